@@ -45,6 +45,7 @@ typedef NS_ENUM(NSInteger, OUTPUT_FORMAT)
 + (void)setLastBackupDir:(NSString *)backupDir;
 + (NSString *)getLastBackupDir;
 + (NSString *)getDefaultBackupDir:(BOOL)checkExistence; // YES
++ (NSString *)getBackupCacheFile;
 
 + (NSInteger)getLastCheckUpdateTime;
 + (void)setLastCheckUpdateTime;
@@ -148,6 +148,24 @@
     return nil;
 }
 
++ (NSString *)getBackupCacheFile
+{
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    NSURL *caches = [fileManager URLForDirectory:NSCachesDirectory inDomain:NSUserDomainMask appropriateForURL:nil create:YES error:nil];
+    if (nil == caches)
+    {
+        return nil;
+    }
+    
+    NSString *cacheDir = [NSString pathWithComponents:@[[caches path], [[NSBundle mainBundle] bundleIdentifier]]];
+    if (![fileManager createDirectoryAtPath:cacheDir withIntermediateDirectories:YES attributes:nil error:nil])
+    {
+        return nil;
+    }
+    
+    return [cacheDir stringByAppendingPathComponent:@"backups.dat"];
+}
+
 + (NSInteger)getLastCheckUpdateTime
 {
     return [[NSUserDefaults standardUserDefaults] integerForKey:@"LastChkUpdateTime"];
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "ExportNotifier.h"
+#include "LoadingNotifier.h"
 #include "ViewController.h"
 
 class ExportNotifierImpl : public ExportNotifier
@@ -94,3 +95,56 @@ public:
 	
 };
 
+@interface ViewController (Loading)
+
+- (void)onUsersLoaded:(const std::vector<Friend>&)users;
+- (void)onSessionsLoaded:(const std::vector<Session>&)sessions ofUserAt:(size_t)userIndex;
+
+@end
+
+class LoadingNotifierImpl : public LoadingNotifier
+{
+protected:
+    __weak ViewController *m_viewController;
+
+public:
+    LoadingNotifierImpl(ViewController* viewController)
+    {
+        m_viewController = viewController;
+    }
+
+    ~LoadingNotifierImpl()
+    {
+        m_viewController = nil;
+    }
+
+    void onUsersLoaded(const std::vector<Friend>& users) const
+    {
+        __block __weak ViewController* viewController = m_viewController;
+        std::vector<Friend> localUsers(users);
+
+        dispatch_async(dispatch_get_main_queue(), ^{
+            __strong __typeof(viewController)strongVC = viewController;
+            if (strongVC)
+            {
+                [strongVC onUsersLoaded:localUsers];
+                strongVC = nil;
+            }
+        });
+    }
+
+    void onSessionsLoaded(size_t userIndex, const std::vector<Session>& sessions, int stage) const
+    {
+        __block __weak ViewController* viewController = m_viewController;
+        std::vector<Session> localSessions(sessions);
+
+        dispatch_async(dispatch_get_main_queue(), ^{
+            __strong __typeof(viewController)strongVC = viewController;
+            if (strongVC)
+            {
+                [strongVC onSessionsLoaded:localSessions ofUserAt:userIndex];
+                strongVC = nil;
+            }
+        });
+    }
+};
@@ -29,13 +29,18 @@ public:
         m_viewController = nil;
     }
     
-    void write(const std::string& log)
+    std::string getTimeString() const
     {
 #if !defined(NDEBUG) || defined(DBG_PERF)
-        std::string timeString = getTimestampString(false, true) + ": ";
+        return getTimestampString(false, true) + ": ";
 #else
-        std::string timeString = getTimestampString() + ": ";
+        return getTimestampString() + ": ";
 #endif
+    }
+    
+    void write(const std::string& log)
+    {
+        std::string timeString = getTimeString();
 
         __block NSString *logString = [NSString stringWithUTF8String:(timeString + log).c_str()];
         __block __weak ViewController* viewController = m_viewController;
@@ -49,6 +54,30 @@ public:
         });
     }
     
+    // One dispatch to the main queue per batch
+    void writeLines(const std::vector<std::string>& logs)
+    {
+        std::string timeString = getTimeString();
+        
+        __block NSMutableArray<NSString *> *logStrings = [NSMutableArray arrayWithCapacity:logs.size()];
+        for (std::vector<std::string>::const_iterator it = logs.cbegin(); it != logs.cend(); ++it)
+        {
+            [logStrings addObject:[NSString stringWithUTF8String:(timeString + *it).c_str()]];
+        }
+        __block __weak ViewController* viewController = m_viewController;
+        dispatch_async(dispatch_get_main_queue(), ^{
+            __strong __typeof(viewController)strongVC = viewController;
+            if (strongVC)
+            {
+                for (NSString *logString in logStrings)
+                {
+                    [strongVC writeLog:logString];
+                }
+                strongVC = nil;
+            }
+        });
+    }
+    
     void debug(const std::string& log)
     {
 #if !defined(NDEBUG) || defined(DBG_PERF)
@@ -58,6 +87,15 @@ public:
 #endif
     }
     
+    bool isDebugging() const
+    {
+#if !defined(NDEBUG) || defined(DBG_PERF)
+        return true;
+#else
+        return false;
+#endif
+    }
+    
 };
 
 #endif /* LoggerImpl_h */
@@ -179,6 +179,7 @@
     if (nil != backupDir)
     {
         ManifestParser parser([backupDir UTF8String]);
+        [self setCacheFileOfParser:parser];
         std::vector<BackupManifest> manifests;
         if (parser.parse(manifests))
         {
@@ -202,6 +203,15 @@
     }
 }
 
+- (void)setCacheFileOfParser:(ManifestParser&)parser
+{
+    NSString *cacheFile = [AppConfiguration getBackupCacheFile];
+    if (nil != cacheFile)
+    {
+        parser.setCacheFile([cacheFile UTF8String]);
+    }
+}
+
 - (void)updateBackups:(const std::vector<BackupManifest>&) manifests withPreviousPath:(NSString *)previousPath
 {
     if (manifests.empty())
@@ -307,12 +317,19 @@
     dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
         
         __strong typeof(weakSelf) strongSelf = weakSelf;  // strong by default
+        // The sessions of the list are replaced on the main thread, after the ones loaded so far
+        std::vector<std::pair<Friend, std::vector<Session>>> *usersAndSessions = new std::vector<std::pair<Friend, std::vector<Session>>>();
         if (nil != strongSelf)
         {
+            LoadingNotifierImpl loadingNotifier(strongSelf);
             Exporter exp([workDir UTF8String], [backupDir UTF8String], "", strongSelf->m_logger, NULL);
             exp.setLanguageCode([[self getCurrentLanguageCode] UTF8String]);
-            exp.loadUsersAndSessions();
-            exp.swapUsersAndSessions(strongSelf->m_usersAndSessions);
+            exp.setLoadingNotifier(&loadingNotifier);
+            if (exp.loadUsersAndSessions())
+            {
+                Exporter::prewarmITunes([backupDir UTF8String]);
+            }
+            exp.swapUsersAndSessions(*usersAndSessions);
         }
         
         // update UI on the main thread
@@ -322,9 +339,11 @@
     #ifndef NDEBUG
                 strongSelf->m_logger->write("Data Loaded.");
     #endif
+                strongSelf->m_usersAndSessions.swap(*usersAndSessions);
                 [strongSelf loadUsers];
                 [strongSelf setUIEnabled:YES withCancellable:NO];
             }
+            delete usersAndSessions;
         });
     });
     
@@ -375,6 +394,7 @@
             NSURL *backupUrl = panel.directoryURL;
             
             ManifestParser parser([backupUrl.path UTF8String]);
+            [self setCacheFileOfParser:parser];
             std::vector<BackupManifest> manifests;
             if (parser.parse(manifests) && !manifests.empty())
             {
@@ -553,6 +573,7 @@
         m_exporter->setLoadingDataOnScroll([AppConfiguration getLoadingDataOnScroll]);
     }
     m_exporter->setIncrementalExporting([AppConfiguration getIncrementalExporting]);
+    m_exporter->setCachingManifest([AppConfiguration getIncrementalExporting]);
     m_exporter->supportsFilter([AppConfiguration getSupportingFilter]);
 
     if (nil != textMode && textMode.boolValue)
@@ -809,3 +830,32 @@
 }
 
 @end
+
+@implementation ViewController (Loading)
+
+- (void)onUsersLoaded:(const std::vector<Friend>&)users
+{
+    m_usersAndSessions.clear();
+    m_usersAndSessions.reserve(users.size());
+    for (std::vector<Friend>::const_iterator it = users.cbegin(); it != users.cend(); ++it)
+    {
+        m_usersAndSessions.push_back(std::pair<Friend, std::vector<Session>>(*it, std::vector<Session>()));
+    }
+    [self loadUsers];
+}
+
+- (void)onSessionsLoaded:(const std::vector<Session>&)sessions ofUserAt:(size_t)userIndex
+{
+    if (userIndex >= m_usersAndSessions.size())
+    {
+        return;
+    }
+    m_usersAndSessions[userIndex].second = sessions;
+    NSInteger indexOfSelectedItem = self.popupUsers.indexOfSelectedItem;
+    if (indexOfSelectedItem != -1)
+    {
+        [self setPopupButton:self.popupUsers selectedItemAt:indexOfSelectedItem];
+    }
+}
+
+@end
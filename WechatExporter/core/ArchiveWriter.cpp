@@ -0,0 +1,232 @@
+//
+//  ArchiveWriter.cpp
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#include "ArchiveWriter.h"
+
+static void bindText(sqlite3_stmt* stmt, int index, const std::string& value)
+{
+    sqlite3_bind_text(stmt, index, value.c_str(), static_cast<int>(value.size()), SQLITE_STATIC);
+}
+
+ArchiveWriter::ArchiveWriter(const std::string& path) : m_path(path), m_db(NULL), m_insertMessage(NULL), m_deleteMedia(NULL), m_insertMedia(NULL)
+{
+}
+
+ArchiveWriter::~ArchiveWriter()
+{
+    close();
+}
+
+bool ArchiveWriter::open()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (NULL != m_db)
+    {
+        return true;
+    }
+    if (sqlite3_open_v2(m_path.c_str(), &m_db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK)
+    {
+        sqlite3_close(m_db);
+        m_db = NULL;
+        return false;
+    }
+
+    // A crash loses the last batches at most, they are exported again from the checkpoint
+    bool result = execute("PRAGMA journal_mode=WAL;PRAGMA synchronous=NORMAL;")
+        && execute("CREATE TABLE IF NOT EXISTS sessions(id INTEGER PRIMARY KEY, usrName TEXT NOT NULL UNIQUE, displayName TEXT, chatroom INTEGER);"
+                   "CREATE TABLE IF NOT EXISTS senders(id INTEGER PRIMARY KEY, usrName TEXT NOT NULL UNIQUE, displayName TEXT);"
+                   "CREATE TABLE IF NOT EXISTS messages(session INTEGER NOT NULL, msgId INTEGER NOT NULL, time INTEGER, type INTEGER, sender INTEGER, outgoing INTEGER, text TEXT, content TEXT, PRIMARY KEY(session, msgId)) WITHOUT ROWID;"
+                   "CREATE TABLE IF NOT EXISTS media(session INTEGER NOT NULL, msgId INTEGER NOT NULL, kind TEXT NOT NULL, path TEXT, PRIMARY KEY(session, msgId, kind)) WITHOUT ROWID;"
+                   "CREATE INDEX IF NOT EXISTS messages_time ON messages(time);");
+    const char* insertMessage = "INSERT OR REPLACE INTO messages(session, msgId, time, type, sender, outgoing, text, content) VALUES(?, ?, ?, ?, ?, ?, ?, ?)";
+    const char* deleteMedia = "DELETE FROM media WHERE session = ? AND msgId = ?";
+    const char* insertMedia = "INSERT OR REPLACE INTO media(session, msgId, kind, path) VALUES(?, ?, ?, ?)";
+    result = result
+        && sqlite3_prepare_v2(m_db, insertMessage, -1, &m_insertMessage, NULL) == SQLITE_OK
+        && sqlite3_prepare_v2(m_db, deleteMedia, -1, &m_deleteMedia, NULL) == SQLITE_OK
+        && sqlite3_prepare_v2(m_db, insertMedia, -1, &m_insertMedia, NULL) == SQLITE_OK;
+    if (!result)
+    {
+        release();
+    }
+    return result;
+}
+
+void ArchiveWriter::close()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    release();
+}
+
+void ArchiveWriter::release()
+{
+    sqlite3_finalize(m_insertMessage);
+    sqlite3_finalize(m_deleteMedia);
+    sqlite3_finalize(m_insertMedia);
+    m_insertMessage = NULL;
+    m_deleteMedia = NULL;
+    m_insertMedia = NULL;
+    if (NULL != m_db)
+    {
+        // The last connection merges the WAL into the file
+        sqlite3_close(m_db);
+        m_db = NULL;
+    }
+    m_senderIds.clear();
+}
+
+int64_t ArchiveWriter::addSession(const std::string& usrName, const std::string& displayName, bool chatroom)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (NULL == m_db)
+    {
+        return 0;
+    }
+    return putName("sessions", usrName, displayName, "chatroom", chatroom ? 1 : 0);
+}
+
+bool ArchiveWriter::addMessages(int64_t sessionId, const std::vector<ArchiveMessage>& messages)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (NULL == m_db || !execute("BEGIN IMMEDIATE;"))
+    {
+        return false;
+    }
+
+    bool result = true;
+    for (std::vector<ArchiveMessage>::const_iterator it = messages.cbegin(); result && it != messages.cend(); ++it)
+    {
+        int64_t senderId = it->sender.empty() ? 0 : getSenderId(it->sender, it->senderName);
+
+        sqlite3_bind_int64(m_insertMessage, 1, sessionId);
+        sqlite3_bind_int64(m_insertMessage, 2, it->msgId);
+        sqlite3_bind_int(m_insertMessage, 3, it->createTime);
+        sqlite3_bind_int(m_insertMessage, 4, it->type);
+        if (senderId > 0)
+        {
+            sqlite3_bind_int64(m_insertMessage, 5, senderId);
+        }
+        else
+        {
+            sqlite3_bind_null(m_insertMessage, 5);
+        }
+        sqlite3_bind_int(m_insertMessage, 6, it->outgoing ? 1 : 0);
+        bindText(m_insertMessage, 7, it->text);
+        if (it->content.empty())
+        {
+            sqlite3_bind_null(m_insertMessage, 8);
+        }
+        else
+        {
+            bindText(m_insertMessage, 8, it->content);
+        }
+        result = sqlite3_step(m_insertMessage) == SQLITE_DONE;
+        sqlite3_reset(m_insertMessage);
+
+        // Media of the message exported before, which may be gone by now
+        sqlite3_bind_int64(m_deleteMedia, 1, sessionId);
+        sqlite3_bind_int64(m_deleteMedia, 2, it->msgId);
+        result = result && sqlite3_step(m_deleteMedia) == SQLITE_DONE;
+        sqlite3_reset(m_deleteMedia);
+
+        for (std::vector<std::pair<std::string, std::string>>::const_iterator itMedia = it->media.cbegin(); result && itMedia != it->media.cend(); ++itMedia)
+        {
+            sqlite3_bind_int64(m_insertMedia, 1, sessionId);
+            sqlite3_bind_int64(m_insertMedia, 2, it->msgId);
+            bindText(m_insertMedia, 3, itMedia->first);
+            bindText(m_insertMedia, 4, itMedia->second);
+            result = sqlite3_step(m_insertMedia) == SQLITE_DONE;
+            sqlite3_reset(m_insertMedia);
+        }
+    }
+    sqlite3_clear_bindings(m_insertMessage);
+    sqlite3_clear_bindings(m_deleteMedia);
+    sqlite3_clear_bindings(m_insertMedia);
+
+    if (result && execute("COMMIT;"))
+    {
+        return true;
+    }
+    execute("ROLLBACK;");
+    // Ids of the senders inserted by the transaction are gone with it
+    m_senderIds.clear();
+    return false;
+}
+
+bool ArchiveWriter::execute(const char* sql)
+{
+    return sqlite3_exec(m_db, sql, NULL, NULL, NULL) == SQLITE_OK;
+}
+
+int64_t ArchiveWriter::putName(const char* table, const std::string& usrName, const std::string& displayName, const char* extraColumn, int extraValue)
+{
+    std::string tableName = table;
+    std::string select = "SELECT id, displayName FROM " + tableName + " WHERE usrName = ?";
+    std::string insert = "INSERT INTO " + tableName + "(usrName, displayName" + (NULL != extraColumn ? std::string(", ") + extraColumn + ") VALUES(?, ?, ?)" : std::string(") VALUES(?, ?)"));
+    std::string update = "UPDATE " + tableName + " SET displayName = ? WHERE id = ?";
+
+    int64_t id = 0;
+    bool renamed = false;
+    sqlite3_stmt* stmt = NULL;
+    if (sqlite3_prepare_v2(m_db, select.c_str(), -1, &stmt, NULL) == SQLITE_OK)
+    {
+        bindText(stmt, 1, usrName);
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            id = sqlite3_column_int64(stmt, 0);
+            const unsigned char* name = sqlite3_column_text(stmt, 1);
+            renamed = !displayName.empty() && (NULL == name || displayName != reinterpret_cast<const char*>(name));
+        }
+    }
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+
+    if (id == 0)
+    {
+        if (sqlite3_prepare_v2(m_db, insert.c_str(), -1, &stmt, NULL) == SQLITE_OK)
+        {
+            bindText(stmt, 1, usrName);
+            bindText(stmt, 2, displayName);
+            if (NULL != extraColumn)
+            {
+                sqlite3_bind_int(stmt, 3, extraValue);
+            }
+            if (sqlite3_step(stmt) == SQLITE_DONE)
+            {
+                id = sqlite3_last_insert_rowid(m_db);
+            }
+        }
+    }
+    else if (renamed)
+    {
+        if (sqlite3_prepare_v2(m_db, update.c_str(), -1, &stmt, NULL) == SQLITE_OK)
+        {
+            bindText(stmt, 1, displayName);
+            sqlite3_bind_int64(stmt, 2, id);
+            sqlite3_step(stmt);
+        }
+    }
+    sqlite3_finalize(stmt);
+    return id;
+}
+
+int64_t ArchiveWriter::getSenderId(const std::string& usrName, const std::string& displayName)
+{
+    // Senders are looked up in the file once an exporting
+    std::map<std::string, int64_t>::const_iterator it = m_senderIds.find(usrName);
+    if (it != m_senderIds.cend())
+    {
+        return it->second;
+    }
+    int64_t id = putName("senders", usrName, displayName, NULL, 0);
+    if (id > 0)
+    {
+        m_senderIds[usrName] = id;
+    }
+    return id;
+}
@@ -0,0 +1,90 @@
+//
+//  ArchiveWriter.h
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#ifndef ArchiveWriter_h
+#define ArchiveWriter_h
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <cstdint>
+#include <sqlite3.h>
+
+// File of the archive in the directory of an account
+#define ARCHIVE_FILE_NAME       "messages.db"
+// Messages of a session written in a transaction
+#define ARCHIVE_BATCH_SIZE      1000
+
+// A parsed message as a row of the archive
+struct ArchiveMessage
+{
+    int64_t msgId;
+    int createTime;
+    int type;
+    bool outgoing;
+    std::string sender;         // usrName
+    std::string senderName;
+    std::string text;           // Plain text, of the text messages and the titles and descriptions of the others
+    std::string content;        // Source of the messages other than text, mostly xml
+    // Kind ("image", "video" and so on) and the path relative to the directory of the account, or the url of a link
+    std::vector<std::pair<std::string, std::string>> media;
+
+    void clear()
+    {
+        sender.clear();
+        senderName.clear();
+        text.clear();
+        content.clear();
+        media.clear();
+    }
+};
+
+// Messages of all sessions of an account in one SQLite file, for the tools instead of the pages:
+//   sessions(id, usrName, displayName, chatroom)
+//   senders(id, usrName, displayName)
+//   messages(session, msgId, time, type, sender, outgoing, text, content)
+//   media(session, msgId, kind, path)
+// Rows are replaced by msgId, so the incremental exporting appends the new messages to the same file.
+// The sessions are written by several workers, each batch takes the connection in turn
+class ArchiveWriter
+{
+public:
+    explicit ArchiveWriter(const std::string& path);
+    ~ArchiveWriter();
+
+    // The file is created with the tables if it doesn't exist
+    bool open();
+    void close();
+
+    // Id of the session for addMessages, 0 on failure
+    int64_t addSession(const std::string& usrName, const std::string& displayName, bool chatroom);
+    // A transaction, either all or none of the messages are written
+    bool addMessages(int64_t sessionId, const std::vector<ArchiveMessage>& messages);
+
+private:
+    ArchiveWriter(const ArchiveWriter&);
+    ArchiveWriter& operator=(const ArchiveWriter&);
+
+    // Of close, with m_mutex held
+    void release();
+    bool execute(const char* sql);
+    // Id of the row of usrName in sessions or senders, it is inserted or its displayName updated
+    int64_t putName(const char* table, const std::string& usrName, const std::string& displayName, const char* extraColumn, int extraValue);
+    int64_t getSenderId(const std::string& usrName, const std::string& displayName);
+
+    std::string m_path;
+    std::mutex m_mutex;
+    sqlite3* m_db;
+    sqlite3_stmt* m_insertMessage;
+    sqlite3_stmt* m_deleteMedia;
+    sqlite3_stmt* m_insertMedia;
+    std::map<std::string, int64_t> m_senderIds;
+};
+
+#endif /* ArchiveWriter_h */
@@ -8,6 +8,8 @@
 
 #include "AsyncExecutor.h"
 #include "Utils.h"
+#include "ExportMetrics.h"
+#include "Tracing.h"
 
 std::atomic_uint32_t AsyncExecutor::m_nextTaskId(1u);
 
@@ -16,109 +18,212 @@ uint32_t AsyncExecutor::genNextTaskId()
     return m_nextTaskId.fetch_add(1);
 }
 
-AsyncExecutor::Thread::Thread(AsyncExecutor *executor) : m_executor(executor),
-      m_thread(new std::thread(&AsyncExecutor::Thread::ThreadFunc, this))
+AsyncExecutor::AsyncExecutor(int max_threads, Callback *callback) :
+    m_callback(callback),
+    m_queueMetric(-1),
+    m_shutdown(false),
+    m_max_threads(max_threads < 1 ? 1 : max_threads),
+    m_nthreads(0),
+    m_sleeping(0),
+    m_started(false),
+    m_numberOfQueued(0),
+    m_threads_waiting(0),
+    m_waking(false),
+    m_nextWorker(0)
 {
+    for (int idx = 0; idx < m_max_threads; ++idx)
+    {
+        m_workers.push_back(new Worker());
+    }
 }
 
-AsyncExecutor::Thread::~Thread()
+AsyncExecutor::~AsyncExecutor()
 {
-    m_thread->join();
-    m_thread.reset();
+    shutdown();
+    for (std::vector<Worker *>::iterator it = m_workers.begin(); it != m_workers.end(); ++it)
+    {
+        if ((*it)->thread.joinable())
+        {
+            (*it)->thread.join();
+        }
+        // Tasks added after the shutdown
+        for (int priority = 0; priority < NUMBER_OF_TASK_PRIORITIES; ++priority)
+        {
+            for (std::deque<Task *>::iterator itTask = (*it)->tasks[priority].begin(); itTask != (*it)->tasks[priority].end(); ++itTask)
+            {
+                delete *itTask;
+            }
+        }
+        delete *it;
+    }
+    m_workers.clear();
 }
 
-void AsyncExecutor::Thread::ThreadFunc()
+void AsyncExecutor::startWorkers()
 {
-#if !defined(NDEBUG) || defined(DBG_PERF)
-    std::string tname = m_executor->m_tag + std::to_string(++m_executor->m_tid);
-    setThreadName(tname.c_str());
-#endif
-    
-    m_executor->ThreadFunc();
-    std::unique_lock<std::mutex> lock(m_executor->m_mutex);
-    m_executor->m_nthreads--;
-    m_executor->m_dead_threads.push_back(this);
-    if ((m_executor->m_shutdown) && (m_executor->m_nthreads == 0))
+    // Started with the first task, after the tag is set
+    for (size_t idx = 0; idx < m_workers.size(); ++idx)
     {
-        m_executor->m_shutdown_cv.notify_one();
+        m_workers[idx]->thread = std::thread(&AsyncExecutor::ThreadFunc, this, idx);
     }
+    m_nthreads = static_cast<int>(m_workers.size());
+    m_started = true;
 }
 
 void AsyncExecutor::addTask(AsyncExecutor::Task* task)
 {
-    std::lock_guard<std::mutex> lock(m_mutex);
-
-    // Add works to the callbacks list
-    m_tasks.push(task);
-
-    // Increase pool size or notify as needed
-    if (m_threads_waiting == 0 && m_nthreads < m_max_threads)
+    bool ownWorker = false;
+    Worker* worker = m_workers[getWorkerForNewTask(ownWorker)];
+    ++m_numberOfQueued;
+    addQueueMetric(1);
     {
-        // Kick off a new thread
-        m_nthreads++;
-        new Thread(this);
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        worker->tasks[task->getPriority()].push_back(task);
     }
-    else
+    notifyWorkers(1, ownWorker);
+}
+
+void AsyncExecutor::addTasks(const std::vector<Task *>& tasks)
+{
+    if (tasks.empty())
     {
-        m_cv.notify_one();
+        return;
     }
-
-    // Also use this chance to harvest dead threads
-    if (!m_dead_threads.empty())
+    bool ownWorker = false;
+    size_t index = getWorkerForNewTask(ownWorker);
+    size_t numberOfTasksPerWorker = (tasks.size() + m_workers.size() - 1) / m_workers.size();
+    // Only the first part goes to the queue of the calling worker
+    ownWorker = ownWorker && numberOfTasksPerWorker >= tasks.size();
+    m_numberOfQueued += tasks.size();
+    addQueueMetric(static_cast<int64_t>(tasks.size()));
+    for (size_t idx = 0; idx < tasks.size(); idx += numberOfTasksPerWorker)
     {
-        DestroyThreads(&m_dead_threads);
+        Worker* worker = m_workers[index];
+        {
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            std::vector<Task *>::const_iterator itEnd = tasks.begin() + std::min(idx + numberOfTasksPerWorker, tasks.size());
+            for (std::vector<Task *>::const_iterator it = tasks.begin() + idx; it != itEnd; ++it)
+            {
+                worker->tasks[(*it)->getPriority()].push_back(*it);
+            }
+        }
+        index = (index + 1) % m_workers.size();
     }
+    notifyWorkers(tasks.size(), ownWorker);
 }
 
-AsyncExecutor::AsyncExecutor(int reserve_threads, int max_threads, Callback *callback) :
-    m_callback(callback),
-    m_shutdown(false),
-    m_reserve_threads(reserve_threads),
-    m_max_threads(max_threads),
-    m_nthreads(0),
-    m_threads_waiting(0)
+size_t AsyncExecutor::getWorkerForNewTask(bool& ownWorker)
 {
-#ifndef NDEBUG
-    m_tid = 0;
-#endif
-    /*
-    for (int i = 0; i < m_reserve_threads; i++)
+    std::thread::id threadId = std::this_thread::get_id();
+    // The threads of the workers are assigned before m_started is set
+    for (size_t idx = 0; m_started && idx < m_workers.size(); ++idx)
     {
-        std::lock_guard<std::mutex> lock(m_mutex);
-        m_nthreads++;
-        new Thread(this);
+        if (m_workers[idx]->thread.get_id() == threadId)
+        {
+            ownWorker = true;
+            return idx;
+        }
     }
-     */
+    ownWorker = false;
+    return m_nextWorker.fetch_add(1) % m_workers.size();
 }
 
-AsyncExecutor::~AsyncExecutor()
+void AsyncExecutor::notifyWorkers(size_t numberOfTasks, bool ownWorker)
 {
-    std::unique_lock<std::mutex> lock(m_mutex);
-    m_shutdown = true;
-    m_cv.notify_all();
-
-    while (m_nthreads != 0)
+    if (!m_started)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_started)
+        {
+            startWorkers();
+        }
+    }
+    
+    // Idle workers sleep on m_mutex. Tasks in the queue of the calling worker are taken by it, or by the other busy
+    // ones before they sleep, so m_mutex is skipped while the busy ones are enough for the queued tasks.
+    // Tasks in the queue of another worker may wait behind a long task of it (a pdf, a copy or a transcoding)
+    // and no busy worker may get to them, an idle one is woken up to steal them
+    int waiting = m_threads_waiting;
+    if (waiting == 0 || m_numberOfQueued == 0 || (ownWorker && m_numberOfQueued <= static_cast<size_t>(m_max_threads - waiting)))
     {
-        m_shutdown_cv.wait(lock);
+        return;
     }
-
-    DestroyThreads(&m_dead_threads);
+    if (numberOfTasks > 1)
+    {
+        {
+            // A worker about to sleep has checked the queued tasks, it is waiting once the lock is released
+            std::lock_guard<std::mutex> lock(m_mutex);
+        }
+        m_cv.notify_all();
+        return;
+    }
+    
+    // One worker is woken up at a time, it wakes up the next one if there are still more tasks,
+    // so a burst of tasks doesn't switch to a worker for every one of them
+    bool expected = false;
+    if (!m_waking.compare_exchange_strong(expected, true))
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_sleeping == 0)
+    {
+        // The ones about to sleep see the tasks
+        m_waking = false;
+        return;
+    }
+    m_cv.notify_one();
 }
 
-void AsyncExecutor::DestroyThreads(std::list<Thread*> *threads)
+bool AsyncExecutor::popTask(size_t index, Task*& task)
 {
-    for (auto it = threads->begin(); it != threads->end(); it = threads->erase(it))
+    Worker* worker = m_workers[index];
+    for (int priority = 0; priority < NUMBER_OF_TASK_PRIORITIES; ++priority)
     {
-        delete *it;
+        // Own tasks from the front, in the order they are added
+        {
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            std::deque<Task *>& tasks = worker->tasks[priority];
+            if (!tasks.empty())
+            {
+                task = tasks.front();
+                tasks.pop_front();
+                --m_numberOfQueued;
+                addQueueMetric(-1);
+                return true;
+            }
+        }
+        
+        // Steals from the back of the others, where the owner doesn't get to soon
+        for (size_t idx = 1; idx < m_workers.size(); ++idx)
+        {
+            Worker* victim = m_workers[(index + idx) % m_workers.size()];
+            std::lock_guard<std::mutex> lock(victim->mutex);
+            std::deque<Task *>& tasks = victim->tasks[priority];
+            if (!tasks.empty())
+            {
+                task = tasks.back();
+                tasks.pop_back();
+                --m_numberOfQueued;
+                addQueueMetric(-1);
+                return true;
+            }
+        }
     }
+    return false;
 }
 
 size_t AsyncExecutor::getNumberOfQueue() const
 {
-    std::unique_lock<std::mutex> lock(m_mutex);
-    size_t size = m_tasks.size();
-    
-    return size;
+    return m_numberOfQueued;
+}
+
+void AsyncExecutor::addQueueMetric(int64_t delta)
+{
+    if (m_queueMetric >= 0)
+    {
+        addExportMetric(m_queueMetric, delta);
+    }
 }
 
 void AsyncExecutor::shutdown()
@@ -153,62 +258,92 @@ bool AsyncExecutor::waitForCompltion(unsigned int ms)
 
 void AsyncExecutor::cancel()
 {
-    std::queue<Task *> tasks;
+    std::vector<Task *> tasks;
     {
         std::unique_lock<std::mutex> lock(m_mutex);
-        tasks.swap(m_tasks);
-		m_shutdown = true;
-		m_cv.notify_all();
+        m_shutdown = true;
+        m_cv.notify_all();
     }
     
-    while (!tasks.empty())
+    for (std::vector<Worker *>::iterator it = m_workers.begin(); it != m_workers.end(); ++it)
     {
-        auto task = tasks.front();
-        tasks.pop();
-        delete task;
+        std::lock_guard<std::mutex> lock((*it)->mutex);
+        for (int priority = 0; priority < NUMBER_OF_TASK_PRIORITIES; ++priority)
+        {
+            tasks.insert(tasks.end(), (*it)->tasks[priority].begin(), (*it)->tasks[priority].end());
+            m_numberOfQueued -= (*it)->tasks[priority].size();
+            addQueueMetric(-static_cast<int64_t>((*it)->tasks[priority].size()));
+            (*it)->tasks[priority].clear();
+        }
+    }
+    
+    for (std::vector<Task *>::iterator it = tasks.begin(); it != tasks.end(); ++it)
+    {
+        delete *it;
     }
 }
 
-void AsyncExecutor::ThreadFunc()
+void AsyncExecutor::ThreadFunc(size_t index)
 {
+    std::string tname = m_tag + std::to_string(index + 1);
+    setThreadName(tname.c_str());
+    
     for (;;)
     {
-        std::unique_lock<std::mutex> lock(m_mutex);
-
-        // Wait until work is available or we are shutting down.
-        if (!m_shutdown && m_tasks.empty())
+        Task* task = NULL;
+        if (popTask(index, task))
         {
-            // If there are too many threads waiting, then quit this thread
-            if (m_threads_waiting >= m_reserve_threads)
-            {
-                break;
-            }
-
-            m_threads_waiting++;
-            m_cv.wait(lock);
-            m_threads_waiting--;
-        }
-        
-        // Drain callbacks before considering shutdown to ensure all work gets completed.
-        if (!m_tasks.empty())
-        {
-            auto task = m_tasks.front();
-            m_tasks.pop();
-            lock.unlock();
             if (NULL != m_callback)
             {
                 m_callback->onTaskStart(this, task);
             }
-            bool succeeded = task->run();
+            bool succeeded = false;
+            {
+                TraceSpan span("executor", "task", "type", task->getType());
+                succeeded = task->run();
+            }
             if (NULL != m_callback)
             {
                 m_callback->onTaskComplete(this, task, succeeded);
             }
             delete task;
+            continue;
         }
-        else if (m_shutdown)
+        
+        std::unique_lock<std::mutex> lock(m_mutex);
+        ++m_threads_waiting;
+        // Wait until work is available or we are shutting down.
+        bool woken = false;
+        if (!m_shutdown && m_numberOfQueued == 0)
+        {
+            TraceSpan span("executor", "wait");
+            while (!m_shutdown && m_numberOfQueued == 0)
+            {
+                ++m_sleeping;
+                m_cv.wait(lock);
+                --m_sleeping;
+                m_waking = false;
+                woken = true;
+            }
+        }
+        --m_threads_waiting;
+        // Drain tasks before considering shutdown to ensure all work gets completed.
+        if (m_shutdown && m_numberOfQueued == 0)
         {
             break;
         }
+        lock.unlock();
+        if (woken)
+        {
+            // The next one is woken up if this one isn't enough, it takes a task as the calling worker does
+            notifyWorkers(1, true);
+        }
+    }
+    
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_nthreads--;
+    if ((m_shutdown) && (m_nthreads == 0))
+    {
+        m_shutdown_cv.notify_all();
     }
 }
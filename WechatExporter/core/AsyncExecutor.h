@@ -13,8 +13,15 @@
 #include <mutex>
 #include <atomic>
 #include <thread>
-#include <queue>
-#include <list>
+#include <deque>
+#include <vector>
+#include <string>
+
+// Priorities of the tasks, the queued tasks of a higher one (smaller value) run first
+#define TASK_PRIORITY_HIGH      0
+#define TASK_PRIORITY_NORMAL    1
+#define TASK_PRIORITY_LOW       2
+#define NUMBER_OF_TASK_PRIORITIES   3
 
 class AsyncExecutor
 {
@@ -38,7 +45,7 @@ public:
             return "";
         }
 
-        Task() : m_taskId(0u), m_userData(NULL)
+        Task() : m_taskId(0u), m_userData(NULL), m_priority(TASK_PRIORITY_NORMAL)
         {
         }
         virtual ~Task() {}
@@ -63,9 +70,21 @@ public:
             m_userData = userData;
         }
         
+        int getPriority() const
+        {
+            return m_priority;
+        }
+        
+        // Takes effect when the task is added
+        void setPriority(int priority)
+        {
+            m_priority = (priority < TASK_PRIORITY_HIGH) ? TASK_PRIORITY_HIGH : ((priority > TASK_PRIORITY_LOW) ? TASK_PRIORITY_LOW : priority);
+        }
+        
     private:
         uint32_t        m_taskId;
         const void*     m_userData;
+        int             m_priority;
     };
     
     class Callback
@@ -76,63 +95,73 @@ public:
         virtual ~Callback() {}
     };
     
-protected:
-    class Thread
-    {
-    public:
-        Thread(AsyncExecutor* executor);
-        ~Thread();
-    private:
-        AsyncExecutor* m_executor;
-        std::unique_ptr<std::thread> m_thread;
-        void ThreadFunc();
-        
-    };
-
 public:
-    explicit AsyncExecutor(int reserve_threads, int max_threads, Callback *callback);
+    // max_threads workers are started with the first task and live until the executor is shut down
+    explicit AsyncExecutor(int max_threads, Callback *callback);
     ~AsyncExecutor();
 
     static uint32_t genNextTaskId();
     void addTask(Task *task);
+    // Tasks are spread over the workers, which are woken up once
+    void addTasks(const std::vector<Task *>& tasks);
     
     size_t getNumberOfQueue() const;
+    // The queued tasks are counted in the export metric as well, for the telemetry
+    void setQueueMetric(int metric)
+    {
+        m_queueMetric = metric;
+    }
     void shutdown();
     void cancel();
     // true: completed, false: timeout
     bool waitForCompltion(unsigned int ms);
     
-#if !defined(NDEBUG) || defined(DBG_PERF)
+    // Prefix of the names of the threads, which also name the threads of the traces
     void setTag(const std::string& tag)
     {
         m_tag = tag;
     }
-#endif
 
 protected:
+    // Each worker has its own queues, one for each priority, an idle one steals the tasks from the others,
+    // so the workers only contend for a queue when one of them runs dry
+    struct Worker
+    {
+        std::mutex mutex;
+        std::deque<Task *> tasks[NUMBER_OF_TASK_PRIORITIES];
+        std::thread thread;
+    };
     
     Callback* m_callback;
-#if !defined(NDEBUG) || defined(DBG_PERF)
     std::string m_tag;
-    uint32_t m_tid;
-#endif
+    int m_queueMetric;  // -1 if the queue isn't in the export metrics
     
+    // Guards the state of the workers and the sleeping of idle workers, not the queues
     mutable std::mutex m_mutex;
     std::condition_variable m_cv;
     std::condition_variable m_shutdown_cv;
     bool m_shutdown;
-    std::queue<Task *> m_tasks;
-    int m_reserve_threads;
     int m_max_threads;
     int m_nthreads;
-
-    int m_threads_waiting;
-    std::list<Thread*> m_dead_threads;
+    int m_sleeping;     // Workers in m_cv.wait
+    std::vector<Worker *> m_workers;
+    
+    std::atomic<bool> m_started;
+    std::atomic<size_t> m_numberOfQueued;   // Counted before the tasks are in the queues
+    std::atomic<int> m_threads_waiting;
+    std::atomic<bool> m_waking;     // A worker is notified and hasn't woken up yet
+    std::atomic<unsigned int> m_nextWorker;  // Round robin of the tasks added by other threads
     
     static std::atomic_uint32_t m_nextTaskId;
 
-    void ThreadFunc();
-    static void DestroyThreads(std::list<Thread*>* m_threads);
+    void startWorkers();
+    void ThreadFunc(size_t index);
+    // Queue of the calling worker (ownWorker), a task adding more tasks keeps them close
+    size_t getWorkerForNewTask(bool& ownWorker);
+    // Tasks of a higher priority, of any worker, are taken before the ones of a lower priority
+    bool popTask(size_t index, Task*& task);
+    void addQueueMetric(int64_t delta);
+    void notifyWorkers(size_t numberOfTasks, bool ownWorker);
     
 };
 
@@ -0,0 +1,258 @@
+//
+//  AsyncLogger.cpp
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#include "AsyncLogger.h"
+#include "Utils.h"
+
+AsyncLogger::AsyncLogger(Logger* sink, size_t capacity/* = ASYNC_LOGGER_CAPACITY*/) : m_sink(sink), m_debugging(sink->isDebugging()), m_mask(0), m_tail(0), m_head(0), m_numberOfPushed(0), m_numberOfFull(0), m_sleeping(false), m_numberOfRepeats(0), m_numberOfWindowLines(0), m_numberOfDropped(0), m_numberOfDelivered(0), m_stopping(false)
+{
+    size_t size = 2;
+    while (size < capacity)
+    {
+        size <<= 1;
+    }
+    m_mask = size - 1;
+    m_entries.reset(new Entry[size]);
+    for (size_t idx = 0; idx < size; ++idx)
+    {
+        m_entries[idx].sequence.store(idx, std::memory_order_relaxed);
+        m_entries[idx].debugging = false;
+    }
+    m_batch.reserve(ASYNC_LOGGER_BATCH_SIZE);
+    m_windowTime = std::chrono::steady_clock::now();
+    m_thread = std::thread(&AsyncLogger::run, this);
+}
+
+AsyncLogger::~AsyncLogger()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_cv.notify_one();
+    m_thread.join();
+    m_sink = NULL;
+}
+
+void AsyncLogger::write(const std::string& log)
+{
+    push(false, log);
+}
+
+void AsyncLogger::debug(const std::string& log)
+{
+    if (m_debugging)
+    {
+        push(true, log);
+    }
+}
+
+bool AsyncLogger::isDebugging() const
+{
+    return m_debugging;
+}
+
+void AsyncLogger::flush()
+{
+    uint64_t numberOfPushed = m_numberOfPushed.load();
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv.notify_one();
+    while (m_numberOfDelivered < numberOfPushed && !m_stopping)
+    {
+        m_deliveredCv.wait(lock);
+    }
+}
+
+bool AsyncLogger::push(bool debugging, const std::string& log)
+{
+    Entry* entry = NULL;
+    size_t pos = m_tail.load(std::memory_order_relaxed);
+    while (true)
+    {
+        entry = &m_entries[pos & m_mask];
+        size_t sequence = entry->sequence.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+        if (diff == 0)
+        {
+            if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            // Full, the consumer hasn't read the entry of the previous round yet
+            m_numberOfFull.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        else
+        {
+            pos = m_tail.load(std::memory_order_relaxed);
+        }
+    }
+
+    entry->debugging = debugging;
+    entry->log = log;
+    // Sequentially consistent with the load of m_sleeping, so either the consumer sees the entry or this sees it sleeping
+    entry->sequence.store(pos + 1);
+    m_numberOfPushed.fetch_add(1, std::memory_order_relaxed);
+    if (m_sleeping.load())
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_cv.notify_one();
+    }
+    return true;
+}
+
+bool AsyncLogger::pop(bool& debugging, std::string& log)
+{
+    Entry& entry = m_entries[m_head & m_mask];
+    if (entry.sequence.load(std::memory_order_acquire) != m_head + 1)
+    {
+        return false;
+    }
+    debugging = entry.debugging;
+    log.swap(entry.log);
+    entry.log.clear();
+    entry.sequence.store(m_head + m_mask + 1, std::memory_order_release);
+    ++m_head;
+    return true;
+}
+
+void AsyncLogger::run()
+{
+    setThreadName("logger");
+    bool debugging = false;
+    std::string log;
+    while (true)
+    {
+        uint64_t numberOfPopped = 0;
+        while (numberOfPopped < ASYNC_LOGGER_BATCH_SIZE && pop(debugging, log))
+        {
+            ++numberOfPopped;
+            addLine(debugging, log, std::chrono::steady_clock::now());
+        }
+        if (numberOfPopped < ASYNC_LOGGER_BATCH_SIZE)
+        {
+            // Caught up, the counts aren't held for long without a next line
+            addSummaries(std::chrono::steady_clock::now(), false);
+        }
+        deliverBatch();
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_numberOfDelivered += numberOfPopped;
+        m_deliveredCv.notify_all();
+        if (numberOfPopped == ASYNC_LOGGER_BATCH_SIZE)
+        {
+            continue;
+        }
+
+        m_sleeping.store(true);
+        Entry& entry = m_entries[m_head & m_mask];
+        if (entry.sequence.load() != m_head + 1)
+        {
+            if (m_stopping)
+            {
+                m_sleeping.store(false);
+                break;
+            }
+            m_cv.wait_for(lock, std::chrono::milliseconds(ASYNC_LOGGER_IDLE_TIME));
+        }
+        m_sleeping.store(false);
+    }
+
+    addSummaries(std::chrono::steady_clock::now(), true);
+    deliverBatch();
+}
+
+void AsyncLogger::addLine(bool debugging, std::string& log, std::chrono::steady_clock::time_point now)
+{
+    if (!debugging && !m_lastLog.empty() && log == m_lastLog)
+    {
+        if (0 == m_numberOfRepeats++)
+        {
+            m_repeatTime = now;
+        }
+        return;
+    }
+    addRepeats();
+    m_lastLog.clear();
+
+    if (now - m_windowTime >= std::chrono::seconds(1))
+    {
+        addDropped();
+        m_windowTime = now;
+        m_numberOfWindowLines = 0;
+    }
+    if (m_numberOfWindowLines >= ASYNC_LOGGER_MAX_LINES_PER_SECOND)
+    {
+        ++m_numberOfDropped;
+        return;
+    }
+    ++m_numberOfWindowLines;
+
+    if (debugging)
+    {
+        // Debug lines go on their own, in the order of the lines around them
+        deliverBatch();
+        m_sink->debug(log);
+        return;
+    }
+    m_lastLog = log;
+    m_batch.push_back(std::string());
+    m_batch.back().swap(log);
+}
+
+void AsyncLogger::addRepeats()
+{
+    if (m_numberOfRepeats > 0)
+    {
+        m_batch.push_back(formatString("The last line was repeated %llu times.", static_cast<unsigned long long>(m_numberOfRepeats)));
+        m_numberOfRepeats = 0;
+    }
+}
+
+void AsyncLogger::addDropped()
+{
+    uint64_t numberOfDropped = m_numberOfDropped + m_numberOfFull.exchange(0, std::memory_order_relaxed);
+    if (numberOfDropped > 0)
+    {
+        m_batch.push_back(formatString("%llu log lines were dropped.", static_cast<unsigned long long>(numberOfDropped)));
+    }
+    m_numberOfDropped = 0;
+}
+
+void AsyncLogger::addSummaries(std::chrono::steady_clock::time_point now, bool stopping)
+{
+    // The line being repeated is still coalesced after its count is logged
+    if (m_numberOfRepeats > 0 && (stopping || now - m_repeatTime >= std::chrono::seconds(1)))
+    {
+        addRepeats();
+    }
+    if (stopping || now - m_windowTime >= std::chrono::seconds(1))
+    {
+        addDropped();
+    }
+}
+
+void AsyncLogger::deliverBatch()
+{
+    if (m_batch.empty())
+    {
+        return;
+    }
+    if (m_batch.size() == 1)
+    {
+        m_sink->write(m_batch.front());
+    }
+    else
+    {
+        m_sink->writeLines(m_batch);
+    }
+    m_batch.clear();
+}
@@ -0,0 +1,100 @@
+//
+//  AsyncLogger.h
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#ifndef AsyncLogger_h
+#define AsyncLogger_h
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include "Logger.h"
+
+// Lines held by the ring, a power of 2
+#define ASYNC_LOGGER_CAPACITY               4096
+// Lines handed to the sink at once
+#define ASYNC_LOGGER_BATCH_SIZE             256
+// Lines delivered in a second, the others are dropped and counted
+#define ASYNC_LOGGER_MAX_LINES_PER_SECOND   100
+// Milliseconds the delivering thread sleeps without lines, a wakeup missed by a producer isn't longer than it
+#define ASYNC_LOGGER_IDLE_TIME              50
+
+// Front end of a Logger for the threads of the exporting: write and debug put the line into a lock-free ring
+// of many producers and one consumer and return, a thread of its own hands the lines to the sink in batches,
+// so the sink formats the timestamps and marshals to the UI off the workers.
+// A line same as the previous one is coalesced into a count of the repeats. A storm of lines, e.g. failed
+// downloads, is dropped over ASYNC_LOGGER_MAX_LINES_PER_SECOND or once the ring is full, and the number of
+// the dropped lines is logged in their place. The counts are logged within a second
+class AsyncLogger : public Logger
+{
+public:
+    // sink isn't owned, it is called on the delivering thread only
+    explicit AsyncLogger(Logger* sink, size_t capacity = ASYNC_LOGGER_CAPACITY);
+    // The lines in the ring are delivered
+    ~AsyncLogger();
+
+    void write(const std::string& log);
+    void debug(const std::string& log);
+    bool isDebugging() const;
+    // Blocks until the lines written before it are delivered
+    void flush();
+
+private:
+    AsyncLogger(const AsyncLogger&);
+    AsyncLogger& operator=(const AsyncLogger&);
+
+    struct Entry
+    {
+        std::atomic<size_t> sequence;   // index: ready to be written, index + 1: ready to be read
+        bool debugging;
+        std::string log;
+    };
+
+    bool push(bool debugging, const std::string& log);
+    bool pop(bool& debugging, std::string& log);
+    void run();
+    // The coalescing and dropping, the lines to deliver are added to m_batch
+    void addLine(bool debugging, std::string& log, std::chrono::steady_clock::time_point now);
+    void addRepeats();
+    void addDropped();
+    // Counts of the repeated and dropped lines which are due, all of them while stopping
+    void addSummaries(std::chrono::steady_clock::time_point now, bool stopping);
+    void deliverBatch();
+
+    Logger* m_sink;
+    bool m_debugging;
+    std::unique_ptr<Entry[]> m_entries;
+    size_t m_mask;
+    std::atomic<size_t> m_tail;         // Next entry to write, taken by the producers with CAS
+    size_t m_head;                      // Next entry to read, of the consumer only
+    std::atomic<uint64_t> m_numberOfPushed;
+    std::atomic<uint64_t> m_numberOfFull;   // Lines dropped as the ring was full
+    std::atomic<bool> m_sleeping;
+
+    // Of the delivering thread
+    std::vector<std::string> m_batch;
+    std::string m_lastLog;
+    uint64_t m_numberOfRepeats;
+    std::chrono::steady_clock::time_point m_repeatTime;     // Of the first repeat of the count
+    std::chrono::steady_clock::time_point m_windowTime;
+    uint32_t m_numberOfWindowLines;
+    uint64_t m_numberOfDropped;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::condition_variable m_deliveredCv;
+    uint64_t m_numberOfDelivered;       // Popped lines, the coalesced and dropped ones included
+    bool m_stopping;
+    std::thread m_thread;
+};
+
+#endif /* AsyncLogger_h */
@@ -10,14 +10,17 @@
 #include <curl/curl.h>
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <cassert>
 #ifdef _WIN32
 #include <atlstr.h>
-#ifndef NDEBUG
-#include <cassert>
-#endif
 #endif
 #include "FileSystem.h"
 #include "Utils.h"
+#include "ExportMetrics.h"
+#include "ITunesParser.h"
 
 // #define FAKE_DOWNLOAD
 size_t writeHttpDataToBuffer(void *buffer, size_t size, size_t nmemb, void *user_p)
@@ -136,7 +139,22 @@ size_t writeTaskHttpData(void *buffer, size_t size, size_t nmemb, void *user_p)
     return 0;
 }
 
-DownloadTask::DownloadTask(const std::string &url, const std::string& output, const std::string& defaultFile, time_t mtime, const std::string& name/* = ""*/) : m_url(url), m_output(output), m_default(defaultFile), m_mtime(mtime), m_retries(0), m_name(name)
+size_t writeTaskHttpHeader(char *buffer, size_t size, size_t nitems, void *user_p)
+{
+    DownloadTask *task = reinterpret_cast<DownloadTask *>(user_p);
+    if (NULL != task)
+    {
+        return task->writeHeader(buffer, size, nitems);
+    }
+    
+    return size * nitems;
+}
+
+DownloadTask::DownloadTask(const std::string &url, const std::string& output, const std::string& defaultFile, time_t mtime, const std::string& name/* = ""*/) : m_url(url), m_output(output), m_default(defaultFile), m_mtime(mtime), m_retries(0), m_downloaded(false), m_name(name), m_curl(NULL)
+#ifndef NDEBUG
+    , m_logFile(NULL)
+#endif
+    , m_writer(NULL), m_resumeOffset(0), m_resuming(false), m_headers(NULL), m_random(static_cast<std::minstd_rand::result_type>(std::chrono::steady_clock::now().time_since_epoch().count()))
 {
 #ifndef NDEBUG
     if (m_output.empty())
@@ -146,96 +164,162 @@ DownloadTask::DownloadTask(const std::string &url, const std::string& output, co
 #endif
 }
 
+DownloadTask::~DownloadTask()
+{
+    if (NULL != m_curl)
+    {
+        end(CURLE_ABORTED_BY_CALLBACK);
+    }
+    closeBody(false);
+}
+
 unsigned int DownloadTask::getRetries() const
 {
     return m_retries;
 }
 
-bool DownloadTask::run()
+unsigned int DownloadTask::getRetryDelay()
 {
-    std::string* urls[] = { &m_url, &m_urlBackup };
-    
-    for (int item = 0; item < sizeof(urls) / sizeof(std::string*); ++item)
+    if (m_retries == 0 || m_retries >= m_attempts.size())
     {
-        if (urls[item]->empty())
-        {
-            continue;
-        }
-        for (int idx = 0; idx < DEFAULT_RETRIES; idx++)
-        {
-            if (downloadFile(*urls[item]))
-            {
-                return true;
-            }
-        }
-        
-        if (startsWith(*urls[item], "http://"))
-        {
-            std::string url = *urls[item];
-            url.replace(0, 7, "https://");
-            if (downloadFile(url))
-            {
-                return true;
-            }
-        }
+        return 0;
     }
-    
-    if (!m_default.empty())
+    // Exponential back-off, the jitter spreads the retries of the transfers failed at the same time
+    unsigned int delay = RETRY_DELAY << std::min(m_retries - 1, 16u);
+    if (delay > MAX_RETRY_DELAY)
     {
-        if (copyFile(m_default, m_output))
+        delay = MAX_RETRY_DELAY;
+    }
+    return delay / 2 + static_cast<unsigned int>(m_random() % (delay / 2 + 1));
+}
+
+bool DownloadTask::run()
+{
+    for (CURL* curl = begin(); NULL != curl; curl = begin())
+    {
+        if (end(curl_easy_perform(curl)))
         {
             return true;
         }
-        else
+        unsigned int delay = getRetryDelay();
+        if (delay > 0)
         {
-            m_error += "\r\nFailed to copy default file: " + m_default + " => " + m_output;
+            std::this_thread::sleep_for(std::chrono::milliseconds(delay));
         }
     }
     
-    return false;
+    return fallback();
 }
 
-bool DownloadTask::downloadFile(const std::string& url)
+// Same url with http or https
+static bool isSameResource(const std::string& url1, const std::string& url2)
 {
+    std::string::size_type pos1 = url1.find("://");
+    std::string::size_type pos2 = url2.find("://");
+    pos1 = (pos1 == std::string::npos) ? 0 : (pos1 + 3);
+    pos2 = (pos2 == std::string::npos) ? 0 : (pos2 + 3);
+    return url1.compare(pos1, std::string::npos, url2, pos2, std::string::npos) == 0;
+}
+
+CURL* DownloadTask::begin(CURLSH* share/* = NULL*/)
+{
+    if (m_retries == 0)
+    {
+        std::string* urls[] = { &m_url, &m_urlBackup };
+        for (int item = 0; item < sizeof(urls) / sizeof(std::string*); ++item)
+        {
+            if (urls[item]->empty())
+            {
+                continue;
+            }
+            m_attempts.insert(m_attempts.end(), DEFAULT_RETRIES, *urls[item]);
+            if (startsWith(*urls[item], "http://"))
+            {
+                std::string url = *urls[item];
+                url.replace(0, 7, "https://");
+                m_attempts.push_back(url);
+            }
+        }
+    }
+    if (m_retries >= m_attempts.size())
+    {
+        return NULL;
+    }
+    const std::string& url = m_attempts[m_retries];
     ++m_retries;
+    if (m_retries > 1)
+    {
+        addExportMetric(EXPORT_METRIC_RETRIES, 1);
+    }
     
     m_outputTmp = m_output + ".tmp";
-    deleteFile(m_outputTmp);
+    m_resuming = m_resumeOffset > 0 && isSameResource(url, m_resumeUrl);
+    if (!m_resuming)
+    {
+        closeBody(false);
+    }
+    m_etag.clear();
+    m_lastModified.clear();
 
-    CURLcode res = CURLE_OK;
-    CURL *curl = NULL;
 #ifndef NDEBUG
     std::string logPath = m_output + ".http.log";
     
 #ifdef _WIN32
     CA2W pszW(logPath.c_str(), CP_UTF8);
-    FILE* logFile = _wfopen((LPCWSTR)pszW, L"wb");
+    m_logFile = _wfopen((LPCWSTR)pszW, L"wb");
 #else
-    FILE* logFile = fopen(logPath.c_str(), "wb");
+    m_logFile = fopen(logPath.c_str(), "wb");
 #endif
 #endif
     
     std::string userAgent = m_userAgent.empty() ? "WeChat/7.0.15.33 CFNetwork/978.0.7 Darwin/18.6.0" : m_userAgent;
     
-#ifndef FAKE_DOWNLOAD
     // User-Agent: WeChat/7.0.15.33 CFNetwork/978.0.7 Darwin/18.6.0
-    curl = curl_easy_init();
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_USERAGENT, userAgent.c_str());
-    curl_easy_setopt(curl, CURLOPT_FORBID_REUSE, 1L);
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 60);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &::writeTaskHttpData);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, this);
-    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, true);
-    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
-    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0);
+    m_curl = curl_easy_init();
+    curl_easy_setopt(m_curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(m_curl, CURLOPT_USERAGENT, userAgent.c_str());
+    if (NULL != share)
+    {
+        // DNS and TLS sessions are reused across the downloads
+        curl_easy_setopt(m_curl, CURLOPT_SHARE, share);
+        curl_easy_setopt(m_curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+        curl_easy_setopt(m_curl, CURLOPT_PIPEWAIT, 1L);
+    }
+    else
+    {
+        curl_easy_setopt(m_curl, CURLOPT_FORBID_REUSE, 1L);
+    }
+    // Stalled transfers are dropped instead of the slow ones
+    curl_easy_setopt(m_curl, CURLOPT_CONNECTTIMEOUT, CONNECT_TIMEOUT);
+    curl_easy_setopt(m_curl, CURLOPT_LOW_SPEED_LIMIT, LOW_SPEED_LIMIT);
+    curl_easy_setopt(m_curl, CURLOPT_LOW_SPEED_TIME, LOW_SPEED_TIME);
+    if (m_resuming)
+    {
+        // The server sends the whole file again if it is changed, which CURLOPT_RANGE takes as it is
+        std::string range = std::to_string(m_resumeOffset) + "-";
+        curl_easy_setopt(m_curl, CURLOPT_RANGE, range.c_str());
+        m_headers = curl_slist_append(NULL, ("If-Range: " + m_resumeValidator).c_str());
+        curl_easy_setopt(m_curl, CURLOPT_HTTPHEADER, m_headers);
+    }
+    curl_easy_setopt(m_curl, CURLOPT_WRITEFUNCTION, &::writeTaskHttpData);
+    curl_easy_setopt(m_curl, CURLOPT_WRITEDATA, this);
+    curl_easy_setopt(m_curl, CURLOPT_HEADERFUNCTION, &::writeTaskHttpHeader);
+    curl_easy_setopt(m_curl, CURLOPT_HEADERDATA, this);
+    curl_easy_setopt(m_curl, CURLOPT_PRIVATE, this);
+    curl_easy_setopt(m_curl, CURLOPT_FOLLOWLOCATION, true);
+    curl_easy_setopt(m_curl, CURLOPT_SSL_VERIFYPEER, 0);
+    curl_easy_setopt(m_curl, CURLOPT_SSL_VERIFYHOST, 0);
 #ifndef NDEBUG
-    curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
-    curl_easy_setopt(curl, CURLOPT_STDERR, logFile);
+    curl_easy_setopt(m_curl, CURLOPT_VERBOSE, 1L);
+    curl_easy_setopt(m_curl, CURLOPT_STDERR, m_logFile);
 #endif
+    return m_curl;
+}
 
+bool DownloadTask::end(CURLcode res)
+{
     long httpStatus = 0;
-    res = curl_easy_perform(curl);
+    curl_easy_getinfo(m_curl, CURLINFO_RESPONSE_CODE, &httpStatus);
     if (res != CURLE_OK)
     {
         m_error = "Failed " + m_name + "\r\n";
@@ -247,11 +331,10 @@ bool DownloadTask::downloadFile(const std::string& url)
     }
     else
     {
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpStatus);
         
 #ifndef NDEBUG
         char *lastUrl = NULL;
-        CURLcode res2 = curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &lastUrl);
+        CURLcode res2 = curl_easy_getinfo(m_curl, CURLINFO_EFFECTIVE_URL, &lastUrl);
 
         if((CURLE_OK == res2) && lastUrl && m_url != lastUrl)
         {
@@ -260,29 +343,46 @@ bool DownloadTask::downloadFile(const std::string& url)
         }
 #endif
     }
-    curl_easy_cleanup(curl);
-#endif // no FAKE_DOWNLOAD
+    curl_easy_cleanup(m_curl);
+    m_curl = NULL;
+    if (NULL != m_headers)
+    {
+        curl_slist_free_all(m_headers);
+        m_headers = NULL;
+    }
 
 #ifndef NDEBUG
-    if (NULL != logFile)
+    if (NULL != m_logFile)
     {
-        fclose(logFile);
+        fclose(m_logFile);
+        m_logFile = NULL;
     }
 #endif
     
-    if (res == CURLE_OK && httpStatus == 200)
+    if (res == CURLE_OK && (httpStatus == 200 || (httpStatus == 206 && m_resuming)))
     {
-        ::moveFile(m_outputTmp, m_output);
+        // Renamed into place, a partial file never shows up as the output
+        if (!closeBody(true) || !::moveFile(m_outputTmp, m_output))
+        {
+            m_error = "Failed to write " + m_output + " of " + m_name;
+            closeBody(false);
+            return false;
+        }
         if (m_mtime > 0)
         {
             updateFileTime(m_output, m_mtime);
         }
 #ifndef NDEBUG
-        ::deleteFile(logPath);
+        ::deleteFile(m_output + ".http.log");
 #endif
+        m_downloaded = true;
         return true;
     }
 
+    if (res == CURLE_OK || res == CURLE_ABORTED_BY_CALLBACK || !keepPartialBody(httpStatus))
+    {
+        closeBody(false);
+    }
     if (m_error.empty())
     {
         m_error = "HTTP Status:" + std::to_string(httpStatus);
@@ -290,17 +390,166 @@ bool DownloadTask::downloadFile(const std::string& url)
     return false;
 }
 
+bool DownloadTask::fallback()
+{
+    if (!m_default.empty())
+    {
+        if (copyFile(m_default, m_output))
+        {
+            return true;
+        }
+        else
+        {
+            m_error += "\r\nFailed to copy default file: " + m_default + " => " + m_output;
+        }
+    }
+    
+    return false;
+}
+
 size_t DownloadTask::writeData(void *buffer, size_t size, size_t nmemb)
 {
     size_t bytesToWrite = size * nmemb;
-    if (appendFile(m_outputTmp, reinterpret_cast<const unsigned char *>(buffer), bytesToWrite))
+    const unsigned char* data = reinterpret_cast<const unsigned char *>(buffer);
+    addExportMetric(EXPORT_METRIC_DOWNLOADED_BYTES, static_cast<int64_t>(bytesToWrite));
+    if (m_resuming && NULL == m_writer && NULL != m_curl)
     {
-        return bytesToWrite;
+        long httpStatus = 0;
+        curl_easy_getinfo(m_curl, CURLINFO_RESPONSE_CODE, &httpStatus);
+        if (httpStatus == 206)
+        {
+            // The rest of the partial body
+            m_writer = new FileWriter();
+            if (!m_writer->openAt(m_outputTmp, m_resumeOffset))
+            {
+                return 0;
+            }
+        }
+        else
+        {
+            // Changed on the server, the whole file is sent
+            m_resuming = false;
+            m_resumeOffset = 0;
+        }
     }
-    return 0;
+    if (NULL == m_writer && m_body.empty() && NULL != m_curl)
+    {
+        // First data of the body, the headers are already there
+#if LIBCURL_VERSION_NUM >= 0x073700
+        curl_off_t contentLength = -1;
+        curl_easy_getinfo(m_curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &contentLength);
+        if (contentLength > static_cast<curl_off_t>(MAX_IN_MEMORY_BODY_SIZE))
+#else
+        double contentLength = -1;
+        curl_easy_getinfo(m_curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &contentLength);
+        if (contentLength > static_cast<double>(MAX_IN_MEMORY_BODY_SIZE))
+#endif
+        {
+            m_writer = new FileWriter();
+            if (!m_writer->open(m_outputTmp))
+            {
+                return 0;
+            }
+        }
+        else if (contentLength > 0)
+        {
+            m_body.reserve(static_cast<size_t>(contentLength));
+        }
+    }
+    
+    if (NULL == m_writer)
+    {
+        if (m_body.size() + bytesToWrite <= MAX_IN_MEMORY_BODY_SIZE)
+        {
+            m_body.insert(m_body.end(), data, data + bytesToWrite);
+            return bytesToWrite;
+        }
+        // Larger than expected, it goes to the file from now on
+        m_writer = new FileWriter();
+        if (!m_writer->open(m_outputTmp) || (!m_body.empty() && !m_writer->write(&m_body[0], m_body.size())))
+        {
+            return 0;
+        }
+        std::vector<unsigned char>().swap(m_body);
+    }
+    
+    return m_writer->write(data, bytesToWrite) ? bytesToWrite : 0;
 }
 
-CopyTask::CopyTask(const std::string &src, const std::string& dest, const std::string& name) : m_src(src), m_dest(dest), m_name(name)
+size_t DownloadTask::writeHeader(const char *buffer, size_t size, size_t nitems)
+{
+    size_t length = size * nitems;
+    std::string header(buffer, length);
+    std::string::size_type pos = header.find(':');
+    if (startsWith(header, "HTTP/"))
+    {
+        // Status line of the response, the headers of a redirection are dropped
+        m_etag.clear();
+        m_lastModified.clear();
+    }
+    else if (pos != std::string::npos)
+    {
+        std::string name = header.substr(0, pos);
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        if (name == "etag" || name == "last-modified")
+        {
+            std::string::size_type begin = header.find_first_not_of(" \t", pos + 1);
+            std::string::size_type end = header.find_last_not_of(" \t\r\n");
+            std::string value = (begin == std::string::npos || end < begin) ? std::string() : header.substr(begin, end - begin + 1);
+            (name == "etag" ? m_etag : m_lastModified) = value;
+        }
+    }
+    return length;
+}
+
+bool DownloadTask::closeBody(bool keeping)
+{
+    bool succeeded = true;
+    if (NULL != m_writer)
+    {
+        succeeded = m_writer->close();
+        delete m_writer;
+        m_writer = NULL;
+    }
+    else if (keeping)
+    {
+        succeeded = writeFile(m_outputTmp, m_body.empty() ? NULL : &m_body[0], m_body.size());
+    }
+    std::vector<unsigned char>().swap(m_body);
+    
+    if (!keeping && !m_outputTmp.empty())
+    {
+        deleteFile(m_outputTmp);
+    }
+    m_resumeOffset = 0;
+    m_resumeUrl.clear();
+    m_resumeValidator.clear();
+    return succeeded;
+}
+
+bool DownloadTask::keepPartialBody(long httpStatus)
+{
+    // Only the bodies written to m_outputTmp, a small one is fetched again,
+    // and the validator makes sure the rest of it is of the same file
+    if (NULL == m_writer || (m_etag.empty() && m_lastModified.empty()) || !(httpStatus == 200 || (httpStatus == 206 && m_resuming)))
+    {
+        return false;
+    }
+    bool succeeded = m_writer->close();
+    uint64_t size = m_writer->getSize();
+    delete m_writer;
+    m_writer = NULL;
+    if (!succeeded || size == 0)
+    {
+        return false;
+    }
+    m_resumeOffset = size;
+    m_resumeUrl = m_attempts[m_retries - 1];
+    m_resumeValidator = m_etag.empty() ? m_lastModified : m_etag;
+    return true;
+}
+
+CopyTask::CopyTask(const std::string &src, const std::string& dest, const std::string& name, time_t mtime/* = 0*/) : m_src(src), m_dest(dest), m_name(name), m_mtime(mtime)
 {
 }
 
@@ -308,6 +557,10 @@ bool CopyTask::run()
 {
     if (::copyFile(m_src, m_dest))
     {
+        if (m_mtime > 0)
+        {
+            updateFileTime(m_dest, m_mtime);
+        }
         return true;
     }
     
@@ -327,35 +580,34 @@ bool CopyTask::run()
     return false;
 }
 
-Mp3Task::Mp3Task(const std::string &pcm, const std::string& mp3, unsigned int mtime) : m_pcm(pcm), m_mp3(mp3), m_mtime(mtime)
+BackupCopyTask::BackupCopyTask(const ITunesDb* iTunesDb, const ITunesFile* file, const std::string& dest, const std::string& usrName) : CopyTask("", dest, "CP: " + dest), m_iTunesDb(iTunesDb), m_file(file), m_usrName(usrName)
 {
 }
 
-void Mp3Task::swapBuffer(std::vector<unsigned char>& buffer)
+bool BackupCopyTask::run()
+{
+    // The file is linked to its first copy if there is one
+    if (m_iTunesDb->copyITunesFile(m_file, m_dest))
+    {
+        return true;
+    }
+    m_error = "Failed CP: " + m_iTunesDb->getRealPath(m_file) + " => " + m_dest;
+    return false;
+}
+
+Mp3Task::Mp3Task(const std::string &pcm, const std::string& mp3, unsigned int mtime, const std::string& sourceId/* = ""*/) : m_pcm(pcm), m_mp3(mp3), m_mtime(mtime), m_sourceId(sourceId)
 {
-    m_pcmData.swap(buffer);
 }
 
 bool Mp3Task::run()
 {
-    std::vector<unsigned char> pcmData;
-    if (silkToPcm(m_pcm, pcmData) && !pcmData.empty())
-    {
-        if (pcmToMp3(pcmData, m_mp3))
-        {
-            updateFileTime(m_mp3, m_mtime);
-            // std::this_thread::sleep_for(std::chrono::milliseconds(192));
-            return true;
-        }
-        else
-        {
-            m_error = "Failed pcmToMp3: " + m_pcm + " => " + m_mp3;
-        }
-    }
-    else
+    // Decoded and encoded frame by frame, the memory doesn't grow with the voice
+    if (silkToMp3(m_pcm, m_mp3))
     {
-        m_error = "Failed silkTpPcm: " + m_pcm;
+        updateFileTime(m_mp3, m_mtime);
+        return true;
     }
+    m_error = "Failed silkToMp3: " + m_pcm + " => " + m_mp3;
     return false;
 }
 
@@ -365,5 +617,10 @@ PdfTask::PdfTask(PdfConverter* pdfConveter, const std::string &src, const std::s
 
 bool PdfTask::run()
 {
-    return m_pdfConverter->convert(m_src, m_dest);
+    if (m_pdfConverter->convert(m_src, m_dest))
+    {
+        return true;
+    }
+    m_error = "Failed PDF: " + m_src + " => " + m_dest;
+    return false;
 }
@@ -10,9 +10,16 @@
 #define AsyncTask_h
 
 #include <stdio.h>
+#include <vector>
+#include <random>
+#include <curl/curl.h>
 #include "AsyncExecutor.h"
 #include "PdfConverter.h"
 
+class FileWriter;
+class ITunesDb;
+struct ITunesFile;
+
 #define TASK_TYPE_DOWNLOAD  1
 #define TASK_TYPE_COPY      2
 #define TASK_TYPE_AUDIO     3
@@ -30,14 +37,43 @@ private:
     std::string m_userAgent;
     time_t m_mtime;
     unsigned int m_retries;
+    bool m_downloaded;  // false if the default file is taken
     
     std::string m_name;
     
+    std::vector<std::string> m_attempts;    // Urls of the attempts in order, retries included
+    CURL* m_curl;
+#ifndef NDEBUG
+    FILE* m_logFile;
+#endif
+    // Body of the transfer, kept in memory while it is small, otherwise written to m_outputTmp through m_writer
+    std::vector<unsigned char> m_body;
+    FileWriter* m_writer;
+    // Validators of the response, kept with the file in DownloadCache
+    std::string m_etag;
+    std::string m_lastModified;
+    // Body of a broken transfer kept in m_outputTmp, the next attempt of the same url asks for the rest of it
+    uint64_t m_resumeOffset;
+    std::string m_resumeUrl;
+    std::string m_resumeValidator;  // ETag or Last-Modified of the partial body, sent in If-Range
+    bool m_resuming;    // The attempt is asking for the rest
+    struct curl_slist* m_headers;
+    std::minstd_rand m_random;      // Jitter of the delays of the retries
+    
 public:
     static const unsigned int DEFAULT_RETRIES = 3;
+    static const size_t MAX_IN_MEMORY_BODY_SIZE = 512 * 1024;
+    // A transfer is stalled once it is slower than LOW_SPEED_LIMIT bytes/s for LOW_SPEED_TIME seconds,
+    // there is no limit of the whole transfer so a large file on a slow link still completes
+    static const long CONNECT_TIMEOUT = 20;
+    static const long LOW_SPEED_LIMIT = 1024;
+    static const long LOW_SPEED_TIME = 30;
+    // Milliseconds before the first retry, doubled for each of the next ones
+    static const unsigned int RETRY_DELAY = 500;
+    static const unsigned int MAX_RETRY_DELAY = 8000;
     
     DownloadTask(const std::string &url, const std::string& output, const std::string& defaultFile, time_t mtime, const std::string& name = "");
-    virtual ~DownloadTask() {}
+    virtual ~DownloadTask();
     
     virtual int getType() const
     {
@@ -64,6 +100,29 @@ public:
         return m_output;
     }
     
+    const std::string& getDefaultFile() const
+    {
+        return m_default;
+    }
+    
+    time_t getMtime() const
+    {
+        return m_mtime;
+    }
+    
+    bool isDownloaded() const
+    {
+        return m_downloaded;
+    }
+    const std::string& getETag() const
+    {
+        return m_etag;
+    }
+    const std::string& getLastModified() const
+    {
+        return m_lastModified;
+    }
+    
     bool hasError() const
     {
         return !m_error.empty();
@@ -78,19 +137,38 @@ public:
     static bool httpGet(const std::string& url, const std::vector<std::pair<std::string, std::string>>& headers, long& httpStatus, std::vector<unsigned char>& body);
     
     size_t writeData(void *buffer, size_t size, size_t nmemb);
+    size_t writeHeader(const char *buffer, size_t size, size_t nitems);
     
     unsigned int getRetries() const;
+    // Milliseconds to wait before the next attempt, with jitter, 0 if there is none left
+    unsigned int getRetryDelay();
     
     bool run();
     
-protected:
-    bool downloadFile(const std::string& url);
+    // Steps of run() for DownloadEngine, which performs the transfers without blocking:
+    // begin returns the handle of the next attempt, NULL once there is none left,
+    // end takes the result of the transfer and releases the handle, true if the file is downloaded,
+    // fallback copies the default file after all attempts failed
+    CURL* begin(CURLSH* share = NULL);
+    bool end(CURLcode res);
+    bool fallback();
+    CURL* getHandle() const
+    {
+        return m_curl;
+    }
+    
+private:
+    // Writes the body to m_outputTmp if it is kept, the temporary file is deleted otherwise
+    bool closeBody(bool keeping);
+    // The partial body is kept for the next attempt if it can be resumed
+    bool keepPartialBody(long httpStatus);
 };
 
 class CopyTask : public AsyncExecutor::Task
 {
 public:
-    CopyTask(const std::string &src, const std::string& dest, const std::string& name);
+    // mtime: modified time of dest, 0 keeps the one of the copy
+    CopyTask(const std::string &src, const std::string& dest, const std::string& name, time_t mtime = 0);
     virtual ~CopyTask() {}
     
     virtual int getType() const
@@ -109,22 +187,70 @@ public:
     {
         return m_error;
     }
+    inline std::string getDest() const
+    {
+        return m_dest;
+    }
+    const std::string& getSrc() const
+    {
+        return m_src;
+    }
+    time_t getMtime() const
+    {
+        return m_mtime;
+    }
     
     bool run();
     
-private:
+protected:
     std::string m_src;
     std::string m_dest;
     std::string m_name;
     std::string m_error;
+    time_t m_mtime;
+};
+
+// Copy of a file of the backup, queued by the parsing so it doesn't wait for big videos and attachments
+class BackupCopyTask : public CopyTask
+{
+public:
+    // usrName: account of the task, for the progress of the account
+    BackupCopyTask(const ITunesDb* iTunesDb, const ITunesFile* file, const std::string& dest, const std::string& usrName);
+    virtual ~BackupCopyTask() {}
+    
+    inline const std::string& getUsrName() const
+    {
+        return m_usrName;
+    }
+    
+    bool run();
+    
+private:
+    const ITunesDb* m_iTunesDb;
+    const ITunesFile* m_file;
+    std::string m_usrName;
 };
 
 class Mp3Task : public AsyncExecutor::Task
 {
 public:
-    Mp3Task(const std::string &pcm, const std::string& mp3, unsigned int mtime);
+    // sourceId: fileId of the voice in the backup, for the transcode cache
+    Mp3Task(const std::string &pcm, const std::string& mp3, unsigned int mtime, const std::string& sourceId = "");
     virtual ~Mp3Task() {}
     
+    const std::string& getOutput() const
+    {
+        return m_mp3;
+    }
+    const std::string& getSourceId() const
+    {
+        return m_sourceId;
+    }
+    unsigned int getMtime() const
+    {
+        return m_mtime;
+    }
+    
     virtual int getType() const
     {
         return TASK_TYPE_AUDIO;
@@ -142,17 +268,14 @@ public:
         return m_error;
     }
     
-    void swapBuffer(std::vector<unsigned char>& buffer);
-
     bool run();
     
 private:
-    std::string m_pcm;
+    std::string m_pcm;  // The silk file
     std::string m_mp3;
     unsigned int m_mtime;
+    std::string m_sourceId;
     std::string m_error;
-    
-    std::vector<unsigned char> m_pcmData;
 };
 
 class PdfTask : public AsyncExecutor::Task
@@ -169,6 +292,14 @@ public:
     {
         return "PDF: " + m_src + " => " + m_dest;
     }
+    bool hasError() const
+    {
+        return !m_error.empty();
+    }
+    std::string getError() const
+    {
+        return m_error;
+    }
     
     bool run();
     
@@ -177,6 +308,7 @@ private:
     std::string m_src;
     std::string m_dest;
     std::string m_name;
+    std::string m_error;
 };
 
 #endif /* AsyncTask_h */
@@ -0,0 +1,80 @@
+//
+//  BoundedQueue.h
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/7.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#ifndef BoundedQueue_h
+#define BoundedQueue_h
+
+#include <queue>
+#include <mutex>
+#include <condition_variable>
+
+// FIFO between threads, push blocks while it is full so a fast producer can't run away from its consumers
+// After close, push fails and pop drains what is left
+template <class T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity) : m_capacity(capacity == 0 ? 1 : capacity), m_closed(false)
+    {
+    }
+
+    bool push(const T& item)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (!m_closed && m_items.size() >= m_capacity)
+        {
+            m_notFull.wait(lock);
+        }
+        if (m_closed)
+        {
+            return false;
+        }
+        m_items.push(item);
+        m_notEmpty.notify_one();
+        return true;
+    }
+
+    // Returns false if the queue is closed and empty
+    bool pop(T& item)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (!m_closed && m_items.empty())
+        {
+            m_notEmpty.wait(lock);
+        }
+        if (m_items.empty())
+        {
+            return false;
+        }
+        item = m_items.front();
+        m_items.pop();
+        m_notFull.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed = true;
+        m_notEmpty.notify_all();
+        m_notFull.notify_all();
+    }
+
+private:
+    BoundedQueue(const BoundedQueue&);
+    BoundedQueue& operator=(const BoundedQueue&);
+
+    std::mutex m_mutex;
+    std::condition_variable m_notEmpty;
+    std::condition_variable m_notFull;
+    std::queue<T> m_items;
+    size_t m_capacity;
+    bool m_closed;
+};
+
+#endif /* BoundedQueue_h */
@@ -0,0 +1,519 @@
+//
+//  ChromePdfConverter.cpp
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#include "ChromePdfConverter.h"
+#include <json/json.h>
+#include <chrono>
+#include <thread>
+#ifndef _WIN32
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#endif
+#include "FileSystem.h"
+#include "Utils.h"
+
+#ifndef MSG_NOSIGNAL
+// SO_NOSIGPIPE is set on the socket instead
+#define MSG_NOSIGNAL 0
+#endif
+
+// Without any message from the browser for so long, it's taken as hung. A big session takes minutes to load
+#define CHROME_PDF_TIMEOUT_MS       (10 * 60 * 1000)
+// Bytes of the pdf read from the stream each time, the pdf isn't held in memory as a whole
+#define CHROME_PDF_CHUNK_SIZE       (1024 * 1024)
+// Time for the browser to quit after Browser.close before it's killed
+#define CHROME_PDF_CLOSE_WAIT_MS    5000
+
+static std::string toFileUrl(const std::string& path)
+{
+    std::string url = "file://";
+    std::string::size_type start = 0;
+    while (true)
+    {
+        std::string::size_type pos = path.find('/', start);
+        url += encodeUrl(path.substr(start, pos == std::string::npos ? std::string::npos : pos - start));
+        if (pos == std::string::npos)
+        {
+            break;
+        }
+        url += '/';
+        start = pos + 1;
+    }
+    return url;
+}
+
+// A browser with one page, the DevTools messages are JSON separated by '\0' on fd 3 (to the browser) and fd 4 (from it),
+// both of which are the same socket here
+class ChromePdfConverter::Browser
+{
+public:
+    explicit Browser(const std::string& profileDir) : m_profileDir(profileDir), m_scanned(0), m_nextId(1)
+#ifndef _WIN32
+        , m_pid(-1), m_fd(-1)
+#endif
+    {
+    }
+
+    ~Browser()
+    {
+        close();
+    }
+
+    bool launch(const std::string& browserPath);
+    bool print(const std::string& url, const std::string& pdfPath);
+    void close();
+
+private:
+    Browser(const Browser&);
+    Browser& operator=(const Browser&);
+
+    bool send(const std::string& method, const Json::Value& params, bool toPage, int& id);
+    // Reads the messages until the reply of the command is there, and the event of the page if eventName is not NULL
+    bool call(const std::string& method, const Json::Value& params, bool toPage, Json::Value& result, const char* eventName = NULL);
+    bool readMessage(Json::Value& message);
+
+    std::string m_profileDir;
+    std::string m_sessionId;    // Session of the page, commands of the page are sent to it
+    std::string m_buffer;       // Read but not parsed
+    size_t m_scanned;           // Bytes of m_buffer without '\0'
+    int m_nextId;
+#ifndef _WIN32
+    pid_t m_pid;
+    int m_fd;
+#endif
+};
+
+bool ChromePdfConverter::Browser::launch(const std::string& browserPath)
+{
+#ifdef _WIN32
+    return false;
+#else
+    makeDirectory(m_profileDir);
+    int fds[2] = {-1, -1};
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    {
+        return false;
+    }
+    // Not inherited by the browsers launched later
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+#ifdef SO_NOSIGPIPE
+    int noSigPipe = 1;
+    setsockopt(fds[0], SOL_SOCKET, SO_NOSIGPIPE, &noSigPipe, sizeof(noSigPipe));
+#endif
+
+    std::string profileArg = "--user-data-dir=" + m_profileDir;
+    const char* argv[] = {browserPath.c_str(), "--headless", "--disable-gpu", "--disable-extensions", "--no-first-run", "--no-default-browser-check", "--remote-debugging-pipe", profileArg.c_str(), "about:blank", NULL};
+    int devNull = open("/dev/null", O_RDWR);
+    if (devNull >= 0)
+    {
+        fcntl(devNull, F_SETFD, FD_CLOEXEC);
+    }
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // Only async-signal-safe calls until exec. The socket is moved above 4 first in case it's 3 or 4,
+        // dup2 to the same fd would keep FD_CLOEXEC
+        if (devNull >= 0)
+        {
+            dup2(devNull, 0);
+            dup2(devNull, 1);
+            dup2(devNull, 2);
+        }
+        int fd = fcntl(fds[1], F_DUPFD, 5);
+        if (fd < 0 || dup2(fd, 3) < 0 || dup2(fd, 4) < 0)
+        {
+            _exit(127);
+        }
+        execv(argv[0], const_cast<char * const *>(argv));
+        _exit(127);
+    }
+
+    ::close(fds[1]);
+    if (devNull >= 0)
+    {
+        ::close(devNull);
+    }
+    if (pid < 0)
+    {
+        ::close(fds[0]);
+        return false;
+    }
+    m_pid = pid;
+    m_fd = fds[0];
+
+    Json::Value result;
+    Json::Value params(Json::objectValue);
+    params["url"] = "about:blank";
+    if (!call("Target.createTarget", params, false, result))
+    {
+        return false;
+    }
+    params = Json::Value(Json::objectValue);
+    params["targetId"] = result["targetId"];
+    params["flatten"] = true;
+    if (!call("Target.attachToTarget", params, false, result))
+    {
+        return false;
+    }
+    m_sessionId = result["sessionId"].asString();
+    return call("Page.enable", Json::Value(Json::objectValue), true, result);
+#endif
+}
+
+bool ChromePdfConverter::Browser::print(const std::string& url, const std::string& pdfPath)
+{
+    Json::Value result;
+    Json::Value params(Json::objectValue);
+    params["url"] = url;
+    if (!call("Page.navigate", params, true, result, "Page.loadEventFired") || result.isMember("errorText"))
+    {
+        return false;
+    }
+
+    params = Json::Value(Json::objectValue);
+    params["printBackground"] = true;
+    params["displayHeaderFooter"] = false;
+    params["transferMode"] = "ReturnAsStream";
+    if (!call("Page.printToPDF", params, true, result))
+    {
+        return false;
+    }
+    Json::Value stream = result["stream"];
+
+    FileWriter writer;
+    bool succeeded = writer.open(pdfPath);
+    bool eof = false;
+    std::vector<unsigned char> data;
+    while (succeeded && !eof)
+    {
+        params = Json::Value(Json::objectValue);
+        params["handle"] = stream;
+        params["size"] = CHROME_PDF_CHUNK_SIZE;
+        if (!call("IO.read", params, true, result))
+        {
+            succeeded = false;
+            break;
+        }
+        std::string chunk = result["data"].asString();
+        if (result["base64Encoded"].asBool())
+        {
+            succeeded = decodeBase64(chunk.c_str(), chunk.size(), data) && (data.empty() || writer.write(&data[0], data.size()));
+        }
+        else
+        {
+            succeeded = writer.write(chunk);
+        }
+        eof = result["eof"].asBool();
+    }
+
+    params = Json::Value(Json::objectValue);
+    params["handle"] = stream;
+    call("IO.close", params, true, result);
+
+    succeeded = writer.close() && succeeded;
+    if (!succeeded)
+    {
+        deleteFile(pdfPath);
+    }
+    return succeeded;
+}
+
+void ChromePdfConverter::Browser::close()
+{
+#ifndef _WIN32
+    if (m_fd >= 0)
+    {
+        int id = 0;
+        send("Browser.close", Json::Value(Json::objectValue), false, id);
+        // The browser quits as well when the pipe is closed
+        ::close(m_fd);
+        m_fd = -1;
+    }
+    if (m_pid > 0)
+    {
+        int status = 0;
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(CHROME_PDF_CLOSE_WAIT_MS);
+        while (waitpid(m_pid, &status, WNOHANG) == 0)
+        {
+            if (std::chrono::steady_clock::now() >= deadline)
+            {
+                kill(m_pid, SIGKILL);
+                waitpid(m_pid, &status, 0);
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+        m_pid = -1;
+    }
+#endif
+    if (!m_profileDir.empty() && existsDirectory(m_profileDir))
+    {
+        deleteDirectory(m_profileDir);
+    }
+}
+
+bool ChromePdfConverter::Browser::send(const std::string& method, const Json::Value& params, bool toPage, int& id)
+{
+#ifdef _WIN32
+    return false;
+#else
+    id = m_nextId++;
+    Json::Value message(Json::objectValue);
+    message["id"] = id;
+    message["method"] = method;
+    message["params"] = params;
+    if (toPage)
+    {
+        message["sessionId"] = m_sessionId;
+    }
+    Json::FastWriter jsonWriter;
+    std::string data = jsonWriter.write(message);
+    // FastWriter ends it with a new line
+    if (!data.empty() && data[data.size() - 1] == '\n')
+    {
+        data[data.size() - 1] = '\0';
+    }
+    else
+    {
+        data.push_back('\0');
+    }
+
+    const char* ptr = data.c_str();
+    size_t length = data.size();
+    while (length > 0)
+    {
+        ssize_t bytes = ::send(m_fd, ptr, length, MSG_NOSIGNAL);
+        if (bytes < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        ptr += bytes;
+        length -= static_cast<size_t>(bytes);
+    }
+    return true;
+#endif
+}
+
+bool ChromePdfConverter::Browser::call(const std::string& method, const Json::Value& params, bool toPage, Json::Value& result, const char* eventName/* = NULL*/)
+{
+    int id = 0;
+    if (!send(method, params, toPage, id))
+    {
+        return false;
+    }
+
+    bool replied = false;
+    bool eventFired = (NULL == eventName);
+    while (!replied || !eventFired)
+    {
+        Json::Value message;
+        if (!readMessage(message))
+        {
+            return false;
+        }
+        if (!message.isObject())
+        {
+            continue;
+        }
+        if (message.isMember("id"))
+        {
+            if (message["id"].asInt() == id)
+            {
+                if (message.isMember("error"))
+                {
+                    return false;
+                }
+                result = message["result"];
+                replied = true;
+            }
+        }
+        else if (!eventFired && message["method"].asString() == eventName && message["sessionId"].asString() == m_sessionId)
+        {
+            eventFired = true;
+        }
+    }
+    return true;
+}
+
+bool ChromePdfConverter::Browser::readMessage(Json::Value& message)
+{
+#ifdef _WIN32
+    return false;
+#else
+    while (true)
+    {
+        std::string::size_type pos = m_buffer.find('\0', m_scanned);
+        if (pos != std::string::npos)
+        {
+            Json::Reader reader;
+            bool parsed = reader.parse(m_buffer.c_str(), m_buffer.c_str() + pos, message, false);
+            m_buffer.erase(0, pos + 1);
+            m_scanned = 0;
+            if (parsed)
+            {
+                return true;
+            }
+            continue;
+        }
+        m_scanned = m_buffer.size();
+
+        struct pollfd pfd;
+        pfd.fd = m_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        int ret = poll(&pfd, 1, CHROME_PDF_TIMEOUT_MS);
+        if (ret < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ret <= 0)
+        {
+            return false;
+        }
+        char buffer[64 * 1024];
+        ssize_t bytes = recv(m_fd, buffer, sizeof(buffer), 0);
+        if (bytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes <= 0)
+        {
+            // The browser is gone
+            return false;
+        }
+        m_buffer.append(buffer, static_cast<size_t>(bytes));
+    }
+#endif
+}
+
+ChromePdfConverter::ChromePdfConverter(const std::string& browserPath, const std::string& outputDir, unsigned int numberOfBrowsers) : m_browserPath(browserPath), m_outputDir(outputDir), m_maxBrowsers(numberOfBrowsers == 0 ? 1 : numberOfBrowsers), m_numberOfBrowsers(0), m_nextProfile(0)
+{
+}
+
+ChromePdfConverter::~ChromePdfConverter()
+{
+    closeBrowsers();
+    std::string profilesDir = combinePath(m_outputDir, ".chrome");
+    if (existsDirectory(profilesDir))
+    {
+        deleteDirectory(profilesDir);
+    }
+}
+
+bool ChromePdfConverter::isSupported() const
+{
+#ifdef _WIN32
+    return false;
+#else
+    return !m_browserPath.empty() && existsFile(m_browserPath);
+#endif
+}
+
+bool ChromePdfConverter::makeUserDirectory(const std::string& dirName)
+{
+    std::string pdfDir = combinePath(m_outputDir, "pdf");
+    if (!existsDirectory(pdfDir) && !makeDirectory(pdfDir))
+    {
+        return false;
+    }
+    std::string userDir = combinePath(pdfDir, dirName);
+    return existsDirectory(userDir) || makeDirectory(userDir);
+}
+
+bool ChromePdfConverter::convert(const std::string& htmlPath, const std::string& pdfPath)
+{
+    Browser* browser = acquireBrowser();
+    if (NULL == browser)
+    {
+        return false;
+    }
+    bool result = browser->print(toFileUrl(htmlPath), pdfPath);
+    // A browser failing to print is not trusted any more, the next conversion launches a new one
+    releaseBrowser(browser, !result);
+    return result;
+}
+
+void ChromePdfConverter::closeBrowsers()
+{
+    std::vector<Browser *> browsers;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        browsers.swap(m_idleBrowsers);
+        m_numberOfBrowsers -= static_cast<unsigned int>(browsers.size());
+    }
+    for (std::vector<Browser *>::iterator it = browsers.begin(); it != browsers.end(); ++it)
+    {
+        delete *it;
+    }
+    m_cv.notify_all();
+}
+
+ChromePdfConverter::Browser* ChromePdfConverter::acquireBrowser()
+{
+    unsigned int profile = 0;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (m_idleBrowsers.empty() && m_numberOfBrowsers >= m_maxBrowsers)
+        {
+            m_cv.wait(lock);
+        }
+        if (!m_idleBrowsers.empty())
+        {
+            Browser* browser = m_idleBrowsers.back();
+            m_idleBrowsers.pop_back();
+            return browser;
+        }
+        ++m_numberOfBrowsers;
+        profile = m_nextProfile++;
+    }
+
+    // Launched out of the lock, it takes a while
+    Browser* browser = new Browser(combinePath(m_outputDir, ".chrome", std::to_string(profile)));
+    if (browser->launch(m_browserPath))
+    {
+        return browser;
+    }
+    delete browser;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        --m_numberOfBrowsers;
+    }
+    m_cv.notify_one();
+    return NULL;
+}
+
+void ChromePdfConverter::releaseBrowser(Browser* browser, bool failed)
+{
+    if (failed)
+    {
+        delete browser;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (failed)
+        {
+            --m_numberOfBrowsers;
+        }
+        else
+        {
+            m_idleBrowsers.push_back(browser);
+        }
+    }
+    m_cv.notify_one();
+}
@@ -0,0 +1,64 @@
+//
+//  ChromePdfConverter.h
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#ifndef ChromePdfConverter_h
+#define ChromePdfConverter_h
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include "PdfConverter.h"
+
+// Prints the sessions with a few headless Chrome (or Edge) instances kept running for the whole exporting,
+// driven by the DevTools protocol over --remote-debugging-pipe: Page.navigate and Page.printToPDF, with the pdf
+// streamed back in chunks. The conversions run on the threads of the task manager, each of them takes a browser
+// from the pool, so there is no cold start of the browser for every session.
+// Launching the browser is implemented for macOS and Linux, on Windows isSupported is false
+class ChromePdfConverter : public PdfConverter
+{
+public:
+    // outputDir: pdf files go to outputDir/pdf, the profiles of the browsers are in outputDir/.chrome until it's destroyed
+    ChromePdfConverter(const std::string& browserPath, const std::string& outputDir, unsigned int numberOfBrowsers);
+    ~ChromePdfConverter();
+
+    bool isSupported() const;
+
+    bool makeUserDirectory(const std::string& dirName);
+    bool convert(const std::string& htmlPath, const std::string& pdfPath);
+    unsigned int getConcurrency() const
+    {
+        return m_maxBrowsers;
+    }
+
+    // Closes the browsers, they are launched again by the next convert
+    void closeBrowsers();
+
+private:
+    ChromePdfConverter(const ChromePdfConverter&);
+    ChromePdfConverter& operator=(const ChromePdfConverter&);
+
+    class Browser;
+
+    // A browser not used by other threads, launched if there are less than m_maxBrowsers, NULL if it fails to launch
+    Browser* acquireBrowser();
+    // failed: the browser is closed instead of being put back in the pool
+    void releaseBrowser(Browser* browser, bool failed);
+
+    std::string m_browserPath;
+    std::string m_outputDir;
+    unsigned int m_maxBrowsers;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::vector<Browser *> m_idleBrowsers;
+    unsigned int m_numberOfBrowsers;     // Idle and in use
+    unsigned int m_nextProfile;
+};
+
+#endif /* ChromePdfConverter_h */
@@ -0,0 +1,86 @@
+//
+//  CompiledTemplate.cpp
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/5.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#include "CompiledTemplate.h"
+#include "MessageParser.h"
+
+CompiledTemplate::CompiledTemplate() : m_literalLength(0)
+{
+}
+
+CompiledTemplate::CompiledTemplate(const std::string& text) : m_literalLength(0)
+{
+    compile(text);
+}
+
+void CompiledTemplate::compile(const std::string& text)
+{
+    m_text = text;
+    m_segments.clear();
+    m_literalLength = 0;
+    
+    std::string::size_type start = 0;
+    std::string::size_type pos = 0;
+    while ((pos = m_text.find("%%", start)) != std::string::npos)
+    {
+        std::string::size_type posEnd = m_text.find("%%", pos + 2);
+        if (posEnd == std::string::npos)
+        {
+            break;
+        }
+        
+        if (pos > start)
+        {
+            Segment literal = { start, pos - start, -1 };
+            m_segments.push_back(literal);
+            m_literalLength += literal.length;
+        }
+        
+        // An unknown key never has a value, so it is left out
+        int slot = TemplateValues::findSlot(m_text.substr(pos, posEnd + 2 - pos));
+        if (slot >= 0)
+        {
+            Segment segment = { pos, posEnd + 2 - pos, slot };
+            m_segments.push_back(segment);
+        }
+        
+        start = posEnd + 2;
+    }
+    
+    if (start < m_text.size())
+    {
+        Segment literal = { start, m_text.size() - start, -1 };
+        m_segments.push_back(literal);
+        m_literalLength += literal.length;
+    }
+}
+
+void CompiledTemplate::render(const TemplateValues& tv, std::string& output) const
+{
+    size_t length = m_literalLength;
+    for (std::vector<Segment>::const_iterator it = m_segments.cbegin(); it != m_segments.cend(); ++it)
+    {
+        if (it->slot >= 0)
+        {
+            length += tv.get(static_cast<TemplateValueSlot>(it->slot)).size();
+        }
+    }
+    
+    output.reserve(output.size() + length);
+    for (std::vector<Segment>::const_iterator it = m_segments.cbegin(); it != m_segments.cend(); ++it)
+    {
+        if (it->slot < 0)
+        {
+            output.append(m_text, it->offset, it->length);
+        }
+        else
+        {
+            output.append(tv.get(static_cast<TemplateValueSlot>(it->slot)));
+        }
+    }
+}
@@ -0,0 +1,47 @@
+//
+//  CompiledTemplate.h
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/5.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#ifndef CompiledTemplate_h
+#define CompiledTemplate_h
+
+#include <string>
+#include <vector>
+
+class TemplateValues;
+
+// Template text split into literal segments and TemplateValues slots once, so a message is rendered in one pass
+class CompiledTemplate
+{
+public:
+    CompiledTemplate();
+    explicit CompiledTemplate(const std::string& text);
+    
+    void compile(const std::string& text);
+    
+    const std::string& getText() const
+    {
+        return m_text;
+    }
+    
+    // Appends the template to output with each %%KEY%% replaced by its slot in tv, unknown keys are dropped
+    void render(const TemplateValues& tv, std::string& output) const;
+    
+private:
+    struct Segment
+    {
+        size_t offset;
+        size_t length;
+        int slot;   // TemplateValueSlot, -1 for the literal text at offset
+    };
+    
+    std::string m_text;
+    std::vector<Segment> m_segments;
+    size_t m_literalLength;
+};
+
+#endif /* CompiledTemplate_h */
@@ -0,0 +1,213 @@
+//
+//  DownloadCache.cpp
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#include "DownloadCache.h"
+#include <vector>
+#include <algorithm>
+#include <cctype>
+#include <json/json.h>
+#include "FileSystem.h"
+#include "Utils.h"
+
+#define DOWNLOAD_CACHE_INDEX_FILE   "index.dat"
+
+DownloadCache::DownloadCache(const std::string& cacheDir, uint64_t maxSize) : m_cacheDir(cacheDir), m_maxSize(maxSize), m_size(0), m_ticks(0), m_modified(false)
+{
+}
+
+bool DownloadCache::load()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_entries.clear();
+    m_size = 0;
+    m_ticks = 0;
+    m_modified = false;
+    if (!existsDirectory(m_cacheDir) && !makeDirectory(m_cacheDir))
+    {
+        return false;
+    }
+
+    std::string contents = readFile(combinePath(m_cacheDir, DOWNLOAD_CACHE_INDEX_FILE));
+    Json::Reader reader;
+    Json::Value cacheObj;
+    if (contents.empty() || !reader.parse(contents, cacheObj) || !cacheObj.isObject() || !cacheObj["entries"].isArray())
+    {
+        return true;
+    }
+
+    m_ticks = cacheObj["ticks"].asUInt64();
+    const Json::Value& entryItems = cacheObj["entries"];
+    for (Json::ArrayIndex idx = 0; idx < entryItems.size(); idx++)
+    {
+        const Json::Value& entryObj = entryItems[idx];
+        if (!entryObj.isObject() || !entryObj.isMember("url") || !entryObj.isMember("file") || !entryObj.isMember("size"))
+        {
+            continue;
+        }
+        Entry entry;
+        entry.fileName = entryObj["file"].asString();
+        entry.size = entryObj["size"].asUInt64();
+        entry.etag = entryObj["etag"].asString();
+        entry.lastModified = entryObj["lastModified"].asString();
+        entry.lastAccess = entryObj["access"].asUInt64();
+        m_entries[entryObj["url"].asString()] = entry;
+        m_size += entry.size;
+    }
+
+    return true;
+}
+
+bool DownloadCache::save()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_modified)
+    {
+        return true;
+    }
+
+    Json::Value entryItems(Json::arrayValue);
+    for (std::map<std::string, Entry>::const_iterator it = m_entries.cbegin(); it != m_entries.cend(); ++it)
+    {
+        Json::Value entryObj(Json::objectValue);
+        entryObj["url"] = Json::Value(it->first);
+        entryObj["file"] = Json::Value(it->second.fileName);
+        entryObj["size"] = Json::Value(static_cast<Json::UInt64>(it->second.size));
+        if (!it->second.etag.empty())
+        {
+            entryObj["etag"] = Json::Value(it->second.etag);
+        }
+        if (!it->second.lastModified.empty())
+        {
+            entryObj["lastModified"] = Json::Value(it->second.lastModified);
+        }
+        entryObj["access"] = Json::Value(static_cast<Json::UInt64>(it->second.lastAccess));
+        entryItems.append(entryObj);
+    }
+
+    Json::Value cacheObj(Json::objectValue);
+    cacheObj["ticks"] = Json::Value(static_cast<Json::UInt64>(m_ticks));
+    cacheObj["entries"] = entryItems;
+
+    Json::FastWriter writer;
+    std::string indexFile = combinePath(m_cacheDir, DOWNLOAD_CACHE_INDEX_FILE);
+    std::string tempFile = indexFile + ".tmp";
+    if (!writeFile(tempFile, writer.write(cacheObj)) || !moveFile(tempFile, indexFile, true))
+    {
+        return false;
+    }
+    m_modified = false;
+    return true;
+}
+
+bool DownloadCache::find(const std::string& url, std::string& path)
+{
+    std::string key = normalizeUrl(url);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::map<std::string, Entry>::iterator it = m_entries.find(key);
+    if (it == m_entries.end())
+    {
+        return false;
+    }
+
+    std::string cachedPath = combinePath(m_cacheDir, it->second.fileName);
+    if (getFileSize(cachedPath) != it->second.size)
+    {
+        // Removed or changed outside
+        m_size -= it->second.size;
+        m_entries.erase(it);
+        m_modified = true;
+        return false;
+    }
+
+    it->second.lastAccess = ++m_ticks;
+    m_modified = true;
+    path = cachedPath;
+    return true;
+}
+
+bool DownloadCache::add(const std::string& url, const std::string& file, const std::string& etag, const std::string& lastModified)
+{
+    uint64_t size = getFileSize(file);
+    if (size == 0 || size > m_maxSize)
+    {
+        return false;
+    }
+
+    std::string key = normalizeUrl(url);
+    std::string fileName = md5(key);
+    std::string cachedPath = combinePath(m_cacheDir, fileName);
+    std::string tempFile = cachedPath + ".tmp";
+    // Copied outside the lock, the same url is only downloaded once by an exporting
+    if (!copyFile(file, tempFile, true) || !moveFile(tempFile, cachedPath, true))
+    {
+        deleteFile(tempFile);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::map<std::string, Entry>::iterator it = m_entries.find(key);
+    if (it == m_entries.end())
+    {
+        it = m_entries.insert(it, std::pair<std::string, Entry>(key, Entry()));
+    }
+    else
+    {
+        m_size -= it->second.size;
+    }
+    it->second.fileName = fileName;
+    it->second.size = size;
+    it->second.etag = etag;
+    it->second.lastModified = lastModified;
+    it->second.lastAccess = ++m_ticks;
+    m_size += size;
+    m_modified = true;
+
+    if (m_size > m_maxSize)
+    {
+        trim();
+    }
+    return true;
+}
+
+void DownloadCache::trim()
+{
+    // Down to 90% of the limit, so it doesn't trim again on every new file
+    uint64_t targetSize = m_maxSize / 10 * 9;
+    std::vector<std::pair<uint64_t, std::string>> accesses;
+    accesses.reserve(m_entries.size());
+    for (std::map<std::string, Entry>::const_iterator it = m_entries.cbegin(); it != m_entries.cend(); ++it)
+    {
+        accesses.push_back(std::pair<uint64_t, std::string>(it->second.lastAccess, it->first));
+    }
+    std::sort(accesses.begin(), accesses.end());
+
+    for (std::vector<std::pair<uint64_t, std::string>>::const_iterator it = accesses.cbegin(); it != accesses.cend() && m_size > targetSize; ++it)
+    {
+        std::map<std::string, Entry>::iterator itEntry = m_entries.find(it->second);
+        deleteFile(combinePath(m_cacheDir, itEntry->second.fileName));
+        m_size -= itEntry->second.size;
+        m_entries.erase(itEntry);
+    }
+    m_modified = true;
+}
+
+std::string DownloadCache::normalizeUrl(const std::string& url)
+{
+    std::string::size_type begin = url.find("://");
+    begin = (begin == std::string::npos) ? 0 : (begin + 3);
+    std::string::size_type end = url.find('#', begin);
+    std::string normalizedUrl = url.substr(begin, end == std::string::npos ? std::string::npos : (end - begin));
+
+    std::string::size_type hostEnd = normalizedUrl.find_first_of("/?");
+    if (hostEnd == std::string::npos)
+    {
+        hostEnd = normalizedUrl.size();
+    }
+    std::transform(normalizedUrl.begin(), normalizedUrl.begin() + hostEnd, normalizedUrl.begin(), ::tolower);
+    return normalizedUrl;
+}
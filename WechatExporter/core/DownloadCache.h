@@ -0,0 +1,63 @@
+//
+//  DownloadCache.h
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#ifndef DownloadCache_h
+#define DownloadCache_h
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <cstdint>
+
+// Files downloaded by the previous exportings, shared by the accounts and kept in a directory across the runs.
+// The urls of emojis and avatars on the CDN are stable for the same contents, so a cached file is taken without
+// going to the network. The least recently used files are removed once the cache grows over its limit.
+class DownloadCache
+{
+public:
+    DownloadCache(const std::string& cacheDir, uint64_t maxSize);
+
+    // Loads the index of the cache, an empty cache if it doesn't exist
+    bool load();
+    bool save();
+
+    // Path of the cached file of url, false if it is not cached
+    bool find(const std::string& url, std::string& path);
+    // file is copied into the cache, etag and lastModified are the headers of the response
+    bool add(const std::string& url, const std::string& file, const std::string& etag, const std::string& lastModified);
+
+    // Scheme and fragment are dropped and the host is in lowercase, http and https urls of the same file are one entry
+    static std::string normalizeUrl(const std::string& url);
+
+private:
+    DownloadCache(const DownloadCache&);
+    DownloadCache& operator=(const DownloadCache&);
+
+    struct Entry
+    {
+        std::string fileName;
+        uint64_t size;
+        std::string etag;
+        std::string lastModified;
+        uint64_t lastAccess;    // Ticks of the cache, a larger one is used later
+    };
+
+    // Removes the least recently used files until the cache is below its limit
+    void trim();
+
+    std::string m_cacheDir;
+    uint64_t m_maxSize;
+
+    std::mutex m_mutex;
+    std::map<std::string, Entry> m_entries; // Normalized url => entry
+    uint64_t m_size;
+    uint64_t m_ticks;
+    bool m_modified;
+};
+
+#endif /* DownloadCache_h */
@@ -0,0 +1,463 @@
+//
+//  DownloadEngine.cpp
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/14.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#include "DownloadEngine.h"
+#include <algorithm>
+#include <cctype>
+#include "Utils.h"
+#include "ExportMetrics.h"
+
+// Milliseconds to wait for the sockets, new tasks are picked up after it
+#define DOWNLOAD_ENGINE_WAIT_TIME   100
+// A burst of failures only halves the limit of the host once
+#define DOWNLOAD_ENGINE_BACKOFF_INTERVAL    1000
+
+static bool isCongested(CURLcode res, long httpStatus)
+{
+    switch (res)
+    {
+        case CURLE_OK:
+            return httpStatus == 429 || httpStatus >= 500;
+        case CURLE_OPERATION_TIMEDOUT:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+        case CURLE_GOT_NOTHING:
+        case CURLE_PARTIAL_FILE:
+        case CURLE_SSL_CONNECT_ERROR:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Waiting doesn't make the host reachable, the attempts are retried right away as DownloadTask::run did
+static bool isUnreachable(CURLcode res)
+{
+    return res == CURLE_COULDNT_CONNECT || res == CURLE_COULDNT_RESOLVE_HOST || res == CURLE_COULDNT_RESOLVE_PROXY;
+}
+
+DownloadEngine::DownloadEngine(unsigned int numberOfThreads, unsigned int maxTransfersPerThread, Callback *callback) : m_callback(callback), m_maxTransfers(maxTransfersPerThread == 0 ? 1 : maxTransfersPerThread), m_minHostTransfers(2), m_maxHostTransfers(16), m_initialHostTransfers(4), m_share(NULL), m_numberOfQueued(0), m_numberOfRunning(0), m_shutdown(false), m_cancelled(false)
+{
+    m_share = curl_share_init();
+    if (NULL != m_share)
+    {
+        curl_share_setopt(m_share, CURLSHOPT_LOCKFUNC, &DownloadEngine::lockShare);
+        curl_share_setopt(m_share, CURLSHOPT_UNLOCKFUNC, &DownloadEngine::unlockShare);
+        curl_share_setopt(m_share, CURLSHOPT_USERDATA, this);
+        curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        // Connections stay in the cache of each multi handle, sharing them across the threads stalls the transfers
+        curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    }
+
+    if (numberOfThreads == 0)
+    {
+        numberOfThreads = 1;
+    }
+    for (unsigned int idx = 0; idx < numberOfThreads; ++idx)
+    {
+        Worker* worker = new Worker();
+        worker->multi = curl_multi_init();
+        // Transfers to a host are limited by the engine
+        curl_multi_setopt(worker->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+        m_workers.push_back(worker);
+    }
+    for (unsigned int idx = 0; idx < numberOfThreads; ++idx)
+    {
+        m_workers[idx]->thread = std::thread(&DownloadEngine::run, this, m_workers[idx], idx);
+    }
+}
+
+DownloadEngine::~DownloadEngine()
+{
+    shutdown();
+    for (std::vector<Worker *>::iterator it = m_workers.begin(); it != m_workers.end(); ++it)
+    {
+        Worker* worker = *it;
+        worker->thread.join();
+        curl_multi_cleanup(worker->multi);
+        delete worker;
+    }
+    m_workers.clear();
+
+    dropQueuedTasks();
+
+    if (NULL != m_share)
+    {
+        curl_share_cleanup(m_share);
+        m_share = NULL;
+    }
+}
+
+void DownloadEngine::setHostConcurrency(unsigned int minTransfers, unsigned int maxTransfers, unsigned int initialTransfers)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_minHostTransfers = std::max(minTransfers, 1u);
+    m_maxHostTransfers = std::max(maxTransfers, m_minHostTransfers);
+    m_initialHostTransfers = std::min(std::max(initialTransfers, m_minHostTransfers), m_maxHostTransfers);
+    for (std::map<std::string, Host>::iterator it = m_hosts.begin(); it != m_hosts.end(); ++it)
+    {
+        it->second.limit = std::min(std::max(it->second.limit, static_cast<double>(m_minHostTransfers)), static_cast<double>(m_maxHostTransfers));
+    }
+    m_cv.notify_all();
+}
+
+void DownloadEngine::addTask(DownloadTask *task)
+{
+    std::string hostName = getHost(task->getUrl());
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::map<std::string, Host>::iterator it = m_hosts.find(hostName);
+    if (it == m_hosts.end())
+    {
+        it = m_hosts.insert(it, std::pair<std::string, Host>(hostName, Host()));
+        it->second.running = 0;
+        it->second.limit = m_initialHostTransfers;
+    }
+    it->second.tasks[task->getPriority()].push_back(task);
+    ++m_numberOfQueued;
+    addExportMetric(EXPORT_METRIC_QUEUED_DOWNLOADS, 1);
+    m_cv.notify_one();
+}
+
+size_t DownloadEngine::getNumberOfQueue() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_numberOfQueued + m_numberOfRunning;
+}
+
+void DownloadEngine::shutdown()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_shutdown = true;
+    m_cv.notify_all();
+}
+
+void DownloadEngine::cancel()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_shutdown = true;
+        m_cancelled = true;
+        m_cv.notify_all();
+        m_completion_cv.notify_all();
+    }
+
+    dropQueuedTasks();
+}
+
+void DownloadEngine::dropQueuedTasks()
+{
+    std::vector<DownloadTask *> tasks;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (std::map<std::string, Host>::iterator it = m_hosts.begin(); it != m_hosts.end(); ++it)
+        {
+            for (int priority = 0; priority < NUMBER_OF_TASK_PRIORITIES; ++priority)
+            {
+                tasks.insert(tasks.end(), it->second.tasks[priority].begin(), it->second.tasks[priority].end());
+                it->second.tasks[priority].clear();
+            }
+        }
+        for (std::multimap<std::chrono::steady_clock::time_point, std::pair<DownloadTask *, Host *>>::iterator it = m_delayedTasks.begin(); it != m_delayedTasks.end(); ++it)
+        {
+            tasks.push_back(it->second.first);
+        }
+        m_delayedTasks.clear();
+        addExportMetric(EXPORT_METRIC_QUEUED_DOWNLOADS, -static_cast<int64_t>(m_numberOfQueued));
+        m_numberOfQueued = 0;
+        m_completion_cv.notify_all();
+    }
+
+    for (std::vector<DownloadTask *>::iterator it = tasks.begin(); it != tasks.end(); ++it)
+    {
+        delete *it;
+    }
+}
+
+// true: completed, false: timeout
+bool DownloadEngine::waitForCompltion(unsigned int ms)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_numberOfQueued > 0 || m_numberOfRunning > 0)
+    {
+        if (ms == 0)
+        {
+            m_completion_cv.wait(lock);
+        }
+        else
+        {
+            m_completion_cv.wait_for(lock, std::chrono::milliseconds(ms));
+        }
+    }
+
+    return m_numberOfQueued == 0 && m_numberOfRunning == 0;
+}
+
+void DownloadEngine::run(Worker* worker, unsigned int index)
+{
+    std::string tname = m_tag + std::to_string(index + 1);
+    setThreadName(tname.c_str());
+
+    std::vector<std::pair<DownloadTask *, Host *>> newTasks;
+    for (;;)
+    {
+        bool hasDelayedTasks = false;
+        std::chrono::steady_clock::time_point dueTime;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (!m_cancelled)
+            {
+                dequeueTasks(m_maxTransfers - worker->transfers.size(), newTasks);
+                if (!newTasks.empty() || !worker->transfers.empty() || (m_shutdown && m_numberOfQueued == 0))
+                {
+                    break;
+                }
+                if (!m_delayedTasks.empty())
+                {
+                    // Nothing to transfer before the next retry
+                    m_cv.wait_until(lock, m_delayedTasks.begin()->first);
+                    continue;
+                }
+                // The queued tasks wait for their hosts
+                m_cv.wait(lock);
+            }
+            if (worker->transfers.empty() && newTasks.empty())
+            {
+                break;
+            }
+            hasDelayedTasks = !m_delayedTasks.empty();
+            if (hasDelayedTasks)
+            {
+                dueTime = m_delayedTasks.begin()->first;
+            }
+        }
+
+        for (std::vector<std::pair<DownloadTask *, Host *>>::iterator it = newTasks.begin(); it != newTasks.end(); ++it)
+        {
+            // Cancelled in the meantime, it is completed as aborted
+            startTransfer(worker, it->first, it->second);
+        }
+        newTasks.clear();
+
+        if (m_cancelled)
+        {
+            for (std::map<DownloadTask *, Host *>::iterator it = worker->transfers.begin(); it != worker->transfers.end(); ++it)
+            {
+                DownloadTask* task = it->first;
+                curl_multi_remove_handle(worker->multi, task->getHandle());
+                task->end(CURLE_ABORTED_BY_CALLBACK);
+                completeTask(task, it->second, false);
+            }
+            worker->transfers.clear();
+            continue;
+        }
+
+        int numberOfRunning = 0;
+        curl_multi_perform(worker->multi, &numberOfRunning);
+
+        CURLMsg* msg = NULL;
+        int numberOfMessages = 0;
+        while ((msg = curl_multi_info_read(worker->multi, &numberOfMessages)) != NULL)
+        {
+            if (msg->msg != CURLMSG_DONE)
+            {
+                continue;
+            }
+            DownloadTask* task = NULL;
+            long httpStatus = 0;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, reinterpret_cast<char **>(&task));
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &httpStatus);
+            CURLcode result = msg->data.result;
+            curl_multi_remove_handle(worker->multi, msg->easy_handle);
+            std::map<DownloadTask *, Host *>::iterator itTask = worker->transfers.find(task);
+            Host* host = itTask->second;
+            worker->transfers.erase(itTask);
+            if (task->end(result))
+            {
+                adjustHostLimit(host, false);
+                completeTask(task, host, true);
+            }
+            else
+            {
+                if (isCongested(result, httpStatus))
+                {
+                    adjustHostLimit(host, true);
+                }
+                // Retried after the back-off, or the default file is taken
+                retryTransfer(worker, task, host, result);
+            }
+        }
+
+        if (!worker->transfers.empty())
+        {
+            int numberOfFds = 0;
+            int waitTime = DOWNLOAD_ENGINE_WAIT_TIME;
+            if (hasDelayedTasks)
+            {
+                long long delay = std::chrono::duration_cast<std::chrono::milliseconds>(dueTime - std::chrono::steady_clock::now()).count();
+                waitTime = static_cast<int>(std::max(0LL, std::min(delay, static_cast<long long>(waitTime))));
+            }
+            curl_multi_wait(worker->multi, NULL, 0, waitTime, &numberOfFds);
+        }
+    }
+}
+
+void DownloadEngine::retryTransfer(Worker* worker, DownloadTask* task, Host* host, CURLcode result)
+{
+    unsigned int delay = (m_cancelled || isUnreachable(result)) ? 0 : task->getRetryDelay();
+    if (delay == 0)
+    {
+        startTransfer(worker, task, host);
+        return;
+    }
+    
+    // The slot of the host is free during the back-off, the task is queued again once it is due
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_delayedTasks.insert(std::pair<std::chrono::steady_clock::time_point, std::pair<DownloadTask *, Host *>>(std::chrono::steady_clock::now() + std::chrono::milliseconds(delay), std::pair<DownloadTask *, Host *>(task, host)));
+    --host->running;
+    --m_numberOfRunning;
+    ++m_numberOfQueued;
+    addExportMetric(EXPORT_METRIC_RUNNING_DOWNLOADS, -1);
+    addExportMetric(EXPORT_METRIC_QUEUED_DOWNLOADS, 1);
+    m_cv.notify_all();
+}
+
+void DownloadEngine::queueDueTasks()
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    while (!m_delayedTasks.empty() && m_delayedTasks.begin()->first <= now)
+    {
+        std::pair<DownloadTask *, Host *> delayed = m_delayedTasks.begin()->second;
+        m_delayedTasks.erase(m_delayedTasks.begin());
+        // Ahead of the tasks which haven't been tried yet
+        delayed.second->tasks[delayed.first->getPriority()].push_front(delayed.first);
+    }
+}
+
+void DownloadEngine::dequeueTasks(size_t maxTasks, std::vector<std::pair<DownloadTask *, Host *>>& tasks)
+{
+    queueDueTasks();
+    for (int priority = 0; priority < NUMBER_OF_TASK_PRIORITIES && tasks.size() < maxTasks; ++priority)
+    {
+        bool dequeued = true;
+        while (dequeued && tasks.size() < maxTasks)
+        {
+            // One task of each host in a round, from the host after the last one
+            dequeued = false;
+            std::map<std::string, Host>::iterator it = m_hosts.upper_bound(m_nextHost);
+            for (size_t idx = 0; idx < m_hosts.size() && tasks.size() < maxTasks; ++idx, ++it)
+            {
+                if (it == m_hosts.end())
+                {
+                    it = m_hosts.begin();
+                }
+                Host& host = it->second;
+                std::deque<DownloadTask *>& hostTasks = host.tasks[priority];
+                if (hostTasks.empty() || host.running >= static_cast<unsigned int>(host.limit))
+                {
+                    continue;
+                }
+                tasks.push_back(std::pair<DownloadTask *, Host *>(hostTasks.front(), &host));
+                hostTasks.pop_front();
+                ++host.running;
+                --m_numberOfQueued;
+                ++m_numberOfRunning;
+                addExportMetric(EXPORT_METRIC_QUEUED_DOWNLOADS, -1);
+                addExportMetric(EXPORT_METRIC_RUNNING_DOWNLOADS, 1);
+                m_nextHost = it->first;
+                dequeued = true;
+            }
+        }
+    }
+}
+
+void DownloadEngine::adjustHostLimit(Host* host, bool congested)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    unsigned int prevLimit = static_cast<unsigned int>(host->limit);
+    if (congested)
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (std::chrono::duration_cast<std::chrono::milliseconds>(now - host->decreasedTime).count() >= DOWNLOAD_ENGINE_BACKOFF_INTERVAL)
+        {
+            host->limit = std::max(host->limit / 2, static_cast<double>(m_minHostTransfers));
+            host->decreasedTime = now;
+        }
+    }
+    else
+    {
+        host->limit = std::min(host->limit + 1.0 / host->limit, static_cast<double>(m_maxHostTransfers));
+    }
+    if (static_cast<unsigned int>(host->limit) > prevLimit)
+    {
+        m_cv.notify_all();
+    }
+}
+
+void DownloadEngine::startTransfer(Worker* worker, DownloadTask* task, Host* host)
+{
+    CURL* curl = m_cancelled ? NULL : task->begin(m_share);
+    if (NULL == curl)
+    {
+        completeTask(task, host, m_cancelled ? false : task->fallback());
+        return;
+    }
+    if (curl_multi_add_handle(worker->multi, curl) != CURLM_OK)
+    {
+        task->end(CURLE_FAILED_INIT);
+        completeTask(task, host, task->fallback());
+        return;
+    }
+    worker->transfers[task] = host;
+}
+
+void DownloadEngine::completeTask(DownloadTask* task, Host* host, bool succeeded)
+{
+    if (NULL != m_callback)
+    {
+        m_callback->onDownloadComplete(task, succeeded);
+    }
+    delete task;
+    addExportMetric(EXPORT_METRIC_DOWNLOADS, 1);
+    if (!succeeded)
+    {
+        addExportMetric(EXPORT_METRIC_FAILED_DOWNLOADS, 1);
+    }
+    addExportMetric(EXPORT_METRIC_RUNNING_DOWNLOADS, -1);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    --host->running;
+    --m_numberOfRunning;
+    // A slot of the host is free for the tasks waiting for it
+    m_cv.notify_all();
+    if (m_numberOfQueued == 0 && m_numberOfRunning == 0)
+    {
+        m_completion_cv.notify_all();
+    }
+}
+
+std::string DownloadEngine::getHost(const std::string& url)
+{
+    std::string::size_type begin = url.find("://");
+    begin = (begin == std::string::npos) ? 0 : (begin + 3);
+    std::string::size_type end = url.find_first_of(":/?#", begin);
+    std::string host = url.substr(begin, end == std::string::npos ? std::string::npos : (end - begin));
+    std::transform(host.begin(), host.end(), host.begin(), ::tolower);
+    return host;
+}
+
+void DownloadEngine::lockShare(CURL * /*handle*/, curl_lock_data data, curl_lock_access /*access*/, void *userptr)
+{
+    DownloadEngine* engine = reinterpret_cast<DownloadEngine *>(userptr);
+    engine->m_shareMutexes[data].lock();
+}
+
+void DownloadEngine::unlockShare(CURL * /*handle*/, curl_lock_data data, void *userptr)
+{
+    DownloadEngine* engine = reinterpret_cast<DownloadEngine *>(userptr);
+    engine->m_shareMutexes[data].unlock();
+}
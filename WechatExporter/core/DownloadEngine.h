@@ -0,0 +1,129 @@
+//
+//  DownloadEngine.h
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/14.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#ifndef DownloadEngine_h
+#define DownloadEngine_h
+
+#include <condition_variable>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <vector>
+#include <curl/curl.h>
+#include "AsyncTask.h"
+
+// Runs DownloadTasks on a few I/O threads, each of which drives many transfers with a curl multi handle.
+// The transfers of a thread reuse its connections to the same CDN hosts, over HTTP/2 with multiplexing
+// where the host supports it, and the DNS and TLS sessions are shared by all threads.
+//
+// Each host has its own limit of concurrent transfers, tuned like AIMD: it grows by 1/limit with every
+// downloaded file and is halved when the host times out, drops connections or answers 429/5xx,
+// so a fast link gets more transfers and a throttled one backs off before the retries run out.
+// Queued tasks of a higher priority start first, on any host, the hosts take turns within a priority.
+class DownloadEngine
+{
+public:
+    class Callback
+    {
+    public:
+        // Called on the I/O thread, the task is deleted after it
+        virtual void onDownloadComplete(const DownloadTask *task, bool succeeded) = 0;
+        virtual ~Callback() {}
+    };
+
+    // maxTransfersPerThread: transfers of a thread for all hosts
+    DownloadEngine(unsigned int numberOfThreads, unsigned int maxTransfersPerThread, Callback *callback);
+    // Downloads still queued are completed first, unless cancel is called
+    ~DownloadEngine();
+
+    // Floor and ceiling of the concurrent transfers to a host, the limit of a new host starts from initialTransfers
+    void setHostConcurrency(unsigned int minTransfers, unsigned int maxTransfers, unsigned int initialTransfers);
+
+    // The task is owned by the engine
+    void addTask(DownloadTask *task);
+    // Downloads queued and running
+    size_t getNumberOfQueue() const;
+    void shutdown();
+    // Queued tasks are dropped without the callback, running ones are aborted
+    void cancel();
+    // true: completed, false: timeout
+    bool waitForCompltion(unsigned int ms);
+
+    // Prefix of the names of the threads, which also name the threads of the traces
+    void setTag(const std::string& tag)
+    {
+        m_tag = tag;
+    }
+
+    // Host of url in lowercase, without the port
+    static std::string getHost(const std::string& url);
+
+private:
+    DownloadEngine(const DownloadEngine&);
+    DownloadEngine& operator=(const DownloadEngine&);
+
+    struct Host
+    {
+        std::deque<DownloadTask *> tasks[NUMBER_OF_TASK_PRIORITIES];
+        unsigned int running;
+        double limit;
+        std::chrono::steady_clock::time_point decreasedTime;
+    };
+
+    struct Worker
+    {
+        CURLM* multi;
+        std::map<DownloadTask *, Host *> transfers;
+        std::thread thread;
+    };
+
+    void run(Worker* worker, unsigned int index);
+    // Tasks of the hosts below their limits, by priority and then in turns of the hosts
+    void dequeueTasks(size_t maxTasks, std::vector<std::pair<DownloadTask *, Host *>>& tasks);
+    // The delayed tasks which are due go back to the fronts of the queues of their hosts
+    void queueDueTasks();
+    // Starts the next attempt of the task, or completes it when there is none
+    void startTransfer(Worker* worker, DownloadTask* task, Host* host);
+    // The next attempt, right away if the host refused the connection, otherwise after the back-off of the task
+    void retryTransfer(Worker* worker, DownloadTask* task, Host* host, CURLcode result);
+    void completeTask(DownloadTask* task, Host* host, bool succeeded);
+    // congested: the host failed in the way more transfers make worse
+    void adjustHostLimit(Host* host, bool congested);
+    void dropQueuedTasks();
+
+    static void lockShare(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr);
+    static void unlockShare(CURL *handle, curl_lock_data data, void *userptr);
+
+    Callback* m_callback;
+    unsigned int m_maxTransfers;
+    unsigned int m_minHostTransfers;
+    unsigned int m_maxHostTransfers;
+    unsigned int m_initialHostTransfers;
+    std::string m_tag;
+
+    CURLSH* m_share;
+    std::mutex m_shareMutexes[CURL_LOCK_DATA_LAST];
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::condition_variable m_completion_cv;
+    std::map<std::string, Host> m_hosts;
+    // Failed tasks waiting for their next attempts by the due time, they count as queued and don't keep the slots of their hosts
+    std::multimap<std::chrono::steady_clock::time_point, std::pair<DownloadTask *, Host *>> m_delayedTasks;
+    std::string m_nextHost;     // Hosts take turns to be dequeued
+    size_t m_numberOfQueued;
+    size_t m_numberOfRunning;
+    bool m_shutdown;
+    std::atomic<bool> m_cancelled;
+    std::vector<Worker *> m_workers;
+};
+
+#endif /* DownloadEngine_h */
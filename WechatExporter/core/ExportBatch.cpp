@@ -0,0 +1,321 @@
+//
+//  ExportBatch.cpp
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#include "ExportBatch.h"
+#include <thread>
+#include <algorithm>
+#include "Exporter.h"
+#include "ExportBudget.h"
+#include "WriteQueue.h"
+
+// The logs of the jobs running at the same time are told apart by the index of the job
+class JobLogger : public Logger
+{
+public:
+    JobLogger(Logger* logger, size_t jobIndex) : m_logger(logger), m_prefix("[" + std::to_string(jobIndex + 1) + "] ")
+    {
+    }
+    
+    void write(const std::string& log)
+    {
+        m_logger->write(m_prefix + log);
+    }
+    
+    void debug(const std::string& log)
+    {
+        m_logger->debug(m_prefix + log);
+    }
+    
+    void writeLines(const std::vector<std::string>& logs)
+    {
+        std::vector<std::string> lines;
+        lines.reserve(logs.size());
+        for (std::vector<std::string>::const_iterator it = logs.cbegin(); it != logs.cend(); ++it)
+        {
+            lines.push_back(m_prefix + *it);
+        }
+        m_logger->writeLines(lines);
+    }
+    
+    bool isDebugging() const
+    {
+        return m_logger->isDebugging();
+    }
+    
+private:
+    Logger* m_logger;
+    std::string m_prefix;
+};
+
+// Passes the events on to the notifier of the job, the progress of the exporting goes to the one of the batch as well
+class JobNotifier : public ExportNotifier
+{
+public:
+    JobNotifier(size_t jobIndex, const ExportNotifier* notifier, const ExportBatchNotifier* batchNotifier) : m_jobIndex(jobIndex), m_notifier(notifier), m_batchNotifier(batchNotifier), m_cancelled(false)
+    {
+    }
+    
+    bool isCancelled() const
+    {
+        return m_cancelled;
+    }
+    
+    void onStart() const
+    {
+        if (NULL != m_notifier)
+        {
+            m_notifier->onStart();
+        }
+    }
+    
+    void onProgress(uint32_t numberOfMessages, uint32_t numberOfTotalMessages) const
+    {
+        if (NULL != m_notifier)
+        {
+            m_notifier->onProgress(numberOfMessages, numberOfTotalMessages);
+        }
+        if (NULL != m_batchNotifier)
+        {
+            m_batchNotifier->onJobProgress(m_jobIndex, numberOfMessages, numberOfTotalMessages);
+        }
+    }
+    
+    void onComplete(bool cancelled) const
+    {
+        m_cancelled = cancelled;
+        if (NULL != m_notifier)
+        {
+            m_notifier->onComplete(cancelled);
+        }
+    }
+    
+    void onUserSessionStart(const std::string& usrName, uint32_t numberOfSessions) const
+    {
+        if (NULL != m_notifier)
+        {
+            m_notifier->onUserSessionStart(usrName, numberOfSessions);
+        }
+    }
+    
+    void onUserSessionComplete(const std::string& usrName) const
+    {
+        if (NULL != m_notifier)
+        {
+            m_notifier->onUserSessionComplete(usrName);
+        }
+    }
+    
+    void onSessionStart(const std::string& sessionUsrName, void * sessionData, uint32_t numberOfTotalMessages) const
+    {
+        if (NULL != m_notifier)
+        {
+            m_notifier->onSessionStart(sessionUsrName, sessionData, numberOfTotalMessages);
+        }
+    }
+    
+    void onSessionProgress(const std::string& sessionUsrName, void * sessionData, uint32_t numberOfMessages, uint32_t numberOfTotalMessages) const
+    {
+        if (NULL != m_notifier)
+        {
+            m_notifier->onSessionProgress(sessionUsrName, sessionData, numberOfMessages, numberOfTotalMessages);
+        }
+    }
+    
+    void onSessionComplete(const std::string& sessionUsrName, void * sessionData, bool cancelled) const
+    {
+        if (NULL != m_notifier)
+        {
+            m_notifier->onSessionComplete(sessionUsrName, sessionData, cancelled);
+        }
+    }
+    
+    void onTasksStart(const std::string& usrName, uint32_t numberOfTotalTasks) const
+    {
+        if (NULL != m_notifier)
+        {
+            m_notifier->onTasksStart(usrName, numberOfTotalTasks);
+        }
+    }
+    
+    void onTasksProgress(const std::string& usrName, uint32_t numberOfCompletedTasks, uint32_t numberOfTotalMessages) const
+    {
+        if (NULL != m_notifier)
+        {
+            m_notifier->onTasksProgress(usrName, numberOfCompletedTasks, numberOfTotalMessages);
+        }
+    }
+    
+    void onTasksComplete(const std::string& usrName, bool cancelled) const
+    {
+        if (NULL != m_notifier)
+        {
+            m_notifier->onTasksComplete(usrName, cancelled);
+        }
+    }
+    
+    void onMetrics(const ExportMetrics& metrics) const
+    {
+        if (NULL != m_notifier)
+        {
+            m_notifier->onMetrics(metrics);
+        }
+    }
+    
+private:
+    size_t m_jobIndex;
+    const ExportNotifier* m_notifier;
+    const ExportBatchNotifier* m_batchNotifier;
+    mutable std::atomic<bool> m_cancelled;
+};
+
+ExportBatch::ExportBatch(const std::string& workDir, Logger* logger) : m_workDir(workDir), m_logger(logger), m_notifier(NULL), m_exportBudget(NULL), m_writeQueue(NULL), m_cancelled(false)
+{
+}
+
+ExportBatch::~ExportBatch()
+{
+    m_logger = NULL;
+    m_notifier = NULL;
+}
+
+void ExportBatch::setBudget(const Budget& budget)
+{
+    m_budget = budget;
+}
+
+void ExportBatch::setNotifier(const ExportBatchNotifier* notifier)
+{
+    m_notifier = notifier;
+}
+
+size_t ExportBatch::addJob(const Job& job)
+{
+    m_jobs.push_back(job);
+    return m_jobs.size() - 1;
+}
+
+bool ExportBatch::run()
+{
+    m_cancelled = false;
+    m_results.assign(m_jobs.size(), 0);
+    if (m_jobs.empty())
+    {
+        return true;
+    }
+    
+    m_exportBudget = new ExportBudget(m_budget.numberOfThreads);
+    m_writeQueue = new WriteQueue(std::max(m_budget.numberOfWriteThreads, 1u), m_budget.maxPendingWriteBytes);
+    
+    // The jobs are taken in their order by the runners, a runner takes the next one once its job is done
+    unsigned int numberOfJobs = static_cast<unsigned int>(std::min(static_cast<size_t>(std::max(m_budget.numberOfJobs, 1u)), m_jobs.size()));
+    std::atomic<size_t> nextJob(0);
+    std::vector<std::thread> threads;
+    threads.reserve(numberOfJobs);
+    for (unsigned int idx = 0; idx < numberOfJobs; ++idx)
+    {
+        threads.push_back(std::thread([this, &nextJob, numberOfJobs]() {
+            while (!m_cancelled)
+            {
+                size_t jobIndex = nextJob.fetch_add(1);
+                if (jobIndex >= m_jobs.size())
+                {
+                    break;
+                }
+                runJob(jobIndex, numberOfJobs);
+            }
+        }));
+    }
+    for (std::vector<std::thread>::iterator it = threads.begin(); it != threads.end(); ++it)
+    {
+        it->join();
+    }
+    
+    bool written = m_writeQueue->flush();
+    delete m_writeQueue;
+    m_writeQueue = NULL;
+    delete m_exportBudget;
+    m_exportBudget = NULL;
+    if (!written)
+    {
+        m_logger->write("Failed to write some of the exported files of the batch.");
+    }
+    
+    return written && std::find(m_results.cbegin(), m_results.cend(), 0) == m_results.cend();
+}
+
+void ExportBatch::cancel()
+{
+    m_cancelled = true;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (std::set<Exporter *>::iterator it = m_exporters.begin(); it != m_exporters.end(); ++it)
+    {
+        (*it)->cancel();
+    }
+}
+
+bool ExportBatch::isSucceeded(size_t jobIndex) const
+{
+    return jobIndex < m_results.size() && m_results[jobIndex] != 0;
+}
+
+void ExportBatch::runJob(size_t jobIndex, unsigned int numberOfJobs)
+{
+    const Job& job = m_jobs[jobIndex];
+    JobLogger logger(m_logger, jobIndex);
+    JobNotifier notifier(jobIndex, job.notifier, m_notifier);
+    
+    Exporter exporter(m_workDir, job.backup, job.output, &logger, job.pdfConverter);
+    if (job.configure)
+    {
+        job.configure(exporter);
+    }
+    // Every job may take all the slots when the others don't need them, the budget decides who gets the next one
+    unsigned int numberOfSlots = m_exportBudget->getNumberOfSlots();
+    exporter.setParallelSessions(numberOfSlots);
+    exporter.setBudget(m_exportBudget, static_cast<unsigned int>(jobIndex));
+    // The transcoding and the downloads aren't under the slots, each job has its share of them
+    exporter.setAudioThreads(std::max(numberOfSlots / numberOfJobs, 1u));
+    unsigned int maxTransfersPerHost = std::max(m_budget.maxTransfersPerHost / numberOfJobs, 1u);
+    exporter.setDownloadConcurrency(std::min(2u, maxTransfersPerHost), maxTransfersPerHost);
+    exporter.setWriteQueue(m_writeQueue);
+    exporter.setNotifier(&notifier);
+    if (!job.filter.empty())
+    {
+        exporter.filterUsersAndSessions(job.filter);
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_cancelled)
+        {
+            return;
+        }
+        m_exporters.insert(&exporter);
+    }
+    
+    if (NULL != m_notifier)
+    {
+        m_notifier->onJobStart(jobIndex);
+    }
+    bool succeeded = false;
+    if (exporter.run())
+    {
+        exporter.waitForComplition();
+        succeeded = !notifier.isCancelled();
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_exporters.erase(&exporter);
+    }
+    m_results[jobIndex] = succeeded ? 1 : 0;
+    if (NULL != m_notifier)
+    {
+        m_notifier->onJobComplete(jobIndex, succeeded, notifier.isCancelled());
+    }
+}
@@ -0,0 +1,112 @@
+//
+//  ExportBatch.h
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#ifndef ExportBatch_h
+#define ExportBatch_h
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include "Logger.h"
+#include "PdfConverter.h"
+#include "ExportNotifier.h"
+
+class Exporter;
+class ExportBudget;
+class WriteQueue;
+
+// Progress of the jobs of a batch, called on the threads of the jobs
+class ExportBatchNotifier
+{
+public:
+    virtual ~ExportBatchNotifier() {}
+    
+    virtual void onJobStart(size_t jobIndex) const = 0;
+    virtual void onJobProgress(size_t jobIndex, uint32_t numberOfMessages, uint32_t numberOfTotalMessages) const = 0;
+    virtual void onJobComplete(size_t jobIndex, bool succeeded, bool cancelled) const = 0;
+};
+
+// Exportings of several backups or accounts under one budget: the jobs run in the order they are added, a few of them
+// at the same time, their sessions take the slots of one ExportBudget of the cores and their files go to one WriteQueue.
+// The downloads and the transcoding stay with the TaskManager of each job, the budget divides their threads and
+// the transfers per host by the jobs running at the same time
+class ExportBatch
+{
+public:
+    struct Budget
+    {
+        unsigned int numberOfJobs;          // Exportings at the same time
+        unsigned int numberOfThreads;       // Sessions exported at the same time by all the jobs, 0 for the number of cores
+        unsigned int maxTransfersPerHost;   // Downloads from a CDN host by all the jobs
+        unsigned int numberOfWriteThreads;
+        size_t maxPendingWriteBytes;        // The jobs wait while the queue has more to write
+        
+        Budget() : numberOfJobs(2), numberOfThreads(0), maxTransfersPerHost(16), numberOfWriteThreads(2), maxPendingWriteBytes(64 * 1024 * 1024)
+        {
+        }
+    };
+    
+    struct Job
+    {
+        std::string backup;
+        std::string output;
+        std::map<std::string, std::map<std::string, void *>> filter;    // As filterUsersAndSessions, empty for everything
+        PdfConverter* pdfConverter;
+        ExportNotifier* notifier;   // Events of the exporting of the job, it can be NULL
+        // Options of the exporting, set before it runs. The thread and download settings are taken over by the budget,
+        // the pipeline workers of a large session run under the slot of the session
+        std::function<void (Exporter&)> configure;
+        
+        Job() : pdfConverter(NULL), notifier(NULL)
+        {
+        }
+    };
+    
+    ExportBatch(const std::string& workDir, Logger* logger);
+    ~ExportBatch();
+    
+    void setBudget(const Budget& budget);
+    void setNotifier(const ExportBatchNotifier* notifier);
+    // Returns the index of the job for the notifier
+    size_t addJob(const Job& job);
+    size_t getNumberOfJobs() const
+    {
+        return m_jobs.size();
+    }
+    
+    // Returns once all the jobs are done, false if any of them failed or was cancelled
+    bool run();
+    // The running exportings are cancelled and the others are not started, it can be called on any thread
+    void cancel();
+    // Of the last run
+    bool isSucceeded(size_t jobIndex) const;
+    
+private:
+    ExportBatch(const ExportBatch&);
+    ExportBatch& operator=(const ExportBatch&);
+    
+    void runJob(size_t jobIndex, unsigned int numberOfJobs);
+    
+    std::string m_workDir;
+    Logger* m_logger;
+    Budget m_budget;
+    const ExportBatchNotifier* m_notifier;
+    std::vector<Job> m_jobs;
+    std::vector<char> m_results;    // Succeeded, each one is set by the thread of its job
+    ExportBudget* m_exportBudget;
+    WriteQueue* m_writeQueue;
+    std::atomic<bool> m_cancelled;
+    std::mutex m_mutex;
+    std::set<Exporter *> m_exporters;  // Running
+};
+
+#endif /* ExportBatch_h */
@@ -0,0 +1,77 @@
+//
+//  ExportBudget.cpp
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#include "ExportBudget.h"
+#include <thread>
+#include <algorithm>
+
+ExportBudget::ExportBudget(unsigned int numberOfSlots/* = 0*/) : m_numberOfSlots(numberOfSlots), m_freeSlots(0), m_numberOfGrants(0)
+{
+    if (0 == m_numberOfSlots)
+    {
+        m_numberOfSlots = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    m_freeSlots = m_numberOfSlots;
+}
+
+void ExportBudget::acquire(unsigned int jobId)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    // Entries of std::map stay where they are while the others come and go
+    Job& job = m_jobs[jobId];
+    ++job.numberOfWaiting;
+    m_cv.wait(lock, [this, jobId] {
+        unsigned int nextJobId = 0;
+        return m_freeSlots > 0 && getNextJob(nextJobId) && nextJobId == jobId;
+    });
+    --job.numberOfWaiting;
+    ++job.numberOfHeld;
+    job.lastGrant = ++m_numberOfGrants;
+    --m_freeSlots;
+    if (m_freeSlots > 0)
+    {
+        // The next slot may be for another job
+        m_cv.notify_all();
+    }
+}
+
+void ExportBudget::release(unsigned int jobId)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::map<unsigned int, Job>::iterator it = m_jobs.find(jobId);
+    if (it == m_jobs.end() || it->second.numberOfHeld == 0)
+    {
+        return;
+    }
+    --it->second.numberOfHeld;
+    if (it->second.numberOfHeld == 0 && it->second.numberOfWaiting == 0)
+    {
+        m_jobs.erase(it);
+    }
+    ++m_freeSlots;
+    m_cv.notify_all();
+}
+
+bool ExportBudget::getNextJob(unsigned int& jobId) const
+{
+    const Job* nextJob = NULL;
+    for (std::map<unsigned int, Job>::const_iterator it = m_jobs.cbegin(); it != m_jobs.cend(); ++it)
+    {
+        const Job& job = it->second;
+        if (job.numberOfWaiting == 0)
+        {
+            continue;
+        }
+        if (NULL == nextJob || job.numberOfHeld < nextJob->numberOfHeld || (job.numberOfHeld == nextJob->numberOfHeld && job.lastGrant < nextJob->lastGrant))
+        {
+            nextJob = &job;
+            jobId = it->first;
+        }
+    }
+    return NULL != nextJob;
+}
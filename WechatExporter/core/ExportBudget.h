@@ -0,0 +1,85 @@
+//
+//  ExportBudget.h
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#ifndef ExportBudget_h
+#define ExportBudget_h
+
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <cstdint>
+
+// Cores shared by the exportings of a batch. A worker of a session holds a slot while it exports the session,
+// a freed slot goes to the waiting job holding the fewest slots, the one served the longest ago among them.
+// A job alone takes all of them, the others get their share back as their workers finish the sessions
+class ExportBudget
+{
+public:
+    // Holds a slot of the job for its scope, nothing is done without a budget
+    class Slot
+    {
+    public:
+        Slot(ExportBudget* budget, unsigned int jobId) : m_budget(budget), m_jobId(jobId)
+        {
+            if (NULL != m_budget)
+            {
+                m_budget->acquire(m_jobId);
+            }
+        }
+        
+        ~Slot()
+        {
+            if (NULL != m_budget)
+            {
+                m_budget->release(m_jobId);
+            }
+        }
+        
+    private:
+        Slot(const Slot&);
+        Slot& operator=(const Slot&);
+        
+        ExportBudget* m_budget;
+        unsigned int m_jobId;
+    };
+    
+    // numberOfSlots: 0 for the number of cores
+    explicit ExportBudget(unsigned int numberOfSlots = 0);
+    
+    unsigned int getNumberOfSlots() const
+    {
+        return m_numberOfSlots;
+    }
+    
+    // Blocks until a slot is granted to the job
+    void acquire(unsigned int jobId);
+    void release(unsigned int jobId);
+    
+private:
+    ExportBudget(const ExportBudget&);
+    ExportBudget& operator=(const ExportBudget&);
+    
+    struct Job
+    {
+        unsigned int numberOfWaiting;
+        unsigned int numberOfHeld;
+        uint64_t lastGrant;     // Sequence of the last slot granted to the job
+    };
+    
+    // The waiting job with the fewest slots, called with m_mutex locked
+    bool getNextJob(unsigned int& jobId) const;
+    
+    unsigned int m_numberOfSlots;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    unsigned int m_freeSlots;
+    uint64_t m_numberOfGrants;
+    std::map<unsigned int, Job> m_jobs;     // Jobs waiting for or holding slots
+};
+
+#endif /* ExportBudget_h */
@@ -9,15 +9,22 @@
 #ifndef ExportContext_h
 #define ExportContext_h
 
+#include "SessionWriter.h"
+#include "TaskManager.h"
+
 class ExportContext
 {
 private:
     int m_options;
     std::time_t m_exportTime;
+    // Saved by a checkpoint of an exporting still running, which is resumed if it never completes
+    bool m_incomplete;
     std::map<std::string, int64_t> m_maxIdForSessions;
+    std::map<std::string, SessionPages> m_pagesForSessions;
+    std::map<std::string, std::vector<PendingDownload>> m_pendingDownloads;    // usrName of account => downloads
     
 public:
-    ExportContext()
+    ExportContext() : m_options(0), m_exportTime(0), m_incomplete(false)
     {
     }
     
@@ -44,6 +51,15 @@ public:
         return m_exportTime;
     }
     
+    bool isIncomplete() const
+    {
+        return m_incomplete;
+    }
+    void setIncomplete(bool incomplete)
+    {
+        m_incomplete = incomplete;
+    }
+    
     size_t getNumberOfSessions() const
     {
         return m_maxIdForSessions.size();
@@ -65,6 +81,45 @@ public:
         m_maxIdForSessions[usrName] = maxId;
     }
     
+    bool getPages(const std::string& usrName, SessionPages& pages) const
+    {
+        std::map<std::string, SessionPages>::const_iterator it = m_pagesForSessions.find(usrName);
+        if (it != m_pagesForSessions.cend())
+        {
+            pages = it->second;
+            return true;
+        }
+        return false;
+    }
+    
+    void setPages(const std::string& usrName, const SessionPages& pages)
+    {
+        m_pagesForSessions[usrName] = pages;
+    }
+    
+    bool getPendingDownloads(const std::string& usrName, std::vector<PendingDownload>& downloads) const
+    {
+        std::map<std::string, std::vector<PendingDownload>>::const_iterator it = m_pendingDownloads.find(usrName);
+        if (it != m_pendingDownloads.cend())
+        {
+            downloads = it->second;
+            return true;
+        }
+        return false;
+    }
+    
+    void setPendingDownloads(const std::string& usrName, const std::vector<PendingDownload>& downloads)
+    {
+        if (downloads.empty())
+        {
+            m_pendingDownloads.erase(usrName);
+        }
+        else
+        {
+            m_pendingDownloads[usrName] = downloads;
+        }
+    }
+    
     std::string serialize() const
     {
         Json::Value maxIdForSessions(Json::arrayValue);
@@ -74,13 +129,42 @@ public:
             itemObj["usrName"] = Json::Value(it->first);
             itemObj["maxId"] = Json::Value(it->second);
             
+            std::map<std::string, SessionPages>::const_iterator itPages = m_pagesForSessions.find(it->first);
+            if (itPages != m_pagesForSessions.cend())
+            {
+                itemObj["pages"] = serializePages(itPages->second);
+            }
+            
             maxIdForSessions.append(itemObj);
         }
         
+        Json::Value pendingDownloads(Json::arrayValue);
+        for (std::map<std::string, std::vector<PendingDownload>>::const_iterator it = m_pendingDownloads.cbegin(); it != m_pendingDownloads.cend(); ++it)
+        {
+            for (std::vector<PendingDownload>::const_iterator itDownload = it->second.cbegin(); itDownload != it->second.cend(); ++itDownload)
+            {
+                Json::Value itemObj(Json::objectValue);
+                itemObj["usrName"] = Json::Value(it->first);
+                itemObj["url"] = Json::Value(itDownload->url);
+                itemObj["output"] = Json::Value(itDownload->output);
+                itemObj["default"] = Json::Value(itDownload->defaultFile);
+                itemObj["mtime"] = Json::Value(static_cast<Json::Int64>(itDownload->mtime));
+                pendingDownloads.append(itemObj);
+            }
+        }
+        
         Json::Value contextObj(Json::objectValue);
         contextObj["options"] = Json::Value(m_options);
         contextObj["exportTime"] = Json::Value(static_cast<uint32_t>(m_exportTime));
         contextObj["sessions"] = maxIdForSessions;
+        if (m_incomplete)
+        {
+            contextObj["incomplete"] = Json::Value(true);
+        }
+        if (!m_pendingDownloads.empty())
+        {
+            contextObj["downloads"] = pendingDownloads;
+        }
         
         Json::FastWriter writer;
         return writer.write(contextObj);
@@ -109,7 +193,11 @@ public:
         m_options = contextObj["options"].asInt();
         m_exportTime = static_cast<std::time_t>(contextObj["exportTime"].asInt());
         
+        m_incomplete = contextObj.isMember("incomplete") && contextObj["incomplete"].asBool();
+        
         m_maxIdForSessions.clear();
+        m_pagesForSessions.clear();
+        m_pendingDownloads.clear();
         
         for (Json::ArrayIndex idx = 0; idx < maxIdForSessions.size(); idx++)
         {
@@ -121,8 +209,92 @@ public:
             }
             
             m_maxIdForSessions.insert(std::pair<std::string, int64_t>(itemObj["usrName"].asString(), itemObj["maxId"].asInt64()));
+            
+            // Exported by the older versions without the pages, which are all written again then
+            SessionPages pages;
+            if (itemObj.isMember("pages") && unserializePages(itemObj["pages"], pages))
+            {
+                m_pagesForSessions.insert(std::pair<std::string, SessionPages>(itemObj["usrName"].asString(), pages));
+            }
+        }
+        
+        // Only kept by the checkpoints, the downloads are started again by the resumed exporting
+        const Json::Value& pendingDownloads = contextObj["downloads"];
+        for (Json::ArrayIndex idx = 0; pendingDownloads.isArray() && idx < pendingDownloads.size(); idx++)
+        {
+            const Json::Value& itemObj = pendingDownloads[idx];
+            if (!itemObj.isObject() || !itemObj.isMember("usrName") || !itemObj.isMember("url") || !itemObj.isMember("output"))
+            {
+                continue;
+            }
+            PendingDownload download;
+            download.url = itemObj["url"].asString();
+            download.output = itemObj["output"].asString();
+            download.defaultFile = itemObj["default"].asString();
+            download.mtime = static_cast<time_t>(itemObj["mtime"].asInt64());
+            m_pendingDownloads[itemObj["usrName"].asString()].push_back(download);
+        }
+        
+        return true;
+    }
+    
+private:
+    static Json::Value serializePages(const SessionPages& pages)
+    {
+        Json::Value pageItems(Json::arrayValue);
+        for (std::vector<SessionPages::Page>::const_iterator it = pages.pages.cbegin(); it != pages.pages.cend(); ++it)
+        {
+            Json::Value pageObj(Json::objectValue);
+            pageObj["size"] = Json::Value(static_cast<Json::UInt64>(it->size));
+            pageObj["hash"] = Json::Value(it->hash);
+            pageObj["count"] = Json::Value(static_cast<Json::UInt64>(it->numberOfMessages));
+            pageObj["begin"] = Json::Value(static_cast<Json::UInt>(it->beginTime));
+            pageObj["end"] = Json::Value(static_cast<Json::UInt>(it->endTime));
+            pageItems.append(pageObj);
+        }
+        
+        Json::Value pagesObj(Json::objectValue);
+        pagesObj["pageSize"] = Json::Value(static_cast<Json::UInt64>(pages.pageSize));
+        pagesObj["pageBytes"] = Json::Value(static_cast<Json::UInt64>(pages.pageBytes));
+        pagesObj["desc"] = Json::Value(pages.descending);
+        pagesObj["numberOfMsgs"] = Json::Value(static_cast<Json::UInt64>(pages.numberOfMessages));
+        pagesObj["pages"] = pageItems;
+        pagesObj["indexShards"] = Json::Value(static_cast<Json::UInt64>(pages.numberOfIndexShards));
+        return pagesObj;
+    }
+    
+    static bool unserializePages(const Json::Value& pagesObj, SessionPages& pages)
+    {
+        if (!pagesObj.isObject() || !pagesObj.isMember("pageSize") || !pagesObj.isMember("desc") || !pagesObj.isMember("numberOfMsgs") || !pagesObj["pages"].isArray())
+        {
+            return false;
         }
         
+        pages.pageSize = static_cast<size_t>(pagesObj["pageSize"].asUInt64());
+        // Contexts written before the byte budget have neither it nor the counts of pages, nothing is reused
+        pages.pageBytes = pagesObj.isMember("pageBytes") ? static_cast<size_t>(pagesObj["pageBytes"].asUInt64()) : 0;
+        pages.descending = pagesObj["desc"].asBool();
+        pages.numberOfMessages = static_cast<size_t>(pagesObj["numberOfMsgs"].asUInt64());
+        // Contexts written before the search index have none
+        pages.numberOfIndexShards = pagesObj.isMember("indexShards") ? static_cast<size_t>(pagesObj["indexShards"].asUInt64()) : 0;
+        pages.pages.clear();
+        
+        const Json::Value& pageItems = pagesObj["pages"];
+        for (Json::ArrayIndex idx = 0; idx < pageItems.size(); idx++)
+        {
+            const Json::Value& pageObj = pageItems[idx];
+            if (!pageObj.isObject() || !pageObj.isMember("size") || !pageObj.isMember("hash"))
+            {
+                return false;
+            }
+            SessionPages::Page page;
+            page.size = pageObj["size"].asUInt64();
+            page.hash = pageObj["hash"].asString();
+            page.numberOfMessages = pageObj.isMember("count") ? static_cast<size_t>(pageObj["count"].asUInt64()) : 0;
+            page.beginTime = pageObj.isMember("begin") ? static_cast<uint32_t>(pageObj["begin"].asUInt()) : 0;
+            page.endTime = pageObj.isMember("end") ? static_cast<uint32_t>(pageObj["end"].asUInt()) : 0;
+            pages.pages.push_back(page);
+        }
         return true;
     }
 };
@@ -0,0 +1,122 @@
+//
+//  ExportMetrics.cpp
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#include "ExportMetrics.h"
+
+std::atomic<int64_t> g_exportMetrics[NUMBER_OF_EXPORT_METRICS];
+static std::atomic<uint64_t> g_memoryCeiling(0);
+
+void resetExportMetrics()
+{
+    // The bytes of the buffers living across the exportings, e.g. a prewarmed manifest, are kept
+    for (int metric = 0; metric < EXPORT_METRIC_MANIFEST_BYTES; ++metric)
+    {
+        g_exportMetrics[metric].store(0, std::memory_order_relaxed);
+    }
+}
+
+int64_t getAccountedMemory()
+{
+    int64_t bytes = g_exportMetrics[EXPORT_METRIC_MANIFEST_BYTES].load(std::memory_order_relaxed)
+        + g_exportMetrics[EXPORT_METRIC_DEFERRED_BYTES].load(std::memory_order_relaxed)
+        + g_exportMetrics[EXPORT_METRIC_PENDING_WRITE_BYTES].load(std::memory_order_relaxed)
+        + g_exportMetrics[EXPORT_METRIC_SESSION_BYTES].load(std::memory_order_relaxed);
+    return bytes > 0 ? bytes : 0;
+}
+
+void setExportMemoryCeiling(uint64_t bytes)
+{
+    g_memoryCeiling.store(bytes, std::memory_order_relaxed);
+}
+
+uint64_t getExportMemoryCeiling()
+{
+    return g_memoryCeiling.load(std::memory_order_relaxed);
+}
+
+bool isOverMemoryCeiling()
+{
+    uint64_t ceiling = g_memoryCeiling.load(std::memory_order_relaxed);
+    return ceiling > 0 && getAccountedMemory() > static_cast<int64_t>(ceiling);
+}
+
+ExportMetricsSampler::ExportMetricsSampler()
+{
+    reset();
+}
+
+void ExportMetricsSampler::reset()
+{
+    m_startTime = std::chrono::steady_clock::now();
+    m_sampleTime = m_startTime;
+    m_peakAccountedBytes = 0;
+    for (int metric = 0; metric < NUMBER_OF_EXPORT_METRICS; ++metric)
+    {
+        m_values[metric] = g_exportMetrics[metric].load(std::memory_order_relaxed);
+    }
+}
+
+void ExportMetricsSampler::sample(ExportMetrics& metrics)
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    int64_t values[NUMBER_OF_EXPORT_METRICS];
+    for (int metric = 0; metric < NUMBER_OF_EXPORT_METRICS; ++metric)
+    {
+        values[metric] = g_exportMetrics[metric].load(std::memory_order_relaxed);
+        if (values[metric] < 0)
+        {
+            // A gauge decreased by a task queued before the reset
+            values[metric] = 0;
+        }
+    }
+
+    metrics.numberOfMessages = static_cast<uint64_t>(values[EXPORT_METRIC_MESSAGES]);
+    metrics.downloadedBytes = static_cast<uint64_t>(values[EXPORT_METRIC_DOWNLOADED_BYTES]);
+    metrics.writtenBytes = static_cast<uint64_t>(values[EXPORT_METRIC_WRITTEN_BYTES]);
+    metrics.numberOfDownloads = static_cast<uint64_t>(values[EXPORT_METRIC_DOWNLOADS]);
+    metrics.numberOfFailedDownloads = static_cast<uint64_t>(values[EXPORT_METRIC_FAILED_DOWNLOADS]);
+    metrics.numberOfRetries = static_cast<uint64_t>(values[EXPORT_METRIC_RETRIES]);
+    metrics.queuedDownloads = static_cast<uint32_t>(values[EXPORT_METRIC_QUEUED_DOWNLOADS]);
+    metrics.runningDownloads = static_cast<uint32_t>(values[EXPORT_METRIC_RUNNING_DOWNLOADS]);
+    metrics.queuedCopies = static_cast<uint32_t>(values[EXPORT_METRIC_QUEUED_COPIES]);
+    metrics.deferredTasks = static_cast<uint32_t>(values[EXPORT_METRIC_DEFERRED_TASKS]);
+    metrics.queuedAudio = static_cast<uint32_t>(values[EXPORT_METRIC_QUEUED_AUDIO]);
+    metrics.queuedWrites = static_cast<uint32_t>(values[EXPORT_METRIC_QUEUED_WRITES]);
+    metrics.pendingWriteBytes = static_cast<uint64_t>(values[EXPORT_METRIC_PENDING_WRITE_BYTES]);
+    metrics.accountedBytes = static_cast<uint64_t>(values[EXPORT_METRIC_MANIFEST_BYTES] + values[EXPORT_METRIC_DEFERRED_BYTES] + values[EXPORT_METRIC_PENDING_WRITE_BYTES] + values[EXPORT_METRIC_SESSION_BYTES]);
+    if (metrics.accountedBytes > m_peakAccountedBytes)
+    {
+        m_peakAccountedBytes = metrics.accountedBytes;
+    }
+    metrics.peakAccountedBytes = m_peakAccountedBytes;
+
+    metrics.elapsedSeconds = std::chrono::duration<double>(now - m_startTime).count();
+    double seconds = std::chrono::duration<double>(now - m_sampleTime).count();
+    if (seconds > 0)
+    {
+        metrics.messagesPerSecond = (values[EXPORT_METRIC_MESSAGES] - m_values[EXPORT_METRIC_MESSAGES]) / seconds;
+        metrics.downloadedBytesPerSecond = (values[EXPORT_METRIC_DOWNLOADED_BYTES] - m_values[EXPORT_METRIC_DOWNLOADED_BYTES]) / seconds;
+        metrics.writtenBytesPerSecond = (values[EXPORT_METRIC_WRITTEN_BYTES] - m_values[EXPORT_METRIC_WRITTEN_BYTES]) / seconds;
+        metrics.retriesPerSecond = (values[EXPORT_METRIC_RETRIES] - m_values[EXPORT_METRIC_RETRIES]) / seconds;
+        metrics.failedDownloadsPerSecond = (values[EXPORT_METRIC_FAILED_DOWNLOADS] - m_values[EXPORT_METRIC_FAILED_DOWNLOADS]) / seconds;
+    }
+    else
+    {
+        metrics.messagesPerSecond = 0;
+        metrics.downloadedBytesPerSecond = 0;
+        metrics.writtenBytesPerSecond = 0;
+        metrics.retriesPerSecond = 0;
+        metrics.failedDownloadsPerSecond = 0;
+    }
+
+    m_sampleTime = now;
+    for (int metric = 0; metric < NUMBER_OF_EXPORT_METRICS; ++metric)
+    {
+        m_values[metric] = values[metric];
+    }
+}
@@ -0,0 +1,162 @@
+//
+//  ExportMetrics.h
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#ifndef ExportMetrics_h
+#define ExportMetrics_h
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Counters, totals since resetExportMetrics
+#define EXPORT_METRIC_MESSAGES              0
+#define EXPORT_METRIC_DOWNLOADED_BYTES      1
+#define EXPORT_METRIC_WRITTEN_BYTES         2
+#define EXPORT_METRIC_DOWNLOADS             3   // Completed downloads, the failed ones included
+#define EXPORT_METRIC_FAILED_DOWNLOADS      4
+#define EXPORT_METRIC_RETRIES               5
+// Gauges, what is there at the moment
+#define EXPORT_METRIC_QUEUED_DOWNLOADS      6
+#define EXPORT_METRIC_RUNNING_DOWNLOADS     7
+#define EXPORT_METRIC_QUEUED_COPIES         8
+#define EXPORT_METRIC_DEFERRED_TASKS        9
+#define EXPORT_METRIC_QUEUED_WRITES         10
+#define EXPORT_METRIC_PENDING_WRITE_BYTES   11
+#define EXPORT_METRIC_QUEUED_AUDIO          12
+// Gauges of the memory accounting, bytes of the major buffers
+#define EXPORT_METRIC_MANIFEST_BYTES        13  // Files of the loaded manifests
+#define EXPORT_METRIC_DEFERRED_BYTES        14  // Tasks held by the deferring, the spilled ones aren't counted
+#define EXPORT_METRIC_SESSION_BYTES         15  // Buffers of the sessions being exported
+#define NUMBER_OF_EXPORT_METRICS            16
+
+// Updated with relaxed atomics by the threads doing the work, so it costs nothing to them and
+// any thread can read them without a lock
+extern std::atomic<int64_t> g_exportMetrics[NUMBER_OF_EXPORT_METRICS];
+
+inline void addExportMetric(int metric, int64_t delta)
+{
+    g_exportMetrics[metric].fetch_add(delta, std::memory_order_relaxed);
+}
+
+void resetExportMetrics();
+
+// The memory accounting sums the gauges of bytes, the pending writes included.
+// Once it is over the ceiling the exporting streams instead of buffering: the deferred tasks are spilled to disk,
+// the writes wait for the queue to drain and the sessions flush their raw messages early
+int64_t getAccountedMemory();
+// bytes: 0 for no ceiling
+void setExportMemoryCeiling(uint64_t bytes);
+uint64_t getExportMemoryCeiling();
+bool isOverMemoryCeiling();
+
+// Bytes of a buffer in a gauge of the memory accounting, they are taken out once it is gone
+class AccountedBytes
+{
+public:
+    explicit AccountedBytes(int metric) : m_metric(metric), m_bytes(0)
+    {
+    }
+
+    ~AccountedBytes()
+    {
+        set(0);
+    }
+
+    void set(int64_t bytes)
+    {
+        if (bytes != m_bytes)
+        {
+            addExportMetric(m_metric, bytes - m_bytes);
+            m_bytes = bytes;
+        }
+    }
+
+private:
+    AccountedBytes(const AccountedBytes&);
+    AccountedBytes& operator=(const AccountedBytes&);
+
+    int m_metric;
+    int64_t m_bytes;
+};
+
+// High-water mark of the accounted memory while it is in scope, sampled by update
+class MemoryWatermark
+{
+public:
+    MemoryWatermark() : m_peak(0)
+    {
+        update();
+    }
+
+    // Returns true if the accounted memory is over the ceiling
+    bool update()
+    {
+        int64_t bytes = getAccountedMemory();
+        if (bytes > m_peak)
+        {
+            m_peak = bytes;
+        }
+        uint64_t ceiling = getExportMemoryCeiling();
+        return ceiling > 0 && bytes > static_cast<int64_t>(ceiling);
+    }
+
+    uint64_t getPeak() const
+    {
+        return static_cast<uint64_t>(m_peak);
+    }
+
+private:
+    int64_t m_peak;
+};
+
+// Snapshot of the exporting for the notifier, the rates are per second since the previous sample
+struct ExportMetrics
+{
+    uint64_t numberOfMessages;
+    uint64_t downloadedBytes;
+    uint64_t writtenBytes;
+    uint64_t numberOfDownloads;
+    uint64_t numberOfFailedDownloads;
+    uint64_t numberOfRetries;
+
+    uint32_t queuedDownloads;
+    uint32_t runningDownloads;
+    uint32_t queuedCopies;
+    uint32_t deferredTasks;
+    uint32_t queuedAudio;           // Voices waiting for the transcoding
+    uint32_t queuedWrites;
+    uint64_t pendingWriteBytes;
+    uint64_t accountedBytes;        // Sum of the gauges of the memory accounting
+    uint64_t peakAccountedBytes;    // Since the sampler was reset, at the samples
+
+    double elapsedSeconds;          // Since the sampler was reset
+    double messagesPerSecond;
+    double downloadedBytesPerSecond;
+    double writtenBytesPerSecond;
+    double retriesPerSecond;
+    double failedDownloadsPerSecond;
+};
+
+// Reads the metrics and computes the rates from the previous sample, it is used by one thread at a time.
+// A GUI or a command line tool can keep one of its own and sample on its timer
+class ExportMetricsSampler
+{
+public:
+    ExportMetricsSampler();
+
+    void reset();
+    void sample(ExportMetrics& metrics);
+
+private:
+    std::chrono::steady_clock::time_point m_startTime;
+    std::chrono::steady_clock::time_point m_sampleTime;
+    int64_t m_values[NUMBER_OF_EXPORT_METRICS];
+    uint64_t m_peakAccountedBytes;
+};
+
+#endif /* ExportMetrics_h */
@@ -1,6 +1,8 @@
 #ifndef ExportNotifier_h
 #define ExportNotifier_h
 
+#include "ExportMetrics.h"
+
 class ExportNotifier
 {
 public:
@@ -21,6 +23,11 @@ public:
     virtual void onTasksStart(const std::string& usrName, uint32_t numberOfTotalTasks) const = 0;
     virtual void onTasksProgress(const std::string& usrName, uint32_t numberOfCompletedTasks, uint32_t numberOfTotalMessages) const = 0;
     virtual void onTasksComplete(const std::string& usrName, bool cancelled) const = 0;
+    
+    // Throughput and queues of the exporting, sampled every metrics interval of the Exporter on its threads
+    virtual void onMetrics(const ExportMetrics& /*metrics*/) const {}
+    // High-water mark of the accounted memory while the session was exported, the other sessions at the same time included
+    virtual void onSessionMemory(const std::string& /*sessionUsrName*/, void * /*sessionData*/, uint64_t /*peakBytes*/) const {}
 
 };
 
@@ -8,6 +8,8 @@
 
 #include "Exporter.h"
 #include <json/json.h>
+#include <deque>
+#include <algorithm>
 #ifdef USING_DOWNLOADER
 #include "Downloader.h"
 #else
@@ -16,12 +18,197 @@
 #include "TaskManager.h"
 #include "WechatParser.h"
 #include "ExportContext.h"
+#include "SqliteConnectionPool.h"
+#include "SessionWriter.h"
+#include "WriteQueue.h"
+#include "MessagePipeline.h"
+#include "XmlParser.h"
+#include "TranscodeCache.h"
+#include "MediaManifest.h"
+#include "ExportBudget.h"
+#include "Tracing.h"
+#include "ProgressThrottle.h"
+#include "ArchiveWriter.h"
+#include <libxml/parser.h>
 #ifdef _WIN32
 #include <winsock.h>
 #endif
 
 #define WXEXP_DATA_FOLDER   ".wxexp"
 #define WXEXP_DATA_FILE   "wxexp.dat"
+#define WXEXP_TRANSCODE_FILE    "transcodes.dat"
+#define WXEXP_MEDIA_FILE    "media.dat"
+#define WXEXP_DOWNLOAD_CACHE_SIZE   (512ULL * 1024 * 1024)
+// Seconds between two checkpoints of the export context
+#define WXEXP_CHECKPOINT_INTERVAL   60
+#define WXEXP_SPILL_FILE    "deferred.tmp"
+// Messages between two updates of the memory of a session
+#define WXEXP_MEMORY_CHECK_MESSAGES 1024
+// Over the memory ceiling, a session smaller than it isn't flushed early, so a ceiling taken by the others doesn't flush it for each check
+#define WXEXP_MIN_FLUSH_BYTES       (1024 * 1024)
+// Pages of scripts are closed at this size as well as at the number of messages, so pages of media messages aren't much bigger than the ones of text
+#define WXEXP_PAGE_BYTES            (512 * 1024)
+
+#define WECHAT_DOMAIN         "AppDomain-com.tencent.xin"
+#define WECHAT_SHARE_DOMAIN   "AppDomainGroup-group.com.tencent.xin"
+
+// Slots of the media of a message and their kinds in the archive
+static const std::pair<TemplateValueSlot, const char*> ARCHIVE_MEDIA_SLOTS[] = {
+    std::make_pair(TVS_IMGPATH, "image"),
+    std::make_pair(TVS_IMGTHUMBPATH, "thumb"),
+    std::make_pair(TVS_VIDEOPATH, "video"),
+    std::make_pair(TVS_THUMBPATH, "videothumb"),
+    std::make_pair(TVS_AUDIOPATH, "audio"),
+    std::make_pair(TVS_EMOJIPATH, "emoji"),
+    std::make_pair(TVS_SHARINGURL, "link"),
+    std::make_pair(TVS_SHARINGIMGPATH, "linkimage"),
+    std::make_pair(TVS_CARDIMGPATH, "cardimage"),
+    std::make_pair(TVS_APPICONPATH, "appicon"),
+    std::make_pair(TVS_CHANNELURL, "channel"),
+    std::make_pair(TVS_CHANNELTHUMBPATH, "channelthumb"),
+};
+
+// Texts of the values are html, they are taken as plain text
+static void fillArchiveMessage(const WXMSGROW& row, const Session& session, const Friend& user, const TemplateValuesList& tvs, ArchiveMessage& message)
+{
+    message.clear();
+    message.msgId = row.msgIdValue;
+    message.createTime = row.createTime;
+    message.type = row.type;
+    message.outgoing = row.des == 0;
+
+    // Sender of the chatroom as MessageParser::parse takes it
+    const char* content = row.content;
+    const char* end = row.content + row.contentLength;
+    if (message.outgoing)
+    {
+        message.sender = user.getUsrName();
+    }
+    else if (session.isChatroom())
+    {
+        const char* enter = std::search(content, end, ":\n", ":\n" + 2);
+        if (enter != end && enter + 2 < end)
+        {
+            message.sender.assign(content, enter - content);
+            content = enter + 2;
+        }
+    }
+    else
+    {
+        message.sender = session.getUsrName();
+    }
+
+    if (row.type == MessageParser::MSGTYPE_TEXT)
+    {
+        message.text.assign(content, end - content);
+    }
+    else
+    {
+        message.content.assign(content, end - content);
+    }
+    if (tvs.size() == 0)
+    {
+        return;
+    }
+
+    const TemplateValues& tv = *tvs.cbegin();
+    const std::string& name = tv.get(TVS_NAME);
+    appendHtmlText(message.senderName, name.c_str(), name.size());
+    if (row.type != MessageParser::MSGTYPE_TEXT)
+    {
+        // The forwarded messages follow the message itself
+        const TemplateValueSlot textSlots[] = { TVS_SHARINGTITLE, TVS_MESSAGE, TVS_CARDNAME, TVS_REFERMSG };
+        for (TemplateValuesList::const_iterator it = tvs.cbegin(); it != tvs.cend(); ++it)
+        {
+            for (size_t idx = 0; idx < sizeof(textSlots) / sizeof(textSlots[0]); ++idx)
+            {
+                const std::string& value = it->get(textSlots[idx]);
+                if (value.empty())
+                {
+                    continue;
+                }
+                if (!message.text.empty())
+                {
+                    message.text.push_back('\n');
+                }
+                appendHtmlText(message.text, value.c_str(), value.size());
+            }
+        }
+    }
+
+    for (size_t idx = 0; idx < sizeof(ARCHIVE_MEDIA_SLOTS) / sizeof(ARCHIVE_MEDIA_SLOTS[0]); ++idx)
+    {
+        const std::string& path = tv.get(ARCHIVE_MEDIA_SLOTS[idx].first);
+        if (path.empty() || (ARCHIVE_MEDIA_SLOTS[idx].first == TVS_IMGTHUMBPATH && path == tv.get(TVS_IMGPATH)))
+        {
+            continue;
+        }
+        const char* kind = ARCHIVE_MEDIA_SLOTS[idx].second;
+        if (ARCHIVE_MEDIA_SLOTS[idx].first == TVS_SHARINGURL && tv.get(TVS_MSGTYPE) == "file")
+        {
+            kind = "file";
+        }
+        message.media.push_back(std::make_pair(std::string(kind), path));
+    }
+}
+
+static bool loadITunesDbs(ITunesDb* iTunesDb, ITunesDb* iTunesDbShare, bool detailedInfo)
+{
+    // Both are read-only scans of the same immutable Manifest.db, so run them side by side
+    std::thread shareThread([iTunesDbShare]() {
+        setThreadName("itunes_share");
+        iTunesDbShare->load(WECHAT_SHARE_DOMAIN);   // Optional
+    });
+    bool result = iTunesDb->load(WECHAT_DOMAIN, !detailedInfo);
+    shareThread.join();
+    return result;
+}
+
+// Full loading of ITunesDb started in background while sessions are being chosen on UI
+struct ITunesPrewarming
+{
+    std::string backup;
+    ITunesDb* iTunesDb;
+    ITunesDb* iTunesDbShare;
+    std::thread thread;
+    bool succeeded;
+    
+    ITunesPrewarming(const std::string& backupPath) : backup(backupPath), succeeded(false)
+    {
+        iTunesDb = new ITunesDb(backup, "Manifest.db");
+        iTunesDbShare = new ITunesDb(backup, "Manifest.db");
+    }
+    
+    ~ITunesPrewarming()
+    {
+        wait();
+        if (NULL != iTunesDb) delete iTunesDb;
+        if (NULL != iTunesDbShare) delete iTunesDbShare;
+    }
+    
+    void wait()
+    {
+        if (thread.joinable())
+        {
+            thread.join();
+        }
+    }
+};
+
+static std::mutex g_prewarmingMutex;
+static ITunesPrewarming* g_prewarming = NULL;
+
+static ITunesPrewarming* takePrewarming(const std::string& backup, bool anyBackup)
+{
+    std::lock_guard<std::mutex> lock(g_prewarmingMutex);
+    ITunesPrewarming* prewarming = g_prewarming;
+    if (NULL != prewarming && (anyBackup || prewarming->backup == backup))
+    {
+        g_prewarming = NULL;
+        return prewarming;
+    }
+    return NULL;
+}
 
 Exporter::Exporter(const std::string& workDir, const std::string& backup, const std::string& output, Logger* logger, PdfConverter* pdfConverter)
 {
@@ -31,15 +218,42 @@ Exporter::Exporter(const std::string& workDir, const std::string& backup, const
     m_workDir = workDir;
     m_backup = backup;
     m_output = output;
-    m_logger = logger;
+    m_logger = (NULL != logger) ? new AsyncLogger(logger) : NULL;
     m_pdfConverter = pdfConverter;
     m_notifier = NULL;
+    m_loadingNotifier = NULL;
     m_cancelled = false;
     m_options = 0;
     m_loadingDataOnScroll = false; // disabled by default
+    m_cachingManifest = false;
+    m_estimatingRecordCounts = false;
+    m_sessionThreads = 1;
+    m_pipelineThreads = 1;
+    m_pipelineMinMessages = 20000;
+    m_pdfPartMessages = 0;
+    m_mediaLinkMode = MEDIA_LINK_NONE;
     m_extName = "html";
     m_templatesName = "templates";
     m_exportContext = NULL;
+    m_checkpointTime = 0;
+    m_taskManager = NULL;
+    m_dbPool = NULL;
+    m_archive = NULL;
+    m_writeQueue = NULL;
+    m_sharedWriteQueue = NULL;
+    m_budget = NULL;
+    m_budgetJobId = 0;
+    m_audioThreads = 0;
+    m_downloadCacheSize = WXEXP_DOWNLOAD_CACHE_SIZE;
+    m_downloadCache = NULL;
+    m_transcodeCache = NULL;
+    m_mediaManifest = NULL;
+    m_minDownloadsPerHost = 2;
+    m_maxDownloadsPerHost = 16;
+    m_deferringMedia = false;
+    m_metricsInterval = 1000;
+    m_memoryCeiling = 0;
+    m_messageStrings = new LocaleStrings();
 }
 
 Exporter::~Exporter()
@@ -50,6 +264,10 @@ Exporter::~Exporter()
         m_exportContext = NULL;
     }
     releaseITunes();
+    delete m_messageStrings;
+    m_messageStrings = NULL;
+    // The lines left are delivered
+    delete m_logger;
     m_logger = NULL;
     m_notifier = NULL;
 }
@@ -61,15 +279,44 @@ void Exporter::initializeExporter()
 #else
     DownloadTask::initialize();
 #endif
+    // Sessions may be parsed on several threads
+    xmlInitParser();
 }
 
 void Exporter::uninitializeExporter()
 {
+    ITunesPrewarming* prewarming = takePrewarming("", true);
+    if (NULL != prewarming)
+    {
+        delete prewarming;
+    }
+
 #ifdef USING_DOWNLOADER
     Downloader::uninitialize();
 #else
     DownloadTask::uninitialize();
 #endif
+    releaseAudioCodecs();
+}
+
+void Exporter::prewarmITunes(const std::string& backup)
+{
+    ITunesPrewarming* prewarming = new ITunesPrewarming(backup);
+    prewarming->thread = std::thread([prewarming]() {
+        setThreadName("itunes_prewarm");
+        prewarming->succeeded = loadITunesDbs(prewarming->iTunesDb, prewarming->iTunesDbShare, true);
+    });
+    
+    ITunesPrewarming* previous = NULL;
+    {
+        std::lock_guard<std::mutex> lock(g_prewarmingMutex);
+        previous = g_prewarming;
+        g_prewarming = prewarming;
+    }
+    if (NULL != previous)
+    {
+        delete previous;
+    }
 }
 
 bool Exporter::hasPreviousExporting(const std::string& outputDir, int& options, std::string& exportTime)
@@ -113,11 +360,75 @@ bool Exporter::loadExportContext(const std::string& contextFile, ExportContext *
     return true;
 }
 
+bool Exporter::saveExportContext(bool incomplete)
+{
+    m_exportContext->setIncomplete(incomplete);
+    m_exportContext->refreshExportTime();
+    // Moved over the previous one, so a crash never leaves a broken context
+    std::string fileName = combinePath(m_output, WXEXP_DATA_FOLDER, WXEXP_DATA_FILE);
+    std::string tmpFileName = fileName + ".tmp";
+    if (!writeFile(tmpFileName, m_exportContext->serialize()))
+    {
+        return false;
+    }
+    return moveFile(tmpFileName, fileName);
+}
+
+void Exporter::updateExportContext(const Session& session, int64_t maxMsgId, const SessionPages* sessionPages)
+{
+    std::lock_guard<std::mutex> lock(m_contextMutex);
+    if (maxMsgId > 0)
+    {
+        m_exportContext->setMaxId(session.getUsrName(), maxMsgId);
+    }
+    if (NULL != sessionPages)
+    {
+        m_exportContext->setPages(session.getUsrName(), *sessionPages);
+    }
+}
+
+bool Exporter::isCheckpointDue() const
+{
+    return std::time(NULL) - m_checkpointTime >= WXEXP_CHECKPOINT_INTERVAL;
+}
+
+void Exporter::checkpoint()
+{
+    std::lock_guard<std::mutex> lock(m_contextMutex);
+    m_checkpointTime = std::time(NULL);
+    if (NULL != m_taskManager)
+    {
+        std::map<std::string, std::vector<PendingDownload>> downloads;
+        m_taskManager->getPendingDownloads(downloads);
+        for (std::map<std::string, std::vector<PendingDownload>>::const_iterator it = downloads.cbegin(); it != downloads.cend(); ++it)
+        {
+            m_exportContext->setPendingDownloads(it->first, it->second);
+        }
+    }
+    if (m_exportContext->getNumberOfSessions() > 0 && !saveExportContext(true))
+    {
+        m_logger->debug("Failed to save the checkpoint of the exporting.");
+    }
+    if (NULL != m_transcodeCache)
+    {
+        m_transcodeCache->save();
+    }
+    if (NULL != m_mediaManifest)
+    {
+        m_mediaManifest->save();
+    }
+}
+
 void Exporter::setNotifier(ExportNotifier *notifier)
 {
     m_notifier = notifier;
 }
 
+void Exporter::setLoadingNotifier(LoadingNotifier *loadingNotifier)
+{
+    m_loadingNotifier = loadingNotifier;
+}
+
 bool Exporter::isRunning() const
 {
     return m_running;
@@ -138,6 +449,16 @@ void Exporter::waitForComplition()
     m_thread.join();
 }
 
+void Exporter::setOptions(int options)
+{
+    m_options = options;
+}
+
+int Exporter::getOptions() const
+{
+    return m_options;
+}
+
 void Exporter::setTextMode(bool textMode/* = true*/)
 {
     if (textMode)
@@ -155,6 +476,16 @@ void Exporter::setPdfMode(bool pdfMode/* = true*/)
         m_options &= ~SPO_PDF_MODE;
 }
 
+void Exporter::setPdfPartSize(unsigned int numberOfMessages)
+{
+    m_pdfPartMessages = numberOfMessages;
+}
+
+void Exporter::setMediaLinkMode(int linkMode)
+{
+    m_mediaLinkMode = linkMode;
+}
+
 void Exporter::setOrder(bool asc/* = true*/)
 {
     if (asc)
@@ -179,6 +510,30 @@ void Exporter::setSyncLoading(bool syncLoading/* = true*/)
         m_options &= ~SPO_SYNC_LOADING;
 }
 
+void Exporter::setRawAudio(bool rawAudio/* = true*/)
+{
+    if (rawAudio)
+        m_options |= SPO_RAW_AUDIO;
+    else
+        m_options &= ~SPO_RAW_AUDIO;
+}
+
+void Exporter::setArchiveMode(bool archiveMode/* = true*/)
+{
+    if (archiveMode)
+        m_options |= SPO_ARCHIVE;
+    else
+        m_options &= ~SPO_ARCHIVE;
+}
+
+void Exporter::setCompressingPages(bool compressingPages/* = true*/)
+{
+    if (compressingPages)
+        m_options |= SPO_COMPRESS_PAGES;
+    else
+        m_options &= ~SPO_COMPRESS_PAGES;
+}
+
 void Exporter::setLoadingDataOnScroll(bool loadingDataOnScroll/* = true*/)
 {
     m_loadingDataOnScroll = loadingDataOnScroll;
@@ -192,6 +547,78 @@ void Exporter::setIncrementalExporting(bool incrementalExporting)
         m_options &= ~SPO_INCREMENTAL_EXP;
 }
 
+void Exporter::setCachingManifest(bool cachingManifest/* = true*/)
+{
+    m_cachingManifest = cachingManifest;
+}
+
+void Exporter::setEstimatingRecordCounts(bool estimatingRecordCounts/* = true*/)
+{
+    m_estimatingRecordCounts = estimatingRecordCounts;
+}
+
+void Exporter::setDownloadCache(const std::string& cacheDir, uint64_t maxSize)
+{
+    m_downloadCacheDir = cacheDir;
+    m_downloadCacheSize = maxSize;
+}
+
+void Exporter::setDownloadConcurrency(unsigned int minTransfersPerHost/* = 2*/, unsigned int maxTransfersPerHost/* = 16*/)
+{
+    m_minDownloadsPerHost = minTransfersPerHost;
+    m_maxDownloadsPerHost = maxTransfersPerHost;
+}
+
+void Exporter::setDeferringMedia(bool deferringMedia/* = true*/)
+{
+    m_deferringMedia = deferringMedia;
+}
+
+void Exporter::setMetricsInterval(unsigned int intervalMs/* = 1000*/)
+{
+    m_metricsInterval = intervalMs;
+}
+
+void Exporter::setMemoryCeiling(uint64_t bytes/* = 0*/)
+{
+    m_memoryCeiling = bytes;
+}
+
+void Exporter::setParallelSessions(unsigned int numberOfThreads/* = 0*/)
+{
+    if (numberOfThreads == 0)
+    {
+        numberOfThreads = std::thread::hardware_concurrency();
+    }
+    m_sessionThreads = (numberOfThreads == 0) ? 1 : numberOfThreads;
+}
+
+void Exporter::setSessionPipeline(unsigned int numberOfThreads/* = 0*/, unsigned int minMessages/* = 20000*/)
+{
+    if (numberOfThreads == 0)
+    {
+        numberOfThreads = std::thread::hardware_concurrency();
+    }
+    m_pipelineThreads = (numberOfThreads == 0) ? 1 : numberOfThreads;
+    m_pipelineMinMessages = minMessages;
+}
+
+void Exporter::setAudioThreads(unsigned int numberOfThreads/* = 0*/)
+{
+    m_audioThreads = numberOfThreads;
+}
+
+void Exporter::setBudget(ExportBudget* budget, unsigned int jobId)
+{
+    m_budget = budget;
+    m_budgetJobId = jobId;
+}
+
+void Exporter::setWriteQueue(WriteQueue* writeQueue)
+{
+    m_sharedWriteQueue = writeQueue;
+}
+
 void Exporter::supportsFilter(bool supportsFilter/* = true*/)
 {
     if (supportsFilter)
@@ -278,12 +705,36 @@ bool Exporter::loadUsersAndSessions()
     }
 
     m_logger->debug("Wechat Users loaded.");
+    if (NULL != m_loadingNotifier)
+    {
+        m_loadingNotifier->onUsersLoaded(users);
+    }
     m_usersAndSessions.reserve(users.size()); // Avoid re-allocation and causing the pointer changed
+    // The accounts, their session databases, cell data and message databases are loaded in parallel
+    TaskGraph graph;
+    std::deque<Friends> friendsOfUsers;
+    std::deque<SessionsParser> sessionsParsers;
     for (std::vector<Friend>::const_iterator it = users.cbegin(); it != users.cend(); ++it)
     {
         std::vector<std::pair<Friend, std::vector<Session>>>::iterator it2 = m_usersAndSessions.emplace(m_usersAndSessions.cend(), std::pair<Friend, std::vector<Session>>(*it, std::vector<Session>()));
-        Friends friends;
-        loadUserFriendsAndSessions(it2->first, friends, it2->second, false);
+        friendsOfUsers.emplace_back();
+        sessionsParsers.emplace_back(m_iTunesDb, m_iTunesDbShare, m_wechatInfo.getCellDataVersion(), false);
+        if (NULL != m_loadingNotifier)
+        {
+            size_t userIndex = std::distance(users.cbegin(), it);
+            std::vector<Session>& sessions = it2->second;
+            sessionsParsers.back().setStageHandler([this, userIndex, &sessions](int stage) {
+                std::vector<Session> loadedSessions(sessions);
+                std::sort(loadedSessions.begin(), loadedSessions.end(), SessionLastMsgTimeCompare());
+                m_loadingNotifier->onSessionsLoaded(userIndex, loadedSessions, stage);
+            });
+        }
+        addUserFriendsAndSessionsTasks(graph, sessionsParsers.back(), it2->first, friendsOfUsers.back(), it2->second, false);
+    }
+    graph.run();
+    for (std::vector<std::pair<Friend, std::vector<Session>>>::iterator it = m_usersAndSessions.begin(); it != m_usersAndSessions.end(); ++it)
+    {
+        std::sort(it->second.begin(), it->second.end(), SessionLastMsgTimeCompare());
     }
 
     return true;
@@ -296,13 +747,22 @@ void Exporter::swapUsersAndSessions(std::vector<std::pair<Friend, std::vector<Se
 
 bool Exporter::runImpl()
 {
-#if !defined(NDEBUG) || defined(DBG_PERF)
     setThreadName("exp");
-#endif
+    TraceSpan span("export", "runImpl");
     time_t startTime;
     std::time(&startTime);
+    resetExportMetrics();
+    setExportMemoryCeiling(m_memoryCeiling);
+    {
+        std::lock_guard<std::mutex> lock(m_metricsMutex);
+        m_metricsSampler.reset();
+        m_metricsTime = std::chrono::steady_clock::now();
+    }
     notifyStart();
     
+    // Only this exporting changes the outputs while it runs
+    enablePathCache(true);
+    
 #ifndef NDEBUG
     makeDirectory(combinePath(m_output, "dbg"));
 #endif
@@ -314,10 +774,13 @@ bool Exporter::runImpl()
     if (!loadITunes())
     {
         m_logger->write(formatString(getLocaleString("Failed to parse the backup data of iTunes in the directory: %s"), m_backup.c_str()));
+        enablePathCache(false);
         notifyComplete();
         return false;
     }
     m_logger->debug("ITunes Database loaded.");
+    m_iTunesDb->setLinkMode(m_mediaLinkMode);
+    m_iTunesDbShare->setLinkMode(m_mediaLinkMode);
     
     WechatInfoParser wechatInfoParser(m_iTunesDb);
     if (wechatInfoParser.parse(m_wechatInfo))
@@ -340,6 +803,7 @@ bool Exporter::runImpl()
 #if !defined(NDEBUG) || defined(DBG_PERF)
         m_logger->debug(loginInfo2Parser.getError());
 #endif
+        enablePathCache(false);
         notifyComplete();
         return false;
     }
@@ -357,19 +821,83 @@ bool Exporter::runImpl()
     }
     int orgOptions = m_options;
     std::string contextFileName = combinePath(m_output, WXEXP_DATA_FOLDER, WXEXP_DATA_FILE);
-    if ((m_options & SPO_INCREMENTAL_EXP) && loadExportContext(contextFileName, m_exportContext))
+    bool hasContext = loadExportContext(contextFileName, m_exportContext);
+    // An exporting cancelled or crashed with the same options is resumed from its last checkpoint
+    bool resuming = hasContext && m_exportContext->isIncomplete() && (m_exportContext->getOptions() & ~SPO_INCREMENTAL_EXP) == (m_options & ~SPO_INCREMENTAL_EXP);
+    if (hasContext && ((m_options & SPO_INCREMENTAL_EXP) || resuming))
     {
+        if (resuming)
+        {
+            m_logger->write(getLocaleString("Resuming the previous exporting."));
+        }
         // Use the previous options
         m_options = m_exportContext->getOptions() | SPO_INCREMENTAL_EXP;
     }
     else
     {
         // If there is no export context, save current options
+        delete m_exportContext;
+        m_exportContext = new ExportContext();
         m_exportContext->setOptions(m_options);
     }
+    if ((m_options & SPO_RAW_AUDIO) && !existsFile(combinePath(m_workDir, "res", "silk", "silk.js")))
+    {
+        // The pages can't play the SILK without their decoder, the voices are transcoded as usual
+        m_logger->write(getLocaleString("The SILK decoder of the pages (res/silk/silk.js) is missing, the voices are converted to mp3."));
+        m_options &= ~SPO_RAW_AUDIO;
+    }
+    m_checkpointTime = std::time(NULL);
     
     std::string htmlBody;
 
+    // Sessions share a few message databases, keep them open during the exporting
+    m_dbPool = new SqliteConnectionPool();
+    // Rendered files are written behind the parsing
+    m_writeQueue = (NULL != m_sharedWriteQueue) ? m_sharedWriteQueue : new WriteQueue(2, 64 * 1024 * 1024);
+    m_indexWrites = WriteQueue::Group();
+    std::string downloadCacheDir = m_downloadCacheDir;
+    if (downloadCacheDir.empty() && m_cachingManifest)
+    {
+        downloadCacheDir = combinePath(m_output, WXEXP_DATA_FOLDER, "downloads");
+    }
+    if (!downloadCacheDir.empty())
+    {
+        m_downloadCache = new DownloadCache(downloadCacheDir, m_downloadCacheSize);
+        if (!m_downloadCache->load())
+        {
+            delete m_downloadCache;
+            m_downloadCache = NULL;
+        }
+    }
+    
+    // Same voices into the same output, the mp3 files of the previous exporting are kept
+    m_transcodeCache = new TranscodeCache(m_output, combinePath(m_output, WXEXP_DATA_FOLDER, WXEXP_TRANSCODE_FILE));
+    m_transcodeCache->load();
+    // Media of the backup already in the output, an incremental exporting doesn't stat them again.
+    // The other exportings start with an empty one and record the files as they go
+    m_mediaManifest = new MediaManifest(m_output, combinePath(m_output, WXEXP_DATA_FOLDER, WXEXP_MEDIA_FILE));
+    if ((m_options & SPO_INCREMENTAL_EXP) == SPO_INCREMENTAL_EXP)
+    {
+        m_mediaManifest->load();
+    }
+    m_iTunesDb->setMediaManifest(m_mediaManifest);
+    m_iTunesDbShare->setMediaManifest(m_mediaManifest);
+    
+    TaskManager* taskManager = new TaskManager(m_logger, m_audioThreads);
+#ifndef NDEBUG
+    m_logger->debug("UA: " + m_wechatInfo.buildUserAgent());
+#endif
+    taskManager->setNotifier(m_notifier);
+    taskManager->setUserAgent(m_wechatInfo.buildUserAgent());
+    taskManager->setDownloadCache(m_downloadCache);
+    taskManager->setTranscodeCache(m_transcodeCache);
+    taskManager->setDownloadConcurrency(m_minDownloadsPerHost, m_maxDownloadsPerHost);
+    taskManager->setSpillFile(combinePath(m_output, WXEXP_DATA_FOLDER, WXEXP_SPILL_FILE));
+    {
+        std::lock_guard<std::mutex> lock(m_contextMutex);
+        m_taskManager = taskManager;
+    }
+    
     std::set<std::string> userFileNames;
     for (std::vector<Friend>::iterator it = users.begin(); it != users.end(); ++it)
     {
@@ -411,20 +939,101 @@ bool Exporter::runImpl()
         htmlBody += userItem;
     }
     
-    std::string fileName = combinePath(m_output, "index." + m_extName);
-
-    std::string html = getTemplate("listframe");
-    replaceAll(html, "%%USERNAME%%", "");
-    replaceAll(html, "%%TBODY%%", htmlBody);
+    if ((m_options & SPO_ARCHIVE) == 0)
+    {
+        std::string fileName = combinePath(m_output, "index." + m_extName);
+        
+        std::string html = getTemplate("listframe");
+        replaceAll(html, "%%USERNAME%%", "");
+        replaceAll(html, "%%TBODY%%", htmlBody);
+        
+        m_writeQueue->write(fileName, html, false, &m_indexWrites);
+    }
+    
+    // Downloads of the accounts run behind the parsing of the next ones, the last ones are waited for here
+    if (m_cancelled)
+    {
+        taskManager->cancel();
+    }
+    else
+    {
+        std::string queueDesc;
+        if (taskManager->getNumberOfQueue(queueDesc) > 0)
+        {
+            m_logger->write("Waiting for tasks: " + queueDesc);
+        }
+        taskManager->shutdown();
+    }
+    unsigned int timeout = m_cancelled ? 0 : 512;
+    while (!taskManager->waitForCompltion(timeout))
+    {
+        notifyMetrics();
+        if (m_cancelled)
+        {
+            taskManager->cancel();
+            timeout = 0;
+        }
+    }
+    {
+        // Downloads dropped by cancel are started again by the resumed exporting
+        std::map<std::string, std::vector<PendingDownload>> downloads;
+        taskManager->getPendingDownloads(downloads);
+        std::lock_guard<std::mutex> lock(m_contextMutex);
+        for (std::map<std::string, std::vector<PendingDownload>>::const_iterator it = downloads.cbegin(); it != downloads.cend(); ++it)
+        {
+            m_exportContext->setPendingDownloads(it->first, it->second);
+        }
+        m_taskManager = NULL;
+    }
+#if !defined(NDEBUG) || defined(DBG_PERF)
+    m_logger->debug("PERF: Download tables " + taskManager->getTableStats());
+#endif
+    // The downloads are added into the cache until the executors are deleted
+    delete taskManager;
+    taskManager = NULL;
+    
+    // The queue of the batch is flushed by the batch, the other exportings only wait for their own writes
+    bool written = m_writeQueue->wait(m_indexWrites);
+    if (m_writeQueue != m_sharedWriteQueue)
+    {
+        written = m_writeQueue->flush() && written;
+        delete m_writeQueue;
+    }
+    if (!written)
+    {
+        m_logger->write(getLocaleString("Failed to write some of the exported files."));
+    }
+    m_writeQueue = NULL;
     
-    writeFile(fileName, html);
+    delete m_dbPool;
+    m_dbPool = NULL;
+    
+    if (NULL != m_downloadCache)
+    {
+        m_downloadCache->save();
+        delete m_downloadCache;
+        m_downloadCache = NULL;
+    }
+    if (NULL != m_transcodeCache)
+    {
+        m_transcodeCache->save();
+        delete m_transcodeCache;
+        m_transcodeCache = NULL;
+    }
+    if (NULL != m_mediaManifest)
+    {
+        m_iTunesDb->setMediaManifest(NULL);
+        m_iTunesDbShare->setMediaManifest(NULL);
+        m_mediaManifest->save();
+        delete m_mediaManifest;
+        m_mediaManifest = NULL;
+    }
     
     m_options = orgOptions;
     if (m_exportContext->getNumberOfSessions() > 0)
     {
-        m_exportContext->refreshExportTime();
-        fileName = combinePath(m_output, WXEXP_DATA_FOLDER, WXEXP_DATA_FILE);
-        writeFile(fileName, m_exportContext->serialize());
+        // A cancelled exporting is resumed by the next one
+        saveExportContext(m_cancelled);
     }
     
     delete m_exportContext;
@@ -442,7 +1051,27 @@ bool Exporter::runImpl()
         << std::setfill('0') << std::setw(2) << (seconds % 60);
     
     m_logger->write(formatString(getLocaleString((m_cancelled ? "Cancelled in %s." : "Completed in %s.")), stream.str().c_str()));
+#if !defined(NDEBUG) || defined(DBG_PERF)
+    uint64_t xpathHits = 0;
+    uint64_t xpathMisses = 0;
+    size_t numberOfXPaths = 0;
+    XmlParser::getXPathCacheStats(xpathHits, xpathMisses, numberOfXPaths);
+    m_logger->debug(formatString("PERF: XPath cache hits=%llu, misses=%llu, expressions=%u", static_cast<unsigned long long>(xpathHits), static_cast<unsigned long long>(xpathMisses), static_cast<unsigned int>(numberOfXPaths)));
+    uint64_t numberOfCopiedFiles = 0;
+    uint64_t copiedBytes = 0;
+    uint64_t copyTime = 0;
+    getCopyStats(numberOfCopiedFiles, copiedBytes, copyTime);
+    m_logger->debug(formatString("PERF: Copied %llu files, %llu bytes in %llums, %.1fMB/s", static_cast<unsigned long long>(numberOfCopiedFiles), static_cast<unsigned long long>(copiedBytes), static_cast<unsigned long long>(copyTime / 1000), copyTime > 0 ? (static_cast<double>(copiedBytes) / copyTime) : 0.0));
+    uint64_t numberOfClips = 0;
+    uint64_t numberOfEncoders = 0;
+    uint64_t audioSetupTime = 0;
+    getAudioStats(numberOfClips, numberOfEncoders, audioSetupTime);
+    m_logger->debug(formatString("PERF: Audio clips=%llu, encoders=%llu, setup=%lluus, %.1fus per clip", static_cast<unsigned long long>(numberOfClips), static_cast<unsigned long long>(numberOfEncoders), static_cast<unsigned long long>(audioSetupTime), numberOfClips > 0 ? (static_cast<double>(audioSetupTime) / numberOfClips) : 0.0));
+#endif
     
+    enablePathCache(false);
+    // The final totals, whatever the interval
+    notifyMetrics(true);
     notifyComplete(m_cancelled);
     
     return true;
@@ -450,9 +1079,8 @@ bool Exporter::runImpl()
 
 bool Exporter::exportUser(Friend& user, std::string& userOutputPath)
 {
-    std::string uidMd5 = user.getHash();
+    TraceSpan span("export", "exportUser", user.getUsrName());
     
-    std::string userBase = combinePath("Documents", uidMd5);
     // Use display name first, it it can't be created, use uid hash
     userOutputPath = user.getOutputFileName();
     std::string outputBase = combinePath(m_output, userOutputPath);
@@ -479,6 +1107,20 @@ bool Exporter::exportUser(Friend& user, std::string& userOutputPath)
         std::string defaultPortrait = combinePath(portraitPath, "DefaultProfileHead@2x.png");
         copyFile(combinePath(m_workDir, "res", "DefaultProfileHead@2x.png"), defaultPortrait, true);
     }
+    if ((m_options & SPO_RAW_AUDIO) && (m_options & (SPO_IGNORE_AUDIO | SPO_ARCHIVE)) == 0)
+    {
+        // The decoder of the pages, a single file build with the wasm embedded as file:// can't fetch it
+        std::string silkPath = combinePath(outputBase, "silk");
+        makeDirectory(silkPath);
+        copyFile(combinePath(m_workDir, "res", "silk", "silk.js"), combinePath(silkPath, "silk.js"), true);
+    }
+    if ((m_options & SPO_COMPRESS_PAGES) && (m_options & (SPO_TEXT_MODE | SPO_SYNC_LOADING | SPO_ARCHIVE)) == 0)
+    {
+        // Fallback of the pages for the browsers without DecompressionStream
+        std::string inflatePath = combinePath(outputBase, "inflate");
+        makeDirectory(inflatePath);
+        copyFile(combinePath(m_workDir, "res", "inflate", "inflate.js"), combinePath(inflatePath, "inflate.js"), true);
+    }
     if ((m_options & SPO_ICON_IN_SESSION) == 0 && (m_options & SPO_IGNORE_EMOJI) == 0)
     {
         std::string emojiPath = combinePath(outputBase, "Emoji");
@@ -501,7 +1143,7 @@ bool Exporter::exportUser(Friend& user, std::string& userOutputPath)
     
     m_logger->write(formatString(getLocaleString("%d chats found."), (int)(sessions.size())));
     
-    Friend* myself = friends.getFriend(user.getHash());
+    Friend* myself = friends.getFriend(user.getHashKey());
     if (NULL == myself)
     {
         Friend& newUser = friends.addFriend(user.getHash());
@@ -517,39 +1159,75 @@ bool Exporter::exportUser(Friend& user, std::string& userOutputPath)
         itUser = m_usersAndSessionsFilter.find(user.getUsrName());
     }
     
-    bool pdfOutput = (m_options & SPO_PDF_MODE && NULL != m_pdfConverter);
+    bool pdfOutput = (m_options & SPO_PDF_MODE && NULL != m_pdfConverter && (m_options & SPO_ARCHIVE) == 0);
     if (pdfOutput)
     {
         m_pdfConverter->makeUserDirectory(userOutputPath);
     }
     
-#ifdef USING_DOWNLOADER
-    Downloader downloader(m_logger);
-#else
-    TaskManager taskManager(m_logger);
-#endif
-#ifndef NDEBUG
-    m_logger->debug("UA: " + m_wechatInfo.buildUserAgent());
-#endif
+    std::unique_ptr<ArchiveWriter> archive;
+    if (m_options & SPO_ARCHIVE)
+    {
+        std::string archiveFileName = combinePath(outputBase, ARCHIVE_FILE_NAME);
+        if ((m_options & SPO_INCREMENTAL_EXP) == 0)
+        {
+            // Messages of the previous exporting which are gone from the backup aren't kept
+            deleteFile(archiveFileName);
+            deleteFile(archiveFileName + "-wal");
+            deleteFile(archiveFileName + "-shm");
+        }
+        archive.reset(new ArchiveWriter(archiveFileName));
+        if (!archive->open())
+        {
+            m_logger->write(formatString(getLocaleString("Failed to open the archive: %s."), archiveFileName.c_str()));
+            return false;
+        }
+        m_archive = archive.get();
+    }
     
 #ifdef USING_DOWNLOADER
+    Downloader downloader(m_logger);
     downloader.setUserAgent(m_wechatInfo.buildUserAgent());
-#else
-    taskManager.setUserAgent(m_wechatInfo.buildUserAgent());
 #endif
+    // Shared by the accounts, the downloads of this one run on while the next one is parsed
+    TaskManager& taskManager = *m_taskManager;
+    // The pdfs are converted while exporting, their media can't wait for the end
+    taskManager.setDeferringMedia(m_deferringMedia && !pdfOutput);
     
-    std::function<std::string(const std::string&)> localeFunction = std::bind(&Exporter::getLocaleString, this, std::placeholders::_1);
-    MessageParser msgParser(*m_iTunesDb, *m_iTunesDbShare, taskManager, friends, *myself, m_options, m_workDir, outputBase, localeFunction);
+    MessageParser msgParser(*m_iTunesDb, *m_iTunesDbShare, taskManager, friends, *myself, m_options, m_workDir, outputBase, *m_messageStrings);
+    
+    {
+        // Downloads left by the previous exporting, the messages of them are not parsed again
+        std::vector<PendingDownload> downloads;
+        std::lock_guard<std::mutex> lock(m_contextMutex);
+        taskManager.beginAccount(user.getUsrName());
+        if (m_exportContext->getPendingDownloads(user.getUsrName(), downloads))
+        {
+            m_logger->write(formatString(getLocaleString("Resuming %d downloads."), static_cast<int>(downloads.size())));
+            for (std::vector<PendingDownload>::const_iterator it = downloads.cbegin(); it != downloads.cend(); ++it)
+            {
+                if (!existsFile(it->output))
+                {
+                    taskManager.download(NULL, it->url, "", it->output, it->mtime, it->defaultFile);
+                }
+            }
+        }
+    }
     
     if ((m_options & SPO_IGNORE_AVATAR) == 0)
     {
 #ifndef NDEBUG
-        m_logger->debug("Download avatar: *" + user.getPortrait() + "* => " + combinePath(outputBase, "Portrait", user.getLocalPortrait()));
+        if (m_logger->isDebugging())
+        {
+            m_logger->debug("Download avatar: *" + user.getPortrait() + "* => " + combinePath(outputBase, "Portrait", user.getLocalPortrait()));
+        }
 #endif
         msgParser.copyPortraitIcon(NULL, user, combinePath(outputBase, "Portrait"));
         // downloader.addTask(user.getPortrait(), combinePath(outputBase, "Portrait", user.getLocalPortrait()), 0);
     }
 
+    bool parallel = m_sessionThreads > 1;
+    std::vector<size_t> pendingSessions;
     std::set<std::string> sessionFileNames;
     for (std::vector<Session>::iterator it = sessions.begin(); it != sessions.end(); ++it)
     {
@@ -568,6 +1246,20 @@ bool Exporter::exportUser(Friend& user, std::string& userOutputPath)
             
             it->setData(itSession->second);
         }
+        
+        if (parallel)
+        {
+            // Directory names depend on the order of sessions, so they are allocated here and the rest is left to the workers
+            if (!buildFileNameForUser(*it, sessionFileNames))
+            {
+                notifySessionStart(it->getUsrName(), it->getData(), it->getRecordCount());
+                m_logger->write(formatString(getLocaleString("Can't build directory name for chat: %s. Skip it."), it->getDisplayName().c_str()));
+                notifySessionComplete(it->getUsrName(), it->getData(), m_cancelled);
+                continue;
+            }
+            pendingSessions.push_back(std::distance(sessions.begin(), it));
+            continue;
+        }
 
 		notifySessionStart(it->getUsrName(), it->getData(), it->getRecordCount());
         
@@ -578,134 +1270,96 @@ bool Exporter::exportUser(Friend& user, std::string& userOutputPath)
             continue;
         }
         
-        std::string sessionDisplayName = it->getDisplayName();
-#ifndef NDEBUG
-        m_logger->write(formatString(getLocaleString("%d/%d: Handling the chat with %s"), (std::distance(sessions.begin(), it) + 1), sessions.size(), sessionDisplayName.c_str()) + " uid:" + it->getUsrName());
-#else
-        m_logger->write(formatString(getLocaleString("%d/%d: Handling the chat with %s"), (std::distance(sessions.begin(), it) + 1), sessions.size(), sessionDisplayName.c_str()));
-#endif
-        if (it->isSubscription())
+        int64_t maxMsgId = 0;
+        SessionPages sessionPages;
+        m_exportContext->getMaxId(it->getUsrName(), maxMsgId);
+        m_exportContext->getPages(it->getUsrName(), sessionPages);
+        int count = 0;
         {
-            m_logger->write(formatString(getLocaleString("Skip subscription: %s"), sessionDisplayName.c_str()));
-			notifySessionComplete(it->getUsrName(), it->getData(), m_cancelled);
-            continue;
+            ExportBudget::Slot slot(m_budget, m_budgetJobId);
+            count = exportSessionItem(*myself, msgParser, *it, std::distance(sessions.begin(), it) + 1, sessions.size(), outputBase, maxMsgId, sessionPages);
         }
-        if ((m_options & SPO_IGNORE_AVATAR) == 0)
+        updateExportContext(*it, maxMsgId, count > 0 ? &sessionPages : NULL);
+        if (isCheckpointDue())
         {
-            // Download avatar for session
-            msgParser.copyPortraitIcon(&(*it), *it, combinePath(outputBase, "Portrait"));
+            checkpoint();
         }
-        int count = exportSession(*myself, msgParser, *it, userBase, outputBase);
-        
-        m_logger->write(formatString(getLocaleString("Succeeded handling %d messages."), count));
 
-        if (count > 0)
+        // Nothing new, the outputs of the previous exporting are still listed
+        bool unchanged = count == 0 && maxMsgId > 0;
+        if (count > 0 || unchanged)
         {
-            std::string userItem = getTemplate("listitem");
-            replaceAll(userItem, "%%ITEMPICPATH%%", "Portrait/" + it->getLocalPortrait());
-            if ((m_options & SPO_IGNORE_HTML_ENC) == 0)
-            {
-                replaceAll(userItem, "%%ITEMLINK%%", encodeUrl(it->getOutputFileName()) + "." + m_extName);
-                replaceAll(userItem, "%%ITEMTEXT%%", safeHTML(sessionDisplayName));
-            }
-            else
-            {
-                replaceAll(userItem, "%%ITEMLINK%%", it->getOutputFileName() + "." + m_extName);
-                replaceAll(userItem, "%%ITEMTEXT%%", sessionDisplayName);
-            }
-            
-            userBody += userItem;
+            userBody += buildSessionListItem(*it);
         }
 
 		notifySessionComplete(it->getUsrName(), it->getData(), m_cancelled);
         
-        if (pdfOutput)
+        if (pdfOutput && count >= 0)
+        {
+            convertSessionToPdf(*it, outputBase, userOutputPath, unchanged);
+        }
+    }
+    
+    if (!pendingSessions.empty())
+    {
+        std::vector<int> counts;
+        std::vector<int64_t> maxMsgIds;
+        std::vector<SessionPages> sessionPages;
+        exportSessionsInParallel(*myself, friends, taskManager, sessions, pendingSessions, outputBase, counts, maxMsgIds, sessionPages);
+        
+        // Everything shared is updated in the order of sessions, as the serial exporting does
+        for (size_t idx = 0; idx < pendingSessions.size(); ++idx)
         {
-            // std::string 
-            std::string htmlFileName = combinePath(outputBase, it->getOutputFileName() + "." + m_extName);
-            if (existsFile(htmlFileName))
+            const Session& session = sessions[pendingSessions[idx]];
+            bool unchanged = counts[idx] == 0 && maxMsgIds[idx] > 0;
+            if (counts[idx] > 0 || unchanged)
             {
-                std::string pdfFileName = combinePath(m_output, "pdf", userOutputPath, it->getOutputFileName() + ".pdf");
-                // taskManager.convertPdf(&(*it), htmlFileName, pdfFileName, m_pdfConverter);
-                m_pdfConverter->convert(htmlFileName, pdfFileName);
+                userBody += buildSessionListItem(session);
+            }
+            if (pdfOutput && counts[idx] >= 0)
+            {
+                convertSessionToPdf(session, outputBase, userOutputPath, unchanged);
             }
         }
     }
 
-    std::string html = getTemplate("listframe");
-    replaceAll(html, "%%USERNAME%%", " - " + user.getDisplayName());
-    replaceAll(html, "%%TBODY%%", userBody);
-    
-    std::string fileName = combinePath(outputBase, "index." + m_extName);
-    writeFile(fileName, html);
+    if (NULL != m_archive)
+    {
+        // The sessions are done with it
+        m_archive = NULL;
+        archive->close();
+    }
+    else
+    {
+        std::string html = getTemplate("listframe");
+        replaceAll(html, "%%USERNAME%%", " - " + user.getDisplayName());
+        replaceAll(html, "%%TBODY%%", userBody);
+        
+        std::string fileName = combinePath(outputBase, "index." + m_extName);
+        m_writeQueue->write(fileName, html, false, &m_indexWrites);
+    }
+    // The pages of the account are written, the media held for them can go now
+    taskManager.startDeferredTasks();
 
-    size_t dlCount = 0;
-    size_t prevDlCount = 0;
+#ifdef USING_DOWNLOADER
     if (m_cancelled)
     {
-#ifdef USING_DOWNLOADER
         downloader.cancel();
-#else
-        taskManager.cancel();
-#endif
     }
     else
     {
-#ifdef USING_DOWNLOADER
-        dlCount = downloader.getRunningCount();
-        prevDlCount = dlCount;
+        size_t dlCount = downloader.getRunningCount();
         if (dlCount > 0)
         {
             m_logger->write("Waiting for tasks: " + std::to_string(dlCount));
         }
-#else
-        std::string queueDesc;
-        dlCount = taskManager.getNumberOfQueue(queueDesc);
-        prevDlCount = dlCount;
-        if (dlCount > 0)
-        {
-            m_logger->write("Waiting for tasks: " + queueDesc);
-        }
-        taskManager.shutdown();
-#endif
     }
-
-    notifyTasksStart(user.getUsrName(), static_cast<uint32_t>(dlCount));
-    
-#ifdef USING_DOWNLOADER
     downloader.shutdown();
-#else
-    unsigned int timeout = m_cancelled ? 0 : 512;
-    for (int idx = 1; ; ++idx)
-    {
-        if (taskManager.waitForCompltion(timeout))
-        {
-            break;
-        }
-        
-        if (m_cancelled)
-        {
-            taskManager.cancel();
-            timeout = 0;
-        }
-        else if ((idx % 2) == 0)
-        {
-            std::string queueDesc;
-            size_t curDlCount = taskManager.getNumberOfQueue(queueDesc);
-            if (curDlCount != prevDlCount)
-            {
-                notifyTasksProgress(user.getUsrName(), static_cast<uint32_t>(prevDlCount - curDlCount), static_cast<uint32_t>(dlCount));
-                prevDlCount = curDlCount;
-            }
-        }
-    }
 #endif
 
-    if (dlCount != prevDlCount)
-    {
-        notifyTasksProgress(user.getUsrName(), static_cast<uint32_t>(dlCount - prevDlCount), static_cast<uint32_t>(dlCount));
-    }
-    notifyTasksComplete(user.getUsrName(), m_cancelled);
+    // The notifier gets onTasksStart now and onTasksComplete once the downloads of the account complete,
+    // they are waited for at the end of the exporting
+    taskManager.endAccount(user.getUsrName());
     
 #ifndef NDEBUG
     // m_logger->debug(formatString("Total Downloads: %d", downloader.getCount()));
@@ -716,34 +1370,219 @@ bool Exporter::exportUser(Friend& user, std::string& userOutputPath)
 }
 
 bool Exporter::loadUserFriendsAndSessions(const Friend& user, Friends& friends, std::vector<Session>& sessions, bool detailedInfo/* = true*/) const
+{
+    TaskGraph graph;
+    SessionsParser sessionsParser(m_iTunesDb, m_iTunesDbShare, m_wechatInfo.getCellDataVersion(), detailedInfo);
+    addUserFriendsAndSessionsTasks(graph, sessionsParser, user, friends, sessions, detailedInfo);
+    graph.run();
+ 
+    std::sort(sessions.begin(), sessions.end(), SessionLastMsgTimeCompare());
+    
+    // m_logger->debug("Wechat Sessions for: " + user.getDisplayName() + " loaded.");
+    return true;
+}
+
+void Exporter::addUserFriendsAndSessionsTasks(TaskGraph& graph, SessionsParser& sessionsParser, const Friend& user, Friends& friends, std::vector<Session>& sessions, bool detailedInfo) const
 {
     std::string uidMd5 = user.getHash();
     std::string userBase = combinePath("Documents", uidMd5);
     
+    std::vector<TaskGraph::TaskId> friendsTasks;
     if (detailedInfo)
     {
         std::string wcdbPath = m_iTunesDb->findRealPath(combinePath(userBase, "DB", "WCDB_Contact.sqlite"));
-        FriendsParser friendsParser(detailedInfo);
+        friendsTasks.push_back(graph.add([this, &user, &friends, wcdbPath, detailedInfo]() {
+            FriendsParser friendsParser(detailedInfo);
 #ifndef NDEBUG
-        friendsParser.setOutputPath(m_output);
+            friendsParser.setOutputPath(m_output);
 #endif
-        friendsParser.parseWcdb(wcdbPath, friends);
+            friendsParser.parseWcdb(wcdbPath, friends);
 
-        m_logger->debug("Wechat Friends(" + std::to_string(friends.friends.size()) + ") for: " + user.getDisplayName() + " loaded.");
+            m_logger->debug("Wechat Friends(" + std::to_string(friends.size()) + ") for: " + user.getDisplayName() + " loaded.");
+        }));
     }
 
-    SessionsParser sessionsParser(m_iTunesDb, m_iTunesDbShare, m_wechatInfo.getCellDataVersion(), detailedInfo);
+    // The counts listed for the selection are exact, the exporting only shows them in the progress
+    sessionsParser.setEstimatingCounts(detailedInfo && m_estimatingRecordCounts);
+    if (m_cachingManifest && existsDirectory(m_output))
+    {
+        std::string cachePath = combinePath(m_output, WXEXP_DATA_FOLDER, user.getUsrName());
+        if (existsDirectory(cachePath) || makeDirectory(cachePath))
+        {
+            sessionsParser.setStatsCacheFile(combinePath(cachePath, "msgstats.dat"));
+        }
+    }
     
-    sessionsParser.parse(user, sessions, friends);
- 
-    std::sort(sessions.begin(), sessions.end(), SessionLastMsgTimeCompare());
+    sessionsParser.addTasks(graph, user, sessions, friends, friendsTasks);
+}
+
+void Exporter::exportSessionsInParallel(const Friend& myself, Friends& friends, TaskManager& taskManager, std::vector<Session>& sessions, const std::vector<size_t>& indexes, const std::string& outputBase, std::vector<int>& counts, std::vector<int64_t>& maxMsgIds, std::vector<SessionPages>& sessionPages)
+{
+    counts.assign(indexes.size(), -1);
+    maxMsgIds.assign(indexes.size(), 0);
+    sessionPages.assign(indexes.size(), SessionPages());
+    
+    std::vector<size_t> items(indexes.size());
+    for (size_t idx = 0; idx < indexes.size(); ++idx)
+    {
+        items[idx] = idx;
+        // Read all of them before the workers start, each worker updates the context once its session is done
+        m_exportContext->getMaxId(sessions[indexes[idx]].getUsrName(), maxMsgIds[idx]);
+        m_exportContext->getPages(sessions[indexes[idx]].getUsrName(), sessionPages[idx]);
+    }
+    // Largest sessions first, so no worker is left alone with a big one at the end
+    std::stable_sort(items.begin(), items.end(), [&sessions, &indexes](size_t a, size_t b) {
+        return sessions[indexes[a]].getRecordCount() > sessions[indexes[b]].getRecordCount();
+    });
+    
+    std::atomic<size_t> nextItem(0);
+    
+    size_t numberOfThreads = std::min(static_cast<size_t>(m_sessionThreads), items.size());
+    std::vector<std::thread> threads;
+    threads.reserve(numberOfThreads);
+    for (size_t threadIdx = 0; threadIdx < numberOfThreads; ++threadIdx)
+    {
+        threads.push_back(std::thread([&, threadIdx]() {
+            setThreadName(("session" + std::to_string(threadIdx + 1)).c_str());
+            // MessageParser keeps its own buffers, so each worker has one
+            MessageParser msgParser(*m_iTunesDb, *m_iTunesDbShare, taskManager, friends, myself, m_options, m_workDir, outputBase, *m_messageStrings);
+            while (!m_cancelled)
+            {
+                size_t item = nextItem.fetch_add(1);
+                if (item >= items.size())
+                {
+                    break;
+                }
+                
+                size_t idx = items[item];
+                Session& session = sessions[indexes[idx]];
+                notifySessionStart(session.getUsrName(), session.getData(), session.getRecordCount());
+                {
+                    ExportBudget::Slot slot(m_budget, m_budgetJobId);
+                    counts[idx] = exportSessionItem(myself, msgParser, session, indexes[idx] + 1, sessions.size(), outputBase, maxMsgIds[idx], sessionPages[idx]);
+                }
+                updateExportContext(session, maxMsgIds[idx], counts[idx] > 0 ? &sessionPages[idx] : NULL);
+                if (isCheckpointDue())
+                {
+                    checkpoint();
+                }
+                notifySessionComplete(session.getUsrName(), session.getData(), m_cancelled);
+            }
+        }));
+    }
     
-    // m_logger->debug("Wechat Sessions for: " + user.getDisplayName() + " loaded.");
-    return true;
+    for (std::vector<std::thread>::iterator it = threads.begin(); it != threads.end(); ++it)
+    {
+        it->join();
+    }
+}
+
+int Exporter::exportSessionItem(const Friend& user, const MessageParser& msgParser, const Session& session, size_t sessionIndex, size_t numberOfSessions, const std::string& outputBase, int64_t& maxMsgId, SessionPages& sessionPages)
+{
+    std::string sessionDisplayName = session.getDisplayName();
+#ifndef NDEBUG
+    m_logger->write(formatString(getLocaleString("%d/%d: Handling the chat with %s"), static_cast<int>(sessionIndex), static_cast<int>(numberOfSessions), sessionDisplayName.c_str()) + " uid:" + session.getUsrName());
+#else
+    m_logger->write(formatString(getLocaleString("%d/%d: Handling the chat with %s"), static_cast<int>(sessionIndex), static_cast<int>(numberOfSessions), sessionDisplayName.c_str()));
+#endif
+    if (session.isSubscription())
+    {
+        m_logger->write(formatString(getLocaleString("Skip subscription: %s"), sessionDisplayName.c_str()));
+        return -1;
+    }
+    if (isSessionUnchanged(session, outputBase, maxMsgId))
+    {
+        // Nothing new since the previous exporting, its outputs are kept as they are
+        m_logger->write(formatString(getLocaleString("Skip unchanged chat: %s"), sessionDisplayName.c_str()));
+        return 0;
+    }
+    if ((m_options & SPO_IGNORE_AVATAR) == 0)
+    {
+        // Download avatar for session
+        msgParser.copyPortraitIcon(&session, session, combinePath(outputBase, "Portrait"));
+    }
+    int count = exportSession(user, msgParser, session, outputBase, maxMsgId, sessionPages);
+    
+    m_logger->write(formatString(getLocaleString("Succeeded handling %d messages."), count));
+    return count;
+}
+
+bool Exporter::isSessionUnchanged(const Session& session, const std::string& outputBase, int64_t maxMsgId) const
+{
+    if ((m_options & SPO_INCREMENTAL_EXP) == 0 || maxMsgId <= 0 || session.getMaxMsgId() > maxMsgId)
+    {
+        return false;
+    }
+    if (m_options & SPO_ARCHIVE)
+    {
+        return existsFile(combinePath(outputBase, ARCHIVE_FILE_NAME));
+    }
+    return existsFile(combinePath(outputBase, session.getOutputFileName() + "." + m_extName));
+}
+
+std::string Exporter::buildSessionListItem(const Session& session) const
+{
+    std::string userItem = getTemplate("listitem");
+    replaceAll(userItem, "%%ITEMPICPATH%%", "Portrait/" + session.getLocalPortrait());
+    if ((m_options & SPO_IGNORE_HTML_ENC) == 0)
+    {
+        replaceAll(userItem, "%%ITEMLINK%%", encodeUrl(session.getOutputFileName()) + "." + m_extName);
+        replaceAll(userItem, "%%ITEMTEXT%%", safeHTML(session.getDisplayName()));
+    }
+    else
+    {
+        replaceAll(userItem, "%%ITEMLINK%%", session.getOutputFileName() + "." + m_extName);
+        replaceAll(userItem, "%%ITEMTEXT%%", session.getDisplayName());
+    }
+    return userItem;
+}
+
+void Exporter::convertSessionToPdf(const Session& session, const std::string& outputBase, const std::string& userOutputPath, bool unchanged)
+{
+    std::string htmlFileName = combinePath(outputBase, session.getOutputFileName() + "." + m_extName);
+    if (!existsFile(htmlFileName))
+    {
+        return;
+    }
+    std::string pdfBase = combinePath(m_output, "pdf", userOutputPath, session.getOutputFileName());
+    std::string partFileName = getPdfPartFileName(session, outputBase, 1);
+    if (!existsFile(partFileName))
+    {
+        convertHtmlToPdf(session, htmlFileName, pdfBase + ".pdf", unchanged);
+        return;
+    }
+    // Parts written by exportSession, or by the previous exporting for an unchanged session
+    for (size_t part = 1; existsFile(partFileName); partFileName = getPdfPartFileName(session, outputBase, ++part))
+    {
+        convertHtmlToPdf(session, partFileName, pdfBase + formatString("_%03u.pdf", static_cast<unsigned int>(part)), unchanged);
+    }
+}
+
+void Exporter::convertHtmlToPdf(const Session& session, const std::string& htmlFileName, const std::string& pdfFileName, bool unchanged)
+{
+    if (unchanged && existsFile(pdfFileName))
+    {
+        return;
+    }
+    if (m_pdfConverter->getConcurrency() > 0)
+    {
+        // Printed by the pool while the next sessions are exported
+        m_taskManager->convertPdf(&session, htmlFileName, pdfFileName, m_pdfConverter);
+    }
+    else
+    {
+        m_pdfConverter->convert(htmlFileName, pdfFileName);
+    }
 }
 
-int Exporter::exportSession(const Friend& user, const MessageParser& msgParser, const Session& session, const std::string& userBase, const std::string& outputBase)
+std::string Exporter::getPdfPartFileName(const Session& session, const std::string& outputBase, size_t part) const
 {
+    return combinePath(outputBase, session.getOutputFileName() + formatString(".part%03u.", static_cast<unsigned int>(part)) + m_extName);
+}
+
+int Exporter::exportSession(const Friend& user, const MessageParser& msgParser, const Session& session, const std::string& outputBase, int64_t& maxMsgId, SessionPages& sessionPages)
+{
+    TraceSpan span("export", "exportSession", session.getUsrName());
     if (session.isDbFileEmpty())
     {
         return 0;
@@ -761,209 +1600,316 @@ int Exporter::exportSession(const Friend& user, const MessageParser& msgParser,
     {
         makeDirectory(combinePath(sessionBasePath, "Emoji"));
     }
-
-    std::vector<std::string> messages;
-    if (session.getRecordCount() > 0)
+    if (NULL != m_archive)
     {
-        messages.reserve(session.getRecordCount());
+        return exportSessionToArchive(user, msgParser, session, maxMsgId);
     }
-    
-    int64_t maxMsgId = 0;
-    m_exportContext->getMaxId(session.getUsrName(), maxMsgId);
+
+#ifndef NDEBUG
+    const size_t pageSize = 500;
+#else
+    const size_t pageSize = 1000;
+#endif
+    // No page for text mode
+    bool singlePage = (m_options & (SPO_TEXT_MODE | SPO_SYNC_LOADING)) != 0;
+    // Raw messages of a session not in the context are never merged, they may be left by an exporting without it
+    bool merging = (m_options & SPO_INCREMENTAL_EXP) != 0 && maxMsgId > 0;
+    bool descending = (m_options & SPO_DESC) != 0;
+    int64_t prevMaxMsgId = maxMsgId;
     
     int numberOfMsgs = 0;
-    SessionParser sessionParser(m_options);
+    SessionParser sessionParser(m_options, m_dbPool);
     std::unique_ptr<SessionParser::MessageEnumerator> enumerator(sessionParser.buildMsgEnumerator(session, maxMsgId));
-    std::vector<TemplateValues> tvs;
+    TemplateValuesList tvs;
+    WXMSGROW row;
     WXMSG msg;
-    while (enumerator->nextMessage(msg))
+    bool hasMessage = enumerator->nextRow(row);
+    if (!hasMessage && merging)
+    {
+        // Nothing new, the outputs of previous exporting are still up to date
+        return 0;
+    }
+    
+    std::string rawMsgFileName = combinePath(m_output, WXEXP_DATA_FOLDER, session.getOwner()->getUsrName(), session.getUsrName() + ".dat");
+    std::string fileName = combinePath(outputBase, session.getOutputFileName() + "." + m_extName);
+    std::string header;
+    std::string footer;
+    
+    // Messages are written out to the raw messages file as soon as they are rendered, the pages are built from it at last
+    WriteQueue::Group writeGroup;
+    SessionWriter writer(getTemplate("scripts"), pageSize, singlePage, descending);
+    writer.setDataPath(combinePath(sessionBasePath, "Data"));
+    writer.setWriteQueue(m_writeQueue, &writeGroup);
+    writer.setSearchIndex((m_options & SPO_SUPPORT_FILTER) != 0);
+    writer.setCompression((m_options & SPO_COMPRESS_PAGES) != 0);
+    writer.setPageBytes(WXEXP_PAGE_BYTES);
+    writer.openRawMessages(rawMsgFileName, merging);
+    if (hasMessage && merging && !descending)
+    {
+        writer.addRawMessages(rawMsgFileName);
+    }
+    
+    // The buffers of the writer go to the memory accounting. Over the ceiling the raw messages are flushed early,
+    // which is a checkpoint, so only for the ascending order
+    AccountedBytes sessionBytes(EXPORT_METRIC_SESSION_BYTES);
+    MemoryWatermark watermark;
+    int memoryCheckMessages = 0;
+    auto isFlushingDue = [&writer, &sessionBytes, &watermark, &memoryCheckMessages, descending](int numberOfMessages) {
+        if (numberOfMessages - memoryCheckMessages < WXEXP_MEMORY_CHECK_MESSAGES)
+        {
+            return false;
+        }
+        memoryCheckMessages = numberOfMessages;
+        size_t bytes = writer.getMemoryUsage();
+        sessionBytes.set(static_cast<int64_t>(bytes));
+        return watermark.update() && !descending && bytes >= WXEXP_MIN_FLUSH_BYTES;
+    };
+    // Every message would flood the UI thread
+    ProgressThrottle progress(static_cast<uint32_t>(session.getRecordCount()));
+    
+    if (hasMessage && m_pipelineThreads > 1 && session.getRecordCount() >= static_cast<int>(m_pipelineMinMessages))
+    {
+        // Big sessions are parsed by several workers and written back in order
+        MessagePipeline pipeline(msgParser, [this, &session](const TemplateValuesList& tvs, std::string& content) {
+            exportMessage(tvs, content);
+        }, m_cancelled, m_pipelineThreads);
+        numberOfMsgs = pipeline.run(session, *enumerator, row, writer, maxMsgId, [this, &session, &writer, &maxMsgId, descending, &isFlushingDue, &progress](int numberOfMessages) {
+            if (progress.update(static_cast<uint32_t>(numberOfMessages)))
+            {
+                notifySessionProgress(session.getUsrName(), session.getData(), numberOfMessages, session.getRecordCount());
+            }
+            bool flushing = isFlushingDue(numberOfMessages);
+            if (!descending && (flushing || isCheckpointDue()) && writer.checkpoint())
+            {
+                updateExportContext(session, maxMsgId, NULL);
+                checkpoint();
+            }
+        });
+        hasMessage = false;
+    }
+    
+    std::string content;
+    while (hasMessage)
     {
-        if (msg.msgIdValue > maxMsgId)
+        if (row.msgIdValue > maxMsgId)
         {
-            maxMsgId = msg.msgIdValue;
+            maxMsgId = row.msgIdValue;
         }
         
         tvs.clear();
-        msgParser.parse(msg, session, tvs);
-        exportMessage(session, tvs, messages);
+        msgParser.parse(row, session, msg, tvs);
+        content.clear();
+        exportMessage(tvs, content);
+        writer.addMessage(content);
         ++numberOfMsgs;
         
-        notifySessionProgress(session.getUsrName(), session.getData(), numberOfMsgs, session.getRecordCount());
+        if (progress.update(static_cast<uint32_t>(numberOfMsgs)))
+        {
+            notifySessionProgress(session.getUsrName(), session.getData(), numberOfMsgs, session.getRecordCount());
+        }
         if (m_cancelled)
         {
             break;
         }
+        // The pages are built from all messages at last, only the raw messages file is saved in the middle
+        bool flushing = isFlushingDue(numberOfMsgs);
+        if (!descending && (flushing || isCheckpointDue()) && writer.checkpoint())
+        {
+            updateExportContext(session, maxMsgId, NULL);
+            checkpoint();
+        }
+        hasMessage = enumerator->nextRow(row);
     }
     
-    if (maxMsgId > 0)
+    if (progress.finish(static_cast<uint32_t>(numberOfMsgs)))
     {
-        m_exportContext->setMaxId(session.getUsrName(), maxMsgId);
+        notifySessionProgress(session.getUsrName(), session.getData(), numberOfMsgs, session.getRecordCount());
     }
     
-    std::string rawMsgFileName = combinePath(m_output, WXEXP_DATA_FOLDER, session.getOwner()->getUsrName(), session.getUsrName() + ".dat");
-    if (m_options & SPO_INCREMENTAL_EXP)
+    if (m_cancelled && descending)
+    {
+        // The newest messages come first, so the session is exported again from the previous one
+        maxMsgId = prevMaxMsgId;
+        return 0;
+    }
+    
+    if (numberOfMsgs > 0 && merging && descending)
     {
-        mergeMessages(rawMsgFileName, messages);
+        writer.addRawMessages(rawMsgFileName);
     }
-    serializeMessages(rawMsgFileName, messages);
+    writer.closeRawMessages();
 
-    if (numberOfMsgs > 0 && !messages.empty())
+    if (numberOfMsgs > 0)
     {
-#ifndef NDEBUG
-        const size_t pageSize = 500;
-#else
-        const size_t pageSize = 1000;
-#endif
-        auto b = messages.cbegin();
-        // No page for text mode
-        auto e = (((m_options & (SPO_TEXT_MODE | SPO_SYNC_LOADING)) != 0) || (messages.size() <= pageSize)) ? messages.cend() : (b + pageSize);
-        
-        const size_t numberOfMessages = std::distance(e, messages.cend());
-        const size_t numberOfPages = (numberOfMessages + pageSize - 1) / pageSize;
-        
-        std::string html = getTemplate("frame");
-#ifndef NDEBUG
-        replaceAll(html, "%%USRNAME%%", user.getUsrName() + " - " + user.getHash());
-        replaceAll(html, "%%SESSION_USRNAME%%", session.getUsrName() + " - " + session.getHash());
-#else
-        replaceAll(html, "%%USRNAME%%", "");
-        replaceAll(html, "%%SESSION_USRNAME%%", "");
-#endif
-        replaceAll(html, "%%DISPLAYNAME%%", session.getDisplayName());
-        replaceAll(html, "%%WX_CHAT_HISTORY%%", getLocaleString("Wechat Chat History"));
-        replaceAll(html, "%%ASYNC_LOADING_TYPE%%", m_loadingDataOnScroll ? "onscroll" : "initial");
-        
-        replaceAll(html, "%%SIZE_OF_PAGE%%", std::to_string(pageSize));
-        replaceAll(html, "%%NUMBER_OF_MSGS%%", std::to_string(numberOfMessages));
-        replaceAll(html, "%%NUMBER_OF_PAGES%%", std::to_string(numberOfPages));
-        
-        replaceAll(html, "%%DATA_PATH%%", encodeUrl(session.getOutputFileName() + "_files") + "/Data");
-        
-        replaceAll(html, "%%BODY%%", join(b, e, ""));
-        replaceAll(html, "%%HEADER_FILTER%%", (m_options & SPO_SUPPORT_FILTER) ? getTemplate("filter") : "");
-        
-        std::string fileName = combinePath(outputBase, session.getOutputFileName() + "." + m_extName);
-        writeFile(fileName, html);
-        
-        if ((m_options & SPO_SYNC_LOADING) == 0 && numberOfPages > 0)
+        // Only the pages changed by the new messages are written for the incremental exporting
+        writer.writePages(sessionPages);
+        buildSessionFrame(session, pageSize, writer.getNumberOfPagedMessages(), writer.getPages(), header, footer);
+        if ((m_options & SPO_PDF_MODE) && NULL != m_pdfConverter)
         {
-            std::string dataPath = combinePath(outputBase, session.getOutputFileName() + "_files", "Data");
-            makeDirectory(dataPath);
-
-            for (size_t page = 0; page < numberOfPages; ++page)
+            // Same frame, each part holds a range of the messages of the html page
+            size_t numberOfPdfParts = writer.writeHtmlParts([this, &session, &outputBase](size_t part) {
+                return getPdfPartFileName(session, outputBase, part);
+            }, m_pdfPartMessages, header, footer);
+            // Parts left by a previous exporting with more of them
+            for (size_t part = numberOfPdfParts + 1; existsFile(getPdfPartFileName(session, outputBase, part)); ++part)
             {
-                b = e;
-                std::string scripts = getTemplate("scripts");
-                e = (page == (numberOfPages - 1)) ? messages.cend() : (b + pageSize);
-                Json::Value jsonMsgs(Json::arrayValue);
-                for (auto it = b; it != e; ++it)
-                {
-                    jsonMsgs.append(*it);
-                }
-                Json::StreamWriterBuilder builder;
-                builder["indentation"] = "";  // assume default for comments is None
-#ifndef NDEBUG
-                builder["emitUTF8"] = true;
-#endif
-                std::string moreMsgs = Json::writeString(builder, jsonMsgs);
-
-                replaceAll(scripts, "%%JSON_DATA%%", moreMsgs);
-                
-                fileName = combinePath(dataPath, "msg-" + std::to_string(page + 1) + ".js");
-                writeFile(fileName, scripts);
+                deleteFile(getPdfPartFileName(session, outputBase, part));
             }
         }
-        
-        
+        writer.writeHtml(fileName, header, footer);
+        sessionPages = writer.getPages();
+        sessionBytes.set(static_cast<int64_t>(writer.getMemoryUsage()));
     }
+    watermark.update();
+    notifySessionMemory(session.getUsrName(), session.getData(), watermark.getPeak());
     
-    return numberOfMsgs;
-}
-
-bool Exporter::exportMessage(const Session& session, const std::vector<TemplateValues>& tvs, std::vector<std::string>& messages)
-{
-    std::string content;
-    for (std::vector<TemplateValues>::const_iterator it = tvs.cbegin(); it != tvs.cend(); ++it)
+    // The session is complete once its files are written
+    if (NULL != m_writeQueue && !m_writeQueue->wait(writeGroup))
     {
-        content.append(buildContentFromTemplateValues(*it));
+        m_logger->write(formatString(getLocaleString("Failed to write the files of chat: %s."), session.getDisplayName().c_str()));
+        // All pages are written again by the next incremental exporting
+        sessionPages = SessionPages();
     }
     
-    messages.push_back(content);
-    return m_cancelled;
-}
-
-void Exporter::serializeMessages(const std::string& fileName, const std::vector<std::string>& messages)
-{
-    uint32_t size = htonl(static_cast<uint32_t>(messages.size()));
-    writeFile(fileName, "");
-    appendFile(fileName, reinterpret_cast<const unsigned char *>(&size), sizeof(size));
-    
-    for (std::vector<std::string>::const_iterator it = messages.cbegin(); it != messages.cend(); ++it)
-    {
-        size = htonl(static_cast<uint32_t>(it->size()));
-        appendFile(fileName, reinterpret_cast<const unsigned char *>(&size), sizeof(size));
-        appendFile(fileName, *it);
-    }
+    return numberOfMsgs;
 }
 
-void Exporter::unserializeMessages(const std::string& fileName, std::vector<std::string>& messages)
+int Exporter::exportSessionToArchive(const Friend& user, const MessageParser& msgParser, const Session& session, int64_t& maxMsgId)
 {
-    std::vector<unsigned char> data;
-    if (!readFile(fileName, data))
+    int64_t sessionId = m_archive->addSession(session.getUsrName(), session.getDisplayName(), session.isChatroom());
+    if (sessionId == 0)
     {
-        messages.clear();
-        return;
-    }
-    
-    size_t dataSize = data.size();
-    if (dataSize < sizeof(uint32_t))
-    {
-        return;
+        m_logger->write(formatString(getLocaleString("Failed to write the files of chat: %s."), session.getDisplayName().c_str()));
+        return 0;
     }
     
-    size_t offset = 0;
-    uint32_t itemSize = 0;
-    memcpy(&itemSize, &data[offset], sizeof(uint32_t));
-    offset += sizeof(uint32_t);
-    itemSize = ntohl(itemSize);
-    
-    messages.clear();
-    messages.reserve(itemSize);
+    // Always in the order of the ids, so a committed batch is a checkpoint.
+    // Rows are replaced by their ids, the ones of an interrupted batch are written again
+    SessionParser sessionParser(m_options & ~SPO_DESC, m_dbPool);
+    std::unique_ptr<SessionParser::MessageEnumerator> enumerator(sessionParser.buildMsgEnumerator(session, maxMsgId));
+    TemplateValuesList tvs;
+    WXMSGROW row;
+    WXMSG msg;
+    // The messages of a batch are reused by the next one
+    std::vector<ArchiveMessage> messages(ARCHIVE_BATCH_SIZE);
+    size_t numberOfBatchMessages = 0;
+    int64_t batchMaxMsgId = maxMsgId;
+    int numberOfMsgs = 0;
+    int numberOfCommittedMsgs = 0;
+    ProgressThrottle progress(static_cast<uint32_t>(session.getRecordCount()));
     
-    uint32_t sizeOfString = 0;
-    for (uint32_t idx = 0; idx < itemSize; ++idx)
+    bool hasMessage = enumerator->nextRow(row);
+    while (hasMessage || numberOfBatchMessages > 0)
     {
-        if (offset + sizeof(uint32_t) > dataSize)
+        if (hasMessage)
         {
-            break;
+            tvs.clear();
+            msgParser.parse(row, session, msg, tvs);
+            fillArchiveMessage(row, session, user, tvs, messages[numberOfBatchMessages++]);
+            if (row.msgIdValue > batchMaxMsgId)
+            {
+                batchMaxMsgId = row.msgIdValue;
+            }
+            ++numberOfMsgs;
+            if (progress.update(static_cast<uint32_t>(numberOfMsgs)))
+            {
+                notifySessionProgress(session.getUsrName(), session.getData(), numberOfMsgs, session.getRecordCount());
+            }
+            // The messages parsed so far are still written
+            hasMessage = !m_cancelled && enumerator->nextRow(row);
+        }
+        if (numberOfBatchMessages < ARCHIVE_BATCH_SIZE && hasMessage)
+        {
+            continue;
         }
-        memcpy(&sizeOfString, &data[offset], sizeof(uint32_t));
-        offset += sizeof(uint32_t);
-        sizeOfString = ntohl(sizeOfString);
         
-        if (offset + sizeOfString > dataSize)
+        messages.resize(numberOfBatchMessages);
+        if (!m_archive->addMessages(sessionId, messages))
         {
+            m_logger->write(formatString(getLocaleString("Failed to write the files of chat: %s."), session.getDisplayName().c_str()));
             break;
         }
-        
-        messages.emplace_back(reinterpret_cast<const char *>(&data[offset]), sizeOfString);
-        offset += sizeOfString;
+        maxMsgId = batchMaxMsgId;
+        numberOfCommittedMsgs = numberOfMsgs;
+        numberOfBatchMessages = 0;
+        if (isCheckpointDue())
+        {
+            updateExportContext(session, maxMsgId, NULL);
+            checkpoint();
+        }
     }
+    
+    if (progress.finish(static_cast<uint32_t>(numberOfMsgs)))
+    {
+        notifySessionProgress(session.getUsrName(), session.getData(), numberOfMsgs, session.getRecordCount());
+    }
+    return numberOfCommittedMsgs;
 }
 
-void Exporter::mergeMessages(const std::string& fileName, std::vector<std::string>& messages)
+void Exporter::buildSessionFrame(const Session& session, size_t pageSize, size_t numberOfMessages, const SessionPages& pages, std::string& header, std::string& footer) const
 {
-    std::vector<std::string> orgMessages;
-    unserializeMessages(fileName, orgMessages);
+    size_t numberOfPages = pages.pages.size();
+    std::string html = getTemplate("frame");
+#ifndef NDEBUG
+    const Friend* user = session.getOwner();
+    replaceAll(html, "%%USRNAME%%", NULL == user ? "" : (user->getUsrName() + " - " + user->getHash()));
+    replaceAll(html, "%%SESSION_USRNAME%%", session.getUsrName() + " - " + session.getHash());
+#else
+    replaceAll(html, "%%USRNAME%%", "");
+    replaceAll(html, "%%SESSION_USRNAME%%", "");
+#endif
+    replaceAll(html, "%%DISPLAYNAME%%", session.getDisplayName());
+    replaceAll(html, "%%WX_CHAT_HISTORY%%", getLocaleString("Wechat Chat History"));
+    replaceAll(html, "%%ASYNC_LOADING_TYPE%%", m_loadingDataOnScroll ? "onscroll" : "initial");
+    
+    replaceAll(html, "%%SIZE_OF_PAGE%%", std::to_string(pageSize));
+    replaceAll(html, "%%NUMBER_OF_MSGS%%", std::to_string(numberOfMessages));
+    replaceAll(html, "%%NUMBER_OF_PAGES%%", std::to_string(numberOfPages));
+    // Pages hold different numbers of messages, the frame counts the loaded ones by the offsets of the pages
+    std::string pageOffsets = "0";
+    size_t pageOffset = 0;
+    // Time index for jumping to a date: the first and the last createTime of each page
+    std::string pageTimes;
+    for (std::vector<SessionPages::Page>::const_iterator it = pages.pages.cbegin(); it != pages.pages.cend(); ++it)
+    {
+        pageOffset += it->numberOfMessages;
+        pageOffsets += "," + std::to_string(pageOffset);
+        if (!pageTimes.empty())
+        {
+            pageTimes.push_back(',');
+        }
+        pageTimes += std::to_string(it->beginTime) + "," + std::to_string(it->endTime);
+    }
+    replaceAll(html, "%%PAGE_OFFSETS%%", pageOffsets);
+    replaceAll(html, "%%PAGE_TIMES%%", pageTimes);
+    replaceAll(html, "%%DESCENDING_PAGES%%", (m_options & SPO_DESC) ? "1" : "0");
+    // The shards are written by the SessionWriter with the filter
+    replaceAll(html, "%%INDEX_PAGES_PER_SHARD%%", ((m_options & SPO_SUPPORT_FILTER) && numberOfPages > 0) ? std::to_string(SEARCH_INDEX_PAGES_PER_SHARD) : "0");
     
-    std::string contents = readFile(fileName);
-    if ((m_options & SPO_DESC) == 0)
+    replaceAll(html, "%%DATA_PATH%%", encodeUrl(session.getOutputFileName() + "_files") + "/Data");
+    replaceAll(html, "%%HEADER_FILTER%%", (m_options & SPO_SUPPORT_FILTER) ? getTemplate("filter") : "");
+    
+    // Messages go between the header and the footer
+    std::string::size_type pos = html.find("%%BODY%%");
+    if (pos == std::string::npos)
     {
-        messages.swap(orgMessages);
+        header.swap(html);
+        footer.clear();
+        return;
     }
-    
-    messages.reserve(messages.size() + orgMessages.size());
-    messages.insert(messages.cend(), orgMessages.cbegin(), orgMessages.cend());
+    header = html.substr(0, pos);
+    footer = html.substr(pos + 8);
+}
+
+bool Exporter::exportMessage(const TemplateValuesList& tvs, std::string& content)
+{
+    for (TemplateValuesList::const_iterator it = tvs.cbegin(); it != tvs.cend(); ++it)
+    {
+        buildContentFromTemplateValues(*it, content);
+    }
+    addExportMetric(EXPORT_METRIC_MESSAGES, 1);
+
+    return m_cancelled;
 }
 
 bool Exporter::buildFileNameForUser(Friend& user, std::set<std::string>& existingFileNames)
@@ -1002,7 +1948,7 @@ bool Exporter::fillSession(Session& session, const Friends& friends) const
 {
     if (session.isDisplayNameEmpty())
     {
-        const Friend* f = friends.getFriend(session.getHash());
+        const Friend* f = friends.getFriend(session.getHashKey());
         if (NULL != f && !f->isDisplayNameEmpty())
         {
             session.setDisplayName(f->getDisplayName());
@@ -1028,27 +1974,70 @@ void Exporter::releaseITunes()
 
 bool Exporter::loadITunes(bool detailedInfo/* = true*/)
 {
+    TraceSpan span("itunes", "loadITunes");
     releaseITunes();
     
+    if (detailedInfo)
+    {
+        ITunesPrewarming* prewarming = takePrewarming(m_backup, false);
+        if (NULL != prewarming)
+        {
+            prewarming->wait();
+            bool succeeded = prewarming->succeeded;
+            m_iTunesDb = prewarming->iTunesDb;
+            m_iTunesDbShare = prewarming->iTunesDbShare;
+            prewarming->iTunesDb = NULL;
+            prewarming->iTunesDbShare = NULL;
+            delete prewarming;
+            if (succeeded)
+            {
+                return true;
+            }
+            releaseITunes();
+        }
+    }
+    
+    std::string cachePath;
+    if (m_cachingManifest && existsDirectory(m_output))
+    {
+        cachePath = combinePath(m_output, WXEXP_DATA_FOLDER);
+        if (!existsDirectory(cachePath) && !makeDirectory(cachePath))
+        {
+            cachePath.clear();
+        }
+    }
+    
     m_iTunesDb = new ITunesDb(m_backup, "Manifest.db");
     if (!detailedInfo)
     {
         std::function<bool(const char*, int)> fn = std::bind(&Exporter::filterITunesFile, this, std::placeholders::_1, std::placeholders::_2);
         m_iTunesDb->setLoadingFilter(fn);
     }
-    if (!m_iTunesDb->load("AppDomain-com.tencent.xin", !detailedInfo))
-    {
-        return false;
-    }
     m_iTunesDbShare = new ITunesDb(m_backup, "Manifest.db");
-    
-    if (!m_iTunesDbShare->load("AppDomainGroup-group.com.tencent.xin"))
+    if (detailedInfo && !m_usersAndSessionsFilter.empty())
+    {
+        // Only load the files of the selected accounts and the common ones
+        ITunesPathFilter pathFilter;
+        pathFilter.addPrefix("Documents/LoginInfo2.dat");
+        pathFilter.addPrefix("Documents/MMappedKV/mmsetting.");
+        pathFilter.addPrefix("Library/Preferences/com.tencent.xin.plist");
+        ITunesPathFilter sharePathFilter;
+        for (std::map<std::string, std::map<std::string, void *>>::const_iterator it = m_usersAndSessionsFilter.cbegin(); it != m_usersAndSessionsFilter.cend(); ++it)
+        {
+            std::string usrNameHash = md5(it->first);
+            pathFilter.addPrefix("Documents/" + usrNameHash + "/");
+            sharePathFilter.addPrefix("share/" + usrNameHash + "/");
+        }
+        m_iTunesDb->setPathFilter(pathFilter);
+        m_iTunesDbShare->setPathFilter(sharePathFilter);
+    }
+    if (!cachePath.empty())
     {
-        // Optional
-        // return false;
+        m_iTunesDb->setCacheFile(combinePath(cachePath, detailedInfo ? "manifest.idx" : "manifest_brief.idx"));
+        m_iTunesDbShare->setCacheFile(combinePath(cachePath, "manifest_share.idx"));
     }
     
-    return true;
+    return loadITunesDbs(m_iTunesDb, m_iTunesDbShare, detailedInfo);
 }
 
 std::string Exporter::getITunesVersion() const
@@ -1068,12 +2057,13 @@ std::string Exporter::getWechatVersion() const
 
 bool Exporter::loadTemplates()
 {
-    const char* names[] = {"frame", "msg", "video", "notice", "system", "audio", "image", "card", "emoji", "plainshare", "share", "thumb", "listframe", "listitem", "scripts", "filter", "refermsg", "channels"};
+    const char* names[] = {"frame", "msg", "video", "notice", "system", "audio", "audio_silk", "image", "card", "emoji", "plainshare", "share", "thumb", "listframe", "listitem", "scripts", "filter", "refermsg", "channels"};
     for (int idx = 0; idx < sizeof(names) / sizeof(const char*); idx++)
     {
         std::string name = names[idx];
         std::string path = combinePath(m_workDir, "res", m_templatesName, name + ".html");
         m_templates[name] = readFile(path);
+        m_compiledTemplates[name].compile(m_templates[name]);
     }
     return true;
 }
@@ -1085,6 +2075,7 @@ bool Exporter::loadStrings()
     std::string path = combinePath(m_workDir, "res", m_languageCode + ".txt");
     if (!existsFile(path))
     {
+        m_messageStrings->load(m_localeStrings);
         return false;
     }
 
@@ -1104,6 +2095,7 @@ bool Exporter::loadStrings()
             m_localeStrings[k] = v;
         }
     }
+    m_messageStrings->load(m_localeStrings);
 
     return true;
 }
@@ -1121,45 +2113,23 @@ std::string Exporter::getLocaleString(const std::string& key) const
     return it == m_localeStrings.cend() ? key : it->second;
 }
 
-std::string Exporter::buildContentFromTemplateValues(const TemplateValues& tv) const
+void Exporter::buildContentFromTemplateValues(const TemplateValues& tv, std::string& content) const
 {
-#if !defined(NDEBUG) && defined(SAMPLING_TMPL)
-    std::string alignment = "";
-#endif
-    std::string content = getTemplate(tv.getName());
-    for (TemplateValues::const_iterator it = tv.cbegin(); it != tv.cend(); ++it)
+    std::map<std::string, CompiledTemplate>::const_iterator itTemplate = m_compiledTemplates.find(tv.getName());
+    if (itTemplate == m_compiledTemplates.cend())
     {
-        if (startsWith(it->first, "%"))
-        {
-            replaceAll(content, it->first, it->second);
-        }
+        return;
+    }
 #if !defined(NDEBUG) && defined(SAMPLING_TMPL)
-        if (it->first == "%%ALIGNMENT%%")
-        {
-            alignment = it->second;
-        }
+    size_t orgLength = content.size();
 #endif
-    }
-    
-    std::string::size_type pos = 0;
-
-    while ((pos = content.find("%%", pos)) != std::string::npos)
-    {
-        std::string::size_type posEnd = content.find("%%", pos + 2);
-        if (posEnd == std::string::npos)
-        {
-            break;
-        }
-        
-        content.erase(pos, posEnd + 2 - pos);
-    }
+    itTemplate->second.render(tv, content);
     
 #if !defined(NDEBUG) && defined(SAMPLING_TMPL)
+    std::string alignment = tv.get(TVS_ALIGNMENT);
     std::string fileName = "sample_" + tv.getName() + alignment + ".html";
-    writeFile(combinePath(m_output, "dbg", fileName), content);
+    writeFile(combinePath(m_output, "dbg", fileName), content.substr(orgLength));
 #endif
-    
-    return content;
 }
 
 void Exporter::notifyStart()
@@ -1172,6 +2142,11 @@ void Exporter::notifyStart()
 
 void Exporter::notifyComplete(bool cancelled/* = false*/)
 {
+    // The lines of the exporting are shown before it completes
+    if (NULL != m_logger)
+    {
+        m_logger->flush();
+    }
     if (m_notifier)
     {
         m_notifier->onComplete(cancelled);
@@ -1208,6 +2183,18 @@ void Exporter::notifySessionProgress(const std::string& sessionUsrName, void * s
     {
         m_notifier->onSessionProgress(sessionUsrName, sessionData, numberOfMessages, numberOfTotalMessages);
     }
+    notifyMetrics();
+}
+
+void Exporter::notifySessionMemory(const std::string& sessionUsrName, void * sessionData, uint64_t peakBytes)
+{
+#ifndef NDEBUG
+    m_logger->debug(formatString("Peak memory of %s: %llu bytes", sessionUsrName.c_str(), static_cast<unsigned long long>(peakBytes)));
+#endif
+    if (m_notifier)
+    {
+        m_notifier->onSessionMemory(sessionUsrName, sessionData, peakBytes);
+    }
 }
 
 void Exporter::notifyTasksStart(const std::string& usrName, uint32_t numberOfTotalTasks)
@@ -1234,6 +2221,33 @@ void Exporter::notifyTasksProgress(const std::string& usrName, uint32_t numberOf
     }
 }
 
+void Exporter::notifyMetrics(bool forced/* = false*/)
+{
+    if (NULL == m_notifier || (m_metricsInterval == 0 && !forced))
+    {
+        return;
+    }
+    // Called by the workers of sessions for every message, the one sampling doesn't hold up the others
+    std::unique_lock<std::mutex> lock(m_metricsMutex, std::try_to_lock);
+    if (!forced && !lock.owns_lock())
+    {
+        return;
+    }
+    if (!lock.owns_lock())
+    {
+        lock.lock();
+    }
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (!forced && std::chrono::duration_cast<std::chrono::milliseconds>(now - m_metricsTime).count() < static_cast<std::chrono::milliseconds::rep>(m_metricsInterval))
+    {
+        return;
+    }
+    m_metricsTime = now;
+    ExportMetrics metrics;
+    m_metricsSampler.sample(metrics);
+    m_notifier->onMetrics(metrics);
+}
+
 bool Exporter::filterITunesFile(const char *file, int flags) const
 {
     if (startsWith(file, "Documents/MMappedKV/"))
@@ -10,21 +10,38 @@
 #include <string>
 #include <thread>
 #include <atomic>
+#include <mutex>
+#include <chrono>
 
 #include "Logger.h"
+#include "AsyncLogger.h"
 #include "PdfConverter.h"
 #include "WechatObjects.h"
 #include "ITunesParser.h"
 #include "ExportNotifier.h"
-
-// #define USING_ASYNC_TASK_FOR_MP3
+#include "LoadingNotifier.h"
+#include "ExportMetrics.h"
+#include "CompiledTemplate.h"
+#include "TaskGraph.h"
+#include "WriteQueue.h"
 
 #ifndef Exporter_h
 #define Exporter_h
 
 class MessageParser;
 class TemplateValues;
+class TemplateValuesList;
+class LocaleStrings;
 class ExportContext;
+struct SessionPages;
+class SqliteConnectionPool;
+class TaskManager;
+class DownloadCache;
+class TranscodeCache;
+class MediaManifest;
+class SessionsParser;
+class ExportBudget;
+class ArchiveWriter;
 
 class Exporter
 {
@@ -38,20 +55,31 @@ protected:
     WechatInfo m_wechatInfo;
     std::string m_backup;
     std::string m_output;
-    Logger* m_logger;
+    // In front of the logger passed in, the workers don't wait for the sink
+    AsyncLogger* m_logger;
     PdfConverter* m_pdfConverter;
     
     ITunesDb *m_iTunesDb;
     ITunesDb *m_iTunesDbShare;
     
     std::map<std::string, std::string> m_templates;
+    std::map<std::string, CompiledTemplate> m_compiledTemplates;    // Templates of messages
     std::map<std::string, std::string> m_localeStrings;
+    LocaleStrings* m_messageStrings;    // Strings of messages, resolved from m_localeStrings
 
     ExportNotifier* m_notifier;
+    LoadingNotifier* m_loadingNotifier;
     
     std::atomic<bool> m_cancelled;
     int m_options;
     bool m_loadingDataOnScroll;
+    bool m_cachingManifest;
+    bool m_estimatingRecordCounts;
+    unsigned int m_sessionThreads;
+    unsigned int m_pipelineThreads;
+    unsigned int m_pipelineMinMessages;
+    unsigned int m_pdfPartMessages;
+    int m_mediaLinkMode;
     std::string m_extName;
     std::string m_templatesName;
     
@@ -60,6 +88,30 @@ protected:
     std::vector<std::pair<Friend, std::vector<Session>>> m_usersAndSessions;
     
     ExportContext*  m_exportContext;
+    std::mutex m_contextMutex;  // The export context is updated by the workers of sessions
+    std::atomic<std::time_t> m_checkpointTime;
+    TaskManager* m_taskManager; // Downloads of the accounts, shared by them and saved in the checkpoints
+    SqliteConnectionPool* m_dbPool;
+    ArchiveWriter* m_archive;   // Of the account being exported in the archive mode
+    WriteQueue* m_writeQueue;
+    WriteQueue* m_sharedWriteQueue;     // Of the batch, m_writeQueue is created by the exporting without it
+    WriteQueue::Group m_indexWrites;    // Index pages of the accounts and the exporting
+    ExportBudget* m_budget;     // Cores of the batch, the workers hold a slot of m_budgetJobId for each session
+    unsigned int m_budgetJobId;
+    unsigned int m_audioThreads;
+    std::string m_downloadCacheDir;
+    uint64_t m_downloadCacheSize;
+    DownloadCache* m_downloadCache;     // Shared by the accounts of the exporting
+    TranscodeCache* m_transcodeCache;   // Voices transcoded into the output by the previous exportings
+    MediaManifest* m_mediaManifest;     // Media of the backup copied into the output by the previous exportings
+    unsigned int m_minDownloadsPerHost;
+    unsigned int m_maxDownloadsPerHost;
+    bool m_deferringMedia;
+    unsigned int m_metricsInterval;
+    uint64_t m_memoryCeiling;
+    std::mutex m_metricsMutex;  // Taken with try_lock, a busy sampler skips the sample
+    ExportMetricsSampler m_metricsSampler;
+    std::chrono::steady_clock::time_point m_metricsTime;
     
     std::string m_languageCode;
 
@@ -68,6 +120,8 @@ public:
     ~Exporter();
 
     void setNotifier(ExportNotifier *notifier);
+    // The accounts and sessions are handed to it while loadUsersAndSessions runs
+    void setLoadingNotifier(LoadingNotifier *loadingNotifier);
     
     bool loadUsersAndSessions();
     void swapUsersAndSessions(std::vector<std::pair<Friend, std::vector<Session>>>& usersAndSessions);
@@ -78,13 +132,57 @@ public:
     void waitForComplition();
     
     void filterUsersAndSessions(const std::map<std::string, std::map<std::string, void *>>& usersAndSessions);
+    // SPO_* of MessageParser.h as a whole, for the command line. The setters below change the bits of it
+    void setOptions(int options);
+    int getOptions() const;
     void setTextMode(bool textMode = true);
     void setPdfMode(bool pdfMode = true);
+    // Sessions with more messages are printed as a series of pdf files of up to numberOfMessages messages each,
+    // <session>_001.pdf and so on, which bounds the memory of the browser and spreads them over the pdf pool. 0: whole sessions
+    void setPdfPartSize(unsigned int numberOfMessages);
+    // MEDIA_LINK_*, for the output on the volume of the backup: images, videos and files are links to the backup instead of copies
+    void setMediaLinkMode(int linkMode);
     void setOrder(bool asc = true);
     void saveFilesInSessionFolder(bool flags = true);
     void setSyncLoading(bool syncLoading = true);
+    // Copy the SILK of voices instead of transcoding them to mp3, the pages decode them with res/silk/silk.js.
+    // The decoder isn't part of the tree, without it the voices are still transcoded
+    void setRawAudio(bool rawAudio = true);
+    // The parsed messages of an account are written to messages.db in its directory, no templates or pages.
+    // The media are still copied and referenced by their paths
+    void setArchiveMode(bool archiveMode = true);
+    // Data/msg-N.js are written as the base64 of their zlib streams, which is about a third of the size for text.
+    // The pages inflate them with DecompressionStream, or inflate/inflate.js of the account on older browsers
+    void setCompressingPages(bool compressingPages = true);
     void setLoadingDataOnScroll(bool loadingDataOnScroll = true);
     void setIncrementalExporting(bool incrementalExporting);
+    // The manifest and the stats of the message databases are cached in the output directory
+    void setCachingManifest(bool cachingManifest = true);
+    // Record counts of sessions are estimated while exporting, they only drive the progress
+    void setEstimatingRecordCounts(bool estimatingRecordCounts = true);
+    // Downloads are cached in cacheDir across the exportings, up to maxSize bytes.
+    // Without it, they are cached in the output directory if the manifest is cached
+    void setDownloadCache(const std::string& cacheDir, uint64_t maxSize);
+    // Concurrent downloads from a CDN host are tuned between them by the throughput and errors
+    void setDownloadConcurrency(unsigned int minTransfersPerHost = 2, unsigned int maxTransfersPerHost = 16);
+    // Emojis, thumbnails and the other media are downloaded after the pages of the account are written,
+    // the avatars are not held. It is ignored in the pdf mode
+    void setDeferringMedia(bool deferringMedia = true);
+    // onMetrics of the notifier is called every intervalMs at most, 0 disables it
+    void setMetricsInterval(unsigned int intervalMs = 1000);
+    // Ceiling of the accounted memory (manifest, deferred tasks, pending writes and sessions), 0 (default) for none.
+    // Over it the deferred tasks are spilled to disk and the sessions flushed early. It is of the process, a batch shares it
+    void setMemoryCeiling(uint64_t bytes = 0);
+    // Number of sessions exported at the same time, 0 for the number of cores, 1 (default) exports them one by one
+    void setParallelSessions(unsigned int numberOfThreads = 0);
+    // Sessions with at least minMessages messages are parsed by numberOfThreads workers, 0 for the number of cores, 1 (default) disables it
+    void setSessionPipeline(unsigned int numberOfThreads = 0, unsigned int minMessages = 20000);
+    // Transcoding threads of the voices, 0 (default) for the number of cores
+    void setAudioThreads(unsigned int numberOfThreads = 0);
+    // The sessions are exported under the budget shared by the exportings of a batch, as its job jobId
+    void setBudget(ExportBudget* budget, unsigned int jobId);
+    // The files are written by the queue of the batch instead of one of the exporting, it has to outlive run
+    void setWriteQueue(WriteQueue* writeQueue);
     void supportsFilter(bool supportsFilter = true);
     void setExtName(const std::string& extName);
     void setTemplatesName(const std::string& templatesName);
@@ -98,6 +196,9 @@ public:
     static void initializeExporter();
     static void uninitializeExporter();
     
+    // Load the full ITunesDb of the backup in background, run() of any Exporter on the same backup will take it over
+    static void prewarmITunes(const std::string& backup);
+    
     static bool hasPreviousExporting(const std::string& outputDir, int& options, std::string& exportTime);
 
 protected:
@@ -105,9 +206,25 @@ protected:
     bool exportUser(Friend& user, std::string& userOutputPath);
     // bool loadUserSessions(Friend& user, std::vector<Session>& sessions) const;
     bool loadUserFriendsAndSessions(const Friend& user, Friends& friends, std::vector<Session>& sessions, bool detailedInfo = true) const;
-    int exportSession(const Friend& user, const MessageParser& msgParser, const Session& session, const std::string& userBase, const std::string& outputBase);
+    // The sessions are not sorted by the tasks, the parser, friends and sessions have to outlive graph.run
+    void addUserFriendsAndSessionsTasks(TaskGraph& graph, SessionsParser& sessionsParser, const Friend& user, Friends& friends, std::vector<Session>& sessions, bool detailedInfo) const;
+    void exportSessionsInParallel(const Friend& myself, Friends& friends, TaskManager& taskManager, std::vector<Session>& sessions, const std::vector<size_t>& indexes, const std::string& outputBase, std::vector<int>& counts, std::vector<int64_t>& maxMsgIds, std::vector<SessionPages>& sessionPages);
+    // -1 if the session is skipped
+    int exportSessionItem(const Friend& user, const MessageParser& msgParser, const Session& session, size_t sessionIndex, size_t numberOfSessions, const std::string& outputBase, int64_t& maxMsgId, SessionPages& sessionPages);
+    int exportSession(const Friend& user, const MessageParser& msgParser, const Session& session, const std::string& outputBase, int64_t& maxMsgId, SessionPages& sessionPages);
+    // Messages newer than maxMsgId go to m_archive
+    int exportSessionToArchive(const Friend& user, const MessageParser& msgParser, const Session& session, int64_t& maxMsgId);
+    // Incremental exporting, no message is newer than maxMsgId of the previous exporting
+    bool isSessionUnchanged(const Session& session, const std::string& outputBase, int64_t maxMsgId) const;
+    std::string buildSessionListItem(const Session& session) const;
+    // unchanged: the pdf of the previous exporting is kept
+    void convertSessionToPdf(const Session& session, const std::string& outputBase, const std::string& userOutputPath, bool unchanged);
+    void convertHtmlToPdf(const Session& session, const std::string& htmlFileName, const std::string& pdfFileName, bool unchanged);
+    // Html page of a part of the session for printing, part is from 1
+    std::string getPdfPartFileName(const Session& session, const std::string& outputBase, size_t part) const;
     
-    bool exportMessage(const Session& session, const std::vector<TemplateValues>& tvs, std::vector<std::string>& messages);
+    bool exportMessage(const TemplateValuesList& tvs, std::string& content);
+    void buildSessionFrame(const Session& session, size_t pageSize, size_t numberOfMessages, const SessionPages& pages, std::string& header, std::string& footer) const;
 
     bool fillSession(Session& session, const Friends& friends) const;
     void releaseITunes();
@@ -123,19 +240,23 @@ protected:
     void notifySessionStart(const std::string& sessionUsrName, void * sessionData, uint32_t numberOfTotalMessages);
     void notifySessionComplete(const std::string& sessionUsrName, void * sessionData, bool cancelled = false);
     void notifySessionProgress(const std::string& sessionUsrName, void * sessionData, uint32_t numberOfMessages, uint32_t numberOfTotalMessages);
+    void notifySessionMemory(const std::string& sessionUsrName, void * sessionData, uint64_t peakBytes);
     void notifyTasksStart(const std::string& usrName, uint32_t numberOfTotalTasks);
     void notifyTasksComplete(const std::string& usrName, bool cancelled = false);
     void notifyTasksProgress(const std::string& usrName, uint32_t numberOfCompletedTasks, uint32_t numberOfTotalTasks);
+    // forced: sampled even if the interval isn't over yet
+    void notifyMetrics(bool forced = false);
     bool buildFileNameForUser(Friend& user, std::set<std::string>& existingFileNames);
-    std::string buildContentFromTemplateValues(const TemplateValues& values) const;
+    void buildContentFromTemplateValues(const TemplateValues& values, std::string& content) const;
     
     bool filterITunesFile(const char * file, int flags) const;
     
-    void serializeMessages(const std::string& fileName, const std::vector<std::string>& messages);
-    void unserializeMessages(const std::string& fileName, std::vector<std::string>& messages);
-    void mergeMessages(const std::string& fileName, std::vector<std::string>& messages);
-    
     static bool loadExportContext(const std::string& contextFile, ExportContext *context);
+    bool saveExportContext(bool incomplete);
+    void updateExportContext(const Session& session, int64_t maxMsgId, const SessionPages* sessionPages);
+    bool isCheckpointDue() const;
+    // Saves the export context of the exporting so far, with the pending downloads
+    void checkpoint();
     
     
 };
@@ -9,11 +9,18 @@
 #include "FileSystem.h"
 #include "Utils.h"
 #include "OSDef.h"
+#include "ExportMetrics.h"
+#include "Tracing.h"
 #ifndef NDEBUG
 #include <cassert>
 #endif
 // #include <iomanip>
 #include <fstream>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <unordered_set>
 
 #ifdef _WIN32
 #include <algorithm>
@@ -22,17 +29,310 @@
 #include <Shlwapi.h>
 #include <shlobj_core.h>
 #else //  _WIN32
+#include <algorithm>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fts.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef __APPLE__
+#include <sys/clonefile.h>
+#include <copyfile.h>
+#endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#endif
 #endif //  _WIN32
 
+// Big media files are copied without the system cache on Windows
+#define COPY_NO_BUFFERING_SIZE  (32 * 1024 * 1024)
+
+struct PathCache
+{
+    std::mutex mutex;
+    std::atomic<int> refCount;
+    std::unordered_set<std::string> directories;
+    std::unordered_set<std::string> files;
+    
+    PathCache() : refCount(0)
+    {
+    }
+};
+
+static PathCache g_pathCache;
+
+void enablePathCache(bool enabled)
+{
+    std::lock_guard<std::mutex> lock(g_pathCache.mutex);
+    if (enabled)
+    {
+        ++g_pathCache.refCount;
+    }
+    else if (g_pathCache.refCount > 0 && --g_pathCache.refCount == 0)
+    {
+        g_pathCache.directories.clear();
+        g_pathCache.files.clear();
+    }
+}
+
+static bool isCachedPath(const std::unordered_set<std::string>& paths, const std::string& path)
+{
+    if (g_pathCache.refCount == 0)
+    {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(g_pathCache.mutex);
+    return paths.find(path) != paths.cend();
+}
+
+static void addCachedPath(std::unordered_set<std::string>& paths, const std::string& path)
+{
+    if (g_pathCache.refCount == 0)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(g_pathCache.mutex);
+    if (g_pathCache.refCount > 0)
+    {
+        paths.insert(path);
+    }
+}
+
+static void removeCachedFile(const std::string& path)
+{
+    if (g_pathCache.refCount == 0)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(g_pathCache.mutex);
+    g_pathCache.files.erase(path);
+}
+
+static void clearPathCache()
+{
+    std::lock_guard<std::mutex> lock(g_pathCache.mutex);
+    g_pathCache.directories.clear();
+    g_pathCache.files.clear();
+}
+
+#ifdef _WIN32
+// UTF-8 to UTF-16 for the paths, ASCII (most of the paths) is widened as it is.
+// '/' becomes '\\', which the \\?\ paths need
+static void appendWidePath(const char* path, size_t length, std::wstring& output)
+{
+    size_t pos = 0;
+    while (pos < length && static_cast<unsigned char>(path[pos]) < 0x80)
+    {
+        output.push_back(path[pos] == ALT_DIR_SEP ? L'\\' : static_cast<wchar_t>(path[pos]));
+        ++pos;
+    }
+    if (pos == length)
+    {
+        return;
+    }
+    int wideLength = ::MultiByteToWideChar(CP_UTF8, 0, path + pos, static_cast<int>(length - pos), NULL, 0);
+    if (wideLength <= 0)
+    {
+        return;
+    }
+    size_t offset = output.size();
+    output.resize(offset + wideLength);
+    ::MultiByteToWideChar(CP_UTF8, 0, path + pos, static_cast<int>(length - pos), &output[offset], wideLength);
+    std::replace(output.begin() + offset, output.end(), L'/', L'\\');
+}
+
+// Directory of the last path of the thread, the files of an exporting mostly go to the same directories
+struct WideDirectoryCache
+{
+    std::string directory;
+    std::wstring wideDirectory;
+};
+
+static thread_local WideDirectoryCache t_wideDirectoryCache;
+
+// Wide form of a UTF-8 path for the W functions of Windows, in place of CW2T(CA2W(path, CP_UTF8)).
+// The directory is converted once for the files in it.
+// Absolute paths over MAX_PATH get the \\?\ prefix, they would fail without it
+class WidePath
+{
+public:
+    explicit WidePath(const std::string& path)
+    {
+        size_t pos = path.find_last_of("\\/");
+        if (pos != std::string::npos)
+        {
+            WideDirectoryCache& cache = t_wideDirectoryCache;
+            if (cache.directory.size() != pos + 1 || path.compare(0, pos + 1, cache.directory) != 0)
+            {
+                cache.directory.assign(path, 0, pos + 1);
+                cache.wideDirectory.clear();
+                appendWidePath(path.c_str(), pos + 1, cache.wideDirectory);
+            }
+            m_path.reserve(cache.wideDirectory.size() + path.size() - pos - 1);
+            m_path = cache.wideDirectory;
+            appendWidePath(path.c_str() + pos + 1, path.size() - pos - 1, m_path);
+        }
+        else
+        {
+            appendWidePath(path.c_str(), path.size(), m_path);
+        }
+
+        // The \\?\ paths aren't normalized, so the ones with . or .. are left as they are
+        if (m_path.size() >= MAX_PATH && m_path.find(L"\\.") == std::wstring::npos)
+        {
+            if (m_path.size() > 2 && m_path[1] == L':' && m_path[2] == L'\\')
+            {
+                m_path.insert(0, L"\\\\?\\");
+            }
+            else if (m_path.size() > 2 && m_path[0] == L'\\' && m_path[1] == L'\\' && m_path[2] != L'?')
+            {
+                m_path.replace(0, 2, L"\\\\?\\UNC\\");
+            }
+        }
+    }
+
+    operator LPCWSTR() const
+    {
+        return m_path.c_str();
+    }
+    const std::wstring& str() const
+    {
+        return m_path;
+    }
+
+private:
+    std::wstring m_path;
+};
+
+// Directories are created from the deepest existing one, the shell's SHCreateDirectoryEx is slower and has no long paths
+static bool createDirectories(std::wstring path)
+{
+    while (path.size() > 3 && path.back() == L'\\')
+    {
+        path.pop_back();
+    }
+    if (::CreateDirectoryW(path.c_str(), NULL))
+    {
+        return true;
+    }
+    DWORD err = ::GetLastError();
+    if (err == ERROR_ALREADY_EXISTS)
+    {
+        DWORD dwAttrib = ::GetFileAttributesW(path.c_str());
+        return dwAttrib != INVALID_FILE_ATTRIBUTES && (dwAttrib & FILE_ATTRIBUTE_DIRECTORY) == FILE_ATTRIBUTE_DIRECTORY;
+    }
+    size_t pos = path.find_last_of(L'\\');
+    // Up to the root, a drive or a share
+    if (err != ERROR_PATH_NOT_FOUND || pos == std::wstring::npos || pos == 0 || path[pos - 1] == L':' || path[pos - 1] == L'\\' || path[pos - 1] == L'?')
+    {
+        return false;
+    }
+    return createDirectories(path.substr(0, pos)) && (::CreateDirectoryW(path.c_str(), NULL) || ::GetLastError() == ERROR_ALREADY_EXISTS);
+}
+#endif
+
+static std::atomic<uint64_t> g_numberOfCopiedFiles(0);
+static std::atomic<uint64_t> g_copiedBytes(0);
+static std::atomic<uint64_t> g_copyTime(0);
+
+static void addCopyStats(uint64_t bytes, std::chrono::steady_clock::time_point startTime)
+{
+    ++g_numberOfCopiedFiles;
+    g_copiedBytes += bytes;
+    addExportMetric(EXPORT_METRIC_WRITTEN_BYTES, static_cast<int64_t>(bytes));
+    g_copyTime += static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count());
+}
+
+void getCopyStats(uint64_t& numberOfFiles, uint64_t& bytes, uint64_t& microseconds)
+{
+    numberOfFiles = g_numberOfCopiedFiles;
+    bytes = g_copiedBytes;
+    microseconds = g_copyTime;
+}
+
+#ifndef _WIN32
+// The kernel copies the data if it can (a clone of the blocks first, then copy_file_range),
+// otherwise it is streamed from where the kernel stopped
+static bool copyFileData(int srcFd, int destFd, uint64_t size)
+{
+#if defined(__linux__) && defined(FICLONE)
+    if (::ioctl(destFd, FICLONE, srcFd) == 0)
+    {
+        return true;
+    }
+#endif
+#ifdef __APPLE__
+    if (::fcopyfile(srcFd, destFd, NULL, COPYFILE_DATA) == 0)
+    {
+        return true;
+    }
+#endif
+#if defined(__linux__) && defined(SYS_copy_file_range)
+    uint64_t remaining = size;
+    while (remaining > 0)
+    {
+        ssize_t copied = ::syscall(SYS_copy_file_range, srcFd, NULL, destFd, NULL, static_cast<size_t>(std::min(remaining, static_cast<uint64_t>(0x40000000))), 0);
+        if (copied < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (copied <= 0)
+        {
+            // Not supported (old kernel, across file systems), or the source is shorter
+            break;
+        }
+        remaining -= static_cast<uint64_t>(copied);
+    }
+    if (remaining == 0)
+    {
+        return true;
+    }
+#endif
+
+    std::vector<char> buffer(1024 * 1024);
+    while (true)
+    {
+        ssize_t bytesRead = ::read(srcFd, &buffer[0], buffer.size());
+        if (bytesRead < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytesRead < 0)
+        {
+            return false;
+        }
+        if (bytesRead == 0)
+        {
+            return true;
+        }
+        const char* ptr = &buffer[0];
+        while (bytesRead > 0)
+        {
+            ssize_t written = ::write(destFd, ptr, static_cast<size_t>(bytesRead));
+            if (written < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (written <= 0)
+            {
+                return false;
+            }
+            ptr += written;
+            bytesRead -= written;
+        }
+    }
+}
+#endif
+
 size_t getFileSize(const std::string& path)
 {
 #ifdef _WIN32
-    CW2T pszT(CA2W(path.c_str(), CP_UTF8));
+    WidePath pszT(path);
 	HANDLE hFile = CreateFile((LPCTSTR)pszT, GENERIC_READ,
 		FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
 		FILE_ATTRIBUTE_NORMAL, NULL);
@@ -55,19 +355,54 @@ size_t getFileSize(const std::string& path)
 #endif
 }
 
+bool getFileInfo(const std::string& path, uint64_t& size, std::time_t& modifiedTime)
+{
+#ifdef _WIN32
+    WidePath pszT(path);
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!::GetFileAttributesEx((LPCTSTR)pszT, GetFileExInfoStandard, &data))
+    {
+        return false;
+    }
+    size = (static_cast<uint64_t>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+    // FILETIME is in 100ns since 1601-01-01
+    uint64_t fileTime = (static_cast<uint64_t>(data.ftLastWriteTime.dwHighDateTime) << 32) | data.ftLastWriteTime.dwLowDateTime;
+    modifiedTime = static_cast<std::time_t>(fileTime / 10000000ULL - 11644473600ULL);
+    return true;
+#else
+    struct stat sb;
+    if (stat(path.c_str(), &sb) != 0)
+    {
+        return false;
+    }
+    size = static_cast<uint64_t>(sb.st_size);
+    modifiedTime = sb.st_mtime;
+    return true;
+#endif
+}
+
 bool existsDirectory(const std::string& path)
 {
+    if (isCachedPath(g_pathCache.directories, path))
+    {
+        return true;
+    }
 #ifdef _WIN32
-	CW2T pszT(CA2W(path.c_str(), CP_UTF8));
+	WidePath pszT(path);
 
 	DWORD dwAttrib = ::GetFileAttributes((LPCTSTR)pszT);
 
-	return (dwAttrib != INVALID_FILE_ATTRIBUTES &&
+	bool existed = (dwAttrib != INVALID_FILE_ATTRIBUTES &&
 		(dwAttrib & FILE_ATTRIBUTE_DIRECTORY) == FILE_ATTRIBUTE_DIRECTORY);
 #else
     struct stat sb;
-    return (stat(path.c_str(), &sb) == 0 && S_ISDIR(sb.st_mode));
+    bool existed = (stat(path.c_str(), &sb) == 0 && S_ISDIR(sb.st_mode));
 #endif
+    if (existed)
+    {
+        addCachedPath(g_pathCache.directories, path);
+    }
+    return existed;
 }
 
 #ifndef _WIN32
@@ -103,10 +438,18 @@ bool makeDirectory(const std::string& path)
 #endif
 #endif
     
+    if (isCachedPath(g_pathCache.directories, path))
+    {
+        return true;
+    }
 #ifdef _WIN32
-	CW2T pszT(CA2W(path.c_str(), CP_UTF8));
-
-	return ::SHCreateDirectoryEx(NULL, (LPCTSTR)pszT, NULL) == ERROR_SUCCESS;
+	WidePath pszT(path);
+	bool created = createDirectories(pszT.str());
+	if (created)
+	{
+		addCachedPath(g_pathCache.directories, path);
+	}
+	return created;
 #else
     std::vector<std::string::value_type> copypath;
     copypath.reserve(path.size() + 1);
@@ -135,14 +478,19 @@ bool makeDirectory(const std::string& path)
         status = makePathImpl(&copypath[0], mode);
     }
     
+    if (status == 0)
+    {
+        addCachedPath(g_pathCache.directories, path);
+    }
     return status == 0;
 #endif
 }
 
 bool deleteFile(const std::string& path)
 {
+    removeCachedFile(path);
 #ifdef _WIN32
-	CW2T pszT(CA2W(path.c_str(), CP_UTF8));
+	WidePath pszT(path);
 	return ::DeleteFile((LPCTSTR)pszT) == TRUE;
 #else
     return 0 == std::remove(path.c_str());
@@ -151,6 +499,11 @@ bool deleteFile(const std::string& path)
 
 bool deleteDirectory(const std::string& path)
 {
+    // Everything in it is gone
+    if (g_pathCache.refCount > 0)
+    {
+        clearPathCache();
+    }
 #ifdef _WIN32
 	CW2T pszT(CA2W(path.c_str(), CP_UTF8));
 
@@ -241,17 +594,26 @@ finish:
 
 bool existsFile(const std::string& path)
 {
+    if (isCachedPath(g_pathCache.files, path))
+    {
+        return true;
+    }
 #ifdef _WIN32
-	CW2T pszT(CA2W(path.c_str(), CP_UTF8));
+	WidePath pszT(path);
 
 	DWORD dwAttrib = ::GetFileAttributes((LPCTSTR)pszT);
 
-	return (dwAttrib != INVALID_FILE_ATTRIBUTES &&
+	bool existed = (dwAttrib != INVALID_FILE_ATTRIBUTES &&
 		(dwAttrib & FILE_ATTRIBUTE_DIRECTORY) == 0);
 #else
     struct stat sb;
-    return (stat(path.c_str(), &sb) == 0);
+    bool existed = (stat(path.c_str(), &sb) == 0);
 #endif
+    if (existed)
+    {
+        addCachedPath(g_pathCache.files, path);
+    }
+    return existed;
 }
 
 bool listSubDirectories(const std::string& path, std::vector<std::string>& subDirectories)
@@ -309,13 +671,30 @@ bool listSubDirectories(const std::string& path, std::vector<std::string>& subDi
 bool copyFile(const std::string& src, const std::string& dest, bool overwrite)
 {
 #ifdef _WIN32
-	CW2T pszSrc(CA2W(src.c_str(), CP_UTF8));
-	CW2T pszDest(CA2W(dest.c_str(), CP_UTF8));
+	WidePath pszSrc(src);
+	WidePath pszDest(dest);
 
 	BOOL bRet = FALSE;
 	if (::PathFileExists((LPCTSTR)pszSrc))
 	{
-		bRet = ::CopyFile((LPCTSTR)pszSrc, (LPCTSTR)pszDest, (overwrite ? FALSE : TRUE));
+		std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+		WIN32_FILE_ATTRIBUTE_DATA fileData = { 0 };
+		uint64_t size = 0;
+		if (::GetFileAttributesEx((LPCTSTR)pszSrc, GetFileExInfoStandard, &fileData))
+		{
+			size = (static_cast<uint64_t>(fileData.nFileSizeHigh) << 32) | fileData.nFileSizeLow;
+		}
+		DWORD flags = overwrite ? 0 : COPY_FILE_FAIL_IF_EXISTS;
+		if (size >= COPY_NO_BUFFERING_SIZE)
+		{
+			flags |= COPY_FILE_NO_BUFFERING;
+		}
+		bRet = ::CopyFileEx((LPCTSTR)pszSrc, (LPCTSTR)pszDest, NULL, NULL, NULL, flags);
+		if (bRet)
+		{
+			addCopyStats(size, startTime);
+			addCachedPath(g_pathCache.files, dest);
+		}
 #ifndef NDEBUG
 		DWORD err = ::GetLastError();
 		TCHAR buffer[256] = { 0 };
@@ -332,30 +711,97 @@ bool copyFile(const std::string& src, const std::string& dest, bool overwrite)
         return false;
     }
     
-    std::ifstream ss(src, std::ios::in | std::ios::binary);
-    if (!ss.is_open())
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+    int srcFd = ::open(src.c_str(), O_RDONLY);
+    if (srcFd == -1)
     {
 #ifndef NDEBUG
         // assert(false);
 #endif
         return false;
     }
-    std::ofstream ds(dest, std::ios::out | std::ios::binary | std::ios::trunc);
-    if (!ds.is_open())
+    struct stat sb;
+    if (fstat(srcFd, &sb) != 0)
+    {
+        ::close(srcFd);
+        return false;
+    }
+#ifdef __APPLE__
+    // A clone on APFS shares the blocks until one of them is changed
+    ::unlink(dest.c_str());
+    if (::clonefile(src.c_str(), dest.c_str(), 0) == 0)
+    {
+        ::close(srcFd);
+        addCopyStats(static_cast<uint64_t>(sb.st_size), startTime);
+        addCachedPath(g_pathCache.files, dest);
+        return true;
+    }
+#endif
+    int destFd = ::open(dest.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (destFd == -1)
     {
 #ifndef NDEBUG
         assert(false);
 #endif
-        ss.close();
+        ::close(srcFd);
         return false;
     }
-    ds << ss.rdbuf();
+    bool succeeded = copyFileData(srcFd, destFd, static_cast<uint64_t>(sb.st_size));
+    ::close(srcFd);
+    succeeded = (::close(destFd) == 0) && succeeded;
+    if (succeeded)
+    {
+        addCopyStats(static_cast<uint64_t>(sb.st_size), startTime);
+        addCachedPath(g_pathCache.files, dest);
+    }
+    return succeeded;
+#endif
+}
 
-    ss.close();
-    ds.close();
-    
-    return true;
+bool linkFile(const std::string& src, const std::string& dest)
+{
+    removeCachedFile(dest);
+#ifdef _WIN32
+    WidePath pszSrc(src);
+    WidePath pszDest(dest);
+    ::DeleteFile((LPCTSTR)pszDest);
+    bool linked = ::CreateHardLink((LPCTSTR)pszDest, (LPCTSTR)pszSrc, NULL) == TRUE;
+#else
+    ::unlink(dest.c_str());
+    bool linked = false;
+#ifdef __APPLE__
+    // A clone shares the blocks but stays a file of its own
+    linked = ::clonefile(src.c_str(), dest.c_str(), 0) == 0;
+#endif
+    linked = linked || ::link(src.c_str(), dest.c_str()) == 0;
+#endif
+    if (linked)
+    {
+        addCachedPath(g_pathCache.files, dest);
+    }
+    return linked;
+}
+
+bool symlinkFile(const std::string& src, const std::string& dest)
+{
+    removeCachedFile(dest);
+#ifdef _WIN32
+    WidePath pszSrc(src);
+    WidePath pszDest(dest);
+    ::DeleteFile((LPCTSTR)pszDest);
+#ifndef SYMBOLIC_LINK_FLAG_ALLOW_UNPRIVILEGED_CREATE
+#define SYMBOLIC_LINK_FLAG_ALLOW_UNPRIVILEGED_CREATE 0x2
+#endif
+    bool linked = ::CreateSymbolicLink((LPCTSTR)pszDest, (LPCTSTR)pszSrc, SYMBOLIC_LINK_FLAG_ALLOW_UNPRIVILEGED_CREATE) != FALSE;
+#else
+    ::unlink(dest.c_str());
+    bool linked = ::symlink(src.c_str(), dest.c_str()) == 0;
 #endif
+    if (linked)
+    {
+        addCachedPath(g_pathCache.files, dest);
+    }
+    return linked;
 }
 
 bool moveFile(const std::string& src, const std::string& dest, bool overwrite/* = true*/)
@@ -370,9 +816,13 @@ bool moveFile(const std::string& src, const std::string& dest, bool overwrite/*
 		assert(!"dest is empty");
 	}
 #endif
+    if (overwrite)
+    {
+        removeCachedFile(dest);
+    }
 #ifdef _WIN32
-	CW2T pszSrc(CA2W(src.c_str(), CP_UTF8));
-	CW2T pszDest(CA2W(dest.c_str(), CP_UTF8));
+	WidePath pszSrc(src);
+	WidePath pszDest(dest);
 	if (overwrite && ::PathFileExists((LPCTSTR)pszDest))
 	{
 		::DeleteFile((LPCTSTR)pszDest);
@@ -389,6 +839,11 @@ bool moveFile(const std::string& src, const std::string& dest, bool overwrite/*
 		}
 #endif
 	}
+    if (bRet)
+    {
+        removeCachedFile(src);
+        addCachedPath(g_pathCache.files, dest);
+    }
     return bRet;
 #else
     if (overwrite)
@@ -407,6 +862,11 @@ bool moveFile(const std::string& src, const std::string& dest, bool overwrite/*
 #ifndef NDEBUG
     assert(ret == 0);
 #endif
+    if (ret == 0)
+    {
+        removeCachedFile(src);
+        addCachedPath(g_pathCache.files, dest);
+    }
     return ret == 0;
 #endif
 }
@@ -561,8 +1021,8 @@ std::string readFile(const std::string& path)
 bool readFile(const std::string& path, std::vector<unsigned char>& data)
 {
 #ifdef _WIN32
-    CA2W pszW(path.c_str(), CP_UTF8);
-    std::ifstream ifs(pszW, std::ios::in | std::ios::binary | std::ios::ate);
+    WidePath pszW(path);
+    std::ifstream ifs((LPCWSTR)pszW, std::ios::in | std::ios::binary | std::ios::ate);
 #else
     std::ifstream ifs(path, std::ios::in | std::ios::binary | std::ios::ate);
 #endif
@@ -595,8 +1055,9 @@ bool writeFile(const std::string& path, const std::string& data)
 
 bool writeFile(const std::string& path, const unsigned char* data, size_t dataLength)
 {
+    TraceSpan span("io", "writeFile", "bytes", static_cast<int64_t>(dataLength));
 #ifdef _WIN32
-    CW2T pszT(CA2W(path.c_str(), CP_UTF8));
+    WidePath pszT(path);
 
     HANDLE hFile = CreateFile(pszT, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
     if (hFile == INVALID_HANDLE_VALUE)
@@ -609,6 +1070,7 @@ bool writeFile(const std::string& path, const unsigned char* data, size_t dataLe
     BOOL bErrorFlag = WriteFile(hFile, data, dwBytesToWrite, &dwBytesWritten, NULL);
 
     ::CloseHandle(hFile);
+    addExportMetric(EXPORT_METRIC_WRITTEN_BYTES, dwBytesWritten);
     return (TRUE == bErrorFlag);
 #else
 
@@ -618,6 +1080,7 @@ bool writeFile(const std::string& path, const unsigned char* data, size_t dataLe
     {
         ofs.write(reinterpret_cast<const char *>(data), dataLength);
         ofs.close();
+        addExportMetric(EXPORT_METRIC_WRITTEN_BYTES, static_cast<int64_t>(dataLength));
         return true;
     }
 
@@ -632,8 +1095,9 @@ bool appendFile(const std::string& path, const std::string& data)
 
 bool appendFile(const std::string& path, const unsigned char* data, size_t dataLength)
 {
+    TraceSpan span("io", "appendFile", "bytes", static_cast<int64_t>(dataLength));
 #ifdef _WIN32
-    CW2T pszT(CA2W(path.c_str(), CP_UTF8));
+    WidePath pszT(path);
 
     HANDLE hFile = ::CreateFile(pszT, GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
     if (hFile == INVALID_HANDLE_VALUE)
@@ -646,6 +1110,7 @@ bool appendFile(const std::string& path, const unsigned char* data, size_t dataL
     DWORD dwBytesWritten = 0;
     BOOL bErrorFlag = WriteFile(hFile, data, dwBytesToWrite, &dwBytesWritten, NULL);
     ::CloseHandle(hFile);
+    addExportMetric(EXPORT_METRIC_WRITTEN_BYTES, dwBytesWritten);
     return (TRUE == bErrorFlag);
 #else
     std::ofstream ofs;
@@ -654,6 +1119,7 @@ bool appendFile(const std::string& path, const unsigned char* data, size_t dataL
     {
         ofs.write(reinterpret_cast<const char *>(data), dataLength);
         ofs.close();
+        addExportMetric(EXPORT_METRIC_WRITTEN_BYTES, static_cast<int64_t>(dataLength));
         return true;
     }
 
@@ -727,3 +1193,287 @@ void normalizePath(std::string& path)
 {
     std::replace(path.begin(), path.end(), ALT_DIR_SEP, DIR_SEP);
 }
+
+MappedFile::MappedFile() : m_data(NULL), m_size(0)
+#ifdef _WIN32
+    , m_file(INVALID_HANDLE_VALUE), m_mapping(NULL)
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+bool MappedFile::open(const std::string& path)
+{
+    close();
+#ifdef _WIN32
+    WidePath pszT(path);
+    HANDLE hFile = ::CreateFile((LPCTSTR)pszT, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+    LARGE_INTEGER fileSize;
+    if (!::GetFileSizeEx(hFile, &fileSize) || fileSize.QuadPart == 0)
+    {
+        ::CloseHandle(hFile);
+        return false;
+    }
+    HANDLE hMapping = ::CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (NULL == hMapping)
+    {
+        ::CloseHandle(hFile);
+        return false;
+    }
+    void* data = ::MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    if (NULL == data)
+    {
+        ::CloseHandle(hMapping);
+        ::CloseHandle(hFile);
+        return false;
+    }
+    m_file = hFile;
+    m_mapping = hMapping;
+    m_data = reinterpret_cast<const unsigned char *>(data);
+    m_size = static_cast<size_t>(fileSize.QuadPart);
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+    {
+        return false;
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) != 0 || sb.st_size == 0)
+    {
+        ::close(fd);
+        return false;
+    }
+    void* data = mmap(NULL, static_cast<size_t>(sb.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping holds its own reference to the file
+    ::close(fd);
+    if (data == MAP_FAILED)
+    {
+        return false;
+    }
+    m_data = reinterpret_cast<const unsigned char *>(data);
+    m_size = static_cast<size_t>(sb.st_size);
+#endif
+    return true;
+}
+
+void MappedFile::close()
+{
+#ifdef _WIN32
+    if (NULL != m_data)
+    {
+        ::UnmapViewOfFile(m_data);
+    }
+    if (NULL != m_mapping)
+    {
+        ::CloseHandle(m_mapping);
+        m_mapping = NULL;
+    }
+    if (m_file != INVALID_HANDLE_VALUE)
+    {
+        ::CloseHandle(m_file);
+        m_file = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (NULL != m_data)
+    {
+        munmap(const_cast<unsigned char *>(m_data), m_size);
+    }
+#endif
+    m_data = NULL;
+    m_size = 0;
+}
+
+FileWriter::FileWriter(size_t bufferSize/* = 64 * 1024*/) : m_buffer(bufferSize), m_used(0), m_position(0), m_failed(false)
+#ifdef _WIN32
+    , m_file(INVALID_HANDLE_VALUE)
+#else
+    , m_file(-1)
+#endif
+{
+}
+
+FileWriter::~FileWriter()
+{
+    close();
+}
+
+bool FileWriter::open(const std::string& path)
+{
+    close();
+    m_used = 0;
+    m_position = 0;
+    m_failed = false;
+#ifdef _WIN32
+    WidePath pszT(path);
+    m_file = ::CreateFile((LPCTSTR)pszT, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+#else
+    m_file = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+    if (isOpen())
+    {
+        addCachedPath(g_pathCache.files, path);
+    }
+    return isOpen();
+}
+
+bool FileWriter::openAt(const std::string& path, uint64_t offset)
+{
+    close();
+    m_used = 0;
+    m_position = offset;
+    m_failed = false;
+#ifdef _WIN32
+    WidePath pszT(path);
+    m_file = ::CreateFile((LPCTSTR)pszT, GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (m_file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+    LARGE_INTEGER pos;
+    pos.QuadPart = static_cast<LONGLONG>(offset);
+    bool succeeded = ::SetFilePointerEx(m_file, pos, NULL, FILE_BEGIN) && ::SetEndOfFile(m_file);
+#else
+    m_file = ::open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+    if (m_file == -1)
+    {
+        return false;
+    }
+    bool succeeded = ftruncate(m_file, static_cast<off_t>(offset)) == 0 && lseek(m_file, static_cast<off_t>(offset), SEEK_SET) == static_cast<off_t>(offset);
+#endif
+    if (!succeeded)
+    {
+        close();
+        return false;
+    }
+    addCachedPath(g_pathCache.files, path);
+    return true;
+}
+
+bool FileWriter::isOpen() const
+{
+#ifdef _WIN32
+    return m_file != INVALID_HANDLE_VALUE;
+#else
+    return m_file != -1;
+#endif
+}
+
+bool FileWriter::close()
+{
+    if (!isOpen())
+    {
+        return false;
+    }
+    bool succeeded = flush();
+#ifdef _WIN32
+    ::CloseHandle(m_file);
+    m_file = INVALID_HANDLE_VALUE;
+#else
+    ::close(m_file);
+    m_file = -1;
+#endif
+    return succeeded && !m_failed;
+}
+
+bool FileWriter::write(const void* data, size_t length)
+{
+    if (length == 0)
+    {
+        return true;
+    }
+    if (m_used + length > m_buffer.size())
+    {
+        if (!flush())
+        {
+            return false;
+        }
+        if (length >= m_buffer.size())
+        {
+            // Too big for the buffer, no copy at all
+            return writeToFile(data, length);
+        }
+    }
+    memcpy(&m_buffer[m_used], data, length);
+    m_used += length;
+    return true;
+}
+
+bool FileWriter::writeAt(uint64_t offset, const void* data, size_t length)
+{
+    if (!flush() || offset + length > m_position)
+    {
+        return false;
+    }
+#ifdef _WIN32
+    LARGE_INTEGER pos;
+    pos.QuadPart = static_cast<LONGLONG>(offset);
+    DWORD dwBytesWritten = 0;
+    bool succeeded = ::SetFilePointerEx(m_file, pos, NULL, FILE_BEGIN) && ::WriteFile(m_file, data, static_cast<DWORD>(length), &dwBytesWritten, NULL) && dwBytesWritten == length;
+    pos.QuadPart = 0;
+    ::SetFilePointerEx(m_file, pos, NULL, FILE_END);
+#else
+    bool succeeded = pwrite(m_file, data, length, static_cast<off_t>(offset)) == static_cast<ssize_t>(length);
+#endif
+    if (!succeeded)
+    {
+        m_failed = true;
+    }
+    return succeeded;
+}
+
+bool FileWriter::flush()
+{
+    if (m_used == 0)
+    {
+        return !m_failed;
+    }
+    size_t used = m_used;
+    m_used = 0;
+    return writeToFile(&m_buffer[0], used);
+}
+
+bool FileWriter::writeToFile(const void* data, size_t length)
+{
+    if (m_failed || !isOpen())
+    {
+        return false;
+    }
+    const char* ptr = reinterpret_cast<const char *>(data);
+    while (length > 0)
+    {
+#ifdef _WIN32
+        DWORD dwBytesWritten = 0;
+        DWORD dwBytesToWrite = static_cast<DWORD>(std::min(length, static_cast<size_t>(0x40000000)));
+        if (!::WriteFile(m_file, ptr, dwBytesToWrite, &dwBytesWritten, NULL) || dwBytesWritten == 0)
+        {
+            m_failed = true;
+            return false;
+        }
+        size_t written = dwBytesWritten;
+#else
+        ssize_t written = ::write(m_file, ptr, length);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            m_failed = true;
+            return false;
+        }
+#endif
+        ptr += written;
+        length -= written;
+        m_position += written;
+        addExportMetric(EXPORT_METRIC_WRITTEN_BYTES, static_cast<int64_t>(written));
+    }
+    return true;
+}
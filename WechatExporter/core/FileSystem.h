@@ -11,6 +11,8 @@
 
 #include <string>
 #include <vector>
+#include <ctime>
+#include <cstdint>
 
 #ifdef _WIN32
 #define DIR_SEP '\\'
@@ -22,7 +24,13 @@
 #define ALT_DIR_SEP '\\'
 #endif
 
+// Directories and files known to exist are cached while it is enabled, e.g. during an exporting,
+// so that existsDirectory, makeDirectory and existsFile skip the system calls for them.
+// Only the changes made through the functions below are seen, calls of enablePathCache can be nested
+void enablePathCache(bool enabled);
+
 size_t getFileSize(const std::string& path);
+bool getFileInfo(const std::string& path, uint64_t& size, std::time_t& modifiedTime);
 bool existsDirectory(const std::string& path);
 bool makeDirectory(const std::string& path);
 bool deleteFile(const std::string& path);
@@ -31,6 +39,12 @@ bool existsFile(const std::string& path);
 bool listSubDirectories(const std::string& path, std::vector<std::string>& subDirectories);
 bool copyFile(const std::string& src, const std::string& dest, bool overwrite = true);
 bool moveFile(const std::string& src, const std::string& dest, bool overwrite = true);
+// Files copied by copyFile so far, for the perf logging
+void getCopyStats(uint64_t& numberOfFiles, uint64_t& bytes, uint64_t& microseconds);
+// dest is replaced by a clone (APFS) or a hard link of src, which fails across volumes or on file systems without links
+bool linkFile(const std::string& src, const std::string& dest);
+// dest is replaced by a symbolic link to src, which is to be an absolute path. Windows needs the developer mode or the privilege for it
+bool symlinkFile(const std::string& src, const std::string& dest);
 // ref: https://blackbeltreview.wordpress.com/2015/01/27/illegal-filename-characters-on-windows-vs-mac-os/
 bool isValidFileName(const std::string& fileName);
 std::string removeInvalidCharsForFileName(const std::string& fileName);
@@ -52,5 +66,85 @@ std::string combinePath(const std::string& p1, const std::string& p2, const std:
 std::string normalizePath(const std::string& path);
 void normalizePath(std::string& path);
 
+// Read-only memory mapping of the whole file
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+    
+    bool open(const std::string& path);
+    void close();
+    
+    bool isOpen() const
+    {
+        return NULL != m_data;
+    }
+    const unsigned char* data() const
+    {
+        return m_data;
+    }
+    size_t size() const
+    {
+        return m_size;
+    }
+    
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+    
+    const unsigned char* m_data;
+    size_t m_size;
+#ifdef _WIN32
+    void* m_file;
+    void* m_mapping;
+#endif
+};
+
+// Sequential writer of a new file through a buffer, data already written can still be patched by writeAt
+class FileWriter
+{
+public:
+    explicit FileWriter(size_t bufferSize = 64 * 1024);
+    ~FileWriter();
+    
+    // The file is truncated
+    bool open(const std::string& path);
+    // The file is kept up to offset and written from there, it is created if it doesn't exist
+    bool openAt(const std::string& path, uint64_t offset);
+    bool close();
+    
+    bool isOpen() const;
+    
+    bool write(const void* data, size_t length);
+    bool write(const std::string& data)
+    {
+        return write(data.c_str(), data.size());
+    }
+    bool writeAt(uint64_t offset, const void* data, size_t length);
+    bool flush();
+    
+    // Including the data in buffer
+    uint64_t getSize() const
+    {
+        return m_position + m_used;
+    }
+    
+private:
+    FileWriter(const FileWriter&);
+    FileWriter& operator=(const FileWriter&);
+    
+    bool writeToFile(const void* data, size_t length);
+    
+    std::vector<char> m_buffer;
+    size_t m_used;
+    uint64_t m_position;
+    bool m_failed;
+#ifdef _WIN32
+    void* m_file;
+#else
+    int m_file;
+#endif
+};
 
 #endif /* FileSystem_h */
@@ -0,0 +1,393 @@
+//
+//  HashTable.h
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#ifndef HashTable_h
+#define HashTable_h
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdint>
+
+// 128-bit hash of a string, kept instead of the string in the tables that only need to tell whether it is there.
+// Two independent 64-bit hashes, a collision of both of them is not expected in an exporting
+struct HashKey
+{
+    uint64_t high;
+    uint64_t low;
+
+    bool operator==(const HashKey& other) const
+    {
+        return high == other.high && low == other.low;
+    }
+
+    // Keys of digests order like their hex strings
+    bool operator<(const HashKey& other) const
+    {
+        return high < other.high || (high == other.high && low < other.low);
+    }
+
+    bool isEmpty() const
+    {
+        return high == 0 && low == 0;
+    }
+};
+
+inline uint64_t mixHash64(uint64_t value)
+{
+    // Finalizer of MurmurHash3
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdULL;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53ULL;
+    value ^= value >> 33;
+    return value;
+}
+
+inline HashKey hashString(const char* data, size_t length)
+{
+    // FNV-1a and a multiplicative hash of another constant
+    uint64_t high = 0xcbf29ce484222325ULL;
+    uint64_t low = 0x9e3779b97f4a7c15ULL ^ length;
+    for (size_t idx = 0; idx < length; ++idx)
+    {
+        unsigned char ch = static_cast<unsigned char>(data[idx]);
+        high = (high ^ ch) * 0x100000001b3ULL;
+        low = (low + ch) * 0xc6a4a7935bd1e995ULL;
+        low ^= low >> 29;
+    }
+    HashKey key = { mixHash64(high), mixHash64(low) };
+    if (key.isEmpty())
+    {
+        // The empty key marks the free slots
+        key.low = 1;
+    }
+    return key;
+}
+
+inline HashKey hashString(const std::string& value)
+{
+    return hashString(value.c_str(), value.size());
+}
+
+// Key of a 16-byte digest like MD5, the bytes are kept in their order so formatHashKey gives the same hex string
+inline HashKey makeHashKey(const unsigned char* digest)
+{
+    HashKey key = { 0, 0 };
+    for (int idx = 0; idx < 8; ++idx)
+    {
+        key.high = (key.high << 8) | digest[idx];
+        key.low = (key.low << 8) | digest[idx + 8];
+    }
+    return key;
+}
+
+// hex is the 32 digits of a digest, in lower or upper case
+inline bool parseHashKey(const char* hex, size_t length, HashKey& key)
+{
+    if (length != 32)
+    {
+        return false;
+    }
+    uint64_t parts[2] = { 0, 0 };
+    for (size_t idx = 0; idx < length; ++idx)
+    {
+        char ch = hex[idx];
+        uint64_t digit = 0;
+        if (ch >= '0' && ch <= '9')
+        {
+            digit = ch - '0';
+        }
+        else if (ch >= 'a' && ch <= 'f')
+        {
+            digit = ch - 'a' + 10;
+        }
+        else if (ch >= 'A' && ch <= 'F')
+        {
+            digit = ch - 'A' + 10;
+        }
+        else
+        {
+            return false;
+        }
+        parts[idx / 16] = (parts[idx / 16] << 4) | digit;
+    }
+    key.high = parts[0];
+    key.low = parts[1];
+    return true;
+}
+
+inline bool parseHashKey(const std::string& hex, HashKey& key)
+{
+    return parseHashKey(hex.c_str(), hex.size(), key);
+}
+
+// Lower case hex of the digest, empty for the empty key
+inline std::string formatHashKey(const HashKey& key)
+{
+    if (key.isEmpty())
+    {
+        return std::string();
+    }
+    static const char digits[] = "0123456789abcdef";
+    std::string hex(32, '0');
+    for (int idx = 15; idx >= 0; --idx)
+    {
+        hex[idx] = digits[(key.high >> ((15 - idx) * 4)) & 0xF];
+        hex[idx + 16] = digits[(key.low >> ((15 - idx) * 4)) & 0xF];
+    }
+    return hex;
+}
+
+// Open addressing with linear probing on HashKeys, Entry is a struct with a HashKey member named key.
+// The entries are in one array, no node is allocated for them, and the table is at most 3/4 full
+template <class Entry>
+class OpenHashTable
+{
+public:
+    OpenHashTable() : m_size(0)
+    {
+    }
+
+    Entry* find(const HashKey& key)
+    {
+        if (m_entries.empty())
+        {
+            return NULL;
+        }
+        size_t mask = m_entries.size() - 1;
+        for (size_t idx = static_cast<size_t>(key.high) & mask; !m_entries[idx].key.isEmpty(); idx = (idx + 1) & mask)
+        {
+            if (m_entries[idx].key == key)
+            {
+                return &m_entries[idx];
+            }
+        }
+        return NULL;
+    }
+
+    const Entry* find(const HashKey& key) const
+    {
+        return const_cast<OpenHashTable *>(this)->find(key);
+    }
+
+    // The entry of key, inserted is false if it is there already
+    Entry* insert(const HashKey& key, bool& inserted)
+    {
+        if ((m_size + 1) * 4 > m_entries.size() * 3)
+        {
+            rehash(m_entries.empty() ? 16 : m_entries.size() * 2);
+        }
+        size_t mask = m_entries.size() - 1;
+        size_t idx = static_cast<size_t>(key.high) & mask;
+        for (; !m_entries[idx].key.isEmpty(); idx = (idx + 1) & mask)
+        {
+            if (m_entries[idx].key == key)
+            {
+                inserted = false;
+                return &m_entries[idx];
+            }
+        }
+        m_entries[idx] = Entry();
+        m_entries[idx].key = key;
+        ++m_size;
+        inserted = true;
+        return &m_entries[idx];
+    }
+
+    bool erase(const HashKey& key)
+    {
+        Entry* entry = find(key);
+        if (NULL == entry)
+        {
+            return false;
+        }
+        // Backward shift, the entries after it are moved up so no tombstone is left
+        size_t mask = m_entries.size() - 1;
+        size_t hole = static_cast<size_t>(entry - &m_entries[0]);
+        for (size_t idx = (hole + 1) & mask; !m_entries[idx].key.isEmpty(); idx = (idx + 1) & mask)
+        {
+            size_t home = static_cast<size_t>(m_entries[idx].key.high) & mask;
+            // The entry can fill the hole if its home isn't in (hole, idx]
+            if (((idx - home) & mask) >= ((idx - hole) & mask))
+            {
+                m_entries[hole] = m_entries[idx];
+                hole = idx;
+            }
+        }
+        m_entries[hole] = Entry();
+        --m_size;
+        return true;
+    }
+
+    size_t size() const
+    {
+        return m_size;
+    }
+
+    bool empty() const
+    {
+        return m_size == 0;
+    }
+
+    void clear()
+    {
+        std::vector<Entry>().swap(m_entries);
+        m_size = 0;
+    }
+
+    size_t getMemoryUsage() const
+    {
+        return m_entries.capacity() * sizeof(Entry);
+    }
+
+    // visitor is called with each entry, in the order of the slots
+    template <class Visitor>
+    void forEach(Visitor visitor) const
+    {
+        for (typename std::vector<Entry>::const_iterator it = m_entries.cbegin(); it != m_entries.cend(); ++it)
+        {
+            if (!it->key.isEmpty())
+            {
+                visitor(*it);
+            }
+        }
+    }
+
+    // The visitor can change the values, not the keys
+    template <class Visitor>
+    void forEach(Visitor visitor)
+    {
+        for (typename std::vector<Entry>::iterator it = m_entries.begin(); it != m_entries.end(); ++it)
+        {
+            if (!it->key.isEmpty())
+            {
+                visitor(*it);
+            }
+        }
+    }
+
+private:
+    void rehash(size_t capacity)
+    {
+        std::vector<Entry> entries(capacity);
+        entries.swap(m_entries);
+        size_t mask = capacity - 1;
+        for (typename std::vector<Entry>::const_iterator it = entries.cbegin(); it != entries.cend(); ++it)
+        {
+            if (it->key.isEmpty())
+            {
+                continue;
+            }
+            size_t idx = static_cast<size_t>(it->key.high) & mask;
+            while (!m_entries[idx].key.isEmpty())
+            {
+                idx = (idx + 1) & mask;
+            }
+            m_entries[idx] = *it;
+        }
+    }
+
+    std::vector<Entry> m_entries;  // Size is 0 or a power of 2
+    size_t m_size;
+};
+
+struct HashSetEntry
+{
+    HashKey key;
+
+    HashSetEntry()
+    {
+        key.high = 0;
+        key.low = 0;
+    }
+};
+
+template <class T>
+struct HashMapEntry
+{
+    HashKey key;
+    T value;
+
+    HashMapEntry() : value()
+    {
+        key.high = 0;
+        key.low = 0;
+    }
+};
+
+typedef OpenHashTable<HashSetEntry> HashSet;
+template <class T>
+using HashMap = OpenHashTable<HashMapEntry<T>>;
+
+// Paths kept as the index of the directory and the file name in one buffer, the directories of
+// an exporting are a few, and the names don't take a node and a heap block each in the buffer
+class PathArena
+{
+public:
+    PathArena()
+    {
+    }
+
+    // Id of the path, it is added every time
+    uint32_t add(const std::string& path)
+    {
+        std::string::size_type pos = path.find_last_of("/\\");
+        std::string dir = (pos == std::string::npos) ? std::string() : path.substr(0, pos + 1);
+        std::map<std::string, uint32_t>::iterator it = m_dirIndexes.find(dir);
+        if (it == m_dirIndexes.end())
+        {
+            it = m_dirIndexes.insert(it, std::pair<std::string, uint32_t>(dir, static_cast<uint32_t>(m_dirs.size())));
+            m_dirs.push_back(dir);
+        }
+        Item item = { it->second, static_cast<uint32_t>(m_names.size()) };
+        m_names.insert(m_names.end(), path.begin() + dir.size(), path.end());
+        m_names.push_back('\0');
+        m_items.push_back(item);
+        return static_cast<uint32_t>(m_items.size() - 1);
+    }
+
+    std::string get(uint32_t id) const
+    {
+        const Item& item = m_items[id];
+        return m_dirs[item.dirIndex] + (&m_names[0] + item.nameOffset);
+    }
+
+    size_t size() const
+    {
+        return m_items.size();
+    }
+
+    size_t getMemoryUsage() const
+    {
+        size_t usage = m_items.capacity() * sizeof(Item) + m_names.capacity();
+        for (std::vector<std::string>::const_iterator it = m_dirs.cbegin(); it != m_dirs.cend(); ++it)
+        {
+            // In the vector and the key of the map
+            usage += (it->capacity() + sizeof(std::string)) * 2 + sizeof(uint32_t);
+        }
+        return usage;
+    }
+
+private:
+    PathArena(const PathArena&);
+    PathArena& operator=(const PathArena&);
+
+    struct Item
+    {
+        uint32_t dirIndex;
+        uint32_t nameOffset;
+    };
+
+    std::vector<std::string> m_dirs;
+    std::map<std::string, uint32_t> m_dirIndexes;
+    std::vector<Item> m_items;
+    std::vector<char> m_names;
+};
+
+#endif /* HashTable_h */
@@ -12,7 +12,9 @@
 #include <sys/types.h>
 #include <sqlite3.h>
 #include <algorithm>
+#include <new>
 #include <plist/plist.h>
+#include <json/json.h>
 #include <libxml/tree.h>
 #include <libxml/parser.h>
 
@@ -26,10 +28,13 @@
 #include <unistd.h>
 #endif
 
+#include "MediaManifest.h"
 #include "MbdbReader.h"
 #include "OSDef.h"
 #include "Utils.h"
 #include "FileSystem.h"
+#include "TaskGraph.h"
+#include "Tracing.h"
 
 inline std::string getPlistStringValue(plist_t node)
 {
@@ -53,8 +58,8 @@ struct __string_less
     // _LIBCPP_INLINE_VISIBILITY _LIBCPP_CONSTEXPR_AFTER_CXX11
     bool operator()(const std::string& __x, const std::string& __y) const {return __x < __y;}
     bool operator()(const std::pair<std::string, std::string>& __x, const std::string& __y) const {return __x.first < __y;}
-    bool operator()(const ITunesFile* __x, const std::string& __y) const {return __x->relativePath < __y;}
-    bool operator()(const ITunesFile* __x, const ITunesFile* __y) const {return __x->relativePath < __y->relativePath;}
+    bool operator()(const ITunesFile* __x, const std::string& __y) const {return __x->compare(__y) < 0;}
+    bool operator()(const ITunesFile* __x, const ITunesFile* __y) const {return __x->compare(__y->relativePath, __y->relativePathLength) < 0;}
 };
 
 struct PlistDictionary
@@ -129,6 +134,66 @@ protected:
     };
 };
 
+#define MANIFEST_CACHE_MAGIC     0x4D495857  // WXIM
+#define MANIFEST_CACHE_VERSION   1
+
+#define MANIFEST_CACHE_ONLY_FILE    (1 << 0)
+#define MANIFEST_CACHE_FILTERED     (1 << 1)
+#define MANIFEST_CACHE_MBDB         (1 << 2)
+#define MANIFEST_CACHE_PATH_FILTER  (1 << 3)
+
+// Layout of the cache file: header, domain (padded to 8 bytes), sorted records and the string pool
+struct ManifestCacheHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t manifestSize;
+    int64_t manifestTime;
+    uint32_t options;
+    uint32_t domainLength;
+    uint32_t numberOfFiles;
+    uint32_t poolSize;
+};
+
+struct ManifestCacheRecord
+{
+    uint64_t size;
+    uint32_t pathOffset;
+    uint32_t pathLength;
+    uint32_t flags;
+    uint32_t modifiedTime;
+    unsigned char fileId[20];
+    uint32_t hasFileId;
+};
+
+inline size_t alignTo8(size_t size)
+{
+    return (size + 7) & ~static_cast<size_t>(7);
+}
+
+inline int hexCharToInt(char ch)
+{
+    if (ch >= '0' && ch <= '9') return ch - '0';
+    if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+    return -1;
+}
+
+inline bool hexToBinary(const char* hex, unsigned char* buffer, size_t length)
+{
+    for (size_t idx = 0; idx < length; ++idx)
+    {
+        int h = hexCharToInt(hex[idx * 2]);
+        int l = (h < 0) ? -1 : hexCharToInt(hex[idx * 2 + 1]);
+        if (l < 0)
+        {
+            return false;
+        }
+        buffer[idx] = static_cast<unsigned char>((h << 4) | l);
+    }
+    return true;
+}
+
 inline std::string PlistDictionary::toString(const xmlChar* ch)
 {
     const char *p = reinterpret_cast<const char *>(ch);
@@ -141,7 +206,7 @@ inline std::string PlistDictionary::toString(const xmlChar* ch, int len)
     return std::string(p, p + len);
 }
 
-ITunesDb::ITunesDb(const std::string& rootPath, const std::string& manifestFileName) : m_isMbdb(false), m_rootPath(rootPath), m_manifestFileName(manifestFileName)
+ITunesDb::ITunesDb(const std::string& rootPath, const std::string& manifestFileName) : m_isMbdb(false), m_rootPath(rootPath), m_manifestFileName(manifestFileName), m_linkMode(MEDIA_LINK_NONE), m_linkFailed(false), m_mediaManifest(NULL), m_accountedBytes(EXPORT_METRIC_MANIFEST_BYTES)
 {
     std::replace(m_rootPath.begin(), m_rootPath.end(), ALT_DIR_SEP, DIR_SEP);
     
@@ -153,10 +218,8 @@ ITunesDb::ITunesDb(const std::string& rootPath, const std::string& manifestFileN
 
 ITunesDb::~ITunesDb()
 {
-    for (std::vector<ITunesFile *>::iterator it = m_files.begin(); it != m_files.end(); ++it)
-    {
-        delete *it;
-    }
+    // Records are allocated from m_arena and have nothing to destruct
+    m_index.clear();
     m_files.clear();
 }
 
@@ -181,14 +244,38 @@ bool ITunesDb::load(const std::string& domain, bool onlyFile)
     }
     
     std::string dbPath = combinePath(m_rootPath, "Manifest.mbdb");
-    if (existsFile(dbPath))
+    m_isMbdb = existsFile(dbPath);
+    if (!m_isMbdb)
+    {
+        dbPath = combinePath(m_rootPath, "Manifest.db");
+    }
+    
+    uint32_t options = (onlyFile ? MANIFEST_CACHE_ONLY_FILE : 0) | (m_loadingFilter ? MANIFEST_CACHE_FILTERED : 0) | (m_isMbdb ? MANIFEST_CACHE_MBDB : 0);
+    std::string cacheKey = domain;
+    if (!m_pathFilter.isEmpty())
     {
-        m_isMbdb = true;
-        return loadMbdb(domain, onlyFile);
+        options |= MANIFEST_CACHE_PATH_FILTER;
+        cacheKey += '\n' + m_pathFilter.toString();
+    }
+    uint64_t manifestSize = 0;
+    std::time_t manifestTime = 0;
+    bool cachable = !m_cacheFile.empty() && m_files.empty() && getFileInfo(dbPath, manifestSize, manifestTime);
+    if (cachable && loadCache(cacheKey, options, manifestSize, manifestTime))
+    {
+        return true;
     }
     
-    m_isMbdb = false;
-    dbPath = combinePath(m_rootPath, "Manifest.db");
+    bool result = m_isMbdb ? loadMbdb(domain, onlyFile) : loadDb(domain, onlyFile);
+    if (result && cachable)
+    {
+        saveCache(cacheKey, options, manifestSize, manifestTime);
+    }
+    return result;
+}
+
+bool ITunesDb::loadDb(const std::string& domain, bool onlyFile)
+{
+    std::string dbPath = combinePath(m_rootPath, "Manifest.db");
     
     sqlite3 *db = NULL;
     int rc = openSqlite3ReadOnly(dbPath, &db);
@@ -199,17 +286,49 @@ bool ITunesDb::load(const std::string& domain, bool onlyFile)
         return false;
     }
 
-#if !defined(NDEBUG) || defined(DBG_PERF)
-    printf("PERF: start.....%s\r\n", getTimestampString(false, true).c_str());
-#endif
+    TraceSpan span("itunes", "loadManifest", domain);
 
-    sqlite3_exec(db, "PRAGMA mmap_size=2097152;", NULL, NULL, NULL); // 8M:8388608  2M 2097152
+    // mmap_size comes from the read profile of openSqlite3ReadOnly
     sqlite3_exec(db, "PRAGMA synchronous=OFF;", NULL, NULL, NULL);
     
-    std::string sql = "SELECT fileID,relativePath,flags,file FROM Files";
+    std::vector<std::string> params;
+    std::string conditions;
+    const std::vector<std::string>& prefixes = m_pathFilter.getPrefixes();
     if (domain.size() > 0)
     {
-        sql += " WHERE domain=?";
+        // Unary "+" keeps sqlite3 from picking the domain index when the path ranges can use the index of relativePath
+        conditions = prefixes.empty() ? "domain=?" : "+domain=?";
+        params.push_back(domain);
+    }
+    if (!prefixes.empty())
+    {
+        std::string ranges;
+        for (std::vector<std::string>::const_iterator it = prefixes.cbegin(); it != prefixes.cend(); ++it)
+        {
+            std::string upperBound = ITunesPathFilter::upperBound(*it);
+            ranges += ranges.empty() ? "(" : " OR (";
+            ranges += upperBound.empty() ? "relativePath>=?)" : "relativePath>=? AND relativePath<?)";
+            params.push_back(*it);
+            if (!upperBound.empty())
+            {
+                params.push_back(upperBound);
+            }
+        }
+        conditions += conditions.empty() ? "(" : " AND (";
+        conditions += ranges + ")";
+    }
+    // Putting flags=1 into sql causes sqlite3 to use index of flags instead of domain, "+" disqualifies the flags term from indexing
+    int flagsFilter = m_pathFilter.getFlags();
+    if (flagsFilter != 0 || onlyFile)
+    {
+        conditions += conditions.empty() ? "" : " AND ";
+        conditions += flagsFilter != 0 ? ("+flags=" + std::to_string(flagsFilter)) : "+flags<>2";
+    }
+    
+    std::string sql = "SELECT fileID,relativePath,flags,file FROM Files";
+    if (!conditions.empty())
+    {
+        sql += " WHERE " + conditions;
     }
     
     sqlite3_stmt* stmt = NULL;
@@ -221,9 +340,9 @@ bool ITunesDb::load(const std::string& domain, bool onlyFile)
         return false;
     }
     
-    if (domain.size() > 0)
+    for (size_t idx = 0; idx < params.size(); ++idx)
     {
-        rc = sqlite3_bind_text(stmt, 1, domain.c_str(), (int)(domain.size()), NULL);
+        rc = sqlite3_bind_text(stmt, static_cast<int>(idx + 1), params[idx].c_str(), (int)(params[idx].size()), NULL);
         if (rc != SQLITE_OK)
         {
             sqlite3_finalize(stmt);
@@ -232,10 +351,6 @@ bool ITunesDb::load(const std::string& domain, bool onlyFile)
         }
     }
     
-#if !defined(NDEBUG) || defined(DBG_PERF)
-    printf("PERF: %s sql=%s, domain=%s\r\n", getTimestampString(false, true).c_str(), sql.c_str(), domain.c_str());
-#endif
-    
     bool hasFilter = (bool)m_loadingFilter;
     
     m_files.reserve(2048);
@@ -244,8 +359,6 @@ bool ITunesDb::load(const std::string& domain, bool onlyFile)
         int flags = sqlite3_column_int(stmt, 2);
         if (onlyFile && flags == 2)
         {
-            // Putting flags=1 into sql causes sqlite3 to use index of flags instead of domain and don't know why...
-            // So filter the directory with the code
             continue;
         }
         
@@ -255,45 +368,27 @@ bool ITunesDb::load(const std::string& domain, bool onlyFile)
             continue;
         }
         
-        ITunesFile *file = new ITunesFile();
         const char *fileId = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
-        if (NULL != fileId)
-        {
-            file->fileId = fileId;
-        }
-        
-        if (NULL != relativePath)
-        {
-            file->relativePath = relativePath;
-        }
-        file->flags = static_cast<unsigned int>(flags);
+        ITunesFile *file = addFile(relativePath, NULL == relativePath ? 0 : sqlite3_column_bytes(stmt, 1), fileId, static_cast<unsigned int>(flags));
         if (flags == 1)
         {
-            // Files
-            int blobBytes = sqlite3_column_bytes(stmt, 3);
+            // Files: only keep the fields in use instead of the blob
             const unsigned char *blob = reinterpret_cast<const unsigned char*>(sqlite3_column_blob(stmt, 3));
+            int blobBytes = sqlite3_column_bytes(stmt, 3);
             if (blobBytes > 0 && NULL != blob)
             {
-                std::vector<unsigned char> blobVector(blob, blob + blobBytes);
-                file->blob.swap(blobVector);
+                parseFileMetadata(blob, static_cast<size_t>(blobBytes), file->modifiedTime, file->size);
             }
         }
-        
-        m_files.push_back(file);
     }
     
     sqlite3_finalize(stmt);
     sqlite3_close(db);
-
-#if !defined(NDEBUG) || defined(DBG_PERF)
-    printf("PERF: end.....%s, size=%lu\r\n", getTimestampString(false, true).c_str(), m_files.size());
-#endif
+    span.setArg("files", static_cast<int64_t>(m_files.size()));
     
+    TraceSpan sortSpan("itunes", "sort");
     std::sort(m_files.begin(), m_files.end(), __string_less());
-    
-#if !defined(NDEBUG) || defined(DBG_PERF)
-    printf("PERF: after sort.....%s\r\n", getTimestampString(false, true).c_str());
-#endif
+    buildIndex();
     return true;
 }
 
@@ -305,17 +400,14 @@ bool ITunesDb::loadMbdb(const std::string& domain, bool onlyFile)
         return false;
     }
     
-    // unsigned char mdbxBuffer[26];           // buffer for .mbdx record
-    unsigned char fixedData[40] = { 0 };    // buffer for the fixed part of .mbdb record
-    // SHA1CryptoServiceProvider hasher = new SHA1CryptoServiceProvider();
+    const unsigned char* fixedData = NULL;  // the fixed part(40 bytes) of .mbdb record
 
-    // System.DateTime unixEpoch = new System.DateTime(1970, 1, 1, 0, 0, 0, 0, DateTimeKind.Utc);
-
-    std::string domainInFile;
-    std::string path;
-    std::string linkTarget;
-    std::string dataHash;
-    std::string alwaysNull;
+    const char* domainInFile = NULL;
+    size_t domainLength = 0;
+    const char* pathInFile = NULL;
+    size_t pathLength = 0;
+    std::string path;   // null-terminated copy for the loading filter
+    std::string fileIdSource;
     unsigned short fileMode = 0;
     bool isDir = false;
     bool skipped = false;
@@ -324,132 +416,273 @@ bool ITunesDb::loadMbdb(const std::string& domain, bool onlyFile)
 
     while (reader.hasMoreData())
     {
-        if (!reader.read(domainInFile))
+        if (!reader.read(domainInFile, domainLength))
+        {
+            break;
+        }
+        
+        skipped = !domain.empty() && (domain.size() != domainLength || std::memcmp(domain.c_str(), domainInFile, domainLength) != 0);
+        if (skipped)
+        {
+            // will skip it
+            reader.skipString();    // path
+        }
+        else if (!reader.read(pathInFile, pathLength))
         {
             break;
         }
+        reader.skipString();    // linkTarget
+        reader.skipString();    // dataHash
+        reader.skipString();    // alwaysNull;
         
-        skipped = false;
-        if (!domain.empty() && domain != domainInFile)
+        fixedData = reader.read(40);
+        if (NULL == fixedData)
         {
-            skipped = true;
+            break;
+        }
+        int propertyCount = fixedData[39];
+        for (int j = 0; j < propertyCount; ++j)
+        {
+            reader.skipString(); // name
+            reader.skipString(); // value
         }
         
         if (skipped)
         {
-            // will skip it
-            reader.skipString();    // path
-            reader.skipString();    // linkTarget
-            reader.skipString();    // dataHash
-            reader.skipString();    // alwaysNull;
-            
-            reader.read(fixedData, 40);
-            int propertyCount = fixedData[39];
-
-            for (int j = 0; j < propertyCount; ++j)
-            {
-                reader.skipString();
-                reader.skipString();
-            }
+            continue;
         }
-        else
+        
+        fileMode = (fixedData[0] << 8) | fixedData[1];
+        isDir = S_ISDIR(fileMode);
+        // unsigned char flags = fixedData[38];
+        if (onlyFile && isDir)
         {
-            reader.read(path);
-            reader.read(linkTarget);
-            reader.readD(dataHash);
-            reader.readD(alwaysNull);
-            
-            reader.read(fixedData, 40);
-
-            fileMode = (fixedData[0] << 8) | fixedData[1];
-            
-            isDir = S_ISDIR(fileMode);
-            
-            // unsigned char flags = fixedData[38];
-            
-            if (onlyFile && isDir)
-            {
-                skipped = true;
-            }
-            
-            if (hasFilter && !m_loadingFilter(path.c_str(), (isDir ? 2 : 1)))
-            {
-                skipped = true;
-            }
-            
-            unsigned int aTime = GetBigEndianInteger(fixedData, 18);
-            unsigned int bTime = GetBigEndianInteger(fixedData, 22);
-            // unsigned int cTime = GetBigEndianInteger(fixedData, 26);
-            
-            int propertyCount = fixedData[39];
-            
-            // rec.Properties = new MBFileRecord.Property[rec.PropertyCount];
-            for (int j = 0; j < propertyCount; ++j)
-            {
-                if (skipped)
-                {
-                    reader.skipString(); // name
-                    reader.skipString(); // value
-                }
-                else
-                {
-                    std::string name;
-                    std::string value;
-                    
-                    reader.read(name);
-                    reader.read(value);
-                }
-                
-            }
-            /*
-            StringBuilder fileName = new StringBuilder();
-            byte[] fb = hasher.ComputeHash(ASCIIEncoding.UTF8.GetBytes(rec.Domain + "-" + rec.Path));
-            for (int k = 0; k < fb.Length; k++)
-            {
-                fileName.Append(fb[k].ToString("x2"));
-            }
-
-            rec.key = fileName.ToString();
-             */
-            
-            if (!skipped)
-            {
-                ITunesFile *file = new ITunesFile();
-                file->relativePath = path;
-                file->fileId = sha1(domain + "-" + path);
-                file->flags = isDir ? 2 : 1;
-                file->modifiedTime = aTime != 0 ? aTime : bTime;
-                
-                m_files.push_back(file);
-            }
-            
+            continue;
+        }
+        
+        if (!m_pathFilter.matches(pathInFile, pathLength, (isDir ? 2 : 1)))
+        {
+            continue;
         }
         
+        path.assign(pathInFile, pathLength);
+        if (hasFilter && !m_loadingFilter(path.c_str(), (isDir ? 2 : 1)))
+        {
+            continue;
+        }
         
+        unsigned int aTime = GetBigEndianInteger(fixedData, 18);
+        unsigned int bTime = GetBigEndianInteger(fixedData, 22);
+        // unsigned int cTime = GetBigEndianInteger(fixedData, 26);
+        uint64_t fileSize = (static_cast<uint64_t>(static_cast<uint32_t>(GetBigEndianInteger(fixedData, 30))) << 32) | static_cast<uint32_t>(GetBigEndianInteger(fixedData, 34));
+        
+        // fileId = sha1(domain + "-" + path)
+        fileIdSource.assign(domainInFile, domainLength);
+        fileIdSource += '-';
+        fileIdSource += path;
+        std::string fileId = sha1(fileIdSource);
+        ITunesFile *file = addFile(path.c_str(), path.size(), fileId.c_str(), isDir ? 2 : 1);
+        file->modifiedTime = aTime != 0 ? aTime : bTime;
+        file->size = fileSize;
     }
     
     std::sort(m_files.begin(), m_files.end(), __string_less());
+    buildIndex();
+
+    return true;
+}
+
+ITunesFile* ITunesDb::addFile(const char* relativePath, size_t relativePathLength, const char* fileId, unsigned int flags)
+{
+    ITunesFile *file = new (m_arena.allocate(sizeof(ITunesFile))) ITunesFile();
+    if (NULL != relativePath)
+    {
+        file->relativePath = m_arena.addString(relativePath, relativePathLength);
+        file->relativePathLength = static_cast<uint32_t>(relativePathLength);
+    }
+    if (NULL != fileId && std::strlen(fileId) == sizeof(file->fileId) * 2)
+    {
+        file->hasFileId = hexToBinary(fileId, file->fileId, sizeof(file->fileId));
+    }
+    file->flags = flags;
+    
+    m_files.push_back(file);
+    return file;
+}
 
+bool ITunesDb::loadCache(const std::string& cacheKey, uint32_t options, uint64_t manifestSize, std::time_t manifestTime)
+{
+    if (m_cacheMapping.isOpen() || !existsFile(m_cacheFile) || !m_cacheMapping.open(m_cacheFile))
+    {
+        return false;
+    }
+    
+    const unsigned char* data = m_cacheMapping.data();
+    size_t dataSize = m_cacheMapping.size();
+    
+    ManifestCacheHeader header;
+    if (dataSize < sizeof(header))
+    {
+        m_cacheMapping.close();
+        return false;
+    }
+    std::memcpy(&header, data, sizeof(header));
+    
+    size_t recordsOffset = sizeof(header) + alignTo8(header.domainLength);
+    size_t poolOffset = recordsOffset + static_cast<size_t>(header.numberOfFiles) * sizeof(ManifestCacheRecord);
+    if (header.magic != MANIFEST_CACHE_MAGIC || header.version != MANIFEST_CACHE_VERSION || header.manifestSize != manifestSize || header.manifestTime != static_cast<int64_t>(manifestTime) || header.options != options || header.domainLength != cacheKey.size() || poolOffset + header.poolSize != dataSize || std::memcmp(data + sizeof(header), cacheKey.c_str(), cacheKey.size()) != 0)
+    {
+        m_cacheMapping.close();
+        return false;
+    }
+    
+    TraceSpan span("itunes", "loadCache", cacheKey);
+    
+    // Paths are used right from the mapping, which lives as long as the ITunesDb
+    const ManifestCacheRecord* record = reinterpret_cast<const ManifestCacheRecord *>(data + recordsOffset);
+    const char* pool = reinterpret_cast<const char *>(data + poolOffset);
+    m_files.reserve(header.numberOfFiles);
+    for (uint32_t idx = 0; idx < header.numberOfFiles; ++idx, ++record)
+    {
+        if (static_cast<uint64_t>(record->pathOffset) + record->pathLength >= header.poolSize || pool[record->pathOffset + record->pathLength] != '\0')
+        {
+            m_files.clear();
+            m_cacheMapping.close();
+            return false;
+        }
+        ITunesFile *file = new (m_arena.allocate(sizeof(ITunesFile))) ITunesFile();
+        file->relativePath = pool + record->pathOffset;
+        file->relativePathLength = record->pathLength;
+        file->size = record->size;
+        file->flags = record->flags;
+        file->modifiedTime = record->modifiedTime;
+        std::memcpy(file->fileId, record->fileId, sizeof(file->fileId));
+        file->hasFileId = record->hasFileId != 0;
+        m_files.push_back(file);
+    }
+    
+    buildIndex();
+    span.setArg("files", static_cast<int64_t>(m_files.size()));
     return true;
 }
 
-unsigned int ITunesDb::parseModifiedTime(const std::vector<unsigned char>& data)
+bool ITunesDb::saveCache(const std::string& cacheKey, uint32_t options, uint64_t manifestSize, std::time_t manifestTime) const
 {
-    uint64_t val = 0;
+    ManifestCacheHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.magic = MANIFEST_CACHE_MAGIC;
+    header.version = MANIFEST_CACHE_VERSION;
+    header.manifestSize = manifestSize;
+    header.manifestTime = static_cast<int64_t>(manifestTime);
+    header.options = options;
+    header.domainLength = static_cast<uint32_t>(cacheKey.size());
+    header.numberOfFiles = static_cast<uint32_t>(m_files.size());
+    
+    uint64_t poolSize = 0;
+    for (std::vector<ITunesFile *>::const_iterator it = m_files.cbegin(); it != m_files.cend(); ++it)
+    {
+        poolSize += (*it)->relativePathLength + 1;
+    }
+    if (poolSize > UINT32_MAX)
+    {
+        return false;
+    }
+    header.poolSize = static_cast<uint32_t>(poolSize);
+    
+    size_t recordsOffset = sizeof(header) + alignTo8(cacheKey.size());
+    size_t poolOffset = recordsOffset + m_files.size() * sizeof(ManifestCacheRecord);
+    std::vector<unsigned char> data(poolOffset + header.poolSize, 0);
+    std::memcpy(&data[0], &header, sizeof(header));
+    if (!cacheKey.empty())
+    {
+        std::memcpy(&data[sizeof(header)], cacheKey.c_str(), cacheKey.size());
+    }
+    
+    uint32_t pathOffset = 0;
+    ManifestCacheRecord record;
+    unsigned char* p = &data[recordsOffset];
+    for (std::vector<ITunesFile *>::const_iterator it = m_files.cbegin(); it != m_files.cend(); ++it, p += sizeof(record))
+    {
+        const ITunesFile* file = *it;
+        std::memset(&record, 0, sizeof(record));
+        record.size = file->size;
+        record.pathOffset = pathOffset;
+        record.pathLength = file->relativePathLength;
+        record.flags = file->flags;
+        record.modifiedTime = file->modifiedTime;
+        std::memcpy(record.fileId, file->fileId, sizeof(record.fileId));
+        record.hasFileId = file->hasFileId ? 1 : 0;
+        std::memcpy(p, &record, sizeof(record));
+        
+        std::memcpy(&data[poolOffset + pathOffset], file->relativePath, file->relativePathLength);
+        pathOffset += file->relativePathLength + 1;
+    }
+    
+    // Write to a temporary file first so an interrupted run never leaves a truncated cache
+    std::string tempFile = m_cacheFile + ".tmp";
+    if (!writeFile(tempFile, data))
+    {
+        return false;
+    }
+    return moveFile(tempFile, m_cacheFile, true);
+}
+
+void ITunesDb::buildIndex()
+{
+    m_index.clear();
+    m_index.reserve(m_files.size());
+    for (std::vector<ITunesFile *>::const_iterator it = m_files.cbegin(); it != m_files.cend(); ++it)
+    {
+        // Keep the first one of duplicated paths, which is what lower_bound returned before
+        m_index.emplace(ITunesPathKey((*it)->relativePath, (*it)->relativePathLength), *it);
+    }
+    updateMemoryAccounting();
+}
+
+void ITunesDb::updateMemoryAccounting()
+{
+    // A node of the index holds the pair and the link, the buckets are pointers
+    size_t bytes = m_arena.getSize() + m_files.capacity() * sizeof(ITunesFile *)
+        + m_index.size() * (sizeof(std::pair<const ITunesPathKey, const ITunesFile *>) + sizeof(void *)) + m_index.bucket_count() * sizeof(void *);
+    m_accountedBytes.set(static_cast<int64_t>(bytes));
+}
+
+bool ITunesDb::parseFileMetadata(const unsigned char* data, size_t length, unsigned int& modifiedTime, uint64_t& size)
+{
+    if (NULL == data || 0 == length)
+    {
+        return false;
+    }
     plist_t node = NULL;
-    plist_from_memory(reinterpret_cast<const char *>(&data[0]), static_cast<uint32_t>(data.size()), &node);
-    if (NULL != node)
+    plist_from_memory(reinterpret_cast<const char *>(data), static_cast<uint32_t>(length), &node);
+    if (NULL == node)
     {
-        plist_t lastModified = plist_access_path(node, 3, "$objects", 1, "LastModified");
+        return false;
+    }
+    
+    // MBFile archived by NSKeyedArchiver
+    plist_t fileNode = plist_access_path(node, 2, "$objects", 1);
+    if (NULL != fileNode)
+    {
+        uint64_t val = 0;
+        plist_t lastModified = plist_dict_get_item(fileNode, "LastModified");
         if (NULL != lastModified)
         {
             plist_get_uint_val(lastModified, &val);
+            modifiedTime = static_cast<unsigned int>(val);
+        }
+        plist_t sizeNode = plist_dict_get_item(fileNode, "Size");
+        if (NULL != sizeNode)
+        {
+            val = 0;
+            plist_get_uint_val(sizeNode, &val);
+            size = val;
         }
-        
-        plist_free(node);
     }
+    
+    plist_free(node);
 
-    return static_cast<unsigned int>(val);
+    return NULL != fileNode;
 }
 
 std::string ITunesDb::findFileId(const std::string& relativePath) const
@@ -460,21 +693,24 @@ std::string ITunesDb::findFileId(const std::string& relativePath) const
     {
         return std::string();
     }
-    return file->fileId;
+    return file->getFileId();
 }
 
 const ITunesFile* ITunesDb::findITunesFile(const std::string& relativePath) const
 {
-    std::string formatedPath = relativePath;
-    std::replace(formatedPath.begin(), formatedPath.end(), '\\', '/');
-
-    typename std::vector<ITunesFile *>::iterator it = std::lower_bound(m_files.begin(), m_files.end(), formatedPath, __string_less());
-    
-    if (it == m_files.end() || (*it)->relativePath != formatedPath)
+    std::unordered_map<ITunesPathKey, const ITunesFile *, ITunesPathKeyHash>::const_iterator it;
+    if (relativePath.find('\\') == std::string::npos)
     {
-        return NULL;
+        it = m_index.find(ITunesPathKey(relativePath.c_str(), relativePath.size()));
     }
-    return *it;
+    else
+    {
+        std::string formatedPath = relativePath;
+        std::replace(formatedPath.begin(), formatedPath.end(), '\\', '/');
+        it = m_index.find(ITunesPathKey(formatedPath.c_str(), formatedPath.size()));
+    }
+    
+    return it == m_index.cend() ? NULL : it->second;
 }
 
 std::string ITunesDb::fileIdToRealPath(const std::string& fileId) const
@@ -489,12 +725,12 @@ std::string ITunesDb::fileIdToRealPath(const std::string& fileId) const
 
 std::string ITunesDb::getRealPath(const ITunesFile& file) const
 {
-    return fileIdToRealPath(file.fileId);
+    return fileIdToRealPath(file.getFileId());
 }
 
 std::string ITunesDb::getRealPath(const ITunesFile* file) const
 {
-    return fileIdToRealPath(file->fileId);
+    return fileIdToRealPath(file->getFileId());
 }
 
 std::string ITunesDb::findRealPath(const std::string& relativePath) const
@@ -506,25 +742,15 @@ std::string ITunesDb::findRealPath(const std::string& relativePath) const
 bool ITunesDb::copyFile(const std::string& vpath, const std::string& dest, bool overwrite/* = false*/) const
 {
     std::string destPath = normalizePath(dest);
-    if (!overwrite && existsFile(destPath))
+    const ITunesFile* file = findITunesFile(vpath);
+    if (!overwrite && (NULL == file ? existsFile(destPath) : isCopied(file, destPath)))
     {
         return true;
     }
     
-    const ITunesFile* file = findITunesFile(vpath);
     if (NULL != file)
     {
-        std::string srcPath = getRealPath(*file);
-        if (!srcPath.empty())
-        {
-            normalizePath(srcPath);
-            bool result = ::copyFile(srcPath, destPath, true);
-            if (result)
-            {
-                updateFileTime(dest, ITunesDb::parseModifiedTime(file->blob));
-            }
-            return result;
-        }
+        return copyITunesFile(file, destPath);
     }
     
     return false;
@@ -533,38 +759,117 @@ bool ITunesDb::copyFile(const std::string& vpath, const std::string& dest, bool
 bool ITunesDb::copyFile(const std::string& vpath, const std::string& destPath, const std::string& destFileName, bool overwrite/* = false*/) const
 {
     std::string destFullPath = normalizePath(combinePath(destPath, destFileName));
-    if (!overwrite && existsFile(destFullPath))
+    const ITunesFile* file = findITunesFile(vpath);
+    if (!overwrite && (NULL == file ? existsFile(destFullPath) : isCopied(file, destFullPath)))
     {
         return true;
     }
     
-    const ITunesFile* file = findITunesFile(vpath);
     if (NULL != file)
     {
-        std::string srcPath = getRealPath(*file);
-        if (!srcPath.empty())
+        if (!existsDirectory(destPath))
         {
-            normalizePath(srcPath);
-            if (!existsDirectory(destPath))
-            {
-                makeDirectory(destPath);
-            }
-            bool result = ::copyFile(srcPath, destFullPath, true);
-            if (result)
-            {
-                updateFileTime(destFullPath, ITunesDb::parseModifiedTime(file->blob));
-            }
-            return result;
+            makeDirectory(destPath);
         }
+        return copyITunesFile(file, destFullPath);
     }
     
     return false;
 }
 
+bool ITunesDb::isCopied(const ITunesFile* file, const std::string& destFullPath) const
+{
+    if (NULL != m_mediaManifest && m_mediaManifest->contains(destFullPath, *file))
+    {
+        return true;
+    }
+    if (!existsFile(destFullPath))
+    {
+        return false;
+    }
+    // Exported before the manifest, or the manifest was lost
+    if (NULL != m_mediaManifest)
+    {
+        m_mediaManifest->add(destFullPath, *file);
+    }
+    return true;
+}
+
+bool ITunesDb::copyITunesFile(const ITunesFile* file, const std::string& destFullPath) const
+{
+    if (!copyOrLinkITunesFile(file, destFullPath))
+    {
+        return false;
+    }
+    if (NULL != m_mediaManifest)
+    {
+        m_mediaManifest->add(destFullPath, *file);
+    }
+    return true;
+}
+
+// Images, stickers and files forwarded to many sessions (or shared by accounts) are copied only once,
+// the other copies are links to the first one, or plain copies where links are not supported
+bool ITunesDb::copyOrLinkITunesFile(const ITunesFile* file, const std::string& destFullPath) const
+{
+    std::string srcPath = getRealPath(*file);
+    if (srcPath.empty())
+    {
+        return false;
+    }
+    
+    std::string copiedPath;
+    {
+        std::lock_guard<std::mutex> lock(m_copiedFilesMutex);
+        std::unordered_map<const ITunesFile *, std::string>::const_iterator it = m_copiedFiles.find(file);
+        if (it != m_copiedFiles.cend())
+        {
+            copiedPath = it->second;
+        }
+    }
+    if (!copiedPath.empty())
+    {
+        if (copiedPath == destFullPath || linkFile(copiedPath, destFullPath))
+        {
+            return true;
+        }
+    }
+    
+    normalizePath(srcPath);
+    if (m_linkMode != MEDIA_LINK_NONE && !m_linkFailed.load(std::memory_order_relaxed))
+    {
+        // A hard link shares the time of the file in the backup, it's not updated
+        if (m_linkMode == MEDIA_LINK_SYMBOLIC ? symlinkFile(srcPath, destFullPath) : linkFile(srcPath, destFullPath))
+        {
+            return true;
+        }
+        // Another volume or a file system without links, the other files won't do either
+        m_linkFailed.store(true, std::memory_order_relaxed);
+    }
+    bool result = ::copyFile(srcPath, destFullPath, true);
+    if (result)
+    {
+        updateFileTime(destFullPath, ITunesDb::parseModifiedTime(file));
+        if (copiedPath.empty())
+        {
+            std::lock_guard<std::mutex> lock(m_copiedFilesMutex);
+            m_copiedFiles.insert(std::pair<const ITunesFile *, std::string>(file, destFullPath));
+        }
+    }
+    return result;
+}
+
+#define BACKUP_CACHE_VERSION    1
+
 ManifestParser::ManifestParser(const std::string& manifestPath) : m_manifestPath(manifestPath)
 {
 }
 
+void ManifestParser::setCacheFile(const std::string& cacheFile)
+{
+    m_cacheFile = cacheFile;
+}
+
 std::string ManifestParser::getLastError() const
 {
 	return m_lastError;
@@ -574,31 +879,68 @@ bool ManifestParser::parse(std::vector<BackupManifest>& manifests) const
 {
     bool res = false;
     
+    std::map<std::string, CachedManifest> cache;
+    bool cacheChanged = false;
+    if (!m_cacheFile.empty())
+    {
+        loadCache(cache);
+    }
+    
     std::string path = normalizePath(m_manifestPath);
     if (endsWith(path, normalizePath("/MobileSync")) || endsWith(path, normalizePath("/MobileSync/")))
     {
         path = combinePath(path, "Backup");
-        res = parseDirectory(path, manifests);
+        res = parseDirectory(path, manifests, cache, cacheChanged);
     }
     else if (isValidBackupItem(path))
     {
-        BackupManifest manifest;
-        if (parse(path, manifest) && manifest.isValid())
+        BackupItem item;
+        item.path = path;
+        parseBackupItem(cache, item);
+        m_lastError += item.error;
+        if (item.parsed)
         {
-            res = true;
-            manifests.push_back(manifest);
+            if (item.storing)
+            {
+                cache[item.path] = item.entry;
+                cacheChanged = true;
+            }
+            if (item.entry.manifest.isValid())
+            {
+                res = true;
+                manifests.push_back(item.entry.manifest);
+            }
         }
     }
     else
     {
         // Assume the directory is ../../Backup/../
-        res = parseDirectory(path, manifests);
+        res = parseDirectory(path, manifests, cache, cacheChanged);
+    }
+    
+    if (!m_cacheFile.empty())
+    {
+        // Drop the backups deleted
+        for (std::map<std::string, CachedManifest>::iterator it = cache.begin(); it != cache.end();)
+        {
+            if (existsFile(combinePath(it->first, "Info.plist")))
+            {
+                ++it;
+                continue;
+            }
+            it = cache.erase(it);
+            cacheChanged = true;
+        }
+        if (cacheChanged)
+        {
+            saveCache(cache);
+        }
     }
     
     return res;
 }
 
-bool ManifestParser::parseDirectory(const std::string& path, std::vector<BackupManifest>& manifests) const
+bool ManifestParser::parseDirectory(const std::string& path, std::vector<BackupManifest>& manifests, std::map<std::string, CachedManifest>& cache, bool& cacheChanged) const
 {
     std::vector<std::string> subDirectories;
     if (!listSubDirectories(path, subDirectories))
@@ -609,20 +951,37 @@ bool ManifestParser::parseDirectory(const std::string& path, std::vector<BackupM
         return false;
     }
     
+    // The backups are parsed in parallel and kept in the order of the directories
+    std::vector<BackupItem> items(subDirectories.size());
+    // libxml2 has to be initialized before the threads use it
+    xmlInitParser();
+    TaskGraph graph;
+    for (size_t idx = 0; idx < subDirectories.size(); ++idx)
+    {
+        items[idx].path = combinePath(path, subDirectories[idx]);
+        graph.add([this, &cache, &items, idx]() {
+            parseBackupItem(cache, items[idx]);
+        });
+    }
+    graph.run();
+    
     bool res = false;
-    for (std::vector<std::string>::const_iterator it = subDirectories.cbegin(); it != subDirectories.cend(); ++it)
+    for (std::vector<BackupItem>::const_iterator it = items.cbegin(); it != items.cend(); ++it)
     {
-        std::string backupPath = combinePath(path, *it);
-		if (!isValidBackupItem(backupPath))
-		{
-			continue;
-		}
-        
-        BackupManifest manifest;
-        if (parse(backupPath, manifest) && manifest.isValid())
+        m_lastError += it->error;
+        if (!it->parsed)
+        {
+            continue;
+        }
+        if (it->storing)
+        {
+            cache[it->path] = it->entry;
+            cacheChanged = true;
+        }
+        if (it->entry.manifest.isValid())
         {
             res = true;
-            manifests.push_back(manifest);
+            manifests.push_back(it->entry.manifest);
         }
     }
 
@@ -634,6 +993,112 @@ bool ManifestParser::parseDirectory(const std::string& path, std::vector<BackupM
     return res;
 }
 
+void ManifestParser::parseBackupItem(const std::map<std::string, CachedManifest>& cache, BackupItem& item) const
+{
+    // m_lastError is not shared by the threads
+    ManifestParser parser(item.path);
+    if (!parser.isValidBackupItem(item.path))
+    {
+        item.error = parser.m_lastError;
+        return;
+    }
+    
+    CachedManifest& entry = item.entry;
+    bool hasFileInfo = getFileInfo(combinePath(item.path, "Info.plist"), entry.infoSize, entry.infoModifiedTime) && getFileInfo(combinePath(item.path, "Manifest.plist"), entry.manifestSize, entry.manifestModifiedTime);
+    if (hasFileInfo)
+    {
+        std::map<std::string, CachedManifest>::const_iterator it = cache.find(item.path);
+        if (it != cache.cend() && it->second.isSameFiles(entry))
+        {
+            entry.manifest = it->second.manifest;
+            item.parsed = true;
+            return;
+        }
+    }
+    
+    item.parsed = parser.parse(item.path, entry.manifest);
+    item.storing = item.parsed && hasFileInfo;
+    item.error = parser.m_lastError;
+}
+
+void ManifestParser::loadCache(std::map<std::string, CachedManifest>& cache) const
+{
+    std::string contents = readFile(m_cacheFile);
+    Json::Reader reader;
+    Json::Value cacheObj;
+    if (contents.empty() || !reader.parse(contents, cacheObj) || !cacheObj.isObject() || cacheObj["version"].asInt() != BACKUP_CACHE_VERSION || !cacheObj["backups"].isArray())
+    {
+        return;
+    }
+    
+    const Json::Value& backupItems = cacheObj["backups"];
+    for (Json::ArrayIndex idx = 0; idx < backupItems.size(); idx++)
+    {
+        // info and manifest: [size, mtime] of Info.plist and Manifest.plist
+        const Json::Value& backupObj = backupItems[idx];
+        if (!backupObj.isObject() || !backupObj["path"].isString() || !backupObj["info"].isArray() || backupObj["info"].size() != 2 || !backupObj["manifest"].isArray() || backupObj["manifest"].size() != 2)
+        {
+            continue;
+        }
+        CachedManifest entry;
+        entry.infoSize = backupObj["info"][0].asUInt64();
+        entry.infoModifiedTime = static_cast<std::time_t>(backupObj["info"][1].asInt64());
+        entry.manifestSize = backupObj["manifest"][0].asUInt64();
+        entry.manifestModifiedTime = static_cast<std::time_t>(backupObj["manifest"][1].asInt64());
+        
+        BackupManifest& manifest = entry.manifest;
+        manifest.setPath(backupObj["path"].asString());
+        manifest.setDeviceName(backupObj["device"].asString());
+        manifest.setDisplayName(backupObj["name"].asString());
+        manifest.setBackupTime(backupObj["time"].asString());
+        manifest.setITunesVersion(backupObj["itunes"].asString());
+        manifest.setMacOSVersion(backupObj["macos"].asString());
+        manifest.setIOSVersion(backupObj["ios"].asString());
+        manifest.setEncrypted(backupObj["encrypted"].asBool());
+        cache[manifest.getPath()] = entry;
+    }
+}
+
+bool ManifestParser::saveCache(const std::map<std::string, CachedManifest>& cache) const
+{
+    Json::Value backupItems(Json::arrayValue);
+    for (std::map<std::string, CachedManifest>::const_iterator it = cache.cbegin(); it != cache.cend(); ++it)
+    {
+        const BackupManifest& manifest = it->second.manifest;
+        Json::Value infoObj(Json::arrayValue);
+        infoObj.append(Json::Value(static_cast<Json::UInt64>(it->second.infoSize)));
+        infoObj.append(Json::Value(static_cast<Json::Int64>(it->second.infoModifiedTime)));
+        Json::Value manifestObj(Json::arrayValue);
+        manifestObj.append(Json::Value(static_cast<Json::UInt64>(it->second.manifestSize)));
+        manifestObj.append(Json::Value(static_cast<Json::Int64>(it->second.manifestModifiedTime)));
+        
+        Json::Value backupObj(Json::objectValue);
+        backupObj["path"] = Json::Value(it->first);
+        backupObj["info"] = infoObj;
+        backupObj["manifest"] = manifestObj;
+        backupObj["device"] = Json::Value(manifest.getDeviceName());
+        backupObj["name"] = Json::Value(manifest.getDisplayName());
+        backupObj["time"] = Json::Value(manifest.getBackupTime());
+        backupObj["itunes"] = Json::Value(manifest.isITunesVersionEmpty() ? std::string() : manifest.getITunesVersion());
+        backupObj["macos"] = Json::Value(manifest.getMacOSVersion());
+        backupObj["ios"] = Json::Value(manifest.getIOSVersion());
+        backupObj["encrypted"] = Json::Value(manifest.isEncrypted());
+        backupItems.append(backupObj);
+    }
+    
+    Json::Value cacheObj(Json::objectValue);
+    cacheObj["version"] = Json::Value(BACKUP_CACHE_VERSION);
+    cacheObj["backups"] = backupItems;
+    
+    Json::FastWriter writer;
+    std::string tempFile = m_cacheFile + ".tmp";
+    if (!writeFile(tempFile, writer.write(cacheObj)))
+    {
+        return false;
+    }
+    return moveFile(tempFile, m_cacheFile, true);
+}
+
 bool ManifestParser::isValidBackupItem(const std::string& path) const
 {
     std::string fileName = combinePath(path, "Info.plist");
@@ -742,8 +1207,8 @@ bool ManifestParser::parseInfoPlist(const std::string& backupIdPath, BackupManif
     std::vector<std::string> keys = {ValueLastBackupDate, ValueDisplayName, ValueDeviceName, ValueITunesVersion, ValueMacOSVersion, ValueProductVersion};
     
     PlistDictionary plistDict(tags, keys);
+    // No xmlCleanupParser here, the backups are parsed on several threads
     int res = xmlSAXUserParseFile(&saxHander, &plistDict, fileName.c_str());
-    xmlCleanupParser();
     if (res != 0)
     {
         // m_lastError += "Failed to parse xml: Info.plist\r\n";
@@ -9,24 +9,43 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+#include <atomic>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
 
 #include <sstream>
 #include <iomanip>
 #include <ctime>
 #include "Utils.h"
+#include "FileSystem.h"
+#include "ExportMetrics.h"
 
 #ifndef ITunesParser_h
 #define ITunesParser_h
 
+// How copyFile puts the files of the backup in the output
+#define MEDIA_LINK_NONE         0   // Copies
+#define MEDIA_LINK_HARD         1   // Clones (APFS) or hard links of the files of the backup
+#define MEDIA_LINK_SYMBOLIC     2   // Symbolic links to the files of the backup
+
+class MediaManifest;
+
 struct ITunesFile
 {
-    std::string fileId;
-    std::string relativePath;
+    // relativePath points into the arena of the owner ITunesDb
+    const char* relativePath;
+    uint64_t size;
+    uint32_t relativePathLength;
     unsigned int flags;
-    unsigned int modifiedTime;
-    std::vector<unsigned char> blob;
+    unsigned int modifiedTime;  // decoded from the plist blob or mbdb record when loading
+    unsigned char fileId[20];   // binary sha1
+    bool hasFileId;
     
-    ITunesFile()
+    ITunesFile() : relativePath(""), size(0), relativePathLength(0), flags(0), modifiedTime(0), hasFileId(false)
     {
     }
     
@@ -34,6 +53,142 @@ struct ITunesFile
     {
         return flags == 2;
     }
+    
+    std::string getFileId() const
+    {
+        static const char hexChars[] = "0123456789abcdef";
+        std::string value;
+        if (hasFileId)
+        {
+            value.resize(sizeof(fileId) * 2);
+            for (size_t idx = 0; idx < sizeof(fileId); ++idx)
+            {
+                value[idx * 2] = hexChars[fileId[idx] >> 4];
+                value[idx * 2 + 1] = hexChars[fileId[idx] & 0x0F];
+            }
+        }
+        return value;
+    }
+    
+    std::string getRelativePath() const
+    {
+        return std::string(relativePath, relativePathLength);
+    }
+    
+    int compare(const char* path, size_t length) const
+    {
+        int res = std::memcmp(relativePath, path, std::min(static_cast<size_t>(relativePathLength), length));
+        if (res == 0 && relativePathLength != length)
+        {
+            res = relativePathLength < length ? -1 : 1;
+        }
+        return res;
+    }
+    
+    int compare(const std::string& path) const
+    {
+        return compare(path.c_str(), path.size());
+    }
+    
+    bool startsWith(const std::string& prefix, size_t pos = 0) const
+    {
+        return relativePathLength >= pos + prefix.size() && std::memcmp(relativePath + pos, prefix.c_str(), prefix.size()) == 0;
+    }
+    
+    bool endsWith(const std::string& suffix) const
+    {
+        return relativePathLength >= suffix.size() && std::memcmp(relativePath + relativePathLength - suffix.size(), suffix.c_str(), suffix.size()) == 0;
+    }
+    
+    bool contains(const std::string& str, size_t pos = 0) const
+    {
+        return pos <= relativePathLength && std::strstr(relativePath + pos, str.c_str()) != NULL;
+    }
+};
+
+// Block allocator for ITunesFile records and their strings, freed all at once with the ITunesDb
+class ITunesArena
+{
+public:
+    ITunesArena(size_t blockSize = 256 * 1024) : m_blockSize(blockSize), m_cur(NULL), m_left(0), m_size(0)
+    {
+    }
+    
+    ~ITunesArena()
+    {
+        clear();
+    }
+    
+    void* allocate(size_t size, size_t alignment = sizeof(void *))
+    {
+        size_t padding = (alignment - (reinterpret_cast<uintptr_t>(m_cur) & (alignment - 1))) & (alignment - 1);
+        if (NULL == m_cur || m_left < size + padding)
+        {
+            // Big items get their own block so the current one can be still used
+            size_t blockSize = std::max(m_blockSize, size + alignment);
+            char* block = new char[blockSize];
+            m_blocks.push_back(block);
+            m_size += blockSize;
+            if (blockSize > m_blockSize)
+            {
+                return block;
+            }
+            m_cur = block;
+            m_left = blockSize;
+            padding = 0;
+        }
+        
+        char* p = m_cur + padding;
+        m_cur = p + size;
+        m_left -= size + padding;
+        return p;
+    }
+    
+    const char* addString(const char* str, size_t length)
+    {
+        char* p = reinterpret_cast<char *>(allocate(length + 1, 1));
+        if (length > 0)
+        {
+            std::memcpy(p, str, length);
+        }
+        p[length] = '\0';
+        return p;
+    }
+    
+    const unsigned char* addBytes(const void* data, size_t length)
+    {
+        unsigned char* p = reinterpret_cast<unsigned char *>(allocate(length, 1));
+        std::memcpy(p, data, length);
+        return p;
+    }
+    
+    void clear()
+    {
+        for (std::vector<char *>::iterator it = m_blocks.begin(); it != m_blocks.end(); ++it)
+        {
+            delete[] *it;
+        }
+        m_blocks.clear();
+        m_cur = NULL;
+        m_left = 0;
+        m_size = 0;
+    }
+    
+    // Bytes of the blocks
+    size_t getSize() const
+    {
+        return m_size;
+    }
+    
+private:
+    ITunesArena(const ITunesArena&);
+    ITunesArena& operator=(const ITunesArena&);
+    
+    std::vector<char *> m_blocks;
+    size_t m_blockSize;
+    char* m_cur;
+    size_t m_left;
+    size_t m_size;
 };
 
 using ITunesFileVector = std::vector<ITunesFile *>;
@@ -41,6 +196,127 @@ using ITunesFilesIterator = typename ITunesFileVector::iterator;
 using ITunesFilesConstIterator = typename ITunesFileVector::const_iterator;
 using ITunesFileRange = std::pair<ITunesFilesConstIterator, ITunesFilesConstIterator>;
 
+// Non-owning view of ITunesFile::relativePath, used as the key of the lookup index
+struct ITunesPathKey
+{
+    const char* path;
+    size_t length;
+    
+    ITunesPathKey(const char* p, size_t len) : path(p), length(len)
+    {
+    }
+    
+    bool operator==(const ITunesPathKey& rhs) const
+    {
+        return length == rhs.length && (length == 0 || std::memcmp(path, rhs.path, length) == 0);
+    }
+};
+
+struct ITunesPathKeyHash
+{
+    size_t operator()(const ITunesPathKey& key) const
+    {
+        // FNV-1a
+        uint64_t hash = 14695981039346656037ULL;
+        const unsigned char* p = reinterpret_cast<const unsigned char *>(key.path);
+        for (const unsigned char* end = p + key.length; p < end; ++p)
+        {
+            hash ^= *p;
+            hash *= 1099511628211ULL;
+        }
+        return static_cast<size_t>(hash);
+    }
+};
+
+// Declarative loading filter of ITunesDb, which is turned into range scans on relativePath
+class ITunesPathFilter
+{
+protected:
+    std::vector<std::string> m_prefixes;
+    int m_flags;    // 0: all, 1: files only, 2: directories only
+    
+public:
+    ITunesPathFilter() : m_flags(0)
+    {
+    }
+    
+    void addPrefix(const std::string& prefix)
+    {
+        if (!prefix.empty())
+        {
+            m_prefixes.push_back(prefix);
+        }
+    }
+    
+    void setFlags(int flags)
+    {
+        m_flags = flags;
+    }
+    
+    int getFlags() const
+    {
+        return m_flags;
+    }
+    
+    const std::vector<std::string>& getPrefixes() const
+    {
+        return m_prefixes;
+    }
+    
+    bool isEmpty() const
+    {
+        return m_prefixes.empty() && m_flags == 0;
+    }
+    
+    bool matches(const char* path, size_t length, int flags) const
+    {
+        if (m_flags != 0 && m_flags != flags)
+        {
+            return false;
+        }
+        if (m_prefixes.empty())
+        {
+            return true;
+        }
+        for (std::vector<std::string>::const_iterator it = m_prefixes.cbegin(); it != m_prefixes.cend(); ++it)
+        {
+            if (length >= it->size() && std::memcmp(path, it->c_str(), it->size()) == 0)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    std::string toString() const
+    {
+        std::string value = std::to_string(m_flags);
+        for (std::vector<std::string>::const_iterator it = m_prefixes.cbegin(); it != m_prefixes.cend(); ++it)
+        {
+            value += '\n';
+            value += *it;
+        }
+        return value;
+    }
+    
+    // The smallest string greater than all strings starting with prefix, empty if there is no such one
+    static std::string upperBound(const std::string& prefix)
+    {
+        std::string value = prefix;
+        while (!value.empty())
+        {
+            unsigned char ch = static_cast<unsigned char>(value.back());
+            if (ch < 0xFF)
+            {
+                value.back() = static_cast<char>(ch + 1);
+                break;
+            }
+            value.pop_back();
+        }
+        return value;
+    }
+};
+
 class BackupManifest
 {
 protected:
@@ -111,6 +387,26 @@ public:
         return m_iOSVersion;
     }
     
+    std::string getDeviceName() const
+    {
+        return m_deviceName;
+    }
+    
+    std::string getDisplayName() const
+    {
+        return m_displayName;
+    }
+    
+    std::string getBackupTime() const
+    {
+        return m_backupTime;
+    }
+    
+    std::string getMacOSVersion() const
+    {
+        return m_macOSVersion;
+    }
+    
     bool isITunesVersionEmpty() const
     {
         return m_iTunesVersion.empty();
@@ -168,6 +464,30 @@ public:
         m_loadingFilter = std::move(loadingFilter);
     }
     
+    // Optional index file of the loaded manifest, reused while Manifest.db/mbdb is unchanged
+    void setCacheFile(const std::string& cacheFile)
+    {
+        m_cacheFile = cacheFile;
+    }
+    
+    void setPathFilter(const ITunesPathFilter& pathFilter)
+    {
+        m_pathFilter = pathFilter;
+    }
+    
+    // MEDIA_LINK_*. The output then depends on the backup, it falls back to copies once linking fails, e.g. across volumes
+    void setLinkMode(int linkMode)
+    {
+        m_linkMode = linkMode;
+        m_linkFailed = false;
+    }
+    
+    // The files copied by the exportings so far, copyFile checks it before the file system. Not owned
+    void setMediaManifest(MediaManifest* mediaManifest)
+    {
+        m_mediaManifest = mediaManifest;
+    }
+    
     bool load();
     bool load(const std::string& domain);
     bool load(const std::string& domain, bool onlyFile);
@@ -184,22 +504,50 @@ public:
     std::string getRealPath(const ITunesFile& file) const;
     std::string getRealPath(const ITunesFile* file) const;
     
-    static unsigned int parseModifiedTime(const std::vector<unsigned char>& data);
+    static unsigned int parseModifiedTime(const ITunesFile* file)
+    {
+        return file->modifiedTime;
+    }
+    static bool parseFileMetadata(const unsigned char* data, size_t length, unsigned int& modifiedTime, uint64_t& size);
     bool copyFile(const std::string& vpath, const std::string& dest, bool overwrite = false) const;
     bool copyFile(const std::string& vpath, const std::string& destPath, const std::string& destFileName, bool overwrite = false) const;
+    bool copyITunesFile(const ITunesFile* file, const std::string& destFullPath) const;
+    // destFullPath is a copy of file, from the media manifest or the file system
+    bool isCopied(const ITunesFile* file, const std::string& destFullPath) const;
     
 protected:
+    bool loadDb(const std::string& domain, bool onlyFile);
     bool loadMbdb(const std::string& domain, bool onlyFile);
+    bool loadCache(const std::string& cacheKey, uint32_t options, uint64_t manifestSize, std::time_t manifestTime);
+    bool saveCache(const std::string& cacheKey, uint32_t options, uint64_t manifestSize, std::time_t manifestTime) const;
+    ITunesFile* addFile(const char* relativePath, size_t relativePathLength, const char* fileId, unsigned int flags);
+    void buildIndex();
+    // The bytes of the files and the index go to the memory accounting
+    void updateMemoryAccounting();
     std::string fileIdToRealPath(const std::string& fileId) const;
+    bool copyOrLinkITunesFile(const ITunesFile* file, const std::string& destFullPath) const;
     
 protected:
     bool m_isMbdb;
+    ITunesArena m_arena;
     mutable std::vector<ITunesFile *> m_files;
+    // m_files stays sorted for filter()/enumFiles(), exact lookups go through the hash index
+    std::unordered_map<ITunesPathKey, const ITunesFile *, ITunesPathKeyHash> m_index;
     std::string m_rootPath;
     std::string m_manifestFileName;
     std::string m_version;
     std::string m_iOSVersion;
     std::function<bool(const char *, int flags)> m_loadingFilter;
+    ITunesPathFilter m_pathFilter;
+    std::string m_cacheFile;
+    MappedFile m_cacheMapping;
+    // First copy of each file (by fileId) in the output, the other copies are linked to it
+    mutable std::mutex m_copiedFilesMutex;
+    mutable std::unordered_map<const ITunesFile *, std::string> m_copiedFiles;
+    int m_linkMode;
+    mutable std::atomic<bool> m_linkFailed;
+    MediaManifest* m_mediaManifest;
+    AccountedBytes m_accountedBytes;
 };
 
 template<class TFilter>
@@ -236,21 +584,61 @@ void ITunesDb::enumFiles(THandler handler) const
 class ManifestParser
 {
 protected:
+    // A backup parsed before, it's used again while its plists are not changed
+    struct CachedManifest
+    {
+        uint64_t infoSize;
+        std::time_t infoModifiedTime;
+        uint64_t manifestSize;
+        std::time_t manifestModifiedTime;
+        BackupManifest manifest;
+        
+        CachedManifest() : infoSize(0), infoModifiedTime(0), manifestSize(0), manifestModifiedTime(0)
+        {
+        }
+        
+        bool isSameFiles(const CachedManifest& rhs) const
+        {
+            return infoSize == rhs.infoSize && infoModifiedTime == rhs.infoModifiedTime && manifestSize == rhs.manifestSize && manifestModifiedTime == rhs.manifestModifiedTime;
+        }
+    };
+    
+    struct BackupItem
+    {
+        std::string path;
+        bool parsed;
+        bool storing;   // entry is new to the cache
+        CachedManifest entry;
+        std::string error;
+        
+        BackupItem() : parsed(false), storing(false)
+        {
+        }
+    };
+    
     std::string m_manifestPath;
+    std::string m_cacheFile;
 	mutable std::string m_lastError;
 
 public:
     ManifestParser(const std::string& manifestPath);
+    // The manifests of the backups are kept in the file between launches, a backup is parsed again once its plists change
+    void setCacheFile(const std::string& cacheFile);
     bool parse(std::vector<BackupManifest>& manifets) const;
 	std::string getLastError() const;
 
     friend ITunesDb;
     
 protected:
-    bool parseDirectory(const std::string& path, std::vector<BackupManifest>& manifests) const;
+    bool parseDirectory(const std::string& path, std::vector<BackupManifest>& manifests, std::map<std::string, CachedManifest>& cache, bool& cacheChanged) const;
+    // Runs on the threads of parseDirectory, the errors go to item.error
+    void parseBackupItem(const std::map<std::string, CachedManifest>& cache, BackupItem& item) const;
     bool parse(const std::string& path, BackupManifest& manifest) const;
 	bool isValidBackupItem(const std::string& path) const;
     
+    void loadCache(std::map<std::string, CachedManifest>& cache) const;
+    bool saveCache(const std::map<std::string, CachedManifest>& cache) const;
+    
     static bool parseInfoPlist(const std::string& backupIdPath, BackupManifest& manifest);
 };
 
@@ -0,0 +1,27 @@
+#ifndef LoadingNotifier_h
+#define LoadingNotifier_h
+
+#include <vector>
+#include "WechatObjects.h"
+
+// What is known about the sessions of an account when they are handed out
+#define SESSIONS_LOADED_BASIC       0   // Read from session.db, without names and record counts
+#define SESSIONS_LOADED_NAMES       1   // Names and portraits from the cell data and the contacts
+#define SESSIONS_LOADED_COUNTS      2   // Record counts, the sessions are complete
+
+// The accounts and sessions while Exporter::loadUsersAndSessions runs, so the list can be shown before
+// all message databases are scanned. Called on the loading threads with copies sorted for display,
+// the accounts of a backup load in parallel so the calls of different accounts may interleave
+class LoadingNotifier
+{
+public:
+
+    virtual ~LoadingNotifier() {}
+
+    virtual void onUsersLoaded(const std::vector<Friend>& users) const = 0;
+    // userIndex is the index in users of onUsersLoaded
+    virtual void onSessionsLoaded(size_t userIndex, const std::vector<Session>& sessions, int stage) const = 0;
+
+};
+
+#endif /* LoadingNotifier_h */
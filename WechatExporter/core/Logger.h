@@ -7,6 +7,7 @@
 //
 
 #include <string>
+#include <vector>
 
 #ifndef Logger_h
 #define Logger_h
@@ -16,6 +17,19 @@ class Logger
 public:
     virtual void write(const std::string& log) = 0;
     virtual void debug(const std::string& log) = 0;
+    // Lines of AsyncLogger in one go, a sink marshalling them to the UI can take them at once
+    virtual void writeLines(const std::vector<std::string>& logs)
+    {
+        for (std::vector<std::string>::const_iterator it = logs.cbegin(); it != logs.cend(); ++it)
+        {
+            write(*it);
+        }
+    }
+    // false if debug drops the lines, so they aren't built
+    virtual bool isDebugging() const
+    {
+        return true;
+    }
     virtual ~Logger() {}
 };
 
@@ -9,6 +9,11 @@
 #ifndef MMKVReader_h
 #define MMKVReader_h
 
+#include <string>
+#include <cstring>
+#include "FileSystem.h"
+#include "HashTable.h"
+
 class MMKVReader
 {
 private:
@@ -131,4 +136,144 @@ public:
     }
 };
 
+// The file is mapped and indexed in one pass: key => span of its last value, as MMKV appends the updates
+// and an empty value removes the key. The values are views into the mapping, valid until it's closed
+class MMKVIndex
+{
+private:
+    struct Span
+    {
+        size_t offset;
+        size_t length;
+    };
+    
+    MappedFile m_file;
+    HashMap<Span> m_index;
+    
+public:
+    MMKVIndex()
+    {
+    }
+    
+    // actualSize: the size of the data after the header of 4 bytes, the one at the beginning of the file is used if it's 0
+    bool open(const std::string& path, uint32_t actualSize)
+    {
+        close();
+        if (!m_file.open(path) || m_file.size() < 8)
+        {
+            m_file.close();
+            return false;
+        }
+        uint32_t headerSize = 0;
+        std::memcpy(&headerSize, m_file.data(), 4);
+        if (headerSize > 0)
+        {
+            actualSize = headerSize;
+        }
+        if (actualSize == 0)
+        {
+            m_file.close();
+            return false;
+        }
+        size_t size = static_cast<size_t>(actualSize) + 4;
+        if (size > m_file.size())
+        {
+            size = m_file.size();
+        }
+        
+        const unsigned char* begin = m_file.data();
+        const unsigned char* end = begin + size;
+        const unsigned char* p = begin + 8;
+        while (p < end)
+        {
+            uint32_t keyLength = 0;
+            p = calcVarint32Ptr(p, end, &keyLength);
+            if (NULL == p || keyLength == 0 || keyLength > static_cast<size_t>(end - p))
+            {
+                break;
+            }
+            HashKey key = hashString(reinterpret_cast<const char *>(p), keyLength);
+            p += keyLength;
+            
+            uint32_t valueLength = 0;
+            p = calcVarint32Ptr(p, end, &valueLength);
+            if (NULL == p || valueLength > static_cast<size_t>(end - p))
+            {
+                break;
+            }
+            if (valueLength == 0)
+            {
+                m_index.erase(key);
+                continue;
+            }
+            bool inserted = false;
+            HashMapEntry<Span>* entry = m_index.insert(key, inserted);
+            entry->value.offset = static_cast<size_t>(p - begin);
+            entry->value.length = valueLength;
+            p += valueLength;
+        }
+        return true;
+    }
+    
+    void close()
+    {
+        m_index.clear();
+        m_file.close();
+    }
+    
+    size_t size() const
+    {
+        return m_index.size();
+    }
+    
+    // The value as it's stored
+    bool findValue(const std::string& key, const unsigned char*& value, size_t& length)
+    {
+        const HashMapEntry<Span>* entry = m_index.find(hashString(key));
+        if (NULL == entry)
+        {
+            return false;
+        }
+        value = m_file.data() + entry->value.offset;
+        length = entry->value.length;
+        return true;
+    }
+    
+    // A string value is a MMBuffer: its length and the bytes
+    bool findString(const std::string& key, const char*& value, size_t& length)
+    {
+        const unsigned char* data = NULL;
+        size_t dataLength = 0;
+        if (!findValue(key, data, dataLength))
+        {
+            return false;
+        }
+        uint32_t mbbLength = 0;
+        const unsigned char* ptr = calcVarint32Ptr(data, data + dataLength, &mbbLength);
+        if (NULL == ptr || mbbLength > static_cast<size_t>(data + dataLength - ptr))
+        {
+            return false;
+        }
+        value = reinterpret_cast<const char *>(ptr);
+        length = mbbLength;
+        return true;
+    }
+    
+    bool getString(const std::string& key, std::string& value)
+    {
+        const char* data = NULL;
+        size_t length = 0;
+        if (!findString(key, data, length))
+        {
+            return false;
+        }
+        value.assign(data, length);
+        return true;
+    }
+    
+private:
+    MMKVIndex(const MMKVIndex&);
+    MMKVIndex& operator=(const MMKVIndex&);
+};
+
 #endif /* MMKVReader_h */
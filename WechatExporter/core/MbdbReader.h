@@ -6,7 +6,9 @@
 //  Copyright © 2021 Matthew. All rights reserved.
 //
 
-#include <fstream>
+#include <string>
+#include <cstring>
+#include "FileSystem.h"
 
 #ifndef MbdbReader_h
 #define MbdbReader_h
@@ -37,76 +39,101 @@
 
 class MbdbReader {
     
-    std::ifstream m_ifs;
-    std::vector<char> m_buffer;
+    // The whole file is mapped and strings are returned as views into the mapping
+    MappedFile m_file;
+    const unsigned char* m_data;
+    size_t m_size;
+    size_t m_pos;
     
-#ifndef NDEBUG
-    std::ifstream::streampos m_pos;
-#endif
 public:
+    MbdbReader() : m_data(NULL), m_size(0), m_pos(0)
+    {
+    }
     
     ~MbdbReader()
     {
-        if (m_ifs.is_open())
-        {
-            m_ifs.close();
-        }
+        m_file.close();
     }
     
     bool open(const std::string& fileName)
     {
-        m_ifs.open(fileName, std::ios_base::in | std::ios_base::binary);
-        if (!m_ifs.is_open())
+        if (!m_file.open(fileName))
         {
             return false;
         }
         
-        char signature[7] = { 0 };
-        m_ifs.read(&signature[0], 6);
-        if (strcmp(signature, "mbdb\5\0") != 0)
+        m_data = m_file.data();
+        m_size = m_file.size();
+        if (m_size < 6 || std::memcmp(m_data, "mbdb\5\0", 6) != 0)
         {
-            m_ifs.close();
+            m_file.close();
+            m_data = NULL;
+            m_size = 0;
             return false;
         }
+        m_pos = 6;
         
         return true;
     }
     
-    bool hasMoreData()
+    bool hasMoreData() const
     {
-        return !m_ifs.eof();
+        return m_pos < m_size;
+    }
+    
+    const unsigned char* read(size_t length)
+    {
+        if (length > m_size - m_pos)
+        {
+            m_pos = m_size;
+            return NULL;
+        }
+        const unsigned char* p = m_data + m_pos;
+        m_pos += length;
+        return p;
     }
     
     bool read(unsigned char *buffer, size_t length)
     {
-        m_ifs.read(reinterpret_cast<char *>(buffer), length);
-
+        const unsigned char* p = read(length);
+        if (NULL == p)
+        {
+            return false;
+        }
+        std::memcpy(buffer, p, length);
         return true;
     }
     
-    bool read(std::string& str)
+    // str is not null-terminated and only valid while the reader is open
+    bool read(const char*& str, size_t& length)
     {
-        int b0 = m_ifs.get();
-        int b1 = m_ifs.get();
+        const unsigned char* p = read(2);
+        if (NULL == p)
+        {
+            return false;
+        }
         
-        if ((b0 == 255 && b1 == 255) || (b0 == 0 && b1 == 0))
+        if ((p[0] == 255 && p[1] == 255) || (p[0] == 0 && p[1] == 0))
         {
-            str.clear();
+            str = reinterpret_cast<const char *>(m_data + m_pos);
+            length = 0;
             return true;
         }
         
-        if (b0 == std::ifstream::traits_type::eof() || b1 == std::ifstream::traits_type::eof())
+        length = p[0] * 256 + p[1];
+        str = reinterpret_cast<const char *>(read(length));
+        return NULL != str;
+    }
+    
+    bool read(std::string& str)
+    {
+        const char* p = NULL;
+        size_t length = 0;
+        if (!read(p, length))
         {
             return false;
         }
-        
-        int lengthOfString = b0 * 256 + b1;
-        m_buffer.resize(lengthOfString);
-        m_ifs.read(&m_buffer[0], lengthOfString);
-
-        str.clear();
-        std::copy(m_buffer.begin(), m_buffer.end(), std::back_inserter(str));
-        
+        str.assign(p, length);
         return true;
     }
     
@@ -121,7 +148,9 @@ public:
         size_t i = 0, length = str.size();
         for (; i < length; ++i)
         {
-            if (str[i] < 32 || str[i] >= 128)
+            // char is signed, the bytes over 127 are compared as unsigned
+            unsigned char ch = static_cast<unsigned char>(str[i]);
+            if (ch < 32 || ch >= 128)
             {
                 break;
             }
@@ -145,30 +174,14 @@ public:
 
     bool skipString()
     {
-        int b0 = m_ifs.get();
-        int b1 = m_ifs.get();
-        
-        if ((b0 == 255 && b1 == 255) || (b0 == 0 && b1 == 0))
-        {
-            return true;
-        }
-        
-        if (b0 == std::ifstream::traits_type::eof() || b1 == std::ifstream::traits_type::eof())
-        {
-            return false;
-        }
-        
-        int lengthOfString = b0 * 256 + b1;
-        m_ifs.seekg(lengthOfString, std::ios_base::cur);
-
-        return true;
+        const char* p = NULL;
+        size_t length = 0;
+        return read(p, length);
     }
-    // static size_t skipString(const unsigned char *data, size_t length);
     
     bool skip(size_t length)
     {
-        m_ifs.seekg(length, std::ios_base::cur);
-        return true;
+        return NULL != read(length);
     }
     
 protected:
@@ -0,0 +1,178 @@
+//
+//  MediaManifest.cpp
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#include "MediaManifest.h"
+#include <cstring>
+#include <vector>
+#include "ITunesParser.h"
+#include "FileSystem.h"
+
+#define MEDIA_MANIFEST_MAGIC     0x4D4D5857  // WXMM
+#define MEDIA_MANIFEST_VERSION   1
+
+// Layout of the file: header and the records
+struct MediaManifestHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t numberOfRecords;
+    uint32_t reserved;
+};
+
+struct MediaManifestRecord
+{
+    uint64_t keyHigh;
+    uint64_t keyLow;
+    uint64_t size;
+    uint32_t modifiedTime;
+    unsigned char fileId[20];
+};
+
+MediaManifest::MediaManifest(const std::string& outputDir, const std::string& manifestFile) : m_outputDir(outputDir), m_manifestFile(manifestFile), m_modified(false)
+{
+}
+
+bool MediaManifest::load()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_sources.clear();
+    m_modified = false;
+
+    std::vector<unsigned char> data;
+    if (!existsFile(m_manifestFile) || !readFile(m_manifestFile, data) || data.size() < sizeof(MediaManifestHeader))
+    {
+        return true;
+    }
+
+    MediaManifestHeader header;
+    std::memcpy(&header, &data[0], sizeof(header));
+    if (header.magic != MEDIA_MANIFEST_MAGIC || header.version != MEDIA_MANIFEST_VERSION || (data.size() - sizeof(header)) / sizeof(MediaManifestRecord) != header.numberOfRecords)
+    {
+        return true;
+    }
+
+    const unsigned char* p = &data[0] + sizeof(header);
+    for (uint32_t idx = 0; idx < header.numberOfRecords; ++idx, p += sizeof(MediaManifestRecord))
+    {
+        MediaManifestRecord record;
+        std::memcpy(&record, p, sizeof(record));
+        HashKey key;
+        key.high = record.keyHigh;
+        key.low = record.keyLow;
+        if (key.isEmpty())
+        {
+            continue;
+        }
+        bool inserted = false;
+        HashMapEntry<Source>* entry = m_sources.insert(key, inserted);
+        entry->value.size = record.size;
+        entry->value.modifiedTime = record.modifiedTime;
+        std::memcpy(entry->value.fileId, record.fileId, sizeof(record.fileId));
+    }
+
+    return true;
+}
+
+bool MediaManifest::save()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_modified)
+    {
+        return true;
+    }
+
+    MediaManifestHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.magic = MEDIA_MANIFEST_MAGIC;
+    header.version = MEDIA_MANIFEST_VERSION;
+    header.numberOfRecords = static_cast<uint32_t>(m_sources.size());
+
+    std::vector<unsigned char> data(sizeof(header) + m_sources.size() * sizeof(MediaManifestRecord));
+    std::memcpy(&data[0], &header, sizeof(header));
+    unsigned char* p = &data[0] + sizeof(header);
+    m_sources.forEach([&p](const HashMapEntry<Source>& entry) {
+        MediaManifestRecord record;
+        record.keyHigh = entry.key.high;
+        record.keyLow = entry.key.low;
+        record.size = entry.value.size;
+        record.modifiedTime = entry.value.modifiedTime;
+        std::memcpy(record.fileId, entry.value.fileId, sizeof(record.fileId));
+        std::memcpy(p, &record, sizeof(record));
+        p += sizeof(record);
+    });
+
+    std::string tempFile = m_manifestFile + ".tmp";
+    if (!writeFile(tempFile, data) || !moveFile(tempFile, m_manifestFile, true))
+    {
+        return false;
+    }
+    m_modified = false;
+    return true;
+}
+
+bool MediaManifest::contains(const std::string& output, const ITunesFile& file)
+{
+    if (!file.hasFileId)
+    {
+        return false;
+    }
+    Source source;
+    fillSource(file, source);
+    HashKey key = getKey(output);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const HashMapEntry<Source>* entry = m_sources.find(key);
+    return NULL != entry && entry->value.size == source.size && entry->value.modifiedTime == source.modifiedTime && std::memcmp(entry->value.fileId, source.fileId, sizeof(source.fileId)) == 0;
+}
+
+void MediaManifest::add(const std::string& output, const ITunesFile& file)
+{
+    if (!file.hasFileId)
+    {
+        return;
+    }
+    Source source;
+    fillSource(file, source);
+    HashKey key = getKey(output);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    bool inserted = false;
+    HashMapEntry<Source>* entry = m_sources.insert(key, inserted);
+    if (inserted || entry->value.size != source.size || entry->value.modifiedTime != source.modifiedTime || std::memcmp(entry->value.fileId, source.fileId, sizeof(source.fileId)) != 0)
+    {
+        entry->value = source;
+        m_modified = true;
+    }
+}
+
+size_t MediaManifest::size() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_sources.size();
+}
+
+HashKey MediaManifest::getKey(const std::string& output) const
+{
+    if (output.size() > m_outputDir.size() && output.compare(0, m_outputDir.size(), m_outputDir) == 0)
+    {
+        std::string::size_type pos = m_outputDir.size();
+        if (output[pos] == '/' || output[pos] == '\\')
+        {
+            ++pos;
+        }
+        return hashString(output.c_str() + pos, output.size() - pos);
+    }
+    return hashString(output);
+}
+
+void MediaManifest::fillSource(const ITunesFile& file, Source& source)
+{
+    source.size = file.size;
+    source.modifiedTime = file.modifiedTime;
+    std::memcpy(source.fileId, file.fileId, sizeof(file.fileId));
+}
@@ -0,0 +1,60 @@
+//
+//  MediaManifest.h
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#ifndef MediaManifest_h
+#define MediaManifest_h
+
+#include <string>
+#include <mutex>
+#include <cstdint>
+#include "HashTable.h"
+
+struct ITunesFile;
+
+// Files of the backup put in the output by the exportings so far: the hash of the output path, relative to the output
+// directory, and the fileId, time and size of the source. The incremental exporting looks up the media here instead of
+// the file system, which is slow on a network share with many files, only the new or changed ones are touched.
+// A file removed from the output by hand is not noticed while it's in the manifest
+class MediaManifest
+{
+public:
+    MediaManifest(const std::string& outputDir, const std::string& manifestFile);
+
+    // An empty manifest if the file doesn't exist or isn't valid
+    bool load();
+    bool save();
+
+    // output is a copy of file
+    bool contains(const std::string& output, const ITunesFile& file);
+    void add(const std::string& output, const ITunesFile& file);
+
+    size_t size() const;
+
+private:
+    MediaManifest(const MediaManifest&);
+    MediaManifest& operator=(const MediaManifest&);
+
+    struct Source
+    {
+        uint64_t size;
+        uint32_t modifiedTime;
+        unsigned char fileId[20];
+    };
+
+    HashKey getKey(const std::string& output) const;
+    static void fillSource(const ITunesFile& file, Source& source);
+
+    std::string m_outputDir;
+    std::string m_manifestFile;
+
+    mutable std::mutex m_mutex;
+    HashMap<Source> m_sources;
+    bool m_modified;
+};
+
+#endif /* MediaManifest_h */
@@ -12,29 +12,64 @@
 #include <libxml/xpath.h>
 #include <json/json.h>
 #include <plist/plist.h>
+#include <atomic>
+#include <algorithm>
+#include <cstdio>
 #include "XmlParser.h"
+#include "XmlPullExtractor.h"
+#include "Tracing.h"
 
-MessageParser::MessageParser(const ITunesDb& iTunesDb, const ITunesDb& iTunesDbShare, TaskManager& taskManager, Friends& friends, Friend myself, int options, const std::string& resPath, const std::string& outputPath, std::function<std::string(const std::string&)>& localeFunc) : m_iTunesDb(iTunesDb), m_iTunesDbShare(iTunesDbShare), m_taskManager(taskManager), m_friends(friends), m_myself(myself), m_options(options), m_resPath(resPath), m_outputPath(outputPath)
+static const char* TEMPLATE_SLOT_KEYS[TVS_COUNT] = {"%%MSGID%%", "%%NAME%%", "%%TIME%%", "%%MSGTYPE%%", "%%MESSAGE%%", "%%ALIGNMENT%%", "%%AVATAR%%", "%%EXTRA_CLS%%", "%%IMGPATH%%", "%%IMGTHUMBPATH%%", "%%THUMBPATH%%", "%%VIDEOPATH%%", "%%VIDEOWIDTH%%", "%%VIDEOHEIGHT%%", "%%AUDIOPATH%%", "%%EMOJIPATH%%", "%%RAWEMOJIPATH%%", "%%SHARINGURL%%", "%%SHARINGTITLE%%", "%%SHARINGIMGPATH%%", "%%CARDNAME%%", "%%CARDIMGPATH%%", "%%CARDTYPE%%", "%%APPNAME%%", "%%APPICONPATH%%", "%%REFERNAME%%", "%%REFERMSG%%", "%%CHANNELS%%", "%%CHANNELURL%%", "%%CHANNELTHUMBPATH%%", "%%MSGTIME%%"};
+
+static const char* LOCALE_STRING_KEYS[LSI_COUNT] = {"[Audio]", "[Audio %s]", "[Emoji]", "[Link]", "[Video/Audio Call]", "[Location]", "[Location] %s (%s,%s)", "[Real-time Location]", "[Video]", "(Video Missed)", "[Photo]", "[Transfer]", "[Red Packet]", "[File: %s]", "[Contact Card]", "[Contact Card] %s", "[Channel Card]", "[Channel Card] %s", "Channels", "<< %s", "%s Ends >>"};
+
+LocaleStrings::LocaleStrings()
 {
-    m_userBase = "Documents/" + m_myself.getHash();
-    m_localFunction = std::move(localeFunc);
+    for (int idx = 0; idx < LSI_COUNT; ++idx)
+    {
+        m_values[idx] = LOCALE_STRING_KEYS[idx];
+    }
 }
 
-bool MessageParser::parse(WXMSG& msg, const Session& session, std::vector<TemplateValues>& tvs) const
+void LocaleStrings::load(const std::map<std::string, std::string>& localeStrings)
 {
-    TemplateValues& tv = *(tvs.emplace(tvs.end(), "msg"));
+    for (int idx = 0; idx < LSI_COUNT; ++idx)
+    {
+        std::map<std::string, std::string>::const_iterator it = localeStrings.find(LOCALE_STRING_KEYS[idx]);
+        m_values[idx] = (it == localeStrings.cend()) ? LOCALE_STRING_KEYS[idx] : it->second;
+    }
+}
 
-    std::string assetsDir = combinePath(m_outputPath, session.getOutputFileName() + "_files");
-    
-    tv["%%MSGID%%"] = msg.msgId;
-    tv["%%NAME%%"] = "";
-    tv["%%TIME%%"] = fromUnixTime(msg.createTime);
-    tv["%%MSGTYPE%%"] = std::to_string(msg.type);
-    tv["%%MESSAGE%%"] = "";
-    
-    std::string forwardedMsg;
-    std::string forwardedMsgTitle;
+const char* LocaleStrings::getKey(LocaleStringId id)
+{
+    return LOCALE_STRING_KEYS[id];
+}
+
+const char* TemplateValues::getSlotKey(TemplateValueSlot slot)
+{
+    return TEMPLATE_SLOT_KEYS[slot];
+}
+
+int TemplateValues::findSlot(const std::string& key)
+{
+    for (int idx = 0; idx < TVS_COUNT; ++idx)
+    {
+        if (key == TEMPLATE_SLOT_KEYS[idx])
+        {
+            return idx;
+        }
+    }
+    return -1;
+}
 
+MessageParser::MessageParser(const ITunesDb& iTunesDb, const ITunesDb& iTunesDbShare, TaskManager& taskManager, Friends& friends, Friend myself, int options, const std::string& resPath, const std::string& outputPath, const LocaleStrings& localeStrings) : m_iTunesDb(iTunesDb), m_iTunesDbShare(iTunesDbShare), m_taskManager(taskManager), m_friends(friends), m_myself(myself), m_options(options), m_resPath(resPath), m_outputPath(outputPath), m_localeStrings(localeStrings), m_senderSession(NULL), m_isSelfSession(false)
+{
+    m_userBase = "Documents/" + m_myself.getHash();
+}
+
+bool MessageParser::parse(WXMSG& msg, const Session& session, TemplateValuesList& tvs) const
+{
+    TraceSpan span("parser", "parse", "type", msg.type);
     std::string senderId = "";
     if (session.isChatroom())
     {
@@ -43,20 +78,92 @@ bool MessageParser::parse(WXMSG& msg, const Session& session, std::vector<Templa
             std::string::size_type enter = msg.content.find(":\n");
             if (enter != std::string::npos && enter + 2 < msg.content.size())
             {
-                senderId = msg.content.substr(0, enter);
-                msg.content = msg.content.substr(enter + 2);
+                senderId.assign(msg.content, 0, enter);
+                msg.content.erase(0, enter + 2);
             }
         }
     }
+    
+    return parseMessage(msg, senderId, msg.content.c_str(), msg.content.size(), session, tvs);
+}
+
+bool MessageParser::parse(const WXMSGROW& row, const Session& session, WXMSG& msg, TemplateValuesList& tvs) const
+{
+    TraceSpan span("parser", "parse", "type", row.type);
+    msg.createTime = row.createTime;
+    msg.des = row.des;
+    msg.type = row.type;
+    msg.msgIdValue = row.msgIdValue;
+    
+    char msgId[24];
+    int msgIdLength = std::snprintf(msgId, sizeof(msgId), "%lld", static_cast<long long>(row.msgIdValue));
+    msg.msgId.assign(msgId, msgIdLength > 0 ? msgIdLength : 0);
+    
+    const char* content = row.content;
+    size_t contentLength = row.contentLength;
+    const char* senderId = content;
+    size_t senderIdLength = 0;
+    if (session.isChatroom() && row.des != 0 && contentLength > 2)
+    {
+        const char* end = content + contentLength;
+        const char* enter = std::search(content, end, ":\n", ":\n" + 2);
+        if (enter != end && enter + 2 < end)
+        {
+            senderIdLength = enter - content;
+            contentLength = end - (enter + 2);
+            content = enter + 2;
+        }
+    }
+    
+    // Plain text needs no copy, everything else is parsed from msg.content
+    if (row.type == MSGTYPE_TEXT)
+    {
+        msg.content.clear();
+        return parseTextMessage(msg, senderId, senderIdLength, content, contentLength, session, tvs);
+    }
+    
+    msg.content.assign(content, contentLength);
+    std::string senderIdValue(senderId, senderIdLength);
+    return parseMessage(msg, senderIdValue, content, contentLength, session, tvs);
+}
+
+bool MessageParser::parseTextMessage(const WXMSG& msg, const char* senderId, size_t senderIdLength, const char* content, size_t contentLength, const Session& session, TemplateValuesList& tvs) const
+{
+    // Most of the messages, the values are written into the buffers kept by tvs
+    TemplateValues& tv = tvs.add("msg");
+    
+    tv[TVS_MSGID] = msg.msgId;
+    m_timestampFormatter.format(msg.createTime, tv[TVS_TIME]);
+    tv[TVS_MSGTIME] = std::to_string(msg.createTime);
+    tv[TVS_MSGTYPE].assign("1", 1);
+    parseText(content, contentLength, tv);
+    parsePortrait(msg, session, senderId, senderIdLength, tv);
+    
+    return true;
+}
+
+bool MessageParser::parseMessage(WXMSG& msg, std::string& senderId, const char* content, size_t contentLength, const Session& session, TemplateValuesList& tvs) const
+{
+    TemplateValues& tv = tvs.add("msg");
+
+    tv[TVS_MSGID] = msg.msgId;
+    tv[TVS_NAME] = "";
+    m_timestampFormatter.format(msg.createTime, tv[TVS_TIME]);
+    tv[TVS_MSGTIME] = std::to_string(msg.createTime);
+    tv[TVS_MSGTYPE] = std::to_string(msg.type);
+    tv[TVS_MESSAGE] = "";
+    
+    std::string forwardedMsg;
+    std::string forwardedMsgTitle;
 
 #ifndef NDEBUG
-    writeFile(combinePath(m_outputPath, "../dbg", "msg" + std::to_string(msg.type) + ".txt"), msg.content);
+    writeFile(combinePath(m_outputPath, "../dbg", "msg" + std::to_string(msg.type) + ".txt"), reinterpret_cast<const unsigned char *>(content), contentLength);
 #endif
     
     switch (msg.type)
     {
         case MSGTYPE_TEXT:  // 1
-            parseText(msg, session, tv);
+            parseText(content, contentLength, tv);
             break;
         case MSGTYPE_IMAGE:  // 3
             parseImage(msg, session, tv);
@@ -118,129 +225,155 @@ bool MessageParser::parse(WXMSG& msg, const Session& session, std::vector<Templa
             break;
     }
     
-    std::string portraitPath = ((m_options & SPO_ICON_IN_SESSION) == SPO_ICON_IN_SESSION) ? session.getOutputFileName() + "_files/Portrait/" : "Portrait/";
-    // std::string emojiPath = ((m_options & SPO_ICON_IN_SESSION) == SPO_ICON_IN_SESSION) ? session.getOutputFileName() + "_files/Emoji/" : "Emoji/";
-    
-    std::string localPortrait;
+    parsePortrait(msg, session, senderId.c_str(), senderId.size(), tv);
 
-    const Friend* protraitUser = NULL;
+    if (!forwardedMsg.empty())
+    {
+        // This funtion will change tvs and causes tv invalid, so we do it at last
+        parseForwardedMsgs(session, msg, forwardedMsgTitle, forwardedMsg, tvs);
+    }
+    return true;
+}
+
+void MessageParser::parsePortrait(const WXMSG& msg, const Session& session, const char* senderId, size_t senderIdLength, TemplateValues& tv) const
+{
+    if (m_senderSession != &session)
+    {
+        // The senders are resolved once a session, so are the copies of their portraits
+        m_senderSession = &session;
+        m_portraitPath = ((m_options & SPO_ICON_IN_SESSION) == SPO_ICON_IN_SESSION) ? session.getOutputFileName() + "_files/Portrait/" : "Portrait/";
+        m_isSelfSession = session.getUsrName() == m_myself.getUsrName();
+        m_senders.clear();
+        m_selfSender.resolved = false;
+        m_peerSender.resolved = false;
+    }
+    
+    const SenderInfo* sender = NULL;
     if (session.isChatroom())
     {
-        tv["%%ALIGNMENT%%"] = (msg.des == 0) ? "right" : "left";
+        tv[TVS_ALIGNMENT].assign((msg.des == 0) ? "right" : "left");
         if (msg.des == 0)
         {
-            tv["%%NAME%%"] = m_myself.getDisplayName();    // CSS will prevent showing the name for self
-            tv["%%AVATAR%%"] = portraitPath + m_myself.getLocalPortrait();
-            // remotePortrait = m_myself.getPortrait();
-            protraitUser = &m_myself;
+            // CSS will prevent showing the name for self
+            sender = &getSelfSender(session);
         }
-        else
+        else if (senderIdLength > 0)
         {
-            if (!senderId.empty())
-            {
-                std::string senderHash = md5(senderId);
-                std::string senderDisplayName = session.getMemberName(senderHash);
-                const Friend *f = m_friends.getFriend(senderHash);
-                if (senderDisplayName.empty() && NULL != f)
-                {
-                    senderDisplayName = f->getDisplayName();
-                }
-                tv["%%NAME%%"] = senderDisplayName.empty() ? senderId : senderDisplayName;
-                if (NULL != f)
-                {
-                    protraitUser = f;
-                }
-                if (NULL == f)
-                {
-                    ensureDefaultPortraitIconExisted(portraitPath);
-                }
-                tv["%%AVATAR%%"] = portraitPath + ((NULL != f) ? f->getLocalPortrait() : "DefaultProfileHead@2x.png");
-            }
-            else
+            bool inserted = false;
+            HashMapEntry<SenderInfo>* entry = m_senders.insert(hashString(senderId, senderIdLength), inserted);
+            if (inserted)
             {
-                tv["%%NAME%%"] = senderId;
-                tv["%%AVATAR%%"] = "";
+                resolveMember(session, std::string(senderId, senderIdLength), entry->value);
             }
+            sender = &entry->value;
+        }
+        else
+        {
+            tv[TVS_NAME].clear();
+            tv[TVS_AVATAR].clear();
+            return;
         }
     }
+    else if (msg.des == 0 || m_isSelfSession)
+    {
+        tv[TVS_ALIGNMENT].assign("right");
+        sender = &getSelfSender(session);
+    }
     else
     {
-        if (msg.des == 0 || session.getUsrName() == m_myself.getUsrName())
+        tv[TVS_ALIGNMENT].assign("left");
+        if (!m_peerSender.resolved)
         {
-            tv["%%ALIGNMENT%%"] = "right";
-            tv["%%NAME%%"] = m_myself.getDisplayName();
-            tv["%%AVATAR%%"] = portraitPath + m_myself.getLocalPortrait();
-            
-            protraitUser = &m_myself;
+            resolvePeer(session, m_peerSender);
         }
-        else
-        {
-            tv["%%ALIGNMENT%%"] = "left";
+        sender = &m_peerSender;
+    }
+    
+    tv[TVS_NAME].assign(sender->name);
+    tv[TVS_AVATAR].assign(sender->avatar);
+}
 
-            const Friend *f = m_friends.getFriend(session.getHash());
-            if (NULL == f)
-            {
-                tv["%%NAME%%"] = session.getDisplayName();
-                if (session.isPortraitEmpty())
-                {
-                    ensureDefaultPortraitIconExisted(portraitPath);
-                }
-                localPortrait = portraitPath + (session.isPortraitEmpty() ? "DefaultProfileHead@2x.png" : session.getLocalPortrait());
-                // remotePortrait = session.getPortrait();
-                tv["%%AVATAR%%"] = localPortrait;
-                
-                protraitUser = &session;
-            }
-            else
-            {
-                tv["%%NAME%%"] = f->getDisplayName();
-                localPortrait = portraitPath + f->getLocalPortrait();
-                // remotePortrait = f->getPortrait();
-                tv["%%AVATAR%%"] = localPortrait;
-                
-                protraitUser = f;
-            }
-        }
+const MessageParser::SenderInfo& MessageParser::getSelfSender(const Session& session) const
+{
+    if (!m_selfSender.resolved)
+    {
+        m_selfSender.name = m_myself.getDisplayName();
+        m_selfSender.avatar = m_portraitPath + m_myself.getLocalPortrait();
+        finishSender(session, &m_myself, m_selfSender);
     }
+    return m_selfSender;
+}
 
-    if ((m_options & SPO_IGNORE_AVATAR) == 0)
+void MessageParser::resolveMember(const Session& session, const std::string& senderId, SenderInfo& sender) const
+{
+    HashKey senderKey = m_friends.getUidKeys().get(senderId);
+    std::string senderDisplayName = session.getMemberName(senderKey);
+    const Friend *f = m_friends.getFriend(senderKey);
+    if (senderDisplayName.empty() && NULL != f)
     {
-        if (NULL != protraitUser)
-        {
-            copyPortraitIcon(&session, *protraitUser, combinePath(m_outputPath, portraitPath));
-            // m_downloader.addTask(remotePortrait, combinePath(m_outputPath, localPortrait), msg.createTime);
-        }
+        senderDisplayName = f->getDisplayName();
     }
-    
-    if ((m_options & SPO_IGNORE_HTML_ENC) == 0)
+    sender.name = senderDisplayName.empty() ? senderId : senderDisplayName;
+    if (NULL == f)
     {
-        tv["%%NAME%%"] = safeHTML(tv["%%NAME%%"]);
+        ensureDefaultPortraitIconExisted(m_portraitPath);
     }
+    sender.avatar = m_portraitPath + ((NULL != f) ? f->getLocalPortrait() : "DefaultProfileHead@2x.png");
+    finishSender(session, f, sender);
+}
 
-    if (!forwardedMsg.empty())
+void MessageParser::resolvePeer(const Session& session, SenderInfo& sender) const
+{
+    const Friend *f = m_friends.getFriend(session.getHashKey());
+    if (NULL == f)
     {
-        // This funtion will change tvs and causes tv invalid, so we do it at last
-        parseForwardedMsgs(session, msg, forwardedMsgTitle, forwardedMsg, tvs);
+        sender.name = session.getDisplayName();
+        if (session.isPortraitEmpty())
+        {
+            ensureDefaultPortraitIconExisted(m_portraitPath);
+        }
+        sender.avatar = m_portraitPath + (session.isPortraitEmpty() ? "DefaultProfileHead@2x.png" : session.getLocalPortrait());
+        f = &session;
     }
-    return true;
+    else
+    {
+        sender.name = f->getDisplayName();
+        sender.avatar = m_portraitPath + f->getLocalPortrait();
+    }
+    finishSender(session, f, sender);
 }
 
-void MessageParser::parsePortrait(const WXMSG& msg, const Session& session, const std::string& senderId, TemplateValues& tv) const
+void MessageParser::finishSender(const Session& session, const Friend* portraitUser, SenderInfo& sender) const
 {
-    
+    if ((m_options & SPO_IGNORE_AVATAR) == 0 && NULL != portraitUser)
+    {
+        copyPortraitIcon(&session, *portraitUser, combinePath(m_outputPath, m_portraitPath));
+    }
+    if ((m_options & SPO_IGNORE_HTML_ENC) == 0)
+    {
+        sender.name = safeHTML(sender.name);
+    }
+    sender.resolved = true;
 }
 
 /////////////////////////////////////
 
 void MessageParser::parseText(const WXMSG& msg, const Session& session, TemplateValues& tv) const
 {
+    parseText(msg.content.c_str(), msg.content.size(), tv);
+}
+
+void MessageParser::parseText(const char* content, size_t contentLength, TemplateValues& tv) const
+{
+    std::string& message = tv[TVS_MESSAGE];
+    message.clear();
     if ((m_options & SPO_IGNORE_HTML_ENC) == 0)
     {
-        tv["%%MESSAGE%%"] = safeHTML(msg.content);
+        appendSafeHTML(message, content, contentLength);
     }
     else
     {
-        tv["%%MESSAGE%%"] = msg.content;
+        message.assign(content, contentLength);
     }
 }
 
@@ -257,11 +390,11 @@ void MessageParser::parseVoice(const WXMSG& msg, const Session& session, Templat
     const ITunesFile* audioSrcFile = NULL;
     if ((m_options & SPO_IGNORE_AUDIO) == 0)
     {
-        std::string vLenStr;
-        XmlParser xmlParser(msg.content);
-        if (xmlParser.parseAttributeValue("/msg/voicemsg", "voicelength", vLenStr) && !vLenStr.empty())
+        static const XmlPullExtractor extractor("/msg/voicemsg", {"voicelength"});
+        std::vector<std::string> values;
+        if (extractor.extract(msg.content, values) > 0 && !values[0].empty())
         {
-            voiceLen = std::stoi(vLenStr);
+            voiceLen = std::atoi(values[0].c_str());
         }
         
         audioSrcFile = m_iTunesDb.findITunesFile(combinePath(m_userBase, "Audio", session.getHash(), msg.msgId + ".aud"));
@@ -272,39 +405,52 @@ void MessageParser::parseVoice(const WXMSG& msg, const Session& session, Templat
     }
     
     bool result = false;
-    if (!audioSrc.empty())
+    if (!audioSrc.empty() && (m_options & SPO_RAW_AUDIO))
     {
-#ifdef USING_ASYNC_TASK_FOR_MP3
+        // Pages opened from file:// can't read binary files, so the SILK is wrapped in a script,
+        // which is loaded like the msg-N.js pages and decoded by silk/silk.js when it's played
+        std::string assetsDir = combinePath(m_outputPath, session.getOutputFileName() + "_files");
+        std::string jsPath = combinePath(assetsDir, msg.msgId + ".aud.js");
+        result = (m_options & SPO_INCREMENTAL_EXP) && existsFile(jsPath);
+        std::vector<unsigned char> silkData;
+        if (!result && readFile(audioSrc, silkData) && !silkData.empty())
+        {
+            std::string js = "silkAudioLoaded(\"" + msg.msgId + "\", \"";
+            appendBase64(js, &silkData[0], silkData.size());
+            js += "\");";
+            ensureDirectoryExisted(assetsDir);
+            result = writeFile(jsPath, js);
+        }
+        if (result)
+        {
+            tv.setName("audio_silk");
+            tv[TVS_AUDIOPATH] = session.getOutputFileName() + "_files/" + msg.msgId + ".aud.js";
+        }
+    }
+    else if (!audioSrc.empty() && isDecodableSilk(audioSrc))
+    {
+        // Transcoded by the pool of the task manager, the page links the mp3 before it is there.
+        // The header is checked first, the clips which can't be decoded keep the text below
         std::string assetsDir = combinePath(m_outputPath, session.getOutputFileName() + "_files");
         ensureDirectoryExisted(assetsDir);
         std::string mp3Path = combinePath(assetsDir, msg.msgId + ".mp3");
-        m_taskManager.convertAudio(&session, audioSrc, mp3Path, ITunesDb::parseModifiedTime(audioSrcFile->blob));
+        std::string sourceId = audioSrcFile->getFileId();
+        if (sourceId.empty())
+        {
+            sourceId.assign(audioSrcFile->relativePath, audioSrcFile->relativePathLength);
+        }
+        m_taskManager.convertAudio(&session, audioSrc, mp3Path, ITunesDb::parseModifiedTime(audioSrcFile), sourceId);
         
         tv.setName("audio");
-        tv["%%AUDIOPATH%%"] = session.getOutputFileName() + "_files/" + msg.msgId + ".mp3";
+        tv[TVS_AUDIOPATH] = session.getOutputFileName() + "_files/" + msg.msgId + ".mp3";
         result = true;
-#else
-        m_pcmData.clear();
-        if (silkToPcm(audioSrc, m_pcmData) && !m_pcmData.empty())
-        {
-            std::string assetsDir = combinePath(m_outputPath, session.getOutputFileName() + "_files");
-            std::string mp3Path = combinePath(assetsDir, msg.msgId + ".mp3");
-            ensureDirectoryExisted(assetsDir);
-            if (pcmToMp3(m_pcmData, mp3Path))
-            {
-                updateFileTime(mp3Path, ITunesDb::parseModifiedTime(audioSrcFile->blob));
-                tv.setName("audio");
-                tv["%%AUDIOPATH%%"] = session.getOutputFileName() + "_files/" + msg.msgId + ".mp3";
-                result = true;
-            }
-        }
-#endif
     }
     
+    // Also shown by the player of the page if the mp3 fails to load
+    tv[TVS_MESSAGE] = voiceLen == -1 ? getLocaleString(LSI_AUDIO) : formatString(getLocaleString(LSI_AUDIO_LENGTH), getDisplayTime(voiceLen).c_str());
     if (!result)
     {
         tv.setName("msg");
-        tv["%%MESSAGE%%"] = voiceLen == -1 ? getLocaleString("[Audio]") : formatString(getLocaleString("[Audio %s]"), getDisplayTime(voiceLen).c_str());
     }
 }
 
@@ -318,26 +464,25 @@ void MessageParser::parsePushMail(const WXMSG& msg, const Session& session, Temp
     
     tv.setName("plainshare");
 
-    tv["%%SHARINGURL%%"] = "##";
-    tv["%%SHARINGTITLE%%"] = subject;
-    tv["%%MESSAGE%%"] = digest;
+    tv[TVS_SHARINGURL] = "##";
+    tv[TVS_SHARINGTITLE] = subject;
+    tv[TVS_MESSAGE] = digest;
 }
 
 void MessageParser::parseVideo(const WXMSG& msg, const Session& session, std::string& senderId, TemplateValues& tv) const
 {
-    std::map<std::string, std::string> attrs = { {"fromusername", ""}, {"cdnthumbwidth", ""}, {"cdnthumbheight", ""} };
-    XmlParser xmlParser(msg.content);
-    if (xmlParser.parseAttributesValue("/msg/videomsg", attrs))
-    {
-    }
+    // fromusername, cdnthumbwidth, cdnthumbheight
+    static const XmlPullExtractor extractor("/msg/videomsg", {"fromusername", "cdnthumbwidth", "cdnthumbheight"});
+    std::vector<std::string> values;
+    extractor.extract(msg.content, values);
     
     if (senderId.empty())
     {
-        senderId = attrs["fromusername"];
+        senderId = values[0];
     }
     
     std::string vfile = combinePath(m_userBase, "Video", session.getHash(), msg.msgId);
-    parseVideo(m_outputPath, session.getOutputFileName() + "_files", vfile + ".mp4", msg.msgId + ".mp4", vfile + ".video_thum", msg.msgId + "_thum.jpg", attrs["cdnthumbwidth"], attrs["cdnthumbheight"], tv);
+    parseVideo(m_outputPath, session.getOutputFileName() + "_files", vfile + ".mp4", msg.msgId + ".mp4", vfile + ".video_thum", msg.msgId + "_thum.jpg", values[1], values[2], tv);
 }
 
 void MessageParser::parseEmotion(const WXMSG& msg, const Session& session, TemplateValues& tv) const
@@ -345,20 +490,13 @@ void MessageParser::parseEmotion(const WXMSG& msg, const Session& session, Templ
     std::string url;
     if ((m_options & SPO_IGNORE_EMOJI) == 0)
     {
-        XmlParser xmlParser(msg.content);
-        if (!xmlParser.parseAttributeValue("/msg/emoji", "cdnurl", url))
+        static const XmlPullExtractor extractor("/msg/emoji", {"cdnurl", "thumburl"});
+        std::vector<std::string> values;
+        extractor.extract(msg.content, values);
+        url.swap(values[0]);
+        if (!startsWith(url, "http") && startsWith(url, "https"))
         {
-            url.clear();
-        }
-        else
-        {
-            if (!startsWith(url, "http") && startsWith(url, "https"))
-            {
-                if (!xmlParser.parseAttributeValue("/msg/emoji", "thumburl", url))
-                {
-                    url.clear();
-                }
-            }
+            url.swap(values[1]);
         }
     }
 
@@ -373,8 +511,8 @@ void MessageParser::parseEmotion(const WXMSG& msg, const Session& session, Templ
         }
         else
         {
-            static int uniqueFileName = 1000000000;
-            emojiFile = std::to_string(uniqueFileName++);
+            static std::atomic<int> uniqueFileName(1000000000);
+            emojiFile = std::to_string(uniqueFileName.fetch_add(1));
         }
         
         std::string emojiPath = ((m_options & SPO_ICON_IN_SESSION) == SPO_ICON_IN_SESSION) ? session.getOutputFileName() + "_files/Emoji/" : "Emoji/";
@@ -390,13 +528,13 @@ void MessageParser::parseEmotion(const WXMSG& msg, const Session& session, Templ
 #endif
         
         tv.setName("emoji");
-        tv["%%EMOJIPATH%%"] = emojiFile;
-        tv["%%RAWEMOJIPATH%%"] = url;
+        tv[TVS_EMOJIPATH] = emojiFile;
+        tv[TVS_RAWEMOJIPATH] = url;
     }
     else
     {
         tv.setName("msg");
-        tv["%%MESSAGE%%"] = getLocaleString("[Emoji]");
+        tv[TVS_MESSAGE] = getLocaleString(LSI_EMOJI);
     }
 }
 
@@ -416,7 +554,7 @@ void MessageParser::parseAppMsg(const WXMSG& msg, const Session& session, std::s
 #ifndef NDEBUG
         writeFile(combinePath(m_outputPath, "../dbg", "msg" + std::to_string(msg.type) + "_app_invld_" + msg.msgId + ".txt"), msg.content);
 #endif
-        tv["%%MESSAGE%%"] = getLocaleString("[Link]");
+        tv[TVS_MESSAGE] = getLocaleString(LSI_LINK);
         return;
     }
 
@@ -429,14 +567,14 @@ void MessageParser::parseAppMsg(const WXMSG& msg, const Session& session, std::s
     if (!appMsg.appId.empty())
     {
         xmlParser.parseNodeValue("/msg/appinfo/appname", appMsg.appName);
-        tv["%%APPNAME%%"] = appMsg.appName;
+        tv[TVS_APPNAME] = appMsg.appName;
         std::string vFile = combinePath(m_userBase, "appicon", appMsg.appId + ".png");
         std::string portraitDir = ((m_options & SPO_ICON_IN_SESSION) == SPO_ICON_IN_SESSION) ? session.getOutputFileName() + "_files/Portrait" : "Portrait";
 
-        if (m_iTunesDb.copyFile(vFile, combinePath(m_outputPath, portraitDir), "appicon_" + appMsg.appId + ".png"))
+        if (copyBackupFile(m_iTunesDb, vFile, combinePath(m_outputPath, portraitDir), "appicon_" + appMsg.appId + ".png", "avatar"))
         {
             appMsg.localAppIcon = portraitDir + "/appicon_" + appMsg.appId + ".png";
-            tv["%%APPICONPATH%%"] = appMsg.localAppIcon;
+            tv[TVS_APPICONPATH] = appMsg.localAppIcon;
         }
     }
 
@@ -533,24 +671,26 @@ void MessageParser::parseAppMsg(const WXMSG& msg, const Session& session, std::s
 void MessageParser::parseCall(const WXMSG& msg, const Session& session, TemplateValues& tv) const
 {
     tv.setName("msg");
-    tv["%%MESSAGE%%"] = getLocaleString("[Video/Audio Call]");
+    tv[TVS_MESSAGE] = getLocaleString(LSI_CALL);
 }
 
 void MessageParser::parseLocation(const WXMSG& msg, const Session& session, TemplateValues& tv) const
 {
-    std::map<std::string, std::string> attrs = { {"x", ""}, {"y", ""}, {"label", ""}, {"poiname", ""} };
-    
-    XmlParser xmlParser(msg.content);
-    xmlParser.parseAttributesValue("/msg/location", attrs);
+    // x, y, label, poiname
+    static const XmlPullExtractor extractor("/msg/location", {"x", "y", "label", "poiname"});
+    std::vector<std::string> values;
+    extractor.extract(msg.content, values);
     
-    std::string location = (!attrs["poiname"].empty() && !attrs["label"].empty()) ? (attrs["poiname"] + " - " + attrs["label"]) : (attrs["poiname"] + attrs["label"]);
+    const std::string& label = values[2];
+    const std::string& poiname = values[3];
+    std::string location = (!poiname.empty() && !label.empty()) ? (poiname + " - " + label) : (poiname + label);
     if (!location.empty())
     {
-        tv["%%MESSAGE%%"] = formatString(getLocaleString("[Location] %s (%s,%s)"), location.c_str(), attrs["x"].c_str(), attrs["y"].c_str());
+        tv[TVS_MESSAGE] = formatString(getLocaleString(LSI_LOCATION_DETAIL), location.c_str(), values[0].c_str(), values[1].c_str());
     }
     else
     {
-        tv["%%MESSAGE%%"] = getLocaleString("[Location]");
+        tv[TVS_MESSAGE] = getLocaleString(LSI_LOCATION);
     }
     tv.setName("msg");
 }
@@ -596,7 +736,7 @@ void MessageParser::parseNotice(const WXMSG& msg, const Session& session, Templa
     Json::Value root;
     if (reader.parse(msg.content, root))
     {
-        tv["%%MESSAGE%%"] = root["msgContent"].asString();
+        tv[TVS_MESSAGE] = root["msgContent"].asString();
     }
 }
 
@@ -608,7 +748,7 @@ void MessageParser::parseSysNotice(const WXMSG& msg, const Session& session, Tem
     tv.setName("notice");
     std::string sysMsg = msg.content;
     removeHtmlTags(sysMsg);
-    tv["%%MESSAGE%%"] = sysMsg;
+    tv[TVS_MESSAGE] = sysMsg;
 }
 
 void MessageParser::parseSystem(const WXMSG& msg, const Session& session, TemplateValues& tv) const
@@ -640,12 +780,12 @@ void MessageParser::parseSystem(const WXMSG& msg, const Session& session, Templa
                     WechatTemplateHandler handler(xmlParser, templateContent);
                     if (xmlParser.parseWithHandler("/sysmsg/sysmsgtemplate/content_template/link_list/link", handler))
                     {
-                        tv["%%MESSAGE%%"] = handler.getText();
+                        tv[TVS_MESSAGE] = handler.getText();
                     }
                 }
                 else
                 {
-                    tv["%%MESSAGE%%"] = msg.content;
+                    tv[TVS_MESSAGE] = msg.content;
                 }
             }
             else
@@ -660,7 +800,7 @@ void MessageParser::parseSystem(const WXMSG& msg, const Session& session, Templa
         {
             std::string content;
             xmlParser.parseNodeValue("/sysmsg/" + sysMsgType + "/text", content);
-            tv["%%MESSAGE%%"] = content;
+            tv[TVS_MESSAGE] = content;
         }
         else
         {
@@ -668,7 +808,7 @@ void MessageParser::parseSystem(const WXMSG& msg, const Session& session, Templa
             std::string plainText;
             if (xmlParser.parseNodeValue("/sysmsg/" + sysMsgType + "/plain", plainText) && !plainText.empty())
             {
-                tv["%%MESSAGE%%"] = plainText;
+                tv[TVS_MESSAGE] = plainText;
             }
             else
             {
@@ -691,7 +831,7 @@ void MessageParser::parseSystem(const WXMSG& msg, const Session& session, Templa
         // Plain Text
         std::string sysMsg = msg.content;
         removeHtmlTags(sysMsg);
-        tv["%%MESSAGE%%"] = sysMsg;
+        tv[TVS_MESSAGE] = sysMsg;
     }
 }
 
@@ -702,7 +842,7 @@ void MessageParser::parseAppMsgText(const WXAPPMSG& appMsg, const XmlParser& xml
     std::string title;
     xmlParser.parseNodeValue("/msg/appmsg/title", title);
     xmlParser.parseNodeValue("/msg/appmsg/title", title);
-    tv["%%MESSAGE%%"] = title.empty() ? getLocaleString("[Link]") : title;
+    tv[TVS_MESSAGE] = title.empty() ? getLocaleString(LSI_LINK) : title;
 }
 
 void MessageParser::parseAppMsgImage(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const
@@ -738,7 +878,7 @@ void MessageParser::parseAppMsgUrl(const WXAPPMSG& appMsg, const XmlParser& xmlP
     // Check Local File
     std::string vThumbFile = m_userBase + "/OpenData/" + session.getHash() + "/" + appMsg.msg->msgId + ".pic_thum";
     std::string destPath = combinePath(m_outputPath, session.getOutputFileName() + "_files");
-    if (m_iTunesDb.copyFile(vThumbFile, destPath, appMsg.msg->msgId + "_thum.jpg"))
+    if (copyBackupFile(m_iTunesDb, vThumbFile, destPath, appMsg.msg->msgId + "_thum.jpg", "thumb"))
     {
         thumbUrl = session.getOutputFileName() + "_files/" + appMsg.msg->msgId + "_thum.jpg";
     }
@@ -752,10 +892,10 @@ void MessageParser::parseAppMsgUrl(const WXAPPMSG& appMsg, const XmlParser& xmlP
     }
     
     tv.setName(thumbUrl.empty() ? "plainshare" : "share");
-    tv["%%SHARINGIMGPATH%%"] = thumbUrl;
-    tv["%%SHARINGTITLE%%"] = title;
-    tv["%%SHARINGURL%%"] = url;
-    tv["%%MESSAGE%%"] = desc;
+    tv[TVS_SHARINGIMGPATH] = thumbUrl;
+    tv[TVS_SHARINGTITLE] = title;
+    tv[TVS_SHARINGURL] = url;
+    tv[TVS_MESSAGE] = desc;
 }
 
 void MessageParser::parseAppMsgAttachment(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const
@@ -791,7 +931,7 @@ void MessageParser::parseAppMsgEmoji(const WXAPPMSG& appMsg, const XmlParser& xm
 
 void MessageParser::parseAppMsgRtLocation(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const
 {
-    tv["%%MESSAGE%%"] = getLocaleString("[Real-time Location]");
+    tv[TVS_MESSAGE] = getLocaleString(LSI_REALTIME_LOCATION);
 }
 
 void MessageParser::parseAppMsgFwdMsg(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, std::string& forwardedMsg, std::string& forwardedMsgTitle, TemplateValues& tv) const
@@ -803,7 +943,7 @@ void MessageParser::parseAppMsgFwdMsg(const WXAPPMSG& appMsg, const XmlParser& x
     writeFile(combinePath(m_outputPath, "../dbg", "msg" + std::to_string(appMsg.msg->type) + "_app_19.txt"), forwardedMsg);
 #endif
     tv.setName("msg");
-    tv["%%MESSAGE%%"] = title;
+    tv[TVS_MESSAGE] = title;
 
     forwardedMsgTitle = title;
 }
@@ -845,19 +985,19 @@ void MessageParser::parseAppMsgRefer(const WXAPPMSG& appMsg, const XmlParser& xm
         writeFile(combinePath(m_outputPath, "../dbg", "msg" + std::to_string(appMsg.msg->type) + "_app_" + std::to_string(APPMSGTYPE_REFER) + "_ref_" + nodes["type"] + " .txt"), nodes["content"]);
 #endif
         tv.setName("refermsg");
-        tv["%%MESSAGE%%"] = title;
-        tv["%%REFERNAME%%"] = nodes["displayname"];
+        tv[TVS_MESSAGE] = title;
+        tv[TVS_REFERNAME] = nodes["displayname"];
         if (nodes["type"] == "43")
         {
-            tv["%%REFERMSG%%"] = getLocaleString("[Video]");
+            tv[TVS_REFERMSG] = getLocaleString(LSI_VIDEO);
         }
         else if (nodes["type"] == "1")
         {
-            tv["%%REFERMSG%%"] = nodes["content"];
+            tv[TVS_REFERMSG] = nodes["content"];
         }
         else if (nodes["type"] == "3")
         {
-            tv["%%REFERMSG%%"] = getLocaleString("[Photo]");
+            tv[TVS_REFERMSG] = getLocaleString(LSI_PHOTO);
         }
         else if (nodes["type"] == "49")
         {
@@ -865,28 +1005,28 @@ void MessageParser::parseAppMsgRefer(const WXAPPMSG& appMsg, const XmlParser& xm
             XmlParser subAppMsgXmlParser(nodes["content"], true);
             std::string subAppMsgTitle;
             subAppMsgXmlParser.parseNodeValue("/msg/appmsg/title", subAppMsgTitle);
-            tv["%%REFERMSG%%"] = subAppMsgTitle;
+            tv[TVS_REFERMSG] = subAppMsgTitle;
         }
         else
         {
-            tv["%%REFERMSG%%"] = nodes["content"];
+            tv[TVS_REFERMSG] = nodes["content"];
         }
     }
     else
     {
         tv.setName("msg");
-        tv["%%MESSAGE%%"] = title;
+        tv[TVS_MESSAGE] = title;
     }
 }
 
 void MessageParser::parseAppMsgTransfer(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const
 {
-    tv["%%MESSAGE%%"] = getLocaleString("[Transfer]");
+    tv[TVS_MESSAGE] = getLocaleString(LSI_TRANSFER);
 }
 
 void MessageParser::parseAppMsgRedPacket(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const
 {
-    tv["%%MESSAGE%%"] = getLocaleString("[Red Packet]");
+    tv[TVS_MESSAGE] = getLocaleString(LSI_RED_PACKET);
 }
 
 void MessageParser::parseAppMsgReaderType(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const
@@ -911,18 +1051,18 @@ void MessageParser::parseAppMsgDefault(const WXAPPMSG& appMsg, const XmlParser&
     {
         tv.setName(nodes["thumburl"].empty() ? "plainshare" : "share");
 
-        tv["%%SHARINGIMGPATH%%"] = nodes["thumburl"];
-        tv["%%SHARINGURL%%"] = nodes["url"];
-        tv["%%SHARINGTITLE%%"] = nodes["title"];
-        tv["%%MESSAGE%%"] = nodes["des"];
+        tv[TVS_SHARINGIMGPATH] = nodes["thumburl"];
+        tv[TVS_SHARINGURL] = nodes["url"];
+        tv[TVS_SHARINGTITLE] = nodes["title"];
+        tv[TVS_MESSAGE] = nodes["des"];
     }
     else if (!nodes["title"].empty())
     {
-        tv["%%MESSAGE%%"] = nodes["title"];
+        tv[TVS_MESSAGE] = nodes["title"];
     }
     else
     {
-        tv["%%MESSAGE%%"] = getLocaleString("[Link]");
+        tv[TVS_MESSAGE] = getLocaleString(LSI_LINK);
     }
 }
 
@@ -934,7 +1074,7 @@ void MessageParser::parseFwdMsgText(const WXFWDMSG& fwdMsg, const XmlParser& xml
     xmlParser.getChildNodeContent(itemNode, "datadesc", message);
     static std::vector<std::pair<std::string, std::string>> replaces = { {"\r\n", "<br />"}, {"\r", "<br />"}, {"\n", "<br />"}};
     replaceAll(message, replaces);
-    tv["%%MESSAGE%%"] = message;
+    tv[TVS_MESSAGE] = message;
 }
 
 void MessageParser::parseFwdMsgImage(const WXFWDMSG& fwdMsg, const XmlParser& xmlParser, xmlNode *itemNode, const Session& session, TemplateValues& tv) const
@@ -971,21 +1111,21 @@ void MessageParser::parseFwdMsgLink(const WXFWDMSG& fwdMsg, const XmlParser& xml
     if ((m_options & SPO_IGNORE_SHARING) == 0)
     {
         std::string vfile = m_userBase + "/OpenData/" + session.getHash() + "/" + fwdMsg.msg->msgId + "/" + fwdMsg.dataId + ".record_thumb";
-        hasThumb = m_iTunesDb.copyFile(vfile, combinePath(m_outputPath, session.getOutputFileName() + "_files", fwdMsg.msg->msgId), fwdMsg.dataId + "_thumb.jpg");
+        hasThumb = copyBackupFile(m_iTunesDb, vfile, combinePath(m_outputPath, session.getOutputFileName() + "_files", fwdMsg.msg->msgId), fwdMsg.dataId + "_thumb.jpg", "thumb");
     }
     
     if (!(link.empty()))
     {
         tv.setName(hasThumb ? "share" : "plainshare");
 
-        tv["%%SHARINGIMGPATH%%"] = session.getOutputFileName() + "_files/" + fwdMsg.msg->msgId + "/" + fwdMsg.dataId + "_thumb.jpg";
-        tv["%%SHARINGURL%%"] = link;
-        tv["%%SHARINGTITLE%%"] = title;
-        tv["%%MESSAGE%%"] = message;
+        tv[TVS_SHARINGIMGPATH] = session.getOutputFileName() + "_files/" + fwdMsg.msg->msgId + "/" + fwdMsg.dataId + "_thumb.jpg";
+        tv[TVS_SHARINGURL] = link;
+        tv[TVS_SHARINGTITLE] = title;
+        tv[TVS_MESSAGE] = message;
     }
     else
     {
-        tv["%%MESSAGE%%"] = title;
+        tv[TVS_MESSAGE] = title;
     }
 }
 
@@ -1007,11 +1147,11 @@ void MessageParser::parseFwdMsgLocation(const WXFWDMSG& fwdMsg, const XmlParser&
     std::string location = (!message.empty() && !label.empty()) ? (message + " - " + label) : (message + label);
     if (!location.empty())
     {
-        tv["%%MESSAGE%%"] = formatString(getLocaleString("[Location] %s (%s,%s)"), location.c_str(), lat.c_str(), lng.c_str());
+        tv[TVS_MESSAGE] = formatString(getLocaleString(LSI_LOCATION_DETAIL), location.c_str(), lat.c_str(), lng.c_str());
     }
     else
     {
-        tv["%%MESSAGE%%"] = getLocaleString("[Location]");
+        tv[TVS_MESSAGE] = getLocaleString(LSI_LOCATION);
     }
     tv.setName("msg");
 }
@@ -1044,14 +1184,14 @@ void MessageParser::MessageParser::parseFwdMsgNestedFwdMsg(const WXFWDMSG& fwdMs
         nestedFwdMsg = XmlParser::getNodeOuterXml(nodeRecordInfo);
     }
     
-    tv["%%MESSAGE%%"] = nestedFwdMsgTitle;
+    tv[TVS_MESSAGE] = nestedFwdMsgTitle;
 }
 
 void MessageParser::MessageParser::parseFwdMsgMiniProgram(const WXFWDMSG& fwdMsg, const XmlParser& xmlParser, xmlNodePtr itemNode, const Session& session, TemplateValues& tv) const
 {
     std::string title;
     xmlParser.getChildNodeContent(itemNode, "datatitle", title);
-    tv["%%MESSAGE%%"] = title;
+    tv[TVS_MESSAGE] = title;
 }
 
 void MessageParser::MessageParser::parseFwdMsgChannels(const WXFWDMSG& fwdMsg, const XmlParser& xmlParser, xmlNodePtr itemNode, const Session& session, TemplateValues& tv) const
@@ -1088,31 +1228,31 @@ void MessageParser::parseVideo(const std::string& sessionPath, const std::string
     {
         std::string fullAssertsPath = combinePath(sessionPath, sessionAssertsPath);
         ensureDirectoryExisted(fullAssertsPath);
-        hasThumb = m_iTunesDb.copyFile(srcThumb, combinePath(fullAssertsPath, destThumb));
-        hasVideo = m_iTunesDb.copyFile(srcVideo, combinePath(fullAssertsPath, destVideo));
+        hasThumb = copyBackupFile(m_iTunesDb, srcThumb, fullAssertsPath, destThumb, "thumb");
+        hasVideo = copyBackupFile(m_iTunesDb, srcVideo, fullAssertsPath, destVideo, "video");
     }
 
     if (hasVideo)
     {
         tv.setName("video");
-        tv["%%THUMBPATH%%"] = hasThumb ? (sessionAssertsPath + "/" + destThumb) : "";
-        tv["%%VIDEOPATH%%"] = sessionAssertsPath + "/" + destVideo;
-        tv["%%MSGTYPE%%"] = "video";
+        tv[TVS_THUMBPATH] = hasThumb ? (sessionAssertsPath + "/" + destThumb) : "";
+        tv[TVS_VIDEOPATH] = sessionAssertsPath + "/" + destVideo;
+        tv[TVS_MSGTYPE] = "video";
     }
     else if (hasThumb)
     {
         tv.setName("thumb");
-        tv["%%IMGTHUMBPATH%%"] = sessionAssertsPath + "/" + destThumb;
-        tv["%%MESSAGE%%"] = getLocaleString("(Video Missed)");
+        tv[TVS_IMGTHUMBPATH] = sessionAssertsPath + "/" + destThumb;
+        tv[TVS_MESSAGE] = getLocaleString(LSI_VIDEO_MISSED);
     }
     else
     {
         tv.setName("msg");
-        tv["%%MESSAGE%%"] = getLocaleString("[Video]");
+        tv[TVS_MESSAGE] = getLocaleString(LSI_VIDEO);
     }
     
-    tv["%%VIDEOWIDTH%%"] = width;
-    tv["%%VIDEOHEIGHT%%"] = height;
+    tv[TVS_VIDEOWIDTH] = width;
+    tv[TVS_VIDEOHEIGHT] = height;
 }
 
 void MessageParser::parseImage(const std::string& sessionPath, const std::string& sessionAssertsPath, const std::string& src, const std::string& srcPre, const std::string& dest, const std::string& srcThumb, const std::string& destThumb, TemplateValues& tv) const
@@ -1122,37 +1262,37 @@ void MessageParser::parseImage(const std::string& sessionPath, const std::string
     if ((m_options & SPO_IGNORE_IMAGE) == 0)
     {
         std::string fullAssertsPath = combinePath(sessionPath, sessionAssertsPath);
-        hasThumb = m_iTunesDb.copyFile(srcThumb, fullAssertsPath, destThumb);
+        hasThumb = copyBackupFile(m_iTunesDb, srcThumb, fullAssertsPath, destThumb, "thumb");
         if (!srcPre.empty())
         {
-            hasImage = m_iTunesDb.copyFile(srcPre, fullAssertsPath, dest);
+            hasImage = copyBackupFile(m_iTunesDb, srcPre, fullAssertsPath, dest, "image");
         }
         if (!hasImage)
         {
-            hasImage = m_iTunesDb.copyFile(src, fullAssertsPath, dest);
+            hasImage = copyBackupFile(m_iTunesDb, src, fullAssertsPath, dest, "image");
         }
     }
 
     if (hasImage)
     {
         tv.setName("image");
-        tv["%%IMGPATH%%"] = sessionAssertsPath + "/" + dest;
+        tv[TVS_IMGPATH] = sessionAssertsPath + "/" + dest;
         // If it is PDF mode, use the raw image directly for print quaility
-        tv["%%IMGTHUMBPATH%%"] = sessionAssertsPath + "/" + (((!hasThumb) || (m_options & SPO_PDF_MODE)) ? dest : destThumb);
-        tv["%%MSGTYPE%%"] = "image";
-        tv["%%EXTRA_CLS%%"] = "raw-img";
+        tv[TVS_IMGTHUMBPATH] = sessionAssertsPath + "/" + (((!hasThumb) || (m_options & SPO_PDF_MODE)) ? dest : destThumb);
+        tv[TVS_MSGTYPE] = "image";
+        tv[TVS_EXTRA_CLS] = "raw-img";
     }
     else if (hasThumb)
     {
         tv.setName("thumb");
-        tv["%%IMGTHUMBPATH%%"] = sessionAssertsPath + "/" + destThumb;
-        tv["%%MESSAGE%%"] = "";
-        tv["%%MSGTYPE%%"] = "image";
+        tv[TVS_IMGTHUMBPATH] = sessionAssertsPath + "/" + destThumb;
+        tv[TVS_MESSAGE] = "";
+        tv[TVS_MSGTYPE] = "image";
     }
     else
     {
         tv.setName("msg");
-        tv["%%MESSAGE%%"] = getLocaleString("[Photo]");
+        tv[TVS_MESSAGE] = getLocaleString(LSI_PHOTO);
     }
 }
 
@@ -1161,21 +1301,21 @@ void MessageParser::parseFile(const std::string& sessionPath, const std::string&
     bool hasFile = false;
     if ((m_options & SPO_IGNORE_FILE) == 0)
     {
-        hasFile = m_iTunesDb.copyFile(src, combinePath(sessionPath, sessionAssertsPath), dest);
+        hasFile = copyBackupFile(m_iTunesDb, src, combinePath(sessionPath, sessionAssertsPath), dest, "file");
     }
 
     if (hasFile)
     {
         tv.setName("plainshare");
-        tv["%%SHARINGURL%%"] = sessionAssertsPath + "/" + dest;
-        tv["%%SHARINGTITLE%%"] = fileName;
-        tv["%%MESSAGE%%"] = "";
-        tv["%%MSGTYPE%%"] = "file";
+        tv[TVS_SHARINGURL] = sessionAssertsPath + "/" + dest;
+        tv[TVS_SHARINGTITLE] = fileName;
+        tv[TVS_MESSAGE] = "";
+        tv[TVS_MSGTYPE] = "file";
     }
     else
     {
         tv.setName("msg");
-        tv["%%MESSAGE%%"] = formatString(getLocaleString("[File: %s]"), fileName.c_str());
+        tv[TVS_MESSAGE] = formatString(getLocaleString(LSI_FILE), fileName.c_str());
     }
 }
 
@@ -1193,7 +1333,7 @@ void MessageParser::parseCard(const Session& session, const std::string& session
         attrs = { {"nickname", ""}, {"username", ""} };
     }
 
-    tv["%%CARDTYPE%%"] = getLocaleString("[Contact Card]");
+    tv[TVS_CARDTYPE] = getLocaleString(LSI_CONTACT_CARD);
     XmlParser xmlParser(cardMessage, true);
     if (xmlParser.parseAttributesValue("/msg", attrs) && !attrs["nickname"].empty())
     {
@@ -1204,8 +1344,8 @@ void MessageParser::parseCard(const Session& session, const std::string& session
             tv.setName("card");
             // Some username is too long to be created on windows, have to use its md5 string
 			std::string imgFileName = startsWith(attrs["username"], "wxid_") ? attrs["username"] : md5(attrs["username"]);
-            tv["%%CARDNAME%%"] = attrs["nickname"];
-            tv["%%CARDIMGPATH%%"] = portraitDir + "/" + imgFileName + ".jpg";
+            tv[TVS_CARDNAME] = attrs["nickname"];
+            tv[TVS_CARDIMGPATH] = portraitDir + "/" + imgFileName + ".jpg";
 			std::string localPortraitDir = normalizePath(portraitDir);
             std::string localFile = combinePath(localPortraitDir, imgFileName + ".jpg");
             ensureDirectoryExisted(combinePath(sessionPath, localPortraitDir));
@@ -1218,18 +1358,18 @@ void MessageParser::parseCard(const Session& session, const std::string& session
         }
         else if (!attrs["nickname"].empty())
         {
-            tv["%%MESSAGE%%"] = formatString(getLocaleString("[Contact Card] %s"), attrs["nickname"].c_str());
+            tv[TVS_MESSAGE] = formatString(getLocaleString(LSI_CONTACT_CARD_NAME), attrs["nickname"].c_str());
         }
         else
         {
-            tv["%%MESSAGE%%"] = getLocaleString("[Contact Card]");
+            tv[TVS_MESSAGE] = getLocaleString(LSI_CONTACT_CARD);
         }
     }
     else
     {
-        tv["%%MESSAGE%%"] = getLocaleString("[Contact Card]");
+        tv[TVS_MESSAGE] = getLocaleString(LSI_CONTACT_CARD);
     }
-    tv["%%EXTRA_CLS%%"] = "contact-card";
+    tv[TVS_EXTRA_CLS] = "contact-card";
 }
 
 void MessageParser::parseChannelCard(const Session& session, const std::string& portraitDir, const std::string& usrName, const std::string& avatar, const std::string& avatarLD, const std::string& name, TemplateValues& tv) const
@@ -1239,14 +1379,14 @@ void MessageParser::parseChannelCard(const Session& session, const std::string&
     {
         hasImg = (!usrName.empty() && !avatar.empty());
     }
-    tv["%%CARDTYPE%%"] = getLocaleString("[Channel Card]");
+    tv[TVS_CARDTYPE] = getLocaleString(LSI_CHANNEL_CARD);
     if (!name.empty())
     {
         if (hasImg)
         {
             tv.setName("card");
-            tv["%%CARDNAME%%"] = name;
-            tv["%%CARDIMGPATH%%"] = portraitDir + "/" + usrName + ".jpg";
+            tv[TVS_CARDNAME] = name;
+            tv[TVS_CARDIMGPATH] = portraitDir + "/" + usrName + ".jpg";
 			std::string localPortraitDir = normalizePath(portraitDir);
             std::string localFile = combinePath(localPortraitDir, usrName + ".jpg");
             ensureDirectoryExisted(combinePath(m_outputPath, localPortraitDir));
@@ -1259,14 +1399,14 @@ void MessageParser::parseChannelCard(const Session& session, const std::string&
         else
         {
             tv.setName("msg");
-            tv["%%MESSAGE%%"] = formatString(getLocaleString("[Channel Card] %s"), name.c_str());
+            tv[TVS_MESSAGE] = formatString(getLocaleString(LSI_CHANNEL_CARD_NAME), name.c_str());
         }
     }
     else
     {
-        tv["%%MESSAGE%%"] = getLocaleString("[Channel Card]");
+        tv[TVS_MESSAGE] = getLocaleString(LSI_CHANNEL_CARD);
     }
-    tv["%%EXTRA_CLS%%"] = "channel-card";
+    tv[TVS_EXTRA_CLS] = "channel-card";
 }
 
 void MessageParser::parseChannels(const std::string& msgId, const XmlParser& xmlParser, xmlNodePtr parentNode, const std::string& finderFeedXPath, const Session& session, TemplateValues& tv) const
@@ -1296,18 +1436,18 @@ void MessageParser::parseChannels(const std::string& msgId, const XmlParser& xml
     
     const std::string portraitDir = ((m_options & SPO_ICON_IN_SESSION) == SPO_ICON_IN_SESSION) ? session.getOutputFileName() + "_files/Portrait" : "Portrait";
     
-    tv["%%CARDNAME%%"] = nodes["nickname"];
-    tv["%%CHANNELS%%"] = getLocaleString("Channels");
-    tv["%%MESSAGE%%"] = nodes["desc"];
-    tv["%%EXTRA_CLS%%"] = "channels";
+    tv[TVS_CARDNAME] = nodes["nickname"];
+    tv[TVS_CHANNELS] = getLocaleString(LSI_CHANNELS);
+    tv[TVS_MESSAGE] = nodes["desc"];
+    tv[TVS_EXTRA_CLS] = "channels";
     
     if (!thumbUrl.empty())
     {
         tv.setName("channels");
-        tv["%%MSGTYPE%%"] = "channels";
+        tv[TVS_MSGTYPE] = "channels";
         std::string thumbFile = session.getOutputFileName() + "_files/" + msgId + ".jpg";
 		std::string localThumbFile = session.getOutputFileName() + "_files" + DIR_SEP + msgId + ".jpg";
-        tv["%%CHANNELTHUMBPATH%%"] = thumbFile;
+        tv[TVS_CHANNELTHUMBPATH] = thumbFile;
         ensureDirectoryExisted(combinePath(m_outputPath, session.getOutputFileName() + "_files"));
 
 #ifdef USING_DOWNLOADER
@@ -1319,7 +1459,7 @@ void MessageParser::parseChannels(const std::string& msgId, const XmlParser& xml
         if (!nodes["avatar"].empty())
         {
             std::string fileName = nodes["username"].empty() ? nodes["objectId"] : nodes["username"];
-            tv["%%CARDIMGPATH%%"] = portraitDir + "/" + fileName + ".jpg";
+            tv[TVS_CARDIMGPATH] = portraitDir + "/" + fileName + ".jpg";
 			std::string localPortraitDir = normalizePath(portraitDir);
             std::string localFile = combinePath(localPortraitDir, fileName + ".jpg");
             ensureDirectoryExisted(combinePath(m_outputPath, localPortraitDir));
@@ -1330,18 +1470,20 @@ void MessageParser::parseChannels(const std::string& msgId, const XmlParser& xml
 #endif
         }
 
-        tv["%%CHANNELURL%%"] = videoNodes["url"];
+        tv[TVS_CHANNELURL] = videoNodes["url"];
     }
 }
 
-bool MessageParser::parseForwardedMsgs(const Session& session, const WXMSG& msg, const std::string& title, const std::string& message, std::vector<TemplateValues>& tvs) const
+bool MessageParser::parseForwardedMsgs(const Session& session, const WXMSG& msg, const std::string& title, const std::string& message, TemplateValuesList& tvs) const
 {
     std::string portraitPath = ((m_options & SPO_ICON_IN_SESSION) == SPO_ICON_IN_SESSION) ? session.getOutputFileName() + "_files/Portrait/" : "Portrait/";
     
-    tvs.push_back(TemplateValues("notice"));
-    TemplateValues& beginTv = tvs.back();
-    beginTv["%%MESSAGE%%"] = formatString(getLocaleString("<< %s"), title.c_str());
-    beginTv["%%EXTRA_CLS%%"] = "fmsgtag";   // tag for forwarded msg
+    TemplateValues& beginTv = tvs.add("notice");
+    beginTv[TVS_MESSAGE] = formatString(getLocaleString(LSI_FWDMSG_BEGIN), title.c_str());
+    beginTv[TVS_EXTRA_CLS] = "fmsgtag";   // tag for forwarded msg
+    // The forwarded messages are placed at the time of the message forwarding them
+    std::string msgTime = std::to_string(msg.createTime);
+    beginTv[TVS_MSGTIME] = msgTime;
     
     XmlParser xmlParser(message);
     XmlParser::XPathEnumerator enumerator(xmlParser, "/recordinfo/datalist/dataitem");
@@ -1373,9 +1515,9 @@ bool MessageParser::parseForwardedMsgs(const Session& session, const WXMSG& msg,
             fmsg.rawMessage = xmlParser.getNodeOuterXml(node);
             writeFile(combinePath(m_outputPath, "../dbg", "fwdmsg_" + fmsg.dataType + ".txt"), fmsg.rawMessage);
 #endif
-            TemplateValues& tv = *(tvs.emplace(tvs.end(), "msg"));
-            tv["%%ALIGNMENT%%"] = "left";
-            tv["%%EXTRA_CLS%%"] = "fmsg";   // forwarded msg
+            TemplateValues& tv = tvs.add("msg");
+            tv[TVS_ALIGNMENT] = "left";
+            tv[TVS_EXTRA_CLS] = "fmsg";   // forwarded msg
             
             std::string nestedFwdMsgTitle;
             std::string nestedFwdMsg;
@@ -1423,21 +1565,22 @@ bool MessageParser::parseForwardedMsgs(const Session& session, const WXMSG& msg,
                     break;
             }
             
-            tv["%%NAME%%"] = fmsg.displayName;
-            tv["%%MSGID%%"] = msg.msgId + "_" + fmsg.dataId;
-            tv["%%TIME%%"] = fmsg.srcMsgTime.empty() ? fmsg.msgTime : fromUnixTime(static_cast<unsigned int>(std::atoi(fmsg.srcMsgTime.c_str())));
+            tv[TVS_NAME] = fmsg.displayName;
+            tv[TVS_MSGID] = msg.msgId + "_" + fmsg.dataId;
+            tv[TVS_MSGTIME] = msgTime;
+            tv[TVS_TIME] = fmsg.srcMsgTime.empty() ? fmsg.msgTime : m_timestampFormatter.format(static_cast<unsigned int>(std::atoi(fmsg.srcMsgTime.c_str())));
 
             // std::string localPortrait;
             // bool hasPortrait = false;
             // localPortrait = combinePath(portraitPath, fmsg.usrName + ".jpg");
             if (copyPortraitIcon(&session, fmsg.usrName, fmsg.portrait, fmsg.portraitLD, combinePath(m_outputPath, portraitPath)))
             {
-                tv["%%AVATAR%%"] = portraitPath + "/" + fmsg.usrName + ".jpg";
+                tv[TVS_AVATAR] = portraitPath + "/" + fmsg.usrName + ".jpg";
             }
             else
             {
                 ensureDefaultPortraitIconExisted(portraitPath);
-                tv["%%AVATAR%%"] = portraitPath + "DefaultProfileHead@2x.png";
+                tv[TVS_AVATAR] = portraitPath + "DefaultProfileHead@2x.png";
             }
 
             if ((dataType == FWDMSG_DATATYPE_NESTED_FWD_MSG) && !nestedFwdMsg.empty())
@@ -1447,10 +1590,10 @@ bool MessageParser::parseForwardedMsgs(const Session& session, const WXMSG& msg,
         }
     }
     
-    tvs.push_back(TemplateValues("notice"));
-    TemplateValues& endTv = tvs.back();
-    endTv["%%MESSAGE%%"] = formatString(getLocaleString("%s Ends >>"), title.c_str());
-    endTv["%%EXTRA_CLS%%"] = "fmsgtag";   // tag for forwarded msg
+    TemplateValues& endTv = tvs.add("notice");
+    endTv[TVS_MESSAGE] = formatString(getLocaleString(LSI_FWDMSG_END), title.c_str());
+    endTv[TVS_EXTRA_CLS] = "fmsgtag";   // tag for forwarded msg
+    endTv[TVS_MSGTIME] = msgTime;
     
     return true;
 }
@@ -1480,7 +1623,7 @@ bool MessageParser::copyPortraitIcon(const Session* session, const std::string&
 {
     std::string destFileName = usrName + ".jpg";
     std::string avatarPath = "share/" + m_myself.getHash() + "/session/headImg/" + usrNameHash + ".pic";
-    bool hasPortrait = m_iTunesDbShare.copyFile(avatarPath, destPath, destFileName);
+    bool hasPortrait = copyBackupFile(m_iTunesDbShare, avatarPath, destPath, destFileName, "avatar");
     if (!hasPortrait)
     {
         if (portraitUrl.empty() && portraitUrlLD.empty())
@@ -1527,3 +1670,26 @@ void MessageParser::ensureDefaultPortraitIconExisted(const std::string& portrait
         copyFile(combinePath(m_resPath, "res", "DefaultProfileHead@2x.png"), dest, false);
     }
 }
+
+bool MessageParser::copyBackupFile(const ITunesDb& iTunesDb, const std::string& vpath, const std::string& destPath, const std::string& destFileName, const std::string& type) const
+{
+    std::string destFullPath = normalizePath(combinePath(destPath, destFileName));
+    const ITunesFile* file = iTunesDb.findITunesFile(vpath);
+    if (NULL == file)
+    {
+        return existsFile(destFullPath);
+    }
+    if (iTunesDb.isCopied(file, destFullPath))
+    {
+        return true;
+    }
+    // The directory is made here, the tasks of a session don't race for it
+    ensureDirectoryExisted(normalizePath(destPath));
+    if (m_options & SPO_PDF_MODE)
+    {
+        // The session is converted to pdf right after it's exported, the files have to be there
+        return iTunesDb.copyITunesFile(file, destFullPath);
+    }
+    m_taskManager.copyFile(&iTunesDb, file, destFullPath, type);
+    return true;
+}
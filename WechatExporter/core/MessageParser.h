@@ -20,6 +20,7 @@
 #include "FileSystem.h"
 #include "XmlParser.h"
 #include "Utils.h"
+#include "HashTable.h"
 
 enum SessionParsingOption
 {
@@ -39,6 +40,9 @@ enum SessionParsingOption
     SPO_ICON_IN_SESSION = 1 << 21,     // Put Head Icon and Emoji files in the folder of session
     SPO_SYNC_LOADING = 1 << 22,
     SPO_SUPPORT_FILTER = 1 << 23,
+    SPO_RAW_AUDIO = 1 << 24,           // Keep the SILK of voices, they are decoded by the page when played
+    SPO_ARCHIVE = 1 << 25,             // Messages go to an SQLite file of the account instead of the pages
+    SPO_COMPRESS_PAGES = 1 << 26,      // Pages of scripts are compressed, the html pages inflate them once loaded
     
     SPO_INCREMENTAL_EXP = 1 << 30,
 	
@@ -55,6 +59,18 @@ struct WXMSG
     int64_t msgIdValue;
 };
 
+// Columns of the current row of SessionParser::MessageEnumerator
+// content points into the buffer of sqlite3 and it is only valid until the next row
+struct WXMSGROW
+{
+    int createTime;
+    const char* content;
+    size_t contentLength;
+    int des;
+    int type;
+    int64_t msgIdValue;
+};
+
 struct WXAPPMSG
 {
     const WXMSG *msg;
@@ -82,15 +98,50 @@ struct WXFWDMSG
 #endif
 };
 
+// Variables of message templates, each one is the %%KEY%% of the same name in templates
+enum TemplateValueSlot
+{
+    TVS_MSGID = 0,
+    TVS_NAME,
+    TVS_TIME,
+    TVS_MSGTYPE,
+    TVS_MESSAGE,
+    TVS_ALIGNMENT,
+    TVS_AVATAR,
+    TVS_EXTRA_CLS,
+    TVS_IMGPATH,
+    TVS_IMGTHUMBPATH,
+    TVS_THUMBPATH,
+    TVS_VIDEOPATH,
+    TVS_VIDEOWIDTH,
+    TVS_VIDEOHEIGHT,
+    TVS_AUDIOPATH,
+    TVS_EMOJIPATH,
+    TVS_RAWEMOJIPATH,
+    TVS_SHARINGURL,
+    TVS_SHARINGTITLE,
+    TVS_SHARINGIMGPATH,
+    TVS_CARDNAME,
+    TVS_CARDIMGPATH,
+    TVS_CARDTYPE,
+    TVS_APPNAME,
+    TVS_APPICONPATH,
+    TVS_REFERNAME,
+    TVS_REFERMSG,
+    TVS_CHANNELS,
+    TVS_CHANNELURL,
+    TVS_CHANNELTHUMBPATH,
+    TVS_MSGTIME,        // createTime in seconds, for the time index of the pages
+    
+    TVS_COUNT
+};
+
 class TemplateValues
 {
 private:
     std::string m_name;
-    std::map<std::string, std::string> m_values;
+    std::string m_values[TVS_COUNT];
     
-public:
-    using const_iterator = std::map<std::string, std::string>::const_iterator;
-
 public:
     TemplateValues()
     {
@@ -98,7 +149,7 @@ public:
     TemplateValues(const std::string& name) : m_name(name)
     {
     }
-    std::string getName() const
+    const std::string& getName() const
     {
         return m_name;
     }
@@ -106,34 +157,129 @@ public:
     {
         m_name = name;
     }
-    std::string& operator[](const std::string& k)
+    std::string& operator[](TemplateValueSlot slot)
+    {
+        return m_values[slot];
+    }
+    const std::string& get(TemplateValueSlot slot) const
+    {
+        return m_values[slot];
+    }
+    
+    // Buffers of the strings are kept for the next message
+    void clear()
+    {
+        for (int idx = 0; idx < TVS_COUNT; ++idx)
+        {
+            m_values[idx].clear();
+        }
+    }
+    
+    void clearName()
+    {
+        m_name.clear();
+    }
+    
+    // "%%KEY%%" of the slot
+    static const char* getSlotKey(TemplateValueSlot slot);
+    // -1 if the key is not a variable of message templates
+    static int findSlot(const std::string& key);
+};
+
+// TemplateValues of one message, the items are reused by the next message instead of being reallocated
+class TemplateValuesList
+{
+private:
+    std::vector<TemplateValues> m_items;
+    size_t m_size;
+    
+public:
+    using const_iterator = std::vector<TemplateValues>::const_iterator;
+    
+public:
+    TemplateValuesList() : m_size(0)
+    {
+    }
+    
+    // The reference is invalid after next add
+    TemplateValues& add(const std::string& name)
     {
-        return m_values[k];
+        if (m_size < m_items.size())
+        {
+            TemplateValues& tv = m_items[m_size++];
+            tv.clear();
+            tv.setName(name);
+            return tv;
+        }
+        m_items.emplace_back(name);
+        m_size = m_items.size();
+        return m_items.back();
     }
-    bool hasValue(const std::string& key) const
+    
+    size_t size() const
     {
-        return m_values.find(key) != m_values.cend();
+        return m_size;
     }
     
     const_iterator cbegin() const
     {
-        return m_values.cbegin();
+        return m_items.cbegin();
     }
     
     const_iterator cend() const
     {
-        return m_values.cend();
+        return m_items.cbegin() + m_size;
     }
     
     void clear()
     {
-        m_values.clear();
+        m_size = 0;
     }
+};
+
+// Locale strings used by MessageParser, resolved once when the strings are loaded
+enum LocaleStringId
+{
+    LSI_AUDIO = 0,              // [Audio]
+    LSI_AUDIO_LENGTH,           // [Audio %s]
+    LSI_EMOJI,                  // [Emoji]
+    LSI_LINK,                   // [Link]
+    LSI_CALL,                   // [Video/Audio Call]
+    LSI_LOCATION,               // [Location]
+    LSI_LOCATION_DETAIL,        // [Location] %s (%s,%s)
+    LSI_REALTIME_LOCATION,      // [Real-time Location]
+    LSI_VIDEO,                  // [Video]
+    LSI_VIDEO_MISSED,           // (Video Missed)
+    LSI_PHOTO,                  // [Photo]
+    LSI_TRANSFER,               // [Transfer]
+    LSI_RED_PACKET,             // [Red Packet]
+    LSI_FILE,                   // [File: %s]
+    LSI_CONTACT_CARD,           // [Contact Card]
+    LSI_CONTACT_CARD_NAME,      // [Contact Card] %s
+    LSI_CHANNEL_CARD,           // [Channel Card]
+    LSI_CHANNEL_CARD_NAME,      // [Channel Card] %s
+    LSI_CHANNELS,               // Channels
+    LSI_FWDMSG_BEGIN,           // << %s
+    LSI_FWDMSG_END,             // %s Ends >>
     
-    void clearName()
+    LSI_COUNT
+};
+
+class LocaleStrings
+{
+private:
+    std::string m_values[LSI_COUNT];
+    
+public:
+    LocaleStrings();
+    // Keys which are not in localeStrings are used as they are
+    void load(const std::map<std::string, std::string>& localeStrings);
+    const std::string& get(LocaleStringId id) const
     {
-        m_name.clear();
+        return m_values[id];
     }
+    
+    static const char* getKey(LocaleStringId id);
 };
 
 struct WechatTemplateHandler
@@ -294,19 +440,43 @@ public:
     static const int FWDMSG_DATATYPE_CHANNELS = 22;
     static const int FWDMSG_DATATYPE_CHANNEL_CARD = 26;
     
-    MessageParser(const ITunesDb& iTunesDb, const ITunesDb& iTunesDbShare, TaskManager& taskManager, Friends& friends, Friend myself, int options, const std::string& resPath, const std::string& outputPath, std::function<std::string(const std::string&)>& localeFunc);
+    MessageParser(const ITunesDb& iTunesDb, const ITunesDb& iTunesDbShare, TaskManager& taskManager, Friends& friends, Friend myself, int options, const std::string& resPath, const std::string& outputPath, const LocaleStrings& localeStrings);
     
-    bool parse(WXMSG& msg, const Session& session, std::vector<TemplateValues>& tvs) const;
+    bool parse(WXMSG& msg, const Session& session, TemplateValuesList& tvs) const;
+    // msg is filled from row, the content of text messages is rendered from row directly without copying it into msg
+    bool parse(const WXMSGROW& row, const Session& session, WXMSG& msg, TemplateValuesList& tvs) const;
     
     bool copyPortraitIcon(const Session* session, const std::string& usrName, const std::string& portraitUrl, const std::string& portraitUrlLD, const std::string& destPath) const;
     bool copyPortraitIcon(const Session* session, const std::string& usrName, const std::string& usrNameHash, const std::string& portraitUrl, const std::string& portraitUrlLD, const std::string& destPath) const;
     bool copyPortraitIcon(const Session* session, const Friend& f, const std::string& destPath) const;
     
 protected:
+    // Name and avatar of a sender, HTML encoded as the template takes them
+    struct SenderInfo
+    {
+        std::string name;
+        std::string avatar;
+        bool resolved;
+        
+        SenderInfo() : resolved(false)
+        {
+        }
+    };
     
-    void parsePortrait(const WXMSG& msg, const Session& session, const std::string& senderId, TemplateValues& tv) const;
+    // Alignment, name and avatar of the sender
+    void parsePortrait(const WXMSG& msg, const Session& session, const char* senderId, size_t senderIdLength, TemplateValues& tv) const;
+    const SenderInfo& getSelfSender(const Session& session) const;
+    void resolveMember(const Session& session, const std::string& senderId, SenderInfo& sender) const;
+    void resolvePeer(const Session& session, SenderInfo& sender) const;
+    // Queues the copy of the portrait
+    void finishSender(const Session& session, const Friend* portraitUser, SenderInfo& sender) const;
+    
+    bool parseMessage(WXMSG& msg, std::string& senderId, const char* content, size_t contentLength, const Session& session, TemplateValuesList& tvs) const;
+    // MSGTYPE_TEXT: no assets, no XML, and nothing copied from the row but into the buffers of tvs
+    bool parseTextMessage(const WXMSG& msg, const char* senderId, size_t senderIdLength, const char* content, size_t contentLength, const Session& session, TemplateValuesList& tvs) const;
     
     void parseText(const WXMSG& msg, const Session& session, TemplateValues& tv) const;
+    void parseText(const char* content, size_t contentLength, TemplateValues& tv) const;
     void parseImage(const WXMSG& msg, const Session& session, TemplateValues& tv) const;
     void parseVoice(const WXMSG& msg, const Session& session, TemplateValues& tv) const;
     void parsePushMail(const WXMSG& msg, const Session& session, TemplateValues& tv) const;
@@ -365,12 +535,12 @@ protected:
     void parseCard(const Session& session, const std::string& sessionPath, const std::string& portraitDir, const std::string& cardMessage, TemplateValues& tv) const;
     void parseChannelCard(const Session& session, const std::string& portraitDir, const std::string& usrName, const std::string& avatar, const std::string& avatarLD, const std::string& name, TemplateValues& tv) const;
     void parseChannels(const std::string& msgId, const XmlParser& xmlParser, xmlNodePtr parentNode, const std::string& finderFeedXPath, const Session& session, TemplateValues& tv) const;
-    bool parseForwardedMsgs(const Session& session, const WXMSG& msg, const std::string& title, const std::string& message, std::vector<TemplateValues>& tvs) const;
+    bool parseForwardedMsgs(const Session& session, const WXMSG& msg, const std::string& title, const std::string& message, TemplateValuesList& tvs) const;
     
     std::string getDisplayTime(int ms) const;
-    std::string getLocaleString(const std::string& key) const
+    const std::string& getLocaleString(LocaleStringId id) const
     {
-        return m_localFunction(key);
+        return m_localeStrings.get(id);
     }
     
     void ensureDirectoryExisted(const std::string& path) const
@@ -382,6 +552,9 @@ protected:
     }
     
     void ensureDefaultPortraitIconExisted(const std::string& portraitPath) const;
+    // Queues the copy to the task manager, so the parsing doesn't wait for it.
+    // true if the dest is there already or the file is in the backup, the page can link it either way
+    bool copyBackupFile(const ITunesDb& iTunesDb, const std::string& vpath, const std::string& destPath, const std::string& destFileName, const std::string& type) const;
 protected:
     const ITunesDb& m_iTunesDb;
     const ITunesDb& m_iTunesDbShare;
@@ -396,12 +569,16 @@ protected:
     const std::string m_outputPath;
     std::string m_userBase;
 
-    std::function<std::string(const std::string&)> m_localFunction;
+    const LocaleStrings& m_localeStrings;
+    mutable TimestampFormatter m_timestampFormatter;
     
-protected:
-#ifndef USING_ASYNC_TASK_FOR_MP3
-    mutable std::vector<unsigned char> m_pcmData;  // buffer
-#endif
+    // Senders of the session parsed last, the workers have their own copies of the parser
+    mutable const Session* m_senderSession;
+    mutable std::string m_portraitPath;
+    mutable bool m_isSelfSession;
+    mutable SenderInfo m_selfSender;
+    mutable SenderInfo m_peerSender;
+    mutable HashMap<SenderInfo> m_senders;  // Members of the chatroom by the hashes of their ids
 };
 
 #endif /* MessageParser_h */
@@ -0,0 +1,207 @@
+//
+//  MessagePipeline.cpp
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/7.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#include "MessagePipeline.h"
+#include <thread>
+#include <algorithm>
+#include "SessionWriter.h"
+#include "Utils.h"
+
+MessagePipeline::MessagePipeline(const MessageParser& msgParser, const Renderer& renderer, const std::atomic<bool>& cancelled, size_t numberOfWorkers, size_t batchSize/* = 256*/) : m_msgParser(msgParser), m_renderer(renderer), m_cancelled(cancelled), m_numberOfWorkers(numberOfWorkers == 0 ? 1 : numberOfWorkers), m_batchSize(batchSize == 0 ? 1 : batchSize), m_enumerator(NULL), m_freeBatches(m_numberOfWorkers * 2 + 2), m_pendingBatches(m_numberOfWorkers * 2 + 2), m_numberOfBatches(0), m_readingDone(false), m_aborted(false)
+{
+    // Enough batches for every worker to have one in hand and one queued, plus the one being written
+    size_t numberOfBatches = m_numberOfWorkers * 2 + 2;
+    m_batches.reserve(numberOfBatches);
+    for (size_t idx = 0; idx < numberOfBatches; ++idx)
+    {
+        Batch* batch = new Batch();
+        batch->rows.reserve(m_batchSize);
+        batch->outputEnds.reserve(m_batchSize);
+        m_batches.push_back(batch);
+        m_freeBatches.push(batch);
+    }
+    m_completedBatches.reserve(numberOfBatches);
+}
+
+MessagePipeline::~MessagePipeline()
+{
+    for (std::vector<Batch *>::iterator it = m_batches.begin(); it != m_batches.end(); ++it)
+    {
+        delete *it;
+    }
+    m_batches.clear();
+}
+
+int MessagePipeline::run(const Session& session, SessionParser::MessageEnumerator& enumerator, const WXMSGROW& firstRow, SessionWriter& writer, int64_t& maxMsgId, const ProgressHandler& progressHandler)
+{
+    m_enumerator = &enumerator;
+
+    std::thread reader(&MessagePipeline::readRows, this, std::cref(firstRow));
+    std::vector<std::thread> workers;
+    workers.reserve(m_numberOfWorkers);
+    for (size_t idx = 0; idx < m_numberOfWorkers; ++idx)
+    {
+        workers.push_back(std::thread(&MessagePipeline::parseRows, this, std::cref(session)));
+    }
+
+    int numberOfMsgs = 0;
+    for (size_t sequence = 0; !m_aborted; ++sequence)
+    {
+        Batch* batch = waitForBatch(sequence);
+        if (NULL == batch)
+        {
+            break;
+        }
+
+        size_t start = 0;
+        for (size_t idx = 0; idx < batch->rows.size(); ++idx)
+        {
+            if (batch->rows[idx].msgIdValue > maxMsgId)
+            {
+                maxMsgId = batch->rows[idx].msgIdValue;
+            }
+            writer.addMessage(batch->output.c_str() + start, batch->outputEnds[idx] - start);
+            start = batch->outputEnds[idx];
+            ++numberOfMsgs;
+
+            progressHandler(numberOfMsgs);
+            if (m_cancelled)
+            {
+                abort();
+                break;
+            }
+        }
+
+        m_freeBatches.push(batch);
+    }
+
+    reader.join();
+    for (std::vector<std::thread>::iterator it = workers.begin(); it != workers.end(); ++it)
+    {
+        it->join();
+    }
+    m_enumerator = NULL;
+
+    return numberOfMsgs;
+}
+
+void MessagePipeline::readRows(const WXMSGROW& firstRow)
+{
+    setThreadName("msgreader");
+    size_t sequence = 0;
+    WXMSGROW row = firstRow;
+    bool hasRow = true;
+    while (hasRow && !m_aborted)
+    {
+        Batch* batch = NULL;
+        if (!m_freeBatches.pop(batch))
+        {
+            break;
+        }
+
+        batch->sequence = sequence;
+        batch->contents.clear();
+        batch->rows.clear();
+        while (hasRow && batch->rows.size() < m_batchSize)
+        {
+            addRow(batch, row);
+            hasRow = m_enumerator->nextRow(row);
+        }
+
+        // The buffer doesn't move any more, so the rows can point into it now
+        const char* content = batch->contents.c_str();
+        for (std::vector<WXMSGROW>::iterator it = batch->rows.begin(); it != batch->rows.end(); ++it)
+        {
+            it->content = content;
+            content += it->contentLength;
+        }
+
+        if (!m_pendingBatches.push(batch))
+        {
+            break;
+        }
+        ++sequence;
+    }
+
+    m_pendingBatches.close();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_numberOfBatches = sequence;
+    m_readingDone = true;
+    m_completed.notify_all();
+}
+
+void MessagePipeline::addRow(Batch* batch, const WXMSGROW& row)
+{
+    batch->contents.append(row.content, row.contentLength);
+    batch->rows.push_back(row);
+}
+
+void MessagePipeline::parseRows(const Session& session)
+{
+    setThreadName("msgparser");
+    // The copy shares the databases and the tasks but has buffers of its own
+    MessageParser msgParser(m_msgParser);
+    TemplateValuesList tvs;
+    WXMSG msg;
+    Batch* batch = NULL;
+    while (!m_aborted && m_pendingBatches.pop(batch))
+    {
+        batch->output.clear();
+        batch->outputEnds.clear();
+        for (std::vector<WXMSGROW>::const_iterator it = batch->rows.cbegin(); it != batch->rows.cend(); ++it)
+        {
+            tvs.clear();
+            msgParser.parse(*it, session, msg, tvs);
+            m_renderer(tvs, batch->output);
+            batch->outputEnds.push_back(batch->output.size());
+        }
+
+        completeBatch(batch);
+    }
+}
+
+void MessagePipeline::completeBatch(Batch* batch)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_completedBatches.push_back(batch);
+    m_completed.notify_all();
+}
+
+MessagePipeline::Batch* MessagePipeline::waitForBatch(size_t sequence)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true)
+    {
+        for (std::vector<Batch *>::iterator it = m_completedBatches.begin(); it != m_completedBatches.end(); ++it)
+        {
+            if ((*it)->sequence == sequence)
+            {
+                Batch* batch = *it;
+                m_completedBatches.erase(it);
+                return batch;
+            }
+        }
+
+        if (m_aborted || (m_readingDone && sequence >= m_numberOfBatches))
+        {
+            return NULL;
+        }
+        m_completed.wait(lock);
+    }
+}
+
+void MessagePipeline::abort()
+{
+    m_aborted = true;
+    m_freeBatches.close();
+    m_pendingBatches.close();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_completed.notify_all();
+}
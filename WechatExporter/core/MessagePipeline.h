@@ -0,0 +1,80 @@
+//
+//  MessagePipeline.h
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/7.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#ifndef MessagePipeline_h
+#define MessagePipeline_h
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <functional>
+#include "MessageParser.h"
+#include "WechatParser.h"
+#include "BoundedQueue.h"
+
+class SessionWriter;
+
+// Exports the messages of one session in three stages:
+//  the calling thread's enumerator is stepped by a reader thread into batches of rows,
+//  workers parse and render the batches with their own copies of MessageParser,
+//  the calling thread writes the rendered batches in the order they were read.
+// The batches are recycled through a bounded free list, which also bounds the number of batches in flight
+class MessagePipeline
+{
+public:
+    typedef std::function<void(const TemplateValuesList& tvs, std::string& content)> Renderer;
+    typedef std::function<void(int numberOfMessages)> ProgressHandler;
+
+    MessagePipeline(const MessageParser& msgParser, const Renderer& renderer, const std::atomic<bool>& cancelled, size_t numberOfWorkers, size_t batchSize = 256);
+    ~MessagePipeline();
+
+    // firstRow is the current row of enumerator, which has been stepped by the caller
+    // Returns the number of messages written
+    int run(const Session& session, SessionParser::MessageEnumerator& enumerator, const WXMSGROW& firstRow, SessionWriter& writer, int64_t& maxMsgId, const ProgressHandler& progressHandler);
+
+private:
+    struct Batch
+    {
+        size_t sequence;
+        std::string contents;               // Contents of the rows
+        std::vector<WXMSGROW> rows;
+        std::string output;                 // Rendered messages
+        std::vector<size_t> outputEnds;
+    };
+
+    void readRows(const WXMSGROW& firstRow);
+    void parseRows(const Session& session);
+    void addRow(Batch* batch, const WXMSGROW& row);
+    void completeBatch(Batch* batch);
+    Batch* waitForBatch(size_t sequence);
+    void abort();
+
+    MessagePipeline(const MessagePipeline&);
+    MessagePipeline& operator=(const MessagePipeline&);
+
+    const MessageParser& m_msgParser;
+    Renderer m_renderer;
+    const std::atomic<bool>& m_cancelled;
+    size_t m_numberOfWorkers;
+    size_t m_batchSize;
+
+    SessionParser::MessageEnumerator* m_enumerator;
+    std::vector<Batch *> m_batches;
+    BoundedQueue<Batch *> m_freeBatches;
+    BoundedQueue<Batch *> m_pendingBatches;
+
+    // Parsed batches waiting for their turn to be written
+    std::mutex m_mutex;
+    std::condition_variable m_completed;
+    std::vector<Batch *> m_completedBatches;
+    size_t m_numberOfBatches;
+    bool m_readingDone;
+    std::atomic<bool> m_aborted;
+};
+
+#endif /* MessagePipeline_h */
@@ -0,0 +1,293 @@
+//
+//  MessageStore.cpp
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/8.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#include "MessageStore.h"
+#include <cstring>
+#include "Utils.h"
+
+#define MESSAGE_STORE_MAGIC         "WXMD"
+#define MESSAGE_STORE_VERSION       2
+#define MESSAGE_STORE_HEADER_SIZE   24
+// Appending stops at this number of segments, the file is compacted into one segment then
+#define MESSAGE_STORE_MAX_SEGMENTS  16
+
+static inline void putUInt32(unsigned char* buffer, uint32_t value)
+{
+    buffer[0] = static_cast<unsigned char>(value >> 24);
+    buffer[1] = static_cast<unsigned char>(value >> 16);
+    buffer[2] = static_cast<unsigned char>(value >> 8);
+    buffer[3] = static_cast<unsigned char>(value);
+}
+
+static inline void putUInt64(unsigned char* buffer, uint64_t value)
+{
+    putUInt32(buffer, static_cast<uint32_t>(value >> 32));
+    putUInt32(buffer + 4, static_cast<uint32_t>(value));
+}
+
+static inline uint32_t getUInt32(const unsigned char* buffer)
+{
+    return (static_cast<uint32_t>(buffer[0]) << 24) | (static_cast<uint32_t>(buffer[1]) << 16) | (static_cast<uint32_t>(buffer[2]) << 8) | static_cast<uint32_t>(buffer[3]);
+}
+
+static inline uint64_t getUInt64(const unsigned char* buffer)
+{
+    return (static_cast<uint64_t>(getUInt32(buffer)) << 32) | getUInt32(buffer + 4);
+}
+
+static void buildHeader(unsigned char* header, uint32_t numberOfMessages, uint64_t indexOffset)
+{
+    std::memcpy(header, MESSAGE_STORE_MAGIC, 4);
+    putUInt32(header + 4, MESSAGE_STORE_VERSION);
+    putUInt32(header + 8, numberOfMessages);
+    putUInt32(header + 12, 0);
+    putUInt64(header + 16, indexOffset);
+}
+
+MessageStoreWriter::MessageStoreWriter() : m_writer(256 * 1024), m_appending(false), m_appendingOffset(0)
+{
+}
+
+MessageStoreWriter::~MessageStoreWriter()
+{
+    discard();
+}
+
+bool MessageStoreWriter::open(const std::string& fileName, bool appending/* = false*/)
+{
+    discard();
+    m_fileName = fileName;
+    // Released, a checkpoint of a big session starts over with a small index
+    std::vector<uint64_t>().swap(m_offsets);
+    m_appending = false;
+    m_appendingOffset = 0;
+    if (appending)
+    {
+        MessageStoreReader reader;
+        if (reader.open(fileName) && reader.getVersion() == MESSAGE_STORE_VERSION && reader.getNumberOfSegments() < MESSAGE_STORE_MAX_SEGMENTS)
+        {
+            m_appending = true;
+            m_appendingOffset = reader.getSize();
+        }
+    }
+    if (!m_writer.open(fileName + ".tmp"))
+    {
+        return false;
+    }
+    // The header is written again in close
+    unsigned char header[MESSAGE_STORE_HEADER_SIZE];
+    buildHeader(header, 0, 0);
+    return m_writer.write(header, sizeof(header));
+}
+
+bool MessageStoreWriter::add(const char* message, size_t length)
+{
+    if (!m_writer.isOpen())
+    {
+        return false;
+    }
+    m_offsets.push_back(m_writer.getSize());
+    unsigned char buffer[4];
+    putUInt32(buffer, static_cast<uint32_t>(length));
+    return m_writer.write(buffer, sizeof(buffer)) && m_writer.write(message, length);
+}
+
+bool MessageStoreWriter::close()
+{
+    if (!m_writer.isOpen())
+    {
+        return false;
+    }
+
+    uint64_t indexOffset = m_writer.getSize();
+    bool succeeded = true;
+    unsigned char buffer[8];
+    for (std::vector<uint64_t>::const_iterator it = m_offsets.cbegin(); it != m_offsets.cend(); ++it)
+    {
+        putUInt64(buffer, *it);
+        succeeded = m_writer.write(buffer, sizeof(buffer)) && succeeded;
+    }
+
+    unsigned char header[MESSAGE_STORE_HEADER_SIZE];
+    buildHeader(header, static_cast<uint32_t>(m_offsets.size()), indexOffset);
+    succeeded = m_writer.writeAt(0, header, sizeof(header)) && succeeded;
+    succeeded = m_writer.close() && succeeded;
+
+    std::string tmpFileName = m_fileName + ".tmp";
+    if (!succeeded)
+    {
+        deleteFile(tmpFileName);
+        return false;
+    }
+    if (m_appending)
+    {
+        succeeded = appendSegment(tmpFileName);
+        deleteFile(tmpFileName);
+        return succeeded;
+    }
+    return moveFile(tmpFileName, m_fileName);
+}
+
+// The file written is exactly one segment, which is copied to the end of the complete segments.
+// Anything after them is truncated, so an interrupted copy only leaves an incomplete segment to be ignored
+bool MessageStoreWriter::appendSegment(const std::string& tmpFileName)
+{
+    if (m_offsets.empty())
+    {
+        return true;
+    }
+    MappedFile segment;
+    if (!segment.open(tmpFileName))
+    {
+        return false;
+    }
+    FileWriter writer(0);
+    if (!writer.openAt(m_fileName, m_appendingOffset))
+    {
+        return false;
+    }
+    bool succeeded = writer.write(segment.data(), segment.size());
+    return writer.close() && succeeded;
+}
+
+void MessageStoreWriter::discard()
+{
+    if (m_writer.isOpen())
+    {
+        m_writer.close();
+        deleteFile(m_fileName + ".tmp");
+    }
+}
+
+MessageStoreReader::MessageStoreReader() : m_version(0), m_numberOfMessages(0), m_size(0)
+{
+}
+
+bool MessageStoreReader::open(const std::string& fileName)
+{
+    close();
+    if (!m_file.open(fileName))
+    {
+        return false;
+    }
+
+    const unsigned char* data = m_file.data();
+    size_t dataSize = m_file.size();
+    if (dataSize >= MESSAGE_STORE_HEADER_SIZE && std::memcmp(data, MESSAGE_STORE_MAGIC, 4) == 0)
+    {
+        if (!readSegments())
+        {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    if (dataSize < sizeof(uint32_t))
+    {
+        close();
+        return false;
+    }
+    m_version = 1;
+    return buildIndex(sizeof(uint32_t), getUInt32(data));
+}
+
+void MessageStoreReader::close()
+{
+    m_file.close();
+    m_version = 0;
+    m_numberOfMessages = 0;
+    m_size = 0;
+    m_segments.clear();
+    m_offsets.clear();
+}
+
+bool MessageStoreReader::readSegments()
+{
+    const unsigned char* data = m_file.data();
+    size_t dataSize = m_file.size();
+    size_t offset = 0;
+    while (dataSize - offset >= MESSAGE_STORE_HEADER_SIZE)
+    {
+        const unsigned char* header = data + offset;
+        size_t segmentSize = dataSize - offset;
+        if (std::memcmp(header, MESSAGE_STORE_MAGIC, 4) != 0 || getUInt32(header + 4) != MESSAGE_STORE_VERSION)
+        {
+            break;
+        }
+        uint32_t numberOfMessages = getUInt32(header + 8);
+        uint64_t indexOffset = getUInt64(header + 16);
+        if (indexOffset < MESSAGE_STORE_HEADER_SIZE || indexOffset > segmentSize || (segmentSize - indexOffset) / 8 < numberOfMessages)
+        {
+            // Incomplete
+            break;
+        }
+        Segment segment = {offset, numberOfMessages, header + indexOffset};
+        m_segments.push_back(segment);
+        m_numberOfMessages += numberOfMessages;
+        offset += static_cast<size_t>(indexOffset) + static_cast<size_t>(numberOfMessages) * 8;
+    }
+    if (m_segments.empty())
+    {
+        return false;
+    }
+    m_version = MESSAGE_STORE_VERSION;
+    m_size = offset;
+    return true;
+}
+
+// Offsets of the records of version 1, a truncated file keeps the complete records
+bool MessageStoreReader::buildIndex(size_t offset, uint32_t numberOfMessages)
+{
+    const unsigned char* data = m_file.data();
+    size_t dataSize = m_file.size();
+    m_offsets.reserve(numberOfMessages);
+    for (uint32_t idx = 0; idx < numberOfMessages; ++idx)
+    {
+        if (offset + sizeof(uint32_t) > dataSize)
+        {
+            break;
+        }
+        uint32_t length = getUInt32(data + offset);
+        if (length > dataSize - offset - sizeof(uint32_t))
+        {
+            break;
+        }
+        m_offsets.push_back(offset);
+        offset += sizeof(uint32_t) + length;
+    }
+    m_numberOfMessages = m_offsets.size();
+    m_size = offset;
+    Segment segment = {0, m_numberOfMessages, NULL};
+    m_segments.push_back(segment);
+    return true;
+}
+
+bool MessageStoreReader::getMessage(size_t segment, size_t index, const char*& message, size_t& length) const
+{
+    if (segment >= m_segments.size() || index >= m_segments[segment].numberOfMessages)
+    {
+        return false;
+    }
+
+    const Segment& seg = m_segments[segment];
+    uint64_t offset = (NULL != seg.index) ? (seg.offset + getUInt64(seg.index + index * 8)) : m_offsets[index];
+    size_t dataSize = m_file.size();
+    if (offset + sizeof(uint32_t) > dataSize)
+    {
+        return false;
+    }
+    uint32_t size = getUInt32(m_file.data() + offset);
+    if (size > dataSize - offset - sizeof(uint32_t))
+    {
+        return false;
+    }
+    message = reinterpret_cast<const char *>(m_file.data() + offset + sizeof(uint32_t));
+    length = size;
+    return true;
+}
@@ -0,0 +1,127 @@
+//
+//  MessageStore.h
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/8.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#ifndef MessageStore_h
+#define MessageStore_h
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "FileSystem.h"
+
+// Rendered messages of a session kept for the incremental exporting (.dat)
+// Version 2 is a sequence of segments, each exporting appends one segment of its new messages.
+// A segment is laid out as below, offsets are relative to the segment and all integers are big-endian:
+//  header:  "WXMD", version (uint32), number of messages (uint32), reserved (uint32), offset of the index (uint64)
+//  records: length (uint32), message
+//  index:   offset of each record (uint64)
+// Version 1 has no header and no index: number of messages (uint32), then the records
+class MessageStoreWriter
+{
+public:
+    MessageStoreWriter();
+    ~MessageStoreWriter();
+
+    // The file is written as fileName.tmp and moved to fileName in close.
+    // With appending, the tmp file becomes a new segment at the end of fileName instead,
+    // unless fileName is of version 1 or has too many segments, which is then rewritten (compacted).
+    bool open(const std::string& fileName, bool appending = false);
+    bool isOpen() const
+    {
+        return m_writer.isOpen();
+    }
+    // Messages of the existing segments are kept, only the new ones are to be added
+    bool isAppending() const
+    {
+        return m_appending;
+    }
+    bool add(const char* message, size_t length);
+    bool close();
+    // The file being written is deleted
+    void discard();
+
+    uint32_t getNumberOfMessages() const
+    {
+        return static_cast<uint32_t>(m_offsets.size());
+    }
+    // Bytes of the index of the segment being written, it grows with the messages until the segment is closed
+    size_t getMemoryUsage() const
+    {
+        return m_offsets.capacity() * sizeof(uint64_t);
+    }
+
+private:
+    MessageStoreWriter(const MessageStoreWriter&);
+    MessageStoreWriter& operator=(const MessageStoreWriter&);
+
+    bool appendSegment(const std::string& tmpFileName);
+
+    std::string m_fileName;
+    FileWriter m_writer;
+    std::vector<uint64_t> m_offsets;
+    bool m_appending;
+    uint64_t m_appendingOffset;     // End of the last complete segment
+};
+
+// Messages are read in place from the mapped file, segment by segment.
+// An incomplete segment at the end, left by an interrupted appending, is ignored.
+class MessageStoreReader
+{
+public:
+    MessageStoreReader();
+
+    bool open(const std::string& fileName);
+    void close();
+
+    uint32_t getVersion() const
+    {
+        return m_version;
+    }
+    size_t getNumberOfMessages() const
+    {
+        return m_numberOfMessages;
+    }
+    size_t getNumberOfSegments() const
+    {
+        return m_segments.size();
+    }
+    size_t getNumberOfMessages(size_t segment) const
+    {
+        return segment < m_segments.size() ? m_segments[segment].numberOfMessages : 0;
+    }
+    // Size of the complete segments
+    uint64_t getSize() const
+    {
+        return m_size;
+    }
+    // The message is valid until the reader is closed
+    bool getMessage(size_t segment, size_t index, const char*& message, size_t& length) const;
+
+private:
+    struct Segment
+    {
+        size_t offset;
+        size_t numberOfMessages;
+        const unsigned char* index;     // Index of version 2 in the file, NULL for the offsets built for version 1
+    };
+
+    MessageStoreReader(const MessageStoreReader&);
+    MessageStoreReader& operator=(const MessageStoreReader&);
+
+    bool readSegments();
+    bool buildIndex(size_t offset, uint32_t numberOfMessages);
+
+    MappedFile m_file;
+    uint32_t m_version;
+    size_t m_numberOfMessages;
+    uint64_t m_size;
+    std::vector<Segment> m_segments;
+    std::vector<uint64_t> m_offsets;    // Index built for version 1
+};
+
+#endif /* MessageStore_h */
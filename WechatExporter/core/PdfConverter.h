@@ -14,6 +14,12 @@ class PdfConverter
 public:
     virtual bool makeUserDirectory(const std::string& dirName) = 0;
     virtual bool convert(const std::string& htmlPath, const std::string& pdfPath) = 0;
+    // Conversions that can run at the same time on the threads of the task manager,
+    // 0: convert is only called on the exporting thread, one session after another
+    virtual unsigned int getConcurrency() const
+    {
+        return 0;
+    }
     virtual ~PdfConverter() {}
 };
 
@@ -0,0 +1,59 @@
+//
+//  ProgressThrottle.cpp
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#include "ProgressThrottle.h"
+#include <chrono>
+
+static inline int64_t getProgressNow()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+ProgressThrottle::ProgressThrottle(uint32_t total, uint32_t interval/* = PROGRESS_THROTTLE_INTERVAL*/) : m_step(total / PROGRESS_THROTTLE_STEPS), m_interval(static_cast<int64_t>(interval) * 1000000), m_deliveredValue(0), m_deliveredTime(0)
+{
+    if (m_step == 0)
+    {
+        m_step = 1;
+    }
+    // The first value goes once the interval passes, not at once
+    m_deliveredTime.store(getProgressNow(), std::memory_order_relaxed);
+}
+
+bool ProgressThrottle::update(uint32_t value)
+{
+    uint32_t deliveredValue = m_deliveredValue.load(std::memory_order_relaxed);
+    if (value <= deliveredValue)
+    {
+        // Behind a value delivered by another thread
+        return false;
+    }
+    int64_t deliveredTime = m_deliveredTime.load(std::memory_order_relaxed);
+    int64_t now = getProgressNow();
+    if (value - deliveredValue < m_step && now - deliveredTime < m_interval)
+    {
+        return false;
+    }
+    // Of the threads racing for the same delivery, the one swapping the time delivers
+    if (!m_deliveredTime.compare_exchange_strong(deliveredTime, now, std::memory_order_relaxed))
+    {
+        return false;
+    }
+    m_deliveredValue.store(value, std::memory_order_relaxed);
+    return true;
+}
+
+bool ProgressThrottle::finish(uint32_t value)
+{
+    if (value == m_deliveredValue.load(std::memory_order_relaxed))
+    {
+        return false;
+    }
+    m_deliveredValue.store(value, std::memory_order_relaxed);
+    m_deliveredTime.store(getProgressNow(), std::memory_order_relaxed);
+    return true;
+}
@@ -0,0 +1,43 @@
+//
+//  ProgressThrottle.h
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#ifndef ProgressThrottle_h
+#define ProgressThrottle_h
+
+#include <cstdint>
+#include <atomic>
+
+// Milliseconds between two deliveries of a progress
+#define PROGRESS_THROTTLE_INTERVAL      100
+// A step of the total, e.g. 1%, is delivered without waiting for the interval
+#define PROGRESS_THROTTLE_STEPS         100
+
+// Progress of a counter updated for every item, e.g. the messages of a session, delivered to the notifier at
+// a bounded rate: once the interval passes or the counter moves a step since the last delivery.
+// update can be called by several threads, only one of them is told to deliver a value
+class ProgressThrottle
+{
+public:
+    explicit ProgressThrottle(uint32_t total, uint32_t interval = PROGRESS_THROTTLE_INTERVAL);
+    
+    // true if value is to be delivered now
+    bool update(uint32_t value);
+    // The final value on completion, true if it wasn't delivered yet
+    bool finish(uint32_t value);
+    
+private:
+    ProgressThrottle(const ProgressThrottle&);
+    ProgressThrottle& operator=(const ProgressThrottle&);
+    
+    uint32_t m_step;
+    int64_t m_interval;     // ns
+    std::atomic<uint32_t> m_deliveredValue;
+    std::atomic<int64_t> m_deliveredTime;
+};
+
+#endif /* ProgressThrottle_h */
@@ -0,0 +1,296 @@
+//
+//  ProtobufFields.cpp
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#include "ProtobufFields.h"
+#include <cstring>
+#include <cassert>
+
+#define PB_WIRETYPE_VARINT              0
+#define PB_WIRETYPE_FIXED64             1
+#define PB_WIRETYPE_LENGTH_DELIMITED    2
+#define PB_WIRETYPE_START_GROUP         3
+#define PB_WIRETYPE_END_GROUP           4
+#define PB_WIRETYPE_FIXED32             5
+// Values set by the fallback, the string is in m_fallbackValues
+#define PB_VALUE_FALLBACK_STRING        16
+#define PB_VALUE_FALLBACK_NUMBER        17
+
+static inline const unsigned char* readVarint64(const unsigned char* p, const unsigned char* end, uint64_t& value)
+{
+    uint64_t result = 0;
+    for (uint32_t shift = 0; shift <= 63 && p < end; shift += 7)
+    {
+        uint64_t byte = *p++;
+        result |= ((byte & 0x7F) << shift);
+        if ((byte & 0x80) == 0)
+        {
+            value = result;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+ProtobufFieldPaths::ProtobufFieldPaths(std::initializer_list<const char *> paths)
+{
+    Node root = { 0, -1, -1, -1, 0 };
+    m_nodes.push_back(root);
+
+    assert(paths.size() <= PROTOBUF_MAX_FIELD_PATHS);
+    for (std::initializer_list<const char *>::const_iterator it = paths.begin(); it != paths.end(); ++it)
+    {
+        int pathIndex = static_cast<int>(m_paths.size());
+        m_paths.push_back(*it);
+
+        int nodeIndex = 0;
+        const char* p = *it;
+        while (*p != '\0')
+        {
+            uint32_t fieldNumber = 0;
+            while (*p >= '0' && *p <= '9')
+            {
+                fieldNumber = fieldNumber * 10 + (*p - '0');
+                ++p;
+            }
+            assert(fieldNumber > 0 && (*p == '.' || *p == '\0'));
+            if (*p == '.')
+            {
+                ++p;
+            }
+
+            int child = findChild(nodeIndex, fieldNumber);
+            if (child < 0)
+            {
+                Node node = { fieldNumber, -1, m_nodes[nodeIndex].firstChild, -1, 0 };
+                child = static_cast<int>(m_nodes.size());
+                m_nodes.push_back(node);
+                m_nodes[nodeIndex].firstChild = child;
+            }
+            if (*p != '\0')
+            {
+                m_nodes[child].descendantMask |= (1u << pathIndex);
+            }
+            else
+            {
+                m_nodes[child].pathIndex = pathIndex;
+            }
+            nodeIndex = child;
+        }
+    }
+    assert(m_nodes.size() <= PROTOBUF_MAX_FIELD_NODES);
+}
+
+int ProtobufFieldPaths::findPath(const char* path) const
+{
+    for (size_t idx = 0; idx < m_paths.size(); ++idx)
+    {
+        if (m_paths[idx] == path)
+        {
+            return static_cast<int>(idx);
+        }
+    }
+    return -1;
+}
+
+ProtobufFields::ProtobufFields(const ProtobufFieldPaths& paths) : m_paths(paths), m_found(0)
+{
+}
+
+bool ProtobufFields::read(const void* data, size_t length)
+{
+    m_found = 0;
+    bool visited[PROTOBUF_MAX_FIELD_NODES] = { false };
+    const unsigned char* p = reinterpret_cast<const unsigned char *>(data);
+    if (!walk(p, p + length, 0, 0, visited))
+    {
+        m_found = 0;
+        return false;
+    }
+    return true;
+}
+
+// Reads the fields of one level to end (or to the end of the group), descends only into the fields on the paths
+bool ProtobufFields::walk(const unsigned char*& p, const unsigned char* end, int nodeIndex, uint32_t groupNumber, bool* visited)
+{
+    const std::vector<ProtobufFieldPaths::Node>& nodes = m_paths.m_nodes;
+    while (p < end)
+    {
+        uint64_t tag = 0;
+        p = readVarint64(p, end, tag);
+        if (NULL == p || tag > 0xFFFFFFFF)
+        {
+            return false;
+        }
+        uint32_t fieldNumber = static_cast<uint32_t>(tag >> 3);
+        int wireType = static_cast<int>(tag & 7);
+        if (wireType == PB_WIRETYPE_END_GROUP)
+        {
+            return groupNumber != 0 && fieldNumber == groupNumber;
+        }
+        if (fieldNumber == 0)
+        {
+            return false;
+        }
+
+        int child = m_paths.findChild(nodeIndex, fieldNumber);
+        Value value = { wireType, NULL, 0, 0 };
+        switch (wireType)
+        {
+            case PB_WIRETYPE_VARINT:
+                p = readVarint64(p, end, value.number);
+                if (NULL == p)
+                {
+                    return false;
+                }
+                break;
+            case PB_WIRETYPE_FIXED64:
+                if (end - p < 8)
+                {
+                    return false;
+                }
+                for (int idx = 7; idx >= 0; --idx)
+                {
+                    value.number = (value.number << 8) | p[idx];
+                }
+                p += 8;
+                break;
+            case PB_WIRETYPE_FIXED32:
+                if (end - p < 4)
+                {
+                    return false;
+                }
+                for (int idx = 3; idx >= 0; --idx)
+                {
+                    value.number = (value.number << 8) | p[idx];
+                }
+                p += 4;
+                break;
+            case PB_WIRETYPE_LENGTH_DELIMITED:
+            {
+                uint64_t length = 0;
+                p = readVarint64(p, end, length);
+                if (NULL == p || length > static_cast<uint64_t>(end - p))
+                {
+                    return false;
+                }
+                value.data = reinterpret_cast<const char *>(p);
+                value.length = static_cast<size_t>(length);
+                p += length;
+                break;
+            }
+            case PB_WIRETYPE_START_GROUP:
+            {
+                // A group has no length, it's read to its end either way
+                int groupNode = -1;
+                if (child >= 0 && !visited[child])
+                {
+                    visited[child] = true;
+                    groupNode = child;
+                }
+                if (!walk(p, end, groupNode, fieldNumber, visited))
+                {
+                    return false;
+                }
+                continue;
+            }
+            default:
+                return false;
+        }
+
+        if (child < 0)
+        {
+            continue;
+        }
+        const ProtobufFieldPaths::Node& node = nodes[child];
+        if (node.pathIndex >= 0 && (m_found & (1u << node.pathIndex)) == 0)
+        {
+            m_values[node.pathIndex] = value;
+            m_found |= (1u << node.pathIndex);
+        }
+        if (node.firstChild >= 0 && !visited[child])
+        {
+            visited[child] = true;
+            if (wireType != PB_WIRETYPE_LENGTH_DELIMITED)
+            {
+                continue;
+            }
+            const unsigned char* nested = reinterpret_cast<const unsigned char *>(value.data);
+            if (!walk(nested, nested + value.length, child, 0, visited))
+            {
+                // Not a message, the paths under it are not there
+                m_found &= ~node.descendantMask;
+            }
+        }
+    }
+    return groupNumber == 0;
+}
+
+const ProtobufFields::Value* ProtobufFields::findValue(const char* path) const
+{
+    int pathIndex = m_paths.findPath(path);
+    if (pathIndex < 0 || (m_found & (1u << pathIndex)) == 0)
+    {
+        return NULL;
+    }
+    return &m_values[pathIndex];
+}
+
+bool ProtobufFields::parse(const char* path, std::string& value) const
+{
+    const Value* v = findValue(path);
+    if (NULL == v)
+    {
+        return false;
+    }
+    switch (v->wireType)
+    {
+        case PB_WIRETYPE_LENGTH_DELIMITED:
+        case PB_VALUE_FALLBACK_STRING:
+        case PB_VALUE_FALLBACK_NUMBER:
+            value.assign(v->data, v->length);
+            return true;
+        case PB_WIRETYPE_VARINT:
+        case PB_WIRETYPE_FIXED64:
+            value = std::to_string(v->number);
+            return true;
+        case PB_WIRETYPE_FIXED32:
+            value = std::to_string(static_cast<uint32_t>(v->number));
+            return true;
+    }
+    return false;
+}
+
+bool ProtobufFields::parse(const char* path, int& value) const
+{
+    const Value* v = findValue(path);
+    if (NULL == v)
+    {
+        return false;
+    }
+    switch (v->wireType)
+    {
+        case PB_WIRETYPE_VARINT:
+        case PB_WIRETYPE_FIXED64:
+        case PB_WIRETYPE_FIXED32:
+        case PB_VALUE_FALLBACK_NUMBER:
+            value = static_cast<int>(v->number);
+            return true;
+    }
+    return false;
+}
+
+void ProtobufFields::setValue(size_t pathIndex, const std::string& value, bool hasNumber, int number)
+{
+    m_fallbackValues[pathIndex] = value;
+    Value& v = m_values[pathIndex];
+    v.wireType = hasNumber ? PB_VALUE_FALLBACK_NUMBER : PB_VALUE_FALLBACK_STRING;
+    v.data = m_fallbackValues[pathIndex].c_str();
+    v.length = m_fallbackValues[pathIndex].size();
+    v.number = static_cast<uint64_t>(static_cast<int64_t>(number));
+    m_found |= (1u << pathIndex);
+}
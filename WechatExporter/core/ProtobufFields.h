@@ -0,0 +1,112 @@
+//
+//  ProtobufFields.h
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#ifndef ProtobufFields_h
+#define ProtobufFields_h
+
+#include <string>
+#include <vector>
+#include <initializer_list>
+#include <cstdint>
+
+#define PROTOBUF_MAX_FIELD_PATHS    16
+#define PROTOBUF_MAX_FIELD_NODES    64
+
+// Dotted field paths of the wire format, like "1.1.6", compiled once into a tree of field numbers.
+// Kept in a static local of the parser, it's shared by the threads
+class ProtobufFieldPaths
+{
+public:
+    ProtobufFieldPaths(std::initializer_list<const char *> paths);
+
+    size_t size() const
+    {
+        return m_paths.size();
+    }
+    const std::string& getPath(size_t pathIndex) const
+    {
+        return m_paths[pathIndex];
+    }
+    // -1 if it is not one of the paths
+    int findPath(const char* path) const;
+
+private:
+    friend class ProtobufFields;
+
+    struct Node
+    {
+        uint32_t fieldNumber;
+        int firstChild;
+        int nextSibling;
+        int pathIndex;              // -1 if no path ends here
+        uint32_t descendantMask;    // Paths under the node, not including its own
+    };
+
+    int findChild(int nodeIndex, uint32_t fieldNumber) const
+    {
+        if (nodeIndex < 0)
+        {
+            return -1;
+        }
+        for (int child = m_nodes[nodeIndex].firstChild; child >= 0; child = m_nodes[child].nextSibling)
+        {
+            if (m_nodes[child].fieldNumber == fieldNumber)
+            {
+                return child;
+            }
+        }
+        return -1;
+    }
+
+    std::vector<std::string> m_paths;
+    std::vector<Node> m_nodes;      // The root is at 0
+};
+
+// Values of the compiled paths, read in one pass over the bytes without a descriptor or an UnknownFieldSet.
+// Same results as RawMessage::parse: the first field with the number on each level, a nested message is
+// only looked into at its first occurrence. The strings point into the data, which has to outlive this
+class ProtobufFields
+{
+public:
+    explicit ProtobufFields(const ProtobufFieldPaths& paths);
+
+    // false if the data is not in the wire format
+    bool read(const void* data, size_t length);
+
+    bool parse(const char* path, std::string& value) const;
+    bool parse(const char* path, int& value) const;
+
+    const ProtobufFieldPaths& getPaths() const
+    {
+        return m_paths;
+    }
+    // For the fallback that parsed the data with RawMessage
+    void setValue(size_t pathIndex, const std::string& value, bool hasNumber, int number);
+
+private:
+    ProtobufFields(const ProtobufFields&);
+    ProtobufFields& operator=(const ProtobufFields&);
+
+    struct Value
+    {
+        int wireType;
+        const char* data;
+        size_t length;
+        uint64_t number;
+    };
+
+    bool walk(const unsigned char*& p, const unsigned char* end, int nodeIndex, uint32_t groupNumber, bool* visited);
+    const Value* findValue(const char* path) const;
+
+    const ProtobufFieldPaths& m_paths;
+    uint32_t m_found;
+    Value m_values[PROTOBUF_MAX_FIELD_PATHS];
+    std::string m_fallbackValues[PROTOBUF_MAX_FIELD_PATHS];
+};
+
+#endif /* ProtobufFields_h */
@@ -7,6 +7,7 @@
 //
 
 #include "RawMessage.h"
+#include "FileSystem.h"
 #ifdef _WIN32
 #include <atlstr.h>
 #endif
@@ -58,6 +59,42 @@ bool convertUnknownField(const UnknownField &uf, int& value)
     return false;
 }
 
+bool parseProtobufFields(const char *data, int length, ProtobufFields& fields)
+{
+    const ProtobufFieldPaths& paths = fields.getPaths();
+    if (fields.read(data, static_cast<size_t>(length)))
+    {
+        return true;
+    }
+    
+    RawMessage msg;
+    if (!msg.merge(data, length))
+    {
+        return false;
+    }
+    for (size_t idx = 0; idx < paths.size(); ++idx)
+    {
+        std::string value;
+        int number = 0;
+        if (msg.parse(paths.getPath(idx), value))
+        {
+            bool hasNumber = msg.parse(paths.getPath(idx), number);
+            fields.setValue(idx, value, hasNumber, number);
+        }
+    }
+    return true;
+}
+
+bool parseProtobufFieldsFromFile(const std::string& path, ProtobufFields& fields, std::vector<unsigned char>& buffer)
+{
+    if (!readFile(path, buffer))
+    {
+        return false;
+    }
+    const char *data = buffer.empty() ? "" : reinterpret_cast<const char *>(&buffer[0]);
+    return parseProtobufFields(data, static_cast<int>(buffer.size()), fields);
+}
+
 std::string RawMessage::toUtf8String(const std::string& str)
 {
     return UnescapeCEscapeString(str);
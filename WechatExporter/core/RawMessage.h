@@ -19,17 +19,19 @@
 #include <google/protobuf/io/coded_stream.h>
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 #include <google/protobuf/io/tokenizer.h>
-#include <google/protobuf/compiler/parser.h>
+// The compiler is in libprotoc, which the command line build doesn't link
+// #include <google/protobuf/compiler/parser.h>
 // #include <google/protobuf/compiler/importer.h>
 #include <google/protobuf/stubs/strutil.h>
 #include <google/protobuf/text_format.h>
 
 #include "Utils.h"
+#include "ProtobufFields.h"
 
 
 using namespace google::protobuf;
 using namespace google::protobuf::io;
-using namespace google::protobuf::compiler;
+// using namespace google::protobuf::compiler;
 
 #ifndef RawMessage_h
 #define RawMessage_h
@@ -37,6 +39,11 @@ using namespace google::protobuf::compiler;
 bool convertUnknownField(const UnknownField &uf, std::string& value);
 bool convertUnknownField(const UnknownField &uf, int& value);
 
+// The paths of fields are read by the wire format walker, RawMessage is only used for what it can't read
+bool parseProtobufFields(const char *data, int length, ProtobufFields& fields);
+// buffer keeps the contents of the file for the strings of fields
+bool parseProtobufFieldsFromFile(const std::string& path, ProtobufFields& fields, std::vector<unsigned char>& buffer);
+
 class RawMessage
 {
 public:
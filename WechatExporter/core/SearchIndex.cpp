@@ -0,0 +1,238 @@
+//
+//  SearchIndex.cpp
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#include "SearchIndex.h"
+#include <cstring>
+#include <algorithm>
+#include "Utils.h"
+
+static bool startsWith(const char* begin, const char* end, const char* prefix)
+{
+    size_t length = std::strlen(prefix);
+    return static_cast<size_t>(end - begin) >= length && std::memcmp(begin, prefix, length) == 0;
+}
+
+static bool containsString(const char* begin, const char* end, const char* str)
+{
+    return std::search(begin, end, str, str + std::strlen(str)) != end;
+}
+
+// Invalid bytes are taken as U+FFFD one by one
+static uint32_t nextCodePoint(const std::string& text, size_t& pos)
+{
+    unsigned char ch = static_cast<unsigned char>(text[pos]);
+    size_t length = 1;
+    uint32_t codePoint = ch;
+    if (ch >= 0xF0 && ch < 0xF8)
+    {
+        length = 4;
+        codePoint = ch & 0x07;
+    }
+    else if (ch >= 0xE0)
+    {
+        length = (ch < 0xF0) ? 3 : 1;
+        codePoint = ch & 0x0F;
+    }
+    else if (ch >= 0xC0)
+    {
+        length = 2;
+        codePoint = ch & 0x1F;
+    }
+    else if (ch >= 0x80)
+    {
+        length = 0;
+    }
+
+    if (length == 0 || (ch >= 0xF8) || pos + length > text.size())
+    {
+        ++pos;
+        return 0xFFFD;
+    }
+    for (size_t idx = 1; idx < length; ++idx)
+    {
+        unsigned char next = static_cast<unsigned char>(text[pos + idx]);
+        if ((next & 0xC0) != 0x80)
+        {
+            ++pos;
+            return 0xFFFD;
+        }
+        codePoint = (codePoint << 6) | (next & 0x3F);
+    }
+    pos += length;
+    return codePoint;
+}
+
+// Kana, Han and Hangul, which are written without spaces
+static bool isCjk(uint32_t ch)
+{
+    return (ch >= 0x3040 && ch <= 0x30FF) || (ch >= 0x3400 && ch <= 0x4DBF) || (ch >= 0x4E00 && ch <= 0x9FFF) || (ch >= 0xAC00 && ch <= 0xD7AF) || (ch >= 0xF900 && ch <= 0xFAFF);
+}
+
+SearchIndexBuilder::SearchIndexBuilder(size_t pageSize) : m_pageSize(pageSize)
+{
+}
+
+void SearchIndexBuilder::addMessage(size_t page, size_t offset, const char* message, size_t length)
+{
+    extractText(message, length, m_text);
+    m_tokens.clear();
+    tokenize(m_text, m_tokens);
+
+    uint32_t posting = static_cast<uint32_t>(page * m_pageSize + offset);
+    for (std::vector<std::string>::const_iterator it = m_tokens.cbegin(); it != m_tokens.cend(); ++it)
+    {
+        std::vector<uint32_t>& postings = m_postings[*it];
+        // Tokens repeated in the message
+        if (postings.empty() || postings.back() != posting)
+        {
+            postings.push_back(posting);
+        }
+    }
+}
+
+void SearchIndexBuilder::build(size_t shard, std::string& script)
+{
+    // Sorted by the tokens, so the same messages give the same file
+    std::vector<std::unordered_map<std::string, std::vector<uint32_t>>::iterator> entries;
+    entries.reserve(m_postings.size());
+    for (std::unordered_map<std::string, std::vector<uint32_t>>::iterator it = m_postings.begin(); it != m_postings.end(); ++it)
+    {
+        entries.push_back(it);
+    }
+    std::sort(entries.begin(), entries.end(), [](const std::unordered_map<std::string, std::vector<uint32_t>>::iterator& a, const std::unordered_map<std::string, std::vector<uint32_t>>::iterator& b) {
+        return a->first < b->first;
+    });
+
+    script = "wechatIndexLoaded(" + std::to_string(shard) + ",{";
+    for (size_t idx = 0; idx < entries.size(); ++idx)
+    {
+        std::vector<uint32_t>& postings = entries[idx]->second;
+        std::sort(postings.begin(), postings.end());
+        postings.erase(std::unique(postings.begin(), postings.end()), postings.end());
+
+        if (idx > 0)
+        {
+            script.push_back(',');
+        }
+        appendJsonString(script, entries[idx]->first.c_str(), entries[idx]->first.size());
+        script.append(":[");
+        uint32_t previous = 0;
+        for (std::vector<uint32_t>::const_iterator it = postings.cbegin(); it != postings.cend(); ++it)
+        {
+            if (it != postings.cbegin())
+            {
+                script.push_back(',');
+            }
+            script.append(std::to_string(*it - previous));
+            previous = *it;
+        }
+        script.push_back(']');
+    }
+    script.append("});\n");
+    m_postings.clear();
+}
+
+void SearchIndexBuilder::extractText(const char* message, size_t length, std::string& text)
+{
+    text.clear();
+    const char* end = message + length;
+    const char* p = message;
+    while (p < end)
+    {
+        const char* tag = std::search(p, end, "<span", "<span" + 5);
+        const char* tagEnd = std::find(tag, end, '>');
+        if (tagEnd == end)
+        {
+            break;
+        }
+        p = tagEnd + 1;
+        if (!containsString(tag, tagEnd, "dspname") && !containsString(tag, tagEnd, "msg-text"))
+        {
+            continue;
+        }
+
+        if (!text.empty())
+        {
+            text.push_back(' ');
+        }
+        // Content to the matching </span>, tags inside are stripped
+        int depth = 1;
+        while (p < end && depth > 0)
+        {
+            if (*p == '<')
+            {
+                const char* close = std::find(p, end, '>');
+                if (startsWith(p, close, "</span"))
+                {
+                    --depth;
+                }
+                else if (startsWith(p, close, "<span"))
+                {
+                    ++depth;
+                }
+                else if (startsWith(p, close, "<br"))
+                {
+                    text.push_back(' ');
+                }
+                p = (close == end) ? end : (close + 1);
+            }
+            else if (*p == '&')
+            {
+                p = decodeHtmlEntity(p, end, text);
+            }
+            else
+            {
+                text.push_back(*p++);
+            }
+        }
+    }
+}
+
+void SearchIndexBuilder::tokenize(const std::string& text, std::vector<std::string>& tokens)
+{
+    std::string word;
+    std::vector<size_t> cjkChars;   // Begins of the characters of the CJK run, and its end
+    size_t pos = 0;
+    while (true)
+    {
+        size_t begin = pos;
+        uint32_t ch = (pos < text.size()) ? nextCodePoint(text, pos) : 0;
+        bool wordChar = ch < 0x80 && ((ch >= '0' && ch <= '9') || (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z'));
+        bool cjkChar = !wordChar && isCjk(ch);
+
+        if (!wordChar && !word.empty())
+        {
+            tokens.push_back(word.substr(0, SEARCH_INDEX_MAX_WORD_LENGTH));
+            word.clear();
+        }
+        if (!cjkChar && !cjkChars.empty())
+        {
+            cjkChars.push_back(begin);
+            for (size_t idx = 0; idx + 2 < cjkChars.size(); ++idx)
+            {
+                tokens.push_back(text.substr(cjkChars[idx], cjkChars[idx + 2] - cjkChars[idx]));
+            }
+            // Every character begins a token
+            tokens.push_back(text.substr(cjkChars[cjkChars.size() - 2], begin - cjkChars[cjkChars.size() - 2]));
+            cjkChars.clear();
+        }
+
+        if (wordChar)
+        {
+            word.push_back((ch >= 'A' && ch <= 'Z') ? static_cast<char>(ch - 'A' + 'a') : static_cast<char>(ch));
+        }
+        else if (cjkChar)
+        {
+            cjkChars.push_back(begin);
+        }
+        if (begin >= text.size())
+        {
+            break;
+        }
+    }
+}
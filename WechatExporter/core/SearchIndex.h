@@ -0,0 +1,58 @@
+//
+//  SearchIndex.h
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#ifndef SearchIndex_h
+#define SearchIndex_h
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+
+// Pages of scripts in a shard of the index (Data/idx-N.js), the pages are in the order of the messages,
+// so a shard covers a range of time
+#define SEARCH_INDEX_PAGES_PER_SHARD    8
+// Longer words are indexed by their beginning
+#define SEARCH_INDEX_MAX_WORD_LENGTH    64
+
+// Inverted index of the pages of scripts of a session, for the filter of the html page to load only the pages with
+// the keyword. The text is the one searched by the filter: the names and the texts of the messages.
+// Tokens are lowercase ASCII words and the bigrams of CJK runs, the last character of a run on its own,
+// so a keyword in a run is found by its bigrams or as the beginning of a token.
+// Other characters split the words, a keyword with them is searched without the index.
+// A posting is the message at page * pageSize + offset, pages from 0 and offsets in the array of the page
+class SearchIndexBuilder
+{
+public:
+    explicit SearchIndexBuilder(size_t pageSize);
+
+    void addMessage(size_t page, size_t offset, const char* message, size_t length);
+    bool isEmpty() const
+    {
+        return m_postings.empty();
+    }
+    // The shard as a script calling wechatIndexLoaded(shard, postings), shards from 1.
+    // The postings are sorted, delta-encoded and cleared for the next shard
+    void build(size_t shard, std::string& script);
+
+    // Text inside the spans of the names and the texts of a rendered message, tags stripped and entities decoded
+    static void extractText(const char* message, size_t length, std::string& text);
+    static void tokenize(const std::string& text, std::vector<std::string>& tokens);
+
+private:
+    SearchIndexBuilder(const SearchIndexBuilder&);
+    SearchIndexBuilder& operator=(const SearchIndexBuilder&);
+
+    size_t m_pageSize;
+    std::unordered_map<std::string, std::vector<uint32_t>> m_postings;
+    // Buffers reused by the messages
+    std::string m_text;
+    std::vector<std::string> m_tokens;
+};
+
+#endif /* SearchIndex_h */
@@ -0,0 +1,530 @@
+//
+//  SessionWriter.cpp
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/6.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#include "SessionWriter.h"
+#include <cstring>
+#include <algorithm>
+#include "Utils.h"
+
+// createTime in the msgtime attribute of the outer div of a rendered message, 0 if there is none
+static uint32_t getMessageTime(const char* message, size_t length)
+{
+    static const char ATTRIBUTE[] = " msgtime=\"";
+    const char* end = message + length;
+    const char* p = std::search(message, end, ATTRIBUTE, ATTRIBUTE + sizeof(ATTRIBUTE) - 1);
+    uint32_t time = 0;
+    for (p = (p == end) ? end : (p + sizeof(ATTRIBUTE) - 1); p < end && *p >= '0' && *p <= '9'; ++p)
+    {
+        time = time * 10 + static_cast<uint32_t>(*p - '0');
+    }
+    return time;
+}
+
+SessionWriter::SessionWriter(const std::string& scriptsTemplate, size_t pageSize, bool singlePage, bool descending) : m_pageSize(pageSize == 0 ? 1 : pageSize), m_pageBytes(0), m_singlePage(singlePage), m_descending(descending), m_indexing(false), m_compressing(false), m_writeQueue(NULL), m_writeGroup(NULL), m_numberOfNewMessages(0), m_htmlBegin(0), m_htmlEnd(0)
+{
+    std::string::size_type pos = scriptsTemplate.find("%%JSON_DATA%%");
+    if (pos == std::string::npos)
+    {
+        m_scriptsHeader = scriptsTemplate;
+    }
+    else
+    {
+        m_scriptsHeader = scriptsTemplate.substr(0, pos);
+        m_scriptsFooter = scriptsTemplate.substr(pos + 13);
+    }
+}
+
+SessionWriter::~SessionWriter()
+{
+    m_rawMessages.discard();
+    m_messages.close();
+}
+
+bool SessionWriter::openRawMessages(const std::string& fileName, bool appending)
+{
+    // The previous file may be still read by addRawMessages, it is replaced or appended in closeRawMessages
+    m_rawMessagesFileName = fileName;
+    m_numberOfNewMessages = 0;
+    return m_rawMessages.open(fileName, appending);
+}
+
+void SessionWriter::setDataPath(const std::string& dataPath)
+{
+    m_dataPath = dataPath;
+}
+
+void SessionWriter::setWriteQueue(WriteQueue* writeQueue, WriteQueue::Group* writeGroup)
+{
+    m_writeQueue = writeQueue;
+    m_writeGroup = writeGroup;
+}
+
+void SessionWriter::setSearchIndex(bool indexing)
+{
+    m_indexing = indexing;
+}
+
+void SessionWriter::setCompression(bool compressing)
+{
+    m_compressing = compressing;
+}
+
+void SessionWriter::setPageBytes(size_t pageBytes)
+{
+    m_pageBytes = pageBytes;
+}
+
+void SessionWriter::addMessage(const char* message, size_t length)
+{
+    if (m_rawMessages.isOpen())
+    {
+        m_rawMessages.add(message, length);
+    }
+    ++m_numberOfNewMessages;
+}
+
+bool SessionWriter::addRawMessages(const std::string& fileName)
+{
+    if (m_rawMessages.isAppending())
+    {
+        // The segments stay where they are
+        return true;
+    }
+
+    // Files of both versions are read in place
+    MessageStoreReader reader;
+    if (!reader.open(fileName))
+    {
+        return false;
+    }
+
+    const char* message = NULL;
+    size_t length = 0;
+    size_t numberOfSegments = reader.getNumberOfSegments();
+    for (size_t idx = 0; idx < numberOfSegments; ++idx)
+    {
+        // Descending, the newest segment goes first
+        size_t segment = m_descending ? (numberOfSegments - 1 - idx) : idx;
+        for (size_t msgIdx = 0; msgIdx < reader.getNumberOfMessages(segment); ++msgIdx)
+        {
+            if (!reader.getMessage(segment, msgIdx, message, length))
+            {
+                break;
+            }
+            m_rawMessages.add(message, length);
+        }
+    }
+
+    return true;
+}
+
+bool SessionWriter::checkpoint()
+{
+    if (!m_rawMessages.close() || !m_rawMessages.open(m_rawMessagesFileName, true))
+    {
+        return false;
+    }
+    if (m_rawMessages.isAppending())
+    {
+        // The next messages go to a new segment after the saved ones
+        return true;
+    }
+    // The file has too many segments (or is of version 1), it is rewritten as one segment
+    // from the saved messages, which replaces it at the next close
+    return addRawMessages(m_rawMessagesFileName);
+}
+
+bool SessionWriter::closeRawMessages()
+{
+    return m_rawMessages.close();
+}
+
+bool SessionWriter::writePages(const SessionPages& previousPages)
+{
+    m_pages = SessionPages();
+    m_pages.pageSize = m_pageSize;
+    m_pages.pageBytes = m_pageBytes;
+    m_pages.descending = m_descending;
+    m_htmlBegin = 0;
+    m_htmlEnd = 0;
+    m_segmentEnds.clear();
+    m_changedPages.clear();
+    m_pageRanges.clear();
+    if (!m_messages.open(m_rawMessagesFileName))
+    {
+        return false;
+    }
+
+    size_t numberOfSegments = m_messages.getNumberOfSegments();
+    size_t numberOfMessages = 0;
+    for (size_t idx = 0; idx < numberOfSegments; ++idx)
+    {
+        numberOfMessages += m_messages.getNumberOfMessages(m_descending ? (numberOfSegments - 1 - idx) : idx);
+        m_segmentEnds.push_back(numberOfMessages);
+    }
+    m_pages.numberOfMessages = numberOfMessages;
+
+    if (m_singlePage)
+    {
+        m_htmlEnd = numberOfMessages;
+        return true;
+    }
+
+    buildPageLayout(numberOfMessages);
+    size_t numberOfPreviousMessages = numberOfMessages > m_numberOfNewMessages ? (numberOfMessages - m_numberOfNewMessages) : 0;
+    size_t numberOfReusablePages = getNumberOfReusablePages(previousPages, numberOfPreviousMessages);
+
+    size_t numberOfPages = m_pageRanges.size();
+    bool succeeded = true;
+    for (size_t page = 0; page < numberOfPages; ++page)
+    {
+        if (page < numberOfReusablePages)
+        {
+            m_pages.pages.push_back(previousPages.pages[page]);
+            m_changedPages.push_back(false);
+            continue;
+        }
+        size_t begin = 0;
+        size_t end = 0;
+        getPageRange(page, begin, end);
+        succeeded = writePage(page, begin, end, previousPages) && succeeded;
+    }
+
+    if (m_indexing)
+    {
+        succeeded = writeSearchIndex(previousPages) && succeeded;
+    }
+    return succeeded;
+}
+
+bool SessionWriter::writeHtml(const std::string& fileName, const std::string& header, const std::string& footer)
+{
+    bool result = writeHtml(fileName, header, footer, m_htmlBegin, m_htmlEnd);
+    m_messages.close();
+    return result;
+}
+
+size_t SessionWriter::writeHtmlParts(const std::function<std::string(size_t)>& getPartFileName, size_t messagesPerPart, const std::string& header, const std::string& footer)
+{
+    if (messagesPerPart == 0 || m_htmlEnd - m_htmlBegin <= messagesPerPart)
+    {
+        return 0;
+    }
+    size_t numberOfParts = 0;
+    for (size_t begin = m_htmlBegin; begin < m_htmlEnd; begin += messagesPerPart)
+    {
+        size_t end = std::min(begin + messagesPerPart, m_htmlEnd);
+        ++numberOfParts;
+        if (!writeHtml(getPartFileName(numberOfParts), header, footer, begin, end))
+        {
+            return 0;
+        }
+    }
+    return numberOfParts;
+}
+
+bool SessionWriter::writeHtml(const std::string& fileName, const std::string& header, const std::string& footer, size_t begin, size_t end)
+{
+    const char* message = NULL;
+    size_t length = 0;
+    if (NULL != m_writeQueue)
+    {
+        // Handed over in parts, so a big single page doesn't stay in memory as a whole
+        const size_t partSize = 4 * 1024 * 1024;
+        bool appending = false;
+        std::string part(header);
+        for (size_t idx = begin; idx < end; ++idx)
+        {
+            if (getMessage(idx, message, length))
+            {
+                part.append(message, length);
+            }
+            if (part.size() >= partSize)
+            {
+                m_writeQueue->write(fileName, part, appending, m_writeGroup);
+                appending = true;
+                part.clear();
+            }
+        }
+        part.append(footer);
+        m_writeQueue->write(fileName, part, appending, m_writeGroup);
+        return true;
+    }
+
+    FileWriter writer;
+    if (!writer.open(fileName))
+    {
+        return false;
+    }
+
+    writer.write(header);
+    for (size_t idx = begin; idx < end; ++idx)
+    {
+        if (getMessage(idx, message, length))
+        {
+            writer.write(message, length);
+        }
+    }
+    writer.write(footer);
+    return writer.close();
+}
+
+// Pages of the previous exporting with the same messages, which are still there
+size_t SessionWriter::getNumberOfReusablePages(const SessionPages& previousPages, size_t numberOfPreviousMessages) const
+{
+    if (previousPages.pageSize != m_pageSize || previousPages.pageBytes != m_pageBytes || previousPages.descending != m_descending || previousPages.numberOfMessages != numberOfPreviousMessages)
+    {
+        return 0;
+    }
+
+    size_t numberOfPagedMessages = 0;
+    for (std::vector<SessionPages::Page>::const_iterator it = previousPages.pages.cbegin(); it != previousPages.pages.cend(); ++it)
+    {
+        numberOfPagedMessages += it->numberOfMessages;
+    }
+    if (numberOfPagedMessages > numberOfPreviousMessages)
+    {
+        return 0;
+    }
+
+    // Previous pages in the order of outputs now, descending the new messages are before them.
+    // A page with the same messages as the previous one is the same file
+    size_t numberOfPages = std::min(previousPages.pages.size(), m_pageRanges.size());
+    size_t begin = m_descending ? m_pages.numberOfMessages : (numberOfPreviousMessages - numberOfPagedMessages);
+    for (size_t page = 0; page < numberOfPages; ++page)
+    {
+        size_t numberOfPageMessages = previousPages.pages[page].numberOfMessages;
+        if (m_descending)
+        {
+            begin -= numberOfPageMessages;
+        }
+        uint64_t size = 0;
+        std::time_t modifiedTime = 0;
+        if (m_pageRanges[page].first != begin || m_pageRanges[page].second != begin + numberOfPageMessages || !getFileInfo(getPageFileName(page), size, modifiedTime) || size != previousPages.pages[page].size)
+        {
+            return page;
+        }
+        if (!m_descending)
+        {
+            begin += numberOfPageMessages;
+        }
+    }
+    return numberOfPages;
+}
+
+void SessionWriter::buildPageLayout(size_t numberOfMessages)
+{
+    // Ends of the pages from the first message of the order of the pages, the last one may be open
+    std::vector<size_t> pageEnds;
+    size_t numberOfPageMessages = 0;
+    size_t numberOfPageBytes = 0;
+    const char* message = NULL;
+    size_t length = 0;
+    for (size_t idx = 0; idx < numberOfMessages; ++idx)
+    {
+        ++numberOfPageMessages;
+        if (m_pageBytes > 0 && getMessage(m_descending ? (numberOfMessages - 1 - idx) : idx, message, length))
+        {
+            numberOfPageBytes += length;
+        }
+        if (numberOfPageMessages >= m_pageSize || (m_pageBytes > 0 && numberOfPageBytes >= m_pageBytes))
+        {
+            pageEnds.push_back(idx + 1);
+            numberOfPageMessages = 0;
+            numberOfPageBytes = 0;
+        }
+    }
+    size_t numberOfClosedPages = pageEnds.size();
+    if (numberOfPageMessages > 0)
+    {
+        pageEnds.push_back(numberOfMessages);
+    }
+
+    if (!m_descending)
+    {
+        // The first page is the html page
+        m_htmlEnd = pageEnds.empty() ? 0 : pageEnds[0];
+        for (size_t page = 1; page < pageEnds.size(); ++page)
+        {
+            m_pageRanges.push_back(std::make_pair(pageEnds[page - 1], pageEnds[page]));
+        }
+        return;
+    }
+
+    // Only closed pages, the newest one and the rest are in the html page
+    size_t numberOfPages = numberOfClosedPages > 0 ? (numberOfClosedPages - 1) : 0;
+    for (size_t page = 0; page < numberOfPages; ++page)
+    {
+        size_t begin = (page == 0) ? 0 : pageEnds[page - 1];
+        m_pageRanges.push_back(std::make_pair(numberOfMessages - pageEnds[page], numberOfMessages - begin));
+    }
+    m_htmlEnd = numberOfMessages - (numberOfPages > 0 ? pageEnds[numberOfPages - 1] : 0);
+}
+
+void SessionWriter::getPageRange(size_t page, size_t& begin, size_t& end) const
+{
+    begin = m_pageRanges[page].first;
+    end = m_pageRanges[page].second;
+}
+
+bool SessionWriter::writePage(size_t page, size_t begin, size_t end, const SessionPages& previousPages)
+{
+    // Same output as Json::StreamWriterBuilder without indentation, emitUTF8 is only for debugging
+    m_page.clear();
+    if (!m_compressing)
+    {
+        m_page.append(m_scriptsHeader);
+    }
+    const char* message = NULL;
+    size_t length = 0;
+    uint32_t beginTime = 0;
+    uint32_t endTime = 0;
+    for (size_t idx = begin; idx < end; ++idx)
+    {
+        if (!getMessage(idx, message, length))
+        {
+            continue;
+        }
+        uint32_t time = getMessageTime(message, length);
+        if (time > 0)
+        {
+            beginTime = (beginTime == 0) ? time : std::min(beginTime, time);
+            endTime = std::max(endTime, time);
+        }
+        m_page.push_back(idx == begin ? '[' : ',');
+#ifndef NDEBUG
+        appendJsonString(m_page, message, length, false);
+#else
+        appendJsonString(m_page, message, length);
+#endif
+    }
+    m_page.push_back(']');
+    if (m_compressing)
+    {
+        compressPage(page);
+    }
+    else
+    {
+        m_page.append(m_scriptsFooter);
+    }
+
+    SessionPages::Page pageInfo;
+    pageInfo.size = m_page.size();
+    pageInfo.hash = md5(m_page);
+    pageInfo.numberOfMessages = end - begin;
+    pageInfo.beginTime = beginTime;
+    pageInfo.endTime = endTime;
+    m_pages.pages.push_back(pageInfo);
+
+    std::string fileName = getPageFileName(page);
+    if (page < previousPages.pages.size() && previousPages.pages[page].hash == pageInfo.hash && getFileSize(fileName) == m_page.size())
+    {
+        // Nothing changed
+        m_changedPages.push_back(false);
+        return true;
+    }
+    m_changedPages.push_back(true);
+
+    if (page == 0)
+    {
+        makeDirectory(m_dataPath);
+    }
+    return writeScript(fileName, m_page);
+}
+
+void SessionWriter::compressPage(size_t page)
+{
+    if (!compressZlib(m_page.c_str(), m_page.size(), m_compressed))
+    {
+        m_page.insert(0, m_scriptsHeader);
+        m_page.append(m_scriptsFooter);
+        return;
+    }
+    m_page.assign("wechatPageLoaded(" + std::to_string(page + 1) + ",\"");
+    appendBase64(m_page, reinterpret_cast<const unsigned char *>(m_compressed.c_str()), m_compressed.size());
+    m_page.append("\");\n");
+}
+
+bool SessionWriter::writeSearchIndex(const SessionPages& previousPages)
+{
+    size_t numberOfPages = m_pages.pages.size();
+    m_pages.numberOfIndexShards = (numberOfPages + SEARCH_INDEX_PAGES_PER_SHARD - 1) / SEARCH_INDEX_PAGES_PER_SHARD;
+
+    SearchIndexBuilder builder(m_pageSize);
+    const char* message = NULL;
+    size_t length = 0;
+    bool succeeded = true;
+    for (size_t shard = 0; shard < m_pages.numberOfIndexShards; ++shard)
+    {
+        size_t firstPage = shard * SEARCH_INDEX_PAGES_PER_SHARD;
+        size_t lastPage = std::min(numberOfPages, firstPage + SEARCH_INDEX_PAGES_PER_SHARD);
+        std::string fileName = getIndexFileName(shard);
+        // Kept if the previous exporting wrote it for the same pages
+        if (shard < previousPages.numberOfIndexShards && std::find(m_changedPages.begin() + firstPage, m_changedPages.begin() + lastPage, true) == m_changedPages.begin() + lastPage && existsFile(fileName))
+        {
+            continue;
+        }
+
+        for (size_t page = firstPage; page < lastPage; ++page)
+        {
+            size_t begin = 0;
+            size_t end = 0;
+            getPageRange(page, begin, end);
+            for (size_t idx = begin; idx < end; ++idx)
+            {
+                if (getMessage(idx, message, length))
+                {
+                    builder.addMessage(page, idx - begin, message, length);
+                }
+            }
+        }
+        // The buffer of the pages is reused
+        builder.build(shard + 1, m_page);
+        succeeded = writeScript(fileName, m_page) && succeeded;
+    }
+    return succeeded;
+}
+
+bool SessionWriter::writeScript(const std::string& fileName, std::string& script)
+{
+    if (NULL != m_writeQueue)
+    {
+        m_writeQueue->write(fileName, script, false, m_writeGroup);
+        return true;
+    }
+    FileWriter writer;
+    if (!writer.open(fileName))
+    {
+        return false;
+    }
+    writer.write(script);
+    return writer.close();
+}
+
+bool SessionWriter::getMessage(size_t index, const char*& message, size_t& length) const
+{
+    std::vector<size_t>::const_iterator it = std::upper_bound(m_segmentEnds.cbegin(), m_segmentEnds.cend(), index);
+    if (it == m_segmentEnds.cend())
+    {
+        return false;
+    }
+    size_t idx = std::distance(m_segmentEnds.cbegin(), it);
+    size_t segment = m_descending ? (m_segmentEnds.size() - 1 - idx) : idx;
+    size_t begin = (idx == 0) ? 0 : m_segmentEnds[idx - 1];
+    return m_messages.getMessage(segment, index - begin, message, length);
+}
+
+std::string SessionWriter::getPageFileName(size_t page) const
+{
+    return combinePath(m_dataPath, "msg-" + std::to_string(page + 1) + ".js");
+}
+
+std::string SessionWriter::getIndexFileName(size_t shard) const
+{
+    return combinePath(m_dataPath, "idx-" + std::to_string(shard + 1) + ".js");
+}
@@ -0,0 +1,172 @@
+//
+//  SessionWriter.h
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/6.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#ifndef SessionWriter_h
+#define SessionWriter_h
+
+#include <string>
+#include <vector>
+#include <functional>
+#include "FileSystem.h"
+#include "MessageStore.h"
+#include "WriteQueue.h"
+#include "SearchIndex.h"
+
+// Layout of the pages of scripts (Data/msg-N.js) of a session, kept in the export context
+// so the incremental exporting only writes the pages changed by the new messages
+struct SessionPages
+{
+    struct Page
+    {
+        uint64_t size;
+        std::string hash;   // md5 of the file
+        size_t numberOfMessages;
+        // Range of createTime of the messages, for jumping to a date. 0 for the messages rendered without msgtime
+        uint32_t beginTime;
+        uint32_t endTime;
+    };
+
+    size_t pageSize;
+    size_t pageBytes;
+    bool descending;
+    size_t numberOfMessages;    // Messages in the html page and the pages of scripts
+    std::vector<Page> pages;
+    size_t numberOfIndexShards; // Shards of the search index (Data/idx-N.js) written with the pages, 0 without it
+
+    SessionPages() : pageSize(0), pageBytes(0), descending(false), numberOfMessages(0), numberOfIndexShards(0)
+    {
+    }
+};
+
+// Writes the outputs of a session from its messages:
+// the raw messages file (.dat), the html page and the pages of scripts for the asynchronous loading.
+// Rendered messages only go to the raw messages file, the pages are built from it once it is closed,
+// so only the messages of one page are kept in memory.
+//
+// A page is up to pageSize messages, with a byte budget it is closed once its messages reach the budget,
+// so the pages are of about the same size. They are grouped from the first message of the order of the pages,
+// a page never changes once it is closed.
+// Ascending, the html page has the first page and msg-N.js the next ones.
+// New messages only change the last page.
+// Descending, the pages are counted from the oldest message: msg-1.js has the oldest page,
+// the html page the newest closed page and the newer messages after it, and the pages are loaded from the last one.
+// New messages only change the html page and add pages, and the existing ones are kept.
+// With the search index, its shards are written for the pages of scripts, only the ones with changed pages again.
+// Compressed, a page of scripts calls wechatPageLoaded(page, data) of the html page instead of the template of scripts,
+// data is the base64 of the zlib stream of the JSON array of the messages, which is inflated once the page is loaded.
+// The range of time of a page is taken from the msgtime attributes of its messages.
+class SessionWriter
+{
+public:
+    // singlePage: all messages go to the html page
+    SessionWriter(const std::string& scriptsTemplate, size_t pageSize, bool singlePage, bool descending);
+    ~SessionWriter();
+
+    // appending: the new messages are appended to the previous raw messages file as a segment
+    bool openRawMessages(const std::string& fileName, bool appending);
+    void setDataPath(const std::string& dataPath);
+    // The html page and the pages of scripts are handed to the queue, failures are reported through group
+    void setWriteQueue(WriteQueue* writeQueue, WriteQueue::Group* writeGroup);
+    // The search index goes with the pages of scripts for the filter of the html page
+    void setSearchIndex(bool indexing);
+    void setCompression(bool compressing);
+    // Byte budget of a page, of the rendered messages, 0 (default) for pageSize messages each
+    void setPageBytes(size_t pageBytes);
+
+    void addMessage(const char* message, size_t length);
+    void addMessage(const std::string& message)
+    {
+        addMessage(message.c_str(), message.size());
+    }
+    // Messages of the previous exporting, they are only copied when the raw messages file is rewritten
+    bool addRawMessages(const std::string& fileName);
+
+    // The messages added so far are saved to the raw messages file, the next ones go to a new segment.
+    // Only for the ascending order, a session resumed from a checkpoint continues after its last message.
+    // Once the file has too many segments, the saved messages are copied and it is compacted into one segment
+    bool checkpoint();
+    bool closeRawMessages();
+    // Writes the pages of scripts from the closed raw messages file,
+    // the pages of previousPages still matching the files are kept
+    bool writePages(const SessionPages& previousPages);
+    // Writes the html page, header of which is built with the numbers of the pages
+    bool writeHtml(const std::string& fileName, const std::string& header, const std::string& footer);
+    // The messages of the html page are split into pages of up to messagesPerPart messages, for printing big sessions in parts.
+    // Parts are numbered from 1. To be called before writeHtml, 0 if the html page isn't bigger than that
+    size_t writeHtmlParts(const std::function<std::string(size_t)>& getPartFileName, size_t messagesPerPart, const std::string& header, const std::string& footer);
+
+    // Messages in the pages of scripts
+    size_t getNumberOfPagedMessages() const
+    {
+        return m_pages.numberOfMessages - (m_htmlEnd - m_htmlBegin);
+    }
+    size_t getNumberOfPages() const
+    {
+        return m_pages.pages.size();
+    }
+    // Pages written or kept by writePages
+    const SessionPages& getPages() const
+    {
+        return m_pages;
+    }
+    // Bytes of the buffers, for the memory accounting
+    size_t getMemoryUsage() const
+    {
+        return m_rawMessages.getMemoryUsage() + m_page.capacity() + m_compressed.capacity() + m_segmentEnds.capacity() * sizeof(size_t) + m_pageRanges.capacity() * sizeof(std::pair<size_t, size_t>);
+    }
+
+private:
+    SessionWriter(const SessionWriter&);
+    SessionWriter& operator=(const SessionWriter&);
+
+    size_t getNumberOfReusablePages(const SessionPages& previousPages, size_t numberOfPreviousMessages) const;
+    // The html page and m_pageRanges from the sizes of the messages
+    void buildPageLayout(size_t numberOfMessages);
+    // Messages of the page in the order of outputs
+    void getPageRange(size_t page, size_t& begin, size_t& end) const;
+    bool writePage(size_t page, size_t begin, size_t end, const SessionPages& previousPages);
+    // The JSON array in m_page to the compressed script, it is left as the template of scripts if it can't be compressed
+    void compressPage(size_t page);
+    bool writeSearchIndex(const SessionPages& previousPages);
+    bool writeScript(const std::string& fileName, std::string& script);
+    bool writeHtml(const std::string& fileName, const std::string& header, const std::string& footer, size_t begin, size_t end);
+    // Messages in the order of outputs
+    bool getMessage(size_t index, const char*& message, size_t& length) const;
+    std::string getPageFileName(size_t page) const;
+    std::string getIndexFileName(size_t shard) const;
+
+    // Parts of the template of scripts around %%JSON_DATA%%
+    std::string m_scriptsHeader;
+    std::string m_scriptsFooter;
+    size_t m_pageSize;
+    size_t m_pageBytes;
+    bool m_singlePage;
+    bool m_descending;
+    bool m_indexing;
+    bool m_compressing;
+    std::string m_dataPath;
+    WriteQueue* m_writeQueue;
+    WriteQueue::Group* m_writeGroup;
+
+    std::string m_rawMessagesFileName;
+    MessageStoreWriter m_rawMessages;
+    size_t m_numberOfNewMessages;
+
+    // The raw messages file read back by writePages and writeHtml
+    MessageStoreReader m_messages;
+    std::vector<size_t> m_segmentEnds;  // Ends of the segments in the order of outputs
+    SessionPages m_pages;
+    std::vector<bool> m_changedPages;   // Pages written by writePages, the others are the same as the previous ones
+    std::vector<std::pair<size_t, size_t>> m_pageRanges;    // Messages of the pages of scripts in the order of outputs
+    size_t m_htmlBegin;
+    size_t m_htmlEnd;
+    std::string m_page;
+    std::string m_compressed;
+};
+
+#endif /* SessionWriter_h */
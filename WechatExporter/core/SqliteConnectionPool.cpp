@@ -0,0 +1,136 @@
+//
+//  SqliteConnectionPool.cpp
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/2.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#include "SqliteConnectionPool.h"
+#include <sqlite3.h>
+#include "Utils.h"
+
+SqliteConnectionPool::SqliteConnectionPool(size_t maxIdleStatements/* = 8*/) : m_maxIdleStatements(maxIdleStatements)
+{
+}
+
+SqliteConnectionPool::~SqliteConnectionPool()
+{
+    close();
+}
+
+sqlite3_stmt* SqliteConnectionPool::acquireStatement(const std::string& dbPath, const std::string& sql)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    Connection* connection = NULL;
+    std::list<Connection *>& connections = m_connections[dbPath];
+    for (std::list<Connection *>::iterator it = connections.begin(); it != connections.end(); ++it)
+    {
+        if ((*it)->busy)
+        {
+            continue;
+        }
+        sqlite3_stmt* stmt = takeIdleStatement(*it, sql);
+        if (NULL != stmt)
+        {
+            (*it)->busy = true;
+            return stmt;
+        }
+        if (NULL == connection)
+        {
+            connection = *it;
+        }
+    }
+    
+    if (NULL == connection)
+    {
+        sqlite3 *db = NULL;
+        // Connections of the pool serve the message enumerators
+        int rc = openSqlite3ReadOnly(dbPath, &db, true);
+        if (rc != SQLITE_OK)
+        {
+            sqlite3_close(db);
+            return NULL;
+        }
+
+        connection = new Connection();
+        connection->db = db;
+        connection->busy = false;
+        connections.push_back(connection);
+        m_dbs[db] = connection;
+    }
+
+    sqlite3_stmt* stmt = NULL;
+    int rc = sqlite3_prepare_v2(connection->db, sql.c_str(), (int)(sql.size()), &stmt, NULL);
+    if (rc != SQLITE_OK)
+    {
+        return NULL;
+    }
+
+    connection->busy = true;
+    return stmt;
+}
+
+sqlite3_stmt* SqliteConnectionPool::takeIdleStatement(Connection* connection, const std::string& sql)
+{
+    for (std::list<std::pair<std::string, sqlite3_stmt *>>::iterator itStmt = connection->idleStatements.begin(); itStmt != connection->idleStatements.end(); ++itStmt)
+    {
+        if (itStmt->first == sql)
+        {
+            sqlite3_stmt* stmt = itStmt->second;
+            connection->idleStatements.erase(itStmt);
+            return stmt;
+        }
+    }
+    return NULL;
+}
+
+void SqliteConnectionPool::releaseStatement(sqlite3_stmt* stmt)
+{
+    if (NULL == stmt)
+    {
+        return;
+    }
+
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::map<sqlite3 *, Connection *>::iterator it = m_dbs.find(sqlite3_db_handle(stmt));
+    if (it == m_dbs.end())
+    {
+        sqlite3_finalize(stmt);
+        return;
+    }
+
+    Connection* connection = it->second;
+    connection->busy = false;
+    connection->idleStatements.push_front(std::make_pair(std::string(sqlite3_sql(stmt)), stmt));
+    while (connection->idleStatements.size() > m_maxIdleStatements)
+    {
+        sqlite3_finalize(connection->idleStatements.back().second);
+        connection->idleStatements.pop_back();
+    }
+}
+
+void SqliteConnectionPool::close()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (std::map<std::string, std::list<Connection *>>::iterator it = m_connections.begin(); it != m_connections.end(); ++it)
+    {
+        for (std::list<Connection *>::iterator itConn = it->second.begin(); itConn != it->second.end(); ++itConn)
+        {
+            Connection* connection = *itConn;
+            for (std::list<std::pair<std::string, sqlite3_stmt *>>::iterator itStmt = connection->idleStatements.begin(); itStmt != connection->idleStatements.end(); ++itStmt)
+            {
+                sqlite3_finalize(itStmt->second);
+            }
+            // Statements still in use are finalized by sqlite3_close_v2 after they are done
+            sqlite3_close_v2(connection->db);
+            delete connection;
+        }
+    }
+    m_connections.clear();
+    m_dbs.clear();
+}
@@ -0,0 +1,53 @@
+//
+//  SqliteConnectionPool.h
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/2.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#ifndef SqliteConnectionPool_h
+#define SqliteConnectionPool_h
+
+#include <string>
+#include <map>
+#include <list>
+#include <mutex>
+
+struct sqlite3;
+struct sqlite3_stmt;
+
+// Read-only connections shared by path for the whole export, with a small LRU of idle prepared statements per connection
+// A statement is owned by one caller between acquireStatement and releaseStatement
+// A connection serves one statement at a time, concurrent callers on the same path get connections of their own
+class SqliteConnectionPool
+{
+public:
+    SqliteConnectionPool(size_t maxIdleStatements = 8);
+    ~SqliteConnectionPool();
+
+    sqlite3_stmt* acquireStatement(const std::string& dbPath, const std::string& sql);
+    void releaseStatement(sqlite3_stmt* stmt);
+
+    void close();
+
+private:
+    struct Connection
+    {
+        sqlite3* db;
+        bool busy;
+        std::list<std::pair<std::string, sqlite3_stmt *>> idleStatements;    // Most recently used first
+    };
+    
+    static sqlite3_stmt* takeIdleStatement(Connection* connection, const std::string& sql);
+
+    SqliteConnectionPool(const SqliteConnectionPool&);
+    SqliteConnectionPool& operator=(const SqliteConnectionPool&);
+
+    std::mutex m_mutex;
+    size_t m_maxIdleStatements;
+    std::map<std::string, std::list<Connection *>> m_connections;
+    std::map<sqlite3 *, Connection *> m_dbs;
+};
+
+#endif /* SqliteConnectionPool_h */
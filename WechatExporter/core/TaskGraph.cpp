@@ -0,0 +1,109 @@
+//
+//  TaskGraph.cpp
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#include "TaskGraph.h"
+#include <thread>
+#include <algorithm>
+#include "Utils.h"
+
+TaskGraph::TaskGraph(unsigned int numberOfThreads/* = 0*/) : m_numberOfThreads(numberOfThreads), m_runningTasks(0)
+{
+    if (0 == m_numberOfThreads)
+    {
+        m_numberOfThreads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+}
+
+TaskGraph::TaskId TaskGraph::add(const std::function<void()>& task)
+{
+    return add(task, std::vector<TaskId>());
+}
+
+TaskGraph::TaskId TaskGraph::add(const std::function<void()>& task, const std::vector<TaskId>& dependencies)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    TaskId taskId = m_nodes.size();
+    m_nodes.push_back(Node());
+    Node& node = m_nodes.back();
+    node.task = task;
+    node.numberOfDependencies = 0;
+    node.done = false;
+    for (std::vector<TaskId>::const_iterator it = dependencies.cbegin(); it != dependencies.cend(); ++it)
+    {
+        Node& dependency = m_nodes[*it];
+        if (!dependency.done)
+        {
+            dependency.dependents.push_back(taskId);
+            ++m_nodes[taskId].numberOfDependencies;
+        }
+    }
+    if (0 == m_nodes[taskId].numberOfDependencies)
+    {
+        m_readyTasks.push_back(taskId);
+        m_cv.notify_one();
+    }
+    return taskId;
+}
+
+void TaskGraph::run()
+{
+    std::vector<std::thread> threads;
+    threads.reserve(m_numberOfThreads - 1);
+    for (unsigned int idx = 1; idx < m_numberOfThreads; ++idx)
+    {
+        threads.push_back(std::thread([this]() {
+            setThreadName("taskgraph");
+            work();
+        }));
+    }
+    work();
+    for (std::vector<std::thread>::iterator it = threads.begin(); it != threads.end(); ++it)
+    {
+        it->join();
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_nodes.clear();
+}
+
+void TaskGraph::work()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true)
+    {
+        m_cv.wait(lock, [this] { return !m_readyTasks.empty() || 0 == m_runningTasks; });
+        if (m_readyTasks.empty())
+        {
+            // Nothing is running which could add or release a task
+            m_cv.notify_all();
+            break;
+        }
+        TaskId taskId = m_readyTasks.front();
+        m_readyTasks.pop_front();
+        ++m_runningTasks;
+        // m_nodes may grow while the task runs
+        std::function<void()> task;
+        task.swap(m_nodes[taskId].task);
+
+        lock.unlock();
+        task();
+        lock.lock();
+
+        --m_runningTasks;
+        Node& node = m_nodes[taskId];
+        node.done = true;
+        for (std::vector<TaskId>::const_iterator it = node.dependents.cbegin(); it != node.dependents.cend(); ++it)
+        {
+            if (--m_nodes[*it].numberOfDependencies == 0)
+            {
+                m_readyTasks.push_back(*it);
+            }
+        }
+        m_cv.notify_all();
+    }
+}
@@ -0,0 +1,57 @@
+//
+//  TaskGraph.h
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#ifndef TaskGraph_h
+#define TaskGraph_h
+
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+
+// Tasks with dependencies, run by a few threads: a task starts once the tasks it depends on are done.
+// A running task can add more tasks, e.g. the tasks of the sessions once the sessions are read,
+// run returns when there is nothing left to run
+class TaskGraph
+{
+public:
+    typedef size_t TaskId;
+
+    // numberOfThreads: 0 for the number of cores
+    explicit TaskGraph(unsigned int numberOfThreads = 0);
+
+    TaskId add(const std::function<void()>& task);
+    TaskId add(const std::function<void()>& task, const std::vector<TaskId>& dependencies);
+
+    // Runs the tasks on the threads and the caller's one, the graph is empty after it
+    void run();
+
+private:
+    TaskGraph(const TaskGraph&);
+    TaskGraph& operator=(const TaskGraph&);
+
+    struct Node
+    {
+        std::function<void()> task;
+        size_t numberOfDependencies;    // Not done yet
+        std::vector<TaskId> dependents;
+        bool done;
+    };
+
+    void work();
+
+    unsigned int m_numberOfThreads;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::vector<Node> m_nodes;
+    std::deque<TaskId> m_readyTasks;
+    size_t m_runningTasks;
+};
+
+#endif /* TaskGraph_h */
@@ -9,27 +9,33 @@
 #include "TaskManager.h"
 #include "AsyncTask.h"
 #include "FileSystem.h"
+#include "ExportMetrics.h"
+#include <cstring>
 
-TaskManager::TaskManager(Logger* logger) : m_logger(logger), m_downloadExecutor(NULL)
-#ifdef USING_ASYNC_TASK_FOR_MP3
-    , m_audioExecutor(NULL)
-#endif
+TaskManager::TaskManager(Logger* logger, unsigned int numberOfAudioThreads/* = 0*/) : m_logger(logger), m_downloadEngine(NULL), m_downloadExecutor(NULL), m_audioExecutor(NULL), m_pdfExecutor(NULL), m_downloadCache(NULL), m_transcodeCache(NULL)
+    , m_notifier(NULL), m_deferringMedia(false), m_deferredBytes(0), m_numberOfSpilledTasks(0), m_cancelled(false), m_numberOfAudioTasks(0), m_maxAudioTasks(0)
 {
-    m_downloadExecutor = new AsyncExecutor(2, 4, this);
-#ifdef USING_ASYNC_TASK_FOR_MP3
-    m_audioExecutor = new AsyncExecutor(1, 1, this);
-#endif
-    // m_audioExecutor = m_downloadExecutor;
-    
-#if !defined(NDEBUG) || defined(DBG_PERF)
-    m_downloadExecutor->setTag("dl");
-#ifdef USING_ASYNC_TASK_FOR_MP3
-    if (NULL != m_audioExecutor && m_audioExecutor != m_downloadExecutor)
+    // Transfers are driven by one I/O thread, copies of the downloaded files don't need more than one either.
+    // The transfers to each host are limited by the engine
+    m_downloadEngine = new DownloadEngine(1, 64, this);
+    m_downloadExecutor = new AsyncExecutor(1, this);
+    m_downloadExecutor->setQueueMetric(EXPORT_METRIC_QUEUED_COPIES);
+    // Transcoding takes the cores, the parsing waits for it when more than a few voices of each worker are queued
+    if (numberOfAudioThreads == 0)
     {
-        m_audioExecutor->setTag("audio");
+        numberOfAudioThreads = std::thread::hardware_concurrency();
     }
-#endif
-#endif
+    if (numberOfAudioThreads == 0)
+    {
+        numberOfAudioThreads = 2;
+    }
+    m_audioExecutor = new AsyncExecutor(static_cast<int>(numberOfAudioThreads), this);
+    m_audioExecutor->setQueueMetric(EXPORT_METRIC_QUEUED_AUDIO);
+    m_maxAudioTasks = numberOfAudioThreads * 4;
+    
+    m_downloadEngine->setTag("dl");
+    m_downloadExecutor->setTag("cp");
+    m_audioExecutor->setTag("audio");
 }
 
 TaskManager::~TaskManager()
@@ -40,27 +46,44 @@ TaskManager::~TaskManager()
 
 void TaskManager::shutdown()
 {
-#ifdef USING_ASYNC_TASK_FOR_MP3
-    if (NULL != m_audioExecutor && m_audioExecutor != m_downloadExecutor)
+    // The held tasks have to be queued before the executors run out of tasks
+    startDeferredTasks();
+    if (NULL != m_audioExecutor)
     {
         m_audioExecutor->shutdown();
     }
-#endif
-    if (NULL != m_downloadExecutor)
     {
-        m_downloadExecutor->shutdown();
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (NULL != m_pdfExecutor)
+        {
+            m_pdfExecutor->shutdown();
+        }
+    }
+    if (NULL != m_downloadEngine)
+    {
+        // The executor of copies is shut down once the downloads complete, they queue the copies
+        m_downloadEngine->shutdown();
     }
 }
 
 void TaskManager::shutdownExecutors()
 {
-#ifdef USING_ASYNC_TASK_FOR_MP3
-    if (NULL != m_audioExecutor && m_audioExecutor != m_downloadExecutor)
+    if (NULL != m_audioExecutor)
     {
         delete m_audioExecutor;
         m_audioExecutor = NULL;
     }
-#endif
+    if (NULL != m_pdfExecutor)
+    {
+        delete m_pdfExecutor;
+        m_pdfExecutor = NULL;
+    }
+    if (NULL != m_downloadEngine)
+    {
+        // The copies are queued when the downloads complete
+        delete m_downloadEngine;
+        m_downloadEngine = NULL;
+    }
     if (NULL != m_downloadExecutor)
     {
         delete m_downloadExecutor;
@@ -93,19 +116,28 @@ bool TaskManager::waitForCompltion(unsigned int ms)
     }
      */
     
+    if (!m_downloadEngine->waitForCompltion(ms))
+    {
+        return false;
+    }
+    m_downloadExecutor->shutdown();
     if (!m_downloadExecutor->waitForCompltion(ms))
     {
         return false;
     }
-#ifdef USING_ASYNC_TASK_FOR_MP3
-    if (NULL != m_audioExecutor && m_audioExecutor != m_downloadExecutor)
+    if (!m_audioExecutor->waitForCompltion(ms))
     {
-        if (!m_audioExecutor->waitForCompltion(ms))
-        {
-            return false;
-        }
+        return false;
+    }
+    AsyncExecutor* pdfExecutor = NULL;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        pdfExecutor = m_pdfExecutor;
+    }
+    if (NULL != pdfExecutor && !pdfExecutor->waitForCompltion(ms))
+    {
+        return false;
     }
-#endif
 
     return true;
 }
@@ -113,19 +145,46 @@ bool TaskManager::waitForCompltion(unsigned int ms)
 void TaskManager::cancel()
 {
     std::map<uint32_t, std::set<AsyncExecutor::Task *>> copyTaskQueue;
+    std::map<uint32_t, AsyncExecutor::Task *> deferredTasks;
+    std::vector<std::string> cancelledAccounts;
     
     {
         std::unique_lock<std::mutex> lock(m_mutex);
         copyTaskQueue.swap(m_copyTaskQueue);
+        deferredTasks.swap(m_deferredTasks);
+        addExportMetric(EXPORT_METRIC_DEFERRED_TASKS, -static_cast<int64_t>(deferredTasks.size() + m_numberOfSpilledTasks));
+        addExportMetric(EXPORT_METRIC_DEFERRED_BYTES, -m_deferredBytes);
+        m_deferredBytes = 0;
+        m_numberOfSpilledTasks = 0;
+        m_cancelled = true;
+        if (!m_spillFile.empty())
+        {
+            std::unique_lock<std::mutex> spillLock(m_spillMutex);
+            deleteFile(m_spillFile);
+        }
+        // The dropped tasks don't complete, the accounts not ended yet are completed by endAccount
+        for (std::map<std::string, Account>::iterator it = m_accounts.begin(); it != m_accounts.end(); ++it)
+        {
+            if (it->second.ended && !it->second.completed)
+            {
+                it->second.completed = true;
+                cancelledAccounts.push_back(it->first);
+            }
+        }
     }
     
+    // The parsing waiting for room in the transcoding goes on without the audio
+    m_audioCv.notify_all();
+    m_downloadEngine->cancel();
     m_downloadExecutor->cancel();
-#ifdef USING_ASYNC_TASK_FOR_MP3
-    if (NULL != m_audioExecutor && m_audioExecutor != m_downloadExecutor)
+    m_audioExecutor->cancel();
     {
-        m_audioExecutor->cancel();
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (NULL != m_pdfExecutor)
+        {
+            m_pdfExecutor->cancel();
+        }
     }
-#endif
     
     for (std::map<uint32_t, std::set<AsyncExecutor::Task *>>::iterator it = copyTaskQueue.begin(); it != copyTaskQueue.end(); ++it)
     {
@@ -136,22 +195,32 @@ void TaskManager::cancel()
         it->second.clear();
     }
     copyTaskQueue.clear();
+    // Still in the pending downloads, as the dropped ones of the executors
+    for (std::map<uint32_t, AsyncExecutor::Task *>::iterator it = deferredTasks.begin(); it != deferredTasks.end(); ++it)
+    {
+        delete it->second;
+    }
+    
+    if (NULL != m_notifier)
+    {
+        for (std::vector<std::string>::const_iterator it = cancelledAccounts.cbegin(); it != cancelledAccounts.cend(); ++it)
+        {
+            m_notifier->onTasksComplete(*it, true);
+        }
+    }
 }
 
 size_t TaskManager::getNumberOfQueue(std::string& queueDesc) const
 {
-    size_t numberOfDownloads = m_downloadExecutor->getNumberOfQueue();
-#ifdef USING_ASYNC_TASK_FOR_MP3
+    size_t numberOfDownloads = m_downloadEngine->getNumberOfQueue() + m_downloadExecutor->getNumberOfQueue();
     size_t numberOfAudio = 0;
-    if (m_audioExecutor != m_downloadExecutor)
-    {
-        numberOfAudio = m_audioExecutor->getNumberOfQueue();
-    }
-#endif
+    size_t numberOfPdf = 0;
     
     {
         std::unique_lock<std::mutex> lock(m_mutex);
-        numberOfDownloads += m_copyTaskQueue.size();
+        numberOfDownloads += m_copyTaskQueue.size() + m_deferredTasks.size() + m_numberOfSpilledTasks;
+        numberOfAudio = m_numberOfAudioTasks;
+        numberOfPdf = (NULL != m_pdfExecutor) ? m_pdfExecutor->getNumberOfQueue() : 0;
     }
     
     queueDesc = "";
@@ -159,7 +228,6 @@ size_t TaskManager::getNumberOfQueue(std::string& queueDesc) const
     {
         queueDesc += std::to_string(numberOfDownloads) + " downloads";
     }
-#ifdef USING_ASYNC_TASK_FOR_MP3
     if (numberOfAudio > 0)
     {
         if (!queueDesc.empty())
@@ -168,13 +236,37 @@ size_t TaskManager::getNumberOfQueue(std::string& queueDesc) const
         }
         queueDesc += std::to_string(numberOfAudio) + " audios";
     }
-#endif
+    if (numberOfPdf > 0)
+    {
+        if (!queueDesc.empty())
+        {
+            queueDesc += ", ";
+        }
+        queueDesc += std::to_string(numberOfPdf) + " pdfs";
+    }
 
-    return numberOfDownloads
-#ifdef USING_ASYNC_TASK_FOR_MP3
-		+ numberOfAudio
-#endif
-    ;
+    return numberOfDownloads + numberOfAudio + numberOfPdf;
+}
+
+std::string TaskManager::getTableStats() const
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    size_t bytes = m_downloadedFiles.getMemoryUsage() + m_downloadTasks.getMemoryUsage() + m_downloadPaths.getMemoryUsage() + m_downloadingTasks.getMemoryUsage();
+    return "outputs=" + std::to_string(m_downloadedFiles.size()) + ", urls=" + std::to_string(m_downloadTasks.size()) + ", running=" + std::to_string(m_downloadingTasks.size()) + ", bytes=" + std::to_string(bytes);
+}
+
+void TaskManager::getPendingDownloads(std::map<std::string, std::vector<PendingDownload>>& downloads) const
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    downloads.clear();
+    for (std::map<std::string, Account>::const_iterator it = m_accounts.cbegin(); it != m_accounts.cend(); ++it)
+    {
+        downloads[it->first];
+    }
+    for (std::map<std::string, PendingDownload>::const_iterator it = m_pendingDownloads.cbegin(); it != m_pendingDownloads.cend(); ++it)
+    {
+        downloads[it->second.usrName].push_back(it->second);
+    }
 }
 
 void TaskManager::setUserAgent(const std::string& userAgent)
@@ -182,6 +274,287 @@ void TaskManager::setUserAgent(const std::string& userAgent)
     m_userAgent = userAgent;
 }
 
+void TaskManager::setDownloadCache(DownloadCache* downloadCache)
+{
+    m_downloadCache = downloadCache;
+}
+
+void TaskManager::setTranscodeCache(TranscodeCache* transcodeCache)
+{
+    m_transcodeCache = transcodeCache;
+}
+
+void TaskManager::setDownloadConcurrency(unsigned int minTransfersPerHost, unsigned int maxTransfersPerHost)
+{
+    // Starts from 4, same as the threads of downloads before
+    m_downloadEngine->setHostConcurrency(minTransfersPerHost, maxTransfersPerHost, 4);
+}
+
+void TaskManager::setNotifier(const ExportNotifier* notifier)
+{
+    m_notifier = notifier;
+}
+
+void TaskManager::beginAccount(const std::string& usrName)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_usrName = usrName;
+    std::map<std::string, Account>::iterator it = m_accounts.find(usrName);
+    if (it == m_accounts.end())
+    {
+        it = m_accounts.insert(it, std::pair<std::string, Account>(usrName, Account()));
+        it->second.numberOfTasks = 0;
+    }
+    it->second.numberOfTotalTasks = 0;
+    it->second.ended = false;
+    it->second.completed = false;
+}
+
+void TaskManager::endAccount(const std::string& usrName)
+{
+    uint32_t numberOfTotalTasks = 0;
+    bool completed = false;
+    bool cancelled = false;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_usrName == usrName)
+        {
+            m_usrName.clear();
+        }
+        std::map<std::string, Account>::iterator it = m_accounts.find(usrName);
+        if (it == m_accounts.end() || it->second.ended)
+        {
+            return;
+        }
+        Account& account = it->second;
+        account.ended = true;
+        account.numberOfTotalTasks = account.numberOfTasks;
+        account.progressTime = std::chrono::steady_clock::now();
+        numberOfTotalTasks = account.numberOfTotalTasks;
+        cancelled = m_cancelled;
+        completed = account.numberOfTasks == 0 || cancelled;
+        account.completed = completed;
+    }
+    
+    if (NULL != m_notifier)
+    {
+        m_notifier->onTasksStart(usrName, numberOfTotalTasks);
+        if (completed)
+        {
+            m_notifier->onTasksComplete(usrName, cancelled);
+        }
+    }
+}
+
+void TaskManager::setDeferringMedia(bool deferringMedia)
+{
+    if (!deferringMedia)
+    {
+        startDeferredTasks();
+        return;
+    }
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_deferringMedia = true;
+}
+
+void TaskManager::startDeferredTasks()
+{
+    std::map<uint32_t, AsyncExecutor::Task *> deferredTasks;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_deferringMedia = false;
+        deferredTasks.swap(m_deferredTasks);
+        addExportMetric(EXPORT_METRIC_DEFERRED_TASKS, -static_cast<int64_t>(deferredTasks.size() + m_numberOfSpilledTasks));
+        addExportMetric(EXPORT_METRIC_DEFERRED_BYTES, -m_deferredBytes);
+        m_deferredBytes = 0;
+        if (m_numberOfSpilledTasks > 0)
+        {
+            m_numberOfSpilledTasks = 0;
+            std::unique_lock<std::mutex> spillLock(m_spillMutex);
+            lock.unlock();
+            // Spilled before the ones held in memory, the ids keep them in the order they were added
+            restoreSpilledTasks(deferredTasks);
+        }
+    }
+    
+    // In the order they are added, the copies are spread over the executor at once
+    std::vector<AsyncExecutor::Task *> copyTasks;
+    for (std::map<uint32_t, AsyncExecutor::Task *>::iterator it = deferredTasks.begin(); it != deferredTasks.end(); ++it)
+    {
+        if (it->second->getType() == TASK_TYPE_DOWNLOAD)
+        {
+            m_downloadEngine->addTask(static_cast<DownloadTask *>(it->second));
+        }
+        else
+        {
+            copyTasks.push_back(it->second);
+        }
+    }
+    m_downloadExecutor->addTasks(copyTasks);
+}
+
+void TaskManager::setSpillFile(const std::string& spillFile)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_spillFile = spillFile;
+}
+
+template<class T>
+static void appendSpillValue(std::string& data, T value)
+{
+    data.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+static void appendSpillString(std::string& data, const std::string& value)
+{
+    appendSpillValue(data, static_cast<uint32_t>(value.size()));
+    data.append(value);
+}
+
+template<class T>
+static bool readSpillValue(const std::vector<unsigned char>& data, size_t& offset, T& value)
+{
+    if (offset + sizeof(value) > data.size())
+    {
+        return false;
+    }
+    std::memcpy(&value, &data[offset], sizeof(value));
+    offset += sizeof(value);
+    return true;
+}
+
+static bool readSpillString(const std::vector<unsigned char>& data, size_t& offset, std::string& value)
+{
+    uint32_t length = 0;
+    if (!readSpillValue(data, offset, length) || offset + length > data.size())
+    {
+        return false;
+    }
+    value.assign(reinterpret_cast<const char *>(&data[offset]), length);
+    offset += length;
+    return true;
+}
+
+int64_t TaskManager::getDeferredTaskBytes(const AsyncExecutor::Task* task)
+{
+    size_t bytes = (task->getType() == TASK_TYPE_DOWNLOAD) ? sizeof(DownloadTask) : sizeof(CopyTask);
+    return static_cast<int64_t>(bytes + task->getName().size() * 2);
+}
+
+void TaskManager::spillDeferredTasks(std::unique_lock<std::mutex>& lock)
+{
+    // The file is read by this process only, so the records are in the native byte order and keep the session pointers:
+    // type (uint8), priority (uint8), task id (uint32), session, mtime (int64), then 3 strings of (uint32) length and bytes:
+    // url, output and default file of a download, or source, dest and name of a copy
+    std::map<uint32_t, AsyncExecutor::Task *> deferredTasks;
+    deferredTasks.swap(m_deferredTasks);
+    addExportMetric(EXPORT_METRIC_DEFERRED_BYTES, -m_deferredBytes);
+    m_deferredBytes = 0;
+    m_numberOfSpilledTasks += deferredTasks.size();
+    std::string spillFile = m_spillFile;
+    std::unique_lock<std::mutex> spillLock(m_spillMutex);
+    lock.unlock();
+    
+    std::string data;
+    for (std::map<uint32_t, AsyncExecutor::Task *>::iterator it = deferredTasks.begin(); it != deferredTasks.end(); ++it)
+    {
+        AsyncExecutor::Task* task = it->second;
+        appendSpillValue(data, static_cast<uint8_t>(task->getType()));
+        appendSpillValue(data, static_cast<uint8_t>(task->getPriority()));
+        appendSpillValue(data, task->getTaskId());
+        appendSpillValue(data, reinterpret_cast<uint64_t>(task->getUserData()));
+        if (task->getType() == TASK_TYPE_DOWNLOAD)
+        {
+            const DownloadTask* downloadTask = static_cast<const DownloadTask *>(task);
+            appendSpillValue(data, static_cast<int64_t>(downloadTask->getMtime()));
+            appendSpillString(data, downloadTask->getUrl());
+            appendSpillString(data, downloadTask->getOutput());
+            appendSpillString(data, downloadTask->getDefaultFile());
+        }
+        else
+        {
+            const CopyTask* copyTask = static_cast<const CopyTask *>(task);
+            appendSpillValue(data, static_cast<int64_t>(copyTask->getMtime()));
+            appendSpillString(data, copyTask->getSrc());
+            appendSpillString(data, copyTask->getDest());
+            appendSpillString(data, copyTask->getName());
+        }
+        delete task;
+    }
+    if (!appendFile(spillFile, data) && NULL != m_logger)
+    {
+        // The tasks are lost, they are still in the pending downloads for the next exporting
+        m_logger->write("Failed to write the spilled tasks: " + spillFile);
+    }
+}
+
+void TaskManager::restoreSpilledTasks(std::map<uint32_t, AsyncExecutor::Task *>& tasks)
+{
+    std::vector<unsigned char> data;
+    if (!readFile(m_spillFile, data))
+    {
+        return;
+    }
+    deleteFile(m_spillFile);
+    
+    size_t offset = 0;
+    while (offset < data.size())
+    {
+        uint8_t type = 0;
+        uint8_t priority = 0;
+        uint32_t taskId = 0;
+        uint64_t userData = 0;
+        int64_t mtime = 0;
+        std::string values[3];
+        if (!readSpillValue(data, offset, type) || !readSpillValue(data, offset, priority) || !readSpillValue(data, offset, taskId) || !readSpillValue(data, offset, userData) || !readSpillValue(data, offset, mtime)
+            || !readSpillString(data, offset, values[0]) || !readSpillString(data, offset, values[1]) || !readSpillString(data, offset, values[2]))
+        {
+            break;
+        }
+        AsyncExecutor::Task* task = NULL;
+        if (type == TASK_TYPE_DOWNLOAD)
+        {
+            DownloadTask* downloadTask = new DownloadTask(values[0], values[1], values[2], static_cast<time_t>(mtime), "DL: " + values[0] + " => " + values[1]);
+            downloadTask->setUserAgent(m_userAgent);
+            task = downloadTask;
+        }
+        else
+        {
+            task = new CopyTask(values[0], values[1], values[2], static_cast<time_t>(mtime));
+        }
+        task->setTaskId(taskId);
+        task->setUserData(reinterpret_cast<const void *>(userData));
+        task->setPriority(priority);
+        tasks[taskId] = task;
+    }
+}
+
+void TaskManager::startTask(AsyncExecutor::Task *task)
+{
+    if (task->getType() == TASK_TYPE_DOWNLOAD)
+    {
+        m_downloadEngine->addTask(static_cast<DownloadTask *>(task));
+    }
+    else
+    {
+        m_downloadExecutor->addTask(task);
+    }
+}
+
+int TaskManager::getTaskPriority(const std::string& type)
+{
+    if (type == "avatar")
+    {
+        return TASK_PRIORITY_HIGH;
+    }
+    else if (type == "emoji" || type == "video" || type == "file")
+    {
+        return TASK_PRIORITY_LOW;
+    }
+    // Cards, thumbnails and the resumed downloads
+    return TASK_PRIORITY_NORMAL;
+}
+
 void TaskManager::onTaskStart(const AsyncExecutor* executor, const AsyncExecutor::Task *task)
 {
     if (NULL != m_logger && task->getType() != TASK_TYPE_AUDIO)
@@ -216,19 +589,56 @@ void TaskManager::onTaskComplete(const AsyncExecutor* executor, const AsyncExecu
 #endif
     }
     
+    if (task->getType() == TASK_TYPE_AUDIO)
+    {
+        const Mp3Task* mp3Task = dynamic_cast<const Mp3Task *>(task);
+        if (NULL != m_transcodeCache && NULL != mp3Task)
+        {
+            if (succeeded)
+            {
+                m_transcodeCache->add(mp3Task->getOutput(), mp3Task->getSourceId(), mp3Task->getMtime());
+            }
+            else
+            {
+                m_transcodeCache->remove(mp3Task->getOutput());
+            }
+        }
+        std::unique_lock<std::mutex> lock(m_mutex);
+        --m_numberOfAudioTasks;
+        m_audioCv.notify_one();
+        return;
+    }
+    
     // const Session* session = task->getUserData() == NULL ? NULL : reinterpret_cast<const Session *>(task->getUserData());
     if (/*executor == m_downloadExecutor && */task->getType() == TASK_TYPE_DOWNLOAD)
     {
         const DownloadTask* downloadTask = dynamic_cast<const DownloadTask *>(task);
         
+        uint32_t numberOfCompletedTasks = 0;
+        uint32_t numberOfTotalTasks = 0;
+        bool completed = false;
+        std::string usrName;
+        
         std::unique_lock<std::mutex> lock(m_mutex);
-        std::map<std::string, uint32_t>::const_iterator it = m_downloadingTasks.find(downloadTask->getUrl());
+        std::map<std::string, PendingDownload>::iterator itPending = m_pendingDownloads.find(downloadTask->getOutput());
+        if (itPending != m_pendingDownloads.end())
+        {
+            usrName = itPending->second.usrName;
+            if (succeeded || !m_cancelled)
+            {
+                // Interrupted by cancel, it is still pending
+                m_pendingDownloads.erase(itPending);
+            }
+        }
+        bool notifying = completeAccountTask(usrName, numberOfCompletedTasks, numberOfTotalTasks, completed);
+        HashKey urlKey = hashString(downloadTask->getUrl());
+        const HashMapEntry<uint32_t>* it = m_downloadingTasks.find(urlKey);
 #ifndef NDEBUG
-        assert(it != m_downloadingTasks.cend());
+        assert(it != NULL);
 #endif
-        if (it != m_downloadingTasks.cend())
+        if (NULL != it && it->value == task->getTaskId())
         {
-            m_downloadingTasks.erase(it);
+            m_downloadingTasks.erase(urlKey);
         }
         
         std::set<AsyncExecutor::Task *> copyTasks = dequeueCopyTasks(task->getTaskId());
@@ -240,17 +650,101 @@ void TaskManager::onTaskComplete(const AsyncExecutor* executor, const AsyncExecu
             assert(existsFile(downloadTask->getOutput()));
         }
 #endif
-        for (std::set<AsyncExecutor::Task *>::iterator it = copyTasks.begin(); it != copyTasks.end(); ++it)
+        if (succeeded && downloadTask->isDownloaded() && NULL != m_downloadCache)
         {
-            m_downloadExecutor->addTask(*it);
+            m_downloadCache->add(downloadTask->getUrl(), downloadTask->getOutput(), downloadTask->getETag(), downloadTask->getLastModified());
+        }
+        m_downloadExecutor->addTasks(std::vector<AsyncExecutor::Task *>(copyTasks.begin(), copyTasks.end()));
+        if (notifying)
+        {
+            notifyAccountProgress(usrName, numberOfCompletedTasks, numberOfTotalTasks, completed);
         }
     }
-    else if ((task->getType() == TASK_TYPE_COPY) || (task->getType() == TASK_TYPE_AUDIO))
+    else if (task->getType() == TASK_TYPE_COPY)
     {
-        // check copy task
+        const CopyTask* copyTask = dynamic_cast<const CopyTask *>(task);
+        const BackupCopyTask* backupCopyTask = dynamic_cast<const BackupCopyTask *>(task);
+        uint32_t numberOfCompletedTasks = 0;
+        uint32_t numberOfTotalTasks = 0;
+        bool completed = false;
+        std::string usrName;
+        
+        std::unique_lock<std::mutex> lock(m_mutex);
+        std::map<std::string, PendingDownload>::iterator itPending = (NULL == backupCopyTask) ? m_pendingDownloads.find(copyTask->getDest()) : m_pendingDownloads.end();
+        if (NULL != backupCopyTask)
+        {
+            // Not a download, it isn't resumed from the export context
+            usrName = backupCopyTask->getUsrName();
+        }
+        else if (itPending != m_pendingDownloads.end())
+        {
+            usrName = itPending->second.usrName;
+            if (succeeded || !m_cancelled)
+            {
+                m_pendingDownloads.erase(itPending);
+            }
+        }
+        bool notifying = completeAccountTask(usrName, numberOfCompletedTasks, numberOfTotalTasks, completed);
+        lock.unlock();
+        
+        if (notifying)
+        {
+            notifyAccountProgress(usrName, numberOfCompletedTasks, numberOfTotalTasks, completed);
+        }
     }
 }
 
+bool TaskManager::completeAccountTask(const std::string& usrName, uint32_t& numberOfCompletedTasks, uint32_t& numberOfTotalTasks, bool& completed)
+{
+    std::map<std::string, Account>::iterator it = m_accounts.find(usrName);
+    if (it == m_accounts.end() || it->second.completed || it->second.numberOfTasks == 0)
+    {
+        // Completed by cancel, the running tasks are aborted after it
+        return false;
+    }
+    Account& account = it->second;
+    --account.numberOfTasks;
+    if (!account.ended)
+    {
+        // The total is not known yet
+        return false;
+    }
+    
+    numberOfTotalTasks = account.numberOfTotalTasks;
+    numberOfCompletedTasks = account.numberOfTotalTasks - account.numberOfTasks;
+    completed = account.numberOfTasks == 0;
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (completed)
+    {
+        account.completed = true;
+    }
+    else if (now - account.progressTime < std::chrono::seconds(1))
+    {
+        return false;
+    }
+    account.progressTime = now;
+    return true;
+}
+
+void TaskManager::notifyAccountProgress(const std::string& usrName, uint32_t numberOfCompletedTasks, uint32_t numberOfTotalTasks, bool completed)
+{
+    if (NULL == m_notifier)
+    {
+        return;
+    }
+    m_notifier->onTasksProgress(usrName, numberOfCompletedTasks, numberOfTotalTasks);
+    if (completed)
+    {
+        m_notifier->onTasksComplete(usrName, false);
+    }
+}
+
+void TaskManager::onDownloadComplete(const DownloadTask *task, bool succeeded)
+{
+    // Same as the tasks of the executor, the copies waiting for it are queued
+    onTaskComplete(NULL, task, succeeded);
+}
+
 void TaskManager::download(const Session* session, const std::string &url, const std::string &backupUrl, const std::string& output, time_t mtime, const std::string& defaultFile/* = ""*/, std::string type/* = ""*/)
 {
 #ifndef NDEBUG
@@ -264,18 +758,26 @@ void TaskManager::download(const Session* session, const std::string &url, const
 	}
 #endif
     
+    HashKey urlKey = hashString(url);
+    bool existing = false;
+    std::string sourcePath;     // Output of the first download of url, or the cached file
     {
         std::unique_lock<std::mutex> lock(m_mutex);
-        std::set<std::string>::iterator it = m_downloadedFiles.find(output);
-        if (it != m_downloadedFiles.end())
+        bool inserted = false;
+        m_downloadedFiles.insert(hashString(output), inserted);
+        if (!inserted)
         {
             return;
         }
-        m_downloadedFiles.insert(output);
+        const HashMapEntry<uint32_t>* entry = m_downloadTasks.find(urlKey);
+        if (NULL != entry)
+        {
+            existing = true;
+            sourcePath = m_downloadPaths.get(entry->value);
+        }
     }
     
-    std::map<std::string, std::string>::iterator it = m_downloadTasks.find(url);
-    if (it != m_downloadTasks.end() && it->second == output)
+    if (existing && sourcePath == output)
     {
         // Existed and same output path, skip it
         return;
@@ -284,10 +786,15 @@ void TaskManager::download(const Session* session, const std::string &url, const
     bool downloadFile = false;
     uint32_t taskId = AsyncExecutor::genNextTaskId();
     AsyncExecutor::Task *task = NULL;
-    if (it != m_downloadTasks.end())
+    if (existing)
     {
         // Existed and different output path, copy it
-        task = new CopyTask(it->second, output, "CP: " + url + " => " + output + " <= " + it->second);
+        task = new CopyTask(sourcePath, output, "CP: " + url + " => " + output + " <= " + sourcePath, mtime);
+    }
+    else if (NULL != m_downloadCache && m_downloadCache->find(url, sourcePath))
+    {
+        // Downloaded by a previous exporting, the copies of it are taken from the cache as well
+        task = new CopyTask(sourcePath, output, "CP: " + url + " => " + output + " <= " + sourcePath, mtime);
     }
     else
     {
@@ -295,51 +802,174 @@ void TaskManager::download(const Session* session, const std::string &url, const
         downloadTask->setUserAgent(m_userAgent);
         task = downloadTask;
         downloadFile = true;
-        m_downloadTasks.insert(std::pair<std::string, std::string>(url, output));
+        sourcePath = output;
     }
     task->setTaskId(taskId);
     task->setUserData(reinterpret_cast<const void *>(session));
+    task->setPriority(getTaskPriority(type));
     
+    AsyncExecutor::Task *promotedTask = NULL;
     std::unique_lock<std::mutex> lock(m_mutex);
+    if (!existing)
+    {
+        bool inserted = false;
+        HashMapEntry<uint32_t>* entry = m_downloadTasks.insert(urlKey, inserted);
+        if (inserted)
+        {
+            entry->value = m_downloadPaths.add(sourcePath);
+        }
+    }
+    PendingDownload pendingDownload = {url, output, defaultFile, mtime, m_usrName};
+    m_pendingDownloads[output] = pendingDownload;
+    std::map<std::string, Account>::iterator itAccount = m_accounts.find(m_usrName);
+    if (itAccount != m_accounts.end())
+    {
+        ++itAccount->second.numberOfTasks;
+    }
     if (downloadFile)
     {
-        m_downloadingTasks.insert(std::pair<std::string, uint32_t>(url, taskId));
+        bool inserted = false;
+        HashMapEntry<uint32_t>* entry = m_downloadingTasks.insert(urlKey, inserted);
+        if (inserted)
+        {
+            entry->value = taskId;
+        }
     }
     else
     {
-        std::map<std::string, uint32_t>::const_iterator it3 = m_downloadingTasks.find(url);
-        if (it3 != m_downloadingTasks.cend())
+        const HashMapEntry<uint32_t>* it3 = m_downloadingTasks.find(urlKey);
+        if (NULL != it3)
         {
             // Downloading is running, add it into waiting queue
-            std::map<uint32_t, std::set<AsyncExecutor::Task *>>::iterator it4 = m_copyTaskQueue.find(it3->second);
+            std::map<uint32_t, std::set<AsyncExecutor::Task *>>::iterator it4 = m_copyTaskQueue.find(it3->value);
             if (it4 == m_copyTaskQueue.end())
             {
-                it4 = m_copyTaskQueue.insert(it4, std::pair<uint32_t, std::set<AsyncExecutor::Task *>>(it3->second, std::set<AsyncExecutor::Task *>()));
+                it4 = m_copyTaskQueue.insert(it4, std::pair<uint32_t, std::set<AsyncExecutor::Task *>>(it3->value, std::set<AsyncExecutor::Task *>()));
             }
             it4->second.insert(task);
+            
+            std::map<uint32_t, AsyncExecutor::Task *>::iterator it5 = m_deferredTasks.find(it3->value);
+            if (it5 != m_deferredTasks.end() && task->getPriority() == TASK_PRIORITY_HIGH)
+            {
+                // The download held by the deferring is waited for by an avatar, it isn't held any more
+                promotedTask = it5->second;
+                promotedTask->setPriority(TASK_PRIORITY_HIGH);
+                m_deferredTasks.erase(it5);
+                addExportMetric(EXPORT_METRIC_DEFERRED_TASKS, -1);
+            }
             task = NULL;
         }
     }
+    bool spilling = false;
+    if (NULL != task && m_deferringMedia && task->getPriority() != TASK_PRIORITY_HIGH)
+    {
+        int64_t taskBytes = getDeferredTaskBytes(task);
+        m_deferredTasks.insert(std::pair<uint32_t, AsyncExecutor::Task *>(taskId, task));
+        m_deferredBytes += taskBytes;
+        addExportMetric(EXPORT_METRIC_DEFERRED_TASKS, 1);
+        addExportMetric(EXPORT_METRIC_DEFERRED_BYTES, taskBytes);
+        task = NULL;
+        // An avatar waiting for a spilled download isn't promoted, it is copied once the spilled tasks are started
+        spilling = !m_spillFile.empty() && isOverMemoryCeiling();
+    }
 
+    if (spilling)
+    {
+        spillDeferredTasks(lock);
+        return;
+    }
     lock.unlock();
+    if (NULL != promotedTask)
+    {
+        startTask(promotedTask);
+    }
     if (NULL != task)
     {
-        m_downloadExecutor->addTask(task);
+        startTask(task);
     }
 }
 
-#ifdef USING_ASYNC_TASK_FOR_MP3
-void TaskManager::convertAudio(const Session* session, const std::string& pcmPath, const std::string& mp3Path, unsigned int mtime)
+void TaskManager::convertAudio(const Session* session, const std::string& pcmPath, const std::string& mp3Path, unsigned int mtime, const std::string& sourceId/* = ""*/)
 {
     if (NULL == session)
     {
         return;
     }
+    if (NULL != m_transcodeCache && m_transcodeCache->find(mp3Path, sourceId, mtime))
+    {
+        return;
+    }
     
-    Mp3Task *task = new Mp3Task(pcmPath, mp3Path, mtime);
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        // Back-pressure, the parsing doesn't run ahead of the transcoding by more than the pool holds
+        while (!m_cancelled && m_numberOfAudioTasks >= m_maxAudioTasks)
+        {
+            m_audioCv.wait(lock);
+        }
+        if (m_cancelled)
+        {
+            return;
+        }
+        ++m_numberOfAudioTasks;
+    }
+    
+    Mp3Task *task = new Mp3Task(pcmPath, mp3Path, mtime, sourceId);
     task->setTaskId(AsyncExecutor::genNextTaskId());
     task->setUserData(reinterpret_cast<const void *>(session));
     
     m_audioExecutor->addTask(task);
 }
-#endif
+
+void TaskManager::convertPdf(const Session* session, const std::string& htmlPath, const std::string& pdfPath, PdfConverter* pdfConverter)
+{
+    AsyncExecutor* pdfExecutor = NULL;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_cancelled)
+        {
+            return;
+        }
+        if (NULL == m_pdfExecutor)
+        {
+            unsigned int numberOfThreads = pdfConverter->getConcurrency();
+            m_pdfExecutor = new AsyncExecutor(static_cast<int>(numberOfThreads == 0 ? 1 : numberOfThreads), this);
+            m_pdfExecutor->setTag("pdf");
+        }
+        pdfExecutor = m_pdfExecutor;
+    }
+    
+    PdfTask *task = new PdfTask(pdfConverter, htmlPath, pdfPath, "PDF: " + htmlPath);
+    task->setTaskId(AsyncExecutor::genNextTaskId());
+    task->setUserData(reinterpret_cast<const void *>(session));
+    pdfExecutor->addTask(task);
+}
+
+void TaskManager::copyFile(const ITunesDb* iTunesDb, const ITunesFile* file, const std::string& destFullPath, const std::string& type)
+{
+    BackupCopyTask *task = NULL;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_cancelled)
+        {
+            return;
+        }
+        bool inserted = false;
+        m_downloadedFiles.insert(hashString(destFullPath), inserted);
+        if (!inserted)
+        {
+            // Queued by another message of the session, or by a download
+            return;
+        }
+        task = new BackupCopyTask(iTunesDb, file, destFullPath, m_usrName);
+        std::map<std::string, Account>::iterator itAccount = m_accounts.find(m_usrName);
+        if (itAccount != m_accounts.end())
+        {
+            ++itAccount->second.numberOfTasks;
+        }
+    }
+    task->setTaskId(AsyncExecutor::genNextTaskId());
+    task->setPriority(getTaskPriority(type));
+    
+    m_downloadExecutor->addTask(task);
+}
@@ -11,59 +11,148 @@
 
 #include <stdio.h>
 #include <map>
+#include <queue>
 #include <set>
+#include <vector>
+#include <chrono>
 #include "WechatObjects.h"
 #include "AsyncExecutor.h"
+#include "DownloadEngine.h"
+#include "DownloadCache.h"
+#include "TranscodeCache.h"
 #include "PdfConverter.h"
 #include "Logger.h"
+#include "ExportNotifier.h"
+#include "HashTable.h"
 
-class TaskManager : public AsyncExecutor::Callback
+// Download not completed yet, kept in the export context so the resumed exporting starts it again
+struct PendingDownload
+{
+    std::string url;
+    std::string output;
+    std::string defaultFile;
+    time_t mtime;
+    std::string usrName;    // Account of the download, the export context keeps them by account
+};
+
+class TaskManager : public AsyncExecutor::Callback, public DownloadEngine::Callback
 {
 private:
     Logger* m_logger;
     
-    AsyncExecutor   *m_downloadExecutor;
-#ifdef USING_ASYNC_TASK_FOR_MP3
-    AsyncExecutor   *m_audioExecutor;
-#endif
-    std::map<std::string, std::string> m_downloadTasks;
+    DownloadEngine  *m_downloadEngine;
+    AsyncExecutor   *m_downloadExecutor;    // Copies of the downloaded files
+    AsyncExecutor   *m_audioExecutor;       // Transcoding of the voice messages, a thread for each core
+    AsyncExecutor   *m_pdfExecutor;         // Printing of the sessions, made by the first convertPdf
+    // Tables of the whole exporting, keyed by the hashes of urls and outputs, so they stay small for many stickers
+    HashMap<uint32_t> m_downloadTasks;  // url => id of the output in m_downloadPaths, or of the cached file
+    PathArena m_downloadPaths;
+    DownloadCache* m_downloadCache;
+    TranscodeCache* m_transcodeCache;
     
     std::string m_userAgent;
     
     mutable std::mutex m_mutex;
-    std::set<std::string> m_downloadedFiles;
-    std::map<std::string, uint32_t> m_downloadingTasks;
+    HashSet m_downloadedFiles;
+    HashMap<uint32_t> m_downloadingTasks;   // url => id of the running task
     
     std::map<uint32_t, std::set<AsyncExecutor::Task *>> m_copyTaskQueue;
+    std::map<std::string, PendingDownload> m_pendingDownloads;  // output => download
     
-#ifdef USING_ASYNC_TASK_FOR_MP3
-    std::queue<std::vector<unsigned char>> m_Buffers;
-#endif
+    // Tasks of an account, counted from beginAccount and reported to the notifier once endAccount is called
+    struct Account
+    {
+        uint32_t numberOfTasks;         // Not completed yet
+        uint32_t numberOfTotalTasks;    // Not completed when the account is ended
+        bool ended;
+        bool completed;
+        std::chrono::steady_clock::time_point progressTime;
+    };
+    std::map<std::string, Account> m_accounts;  // usrName => account
+    std::string m_usrName;      // Account of the tasks being added
+    const ExportNotifier* m_notifier;
+    bool m_deferringMedia;
+    std::map<uint32_t, AsyncExecutor::Task *> m_deferredTasks;  // Task id => task held until startDeferredTasks
+    int64_t m_deferredBytes;        // Estimated bytes of m_deferredTasks, for the memory accounting
+    // Held tasks written out over the memory ceiling, they are read back by startDeferredTasks.
+    // Locked after m_mutex, so the file isn't read before the tasks spilled at the same time are in it
+    std::mutex m_spillMutex;
+    std::string m_spillFile;
+    size_t m_numberOfSpilledTasks;
+    bool m_cancelled;
+    std::condition_variable m_audioCv;
+    size_t m_numberOfAudioTasks;    // Queued and running, convertAudio waits while there are m_maxAudioTasks
+    size_t m_maxAudioTasks;
     
 public:
     
-    TaskManager(Logger* logger);
+    // numberOfAudioThreads: transcoding threads, 0 for the number of cores
+    TaskManager(Logger* logger, unsigned int numberOfAudioThreads = 0);
     ~TaskManager();
     
     virtual void onTaskStart(const AsyncExecutor* executor, const AsyncExecutor::Task *task);
     virtual void onTaskComplete(const AsyncExecutor* executor, const AsyncExecutor::Task *task, bool succeeded);
+    virtual void onDownloadComplete(const DownloadTask *task, bool succeeded);
     
     void setUserAgent(const std::string& userAgent);
+    // Downloads are taken from the cache if they are there, and the new ones are added to it
+    void setDownloadCache(DownloadCache* downloadCache);
+    // Voices transcoded by the previous exportings are kept if they are of the same source
+    void setTranscodeCache(TranscodeCache* transcodeCache);
+    // Floor and ceiling of the concurrent downloads from a CDN host, the engine tunes them in between
+    void setDownloadConcurrency(unsigned int minTransfersPerHost, unsigned int maxTransfersPerHost);
+    // onTasksStart/onTasksProgress/onTasksComplete of the accounts, called on the threads of the tasks
+    void setNotifier(const ExportNotifier* notifier);
+    // The tasks added after it belong to the account, until the next one begins
+    void beginAccount(const std::string& usrName);
+    // No more tasks of the account, onTasksComplete is called once they complete, which may be right away
+    void endAccount(const std::string& usrName);
+    // Downloads and copies below the high priority are held until startDeferredTasks, so the avatars
+    // of the pages aren't queued behind the bulk of the emojis and thumbnails
+    void setDeferringMedia(bool deferringMedia);
+    // Queues the held tasks and stops deferring, shutdown does it as well
+    void startDeferredTasks();
+    // The held tasks are spilled to the file once the accounted memory is over the ceiling, nothing is spilled without it
+    void setSpillFile(const std::string& spillFile);
     
     size_t getNumberOfQueue(std::string& queueDesc) const;
+    // Entries and bytes of the tables of urls and outputs, for the debug stats
+    std::string getTableStats() const;
     void cancel();
     void shutdown();
     // true: completed, false: timeout
     bool waitForCompltion(unsigned int ms);
+    // Downloads and copies of them not completed, including the ones dropped by cancel, by account.
+    // Every account begun is there, with no download if all of them completed
+    void getPendingDownloads(std::map<std::string, std::vector<PendingDownload>>& downloads) const;
 
     void download(const Session* session, const std::string &url, const std::string &backupUrl, const std::string& output, time_t mtime, const std::string& defaultFile = "", std::string type = "");
-#ifdef USING_ASYNC_TASK_FOR_MP3
-    void convertAudio(const Session* session, const std::string& pcmPath, const std::string& mp3Path, unsigned int mtime);
-#endif
+    // The voice is transcoded to mp3 in the background, it blocks while the pool is full.
+    // sourceId is the fileId of the voice, nothing is done if the cached mp3 is of the same source and mtime
+    void convertAudio(const Session* session, const std::string& pcmPath, const std::string& mp3Path, unsigned int mtime, const std::string& sourceId = "");
+    // The file of the backup is copied in the background, destFullPath is checked by the caller.
+    // type is the same as download, videos and files of the sessions go after the thumbnails
+    void copyFile(const ITunesDb* iTunesDb, const ITunesFile* file, const std::string& destFullPath, const std::string& type);
+    // The session is printed on a pool of pdfConverter->getConcurrency() threads while the exporting goes on
+    void convertPdf(const Session* session, const std::string& htmlPath, const std::string& pdfPath, PdfConverter* pdfConverter);
     
 private:
     
     void shutdownExecutors();
+    // DownloadTasks go to the engine, the others to the executor
+    void startTask(AsyncExecutor::Task *task);
+    // Priority of the task by the type of the download: avatars first and emojis last
+    static int getTaskPriority(const std::string& type);
+    // Estimated from the strings of the task, the name has the url and the output
+    static int64_t getDeferredTaskBytes(const AsyncExecutor::Task* task);
+    // Moves the held tasks to the spill file, called with m_mutex locked, which is unlocked on return
+    void spillDeferredTasks(std::unique_lock<std::mutex>& lock);
+    // The spilled tasks are added to tasks and the file is deleted, called with m_spillMutex locked
+    void restoreSpilledTasks(std::map<uint32_t, AsyncExecutor::Task *>& tasks);
+    // A task of the account is completed, called with m_mutex locked.
+    // true if the progress is due to be notified, completed: no task of the account is left
+    bool completeAccountTask(const std::string& usrName, uint32_t& numberOfCompletedTasks, uint32_t& numberOfTotalTasks, bool& completed);
+    void notifyAccountProgress(const std::string& usrName, uint32_t numberOfCompletedTasks, uint32_t numberOfTotalTasks, bool completed);
     
     inline std::set<AsyncExecutor::Task *> dequeueCopyTasks(uint32_t taskId)
     {
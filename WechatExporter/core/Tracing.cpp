@@ -0,0 +1,227 @@
+//
+//  Tracing.cpp
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#include "Tracing.h"
+#include <chrono>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <functional>
+#include <cstring>
+#include <json/json.h>
+#include "FileSystem.h"
+
+std::atomic<bool> g_tracing(false);
+
+struct TraceEvent
+{
+    const char* category;
+    const char* name;       // NULL for an instant event without a span
+    const char* argName;
+    int64_t argValue;
+    int64_t startTime;      // ns since startTracing
+    int64_t duration;       // -1 for an instant event
+    char label[TRACE_LABEL_SIZE];
+};
+
+// The mutex is only taken by another thread while writing the trace, so the thread owning the buffer locks it without waiting
+struct TraceBuffer
+{
+    std::mutex mutex;
+    uint64_t tid;
+    std::string threadName;
+    uint32_t generation;
+    std::vector<TraceEvent> events;
+    size_t next;
+    size_t count;
+
+    TraceBuffer() : tid(0), generation(0), next(0), count(0)
+    {
+    }
+};
+
+static std::mutex g_traceMutex;
+static std::vector<std::shared_ptr<TraceBuffer>> g_traceBuffers;  // Buffers of the exited threads are kept until the next startTracing
+static std::atomic<uint32_t> g_traceGeneration(0);
+static std::atomic<size_t> g_traceEventsPerThread(TRACE_DEFAULT_EVENTS_PER_THREAD);
+static std::atomic<int64_t> g_traceOrigin(0);
+static std::atomic<uint64_t> g_traceNextTid(1);
+
+static thread_local std::shared_ptr<TraceBuffer> t_traceBuffer;
+static thread_local std::string t_traceThreadName;
+
+static inline int64_t getTraceNow()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static TraceBuffer* getTraceBuffer()
+{
+    uint32_t generation = g_traceGeneration.load(std::memory_order_acquire);
+    if (t_traceBuffer && t_traceBuffer->generation == generation)
+    {
+        return t_traceBuffer.get();
+    }
+
+    // The first event of the thread in this tracing. A buffer of a previous one isn't reused as the writer may still read it
+    std::shared_ptr<TraceBuffer> buffer = std::make_shared<TraceBuffer>();
+    buffer->tid = t_traceBuffer ? t_traceBuffer->tid : g_traceNextTid.fetch_add(1);
+    buffer->threadName = t_traceThreadName;
+    buffer->generation = generation;
+    buffer->events.resize(g_traceEventsPerThread.load());
+
+    std::lock_guard<std::mutex> lock(g_traceMutex);
+    if (generation != g_traceGeneration.load(std::memory_order_relaxed))
+    {
+        // startTracing was called in between, the event is dropped
+        return NULL;
+    }
+    g_traceBuffers.push_back(buffer);
+    t_traceBuffer = buffer;
+    return buffer.get();
+}
+
+static void addTraceEvent(const char* category, const char* name, const char* argName, int64_t argValue, int64_t startTime, int64_t duration, const std::string& label)
+{
+    TraceBuffer* buffer = getTraceBuffer();
+    if (NULL == buffer || buffer->events.empty())
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(buffer->mutex);
+    TraceEvent& event = buffer->events[buffer->next];
+    event.category = category;
+    event.name = name;
+    event.argName = argName;
+    event.argValue = argValue;
+    event.startTime = startTime - g_traceOrigin.load(std::memory_order_relaxed);
+    event.duration = duration;
+    size_t length = std::min(label.size(), sizeof(event.label) - 1);
+    std::memcpy(event.label, label.c_str(), length);
+    event.label[length] = '\0';
+
+    buffer->next = (buffer->next + 1) % buffer->events.size();
+    if (buffer->count < buffer->events.size())
+    {
+        ++buffer->count;
+    }
+}
+
+void startTracing(size_t eventsPerThread/* = TRACE_DEFAULT_EVENTS_PER_THREAD*/)
+{
+    std::lock_guard<std::mutex> lock(g_traceMutex);
+    g_traceBuffers.clear();
+    g_traceEventsPerThread.store(eventsPerThread);
+    g_traceOrigin.store(getTraceNow());
+    g_traceGeneration.fetch_add(1, std::memory_order_release);
+    g_tracing.store(true);
+}
+
+void stopTracing()
+{
+    g_tracing.store(false);
+}
+
+void setTraceThreadName(const char* threadName)
+{
+    t_traceThreadName = (NULL == threadName) ? "" : threadName;
+    if (t_traceBuffer)
+    {
+        std::lock_guard<std::mutex> lock(t_traceBuffer->mutex);
+        t_traceBuffer->threadName = t_traceThreadName;
+    }
+}
+
+void traceInstant(const char* category, const char* name, const char* argName/* = NULL*/, int64_t argValue/* = 0*/)
+{
+    if (isTracing())
+    {
+        addTraceEvent(category, name, argName, argValue, getTraceNow(), -1, std::string());
+    }
+}
+
+void TraceSpan::begin(const char* category, const char* name)
+{
+    m_category = category;
+    m_name = name;
+    m_startTime = getTraceNow();
+}
+
+void TraceSpan::end()
+{
+    // A span which began before stopTracing is still recorded, so the outer spans, e.g. runImpl, are complete
+    int64_t endTime = getTraceNow();
+    addTraceEvent(m_category, m_name, m_argName, m_argValue, m_startTime, endTime - m_startTime, m_label);
+}
+
+bool writeTrace(const std::string& path)
+{
+    std::vector<std::shared_ptr<TraceBuffer>> buffers;
+    {
+        std::lock_guard<std::mutex> lock(g_traceMutex);
+        buffers = g_traceBuffers;
+    }
+
+    Json::Value eventsObj(Json::arrayValue);
+    for (std::vector<std::shared_ptr<TraceBuffer>>::const_iterator it = buffers.cbegin(); it != buffers.cend(); ++it)
+    {
+        std::lock_guard<std::mutex> lock((*it)->mutex);
+        const TraceBuffer& buffer = *(*it);
+        Json::UInt64 tid = static_cast<Json::UInt64>(buffer.tid);
+        if (!buffer.threadName.empty())
+        {
+            Json::Value metaObj(Json::objectValue);
+            metaObj["ph"] = Json::Value("M");
+            metaObj["name"] = Json::Value("thread_name");
+            metaObj["pid"] = Json::Value(1);
+            metaObj["tid"] = Json::Value(tid);
+            metaObj["args"]["name"] = Json::Value(buffer.threadName);
+            eventsObj.append(metaObj);
+        }
+
+        // The oldest event is at next once the ring is full
+        size_t first = (buffer.count < buffer.events.size()) ? 0 : buffer.next;
+        for (size_t idx = 0; idx < buffer.count; ++idx)
+        {
+            const TraceEvent& event = buffer.events[(first + idx) % buffer.events.size()];
+            Json::Value obj(Json::objectValue);
+            obj["cat"] = Json::Value(event.category);
+            obj["name"] = Json::Value(event.name);
+            obj["pid"] = Json::Value(1);
+            obj["tid"] = Json::Value(tid);
+            obj["ts"] = Json::Value(event.startTime / 1000.0);
+            if (event.duration >= 0)
+            {
+                obj["ph"] = Json::Value("X");
+                obj["dur"] = Json::Value(event.duration / 1000.0);
+            }
+            else
+            {
+                obj["ph"] = Json::Value("i");
+                obj["s"] = Json::Value("t");
+            }
+            if (NULL != event.argName)
+            {
+                obj["args"][event.argName] = Json::Value(static_cast<Json::Int64>(event.argValue));
+            }
+            if ('\0' != event.label[0])
+            {
+                obj["args"]["label"] = Json::Value(event.label);
+            }
+            eventsObj.append(obj);
+        }
+    }
+
+    Json::Value rootObj(Json::objectValue);
+    rootObj["traceEvents"] = eventsObj;
+    rootObj["displayTimeUnit"] = Json::Value("ms");
+    Json::FastWriter writer;
+    return writeFile(path, writer.write(rootObj));
+}
@@ -0,0 +1,101 @@
+//
+//  Tracing.h
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#ifndef Tracing_h
+#define Tracing_h
+
+#include <atomic>
+#include <string>
+#include <cstdint>
+
+// Events kept by each thread, the oldest ones are overwritten once it's full
+#define TRACE_DEFAULT_EVENTS_PER_THREAD     16384
+// Bytes of the label of an event, e.g. the session of exportSession, longer ones are cut
+#define TRACE_LABEL_SIZE                    40
+
+// Spans of the exporting, written in the JSON of Chrome tracing (chrome://tracing, ui.perfetto.dev).
+// It is switched on and off at runtime. While it is off a span costs a relaxed load, while it is on
+// each thread records into a ring buffer of its own, so the threads never wait for each other
+extern std::atomic<bool> g_tracing;
+
+inline bool isTracing()
+{
+    return g_tracing.load(std::memory_order_relaxed);
+}
+
+// The events of a previous tracing are dropped
+void startTracing(size_t eventsPerThread = TRACE_DEFAULT_EVENTS_PER_THREAD);
+void stopTracing();
+// Events recorded since startTracing, it can be called while tracing, e.g. at a checkpoint
+bool writeTrace(const std::string& path);
+
+// The thread shows up with the name in the trace, setThreadName calls it
+void setTraceThreadName(const char* threadName);
+
+// category, name and argName are to be string literals, only the pointers are kept
+void traceInstant(const char* category, const char* name, const char* argName = NULL, int64_t argValue = 0);
+
+class TraceSpan
+{
+public:
+    TraceSpan(const char* category, const char* name) : m_name(NULL), m_argName(NULL), m_argValue(0)
+    {
+        if (isTracing())
+        {
+            begin(category, name);
+        }
+    }
+
+    TraceSpan(const char* category, const char* name, const char* argName, int64_t argValue) : m_name(NULL), m_argName(argName), m_argValue(argValue)
+    {
+        if (isTracing())
+        {
+            begin(category, name);
+        }
+    }
+
+    TraceSpan(const char* category, const char* name, const std::string& label) : m_name(NULL), m_argName(NULL), m_argValue(0)
+    {
+        if (isTracing())
+        {
+            m_label = label;
+            begin(category, name);
+        }
+    }
+
+    ~TraceSpan()
+    {
+        if (NULL != m_name)
+        {
+            end();
+        }
+    }
+
+    // The value known at the end, e.g. the number of messages of a session
+    void setArg(const char* argName, int64_t argValue)
+    {
+        m_argName = argName;
+        m_argValue = argValue;
+    }
+
+private:
+    TraceSpan(const TraceSpan&);
+    TraceSpan& operator=(const TraceSpan&);
+
+    void begin(const char* category, const char* name);
+    void end();
+
+    const char* m_category;
+    const char* m_name;     // NULL if it began while tracing was off
+    const char* m_argName;
+    int64_t m_argValue;
+    int64_t m_startTime;
+    std::string m_label;
+};
+
+#endif /* Tracing_h */
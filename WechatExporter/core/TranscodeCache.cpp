@@ -0,0 +1,152 @@
+//
+//  TranscodeCache.cpp
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#include "TranscodeCache.h"
+#include <json/json.h>
+#include "FileSystem.h"
+#include "Utils.h"
+
+TranscodeCache::TranscodeCache(const std::string& outputDir, const std::string& indexFile) : m_outputDir(outputDir), m_indexFile(indexFile), m_modified(false)
+{
+}
+
+bool TranscodeCache::load()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_entries.clear();
+    m_modified = false;
+
+    std::string contents = readFile(m_indexFile);
+    Json::Reader reader;
+    Json::Value cacheObj;
+    if (contents.empty() || !reader.parse(contents, cacheObj) || !cacheObj.isObject() || !cacheObj["entries"].isArray())
+    {
+        return true;
+    }
+
+    const Json::Value& entryItems = cacheObj["entries"];
+    for (Json::ArrayIndex idx = 0; idx < entryItems.size(); idx++)
+    {
+        const Json::Value& entryObj = entryItems[idx];
+        if (!entryObj.isObject() || !entryObj.isMember("output") || !entryObj.isMember("source") || !entryObj.isMember("size"))
+        {
+            continue;
+        }
+        Entry entry;
+        entry.sourceId = entryObj["source"].asString();
+        entry.sourceTime = entryObj["mtime"].asUInt();
+        entry.size = entryObj["size"].asUInt64();
+        entry.hash = entryObj["hash"].asString();
+        m_entries[entryObj["output"].asString()] = entry;
+    }
+
+    return true;
+}
+
+bool TranscodeCache::save()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_modified)
+    {
+        return true;
+    }
+
+    Json::Value entryItems(Json::arrayValue);
+    for (std::map<std::string, Entry>::const_iterator it = m_entries.cbegin(); it != m_entries.cend(); ++it)
+    {
+        Json::Value entryObj(Json::objectValue);
+        entryObj["output"] = Json::Value(it->first);
+        entryObj["source"] = Json::Value(it->second.sourceId);
+        entryObj["mtime"] = Json::Value(it->second.sourceTime);
+        entryObj["size"] = Json::Value(static_cast<Json::UInt64>(it->second.size));
+        entryObj["hash"] = Json::Value(it->second.hash);
+        entryItems.append(entryObj);
+    }
+
+    Json::Value cacheObj(Json::objectValue);
+    cacheObj["entries"] = entryItems;
+
+    Json::FastWriter writer;
+    std::string tempFile = m_indexFile + ".tmp";
+    if (!writeFile(tempFile, writer.write(cacheObj)) || !moveFile(tempFile, m_indexFile, true))
+    {
+        return false;
+    }
+    m_modified = false;
+    return true;
+}
+
+bool TranscodeCache::find(const std::string& output, const std::string& sourceId, unsigned int sourceTime)
+{
+    if (sourceId.empty())
+    {
+        return false;
+    }
+    std::string key = getKey(output);
+    uint64_t size = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::map<std::string, Entry>::const_iterator it = m_entries.find(key);
+        if (it == m_entries.cend() || it->second.sourceId != sourceId || it->second.sourceTime != sourceTime)
+        {
+            return false;
+        }
+        size = it->second.size;
+    }
+
+    // The size is enough to tell a removed or broken mp3, the hash isn't computed again for every voice
+    return size > 0 && getFileSize(output) == size;
+}
+
+void TranscodeCache::add(const std::string& output, const std::string& sourceId, unsigned int sourceTime)
+{
+    if (sourceId.empty())
+    {
+        return;
+    }
+    std::string contents = readFile(output);
+    if (contents.empty())
+    {
+        return;
+    }
+
+    Entry entry;
+    entry.sourceId = sourceId;
+    entry.sourceTime = sourceTime;
+    entry.size = contents.size();
+    entry.hash = md5(contents);
+
+    std::string key = getKey(output);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_entries[key] = entry;
+    m_modified = true;
+}
+
+void TranscodeCache::remove(const std::string& output)
+{
+    std::string key = getKey(output);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_entries.erase(key) > 0)
+    {
+        m_modified = true;
+    }
+}
+
+std::string TranscodeCache::getKey(const std::string& output) const
+{
+    if (output.size() > m_outputDir.size() && output.compare(0, m_outputDir.size(), m_outputDir) == 0)
+    {
+        std::string::size_type pos = m_outputDir.size();
+        if (output[pos] == '/' || output[pos] == '\\')
+        {
+            ++pos;
+        }
+        return output.substr(pos);
+    }
+    return output;
+}
@@ -0,0 +1,58 @@
+//
+//  TranscodeCache.h
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#ifndef TranscodeCache_h
+#define TranscodeCache_h
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <cstdint>
+
+// Voices transcoded by the previous exportings into the same output, kept in the data folder of the output.
+// An mp3 is taken as it is if it was made from the same file of the backup (fileId and modified time)
+// and it is still there with the same size, so an exporting over an unchanged backup runs no codec at all
+class TranscodeCache
+{
+public:
+    // outputDir: the mp3 files are recorded by their paths relative to it
+    TranscodeCache(const std::string& outputDir, const std::string& indexFile);
+
+    // An empty cache if the index doesn't exist
+    bool load();
+    bool save();
+
+    // true if output was made from the source and is still there
+    bool find(const std::string& output, const std::string& sourceId, unsigned int sourceTime);
+    // output is transcoded from the source, the hash of it is recorded as well
+    void add(const std::string& output, const std::string& sourceId, unsigned int sourceTime);
+    void remove(const std::string& output);
+
+private:
+    TranscodeCache(const TranscodeCache&);
+    TranscodeCache& operator=(const TranscodeCache&);
+
+    struct Entry
+    {
+        std::string sourceId;
+        unsigned int sourceTime;
+        uint64_t size;
+        std::string hash;   // Of the mp3, to verify the output out of the exporting
+    };
+
+    std::string getKey(const std::string& output) const;
+
+    std::string m_outputDir;
+    std::string m_indexFile;
+
+    std::mutex m_mutex;
+    std::map<std::string, Entry> m_entries; // Relative path of the mp3 => entry
+    bool m_modified;
+};
+
+#endif /* TranscodeCache_h */
@@ -0,0 +1,93 @@
+//
+//  UidKeys.cpp
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#include "UidKeys.h"
+#include "Utils.h"
+
+UidKeys::UidKeys()
+{
+}
+
+HashKey UidKeys::get(const std::string& uid)
+{
+    HashKey hash = hashString(uid);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const HashMapEntry<HashKey>* entry = m_keys.find(hash);
+        if (NULL != entry)
+        {
+            return entry->value;
+        }
+    }
+
+    unsigned char digest[16];
+    md5(uid.c_str(), uid.size(), digest);
+    HashKey key = makeHashKey(digest);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    bool inserted = false;
+    m_keys.insert(hash, inserted)->value = key;
+    return key;
+}
+
+void UidKeys::get(const std::vector<std::string>& uids, std::vector<HashKey>& keys)
+{
+    keys.resize(uids.size());
+    std::vector<HashKey> hashes(uids.size());
+    std::vector<size_t> missing;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (size_t idx = 0; idx < uids.size(); ++idx)
+        {
+            hashes[idx] = hashString(uids[idx]);
+            const HashMapEntry<HashKey>* entry = m_keys.find(hashes[idx]);
+            if (NULL != entry)
+            {
+                keys[idx] = entry->value;
+            }
+            else
+            {
+                missing.push_back(idx);
+            }
+        }
+    }
+    if (missing.empty())
+    {
+        return;
+    }
+
+    std::vector<std::string> values;
+    values.reserve(missing.size());
+    for (std::vector<size_t>::const_iterator it = missing.cbegin(); it != missing.cend(); ++it)
+    {
+        values.push_back(uids[*it]);
+    }
+    std::vector<unsigned char> digests(values.size() * 16);
+    md5(&values[0], values.size(), &digests[0]);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (size_t idx = 0; idx < missing.size(); ++idx)
+    {
+        HashKey key = makeHashKey(&digests[idx * 16]);
+        keys[missing[idx]] = key;
+        bool inserted = false;
+        m_keys.insert(hashes[missing[idx]], inserted)->value = key;
+    }
+}
+
+size_t UidKeys::size() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_keys.size();
+}
+
+void UidKeys::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_keys.clear();
+}
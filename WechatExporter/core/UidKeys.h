@@ -0,0 +1,39 @@
+//
+//  UidKeys.h
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#ifndef UidKeys_h
+#define UidKeys_h
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include "HashTable.h"
+
+// MD5 keys of the uids, kept for the export: the contacts, the members of the groups and the senders
+// are the same uids over and over. Shared by the threads, the uids not seen yet are hashed in one batch
+class UidKeys
+{
+public:
+    UidKeys();
+
+    HashKey get(const std::string& uid);
+    // keys[i] is the key of uids[i]
+    void get(const std::vector<std::string>& uids, std::vector<HashKey>& keys);
+
+    size_t size() const;
+    void clear();
+
+private:
+    UidKeys(const UidKeys&);
+    UidKeys& operator=(const UidKeys&);
+
+    mutable std::mutex m_mutex;
+    HashMap<HashKey> m_keys;    // hashString(uid) => MD5 of uid
+};
+
+#endif /* UidKeys_h */
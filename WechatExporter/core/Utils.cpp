@@ -16,7 +16,11 @@
 #include <codecvt>
 #include <locale>
 #include <cstdio>
+#include <cstring>
+#include <cstdlib>
 #include <chrono>
+#include <map>
+#include <mutex>
 #ifdef _WIN32
 #include <direct.h>
 #include <atlstr.h>
@@ -32,29 +36,185 @@
 #include <sys/stat.h>
 #include <time.h>
 #include <sqlite3.h>
-#include <curl/curl.h>
+#include <zlib.h>
 #include "FileSystem.h"
+// SSE2 is there on every x64 cpu and NEON on every arm64 one
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SCAN_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define SCAN_NEON
+#endif
 
-void replaceAll(std::string& input, const std::string& search, const std::string& replace)
+#define SCAN_MAX_SIMD_CHARS  8
+
+// Number of leading bytes which are none of chars
+static size_t scanUntilAnyOf(const char* str, size_t length, const char* chars, size_t numberOfChars)
 {
     size_t pos = 0;
-    while((pos = input.find(search, pos)) != std::string::npos)
+#if defined(SCAN_SSE2)
+    if (numberOfChars <= SCAN_MAX_SIMD_CHARS)
+    {
+        __m128i needles[SCAN_MAX_SIMD_CHARS];
+        for (size_t idx = 0; idx < numberOfChars; ++idx)
+        {
+            needles[idx] = _mm_set1_epi8(chars[idx]);
+        }
+        for (; pos + 16 <= length; pos += 16)
+        {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(str + pos));
+            __m128i found = _mm_setzero_si128();
+            for (size_t idx = 0; idx < numberOfChars; ++idx)
+            {
+                found = _mm_or_si128(found, _mm_cmpeq_epi8(bytes, needles[idx]));
+            }
+            if (_mm_movemask_epi8(found) != 0)
+            {
+                break;
+            }
+        }
+    }
+#elif defined(SCAN_NEON)
+    if (numberOfChars <= SCAN_MAX_SIMD_CHARS)
+    {
+        uint8x16_t needles[SCAN_MAX_SIMD_CHARS];
+        for (size_t idx = 0; idx < numberOfChars; ++idx)
+        {
+            needles[idx] = vdupq_n_u8(static_cast<uint8_t>(chars[idx]));
+        }
+        for (; pos + 16 <= length; pos += 16)
+        {
+            uint8x16_t bytes = vld1q_u8(reinterpret_cast<const uint8_t *>(str + pos));
+            uint8x16_t found = vdupq_n_u8(0);
+            for (size_t idx = 0; idx < numberOfChars; ++idx)
+            {
+                found = vorrq_u8(found, vceqq_u8(bytes, needles[idx]));
+            }
+            if (vmaxvq_u8(found) != 0)
+            {
+                break;
+            }
+        }
+    }
+#endif
+    // The rest of the block which has the char, or everything without SIMD
+    if (numberOfChars == 1)
+    {
+        const void* found = std::memchr(str + pos, chars[0], length - pos);
+        return (NULL == found) ? length : (reinterpret_cast<const char *>(found) - str);
+    }
+    bool table[256] = { false };
+    for (size_t idx = 0; idx < numberOfChars; ++idx)
+    {
+        table[static_cast<unsigned char>(chars[idx])] = true;
+    }
+    for (; pos < length; ++pos)
+    {
+        if (table[static_cast<unsigned char>(str[pos])])
+        {
+            break;
+        }
+    }
+    return pos;
+}
+
+void replaceAll(std::string& input, const std::string& search, const std::string& replace)
+{
+    if (search.empty())
+    {
+        return;
+    }
+    size_t pos = input.find(search);
+    if (pos == std::string::npos)
     {
-        input.replace(pos, search.length(), replace);
-         pos += replace.length();
+        return;
     }
+    
+    // Build it once instead of moving the tail for every match
+    std::string result;
+    result.reserve(input.size() + (replace.size() > search.size() ? (replace.size() - search.size()) * 4 : 0));
+    size_t start = 0;
+    while (pos != std::string::npos)
+    {
+        result.append(input, start, pos - start);
+        result.append(replace);
+        start = pos + search.size();
+        pos = input.find(search, start);
+    }
+    result.append(input, start, std::string::npos);
+    input.swap(result);
 }
 
+// One pass for all pairs: at every position the first pair whose key matches is replaced, and replaced text is not searched again
+// It is the same as replacing the pairs one after another as long as the replacements don't make or break the keys of later pairs
 void replaceAll(std::string& input, const std::vector<std::pair<std::string, std::string>>& pairs)
 {
+    // Candidates are found by the first bytes of the keys
+    char firstChars[256];
+    size_t numberOfFirstChars = 0;
+    bool seen[256] = { false };
     for (std::vector<std::pair<std::string, std::string>>::const_iterator it = pairs.cbegin(); it != pairs.cend(); ++it)
     {
-        size_t pos = 0;
-        while((pos = input.find(it->first, pos)) != std::string::npos)
+        if (it->first.empty())
+        {
+            continue;
+        }
+        unsigned char ch = static_cast<unsigned char>(it->first[0]);
+        if (!seen[ch])
+        {
+            seen[ch] = true;
+            firstChars[numberOfFirstChars++] = static_cast<char>(ch);
+        }
+    }
+    if (numberOfFirstChars == 0)
+    {
+        return;
+    }
+    
+    const char* str = input.c_str();
+    const size_t length = input.size();
+    std::string result;
+    bool replaced = false;
+    size_t start = 0;   // Beginning of the text which has not been copied into result
+    size_t pos = 0;
+    while (pos < length)
+    {
+        pos += scanUntilAnyOf(str + pos, length - pos, firstChars, numberOfFirstChars);
+        if (pos >= length)
+        {
+            break;
+        }
+        
+        std::vector<std::pair<std::string, std::string>>::const_iterator it = pairs.cbegin();
+        for (; it != pairs.cend(); ++it)
+        {
+            if (!it->first.empty() && it->first.size() <= length - pos && std::memcmp(str + pos, it->first.c_str(), it->first.size()) == 0)
+            {
+                break;
+            }
+        }
+        if (it == pairs.cend())
+        {
+            ++pos;
+            continue;
+        }
+        
+        if (!replaced)
         {
-            input.replace(pos, it->first.length(), it->second);
-            pos += it->second.length();
+            result.reserve(length + length / 8);
+            replaced = true;
         }
+        result.append(str + start, pos - start);
+        result.append(it->second);
+        pos += it->first.size();
+        start = pos;
+    }
+    
+    if (replaced)
+    {
+        result.append(str + start, length - start);
+        input.swap(result);
     }
 }
 
@@ -135,11 +295,64 @@ std::string join(std::vector<std::string>::const_iterator b, std::vector<std::st
     return os.str();
 }
 
+static const char SAFE_HTML_CHARS[] = "& <>\r\n";
+
+// Replaces & => &amp;, space => &nbsp;, < => &lt;, > => &gt;, \r\n/\r/\n => <br/> like it is done one after another
 std::string safeHTML(const std::string& s)
 {
-    static std::vector<std::pair<std::string, std::string>> replaces =
-    { {"&", "&amp;"}, {" ", "&nbsp;"}, {"<", "&lt;"}, {">", "&gt;"}, {"\r\n", "<br/>"}, {"\r", "<br/>"}, {"\n", "<br/>"} };
-    return replaceAll(s, replaces);
+    size_t pos = scanUntilAnyOf(s.c_str(), s.size(), SAFE_HTML_CHARS, sizeof(SAFE_HTML_CHARS) - 1);
+    if (pos >= s.size())
+    {
+        return s;
+    }
+    std::string result;
+    result.reserve(s.size() + s.size() / 4);
+    result.append(s, 0, pos);
+    appendSafeHTML(result, s.c_str() + pos, s.size() - pos);
+    return result;
+}
+
+// Same as safeHTML in one pass
+void appendSafeHTML(std::string& output, const char* str, size_t length)
+{
+    const char* end = str + length;
+    output.reserve(output.size() + length);
+    while (str < end)
+    {
+        const char* ptr = str + scanUntilAnyOf(str, end - str, SAFE_HTML_CHARS, sizeof(SAFE_HTML_CHARS) - 1);
+        output.append(str, ptr - str);
+        if (ptr >= end)
+        {
+            break;
+        }
+        
+        switch (*ptr)
+        {
+            case '&':
+                output.append("&amp;");
+                break;
+            case ' ':
+                output.append("&nbsp;");
+                break;
+            case '<':
+                output.append("&lt;");
+                break;
+            case '>':
+                output.append("&gt;");
+                break;
+            case '\r':
+                if (ptr + 1 < end && *(ptr + 1) == '\n')
+                {
+                    ++ptr;
+                }
+                output.append("<br/>");
+                break;
+            default:
+                output.append("<br/>");
+                break;
+        }
+        str = ptr + 1;
+    }
 }
 
 void removeHtmlTags(std::string& html)
@@ -157,6 +370,104 @@ void removeHtmlTags(std::string& html)
     }
 }
 
+void appendHtmlText(std::string& output, const char* html, size_t length)
+{
+    const char* end = html + length;
+    output.reserve(output.size() + length);
+    while (html < end)
+    {
+        if (*html == '<')
+        {
+            const char* close = std::find(html, end, '>');
+            if (close - html >= 3 && (html[1] == 'b' || html[1] == 'B') && (html[2] == 'r' || html[2] == 'R'))
+            {
+                output.push_back('\n');
+            }
+            html = (close == end) ? end : (close + 1);
+        }
+        else if (*html == '&')
+        {
+            html = decodeHtmlEntity(html, end, output);
+        }
+        else
+        {
+            output.push_back(*html++);
+        }
+    }
+}
+
+void appendUtf8(std::string& output, uint32_t ch)
+{
+    if (ch < 0x80)
+    {
+        output.push_back(static_cast<char>(ch));
+    }
+    else if (ch < 0x800)
+    {
+        output.push_back(static_cast<char>(0xC0 | (ch >> 6)));
+        output.push_back(static_cast<char>(0x80 | (ch & 0x3F)));
+    }
+    else if (ch < 0x10000)
+    {
+        output.push_back(static_cast<char>(0xE0 | (ch >> 12)));
+        output.push_back(static_cast<char>(0x80 | ((ch >> 6) & 0x3F)));
+        output.push_back(static_cast<char>(0x80 | (ch & 0x3F)));
+    }
+    else if (ch < 0x110000)
+    {
+        output.push_back(static_cast<char>(0xF0 | (ch >> 18)));
+        output.push_back(static_cast<char>(0x80 | ((ch >> 12) & 0x3F)));
+        output.push_back(static_cast<char>(0x80 | ((ch >> 6) & 0x3F)));
+        output.push_back(static_cast<char>(0x80 | (ch & 0x3F)));
+    }
+}
+
+const char* decodeHtmlEntity(const char* p, const char* end, std::string& output)
+{
+    const char* semicolon = std::find(p, std::min(end, p + 12), ';');
+    if (semicolon == end || *semicolon != ';')
+    {
+        output.push_back('&');
+        return p + 1;
+    }
+
+    std::string name(p + 1, semicolon);
+    if (name == "amp")
+    {
+        output.push_back('&');
+    }
+    else if (name == "lt")
+    {
+        output.push_back('<');
+    }
+    else if (name == "gt")
+    {
+        output.push_back('>');
+    }
+    else if (name == "quot")
+    {
+        output.push_back('"');
+    }
+    else if (name == "apos")
+    {
+        output.push_back('\'');
+    }
+    else if (name == "nbsp")
+    {
+        output.push_back(' ');
+    }
+    else if (name.size() > 1 && name[0] == '#')
+    {
+        bool hex = name[1] == 'x' || name[1] == 'X';
+        appendUtf8(output, static_cast<uint32_t>(std::strtoul(name.c_str() + (hex ? 2 : 1), NULL, hex ? 16 : 10)));
+    }
+    else
+    {
+        output.append(p, semicolon + 1);
+    }
+    return semicolon + 1;
+}
+
 std::string removeCdata(const std::string& str)
 {
     if (startsWith(str, "<![CDATA[") && endsWith(str, "]]>")) return str.substr(9, str.size() - 12);
@@ -174,6 +485,71 @@ std::string fromUnixTime(unsigned int unixtime)
     return ss.str();
 }
 
+static bool getLocalTime(std::time_t time, std::tm& tm)
+{
+#ifdef _WIN32
+    return localtime_s(&tm, &time) == 0;
+#else
+    return localtime_r(&time, &tm) != NULL;
+#endif
+}
+
+TimestampFormatter::TimestampFormatter() : m_dayStart(0), m_dayEnd(0), m_dateLength(0)
+{
+    m_date[0] = '\0';
+}
+
+void TimestampFormatter::format(unsigned int unixtime, std::string& output)
+{
+    std::time_t time = static_cast<std::time_t>(static_cast<std::uint32_t>(unixtime));
+    output.clear();
+    int secondsOfDay = 0;
+    if (m_dayEnd != 0 && time >= m_dayStart && time < m_dayEnd)
+    {
+        secondsOfDay = static_cast<int>(time - m_dayStart);
+    }
+    else
+    {
+        std::tm tm;
+        if (!getLocalTime(time, tm))
+        {
+            m_dayEnd = 0;
+            output = fromUnixTime(unixtime);
+            return;
+        }
+        m_dateLength = std::strftime(m_date, sizeof(m_date), "%Y-%m-%d ", &tm);
+        secondsOfDay = tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec;
+        m_dayStart = time - secondsOfDay;
+        m_dayEnd = m_dayStart + 86400;
+        
+        // The day is only cached when it has no DST change, i.e. both ends of it are on the same local date
+        std::tm tmStart;
+        std::tm tmEnd;
+        if (!getLocalTime(m_dayStart, tmStart) || !getLocalTime(m_dayEnd - 1, tmEnd) || tmStart.tm_hour != 0 || tmStart.tm_min != 0 || tmStart.tm_sec != 0 || tmEnd.tm_hour != 23 || tmEnd.tm_min != 59 || tmEnd.tm_sec != 59 || tmStart.tm_mday != tm.tm_mday || tmEnd.tm_mday != tm.tm_mday)
+        {
+            m_dayEnd = 0;
+        }
+        // Leap seconds are not counted by time_t
+        if (secondsOfDay >= 86400)
+        {
+            m_dayEnd = 0;
+            char buffer[16];
+            size_t length = std::strftime(buffer, sizeof(buffer), "%H:%M:%S", &tm);
+            output.append(m_date, m_dateLength);
+            output.append(buffer, length);
+            return;
+        }
+    }
+    
+    int hour = secondsOfDay / 3600;
+    int minute = (secondsOfDay / 60) % 60;
+    int second = secondsOfDay % 60;
+    char buffer[8] = {static_cast<char>('0' + hour / 10), static_cast<char>('0' + hour % 10), ':', static_cast<char>('0' + minute / 10), static_cast<char>('0' + minute % 10), ':', static_cast<char>('0' + second / 10), static_cast<char>('0' + second % 10)};
+    output.reserve(m_dateLength + sizeof(buffer));
+    output.append(m_date, m_dateLength);
+    output.append(buffer, sizeof(buffer));
+}
+
 uint32_t getUnixTimeStamp()
 {
 	time_t rawTime = 0;
@@ -331,7 +707,7 @@ bool deleteFile(const std::string& fileName)
 }
 */
 
-int openSqlite3ReadOnly(const std::string& path, sqlite3 **ppDb)
+static std::string buildSqliteUri(const std::string& path)
 {
     std::string sep(1, DIR_SEP);
     std::string encodedPath;
@@ -361,23 +737,12 @@ int openSqlite3ReadOnly(const std::string& path, sqlite3 **ppDb)
     std::vector<std::string> encodedParts;
     encodedPath.reserve(parts.size() + 1);
 
-    CURL *curl = curl_easy_init();
-    if (curl)
+    encodedParts.reserve(parts.size());
+    for (std::vector<std::string>::const_iterator it = parts.cbegin(); it != parts.cend(); ++it)
     {
-        for (std::vector<std::string>::const_iterator it = parts.cbegin(); it != parts.cend(); ++it)
-        {
-            char *ptr = curl_easy_escape(curl, it->c_str(), static_cast<int>(it->size()));
-            if (ptr)
-            {
-                encodedParts.push_back(std::string(ptr));
-                curl_free(ptr);
-            }
-        }
-
-        curl_easy_cleanup(curl);
-
-        encodedPath = join(encodedParts, sep.c_str());
+        encodedParts.push_back(encodeUrl(*it));
     }
+    encodedPath = join(encodedParts, sep.c_str());
 
 #ifdef _WIN32
     if (driveLen == 0)
@@ -403,8 +768,85 @@ int openSqlite3ReadOnly(const std::string& path, sqlite3 **ppDb)
     // std::string pathWithQuery = "file:" + path;
     pathWithQuery += "?immutable=1&mode=ro";
     
+    return pathWithQuery;
+}
+
+Sqlite3ReadProfile::Sqlite3ReadProfile() : cacheSizeKb(8 * 1024), scanCacheSizeKb(64 * 1024), tempStoreInMemory(true)
+{
+    // Same as the default SQLITE_MAX_MMAP_SIZE, keep the address space for the others on 32-bit platforms
+    maxMmapSize = (sizeof(void *) > 4) ? 0x7fff0000 : (256 * 1024 * 1024);
+}
+
+static std::mutex g_sqlite3ReadProfileMutex;
+static Sqlite3ReadProfile g_sqlite3ReadProfile;
+
+void setSqlite3ReadProfile(const Sqlite3ReadProfile& profile)
+{
+    std::lock_guard<std::mutex> lock(g_sqlite3ReadProfileMutex);
+    g_sqlite3ReadProfile = profile;
+}
+
+Sqlite3ReadProfile getSqlite3ReadProfile()
+{
+    std::lock_guard<std::mutex> lock(g_sqlite3ReadProfileMutex);
+    return g_sqlite3ReadProfile;
+}
+
+static void applySqlite3ReadProfile(sqlite3 *db, const std::string& path, bool forScanning)
+{
+    Sqlite3ReadProfile profile = getSqlite3ReadProfile();
+    
+    int64_t mmapSize = 0;
+    uint64_t fileSize = 0;
+    std::time_t modifiedTime = 0;
+    if (profile.maxMmapSize > 0 && getFileInfo(path, fileSize, modifiedTime))
+    {
+        mmapSize = std::min(static_cast<int64_t>(fileSize), profile.maxMmapSize);
+    }
+    int cacheSizeKb = forScanning ? profile.scanCacheSizeKb : profile.cacheSizeKb;
+    
+    std::string sql = "PRAGMA mmap_size=" + std::to_string(mmapSize) + ";";
+    if (cacheSizeKb > 0)
+    {
+        // Negative value is in KiB instead of pages
+        sql += "PRAGMA cache_size=-" + std::to_string(cacheSizeKb) + ";";
+    }
+    if (profile.tempStoreInMemory)
+    {
+        sql += "PRAGMA temp_store=MEMORY;";
+    }
+    sqlite3_exec(db, sql.c_str(), NULL, NULL, NULL);
+}
+
+int openSqlite3ReadOnly(const std::string& path, sqlite3 **ppDb, bool forScanning/* = false*/)
+{
+    // The same databases are opened for every session, escape each path only once
+    static std::mutex uriMutex;
+    static std::map<std::string, std::string> uris;
+    
+    std::string pathWithQuery;
+    {
+        std::lock_guard<std::mutex> lock(uriMutex);
+        std::map<std::string, std::string>::const_iterator it = uris.find(path);
+        if (it != uris.cend())
+        {
+            pathWithQuery = it->second;
+        }
+    }
+    if (pathWithQuery.empty())
+    {
+        pathWithQuery = buildSqliteUri(path);
+        std::lock_guard<std::mutex> lock(uriMutex);
+        uris[path] = pathWithQuery;
+    }
+    
     // return sqlite3_open_v2(path.c_str(), ppDb, SQLITE_OPEN_READONLY, NULL);
-    return sqlite3_open_v2(pathWithQuery.c_str(), ppDb, SQLITE_OPEN_READONLY | SQLITE_OPEN_URI, NULL);
+    int rc = sqlite3_open_v2(pathWithQuery.c_str(), ppDb, SQLITE_OPEN_READONLY | SQLITE_OPEN_URI, NULL);
+    if (rc == SQLITE_OK)
+    {
+        applySqlite3ReadProfile(*ppDb, path, forScanning);
+    }
+    return rc;
 }
 
 int GetBigEndianInteger(const unsigned char* data, int startIndex/* = 0*/)
@@ -423,25 +865,357 @@ int GetLittleEndianInteger(const unsigned char* data, int startIndex/* = 0*/)
          | data[startIndex];
 }
 
-std::string encodeUrl(const std::string& url)
+static inline bool isUrlUnreservedChar(unsigned char ch)
+{
+    return (ch >= '0' && ch <= '9') || (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || ch == '-' || ch == '.' || ch == '_' || ch == '~';
+}
+
+// Number of leading bytes which are kept by encodeUrl
+static size_t scanUrlUnreservedChars(const char* str, size_t length)
+{
+    size_t pos = 0;
+#if defined(SCAN_SSE2)
+    // ch is in [lo, hi] if (ch - lo) as an unsigned byte is no more than (hi - lo)
+    const __m128i digitLow = _mm_set1_epi8('0');
+    const __m128i digitSpan = _mm_set1_epi8(9);
+    const __m128i alphaLow = _mm_set1_epi8('a');
+    const __m128i alphaSpan = _mm_set1_epi8(25);
+    const __m128i lowerCase = _mm_set1_epi8(0x20);
+    const __m128i hyphen = _mm_set1_epi8('-');
+    const __m128i dot = _mm_set1_epi8('.');
+    const __m128i underscore = _mm_set1_epi8('_');
+    const __m128i tilde = _mm_set1_epi8('~');
+    for (; pos + 16 <= length; pos += 16)
+    {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(str + pos));
+        __m128i digits = _mm_sub_epi8(bytes, digitLow);
+        __m128i alphas = _mm_sub_epi8(_mm_or_si128(bytes, lowerCase), alphaLow);
+        __m128i safe = _mm_cmpeq_epi8(_mm_min_epu8(digits, digitSpan), digits);
+        safe = _mm_or_si128(safe, _mm_cmpeq_epi8(_mm_min_epu8(alphas, alphaSpan), alphas));
+        safe = _mm_or_si128(safe, _mm_or_si128(_mm_cmpeq_epi8(bytes, hyphen), _mm_cmpeq_epi8(bytes, dot)));
+        safe = _mm_or_si128(safe, _mm_or_si128(_mm_cmpeq_epi8(bytes, underscore), _mm_cmpeq_epi8(bytes, tilde)));
+        if (_mm_movemask_epi8(safe) != 0xFFFF)
+        {
+            break;
+        }
+    }
+#elif defined(SCAN_NEON)
+    const uint8x16_t digitLow = vdupq_n_u8('0');
+    const uint8x16_t digitSpan = vdupq_n_u8(9);
+    const uint8x16_t alphaLow = vdupq_n_u8('a');
+    const uint8x16_t alphaSpan = vdupq_n_u8(25);
+    const uint8x16_t lowerCase = vdupq_n_u8(0x20);
+    for (; pos + 16 <= length; pos += 16)
+    {
+        uint8x16_t bytes = vld1q_u8(reinterpret_cast<const uint8_t *>(str + pos));
+        uint8x16_t safe = vcleq_u8(vsubq_u8(bytes, digitLow), digitSpan);
+        safe = vorrq_u8(safe, vcleq_u8(vsubq_u8(vorrq_u8(bytes, lowerCase), alphaLow), alphaSpan));
+        safe = vorrq_u8(safe, vorrq_u8(vceqq_u8(bytes, vdupq_n_u8('-')), vceqq_u8(bytes, vdupq_n_u8('.'))));
+        safe = vorrq_u8(safe, vorrq_u8(vceqq_u8(bytes, vdupq_n_u8('_')), vceqq_u8(bytes, vdupq_n_u8('~'))));
+        if (vminvq_u8(safe) == 0)
+        {
+            break;
+        }
+    }
+#endif
+    for (; pos < length; ++pos)
+    {
+        if (!isUrlUnreservedChar(static_cast<unsigned char>(str[pos])))
+        {
+            break;
+        }
+    }
+    return pos;
+}
+
+void appendBase64(std::string& output, const unsigned char* data, size_t length)
+{
+    static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    output.reserve(output.size() + (length + 2) / 3 * 4);
+    size_t idx = 0;
+    for (; idx + 2 < length; idx += 3)
+    {
+        unsigned int value = (data[idx] << 16) | (data[idx + 1] << 8) | data[idx + 2];
+        output.push_back(chars[(value >> 18) & 0x3F]);
+        output.push_back(chars[(value >> 12) & 0x3F]);
+        output.push_back(chars[(value >> 6) & 0x3F]);
+        output.push_back(chars[value & 0x3F]);
+    }
+    if (idx < length)
+    {
+        unsigned int value = data[idx] << 16;
+        if (idx + 1 < length)
+        {
+            value |= data[idx + 1] << 8;
+        }
+        output.push_back(chars[(value >> 18) & 0x3F]);
+        output.push_back(chars[(value >> 12) & 0x3F]);
+        output.push_back(idx + 1 < length ? chars[(value >> 6) & 0x3F] : '=');
+        output.push_back('=');
+    }
+}
+
+bool decodeBase64(const char* data, size_t length, std::vector<unsigned char>& output)
 {
-    std::string encodedUrl = url;
-    CURL *curl = curl_easy_init();
-    if(curl)
+    output.clear();
+    output.reserve(length / 4 * 3);
+    unsigned int value = 0;
+    int bits = 0;
+    for (size_t idx = 0; idx < length; ++idx)
     {
-        char *output = curl_easy_escape(curl, url.c_str(), static_cast<int>(url.size()));
-        if(output)
+        char ch = data[idx];
+        int digit = -1;
+        if (ch >= 'A' && ch <= 'Z')
+            digit = ch - 'A';
+        else if (ch >= 'a' && ch <= 'z')
+            digit = ch - 'a' + 26;
+        else if (ch >= '0' && ch <= '9')
+            digit = ch - '0' + 52;
+        else if (ch == '+')
+            digit = 62;
+        else if (ch == '/')
+            digit = 63;
+        else if (ch == '=')
+            break;
+        else if (ch == ' ' || ch == '\r' || ch == '\n' || ch == '\t')
+            continue;
+        else
+            return false;
+        
+        value = (value << 6) | static_cast<unsigned int>(digit);
+        bits += 6;
+        if (bits >= 8)
         {
-            encodedUrl = output;
-            curl_free(output);
+            bits -= 8;
+            output.push_back(static_cast<unsigned char>((value >> bits) & 0xFF));
         }
+    }
+    return true;
+}
+
+bool compressZlib(const char* data, size_t length, std::string& output, int level/* = 6*/)
+{
+    uLongf size = compressBound(static_cast<uLong>(length));
+    output.resize(size);
+    if (compress2(reinterpret_cast<Bytef *>(&output[0]), &size, reinterpret_cast<const Bytef *>(data), static_cast<uLong>(length), level) != Z_OK)
+    {
+        output.clear();
+        return false;
+    }
+    output.resize(size);
+    return true;
+}
+
+// Same as curl_easy_escape: everything but ALPHA, DIGIT, "-", ".", "_" and "~" is encoded as %XX
+std::string encodeUrl(const std::string& url)
+{
+    const char* str = url.c_str();
+    const size_t length = url.size();
+    size_t pos = scanUrlUnreservedChars(str, length);
+    if (pos >= length)
+    {
+        return url;
+    }
+    
+    static const char hexChars[] = "0123456789ABCDEF";
+    std::string encodedUrl;
+    encodedUrl.reserve(length + (length - pos) * 2);
+    encodedUrl.append(str, pos);
+    while (pos < length)
+    {
+        unsigned char ch = static_cast<unsigned char>(str[pos++]);
+        char buffer[3] = { '%', hexChars[ch >> 4], hexChars[ch & 0x0F] };
+        encodedUrl.append(buffer, 3);
         
-        curl_easy_cleanup(curl);
+        size_t count = scanUrlUnreservedChars(str + pos, length - pos);
+        encodedUrl.append(str + pos, count);
+        pos += count;
     }
     
     return encodedUrl;
 }
 
+// Number of leading bytes which can be copied into a JSON string literal as they are
+static size_t scanJsonSafeChars(const char* str, size_t length, bool escapingUnicode)
+{
+    size_t pos = 0;
+#if defined(SCAN_SSE2)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i maxControl = _mm_set1_epi8(0x1F);
+    for (; pos + 16 <= length; pos += 16)
+    {
+        __m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i *>(str + pos));
+        // Unsigned chars <= 0x1F
+        __m128i special = _mm_cmpeq_epi8(_mm_min_epu8(chars, maxControl), chars);
+        special = _mm_or_si128(special, _mm_or_si128(_mm_cmpeq_epi8(chars, quote), _mm_cmpeq_epi8(chars, backslash)));
+        int mask = _mm_movemask_epi8(special);
+        if (escapingUnicode)
+        {
+            // High bit of each byte, all of non-ASCII chars
+            mask |= _mm_movemask_epi8(chars);
+        }
+        if (mask != 0)
+        {
+            break;
+        }
+    }
+#elif defined(SCAN_NEON)
+    const uint8x16_t quote = vdupq_n_u8('"');
+    const uint8x16_t backslash = vdupq_n_u8('\\');
+    const uint8x16_t minPrintable = vdupq_n_u8(0x20);
+    const uint8x16_t minNonAscii = vdupq_n_u8(escapingUnicode ? 0x80 : 0xFF);
+    for (; pos + 16 <= length; pos += 16)
+    {
+        uint8x16_t chars = vld1q_u8(reinterpret_cast<const uint8_t *>(str + pos));
+        uint8x16_t special = vorrq_u8(vcltq_u8(chars, minPrintable), vorrq_u8(vceqq_u8(chars, quote), vceqq_u8(chars, backslash)));
+        if (escapingUnicode)
+        {
+            special = vorrq_u8(special, vcgeq_u8(chars, minNonAscii));
+        }
+        if (vmaxvq_u8(special) != 0)
+        {
+            break;
+        }
+    }
+#endif
+    for (; pos < length; ++pos)
+    {
+        unsigned char ch = static_cast<unsigned char>(str[pos]);
+        if (ch < 0x20 || ch == '"' || ch == '\\' || (escapingUnicode && ch >= 0x80))
+        {
+            break;
+        }
+    }
+    return pos;
+}
+
+static inline void appendJsonHex16(std::string& output, unsigned int value)
+{
+    static const char hexChars[] = "0123456789abcdef";
+    char buffer[6] = { '\\', 'u', hexChars[(value >> 12) & 0x0F], hexChars[(value >> 8) & 0x0F], hexChars[(value >> 4) & 0x0F], hexChars[value & 0x0F] };
+    output.append(buffer, 6);
+}
+
+// Same as utf8ToCodepoint of jsoncpp, including the replacement of invalid sequences
+static unsigned int decodeJsonCodepoint(const char*& s, const char* e)
+{
+    const unsigned int REPLACEMENT_CHARACTER = 0xFFFD;
+    unsigned int firstByte = static_cast<unsigned char>(*s);
+    if (firstByte < 0x80)
+    {
+        return firstByte;
+    }
+    if (firstByte < 0xE0)
+    {
+        if (e - s < 2)
+        {
+            return REPLACEMENT_CHARACTER;
+        }
+        unsigned int calculated = ((firstByte & 0x1F) << 6) | (static_cast<unsigned int>(s[1]) & 0x3F);
+        s += 1;
+        return calculated < 0x80 ? REPLACEMENT_CHARACTER : calculated;
+    }
+    if (firstByte < 0xF0)
+    {
+        if (e - s < 3)
+        {
+            return REPLACEMENT_CHARACTER;
+        }
+        unsigned int calculated = ((firstByte & 0x0F) << 12) | ((static_cast<unsigned int>(s[1]) & 0x3F) << 6) | (static_cast<unsigned int>(s[2]) & 0x3F);
+        s += 2;
+        if (calculated >= 0xD800 && calculated <= 0xDFFF)
+        {
+            return REPLACEMENT_CHARACTER;
+        }
+        return calculated < 0x800 ? REPLACEMENT_CHARACTER : calculated;
+    }
+    if (firstByte < 0xF8)
+    {
+        if (e - s < 4)
+        {
+            return REPLACEMENT_CHARACTER;
+        }
+        unsigned int calculated = ((firstByte & 0x07) << 18) | ((static_cast<unsigned int>(s[1]) & 0x3F) << 12) | ((static_cast<unsigned int>(s[2]) & 0x3F) << 6) | (static_cast<unsigned int>(s[3]) & 0x3F);
+        s += 3;
+        return calculated < 0x10000 ? REPLACEMENT_CHARACTER : calculated;
+    }
+    return REPLACEMENT_CHARACTER;
+}
+
+void appendJsonString(std::string& output, const char* str, size_t length, bool escapingUnicode/* = true*/)
+{
+    const char* end = str + length;
+    output.reserve(output.size() + length + 2);
+    output.push_back('"');
+    while (str < end)
+    {
+        size_t safeLength = scanJsonSafeChars(str, end - str, escapingUnicode);
+        output.append(str, safeLength);
+        str += safeLength;
+        if (str >= end)
+        {
+            break;
+        }
+        
+        switch (*str)
+        {
+            case '"':
+                output.append("\\\"", 2);
+                break;
+            case '\\':
+                output.append("\\\\", 2);
+                break;
+            case '\b':
+                output.append("\\b", 2);
+                break;
+            case '\f':
+                output.append("\\f", 2);
+                break;
+            case '\n':
+                output.append("\\n", 2);
+                break;
+            case '\r':
+                output.append("\\r", 2);
+                break;
+            case '\t':
+                output.append("\\t", 2);
+                break;
+            default:
+            {
+                if (!escapingUnicode)
+                {
+                    // Control chars only
+                    appendJsonHex16(output, static_cast<unsigned char>(*str));
+                    break;
+                }
+                unsigned int codepoint = decodeJsonCodepoint(str, end);
+                if (codepoint < 0x20)
+                {
+                    appendJsonHex16(output, codepoint);
+                }
+                else if (codepoint < 0x80)
+                {
+                    output.push_back(static_cast<char>(codepoint));
+                }
+                else if (codepoint < 0x10000)
+                {
+                    appendJsonHex16(output, codepoint);
+                }
+                else
+                {
+                    codepoint -= 0x10000;
+                    appendJsonHex16(output, 0xD800 + ((codepoint >> 10) & 0x3FF));
+                    appendJsonHex16(output, 0xDC00 + (codepoint & 0x3FF));
+                }
+                break;
+            }
+        }
+        ++str;
+    }
+    output.push_back('"');
+}
+
 long long diff_tm(struct tm *a, struct tm *b) {
     return a->tm_sec - b->tm_sec
         + 60LL * (a->tm_min - b->tm_min)
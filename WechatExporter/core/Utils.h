@@ -8,16 +8,22 @@
 
 #include <string>
 #include <vector>
+#include <ctime>
 #include <map>
 #include <thread>
 #include <locale>
+#include <functional>
+#include <cstdint>
 
 #ifdef _WIN32
 #include <io.h>
 typedef int mode_t;
 #endif
 
+// The builds without lame and silk, e.g. the command line one configured without them, define DISABLE_AUDIO_CONVERTION
+#ifndef DISABLE_AUDIO_CONVERTION
 #define ENABLE_AUDIO_CONVERTION
+#endif
 
 #ifndef Utils_h
 #define Utils_h
@@ -50,14 +56,44 @@ std::string formatString(const std::string& format, Args && ...args)
 // int makePath(const std::string& path, mode_t mode);
 
 std::string md5(const std::string& s);
+// The 16 bytes of the digest, for the keys which don't need the hex string
+bool md5(const void* data, size_t length, unsigned char* digest);
+// Digests of count strings, 16 bytes each in digests, hashed in groups for the many short uids of the contacts and the members
+void md5(const std::string* values, size_t count, unsigned char* digests);
 std::string sha1(const std::string& s);
 
 std::string safeHTML(const std::string& s);
+void appendSafeHTML(std::string& output, const char* str, size_t length);
 void removeHtmlTags(std::string& html);
+// Text of html written by appendSafeHTML and the templates: the tags are removed, <br/> is a line break and the entities are decoded
+void appendHtmlText(std::string& output, const char* html, size_t length);
+// Decodes the entity at p, which is '&', into output and returns the position after it. Unknown entities are kept as they are
+const char* decodeHtmlEntity(const char* p, const char* end, std::string& output);
+void appendUtf8(std::string& output, uint32_t ch);
 
 std::string removeCdata(const std::string& str);
 
 std::string fromUnixTime(unsigned int unixtime);
+// Same output as fromUnixTime
+// The date is kept for the day of the last timestamp, so sorted timestamps only format their time of day
+class TimestampFormatter
+{
+public:
+    TimestampFormatter();
+    void format(unsigned int unixtime, std::string& output);
+    std::string format(unsigned int unixtime)
+    {
+        std::string output;
+        format(unixtime, output);
+        return output;
+    }
+    
+private:
+    std::time_t m_dayStart;     // Local midnight of the cached day
+    std::time_t m_dayEnd;       // 0 if nothing is cached
+    char m_date[16];            // "YYYY-MM-DD "
+    size_t m_dateLength;
+};
 uint32_t getUnixTimeStamp();
 
 const char* calcVarint32Ptr(const char* p, const char* limit, uint32_t* value);
@@ -78,18 +114,47 @@ int GetBigEndianInteger(const unsigned char* data, int startIndex = 0);
 int GetLittleEndianInteger(const unsigned char* data, int startIndex = 0);
 
 class sqlite3;
-int openSqlite3ReadOnly(const std::string& path, sqlite3 **ppDb);
+// Pragmas applied by openSqlite3ReadOnly, the databases in a backup never change while they are read
+struct Sqlite3ReadProfile
+{
+    int64_t maxMmapSize;        // The database is mapped up to its file size but no more than this, 0 for no mapping
+    int cacheSizeKb;            // Page cache of ordinary connections
+    int scanCacheSizeKb;        // Page cache of connections opened for ordered full table scans
+    bool tempStoreInMemory;     // temp_store=MEMORY for the sorters
+    
+    Sqlite3ReadProfile();
+};
+void setSqlite3ReadProfile(const Sqlite3ReadProfile& profile);
+Sqlite3ReadProfile getSqlite3ReadProfile();
+int openSqlite3ReadOnly(const std::string& path, sqlite3 **ppDb, bool forScanning = false);
 
 std::string encodeUrl(const std::string& url);
+void appendBase64(std::string& output, const unsigned char* data, size_t length);
+// Whitespaces are skipped, false if anything else is not base64
+bool decodeBase64(const char* data, size_t length, std::vector<unsigned char>& output);
+// zlib stream (RFC 1950) of data, what DecompressionStream("deflate") of the browsers inflates
+bool compressZlib(const char* data, size_t length, std::string& output, int level = 6);
+// Appends the JSON string literal of str, escaped as jsoncpp does. escapingUnicode is the opposite of emitUTF8 of jsoncpp
+void appendJsonString(std::string& output, const char* str, size_t length, bool escapingUnicode = true);
 
 std::string utcToLocal(const std::string& utcTime);
 std::string getTimestampString(bool includingYMD = false, bool includingMs = false);
 
+// Samples of silkPath, 24kHz mono in the host byte order, go to output packet by packet, it stops if output returns false
+bool decodeSilk(const std::string& silkPath, const std::function<bool(const short* samples, size_t numberOfSamples)>& output);
 bool silkToPcm(const std::string& silkPath, std::vector<unsigned char>& pcmData);
+// The header of silkPath is checked and there is a packet after it, false too if the decoder is not built in
+bool isDecodableSilk(const std::string& silkPath);
 bool silkToPcm(const std::string& silkPath, const std::string& pcmPath);
 
 bool pcmToMp3(const std::string& pcmPath, const std::string& mp3Path);
 bool pcmToMp3(const std::vector<unsigned char>& pcmData, const std::string& mp3Path);
+// The samples are encoded as they are decoded, no pcm of the whole voice is kept
+bool silkToMp3(const std::string& silkPath, const std::string& mp3Path);
+// The decoders and encoders are kept for the next clips, until this is called
+void releaseAudioCodecs();
+// Clips encoded so far, the encoders created for them and the time of setting them up, for the perf logging
+void getAudioStats(uint64_t& numberOfClips, uint64_t& numberOfEncoders, uint64_t& setupMicroseconds);
 
 void setThreadName(const char* threadName);
 bool isNumber(const std::string &s);
@@ -7,19 +7,218 @@
 //  Refer: https://www.programmersought.com/article/2635152445/
 //
 
+#include <mutex>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <cassert>
+#include "Utils.h"
+#include "FileSystem.h"
+#ifdef ENABLE_AUDIO_CONVERTION
 extern "C"
 {
 #include <lame/lame.h>
 }
-#include "Utils.h"
-#include "FileSystem.h"
+#endif
 #ifdef _WIN32
 #include <atlstr.h>
-#ifndef NDEBUG
-#include <cassert>
-#endif
 #endif
 
+void releaseSilkDecoders();
+
+static std::atomic<uint64_t> g_numberOfMp3Clips(0);
+static std::atomic<uint64_t> g_numberOfMp3Encoders(0);
+static std::atomic<uint64_t> g_mp3SetupTime(0);
+
+void getAudioStats(uint64_t& numberOfClips, uint64_t& numberOfEncoders, uint64_t& setupMicroseconds)
+{
+    numberOfClips = g_numberOfMp3Clips;
+    numberOfEncoders = g_numberOfMp3Encoders;
+    setupMicroseconds = g_mp3SetupTime;
+}
+
+#ifdef ENABLE_AUDIO_CONVERTION
+// Samples of a block, lame is called once for it instead of for every frame of 576 samples
+#define MP3_BLOCK_SAMPLES   (576 * 16)
+// Silence encoded at the end of a clip to push the delayed samples out, lame_encode_flush does the same.
+// The encoder is left with silence in its history, so the next clip on it starts from nothing
+#define MP3_TAIL_SAMPLES    (1152 * 2)
+
+// Encoders of the finished clips, the presets are set once for each of them and a new clip only starts
+// a new bitstream, as lame does between the files of gapless encoding
+static std::mutex g_mp3EncodersMutex;
+static std::vector<lame_global_flags *> g_mp3Encoders;
+
+static lame_global_flags* acquireMp3Encoder()
+{
+    {
+        std::lock_guard<std::mutex> lock(g_mp3EncodersMutex);
+        if (!g_mp3Encoders.empty())
+        {
+            lame_global_flags* gfp = g_mp3Encoders.back();
+            g_mp3Encoders.pop_back();
+            lame_init_bitstream(gfp);
+            return gfp;
+        }
+    }
+    
+    lame_global_flags* gfp = NULL;
+    {
+        // lame fills its static tables on the first init, the voices are transcoded on several threads
+        static std::mutex initMutex;
+        std::lock_guard<std::mutex> lock(initMutex);
+        gfp = lame_init();
+    }
+    if (NULL == gfp)
+    {
+        return NULL;
+    }
+    
+    lame_set_in_samplerate(gfp, 24000);
+    lame_set_preset(gfp, 56);
+    lame_set_mode(gfp, MONO);
+    // RG is enabled by default
+    lame_set_findReplayGain(gfp, 1);
+    lame_set_num_channels(gfp, 1);
+    lame_set_out_samplerate(gfp, 24000);
+    if (lame_init_params(gfp) == -1)
+    {
+        lame_close(gfp);
+        return NULL;
+    }
+    ++g_numberOfMp3Encoders;
+    return gfp;
+}
+
+static void releaseMp3Encoder(lame_global_flags* gfp, bool reusable)
+{
+    if (reusable)
+    {
+        std::lock_guard<std::mutex> lock(g_mp3EncodersMutex);
+        g_mp3Encoders.push_back(gfp);
+        return;
+    }
+    lame_close(gfp);
+}
+
+// 24kHz mono samples to mp3, encoded in blocks and written through a buffered writer,
+// the memory doesn't grow with the length of the voice
+class Mp3Encoder
+{
+public:
+    Mp3Encoder() : m_gfp(NULL), m_used(0), m_failed(false)
+    {
+    }
+
+    ~Mp3Encoder()
+    {
+        if (NULL != m_gfp)
+        {
+            // An encoder in the middle of a clip isn't reused
+            releaseMp3Encoder(m_gfp, false);
+        }
+    }
+
+    bool open(const std::string& mp3Path)
+    {
+        std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+        m_gfp = acquireMp3Encoder();
+        g_mp3SetupTime += static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count());
+        if (NULL == m_gfp)
+        {
+            return false;
+        }
+        ++g_numberOfMp3Clips;
+
+        m_samples.resize(MP3_BLOCK_SAMPLES);
+        // The worst case of lame: 1.25 * samples + 7200, which is enough for lame_encode_flush as well
+        m_mp3Data.resize(MP3_BLOCK_SAMPLES * 5 / 4 + 7200);
+        return m_writer.open(mp3Path);
+    }
+
+    bool encode(const short* samples, size_t numberOfSamples)
+    {
+        while (numberOfSamples > 0 && !m_failed)
+        {
+            if (m_used == 0 && numberOfSamples >= MP3_BLOCK_SAMPLES)
+            {
+                // Whole blocks go to lame without the copy
+                encodeBlock(samples, MP3_BLOCK_SAMPLES);
+                samples += MP3_BLOCK_SAMPLES;
+                numberOfSamples -= MP3_BLOCK_SAMPLES;
+                continue;
+            }
+            size_t count = MP3_BLOCK_SAMPLES - m_used;
+            if (count > numberOfSamples)
+            {
+                count = numberOfSamples;
+            }
+            std::memcpy(&m_samples[m_used], samples, count * sizeof(short));
+            m_used += count;
+            samples += count;
+            numberOfSamples -= count;
+            if (m_used == MP3_BLOCK_SAMPLES)
+            {
+                encodeBlock(&m_samples[0], m_used);
+                m_used = 0;
+            }
+        }
+        return !m_failed;
+    }
+
+    // The rest of the samples and the frames lame still holds are written
+    bool close()
+    {
+        if (NULL == m_gfp || !m_writer.isOpen())
+        {
+            return false;
+        }
+        if (m_used > 0)
+        {
+            encodeBlock(&m_samples[0], m_used);
+            m_used = 0;
+        }
+        if (!m_failed)
+        {
+            m_samples.assign(MP3_TAIL_SAMPLES, 0);
+            encodeBlock(&m_samples[0], MP3_TAIL_SAMPLES);
+        }
+        if (!m_failed)
+        {
+            // The last frames are completed, the state of the encoder is kept for the next bitstream
+            int bytes = lame_encode_flush_nogap(m_gfp, &m_mp3Data[0], static_cast<int>(m_mp3Data.size()));
+            if (bytes < 0 || !m_writer.write(&m_mp3Data[0], static_cast<size_t>(bytes)))
+            {
+                m_failed = true;
+            }
+        }
+        releaseMp3Encoder(m_gfp, !m_failed);
+        m_gfp = NULL;
+        return m_writer.close() && !m_failed;
+    }
+
+private:
+    Mp3Encoder(const Mp3Encoder&);
+    Mp3Encoder& operator=(const Mp3Encoder&);
+
+    void encodeBlock(const short* samples, size_t numberOfSamples)
+    {
+        int bytes = lame_encode_buffer(m_gfp, samples, NULL, static_cast<int>(numberOfSamples), &m_mp3Data[0], static_cast<int>(m_mp3Data.size()));
+        if (bytes < 0 || !m_writer.write(&m_mp3Data[0], static_cast<size_t>(bytes)))
+        {
+            m_failed = true;
+        }
+    }
+
+    lame_global_flags* m_gfp;
+    std::vector<short> m_samples;
+    size_t m_used;
+    std::vector<unsigned char> m_mp3Data;
+    FileWriter m_writer;
+    bool m_failed;
+};
+#endif // ENABLE_AUDIO_CONVERTION
+
 bool pcmToMp3(const std::string& pcmPath, const std::string& mp3Path)
 {
 	std::vector<unsigned char> pcmData;
@@ -37,81 +236,51 @@ bool pcmToMp3(const std::vector<unsigned char>& pcmData, const std::string& mp3P
     assert(!pcmData.empty());
 #endif
 #ifdef ENABLE_AUDIO_CONVERTION
-    const int MP3_SIZE = 4096;
-    const int num_of_channels = 1;
+    Mp3Encoder encoder;
+    bool succeeded = encoder.open(mp3Path) && encoder.encode(reinterpret_cast<const short *>(&pcmData[0]), pcmData.size() / sizeof(short));
+    return encoder.close() && succeeded;
+#else
+    return true;
+#endif // ENABLE_AUDIO_CONVERTION
+}
 
-    lame_global_flags *gfp = NULL;
-    gfp = lame_init();
-    if (NULL == gfp)
+bool silkToMp3(const std::string& silkPath, const std::string& mp3Path)
+{
+#ifdef ENABLE_AUDIO_CONVERTION
+    Mp3Encoder encoder;
+    if (!encoder.open(mp3Path))
     {
         return false;
     }
-
-    lame_set_in_samplerate(gfp, 24000);
-    lame_set_preset(gfp, 56);
-    lame_set_mode(gfp, MONO);
-    // RG is enabled by default
-    lame_set_findReplayGain(gfp, 1);
-    // lame_set_quality(gfp, 7);
-    //Setting Channels
-    lame_set_num_channels(gfp, num_of_channels);
-
-    unsigned long fsize = (unsigned long) (pcmData.size() / (2 * num_of_channels));
-    lame_set_num_samples(gfp, fsize);
-    
-    int samples_to_read = lame_get_framesize(gfp);
-    int samples_of_channel = 576;
-    samples_to_read = samples_of_channel * num_of_channels;    //
-    // int framesize = samples_to_read;
-    // std::assert(framesize <= 1152);
-    // int bytes_per_sample = sizeof(short int);
-    
-    lame_set_out_samplerate(gfp, 24000);
-
-    if(lame_init_params(gfp) == -1)
+    bool hasSamples = false;
+    bool succeeded = decodeSilk(silkPath, [&encoder, &hasSamples](const short* samples, size_t numberOfSamples) {
+        hasSamples = true;
+        return encoder.encode(samples, numberOfSamples);
+    });
+    succeeded = encoder.close() && succeeded && hasSamples;
+    if (!succeeded)
     {
-        //lame initialization failed
-        lame_close(gfp);
-        return false;
+        // No broken mp3 is left for the page
+        deleteFile(mp3Path);
     }
-    
-    std::vector<short int> pcm_buffer;
-    pcm_buffer.resize(samples_to_read, 0);
-    int bytesOfPcmBuffer = static_cast<int>(pcm_buffer.size() * sizeof(short int));
-    unsigned char mp3_buffer[MP3_SIZE];
-    int count = static_cast<int>((pcmData.size() + bytesOfPcmBuffer - 1) / bytesOfPcmBuffer);
-    
-#ifdef _WIN32
-	CA2W pszW(mp3Path.c_str(), CP_UTF8);
-    // CW2A pszA(pszW);
-    FILE *mp3 = _wfopen((LPCWSTR)pszW, L"wb" );
-	// FILE *mp3 = fopen(mp3Path.c_str(), "wb,ccs=UTF-8");
+    return succeeded;
 #else
-    FILE *mp3 = fopen(mp3Path.c_str(), "wb");
-#endif
-    
-    if(mp3 == NULL)
+    return true;
+#endif // ENABLE_AUDIO_CONVERTION
+}
+
+void releaseAudioCodecs()
+{
+#ifdef ENABLE_AUDIO_CONVERTION
+    std::vector<lame_global_flags *> encoders;
     {
-        lame_close(gfp);
-        return false;
+        std::lock_guard<std::mutex> lock(g_mp3EncodersMutex);
+        encoders.swap(g_mp3Encoders);
     }
-    for (int idx = 0; idx < count; ++idx)
+    for (std::vector<lame_global_flags *>::iterator it = encoders.begin(); it != encoders.end(); ++it)
     {
-        if (idx == (count - 1) && (pcmData.size() % bytesOfPcmBuffer) != 0)
-        {
-            pcm_buffer.assign(pcm_buffer.size(), 0);
-            samples_to_read = ((pcmData.size() % bytesOfPcmBuffer) + sizeof(short int) - 1) / sizeof(short int);
-        }
-        memcpy(reinterpret_cast<void *>(&(pcm_buffer[0])), reinterpret_cast<const void *>(&(pcmData[idx * bytesOfPcmBuffer])), samples_to_read * sizeof(short int));
-        
-        int write = lame_encode_buffer(gfp, &pcm_buffer[0], NULL, samples_of_channel, mp3_buffer, MP3_SIZE);
-        fwrite(mp3_buffer, write, sizeof(char), mp3);
+        lame_close(*it);
     }
-
-    fclose(mp3);
-    lame_close(gfp);
-
 #endif // ENABLE_AUDIO_CONVERTION
-    
-    return true;
+    releaseSilkDecoders();
 }
@@ -9,6 +9,9 @@
 #include <string>
 #include <sstream>
 #include <iomanip>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
 
 #if defined(_WIN32)
 #include <windows.h>
@@ -19,36 +22,33 @@
 
 #elif defined(__APPLE__)
 #import <CommonCrypto/CommonDigest.h>
+#elif defined(__linux__)
+// For the command line build, the EVP interface as the digests of md5.h and sha.h are deprecated by OpenSSL 3
+#include <openssl/evp.h>
+
+#define MD5_DIGEST_LENGTH 16
+#define SHA_DIGEST_LENGTH 20
 #else
 
 #endif
 
-std::string md5(const std::string& s)
+bool md5(const void* data, size_t length, unsigned char* digest)
 {
-    std::stringstream stream;
-    stream << std::setfill ('0') << std::hex;
-    
+    bool result = false;
+    memset(digest, 0, 16);
 #if defined(_WIN32)
     
     HCRYPTPROV hCryptProv = NULL;
     HCRYPTHASH hHash = NULL;
-    BYTE bHash[0x7f] = {0};
     DWORD dwHashLen= MD5_DIGEST_LENGTH; // The MD5 algorithm always returns 16 bytes.
 
     if(CryptAcquireContext(&hCryptProv, NULL, NULL, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT | CRYPT_MACHINE_KEYSET))
     {
         if(CryptCreateHash(hCryptProv, CALG_MD5, 0, 0, &hHash))
         {
-            if(CryptHashData(hHash, reinterpret_cast<const BYTE*>(s.c_str()), static_cast<DWORD>(s.size()), 0))
+            if(CryptHashData(hHash, reinterpret_cast<const BYTE*>(data), static_cast<DWORD>(length), 0))
             {
-                if(CryptGetHashParam(hHash, HP_HASHVAL, bHash, &dwHashLen, 0))
-                {
-                    // Make a string version of the numeric digest value
-                    for (int idx = 0; idx < 16; idx++)
-                    {
-                        stream << std::setw(2) << ((unsigned int) bHash[idx]);
-                    }
-                }
+                result = CryptGetHashParam(hHash, HP_HASHVAL, digest, &dwHashLen, 0) ? true : false;
             }
         }
     }
@@ -57,18 +57,195 @@ std::string md5(const std::string& s)
     CryptReleaseContext(hCryptProv, 0);
 
 #elif defined(__APPLE__)
-    unsigned char digest[CC_MD5_DIGEST_LENGTH] = {0};
-    CC_MD5(s.c_str(), (CC_LONG)s.size(), digest); // This is the md5 call
-
-    for (int idx = 0; idx < CC_MD5_DIGEST_LENGTH; idx++)
-    {
-        stream << std::setw(2) << ((unsigned int) digest[idx]);
-    }
+    CC_MD5(data, (CC_LONG)length, digest); // This is the md5 call
+    result = true;
+#elif defined(__linux__)
+    result = EVP_Digest(data, length, digest, NULL, EVP_md5(), NULL) == 1;
 #else
 #error "Md5 Not implemented."
 #endif
+    return result;
+}
 
-    return stream.str();
+std::string md5(const std::string& s)
+{
+    static const char digits[] = "0123456789abcdef";
+    unsigned char digest[16];
+    if (!md5(s.c_str(), s.size(), digest))
+    {
+        return std::string();
+    }
+
+    std::string hex(32, '0');
+    for (int idx = 0; idx < 16; idx++)
+    {
+        hex[idx * 2] = digits[digest[idx] >> 4];
+        hex[idx * 2 + 1] = digits[digest[idx] & 0xF];
+    }
+    return hex;
+}
+
+// Strings hashed side by side, the lanes are the innermost loops so the compiler can vectorize them
+#define MD5_LANES   8
+
+static const uint32_t MD5_K[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const int MD5_S[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+// Block index of the padded message: the bytes, 0x80, the zeros and the length in bits
+static void loadMd5Block(const std::string& value, size_t blockIndex, size_t numberOfBlocks, uint32_t* words)
+{
+    unsigned char block[64];
+    size_t length = value.size();
+    size_t offset = blockIndex * 64;
+    for (size_t idx = 0; idx < 64; ++idx)
+    {
+        size_t pos = offset + idx;
+        block[idx] = pos < length ? static_cast<unsigned char>(value[pos]) : (pos == length ? 0x80 : 0);
+    }
+    if (blockIndex + 1 == numberOfBlocks)
+    {
+        uint64_t bits = static_cast<uint64_t>(length) * 8;
+        for (int idx = 0; idx < 8; ++idx)
+        {
+            block[56 + idx] = static_cast<unsigned char>(bits >> (idx * 8));
+        }
+    }
+    for (int idx = 0; idx < 16; ++idx)
+    {
+        words[idx] = block[idx * 4] | (block[idx * 4 + 1] << 8) | (block[idx * 4 + 2] << 16) | (static_cast<uint32_t>(block[idx * 4 + 3]) << 24);
+    }
+}
+
+void md5(const std::string* values, size_t count, unsigned char* digests)
+{
+    for (size_t first = 0; first < count; first += MD5_LANES)
+    {
+        size_t numberOfLanes = std::min(static_cast<size_t>(MD5_LANES), count - first);
+        size_t numberOfBlocks[MD5_LANES] = { 0 };
+        size_t maxBlocks = 0;
+        for (size_t lane = 0; lane < numberOfLanes; ++lane)
+        {
+            numberOfBlocks[lane] = (values[first + lane].size() + 8) / 64 + 1;
+            maxBlocks = std::max(maxBlocks, numberOfBlocks[lane]);
+        }
+
+        uint32_t state[4][MD5_LANES];
+        for (int lane = 0; lane < MD5_LANES; ++lane)
+        {
+            state[0][lane] = 0x67452301;
+            state[1][lane] = 0xefcdab89;
+            state[2][lane] = 0x98badcfe;
+            state[3][lane] = 0x10325476;
+        }
+
+        for (size_t blockIndex = 0; blockIndex < maxBlocks; ++blockIndex)
+        {
+            // words[word][lane], the lanes which are done or unused hash zeros and keep their state
+            uint32_t words[16][MD5_LANES] = { { 0 } };
+            uint32_t laneWords[16];
+            for (size_t lane = 0; lane < numberOfLanes; ++lane)
+            {
+                if (blockIndex < numberOfBlocks[lane])
+                {
+                    loadMd5Block(values[first + lane], blockIndex, numberOfBlocks[lane], laneWords);
+                    for (int idx = 0; idx < 16; ++idx)
+                    {
+                        words[idx][lane] = laneWords[idx];
+                    }
+                }
+            }
+
+            uint32_t a[MD5_LANES], b[MD5_LANES], c[MD5_LANES], d[MD5_LANES];
+            std::memcpy(a, state[0], sizeof(a));
+            std::memcpy(b, state[1], sizeof(b));
+            std::memcpy(c, state[2], sizeof(c));
+            std::memcpy(d, state[3], sizeof(d));
+            for (int round = 0; round < 64; ++round)
+            {
+                int wordIndex = 0;
+                int phase = round / 16;
+                if (phase == 0)
+                {
+                    wordIndex = round;
+                }
+                else if (phase == 1)
+                {
+                    wordIndex = (5 * round + 1) % 16;
+                }
+                else if (phase == 2)
+                {
+                    wordIndex = (3 * round + 5) % 16;
+                }
+                else
+                {
+                    wordIndex = (7 * round) % 16;
+                }
+                uint32_t k = MD5_K[round];
+                int s = MD5_S[round];
+                const uint32_t* w = words[wordIndex];
+                for (int lane = 0; lane < MD5_LANES; ++lane)
+                {
+                    uint32_t f = 0;
+                    if (phase == 0)
+                    {
+                        f = (b[lane] & c[lane]) | (~b[lane] & d[lane]);
+                    }
+                    else if (phase == 1)
+                    {
+                        f = (d[lane] & b[lane]) | (~d[lane] & c[lane]);
+                    }
+                    else if (phase == 2)
+                    {
+                        f = b[lane] ^ c[lane] ^ d[lane];
+                    }
+                    else
+                    {
+                        f = c[lane] ^ (b[lane] | ~d[lane]);
+                    }
+                    uint32_t sum = a[lane] + f + k + w[lane];
+                    a[lane] = d[lane];
+                    d[lane] = c[lane];
+                    c[lane] = b[lane];
+                    b[lane] = b[lane] + ((sum << s) | (sum >> (32 - s)));
+                }
+            }
+
+            for (size_t lane = 0; lane < numberOfLanes; ++lane)
+            {
+                if (blockIndex < numberOfBlocks[lane])
+                {
+                    state[0][lane] += a[lane];
+                    state[1][lane] += b[lane];
+                    state[2][lane] += c[lane];
+                    state[3][lane] += d[lane];
+                }
+            }
+        }
+
+        for (size_t lane = 0; lane < numberOfLanes; ++lane)
+        {
+            unsigned char* digest = digests + (first + lane) * 16;
+            for (int idx = 0; idx < 16; ++idx)
+            {
+                digest[idx] = static_cast<unsigned char>(state[idx / 4][lane] >> ((idx % 4) * 8));
+            }
+        }
+    }
 }
 
 std::string sha1(const std::string& s)
@@ -112,6 +289,14 @@ std::string sha1(const std::string& s)
     {
         stream << std::setw(2) << ((unsigned int) digest[idx]);
     }
+#elif defined(__linux__)
+    unsigned char digest[SHA_DIGEST_LENGTH] = {0};
+    EVP_Digest(s.c_str(), s.size(), digest, NULL, EVP_sha1(), NULL);
+
+    for (int idx = 0; idx < SHA_DIGEST_LENGTH; idx++)
+    {
+        stream << std::setw(2) << ((unsigned int) digest[idx]);
+    }
 #else
 #error "SHA1 Not implemented."
 #endif
@@ -9,8 +9,12 @@
 #include <string.h>
 #include <string>
 #include <vector>
+#include <functional>
+#include <mutex>
+#ifdef ENABLE_AUDIO_CONVERTION
 #include <silk/SKP_Silk_SDK_API.h>
 #include <silk/SKP_Silk_SigProc_FIX.h>
+#endif
 
 #ifdef _WIN32
 #include <atlstr.h>
@@ -72,13 +76,60 @@ unsigned long GetHighResolutionTime() /* O: time in usec*/
 }
 #endif // _WIN32
 
-/* Seed for the random number generator, which is used for simulating packet loss */
-static SKP_int32 rand_seed = 1;
+// Decoder states of the finished clips, a clip takes one and resets it instead of allocating its own
+static std::mutex g_silkDecodersMutex;
+static std::vector<std::vector<unsigned char> *> g_silkDecoders;
 
-bool silkToPcm(const std::string& silkPath, std::vector<unsigned char>& pcmData)
+class SilkDecoderState
+{
+public:
+    explicit SilkDecoderState(size_t size) : m_buffer(NULL)
+    {
+        {
+            std::lock_guard<std::mutex> lock(g_silkDecodersMutex);
+            if (!g_silkDecoders.empty())
+            {
+                m_buffer = g_silkDecoders.back();
+                g_silkDecoders.pop_back();
+            }
+        }
+        if (NULL == m_buffer)
+        {
+            m_buffer = new std::vector<unsigned char>();
+        }
+        m_buffer->resize(size, 0);
+    }
+
+    ~SilkDecoderState()
+    {
+        std::lock_guard<std::mutex> lock(g_silkDecodersMutex);
+        g_silkDecoders.push_back(m_buffer);
+    }
+
+    void* get()
+    {
+        return reinterpret_cast<void *>(&((*m_buffer)[0]));
+    }
+
+private:
+    SilkDecoderState(const SilkDecoderState&);
+    SilkDecoderState& operator=(const SilkDecoderState&);
+
+    std::vector<unsigned char>* m_buffer;
+};
+
+void releaseSilkDecoders()
+{
+    std::lock_guard<std::mutex> lock(g_silkDecodersMutex);
+    for (std::vector<std::vector<unsigned char> *>::iterator it = g_silkDecoders.begin(); it != g_silkDecoders.end(); ++it)
+    {
+        delete *it;
+    }
+    g_silkDecoders.clear();
+}
+
+bool decodeSilk(const std::string& silkPath, const std::function<bool(const short* samples, size_t numberOfSamples)>& output)
 {
-    pcmData.clear();
-    
 #ifdef ENABLE_AUDIO_CONVERTION
     unsigned long tottime, starttime;
     size_t    counter;
@@ -96,6 +147,8 @@ bool silkToPcm(const std::string& silkPath, std::vector<unsigned char>& pcmData)
     SKP_int32 decSizeBytes;
     void      *psDec;
     SKP_float loss_prob;
+    /* Seed for the random number generator, which is used for simulating packet loss, per call for the transcoding threads */
+    SKP_int32 rand_seed = 1;
     SKP_int32 frames, lost, quiet;
     SKP_SILK_SDK_DecControlStruct DecControl;
 
@@ -159,12 +212,10 @@ bool silkToPcm(const std::string& silkPath, std::vector<unsigned char>& pcmData)
     if( ret ) {
         // printf( "\nSKP_Silk_SDK_Get_Decoder_Size returned %d", ret );
     }
-    std::vector<unsigned char> bufferDec;
-    bufferDec.resize(decSizeBytes, 0);
-    // psDec = malloc( decSizeBytes );
-    psDec = reinterpret_cast<void *>(&(bufferDec[0]));
+    SilkDecoderState decoderState(static_cast<size_t>(decSizeBytes));
+    psDec = decoderState.get();
 
-    /* Reset decoder */
+    /* Reset decoder, the state may be of the previous clip */
     ret = SKP_Silk_SDK_InitDecoder( psDec );
     if( ret ) {
         // printf( "\nSKP_Silk_InitDecoder returned %d", ret );
@@ -286,13 +337,10 @@ bool silkToPcm(const std::string& silkPath, std::vector<unsigned char>& pcmData)
         tottime += GetHighResolutionTime() - starttime;
         totPackets++;
 
-        /* Write output to file */
-#ifdef _SYSTEM_IS_BIG_ENDIAN
-        swap_endian( out, tot_len );
-#endif
-        // fwrite( out, sizeof( SKP_int16 ), tot_len, speechOutFile );
-        unsigned char *p = reinterpret_cast<unsigned char *>(out);
-        std::copy(p, p + sizeof( SKP_int16 ) * tot_len, std::back_inserter(pcmData));
+        /* Write output */
+        if (tot_len > 0 && !output(out, static_cast<size_t>(tot_len))) {
+            return false;
+        }
 
         /* Update buffer */
         totBytes = 0;
@@ -383,13 +431,10 @@ bool silkToPcm(const std::string& silkPath, std::vector<unsigned char>& pcmData)
         tottime += GetHighResolutionTime() - starttime;
         totPackets++;
 
-        /* Write output to file */
-#ifdef _SYSTEM_IS_BIG_ENDIAN
-        swap_endian( out, tot_len );
-#endif
-        // fwrite( out, sizeof( SKP_int16 ), tot_len, speechOutFile );
-        unsigned char *p = reinterpret_cast<unsigned char *>(out);
-        std::copy(p, p + sizeof( SKP_int16 ) * tot_len, std::back_inserter(pcmData));
+        /* Write output */
+        if (tot_len > 0 && !output(out, static_cast<size_t>(tot_len))) {
+            return false;
+        }
 
         /* Update Buffer */
         totBytes = 0;
@@ -422,6 +467,47 @@ bool silkToPcm(const std::string& silkPath, std::vector<unsigned char>& pcmData)
     return true;
 }
 
+bool isDecodableSilk(const std::string& silkPath)
+{
+#ifdef ENABLE_AUDIO_CONVERTION
+    FILE *file = NULL;
+#ifdef _WIN32
+    CA2W pszW(silkPath.c_str(), CP_UTF8);
+    file = _wfopen((LPCWSTR)pszW, L"rb" );
+#else
+    file = fopen(silkPath.c_str(), "rb" );
+#endif
+    if (file == NULL)
+    {
+        return false;
+    }
+    
+    /* The header of WeChat (\x02#!SILK_V3) or of the SDK (#!SILK_V3) as decodeSilk accepts it, and the length of the first packet */
+    char buf[ 16 ];
+    size_t counter = fread(buf, sizeof(char), 1 + strlen( "#!SILK_V3" ) + sizeof(SKP_int16), file);
+    fclose(file);
+    
+    size_t offset = (counter > 0 && buf[0] == '\x02') ? 1 : 0;
+    return counter >= offset + strlen( "#!SILK_V3" ) + sizeof(SKP_int16) && memcmp(buf + offset, "#!SILK_V3", strlen( "#!SILK_V3" )) == 0;
+#else
+    return false;
+#endif // ENABLE_AUDIO_CONVERTION
+}
+
+bool silkToPcm(const std::string& silkPath, std::vector<unsigned char>& pcmData)
+{
+    pcmData.clear();
+    return decodeSilk(silkPath, [&pcmData](const short* samples, size_t numberOfSamples) {
+        size_t offset = pcmData.size();
+        pcmData.resize(offset + numberOfSamples * sizeof(short));
+        memcpy(&pcmData[offset], samples, numberOfSamples * sizeof(short));
+#ifdef _SYSTEM_IS_BIG_ENDIAN
+        swap_endian(reinterpret_cast<SKP_int16 *>(&pcmData[offset]), static_cast<SKP_int32>(numberOfSamples));
+#endif
+        return true;
+    });
+}
+
 bool silkToPcm(const std::string& silkPath, const std::string& pcmPath)
 {
     std::vector<unsigned char> pcmData;
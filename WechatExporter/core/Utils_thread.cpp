@@ -7,6 +7,7 @@
 //
 #if 1
 #include "Utils.h"
+#include "Tracing.h"
 
 #ifdef _WIN32
 
@@ -45,6 +46,7 @@ void setThreadName(uint32_t dwThreadID, const char* threadName)
 
 void setThreadName( const char* threadName)
 {
+    setTraceThreadName(threadName);
     setThreadName(GetCurrentThreadId(), threadName);
 }
 
@@ -58,6 +60,7 @@ void setThreadName(std::thread* thread, const char* threadName)
 #include <sys/prctl.h>
 void setThreadName(const char* threadName)
 {
+    setTraceThreadName(threadName);
     prctl(PR_SET_NAME, threadName, 0, 0, 0);
 }
 
@@ -65,6 +68,7 @@ void setThreadName(const char* threadName)
 #include <pthread.h>
 void setThreadName(const char* threadName)
 {
+    setTraceThreadName(threadName);
     pthread_setname_np(threadName);
 }
 #endif
@@ -10,12 +10,17 @@
 #include <vector>
 #include <regex>
 #include <map>
+#include <mutex>
+#include <atomic>
+#include <deque>
 #include <algorithm>
 #include <cmath>
 #ifndef NDEBUG
 #include <cassert>
 #endif
 #include "Utils.h"
+#include "HashTable.h"
+#include "UidKeys.h"
 
 #ifndef WechatObjects_h
 #define WechatObjects_h
@@ -206,11 +211,19 @@ protected:
     }
 };
 
+// Key of the MD5 of a uid, getHash/formatHashKey give its hex string for the paths and the queries
+inline HashKey md5Key(const std::string& uid)
+{
+    unsigned char digest[16];
+    md5(uid.c_str(), uid.size(), digest);
+    return makeHashKey(digest);
+}
+
 class Friend
 {
 protected:
     std::string m_usrName;
-    std::string m_uidHash;
+    HashKey m_uidKey;
     std::string m_displayName;
     int m_userType;
     bool m_isChatroom;
@@ -219,15 +232,17 @@ protected:
     
     std::string m_outputFileName; // Use displayName first and then usrName
     
-    std::map<std::string, std::pair<std::string, std::string>> m_members; // uidHash => <uid,NickName>
+    HashMap<std::pair<std::string, std::string>> m_members; // uidKey => <uid,NickName>
     
 public:
     
     Friend() : m_isChatroom(false)
     {
+        m_uidKey.high = 0;
+        m_uidKey.low = 0;
     }
     
-    Friend(const std::string& uid, const std::string& hash) : m_usrName(uid), m_uidHash(hash)
+    Friend(const std::string& uid, const HashKey& uidKey) : m_usrName(uid), m_uidKey(uidKey)
     {
         m_isChatroom = isChatroom(uid);
     }
@@ -241,34 +256,32 @@ public:
     }
     
     inline std::string getUsrName() const { return m_usrName; }
-    inline std::string getHash() const { return m_uidHash; }
-    void setUsrName(const std::string& usrName) { this->m_usrName = usrName; m_uidHash = md5(usrName);  m_outputFileName = m_uidHash; m_isChatroom = isChatroom(usrName); }
+    inline std::string getHash() const { return formatHashKey(m_uidKey); }
+    inline const HashKey& getHashKey() const { return m_uidKey; }
+    void setUsrName(const std::string& usrName) { this->m_usrName = usrName; m_uidKey = md5Key(usrName);  m_outputFileName = getHash(); m_isChatroom = isChatroom(usrName); }
 
-    bool containMember(const std::string& uidHash) const
+    bool containMember(const HashKey& uidKey) const
     {
-        std::map<std::string, std::pair<std::string, std::string>>::const_iterator it = m_members.find(uidHash);
-        return it != m_members.cend();
+        return NULL != m_members.find(uidKey);
     }
     
-    std::string getMemberName(const std::string& uidHash) const
+    std::string getMemberName(const HashKey& uidKey) const
     {
-        std::map<std::string, std::pair<std::string, std::string>>::const_iterator it = m_members.find(uidHash);
-        return it != m_members.cend() ? it->second.second : "";
+        const HashMapEntry<std::pair<std::string, std::string>>* entry = m_members.find(uidKey);
+        return NULL != entry ? entry->value.second : "";
     }
 
-    void addMember(const std::string& uidHash, const std::pair<std::string, std::string>& uidAndDisplayName)
+    void addMember(const HashKey& uidKey, const std::pair<std::string, std::string>& uidAndDisplayName)
     {
-        typename std::map<std::string, std::pair<std::string, std::string>>::iterator it = m_members.find(uidHash);
-        if (it != m_members.end())
+        bool inserted = false;
+        HashMapEntry<std::pair<std::string, std::string>>* entry = m_members.insert(uidKey, inserted);
+        if (inserted)
         {
-            if (it->second.second != uidAndDisplayName.second)
-            {
-                it->second.second = uidAndDisplayName.second;
-            }
+            entry->value = uidAndDisplayName;
         }
-        else
+        else if (entry->value.second != uidAndDisplayName.second)
         {
-            m_members[uidHash] = uidAndDisplayName;
+            entry->value.second = uidAndDisplayName.second;
         }
     }
     
@@ -365,17 +378,17 @@ protected:
         {
             m_portraitHD = f.m_portraitHD;
         }
-        for (std::map<std::string, std::pair<std::string, std::string>>::iterator it = m_members.begin(); it != m_members.end(); ++it)
-        {
-            if (it->second.second.empty())
+        const HashMap<std::pair<std::string, std::string>>& members = f.m_members;
+        m_members.forEach([&members](HashMapEntry<std::pair<std::string, std::string>>& entry) {
+            if (entry.value.second.empty())
             {
-                std::map<std::string, std::pair<std::string, std::string>>::const_iterator it2 = f.m_members.find(it->first);
-                if (it2 != f.m_members.cend())
+                const HashMapEntry<std::pair<std::string, std::string>>* entry2 = members.find(entry.key);
+                if (NULL != entry2)
                 {
-                    it->second.second = it2->second.second;
+                    entry.value.second = entry2->value.second;
                 }
             }
-        }
+        });
         
         return true;
     }
@@ -405,89 +418,165 @@ inline bool Friend::isInvalidPortrait(const std::string& portrait)
     return !portrait.empty() && (!startsWith(portrait, "http://") && !startsWith(portrait, "https://") && !startsWith(portrait, "file://"));
 }
 
+// Decodes the details of a friend (remark, portraits and members) which were left in the database by the parser
+class FriendDetailLoader
+{
+public:
+    virtual ~FriendDetailLoader() {}
+    virtual void load(int64_t rowId, Friend& f) = 0;
+};
+
 class Friends
 {
 public:
-    std::map<std::string, Friend> friends;  // uidHash => Friend
-    std::map<std::string, std::string> hashes;  // uid => Hash
+    Friends() : m_detailLoader(NULL)
+    {
+    }
+    
+    ~Friends()
+    {
+        if (NULL != m_detailLoader)
+        {
+            delete m_detailLoader;
+            m_detailLoader = NULL;
+        }
+    }
     
     template <class THandler>
     void handleFriend(THandler handler)
     {
-        for (std::map<std::string, Friend>::iterator it = friends.begin(); it != friends.end(); ++it)
+        for (size_t idx = 0; idx < m_friends.size(); ++idx)
         {
-            handler(it->second);
+            loadDetails(idx);
+            handler(m_friends[idx]);
         }
     }
     
-    bool hasFriend(const std::string& hash) const { return friends.find(hash) != friends.end(); }
-    const Friend* getFriend(const std::string& uidHash) const
+    size_t size() const { return m_friends.size(); }
+    bool hasFriend(const HashKey& uidKey) const { return NULL != m_indexes.find(uidKey); }
+    const Friend* getFriend(const HashKey& uidKey) const
     {
-        std::map<std::string, Friend>::const_iterator it = friends.find(uidHash);
-        if (it == friends.cend())
+        const HashMapEntry<size_t>* entry = m_indexes.find(uidKey);
+        if (NULL == entry)
         {
             return NULL;
         }
-        return &(it->second);
+        // The details are filled on the first access, they are not seen as a change of the friend
+        loadDetails(entry->value);
+        return &m_friends[entry->value];
+    }
+    Friend* getFriend(const HashKey& uidKey)
+    {
+        return const_cast<Friend *>(static_cast<const Friends *>(this)->getFriend(uidKey));
+    }
+    // uidHash is the hex string, like the names of the folders and the tables
+    const Friend* getFriend(const std::string& uidHash) const
+    {
+        HashKey uidKey;
+        return parseHashKey(uidHash, uidKey) ? getFriend(uidKey) : NULL;
     }
     Friend* getFriend(const std::string& uidHash)
     {
-        std::map<std::string, Friend>::iterator it = friends.find(uidHash);
-        if (it == friends.end())
-        {
-            return NULL;
-        }
-        return &(it->second);
+        HashKey uidKey;
+        return parseHashKey(uidHash, uidKey) ? getFriend(uidKey) : NULL;
     }
     const Friend* getFriendByUid(const std::string& uid) const
     {
-        std::map<std::string, std::string>::const_iterator it = hashes.find(uid);
-        std::string hash = it == hashes.cend() ? md5(uid) : it->second;
-        
-        std::map<std::string, Friend>::const_iterator it2 = friends.find(hash);
-        if (it2 == friends.cend())
-        {
-            return NULL;
-        }
-        return &(it2->second);
-        // return getFriend(hash);
+        return getFriend(m_uidKeys.get(uid));
     }
     Friend* getFriendByUid(const std::string& uid)
     {
-        std::map<std::string, std::string>::const_iterator it = hashes.find(uid);
-        std::string hash = it == hashes.cend() ? md5(uid) : it->second;
-        
-        std::map<std::string, Friend>::iterator it2 = friends.find(hash);
-        if (it2 == friends.end())
+        return getFriend(m_uidKeys.get(uid));
+    }
+    
+    // A friend which is there already is replaced
+    Friend& addFriend(const std::string& uid)
+    {
+        return addFriend(uid, m_uidKeys.get(uid));
+    }
+    // uidKey is the key of uid, from getUidKeys
+    Friend& addFriend(const std::string& uid, const HashKey& uidKey)
+    {
+        bool inserted = false;
+        HashMapEntry<size_t>* entry = m_indexes.insert(uidKey, inserted);
+        if (inserted)
         {
-            return NULL;
+            entry->value = m_friends.size();
+            m_friends.push_back(Friend(uid, uidKey));
+            m_detailsLoaded.emplace_back(false);
+            return m_friends.back();
         }
-        return &(it2->second);
-        // return getFriend(hash);
+        Friend& f = m_friends[entry->value];
+        f = Friend(uid, uidKey);
+        m_detailsLoaded[entry->value].store(false, std::memory_order_relaxed);
+        return f;
     }
     
-    Friend& addFriend(const std::string& uid)
+    // The details of the friends added by addPendingDetails are loaded on their first access. Takes the ownership of the loader
+    void setDetailLoader(FriendDetailLoader* detailLoader)
     {
-        std::map<std::string, std::string>::const_iterator it = hashes.find(uid);
-        std::string hash = it == hashes.cend() ? md5(uid) : it->second;
-        if (it == hashes.cend())
+        if (NULL != m_detailLoader)
         {
-            hashes[uid] = hash;
+            delete m_detailLoader;
+        }
+        m_detailLoader = detailLoader;
+    }
+    void addPendingDetails(const HashKey& uidKey, int64_t rowId)
+    {
+        bool inserted = false;
+        m_pendingDetails.insert(uidKey, inserted)->value = rowId;
+        const HashMapEntry<size_t>* entry = m_indexes.find(uidKey);
+        if (NULL != entry)
+        {
+            m_detailsLoaded[entry->value].store(false, std::memory_order_relaxed);
         }
-        
-        friends[hash] = Friend(uid, hash);
-        return friends[hash];
     }
+    // The keys of the uids seen in the export, the parsers and the sessions look the same uids up with them
+    UidKeys& getUidKeys() const
+    {
+        return m_uidKeys;
+    }
+    size_t getNumberOfPendingDetails() const
+    {
+        std::lock_guard<std::mutex> lock(m_detailMutex);
+        return m_pendingDetails.size();
+    }
+    
+private:
+    Friends(const Friends&);
+    Friends& operator=(const Friends&);
     
-    void addHash(const std::string& uid)
+    // Sessions exported in parallel share the friends, the loader is called by one of them at a time.
+    // Only the first access of a friend takes the lock, the flag publishes the details to the later ones
+    void loadDetails(size_t index) const
     {
-        std::map<std::string, std::string>::const_iterator it = hashes.find(uid);
-        if (it == hashes.cend())
+        if (NULL == m_detailLoader || m_detailsLoaded[index].load(std::memory_order_acquire))
+        {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(m_detailMutex);
+        if (m_detailsLoaded[index].load(std::memory_order_relaxed))
         {
-            hashes[uid] = md5(uid);
+            return;
         }
+        Friend& f = const_cast<Friend&>(m_friends[index]);
+        const HashMapEntry<int64_t>* entry = m_pendingDetails.find(f.getHashKey());
+        if (NULL != entry)
+        {
+            int64_t rowId = entry->value;
+            m_pendingDetails.erase(f.getHashKey());
+            m_detailLoader->load(rowId, f);
+        }
+        m_detailsLoaded[index].store(true, std::memory_order_release);
     }
     
+    std::deque<Friend> m_friends;   // The deque keeps the friends where they are as it grows
+    HashMap<size_t> m_indexes;      // uidKey => index in m_friends
+    mutable std::deque<std::atomic<bool>> m_detailsLoaded;  // Per friend in m_friends, set once its details are decoded
+    mutable UidKeys m_uidKeys;
+    FriendDetailLoader* m_detailLoader;
+    mutable std::mutex m_detailMutex;
+    mutable HashMap<int64_t> m_pendingDetails;   // uidKey => rowid
 };
 
 class Session : public Friend
@@ -495,6 +584,7 @@ class Session : public Friend
 protected:
     int m_unreadCount;
     int m_recordCount;
+    int64_t m_maxMsgId;     // MAX(MesLocalID) of the message table
     
     unsigned int m_createTime;
     unsigned int m_lastMessageTime;
@@ -505,7 +595,7 @@ protected:
     const Friend* m_owner;
     
 public:
-    Session(const Friend* owner) : Friend(), m_unreadCount(0), m_recordCount(0), m_createTime(0), m_lastMessageTime(0), m_data(NULL), m_owner(owner)
+    Session(const Friend* owner) : Friend(), m_unreadCount(0), m_recordCount(0), m_maxMsgId(0), m_createTime(0), m_lastMessageTime(0), m_data(NULL), m_owner(owner)
     {
     }
     
@@ -564,6 +654,16 @@ public:
         m_recordCount = rc;
     }
     
+    inline int64_t getMaxMsgId() const
+    {
+        return m_maxMsgId;
+    }
+    
+    inline void setMaxMsgId(int64_t maxMsgId)
+    {
+        m_maxMsgId = maxMsgId;
+    }
+    
     inline bool isDbFileEmpty() const
     {
         return m_dbFile.empty();
@@ -606,12 +706,12 @@ struct SessionHashCompare
 {
     bool operator()(const Session& s1, const Session& s2) const
     {
-        return s1.getHash().compare(s2.getHash()) < 0;
+        return s1.getHashKey() < s2.getHashKey();
     }
     
-    bool operator()(const Session& s1, const std::string& s2) const
+    bool operator()(const Session& s1, const HashKey& s2) const
     {
-        return s1.getHash().compare(s2) < 0;
+        return s1.getHashKey() < s2;
     }
 };
 
@@ -14,10 +14,11 @@
 #include <algorithm>
 #include <cstdio>
 #include <cstring>
+#include <thread>
 #include <sqlite3.h>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
-#include <libxml/xpath.h>
+#include <libxml/parserInternals.h>
 #include <json/json.h>
 #include <plist/plist.h>
 
@@ -25,77 +26,170 @@
 #include "RawMessage.h"
 #include "XmlParser.h"
 #include "MMKVReader.h"
+#include "LoadingNotifier.h"
 
 #include "OSDef.h"
 
+// Sessions whose cell data files are read by one task
+#define CELL_DATA_BATCH_SIZE    16
+
 #ifdef _WIN32
 #include <atlconv.h>
 #endif
 
-template<class T>
-bool parseMembers(const std::string& xml, T& f)
+// (UserName, DisplayName) of //RoomData/Member, read by SAX callbacks without a DOM.
+// DisplayName is the text of the first DisplayName child like xmlNodeGetContent
+struct ChatroomMembersReader
 {
-    bool result = false;
-    xmlDocPtr doc = NULL;
-    xmlXPathContextPtr xpathCtx = NULL;
-    xmlXPathObjectPtr xpathObj = NULL;
-    xmlNodeSetPtr xpathNodes = NULL;
+    std::vector<std::string> uids;
+    std::vector<std::string> displayNames;
 
-    doc = xmlParseMemory(xml.c_str(), static_cast<int>(xml.size()));
-    if (doc == NULL) { goto end; }
+    ChatroomMembersReader() : m_depth(0), m_memberDepth(0), m_displayNameDepth(0), m_hasDisplayName(false)
+    {
+    }
 
-    xpathCtx = xmlXPathNewContext(doc);
-    if(xpathCtx == NULL) { goto end; }
-    
-    xpathObj = xmlXPathEvalExpression(BAD_CAST("//RoomData/Member"), xpathCtx);
-    if(xpathObj == NULL) { goto end; }
-    
-    xpathNodes = xpathObj->nodesetval; //从xpath object中得到node set
-    if ((xpathNodes) && (xpathNodes->nodeNr > 0))
+    bool read(const std::string& xml)
     {
-        for (int i = 0; i < xpathNodes->nodeNr; i++)
+        xmlSAXHandler saxHander;
+        memset(&saxHander, 0, sizeof(xmlSAXHandler));
+        saxHander.initialized = XML_SAX2_MAGIC;
+        saxHander.startElementNs = startElementNs;
+        saxHander.endElementNs = endElementNs;
+        saxHander.characters = characters;
+        saxHander.cdataBlock = characters;
+
+        xmlParserCtxtPtr ctxt = xmlCreateMemoryParserCtxt(xml.c_str(), static_cast<int>(xml.size()));
+        if (NULL == ctxt)
         {
-            xmlNode *cur = xpathNodes->nodeTab[i];
-            xmlChar* uidPtr = xmlGetProp(cur, reinterpret_cast<const xmlChar *>("UserName"));
-            if (NULL == uidPtr)
+            return false;
+        }
+        xmlSAXHandlerPtr oldSax = ctxt->sax;
+        ctxt->sax = &saxHander;
+        ctxt->userData = this;
+        // Entities in the attributes are replaced like the DOM does
+        xmlCtxtUseOptions(ctxt, XML_PARSE_NOENT | XML_PARSE_NONET);
+        xmlParseDocument(ctxt);
+        bool wellFormed = ctxt->wellFormed != 0;
+        ctxt->sax = oldSax;
+        ctxt->userData = NULL;
+        xmlFreeParserCtxt(ctxt);
+        if (!wellFormed)
+        {
+            // No member of a broken document, as xmlParseMemory gives nothing
+            uids.clear();
+            displayNames.clear();
+        }
+        return wellFormed;
+    }
+
+private:
+    std::vector<bool> m_roomDataElements;   // Whether the open elements are RoomData
+    size_t m_depth;
+    size_t m_memberDepth;       // Of the Member read, 0 if none
+    size_t m_displayNameDepth;  // Of its DisplayName while the text is read, 0 if none
+    bool m_hasDisplayName;
+    std::string m_uid;
+    std::string m_displayName;
+
+    static void startElementNs(void* ctx, const xmlChar* localName, const xmlChar* prefix, const xmlChar* URI, int nb_namespaces, const xmlChar** namespaces, int nb_attributes, int nb_defaulted, const xmlChar** attrs)
+    {
+        ChatroomMembersReader* reader = reinterpret_cast<ChatroomMembersReader *>(ctx);
+        const char* name = reinterpret_cast<const char *>(localName);
+        bool parentIsRoomData = !reader->m_roomDataElements.empty() && reader->m_roomDataElements.back();
+        ++reader->m_depth;
+        reader->m_roomDataElements.push_back(strcmp(name, "RoomData") == 0);
+
+        if (0 == reader->m_memberDepth)
+        {
+            if (!parentIsRoomData || strcmp(name, "Member") != 0)
             {
-                continue;
+                return;
             }
-            
-            std::string uid = reinterpret_cast<char *>(uidPtr);
-            xmlFree(uidPtr);
-            
-            std::string displayName;
-            
-            cur = cur->xmlChildrenNode;
-            while (cur != NULL)
+            // attrs are localname/prefix/URI/value/end of each attribute
+            for (int idx = 0; idx < nb_attributes; ++idx)
             {
-                if ((!xmlStrcmp(cur->name, reinterpret_cast<const xmlChar *>("DisplayName"))))
+                const xmlChar** attr = attrs + idx * 5;
+                if (NULL == attr[1] && xmlStrcmp(attr[0], reinterpret_cast<const xmlChar *>("UserName")) == 0)
                 {
-                    xmlChar *dnPtr = xmlNodeGetContent(cur);
-                    if (NULL != dnPtr)
-                    {
-                        displayName = reinterpret_cast<char *>(dnPtr);
-                        xmlFree(dnPtr);
-                    }
+                    reader->m_memberDepth = reader->m_depth;
+                    reader->m_uid.assign(reinterpret_cast<const char *>(attr[3]), attr[4] - attr[3]);
+                    reader->m_displayName.clear();
+                    reader->m_hasDisplayName = false;
                     break;
                 }
-                cur = cur->next;
             }
-        
-            std::string uidHash = md5(uid);
-            f.addMember(uidHash, std::make_pair(uid, displayName));
+        }
+        else if (reader->m_depth == reader->m_memberDepth + 1 && !reader->m_hasDisplayName && strcmp(name, "DisplayName") == 0)
+        {
+            reader->m_displayNameDepth = reader->m_depth;
+            reader->m_hasDisplayName = true;
         }
     }
+
+    static void endElementNs(void* ctx, const xmlChar* localName, const xmlChar* prefix, const xmlChar* URI)
+    {
+        ChatroomMembersReader* reader = reinterpret_cast<ChatroomMembersReader *>(ctx);
+        if (reader->m_depth == reader->m_displayNameDepth)
+        {
+            reader->m_displayNameDepth = 0;
+        }
+        else if (reader->m_depth == reader->m_memberDepth)
+        {
+            reader->uids.push_back(reader->m_uid);
+            reader->displayNames.push_back(reader->m_displayName);
+            reader->m_memberDepth = 0;
+        }
+        if (reader->m_depth > 0)
+        {
+            --reader->m_depth;
+            reader->m_roomDataElements.pop_back();
+        }
+    }
+
+    static void characters(void* ctx, const xmlChar* ch, int len)
+    {
+        ChatroomMembersReader* reader = reinterpret_cast<ChatroomMembersReader *>(ctx);
+        if (0 != reader->m_displayNameDepth)
+        {
+            reader->m_displayName.append(reinterpret_cast<const char *>(ch), len);
+        }
+    }
+};
+
+// The uids are collected first, so the ones not seen yet are hashed in one batch
+template<class T>
+bool parseMembers(const std::string& xml, T& f, UidKeys* uidKeys)
+{
+    ChatroomMembersReader reader;
+    if (!reader.read(xml))
+    {
+        return false;
+    }
     
-    result = true;
-    
-    end:
-    if (xpathObj) { xmlXPathFreeObject(xpathObj); }
-    if (xpathCtx) { xmlXPathFreeContext(xpathCtx); }
-    if (doc) { xmlFreeDoc(doc); }
+    const std::vector<std::string>& uids = reader.uids;
+    std::vector<HashKey> keys;
+    if (NULL != uidKeys)
+    {
+        uidKeys->get(uids, keys);
+    }
+    else
+    {
+        std::vector<unsigned char> digests(uids.size() * 16);
+        if (!uids.empty())
+        {
+            md5(&uids[0], uids.size(), &digests[0]);
+        }
+        for (size_t idx = 0; idx < uids.size(); ++idx)
+        {
+            keys.push_back(makeHashKey(&digests[idx * 16]));
+        }
+    }
+    for (size_t idx = 0; idx < uids.size(); ++idx)
+    {
+        f.addMember(keys[idx], std::make_pair(uids[idx], reader.displayNames[idx]));
+    }
     
-    return result;
+    return true;
 }
 
 LoginInfo2Parser::LoginInfo2Parser(ITunesDb *iTunesDb
@@ -188,7 +282,7 @@ bool LoginInfo2Parser::parse(const std::string& loginInfo2Path, std::vector<Frie
     for (ITunesFilesConstIterator it = mmsettings.cbegin(); it != mmsettings.cend(); ++it)
     {
 #if !defined(NDEBUG) || defined(DBG_PERF)
-        m_logger->debug("mmsetting: " + (*it)->relativePath  + " => " + (*it)->fileId);
+        m_logger->debug("mmsetting: " + (*it)->getRelativePath()  + " => " + (*it)->getFileId());
 #endif
         std::string fileName = filter.parse((*it));
         fileName = fileName.substr(filter.getPrefix().size());
@@ -363,7 +457,8 @@ bool LoginInfo2Parser::parseUserFromFolder(std::vector<Friend>& users)
 #if !defined(NDEBUG) || defined(DBG_PERF)
         m_error += "User Folder: *" + fileName + "*  ";
 #endif
-        if (fileName == "00000000000000000000000000000000")
+        HashKey userKey;
+        if (fileName == "00000000000000000000000000000000" || !parseHashKey(fileName, userKey))
         {
             continue;
         }
@@ -376,7 +471,7 @@ bool LoginInfo2Parser::parseUserFromFolder(std::vector<Friend>& users)
         std::vector<Friend>::const_iterator it2 = users.cbegin();
         for (; it2 != users.cend(); ++it2)
         {
-            if (it2->getHash() == fileName)
+            if (it2->getHashKey() == userKey)
             {
                 existing = true;
                 break;
@@ -388,7 +483,7 @@ bool LoginInfo2Parser::parseUserFromFolder(std::vector<Friend>& users)
 #if !defined(NDEBUG) || defined(DBG_PERF)
             m_logger->debug("New User Folder:" + fileName);
 #endif
-            users.emplace(users.end(), "", fileName);
+            users.emplace(users.end(), "", userKey);
 #if !defined(NDEBUG) || defined(DBG_PERF)
             m_error += "New User From Folder: *" + fileName + "*  ";
 #endif
@@ -468,7 +563,9 @@ bool MMKVParser::parse(const std::string& path, const std::string& crcPath)
 #endif
     }
     
-    if (!readFile(path, contents))
+    // Mapped, only the values of the settings below are copied out
+    MMKVIndex index;
+    if (!index.open(path, lastActualSize))
     {
 #if !defined(NDEBUG) || defined(DBG_PERF)
         m_logger->debug("Failed to read MMKV file:" + path);
@@ -477,84 +574,18 @@ bool MMKVParser::parse(const std::string& path, const std::string& crcPath)
     }
     
 #if !defined(NDEBUG) || defined(DBG_PERF)
-    m_logger->debug("MMKV file size:" + std::to_string(contents.size()));
+    m_logger->debug("MMKV keys:" + std::to_string(index.size()));
 #endif
     
-    uint32_t actualSize = 0;
-    if (contents.size() >= 4)
-    {
-        memcpy(&actualSize, &contents[0], 4);
-    }
-    if (actualSize <= 0)
-    {
-        actualSize = lastActualSize;
-    }
-    
-    if (actualSize <= 0)
-    {
+    index.getString("86", m_usrName);
+    index.getString("87", m_name);
+    index.getString("88", m_displayName);
+    index.getString("headimgurl", m_portrait);
+    index.getString("headhdimgurl", m_portraitHD);
 #if !defined(NDEBUG) || defined(DBG_PERF)
-        m_logger->debug("MMKV actualSize is less than 0: " + std::to_string(actualSize));
+    m_logger->debug("MMKV usrName: " + m_usrName);
+    m_logger->debug("MMKV displayName: " + m_displayName);
 #endif
-        return false;
-    }
-
-    actualSize += 4;
-    if (contents.size() < actualSize)
-    {
-#if !defined(NDEBUG) || defined(DBG_PERF)
-        m_logger->debug("MMKV contents size < actualSize: " + std::to_string(contents.size()) + "/" + std::to_string(actualSize));
-#endif
-    }
-    
-    MMKVReader reader(&contents[0], actualSize);
-    reader.seek(8);
-    
-    while (!reader.isAtEnd())
-    {
-#if !defined(NDEBUG) || defined(DBG_PERF)
-        // m_logger->debug("MMKV offset: " + std::to_string(reader.getPos()) + "/" + std::to_string(actualSize));
-#endif
-        // 
-        const auto k = reader.readKey();
-        if (k.empty())
-        {
-#if !defined(NDEBUG) || defined(DBG_PERF)
-            m_logger->debug("MMKV exception: empty key");
-#endif
-            break;
-        }
-        
-        if (k == "86")
-        {
-            m_usrName = reader.readStringValue();
-#if !defined(NDEBUG) || defined(DBG_PERF)
-            m_logger->debug("MMKV usrName: " + m_usrName);
-#endif
-        }
-        else if (k == "87")
-        {
-            m_name = reader.readStringValue();
-        }
-        else if (k == "88")
-        {
-            m_displayName = reader.readStringValue();
-#if !defined(NDEBUG) || defined(DBG_PERF)
-            m_logger->debug("MMKV displayName: " + m_displayName);
-#endif
-        }
-        else if (k == "headimgurl")
-        {
-            m_portrait = reader.readStringValue();
-        }
-        else if (k == "headhdimgurl")
-        {
-            m_portraitHD = reader.readStringValue();
-        }
-        else
-        {
-            reader.skipValue();
-        }
-    }
     
     return true;
 }
@@ -722,7 +753,7 @@ bool MMSettingParser::parse(const std::string& usrNameHash)
     return true;
 }
 
-FriendsParser::FriendsParser(bool detailedInfo/* = true*/) : m_detailedInfo(detailedInfo)
+FriendsParser::FriendsParser(bool detailedInfo/* = true*/) : m_detailedInfo(detailedInfo), m_uidKeys(NULL)
 {
 }
 
@@ -733,6 +764,42 @@ void FriendsParser::setOutputPath(const std::string& outputPath)
 }
 #endif
 
+// Keeps the contact database open during the exporting, the blobs of a friend are read by rowid
+class WcdbFriendDetailLoader : public FriendDetailLoader
+{
+public:
+    // Takes the ownership of db and stmt
+    WcdbFriendDetailLoader(const FriendsParser& parser, sqlite3 *db, sqlite3_stmt *stmt) : m_parser(parser), m_db(db), m_stmt(stmt)
+    {
+    }
+    
+    ~WcdbFriendDetailLoader()
+    {
+        sqlite3_finalize(m_stmt);
+        sqlite3_close(m_db);
+    }
+    
+    void load(int64_t rowId, Friend& f)
+    {
+        sqlite3_bind_int64(m_stmt, 1, rowId);
+        if (sqlite3_step(m_stmt) == SQLITE_ROW)
+        {
+            m_parser.parseRemark(sqlite3_column_blob(m_stmt, 0), sqlite3_column_bytes(m_stmt, 0), f);
+            m_parser.parseAvatar(sqlite3_column_blob(m_stmt, 2), sqlite3_column_bytes(m_stmt, 2), f);
+            m_parser.parseChatroom(sqlite3_column_blob(m_stmt, 1), sqlite3_column_bytes(m_stmt, 1), f);
+        }
+        sqlite3_reset(m_stmt);
+    }
+    
+private:
+    WcdbFriendDetailLoader(const WcdbFriendDetailLoader&);
+    WcdbFriendDetailLoader& operator=(const WcdbFriendDetailLoader&);
+    
+    FriendsParser m_parser;
+    sqlite3 *m_db;
+    sqlite3_stmt *m_stmt;
+};
+
 bool FriendsParser::parseWcdb(const std::string& mmPath, Friends& friends)
 {
     sqlite3 *db = NULL;
@@ -743,19 +810,37 @@ bool FriendsParser::parseWcdb(const std::string& mmPath, Friends& friends)
         return false;
     }
     
-    std::string sql = "SELECT userName,dbContactRemark,dbContactChatRoom,dbContactHeadImage,type FROM Friend";
+    // Only the friends accessed by the exported sessions are decoded, not the whole address book
+    sqlite3_stmt* detailStmt = NULL;
+    if (m_detailedInfo)
+    {
+        std::string detailSql = "SELECT dbContactRemark,dbContactChatRoom,dbContactHeadImage FROM Friend WHERE rowid=?";
+        if (sqlite3_prepare_v2(db, detailSql.c_str(), (int)(detailSql.size()), &detailStmt, NULL) != SQLITE_OK)
+        {
+            sqlite3_finalize(detailStmt);
+            detailStmt = NULL;
+        }
+    }
+    
+    m_uidKeys = &friends.getUidKeys();
+    
+    std::string sql = (NULL != detailStmt) ? "SELECT userName,rowid,type FROM Friend" : "SELECT userName,dbContactRemark,type,dbContactChatRoom,dbContactHeadImage FROM Friend";
     sqlite3_stmt* stmt = NULL;
     rc = sqlite3_prepare_v2(db, sql.c_str(), (int)(sql.size()), &stmt, NULL);
     if (rc != SQLITE_OK)
     {
         std::string error = sqlite3_errmsg(db);
+        sqlite3_finalize(detailStmt);
         sqlite3_close(db);
         return false;
     }
 
+    std::vector<std::string> uids;
+    std::vector<int> userTypes;
+    std::vector<int64_t> rowIds;
     while (sqlite3_step(stmt) == SQLITE_ROW)
     {
-        int userType = sqlite3_column_int(stmt, 4);
+        int userType = sqlite3_column_int(stmt, 2);
         const char* val = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
         if (NULL == val)
         {
@@ -768,27 +853,52 @@ bool FriendsParser::parseWcdb(const std::string& mmPath, Friends& friends)
             continue;
         }
         
+        if (NULL != detailStmt)
+        {
+            // Added after the loop, with the keys of all the uids hashed in one batch
+            uids.push_back(uid);
+            userTypes.push_back(userType);
+            rowIds.push_back(sqlite3_column_int64(stmt, 1));
+            continue;
+        }
         Friend& f = friends.addFriend(uid);
         f.setUserType(userType);
-        
         parseRemark(sqlite3_column_blob(stmt, 1), sqlite3_column_bytes(stmt, 1), f);
         if (m_detailedInfo)
         {
-            parseAvatar(sqlite3_column_blob(stmt, 3), sqlite3_column_bytes(stmt, 3), f);
-            parseChatroom(sqlite3_column_blob(stmt, 2), sqlite3_column_bytes(stmt, 2), f);
+            parseAvatar(sqlite3_column_blob(stmt, 4), sqlite3_column_bytes(stmt, 4), f);
+            parseChatroom(sqlite3_column_blob(stmt, 3), sqlite3_column_bytes(stmt, 3), f);
         }
     }
     
     sqlite3_finalize(stmt);
-    sqlite3_close(db);
+    
+    std::vector<HashKey> keys;
+    m_uidKeys->get(uids, keys);
+    for (size_t idx = 0; idx < uids.size(); ++idx)
+    {
+        Friend& f = friends.addFriend(uids[idx], keys[idx]);
+        f.setUserType(userTypes[idx]);
+        friends.addPendingDetails(keys[idx], rowIds[idx]);
+    }
+    
+    if (NULL != detailStmt)
+    {
+        friends.setDetailLoader(new WcdbFriendDetailLoader(*this, db, detailStmt));
+    }
+    else
+    {
+        sqlite3_close(db);
+    }
     
     return true;
 }
 
 bool FriendsParser::parseRemark(const void *data, int length, Friend& f)
 {
-    RawMessage msg;
-    if (!msg.merge(reinterpret_cast<const char *>(data), length))
+    static const ProtobufFieldPaths paths({ "1" });
+    ProtobufFields msg(paths);
+    if (!parseProtobufFields(reinterpret_cast<const char *>(data), length, msg))
     {
         return false;
     }
@@ -809,9 +919,9 @@ bool FriendsParser::parseRemark(const void *data, int length, Friend& f)
 
 bool FriendsParser::parseAvatar(const void *data, int length, Friend& f)
 {
-
-    RawMessage msg;
-    if (!msg.merge(reinterpret_cast<const char *>(data), length))
+    static const ProtobufFieldPaths paths({ "2", "3" });
+    ProtobufFields msg(paths);
+    if (!parseProtobufFields(reinterpret_cast<const char *>(data), length, msg))
     {
         return false;
     }
@@ -837,8 +947,9 @@ bool FriendsParser::parseAvatar(const void *data, int length, Friend& f)
 
 bool FriendsParser::parseChatroom(const void *data, int length, Friend& f)
 {
-    RawMessage msg;
-    if (!msg.merge(reinterpret_cast<const char *>(data), length))
+    static const ProtobufFieldPaths paths({ "6" });
+    ProtobufFields msg(paths);
+    if (!parseProtobufFields(reinterpret_cast<const char *>(data), length, msg))
     {
         return false;
     }
@@ -846,7 +957,7 @@ bool FriendsParser::parseChatroom(const void *data, int length, Friend& f)
     std::string value;
     if (msg.parse("6", value))
     {
-        parseMembers(value, f);
+        parseMembers(value, f, m_uidKeys);
     }
 
     return true;
@@ -922,7 +1033,7 @@ bool WechatInfoParser::parsePreferences(WechatInfo& wechatInfo)
     return true;
 }
 
-SessionsParser::SessionsParser(ITunesDb *iTunesDb, ITunesDb *iTunesDbShare, const std::string& cellDataVersion, bool detailedInfo/* = true*/) : m_iTunesDb(iTunesDb), m_iTunesDbShare(iTunesDbShare), m_cellDataVersion(cellDataVersion), m_detailedInfo(detailedInfo)
+SessionsParser::SessionsParser(ITunesDb *iTunesDb, ITunesDb *iTunesDbShare, const std::string& cellDataVersion, bool detailedInfo/* = true*/) : m_iTunesDb(iTunesDb), m_iTunesDbShare(iTunesDbShare), m_cellDataVersion(cellDataVersion), m_detailedInfo(detailedInfo), m_estimatingCounts(false), m_scannedDbs(false), m_succeeded(false)
 {
     if (cellDataVersion.empty())
     {
@@ -932,8 +1043,66 @@ SessionsParser::SessionsParser(ITunesDb *iTunesDb, ITunesDb *iTunesDbShare, cons
 
 bool SessionsParser::parse(const Friend& user, std::vector<Session>& sessions, const Friends& friends)
 {
-    std::string usrNameHash = user.getHash();
-    std::string userRoot = "Documents/" + usrNameHash;
+    TaskGraph graph;
+    addTasks(graph, user, sessions, friends, std::vector<TaskGraph::TaskId>());
+    graph.run();
+    return m_succeeded;
+}
+
+// The sessions are read first, then their cell data in batches. The message databases are scanned meanwhile,
+// their stats are applied at last, when the sessions are sorted by their hashes
+void SessionsParser::addTasks(TaskGraph& graph, const Friend& user, std::vector<Session>& sessions, const Friends& friends, const std::vector<TaskGraph::TaskId>& friendsTasks)
+{
+    m_succeeded = false;
+    std::string userRoot = "Documents/" + user.getHash();
+    std::vector<TaskGraph::TaskId> dbTasks = addMessageDbTasks(graph, userRoot);
+    
+    graph.add([this, &graph, &user, &sessions, &friends, friendsTasks, dbTasks, userRoot]() {
+        m_succeeded = parseSessionDb(user, userRoot, sessions);
+        notifyStage(SESSIONS_LOADED_BASIC);
+        
+        std::vector<TaskGraph::TaskId> cellDataTasks;
+        for (size_t begin = 0; begin < sessions.size(); begin += CELL_DATA_BATCH_SIZE)
+        {
+            size_t end = begin + CELL_DATA_BATCH_SIZE;
+            if (end > sessions.size())
+            {
+                end = sessions.size();
+            }
+            cellDataTasks.push_back(graph.add([this, &sessions, &friends, userRoot, begin, end]() {
+                for (size_t idx = begin; idx < end; ++idx)
+                {
+                    Session& session = sessions[idx];
+                    if (!session.isExtFileNameEmpty())
+                    {
+                        parseCellData(userRoot, session, friends.getUidKeys());
+                    }
+                    const Friend* f = friends.getFriend(session.getHashKey());
+                    if (NULL != f && !session.isChatroom())
+                    {
+                        session.update(*f);
+                    }
+                }
+            }, friendsTasks));
+        }
+        
+        std::string shareUserRoot = "share/" + user.getHash();
+        TaskGraph::TaskId groupAppTask = graph.add([this, &sessions, shareUserRoot]() {
+            parseSessionsInGroupApp(shareUserRoot, sessions);
+            notifyStage(SESSIONS_LOADED_NAMES);
+        }, cellDataTasks);
+        
+        std::vector<TaskGraph::TaskId> dependencies(dbTasks);
+        dependencies.push_back(groupAppTask);
+        graph.add([this, &sessions]() {
+            applyMessageDbStats(sessions);
+            notifyStage(SESSIONS_LOADED_COUNTS);
+        }, dependencies);
+    });
+}
+
+bool SessionsParser::parseSessionDb(const Friend& user, const std::string& userRoot, std::vector<Session>& sessions)
+{
     std::string sessionDbPath = m_iTunesDb->findRealPath(combinePath(userRoot, "session", "session.db"));
 	if (sessionDbPath.empty())
 	{
@@ -975,83 +1144,115 @@ bool SessionsParser::parse(const Friend& user, std::vector<Session>& sessions, c
         const char* extFileName = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
         if (NULL != extFileName) session.setExtFileName(extFileName);
         session.setUnreadCount(sqlite3_column_int(stmt, 2));
-
-        if (!session.isExtFileNameEmpty())
-        {
-            parseCellData(userRoot, session);
-        }
-        const Friend* f = friends.getFriend(session.getHash());
-        if (NULL != f)
-        {
-            if (!session.isChatroom())
-            {
-                session.update(*f);
-            }
-        }
     }
     
     sqlite3_finalize(stmt);
     sqlite3_close(db);
-
-    std::string shareUserRoot = "share/" + usrNameHash;
-    parseSessionsInGroupApp(shareUserRoot, sessions);
     
-    // if (m_detailedInfo)
+    return true;
+}
+
+void SessionsParser::setEstimatingCounts(bool estimatingCounts/* = true*/)
+{
+    m_estimatingCounts = estimatingCounts;
+}
+
+void SessionsParser::setStatsCacheFile(const std::string& statsCacheFile)
+{
+    m_statsCacheFile = statsCacheFile;
+}
+
+void SessionsParser::setStageHandler(const std::function<void(int)>& stageHandler)
+{
+    m_stageHandler = stageHandler;
+}
+
+void SessionsParser::notifyStage(int stage) const
+{
+    if (m_stageHandler)
     {
-        parseMessageDbs(userRoot, sessions);
+        m_stageHandler(stage);
     }
+}
+
+std::vector<TaskGraph::TaskId> SessionsParser::addMessageDbTasks(TaskGraph& graph, const std::string& userRoot)
+{
+    MessageDbFilter filter(userRoot);
+    ITunesFileVector dbs = m_iTunesDb->filter(filter);
     
+    // MM.sqlite goes first, a session found in more databases is taken by the last one
+    m_dbStats.clear();
+    m_dbStats.resize(dbs.size() + 1);
+    m_dbStats[0].path = m_iTunesDb->findRealPath(combinePath(userRoot, "DB", "MM.sqlite"));
+    for (size_t idx = 0; idx < dbs.size(); ++idx)
+    {
+        m_dbStats[idx + 1].path = m_iTunesDb->getRealPath(dbs[idx]);
+    }
     
-    return true;
+    std::map<std::string, MessageDbStats> cachedStats;
+    if (!m_statsCacheFile.empty())
+    {
+        loadStatsCache(cachedStats);
+    }
+    m_scannedDbs = false;
+    std::vector<TaskGraph::TaskId> tasks;
+    for (size_t idx = 0; idx < m_dbStats.size(); ++idx)
+    {
+        MessageDbStats& dbStats = m_dbStats[idx];
+        if (!getFileInfo(dbStats.path, dbStats.size, dbStats.modifiedTime))
+        {
+            dbStats.size = 0;
+            dbStats.modifiedTime = 0;
+        }
+        std::map<std::string, MessageDbStats>::const_iterator it = cachedStats.find(dbStats.path);
+        if (it != cachedStats.cend() && it->second.size == dbStats.size && it->second.modifiedTime == dbStats.modifiedTime && (it->second.exact || m_estimatingCounts))
+        {
+            dbStats.exact = it->second.exact;
+            dbStats.tables = it->second.tables;
+            continue;
+        }
+        
+        // Each database is scanned on its own connection
+        m_scannedDbs = true;
+        tasks.push_back(graph.add([this, idx]() {
+            MessageDbStats& dbStats = m_dbStats[idx];
+            dbStats.exact = !m_estimatingCounts;
+            parseMessageDb(dbStats.path, dbStats.tables);
+        }));
+    }
+    return tasks;
 }
 
-bool SessionsParser::parseMessageDbs(const std::string& userRoot, std::vector<Session>& sessions)
+void SessionsParser::applyMessageDbStats(std::vector<Session>& sessions)
 {
 	SessionHashCompare comp;
 	std::sort(sessions.begin(), sessions.end(), comp);
-
-    MessageDbFilter filter(userRoot);
-    ITunesFileVector dbs = m_iTunesDb->filter(filter);
     
-    std::string dbPath = m_iTunesDb->findRealPath(combinePath(userRoot, "DB", "MM.sqlite"));
-
-    std::vector<std::pair<std::string, int>> sessionIds;
-    parseMessageDb(dbPath, sessionIds);
-
-	for (typename std::vector<std::pair<std::string, int>>::const_iterator it = sessionIds.cbegin(); it != sessionIds.cend(); ++it)
-	{
-		std::vector<Session>::iterator itSession = std::lower_bound(sessions.begin(), sessions.end(), it->first, comp);
-		if (itSession != sessions.end() && itSession->getHash() == it->first)
-		{
-			itSession->setDbFile(dbPath);
-            itSession->setRecordCount(it->second);
-		}
-	}
-
-    for (ITunesFilesConstIterator it = dbs.cbegin(); it != dbs.cend(); ++it)
+    for (std::vector<MessageDbStats>::const_iterator it = m_dbStats.cbegin(); it != m_dbStats.cend(); ++it)
     {
-        dbPath = m_iTunesDb->getRealPath(*it);
-		sessionIds.clear();
-        parseMessageDb(dbPath, sessionIds);
-
-		for (typename std::vector<std::pair<std::string, int>>::const_iterator itId = sessionIds.cbegin(); itId != sessionIds.cend(); ++itId)
+		for (typename std::vector<MessageTable>::const_iterator itTable = it->tables.cbegin(); itTable != it->tables.cend(); ++itTable)
 		{
-			std::vector<Session>::iterator itSession = std::lower_bound(sessions.begin(), sessions.end(), itId->first, comp);
-			if (itSession != sessions.end() && itSession->getHash() == itId->first)
+			std::vector<Session>::iterator itSession = std::lower_bound(sessions.begin(), sessions.end(), itTable->chatKey, comp);
+			if (itSession != sessions.end() && itSession->getHashKey() == itTable->chatKey)
 			{
-				itSession->setDbFile(dbPath);
-                itSession->setRecordCount(itId->second);
+				itSession->setDbFile(it->path);
+                itSession->setRecordCount(itTable->recordCount);
+                itSession->setMaxMsgId(itTable->maxMsgId);
 			}
 		}
     }
-
-    return true;
+    
+    if (!m_statsCacheFile.empty() && m_scannedDbs)
+    {
+        saveStatsCache(m_dbStats);
+    }
 }
 
-bool SessionsParser::parseMessageDb(const std::string& mmPath, std::vector<std::pair<std::string, int>>& sessionIds)
+bool SessionsParser::parseMessageDb(const std::string& mmPath, std::vector<MessageTable>& tables) const
 {
     sqlite3 *db = NULL;
-    int rc = openSqlite3ReadOnly(mmPath, &db);
+    // COUNT(*) reads the whole tables once, they don't need the cache
+    int rc = openSqlite3ReadOnly(mmPath, &db, !m_estimatingCounts);
     if (rc != SQLITE_OK)
     {
         sqlite3_close(db);
@@ -1078,24 +1279,36 @@ bool SessionsParser::parseMessageDb(const std::string& mmPath, std::vector<std::
         }
         std::string name = reinterpret_cast<const char*>(pName);
         // "^Chat_([0-9a-f]{32})$"
-        if (startsWith(name, "Chat_"))
+        HashKey chatKey;
+        if (startsWith(name, "Chat_") && parseHashKey(name.c_str() + 5, name.size() - 5, chatKey))
         {
-            std::string chatId = name.substr(5);
-            int recordCount = 0;
-            std::string sql2 = "SELECT COUNT(*) AS rc FROM " + name;
+            MessageTable table = {chatKey, 0, 0};
+            // MesLocalID is the rowid, MAX and MIN of it alone are only lookups.
+            // sqlite_stat1 is not used for the estimation, it misses the messages after the last ANALYZE
+            std::string sql2 = m_estimatingCounts ? ("SELECT (SELECT MAX(MesLocalID) FROM " + name + "), (SELECT MIN(MesLocalID) FROM " + name + ")") : ("SELECT COUNT(*) AS rc, MAX(MesLocalID) FROM " + name);
             sqlite3_stmt* stmt2 = NULL;
             rc = sqlite3_prepare_v2(db, sql2.c_str(), (int)(sql2.size()), &stmt2, NULL);
             if (rc == SQLITE_OK)
             {
                 if (sqlite3_step(stmt2) == SQLITE_ROW)
                 {
-                    recordCount = sqlite3_column_int(stmt2, 0);
+                    if (m_estimatingCounts)
+                    {
+                        table.maxMsgId = sqlite3_column_int64(stmt2, 0);
+                        int64_t minMsgId = sqlite3_column_int64(stmt2, 1);
+                        table.recordCount = table.maxMsgId > 0 ? static_cast<int>(table.maxMsgId - minMsgId + 1) : 0;
+                    }
+                    else
+                    {
+                        table.recordCount = sqlite3_column_int(stmt2, 0);
+                        table.maxMsgId = sqlite3_column_int64(stmt2, 1);
+                    }
                 }
                 
                 sqlite3_finalize(stmt2);
             }
             
-            sessionIds.push_back(std::make_pair<>(chatId, recordCount));
+            tables.push_back(table);
         }
     }
     
@@ -1105,7 +1318,94 @@ bool SessionsParser::parseMessageDb(const std::string& mmPath, std::vector<std::
     return true;
 }
 
-bool SessionsParser::parseCellData(const std::string& userRoot, Session& session)
+void SessionsParser::loadStatsCache(std::map<std::string, MessageDbStats>& stats) const
+{
+    std::string contents = readFile(m_statsCacheFile);
+    Json::Reader reader;
+    Json::Value cacheObj;
+    if (contents.empty() || !reader.parse(contents, cacheObj) || !cacheObj.isObject() || !cacheObj["dbs"].isArray())
+    {
+        return;
+    }
+    
+    const Json::Value& dbItems = cacheObj["dbs"];
+    for (Json::ArrayIndex idx = 0; idx < dbItems.size(); idx++)
+    {
+        const Json::Value& dbObj = dbItems[idx];
+        if (!dbObj.isObject() || !dbObj.isMember("path") || !dbObj.isMember("size") || !dbObj.isMember("mtime") || !dbObj["tables"].isArray())
+        {
+            continue;
+        }
+        MessageDbStats dbStats;
+        dbStats.path = dbObj["path"].asString();
+        dbStats.size = dbObj["size"].asUInt64();
+        dbStats.modifiedTime = static_cast<std::time_t>(dbObj["mtime"].asInt64());
+        dbStats.exact = dbObj["exact"].asBool();
+        
+        const Json::Value& tableItems = dbObj["tables"];
+        dbStats.tables.reserve(tableItems.size());
+        for (Json::ArrayIndex tableIdx = 0; tableIdx < tableItems.size(); tableIdx++)
+        {
+            // [chatId, recordCount, maxMsgId]
+            const Json::Value& tableObj = tableItems[tableIdx];
+            if (!tableObj.isArray() || tableObj.size() != 3)
+            {
+                continue;
+            }
+            HashKey chatKey;
+            if (!parseHashKey(tableObj[0].asString(), chatKey))
+            {
+                continue;
+            }
+            MessageTable table = {chatKey, tableObj[1].asInt(), tableObj[2].asInt64()};
+            dbStats.tables.push_back(table);
+        }
+        stats[dbStats.path] = dbStats;
+    }
+}
+
+bool SessionsParser::saveStatsCache(const std::vector<MessageDbStats>& stats) const
+{
+    Json::Value dbItems(Json::arrayValue);
+    for (std::vector<MessageDbStats>::const_iterator it = stats.cbegin(); it != stats.cend(); ++it)
+    {
+        if (it->size == 0)
+        {
+            // Not found
+            continue;
+        }
+        Json::Value tableItems(Json::arrayValue);
+        for (std::vector<MessageTable>::const_iterator itTable = it->tables.cbegin(); itTable != it->tables.cend(); ++itTable)
+        {
+            Json::Value tableObj(Json::arrayValue);
+            tableObj.append(Json::Value(formatHashKey(itTable->chatKey)));
+            tableObj.append(Json::Value(itTable->recordCount));
+            tableObj.append(Json::Value(static_cast<Json::Int64>(itTable->maxMsgId)));
+            tableItems.append(tableObj);
+        }
+        
+        Json::Value dbObj(Json::objectValue);
+        dbObj["path"] = Json::Value(it->path);
+        dbObj["size"] = Json::Value(static_cast<Json::UInt64>(it->size));
+        dbObj["mtime"] = Json::Value(static_cast<Json::Int64>(it->modifiedTime));
+        dbObj["exact"] = Json::Value(it->exact);
+        dbObj["tables"] = tableItems;
+        dbItems.append(dbObj);
+    }
+    
+    Json::Value cacheObj(Json::objectValue);
+    cacheObj["dbs"] = dbItems;
+    
+    Json::FastWriter writer;
+    std::string tempFile = m_statsCacheFile + ".tmp";
+    if (!writeFile(tempFile, writer.write(cacheObj)))
+    {
+        return false;
+    }
+    return moveFile(tempFile, m_statsCacheFile, true);
+}
+
+bool SessionsParser::parseCellData(const std::string& userRoot, Session& session, UidKeys& uidKeys)
 {
 	std::string fileName = session.getExtFileName();
 	if (startsWith(fileName, DIR_SEP) || startsWith(fileName, ALT_DIR_SEP))
@@ -1121,8 +1421,10 @@ bool SessionsParser::parseCellData(const std::string& userRoot, Session& session
 	}
 
 
-	RawMessage msg;
-	if (!msg.mergeFile(fileName))
+    static const ProtobufFieldPaths paths({ "1.1.6", "1.1.4", "1.1.14", "1.5", "2.7", "2.2" });
+    std::vector<unsigned char> contents;
+    ProtobufFields msg(paths);
+    if (!parseProtobufFieldsFromFile(fileName, msg, contents))
 	{
 		return false;
 	}
@@ -1149,7 +1451,7 @@ bool SessionsParser::parseCellData(const std::string& userRoot, Session& session
 	}
 	if (msg.parse("1.5", value))
 	{
-		parseMembers(value, session);
+		parseMembers(value, session, &uidKeys);
 	}
 	if (msg.parse("2.7", value2))
 	{
@@ -1174,8 +1476,10 @@ bool SessionsParser::parseCellData(const std::string& userRoot, Session& session
                 continue;
             }
             
-            RawMessage msg2;
-            if (!msg2.mergeFile(fileName))
+            static const ProtobufFieldPaths paths2({ "10", "7" });
+            std::vector<unsigned char> contents2;
+            ProtobufFields msg2(paths2);
+            if (!parseProtobufFieldsFromFile(fileName, msg2, contents2))
             {
                 continue;
             }
@@ -1194,7 +1498,7 @@ bool SessionsParser::parseCellData(const std::string& userRoot, Session& session
             unsigned int modifiedTime = 0;
             if (items.size() > 1)
             {
-                modifiedTime = ITunesDb::parseModifiedTime((*it)->blob);
+                modifiedTime = ITunesDb::parseModifiedTime(*it);
             }
             if (session.isDisplayNameEmpty() || (!displayName.empty() && modifiedTime > lastModifiedTime))
             {
@@ -1228,13 +1532,14 @@ bool SessionsParser::parseSessionsInGroupApp(const std::string& userRoot, std::v
                 std::string value;
                 if (msg.parse("1", value))
                 {
+                    static const ProtobufFieldPaths paths({ "1", "2", "3" });
                     uint32_t blockLen = 0;
                     const char * data = value.c_str();
                     const char * data1 = NULL;
                     while ((data1 = calcVarint32Ptr(data, value.c_str() + value.size(), &blockLen)) != NULL)
                     {
-                        RawMessage msg2;
-                        if (msg2.merge(data1, static_cast<int>(blockLen)))
+                        ProtobufFields msg2(paths);
+                        if (parseProtobufFields(data1, static_cast<int>(blockLen), msg2))
                         {
                             std::string value2;
                             if (msg2.parse("1", value2))
@@ -1274,13 +1579,14 @@ bool SessionsParser::parseSessionsInGroupApp(const std::string& userRoot, std::v
                 std::string value;
                 if (msg.parse("1", value))
                 {
+                    static const ProtobufFieldPaths paths({ "1", "2", "3" });
                     uint32_t blockLen = 0;
                     const char * data = value.c_str();
                     const char * data1 = NULL;
                     while ((data1 = calcVarint32Ptr(data, value.c_str() + value.size(), &blockLen)) != NULL)
                     {
-                        RawMessage msg2;
-                        if (msg2.merge(data1, static_cast<int>(blockLen)))
+                        ProtobufFields msg2(paths);
+                        if (parseProtobufFields(data1, static_cast<int>(blockLen), msg2))
                         {
                             std::string value2;
                             if (msg2.parse("1", value2))
@@ -1321,50 +1627,48 @@ bool SessionsParser::parseSessionsInGroupApp(const std::string& userRoot, std::v
     return true;
 }
 
-SessionParser::SessionParser(int options) : m_options(options)
+SessionParser::SessionParser(int options, SqliteConnectionPool* dbPool/* = NULL*/) : m_options(options), m_dbPool(dbPool)
 {
 }
 
 SessionParser::MessageEnumerator* SessionParser::buildMsgEnumerator(const Session& session, uint64_t minId)
 {
-    return new MessageEnumerator(session, m_options, minId);
+    return new MessageEnumerator(session, m_options, minId, m_dbPool);
 }
 
 struct MSG_ENUMERATOR_CONTEXT
 {
     sqlite3* db;
     sqlite3_stmt* stmt;
+    SqliteConnectionPool* dbPool;   // Owns db and gets stmt back if it is not NULL
     
-    MSG_ENUMERATOR_CONTEXT(sqlite3* d, sqlite3_stmt* s) : db(d), stmt(s)
+    MSG_ENUMERATOR_CONTEXT(sqlite3* d, sqlite3_stmt* s, SqliteConnectionPool* p) : db(d), stmt(s), dbPool(p)
     {
         
     }
     
     ~MSG_ENUMERATOR_CONTEXT()
     {
+        if (NULL != dbPool)
+        {
+            dbPool->releaseStatement(stmt);
+            return;
+        }
         if (NULL != stmt) sqlite3_finalize(stmt);
         if (NULL != db) sqlite3_close(db);
     }
 };
 
-SessionParser::MessageEnumerator::MessageEnumerator(const Session& session, int options, int64_t minId)
+SessionParser::MessageEnumerator::MessageEnumerator(const Session& session, int options, int64_t minId, SqliteConnectionPool* dbPool)
 {
-    MSG_ENUMERATOR_CONTEXT* context = new MSG_ENUMERATOR_CONTEXT(NULL, NULL);
+    MSG_ENUMERATOR_CONTEXT* context = new MSG_ENUMERATOR_CONTEXT(NULL, NULL, dbPool);
     m_context = context;
     
-    int rc = openSqlite3ReadOnly(session.getDbFile(), &(context->db));
-    if (rc != SQLITE_OK)
-    {
-        sqlite3_close(context->db);
-        context->db = NULL;
-        return;
-    }
-    
     std::string sql = "SELECT CreateTime,Message,Des,Type,MesLocalID FROM Chat_" + session.getHash();
     if (minId > 0)
     {
         // Incremental Exporting
-        sql += " WHERE MesLocalID>" + std::to_string(minId);
+        sql += " WHERE MesLocalID>?";
     }
     sql += " ORDER BY CreateTime";
     if ((options & SPO_DESC) == SPO_DESC)
@@ -1372,12 +1676,37 @@ SessionParser::MessageEnumerator::MessageEnumerator(const Session& session, int
         sql += " DESC";
     }
     
-    rc = sqlite3_prepare_v2(context->db, sql.c_str(), (int)(sql.size()), &(context->stmt), NULL);
-    if (rc != SQLITE_OK)
+    if (NULL != dbPool)
     {
-        sqlite3_close(context->db);
-        context->db = NULL;
-        return;
+        context->stmt = dbPool->acquireStatement(session.getDbFile(), sql);
+        if (NULL == context->stmt)
+        {
+            return;
+        }
+        context->db = sqlite3_db_handle(context->stmt);
+    }
+    else
+    {
+        int rc = openSqlite3ReadOnly(session.getDbFile(), &(context->db), true);
+        if (rc != SQLITE_OK)
+        {
+            sqlite3_close(context->db);
+            context->db = NULL;
+            return;
+        }
+        
+        rc = sqlite3_prepare_v2(context->db, sql.c_str(), (int)(sql.size()), &(context->stmt), NULL);
+        if (rc != SQLITE_OK)
+        {
+            sqlite3_close(context->db);
+            context->db = NULL;
+            return;
+        }
+    }
+    
+    if (minId > 0)
+    {
+        sqlite3_bind_int64(context->stmt, 1, minId);
     }
 }
 
@@ -1409,10 +1738,28 @@ bool SessionParser::MessageEnumerator::isInvalid() const
 }
 
 bool SessionParser::MessageEnumerator::nextMessage(WXMSG& msg)
+{
+    WXMSGROW row;
+    if (!nextRow(row))
+    {
+        return false;
+    }
+    
+    msg.createTime = row.createTime;
+    msg.content.assign(row.content, row.contentLength);
+    msg.des = row.des;
+    msg.type = row.type;
+    msg.msgIdValue = row.msgIdValue;
+    msg.msgId = std::to_string(msg.msgIdValue);
+    
+    return true;
+}
+
+bool SessionParser::MessageEnumerator::nextRow(WXMSGROW& row)
 {
     if (NULL == m_context)
     {
-        return NULL;
+        return false;
     }
         
     MSG_ENUMERATOR_CONTEXT* context = reinterpret_cast<MSG_ENUMERATOR_CONTEXT *>(m_context);
@@ -1423,20 +1770,14 @@ bool SessionParser::MessageEnumerator::nextMessage(WXMSG& msg)
     
     if (sqlite3_step(context->stmt) == SQLITE_ROW)
     {
-        msg.createTime = sqlite3_column_int(context->stmt, 0);
+        row.createTime = sqlite3_column_int(context->stmt, 0);
+        // sqlite3_column_bytes has to be called after sqlite3_column_text for the length of the utf-8 text
         const unsigned char* pMessage = sqlite3_column_text(context->stmt, 1);
-        if (pMessage != NULL)
-        {
-            msg.content = reinterpret_cast<const char*>(pMessage);
-        }
-        else
-        {
-            msg.content.clear();
-        }
-        msg.des = sqlite3_column_int(context->stmt, 2);
-        msg.type = sqlite3_column_int(context->stmt, 3);
-        msg.msgIdValue = sqlite3_column_int64(context->stmt, 4);
-        msg.msgId = std::to_string(msg.msgIdValue);
+        row.content = (pMessage != NULL) ? reinterpret_cast<const char*>(pMessage) : "";
+        row.contentLength = (pMessage != NULL) ? static_cast<size_t>(sqlite3_column_bytes(context->stmt, 1)) : 0;
+        row.des = sqlite3_column_int(context->stmt, 2);
+        row.type = sqlite3_column_int(context->stmt, 3);
+        row.msgIdValue = sqlite3_column_int64(context->stmt, 4);
         
         return true;
     }
@@ -21,6 +21,8 @@
 #include "WechatObjects.h"
 #include "ITunesParser.h"
 #include "MessageParser.h"
+#include "SqliteConnectionPool.h"
+#include "TaskGraph.h"
 #if !defined(NDEBUG) || defined(DBG_PERF)
 #include "Logger.h"
 #endif
@@ -35,21 +37,21 @@ protected:
 public:
     bool operator() (const ITunesFile* s1, const T& s2) const    // less
     {
-        return !startsWith(s1->relativePath, m_path) && s1->relativePath < m_path;
+        return !s1->startsWith(m_path) && s1->compare(m_path) < 0;
     }
     bool operator() (const T& s2, const ITunesFile* s1) const    // greater
     {
-        return !startsWith(s1->relativePath, m_path) && s1->relativePath > m_path;
+        return !s1->startsWith(m_path) && s1->compare(m_path) > 0;
     }
     bool operator==(const ITunesFile* s) const
     {
-        return startsWith(s->relativePath, m_path) && (s->relativePath.find(m_pattern, m_path.size()) != std::string::npos);
+        return s->startsWith(m_path) && s->contains(m_pattern, m_path.size());
     }
     std::string parse(const ITunesFile* s) const
     {
         if (*this == s)
         {
-            return s->relativePath.substr(m_path.size());
+            return std::string(s->relativePath + m_path.size(), s->relativePathLength - m_path.size());
         }
         return std::string("");
     }
@@ -65,21 +67,21 @@ protected:
 public:
     bool operator() (const ITunesFile* s1, const T& s2) const    // less
     {
-        return !startsWith(s1->relativePath, m_path) && s1->relativePath < m_path;
+        return !s1->startsWith(m_path) && s1->compare(m_path) < 0;
     }
     bool operator() (const T& s2, const ITunesFile* s1) const    // greater
     {
-        return !startsWith(s1->relativePath, m_path) && s1->relativePath > m_path;
+        return !s1->startsWith(m_path) && s1->compare(m_path) > 0;
     }
     bool operator==(const ITunesFile* s) const
     {
-        std::smatch sm;
-        return startsWith(s->relativePath, m_path) && std::regex_search(s->relativePath.begin() + m_path.size(), s->relativePath.end(), sm, m_pattern);
+        std::cmatch sm;
+        return s->startsWith(m_path) && std::regex_search(s->relativePath + m_path.size(), s->relativePath + s->relativePathLength, sm, m_pattern);
     }
     std::string parse(const ITunesFile* s) const
     {
-        std::smatch sm;
-        if (std::regex_search(s->relativePath.begin() + m_path.size(), s->relativePath.end(), sm, m_pattern))
+        std::cmatch sm;
+        if (s->relativePathLength >= m_path.size() && std::regex_search(s->relativePath + m_path.size(), s->relativePath + s->relativePathLength, sm, m_pattern))
         {
             return sm[1];
         }
@@ -123,7 +125,7 @@ public:
     
     bool operator==(const ITunesFile* s) const
     {
-        if (/*(s->relativePath.size() != (m_path.size() + 32 + 13)) || */!startsWith(s->relativePath, m_path)|| !endsWith(s->relativePath, m_suffix))
+        if (/*(s->relativePath.size() != (m_path.size() + 32 + 13)) || */!s->startsWith(m_path)|| !s->endsWith(m_suffix))
         {
             return false;
         }
@@ -137,7 +139,7 @@ public:
     
     std::string parse(const ITunesFile* s) const
     {
-        return s->relativePath.substr(m_pathLen, s->relativePath.length() - m_pathLen - m_suffixLen);
+        return std::string(s->relativePath + m_pathLen, s->relativePathLength - m_pathLen - m_suffixLen);
         // return s->relativePath.substr(m_path.size()) : "";
         // return s->relativePath.size() > 32 ? s->relativePath.substr(m_path.size()) : "";
     }
@@ -227,13 +229,13 @@ public:
     
     bool operator==(const ITunesFile* s) const
     {
-        return startsWith(s->relativePath, m_path) && !endsWith(s->relativePath, m_suffix);
+        return s->startsWith(m_path) && !s->endsWith(m_suffix);
     }
     std::string parse(const ITunesFile* s) const
     {
         if (*this == s)
         {
-            return s->relativePath.substr(m_pattern.size());
+            return std::string(s->relativePath + m_pattern.size(), s->relativePathLength - m_pattern.size());
         }
         return std::string("");
     }
@@ -288,18 +290,22 @@ class FriendsParser
 {
 public:
     FriendsParser(bool detailedInfo = true);
+    // With detailedInfo, the remarks, portraits and members are decoded when the friends are accessed
     bool parseWcdb(const std::string& mmPath, Friends& friends);
 #ifndef NDEBUG
     void setOutputPath(const std::string& outputPath);
 #endif
     
 private:
+    friend class WcdbFriendDetailLoader;
+    
     bool parseRemark(const void *data, int length, Friend& f);
     bool parseAvatar(const void *data, int length, Friend& f);
     bool parseChatroom(const void *data, int length, Friend& f);
     
 private:
     bool m_detailedInfo;
+    UidKeys* m_uidKeys;     // Of the friends being parsed
 #ifndef NDEBUG
     std::string m_outputPath;
 #endif
@@ -308,20 +314,69 @@ private:
 class SessionsParser
 {
 private:
+    struct MessageTable
+    {
+        HashKey chatKey;    // Of the hex string in the table name
+        int recordCount;
+        int64_t maxMsgId;
+    };
+    
+    // Stats of the message tables in a message database, the file is identified by its size and modified time
+    struct MessageDbStats
+    {
+        std::string path;
+        uint64_t size;
+        std::time_t modifiedTime;
+        bool exact;     // Record counts are not estimated
+        std::vector<MessageTable> tables;
+        
+        MessageDbStats() : size(0), modifiedTime(0), exact(false)
+        {
+        }
+    };
+    
     ITunesDb *m_iTunesDb;
     ITunesDb *m_iTunesDbShare;
     std::string m_cellDataVersion;
     bool        m_detailedInfo;
+    bool        m_estimatingCounts;
+    std::string m_statsCacheFile;
+    std::function<void(int)> m_stageHandler;
+    
+    // State of the tasks
+    std::vector<MessageDbStats> m_dbStats;
+    bool        m_scannedDbs;
+    bool        m_succeeded;
 
 public:
     SessionsParser(ITunesDb *iTunesDb, ITunesDb *iTunesDbShare, const std::string& cellDataVersion, bool detailedInfo = true);
     
+    // Record counts are estimated from the range of MesLocalID instead of COUNT(*), good enough for the progress
+    void setEstimatingCounts(bool estimatingCounts = true);
+    // Stats of the message databases are kept in the file between runs, a database changed is scanned again
+    void setStatsCacheFile(const std::string& statsCacheFile);
+    // Called by the tasks with SESSIONS_LOADED_* once the sessions reach the stage, nothing changes the sessions while it runs
+    void setStageHandler(const std::function<void(int)>& stageHandler);
+    
     bool parse(const Friend& user, std::vector<Session>& sessions, const Friends& friends);
+    // The parsing as tasks of graph, the cell data are parsed once friendsTasks are done. The parser,
+    // user, sessions and friends have to outlive graph.run, sessions are sorted by their hashes then
+    void addTasks(TaskGraph& graph, const Friend& user, std::vector<Session>& sessions, const Friends& friends, const std::vector<TaskGraph::TaskId>& friendsTasks);
+    // false if the sessions couldn't be read, after graph.run
+    bool isSucceeded() const
+    {
+        return m_succeeded;
+    }
 
 private:
-    bool parseCellData(const std::string& userRoot, Session& session);
-    bool parseMessageDbs(const std::string& userRoot, std::vector<Session>& sessions);
-    bool parseMessageDb(const std::string& mmPath, std::vector<std::pair<std::string, int>>& sessionIds);
+    bool parseSessionDb(const Friend& user, const std::string& userRoot, std::vector<Session>& sessions);
+    bool parseCellData(const std::string& userRoot, Session& session, UidKeys& uidKeys);
+    std::vector<TaskGraph::TaskId> addMessageDbTasks(TaskGraph& graph, const std::string& userRoot);
+    void applyMessageDbStats(std::vector<Session>& sessions);
+    void notifyStage(int stage) const;
+    bool parseMessageDb(const std::string& mmPath, std::vector<MessageTable>& tables) const;
+    void loadStatsCache(std::map<std::string, MessageDbStats>& stats) const;
+    bool saveStatsCache(const std::vector<MessageDbStats>& stats) const;
     
     bool parseSessionsInGroupApp(const std::string& userRoot, std::vector<Session>& sessions);
 };
@@ -332,12 +387,14 @@ public:
     class MessageEnumerator
     {
     protected:
-        MessageEnumerator(const Session& session, int options, int64_t minId);
+        MessageEnumerator(const Session& session, int options, int64_t minId, SqliteConnectionPool* dbPool);
         
         friend SessionParser;
     public:
         bool isInvalid() const;
         bool nextMessage(WXMSG& msg);
+        // No copy of the content, the row is valid until next call
+        bool nextRow(WXMSGROW& row);
         
         ~MessageEnumerator();
     private:
@@ -348,9 +405,10 @@ public:
 private:
     
     int m_options;
+    SqliteConnectionPool* m_dbPool;
     
 public:
-    SessionParser(int options);
+    SessionParser(int options, SqliteConnectionPool* dbPool = NULL);
 
     MessageEnumerator* buildMsgEnumerator(const Session& session, uint64_t minId);
 };
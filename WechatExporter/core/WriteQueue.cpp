@@ -0,0 +1,149 @@
+//
+//  WriteQueue.cpp
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/9.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#include "WriteQueue.h"
+#include <functional>
+#include "FileSystem.h"
+#include "Utils.h"
+#include "ExportMetrics.h"
+
+WriteQueue::WriteQueue(size_t numberOfThreads, size_t maxPendingBytes) : m_maxPendingBytes(maxPendingBytes), m_pendingBytes(0), m_pendingJobs(0), m_failed(false), m_stopping(false)
+{
+    if (numberOfThreads == 0)
+    {
+        numberOfThreads = 1;
+    }
+    m_workers.reserve(numberOfThreads);
+    for (size_t idx = 0; idx < numberOfThreads; ++idx)
+    {
+        Worker* worker = new Worker();
+        m_workers.push_back(worker);
+        worker->thread = std::thread(&WriteQueue::run, this, worker);
+    }
+}
+
+WriteQueue::~WriteQueue()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+        for (std::vector<Worker *>::iterator it = m_workers.begin(); it != m_workers.end(); ++it)
+        {
+            (*it)->jobAdded.notify_all();
+        }
+    }
+    
+    for (std::vector<Worker *>::iterator it = m_workers.begin(); it != m_workers.end(); ++it)
+    {
+        (*it)->thread.join();
+        delete *it;
+    }
+    m_workers.clear();
+}
+
+void WriteQueue::write(const std::string& path, std::string& data, bool appending, Group* group/* = NULL*/)
+{
+    size_t length = data.size();
+    Worker* worker = m_workers[std::hash<std::string>()(path) % m_workers.size()];
+    
+    std::unique_lock<std::mutex> lock(m_mutex);
+    // One job bigger than the limit still goes when the queue is empty.
+    // Over the memory ceiling the queue is drained first, the writes are then one at a time
+    while (m_pendingBytes > 0 && (m_pendingBytes + length > m_maxPendingBytes || isOverMemoryCeiling()))
+    {
+        m_jobDone.wait(lock);
+    }
+    
+    worker->jobs.emplace_back();
+    Job& job = worker->jobs.back();
+    job.path = path;
+    job.data.swap(data);
+    job.appending = appending;
+    job.group = group;
+    m_pendingBytes += length;
+    ++m_pendingJobs;
+    addExportMetric(EXPORT_METRIC_QUEUED_WRITES, 1);
+    addExportMetric(EXPORT_METRIC_PENDING_WRITE_BYTES, static_cast<int64_t>(length));
+    if (NULL != group)
+    {
+        ++group->m_pending;
+    }
+    worker->jobAdded.notify_one();
+}
+
+bool WriteQueue::wait(Group& group)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (group.m_pending > 0)
+    {
+        m_jobDone.wait(lock);
+    }
+    return !group.m_failed;
+}
+
+bool WriteQueue::flush()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (m_pendingJobs > 0)
+    {
+        m_jobDone.wait(lock);
+    }
+    bool succeeded = !m_failed;
+    m_failed = false;
+    return succeeded;
+}
+
+void WriteQueue::run(Worker* worker)
+{
+    setThreadName("writer");
+    Job job;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true)
+    {
+        if (worker->jobs.empty())
+        {
+            if (m_stopping)
+            {
+                break;
+            }
+            worker->jobAdded.wait(lock);
+            continue;
+        }
+        
+        job.path.swap(worker->jobs.front().path);
+        job.data.swap(worker->jobs.front().data);
+        job.appending = worker->jobs.front().appending;
+        job.group = worker->jobs.front().group;
+        worker->jobs.pop_front();
+        
+        lock.unlock();
+        bool succeeded = job.appending ? appendFile(job.path, job.data) : writeFile(job.path, job.data);
+        size_t length = job.data.size();
+        // Released for the accounting
+        std::string().swap(job.data);
+        lock.lock();
+        
+        m_pendingBytes -= length;
+        --m_pendingJobs;
+        addExportMetric(EXPORT_METRIC_QUEUED_WRITES, -1);
+        addExportMetric(EXPORT_METRIC_PENDING_WRITE_BYTES, -static_cast<int64_t>(length));
+        if (!succeeded)
+        {
+            m_failed = true;
+        }
+        if (NULL != job.group)
+        {
+            --job.group->m_pending;
+            if (!succeeded)
+            {
+                job.group->m_failed = true;
+            }
+        }
+        m_jobDone.notify_all();
+    }
+}
@@ -0,0 +1,83 @@
+//
+//  WriteQueue.h
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/9.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#ifndef WriteQueue_h
+#define WriteQueue_h
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Writes the rendered files behind the exporting on threads of its own, so the parsing goes on
+// while the system flushes them (slow on USB disks or network shares).
+// A file always goes to the same thread, so its parts are written in order.
+// The data in the queue is limited by maxPendingBytes, write blocks until there is room,
+// or until the queue is empty while the accounted memory is over the ceiling.
+class WriteQueue
+{
+public:
+    // Writes of a session, it is to be waited for before it's gone
+    class Group
+    {
+    public:
+        Group() : m_pending(0), m_failed(false)
+        {
+        }
+        
+    private:
+        friend class WriteQueue;
+        size_t m_pending;
+        bool m_failed;
+    };
+    
+    WriteQueue(size_t numberOfThreads, size_t maxPendingBytes);
+    // Everything queued is written
+    ~WriteQueue();
+    
+    // data is taken over, appending: data goes to the end of what is already written to the file
+    void write(const std::string& path, std::string& data, bool appending, Group* group = NULL);
+    // Returns false if any write of group failed
+    bool wait(Group& group);
+    // Waits for all writes, returns false if any of them failed since the last flush
+    bool flush();
+    
+private:
+    struct Job
+    {
+        std::string path;
+        std::string data;
+        bool appending;
+        Group* group;
+    };
+    
+    struct Worker
+    {
+        std::thread thread;
+        std::deque<Job> jobs;
+        std::condition_variable jobAdded;
+    };
+    
+    WriteQueue(const WriteQueue&);
+    WriteQueue& operator=(const WriteQueue&);
+    
+    void run(Worker* worker);
+    
+    std::mutex m_mutex;
+    std::condition_variable m_jobDone;
+    std::vector<Worker *> m_workers;
+    size_t m_maxPendingBytes;
+    size_t m_pendingBytes;
+    size_t m_pendingJobs;
+    bool m_failed;
+    bool m_stopping;
+};
+
+#endif /* WriteQueue_h */
@@ -7,6 +7,13 @@
 //
 
 #include "XmlParser.h"
+#include <mutex>
+#include <atomic>
+
+static std::mutex g_xpathCacheMutex;
+static std::map<std::string, xmlXPathCompExprPtr> g_xpathCache;    // Never released, there are only a few dozens of expressions
+static std::atomic<uint64_t> g_xpathCacheHits(0);
+static std::atomic<uint64_t> g_xpathCacheMisses(0);
 
 struct NodeValueHandler
 {
@@ -184,9 +191,58 @@ XmlParser::~XmlParser()
     if (m_doc) { xmlFreeDoc(m_doc); }
 }
 
+xmlXPathCompExprPtr XmlParser::getCompiledXPath(const std::string& xpath)
+{
+    std::lock_guard<std::mutex> lock(g_xpathCacheMutex);
+    std::map<std::string, xmlXPathCompExprPtr>::const_iterator it = g_xpathCache.find(xpath);
+    if (it != g_xpathCache.cend())
+    {
+        g_xpathCacheHits.fetch_add(1, std::memory_order_relaxed);
+        return it->second;
+    }
+    
+    g_xpathCacheMisses.fetch_add(1, std::memory_order_relaxed);
+    // Invalid expressions are kept as NULL so they are not compiled again
+    xmlXPathCompExprPtr comp = xmlXPathCompile(BAD_CAST(xpath.c_str()));
+    g_xpathCache.insert(std::pair<std::string, xmlXPathCompExprPtr>(xpath, comp));
+    return comp;
+}
+
+void XmlParser::getXPathCacheStats(uint64_t& hits, uint64_t& misses, size_t& numberOfExpressions)
+{
+    hits = g_xpathCacheHits.load(std::memory_order_relaxed);
+    misses = g_xpathCacheMisses.load(std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(g_xpathCacheMutex);
+    numberOfExpressions = g_xpathCache.size();
+}
+
+xmlXPathObjectPtr XmlParser::evalXPath(const std::string& xpath) const
+{
+    if (NULL == m_xpathCtx)
+    {
+        return NULL;
+    }
+    xmlXPathCompExprPtr comp = getCompiledXPath(xpath);
+    return (NULL == comp) ? NULL : xmlXPathCompiledEval(comp, m_xpathCtx);
+}
+
+xmlXPathObjectPtr XmlParser::evalXPath(xmlNodePtr node, const std::string& xpath) const
+{
+    if (NULL == m_xpathCtx || NULL == node)
+    {
+        return NULL;
+    }
+    // Same as xmlXPathNodeEval, the context node is kept for the following evaluations
+    if (xmlXPathSetContextNode(node, m_xpathCtx) != 0)
+    {
+        return NULL;
+    }
+    return evalXPath(xpath);
+}
+
 xmlXPathObjectPtr XmlParser::evalXPathOnNode(xmlNodePtr node, const std::string& xpath)
 {
-    return xmlXPathNodeEval(node, BAD_CAST(xpath.c_str()), m_xpathCtx);
+    return evalXPath(node, xpath);
 }
 
 bool XmlParser::parseNodeValue(const std::string& xpath, std::string& value) const
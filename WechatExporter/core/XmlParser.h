@@ -10,6 +10,7 @@
 #define XmlParser_h
 
 #include <cstdio>
+#include <cstdint>
 #include <string>
 #include <map>
 #include <libxml/parser.h>
@@ -42,7 +43,7 @@ public:
     public:
         XPathEnumerator(const XmlParser& xmlParser, xmlNodePtr curNode, const std::string& xpath) : m_xPathObj(NULL), m_numberOfNodes(0), m_cursor(-1)
         {
-            m_xPathObj = xmlXPathNodeEval(curNode, BAD_CAST(xpath.c_str()), xmlParser.m_xpathCtx);
+            m_xPathObj = xmlParser.evalXPath(curNode, xpath);
             if (NULL != m_xPathObj && NULL != m_xPathObj->nodesetval)
             {
                 m_numberOfNodes = m_xPathObj->nodesetval->nodeNr;
@@ -51,7 +52,7 @@ public:
         
         XPathEnumerator(const XmlParser& xmlParser, const std::string& xpath) : m_xPathObj(NULL), m_numberOfNodes(0), m_cursor(-1)
         {
-            m_xPathObj = xmlXPathEvalExpression(BAD_CAST(xpath.c_str()), xmlParser.m_xpathCtx);
+            m_xPathObj = xmlParser.evalXPath(xpath);
             if (NULL != m_xPathObj && NULL != m_xPathObj->nodesetval)
             {
                 m_numberOfNodes = m_xPathObj->nodesetval->nodeNr;
@@ -92,6 +93,14 @@ public:
     bool parseWithHandler(const std::string& xpath, TNodeHandler& handler) const;
     xmlXPathObjectPtr evalXPathOnNode(xmlNodePtr node, const std::string& xpath);
     
+    // Expressions are compiled once for the whole process and shared by all parsers
+    static void getXPathCacheStats(uint64_t& hits, uint64_t& misses, size_t& numberOfExpressions);
+    
+private:
+    static xmlXPathCompExprPtr getCompiledXPath(const std::string& xpath);
+    xmlXPathObjectPtr evalXPath(const std::string& xpath) const;
+    xmlXPathObjectPtr evalXPath(xmlNodePtr node, const std::string& xpath) const;
+    
 private:
     xmlDocPtr m_doc;
     xmlXPathContextPtr m_xpathCtx;
@@ -144,7 +153,7 @@ bool XmlParser::parseWithHandler(const std::string& xpath, TNodeHandler& handler
         return false;
     }
     
-    xmlXPathObjectPtr xpathObj = xmlXPathEvalExpression(BAD_CAST(xpath.c_str()), m_xpathCtx);
+    xmlXPathObjectPtr xpathObj = evalXPath(xpath);
     if (xpathObj != NULL)
     {
         xmlNodeSetPtr xpathNodes = xpathObj->nodesetval;
@@ -0,0 +1,404 @@
+//
+//  XmlPullExtractor.cpp
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/6.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#include "XmlPullExtractor.h"
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <cassert>
+
+// Paths and fields are tracked with bit masks
+#define XML_PULL_MAX_PATHS      64
+#define XML_PULL_MAX_FIELDS     64
+#define XML_PULL_MAX_DEPTH      32
+
+static inline bool isXmlSpace(char ch)
+{
+    return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n';
+}
+
+static const char* skipPast(const char* ptr, const char* end, const char* pattern, size_t patternLength)
+{
+    while (ptr + patternLength <= end)
+    {
+        const char* found = reinterpret_cast<const char *>(std::memchr(ptr, pattern[0], end - ptr));
+        if (NULL == found || found + patternLength > end)
+        {
+            break;
+        }
+        if (std::memcmp(found, pattern, patternLength) == 0)
+        {
+            return found + patternLength;
+        }
+        ptr = found + 1;
+    }
+    return end;
+}
+
+static void appendUtf8(std::string& value, unsigned long codepoint)
+{
+    if (codepoint < 0x80)
+    {
+        value.push_back(static_cast<char>(codepoint));
+    }
+    else if (codepoint < 0x800)
+    {
+        value.push_back(static_cast<char>(0xC0 | (codepoint >> 6)));
+        value.push_back(static_cast<char>(0x80 | (codepoint & 0x3F)));
+    }
+    else if (codepoint < 0x10000)
+    {
+        value.push_back(static_cast<char>(0xE0 | (codepoint >> 12)));
+        value.push_back(static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F)));
+        value.push_back(static_cast<char>(0x80 | (codepoint & 0x3F)));
+    }
+    else
+    {
+        value.push_back(static_cast<char>(0xF0 | (codepoint >> 18)));
+        value.push_back(static_cast<char>(0x80 | ((codepoint >> 12) & 0x3F)));
+        value.push_back(static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F)));
+        value.push_back(static_cast<char>(0x80 | (codepoint & 0x3F)));
+    }
+}
+
+XmlPullExtractor::XmlPullExtractor() : m_numberOfFields(0)
+{
+}
+
+XmlPullExtractor::XmlPullExtractor(const std::string& path, std::initializer_list<const char *> attributeNames) : m_numberOfFields(0)
+{
+    for (std::initializer_list<const char *>::const_iterator it = attributeNames.begin(); it != attributeNames.end(); ++it)
+    {
+        addAttribute(path, *it);
+    }
+}
+
+size_t XmlPullExtractor::addAttribute(const std::string& path, const std::string& attributeName)
+{
+    std::vector<std::string> elements;
+    std::string::size_type start = 0;
+    while (start < path.size())
+    {
+        std::string::size_type pos = path.find('/', start);
+        if (pos == std::string::npos)
+        {
+            pos = path.size();
+        }
+        if (pos > start)
+        {
+            elements.push_back(path.substr(start, pos - start));
+        }
+        start = pos + 1;
+    }
+    assert(!elements.empty() && elements.size() <= XML_PULL_MAX_DEPTH);
+    assert(m_numberOfFields < XML_PULL_MAX_FIELDS);
+
+    std::vector<Path>::iterator it = m_paths.begin();
+    for (; it != m_paths.end(); ++it)
+    {
+        if (it->elements == elements)
+        {
+            break;
+        }
+    }
+    if (it == m_paths.end())
+    {
+        assert(m_paths.size() < XML_PULL_MAX_PATHS);
+        it = m_paths.insert(m_paths.end(), Path());
+        it->elements.swap(elements);
+    }
+
+    it->attributes.push_back(std::make_pair(attributeName, m_numberOfFields));
+    return m_numberOfFields++;
+}
+
+size_t XmlPullExtractor::extract(const char* xml, size_t length, std::vector<std::string>& values) const
+{
+    values.resize(m_numberOfFields);
+    for (std::vector<std::string>::iterator it = values.begin(); it != values.end(); ++it)
+    {
+        it->clear();
+    }
+    if (NULL == xml || m_paths.empty())
+    {
+        return 0;
+    }
+
+    const size_t numberOfPaths = m_paths.size();
+    const uint64_t allPaths = (numberOfPaths >= 64) ? ~static_cast<uint64_t>(0) : ((static_cast<uint64_t>(1) << numberOfPaths) - 1);
+    // candidates[depth]: paths whose leading elements match the open elements
+    uint64_t candidates[XML_PULL_MAX_DEPTH + 1];
+    candidates[0] = allPaths;
+    uint64_t donePaths = 0;
+    uint64_t foundFields = 0;
+    size_t depth = 0;
+
+    const char* ptr = xml;
+    const char* end = xml + length;
+    while (donePaths != allPaths && ptr < end)
+    {
+        ptr = reinterpret_cast<const char *>(std::memchr(ptr, '<', end - ptr));
+        if (NULL == ptr || ++ptr >= end)
+        {
+            break;
+        }
+
+        if (*ptr == '?')
+        {
+            ptr = skipPast(ptr, end, "?>", 2);
+            continue;
+        }
+        if (*ptr == '!')
+        {
+            if (end - ptr >= 3 && std::memcmp(ptr, "!--", 3) == 0)
+            {
+                ptr = skipPast(ptr + 3, end, "-->", 3);
+            }
+            else if (end - ptr >= 8 && std::memcmp(ptr, "![CDATA[", 8) == 0)
+            {
+                ptr = skipPast(ptr + 8, end, "]]>", 3);
+            }
+            else
+            {
+                ptr = skipPast(ptr, end, ">", 1);
+            }
+            continue;
+        }
+        if (*ptr == '/')
+        {
+            if (depth > 0)
+            {
+                --depth;
+            }
+            ptr = skipPast(ptr, end, ">", 1);
+            continue;
+        }
+
+        const char* name = ptr;
+        while (ptr < end && !isXmlSpace(*ptr) && *ptr != '/' && *ptr != '>')
+        {
+            ++ptr;
+        }
+        size_t nameLength = ptr - name;
+
+        uint64_t childCandidates = 0;
+        uint64_t matchedPaths = 0;  // Paths which end at this element
+        if (depth < XML_PULL_MAX_DEPTH)
+        {
+            uint64_t parentCandidates = candidates[depth];
+            for (size_t idx = 0; parentCandidates != 0 && idx < numberOfPaths; ++idx)
+            {
+                uint64_t bit = static_cast<uint64_t>(1) << idx;
+                if ((parentCandidates & bit) == 0)
+                {
+                    continue;
+                }
+                parentCandidates &= ~bit;
+                const std::vector<std::string>& elements = m_paths[idx].elements;
+                if (elements.size() > depth && elements[depth].size() == nameLength && std::memcmp(elements[depth].c_str(), name, nameLength) == 0)
+                {
+                    if (elements.size() == depth + 1)
+                    {
+                        if ((donePaths & bit) == 0)
+                        {
+                            matchedPaths |= bit;
+                        }
+                    }
+                    else
+                    {
+                        childCandidates |= bit;
+                    }
+                }
+            }
+        }
+
+        bool selfClosing = false;
+        while (ptr < end)
+        {
+            while (ptr < end && isXmlSpace(*ptr))
+            {
+                ++ptr;
+            }
+            if (ptr >= end)
+            {
+                break;
+            }
+            if (*ptr == '>')
+            {
+                ++ptr;
+                break;
+            }
+            if (*ptr == '/')
+            {
+                selfClosing = true;
+                ++ptr;
+                continue;
+            }
+            selfClosing = false;
+
+            const char* attrName = ptr;
+            while (ptr < end && !isXmlSpace(*ptr) && *ptr != '=' && *ptr != '>' && *ptr != '/')
+            {
+                ++ptr;
+            }
+            size_t attrNameLength = ptr - attrName;
+            while (ptr < end && isXmlSpace(*ptr))
+            {
+                ++ptr;
+            }
+
+            const char* value = NULL;
+            size_t valueLength = 0;
+            if (ptr < end && *ptr == '=')
+            {
+                ++ptr;
+                while (ptr < end && isXmlSpace(*ptr))
+                {
+                    ++ptr;
+                }
+                if (ptr < end && (*ptr == '"' || *ptr == '\''))
+                {
+                    value = ptr + 1;
+                    const char* quote = reinterpret_cast<const char *>(std::memchr(value, *ptr, end - value));
+                    if (NULL == quote)
+                    {
+                        quote = end;
+                    }
+                    valueLength = quote - value;
+                    ptr = (quote < end) ? quote + 1 : end;
+                }
+                else
+                {
+                    value = ptr;
+                    while (ptr < end && !isXmlSpace(*ptr) && *ptr != '>')
+                    {
+                        ++ptr;
+                    }
+                    valueLength = ptr - value;
+                }
+            }
+
+            if (0 == matchedPaths || NULL == value || 0 == attrNameLength)
+            {
+                continue;
+            }
+            for (size_t idx = 0; idx < numberOfPaths; ++idx)
+            {
+                if ((matchedPaths & (static_cast<uint64_t>(1) << idx)) == 0)
+                {
+                    continue;
+                }
+                const std::vector<std::pair<std::string, size_t>>& attributes = m_paths[idx].attributes;
+                for (std::vector<std::pair<std::string, size_t>>::const_iterator it = attributes.cbegin(); it != attributes.cend(); ++it)
+                {
+                    uint64_t fieldBit = static_cast<uint64_t>(1) << it->second;
+                    if ((foundFields & fieldBit) == 0 && it->first.size() == attrNameLength && std::memcmp(it->first.c_str(), attrName, attrNameLength) == 0)
+                    {
+                        appendAttributeValue(values[it->second], value, valueLength);
+                        foundFields |= fieldBit;
+                    }
+                }
+            }
+        }
+
+        donePaths |= matchedPaths;
+        if (!selfClosing)
+        {
+            if (depth < XML_PULL_MAX_DEPTH)
+            {
+                candidates[depth + 1] = childCandidates;
+            }
+            ++depth;
+        }
+    }
+
+    size_t numberOfFound = 0;
+    for (; foundFields != 0; foundFields &= foundFields - 1)
+    {
+        ++numberOfFound;
+    }
+    return numberOfFound;
+}
+
+// Decodes references and normalizes white spaces like libxml2 does for attribute values
+void XmlPullExtractor::appendAttributeValue(std::string& value, const char* str, size_t length)
+{
+    const char* end = str + length;
+    value.reserve(value.size() + length);
+    while (str < end)
+    {
+        const char* ptr = str;
+        while (ptr < end && *ptr != '&' && *ptr != '\r' && *ptr != '\n' && *ptr != '\t')
+        {
+            ++ptr;
+        }
+        value.append(str, ptr - str);
+        if (ptr >= end)
+        {
+            break;
+        }
+
+        if (*ptr != '&')
+        {
+            value.push_back(' ');
+            str = (*ptr == '\r' && ptr + 1 < end && *(ptr + 1) == '\n') ? ptr + 2 : ptr + 1;
+            continue;
+        }
+
+        const char* semicolon = reinterpret_cast<const char *>(std::memchr(ptr, ';', (end - ptr) < 12 ? (end - ptr) : 12));
+        if (NULL == semicolon)
+        {
+            value.push_back('&');
+            str = ptr + 1;
+            continue;
+        }
+
+        const char* entity = ptr + 1;
+        size_t entityLength = semicolon - entity;
+        if (entityLength == 3 && std::memcmp(entity, "amp", 3) == 0)
+        {
+            value.push_back('&');
+        }
+        else if (entityLength == 2 && std::memcmp(entity, "lt", 2) == 0)
+        {
+            value.push_back('<');
+        }
+        else if (entityLength == 2 && std::memcmp(entity, "gt", 2) == 0)
+        {
+            value.push_back('>');
+        }
+        else if (entityLength == 4 && std::memcmp(entity, "quot", 4) == 0)
+        {
+            value.push_back('"');
+        }
+        else if (entityLength == 4 && std::memcmp(entity, "apos", 4) == 0)
+        {
+            value.push_back('\'');
+        }
+        else if (entityLength > 1 && *entity == '#')
+        {
+            bool hex = (*(entity + 1) == 'x' || *(entity + 1) == 'X');
+            std::string digits(entity + (hex ? 2 : 1), semicolon);
+            char* digitsEnd = NULL;
+            unsigned long codepoint = std::strtoul(digits.c_str(), &digitsEnd, hex ? 16 : 10);
+            if (!digits.empty() && NULL != digitsEnd && *digitsEnd == '\0' && codepoint > 0 && codepoint <= 0x10FFFF && (codepoint < 0xD800 || codepoint > 0xDFFF))
+            {
+                appendUtf8(value, codepoint);
+            }
+            else
+            {
+                value.append(ptr, semicolon + 1 - ptr);
+            }
+        }
+        else
+        {
+            value.append(ptr, semicolon + 1 - ptr);
+        }
+        str = semicolon + 1;
+    }
+}
@@ -0,0 +1,50 @@
+//
+//  XmlPullExtractor.h
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/6.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#ifndef XmlPullExtractor_h
+#define XmlPullExtractor_h
+
+#include <string>
+#include <vector>
+#include <initializer_list>
+
+// Reads attributes of elements at absolute paths (e.g.: /msg/emoji@cdnurl) in one forward pass without building a DOM
+// Like XPath in XmlParser, only the first element that matches a path is used
+// The fields are set up once (usually as a static const) and extract can be called from multiple threads
+class XmlPullExtractor
+{
+public:
+    XmlPullExtractor();
+    XmlPullExtractor(const std::string& path, std::initializer_list<const char *> attributeNames);
+
+    // Returns the index of the field in values of extract
+    size_t addAttribute(const std::string& path, const std::string& attributeName);
+    size_t getNumberOfFields() const { return m_numberOfFields; }
+
+    // values is resized to the number of fields, fields which are not found are empty
+    // Returns the number of fields found
+    size_t extract(const char* xml, size_t length, std::vector<std::string>& values) const;
+    size_t extract(const std::string& xml, std::vector<std::string>& values) const
+    {
+        return extract(xml.c_str(), xml.size(), values);
+    }
+
+private:
+    struct Path
+    {
+        std::vector<std::string> elements;
+        std::vector<std::pair<std::string, size_t>> attributes;  // name and index of the field
+    };
+
+    static void appendAttributeValue(std::string& value, const char* str, size_t length);
+
+    std::vector<Path> m_paths;
+    size_t m_numberOfFields;
+};
+
+#endif /* XmlPullExtractor_h */
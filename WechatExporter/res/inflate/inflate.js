@@ -0,0 +1,247 @@
+// Inflater of the compressed pages of scripts for the browsers without DecompressionStream.
+// window.wechatInflate(Uint8Array) inflates a zlib stream (RFC 1950/1951) into a Uint8Array, null if it is broken.
+// The adler32 of the stream isn't checked
+(function() {
+	var LENGTH_BASE = [3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258];
+	var LENGTH_EXTRA = [0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0];
+	var DIST_BASE = [1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577];
+	var DIST_EXTRA = [0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13];
+	var CODE_LENGTH_ORDER = [16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15];
+
+	// Canonical Huffman code: the number of codes of each length and the symbols in the order of the codes
+	function buildTree(lengths, offset, count)
+	{
+		var tree = { counts: new Uint16Array(16), symbols: new Uint16Array(count) };
+		var offsets = new Uint16Array(16);
+		for (var idx = 0; idx < count; idx++)
+		{
+			tree.counts[lengths[offset + idx]]++;
+		}
+		tree.counts[0] = 0;
+		for (var len = 1; len < 16; len++)
+		{
+			offsets[len] = offsets[len - 1] + tree.counts[len - 1];
+		}
+		for (var idx = 0; idx < count; idx++)
+		{
+			if (lengths[offset + idx] != 0)
+			{
+				tree.symbols[offsets[lengths[offset + idx]]++] = idx;
+			}
+		}
+		return tree;
+	}
+
+	var fixedLengths = new Uint8Array(288 + 30);
+	for (var idx = 0; idx < 288; idx++)
+	{
+		fixedLengths[idx] = idx < 144 ? 8 : (idx < 256 ? 9 : (idx < 280 ? 7 : 8));
+	}
+	for (var idx = 288; idx < 288 + 30; idx++)
+	{
+		fixedLengths[idx] = 5;
+	}
+	var FIXED_LITERALS = buildTree(fixedLengths, 0, 288);
+	var FIXED_DISTANCES = buildTree(fixedLengths, 288, 30);
+
+	function Reader(data)
+	{
+		this.data = data;
+		this.pos = 2;	// After the zlib header
+		this.bitBuffer = 0;
+		this.bitCount = 0;
+	}
+
+	Reader.prototype.bits = function(count) {
+		while (this.bitCount < count)
+		{
+			if (this.pos >= this.data.length)
+			{
+				throw new Error("truncated");
+			}
+			this.bitBuffer |= this.data[this.pos++] << this.bitCount;
+			this.bitCount += 8;
+		}
+		var value = this.bitBuffer & ((1 << count) - 1);
+		this.bitBuffer >>>= count;
+		this.bitCount -= count;
+		return value;
+	};
+
+	Reader.prototype.decode = function(tree) {
+		var code = 0;
+		var first = 0;
+		var index = 0;
+		for (var len = 1; len < 16; len++)
+		{
+			code |= this.bits(1);
+			var count = tree.counts[len];
+			if (code - first < count)
+			{
+				return tree.symbols[index + code - first];
+			}
+			index += count;
+			first = (first + count) << 1;
+			code <<= 1;
+		}
+		throw new Error("bad code");
+	};
+
+	function readTrees(reader)
+	{
+		var numberOfLiterals = reader.bits(5) + 257;
+		var numberOfDistances = reader.bits(5) + 1;
+		var numberOfCodeLengths = reader.bits(4) + 4;
+		var codeLengths = new Uint8Array(19);
+		for (var idx = 0; idx < numberOfCodeLengths; idx++)
+		{
+			codeLengths[CODE_LENGTH_ORDER[idx]] = reader.bits(3);
+		}
+		var codeLengthTree = buildTree(codeLengths, 0, 19);
+
+		var total = numberOfLiterals + numberOfDistances;
+		var lengths = new Uint8Array(total);
+		for (var num = 0; num < total; )
+		{
+			var symbol = reader.decode(codeLengthTree);
+			if (symbol < 16)
+			{
+				lengths[num++] = symbol;
+				continue;
+			}
+			var previous = 0;
+			var repeat = 0;
+			if (symbol == 16)
+			{
+				if (num == 0)
+				{
+					throw new Error("bad lengths");
+				}
+				previous = lengths[num - 1];
+				repeat = 3 + reader.bits(2);
+			}
+			else if (symbol == 17)
+			{
+				repeat = 3 + reader.bits(3);
+			}
+			else
+			{
+				repeat = 11 + reader.bits(7);
+			}
+			if (num + repeat > total)
+			{
+				throw new Error("bad lengths");
+			}
+			while (repeat-- > 0)
+			{
+				lengths[num++] = previous;
+			}
+		}
+		return [buildTree(lengths, 0, numberOfLiterals), buildTree(lengths, numberOfLiterals, numberOfDistances)];
+	}
+
+	function inflate(data)
+	{
+		if (data.length < 2 || (data[0] & 0x0F) != 8 || (((data[0] << 8) | data[1]) % 31) != 0)
+		{
+			return null;
+		}
+		var reader = new Reader(data);
+		var output = new Uint8Array(Math.max(1024, data.length * 4));
+		var size = 0;
+		function reserve(length)
+		{
+			if (size + length > output.length)
+			{
+				var bigger = new Uint8Array(Math.max(output.length * 2, size + length));
+				bigger.set(output.subarray(0, size));
+				output = bigger;
+			}
+		}
+
+		var last = 0;
+		do
+		{
+			last = reader.bits(1);
+			var type = reader.bits(2);
+			if (type == 0)
+			{
+				// Stored, from the next byte
+				reader.bitBuffer = 0;
+				reader.bitCount = 0;
+				if (reader.pos + 4 > data.length)
+				{
+					return null;
+				}
+				var length = data[reader.pos] | (data[reader.pos + 1] << 8);
+				reader.pos += 4;
+				if (reader.pos + length > data.length)
+				{
+					return null;
+				}
+				reserve(length);
+				output.set(data.subarray(reader.pos, reader.pos + length), size);
+				size += length;
+				reader.pos += length;
+				continue;
+			}
+			if (type == 3)
+			{
+				return null;
+			}
+
+			var trees = (type == 1) ? [FIXED_LITERALS, FIXED_DISTANCES] : readTrees(reader);
+			while (true)
+			{
+				var symbol = reader.decode(trees[0]);
+				if (symbol < 256)
+				{
+					reserve(1);
+					output[size++] = symbol;
+					continue;
+				}
+				if (symbol == 256)
+				{
+					break;
+				}
+				symbol -= 257;
+				if (symbol >= 29)
+				{
+					return null;
+				}
+				var length = LENGTH_BASE[symbol] + reader.bits(LENGTH_EXTRA[symbol]);
+				var distanceSymbol = reader.decode(trees[1]);
+				if (distanceSymbol >= 30)
+				{
+					return null;
+				}
+				var distance = DIST_BASE[distanceSymbol] + reader.bits(DIST_EXTRA[distanceSymbol]);
+				if (distance > size)
+				{
+					return null;
+				}
+				reserve(length);
+				for (var idx = 0; idx < length; idx++, size++)
+				{
+					output[size] = output[size - distance];
+				}
+			}
+		} while (!last);
+		return output.subarray(0, size);
+	}
+
+	window.wechatInflate = function(data) {
+		try
+		{
+			return inflate(data);
+		}
+		catch (e)
+		{
+			return null;
+		}
+	};
+	if (typeof wechatInflaterLoaded === 'function')
+	{
+		wechatInflaterLoaded();
+	}
+})();
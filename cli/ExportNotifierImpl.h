@@ -0,0 +1,208 @@
+//
+//  ExportNotifierImpl.h
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#ifndef ExportNotifierImpl_h
+#define ExportNotifierImpl_h
+
+#include <cstdio>
+#include <mutex>
+#include <vector>
+#include "../WechatExporter/core/ExportNotifier.h"
+#include "../WechatExporter/core/ExportBatch.h"
+
+// Prints the sessions as they are done and keeps the samples of the metrics for the report
+class ExportNotifierImpl : public ExportNotifier
+{
+protected:
+    bool m_quiet;
+    mutable std::mutex m_mutex;
+    mutable bool m_completed;
+    mutable bool m_cancelled;
+    mutable uint32_t m_numberOfSessions;
+    mutable std::vector<ExportMetrics> m_samples;
+    mutable std::vector<std::pair<std::string, uint64_t>> m_sessionMemory;  // Sessions with the peaks of the accounted memory
+
+public:
+    ExportNotifierImpl(bool quiet) : m_quiet(quiet), m_completed(false), m_cancelled(false), m_numberOfSessions(0)
+    {
+    }
+    
+    bool isCompleted() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_completed;
+    }
+    
+    bool isCancelled() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_cancelled;
+    }
+    
+    uint32_t getNumberOfSessions() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_numberOfSessions;
+    }
+    
+    std::vector<ExportMetrics> getSamples() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_samples;
+    }
+    
+    std::vector<std::pair<std::string, uint64_t>> getSessionMemory() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_sessionMemory;
+    }
+    
+    void onStart() const
+    {
+    }
+    
+    void onProgress(uint32_t numberOfMessages, uint32_t numberOfTotalMessages) const
+    {
+    }
+    
+    void onComplete(bool cancelled) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_completed = true;
+        m_cancelled = cancelled;
+    }
+    
+    void onUserSessionStart(const std::string& usrName, uint32_t numberOfSessions) const
+    {
+        if (!m_quiet)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            fprintf(stdout, "%s: %u sessions\n", usrName.c_str(), numberOfSessions);
+            fflush(stdout);
+        }
+    }
+    
+    void onUserSessionComplete(const std::string& usrName) const
+    {
+    }
+    
+    void onSessionStart(const std::string& sessionUsrName, void * sessionData, uint32_t numberOfTotalMessages) const
+    {
+    }
+    
+    void onSessionProgress(const std::string& sessionUsrName, void * sessionData, uint32_t numberOfMessages, uint32_t numberOfTotalMessages) const
+    {
+    }
+    
+    void onSessionComplete(const std::string& sessionUsrName, void * sessionData, bool cancelled) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++m_numberOfSessions;
+        if (!m_quiet)
+        {
+            fprintf(stdout, "  %s%s\n", sessionUsrName.c_str(), cancelled ? " (cancelled)" : "");
+            fflush(stdout);
+        }
+    }
+    
+    void onTasksStart(const std::string& usrName, uint32_t numberOfTotalTasks) const
+    {
+    }
+    
+    void onTasksProgress(const std::string& usrName, uint32_t numberOfCompletedTasks, uint32_t numberOfTotalMessages) const
+    {
+    }
+    
+    void onTasksComplete(const std::string& usrName, bool cancelled) const
+    {
+    }
+    
+    void onMetrics(const ExportMetrics& metrics) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_samples.push_back(metrics);
+    }
+    
+    void onSessionMemory(const std::string& sessionUsrName, void * sessionData, uint64_t peakBytes) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_sessionMemory.push_back(std::make_pair(sessionUsrName, peakBytes));
+    }
+};
+
+// Prints the jobs of the batch as they start and complete, and the progress of each one by tenths
+class BatchNotifierImpl : public ExportBatchNotifier
+{
+protected:
+    struct Job
+    {
+        std::string backup;
+        std::string output;
+        uint32_t progress;  // Tenths printed
+    };
+    
+    bool m_quiet;
+    mutable std::mutex m_mutex;
+    mutable std::vector<Job> m_jobs;
+
+public:
+    BatchNotifierImpl(bool quiet) : m_quiet(quiet)
+    {
+    }
+    
+    void addJob(size_t jobIndex, const std::string& backup, const std::string& output)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_jobs.size() <= jobIndex)
+        {
+            m_jobs.resize(jobIndex + 1);
+        }
+        Job& job = m_jobs[jobIndex];
+        job.backup = backup;
+        job.output = output;
+        job.progress = 0;
+    }
+    
+    void onJobStart(size_t jobIndex) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_quiet && jobIndex < m_jobs.size())
+        {
+            fprintf(stdout, "[%u] %s => %s\n", static_cast<unsigned int>(jobIndex + 1), m_jobs[jobIndex].backup.c_str(), m_jobs[jobIndex].output.c_str());
+            fflush(stdout);
+        }
+    }
+    
+    void onJobProgress(size_t jobIndex, uint32_t numberOfMessages, uint32_t numberOfTotalMessages) const
+    {
+        if (m_quiet || numberOfTotalMessages == 0)
+        {
+            return;
+        }
+        uint32_t progress = static_cast<uint32_t>(static_cast<uint64_t>(numberOfMessages) * 10 / numberOfTotalMessages);
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (jobIndex < m_jobs.size() && progress > m_jobs[jobIndex].progress && progress < 10)
+        {
+            m_jobs[jobIndex].progress = progress;
+            fprintf(stdout, "[%u] %u%%\n", static_cast<unsigned int>(jobIndex + 1), progress * 10);
+            fflush(stdout);
+        }
+    }
+    
+    void onJobComplete(size_t jobIndex, bool succeeded, bool cancelled) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_quiet)
+        {
+            fprintf(stdout, "[%u] %s\n", static_cast<unsigned int>(jobIndex + 1), cancelled ? "cancelled" : (succeeded ? "done" : "failed"));
+            fflush(stdout);
+        }
+    }
+};
+
+#endif /* ExportNotifierImpl_h */
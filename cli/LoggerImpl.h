@@ -0,0 +1,63 @@
+//
+//  LoggerImpl.h
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#include "../WechatExporter/core/Logger.h"
+#include "../WechatExporter/core/Utils.h"
+#include <cstdio>
+#include <mutex>
+
+#ifndef LoggerImpl_h
+#define LoggerImpl_h
+
+// Logs go to stderr, the output of the command is left to the notifier
+class LoggerImpl : public Logger
+{
+protected:
+    bool m_verbose;
+    std::mutex m_mutex;
+
+public:
+    LoggerImpl(bool verbose) : m_verbose(verbose)
+    {
+    }
+    
+    void write(const std::string& log)
+    {
+        std::string line = getTimestampString(true, false) + ": " + log + "\n";
+        std::lock_guard<std::mutex> lock(m_mutex);
+        fputs(line.c_str(), stderr);
+    }
+    
+    // The batch of the logger thread goes out in one call
+    void writeLines(const std::vector<std::string>& logs)
+    {
+        std::string timestamp = getTimestampString(true, false) + ": ";
+        std::string lines;
+        for (std::vector<std::string>::const_iterator it = logs.cbegin(); it != logs.cend(); ++it)
+        {
+            lines += timestamp + *it + "\n";
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        fputs(lines.c_str(), stderr);
+    }
+    
+    void debug(const std::string& log)
+    {
+        if (m_verbose)
+        {
+            write(log);
+        }
+    }
+    
+    bool isDebugging() const
+    {
+        return m_verbose;
+    }
+};
+
+#endif /* LoggerImpl_h */
@@ -0,0 +1,748 @@
+//
+//  main.cpp
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+//  Command line exporting for the machines without a GUI, it links the core only:
+//  wxexp --backup <dir> --output <dir> [options]
+//  wxexp --batch <file> [options]
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <csignal>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <json/json.h>
+#include "../WechatExporter/core/Exporter.h"
+#include "../WechatExporter/core/MessageParser.h"
+#include "../WechatExporter/core/ChromePdfConverter.h"
+#include "../WechatExporter/core/FileSystem.h"
+#include "../WechatExporter/core/ExportBatch.h"
+#include "../WechatExporter/core/Tracing.h"
+#include "LoggerImpl.h"
+#include "ExportNotifierImpl.h"
+
+#define EXIT_CODE_SUCCEEDED     0
+#define EXIT_CODE_WRONG_ARGS    1
+#define EXIT_CODE_FAILED        2
+#define EXIT_CODE_CANCELLED     3
+
+struct CommandLine
+{
+    std::string backup;
+    std::string output;
+    std::string workDir;        // Where the res directory is
+    std::string languageCode;
+    bool hasOptions;
+    int options;                // SPO_*
+    bool textMode;
+    bool pdfMode;
+    bool archiveMode;           // messages.db of each account instead of the pages
+    bool compressingPages;
+    std::string browserPath;
+    unsigned int numberOfBrowsers;
+    bool descOrder;
+    bool incremental;
+    std::set<std::string> accounts;    // usrName or display name
+    std::set<std::string> sessions;
+    unsigned int sessionThreads;
+    unsigned int pipelineThreads;
+    unsigned int pipelineMinMessages;
+    std::string downloadCacheDir;
+    uint64_t downloadCacheSize;
+    std::string metricsFile;
+    unsigned int metricsInterval;
+    std::string traceFile;
+    uint64_t memoryLimit;       // Bytes, 0 for none
+    bool listing;
+    bool quiet;
+    bool verbose;
+    std::string batchFile;      // Jobs of the batch mode, the options above apply to all of them
+    unsigned int batchJobs;
+    unsigned int batchThreads;
+
+    CommandLine() : workDir("."), hasOptions(false), options(0), textMode(false), pdfMode(false), archiveMode(false), compressingPages(false), numberOfBrowsers(2), descOrder(false), incremental(false), sessionThreads(1), pipelineThreads(1), pipelineMinMessages(20000), downloadCacheSize(0), metricsInterval(1000), memoryLimit(0), listing(false), quiet(false), verbose(false), batchJobs(2), batchThreads(0)
+    {
+    }
+};
+
+static Exporter* g_exporter = NULL;
+static std::atomic<bool> g_cancelling(false);   // The batch is cancelled by the main thread, it takes a lock
+
+static void onSignal(int signal)
+{
+    // Cancelling only sets an atomic, the exporter winds down and run returns
+    if (NULL != g_exporter)
+    {
+        g_exporter->cancel();
+    }
+    g_cancelling = true;
+}
+
+static void printUsage(const char* name)
+{
+    fprintf(stderr,
+            "Usage: %s --backup <dir> --output <dir> [options]\n"
+            "       %s --batch <file> [options]\n"
+            "  --backup <dir>              Directory of the iTunes backup (the one with Manifest.db)\n"
+            "  --output <dir>              Output directory, it has to exist\n"
+            "  --res <dir>                 Directory containing res/ with the templates (default: .)\n"
+            "  --lang <code>               Language code of the strings, like en or zh-Hans\n"
+            "  --options <mask>            SPO_* bit mask of MessageParser.h, decimal or 0x hex\n"
+            "  --text                      Text output instead of html\n"
+            "  --pdf --browser <path>      Print the sessions to pdf with headless Chrome\n"
+            "  --browsers <n>              Browsers printing at the same time (default: 2)\n"
+            "  --archive                   Write the messages of each account to its messages.db (SQLite) instead of the pages\n"
+            "  --compress-pages            Compress the pages of messages loaded by the html pages (Data/msg-N.js)\n"
+            "  --desc                      Newest messages first\n"
+            "  --incremental               Export only what is new since the previous exporting to the output\n"
+            "  --account <name>            usrName or display name of an account, repeatable\n"
+            "  --session <name>            usrName or display name of a session, repeatable\n"
+            "  --session-threads <n>       Sessions exported at the same time, 0 for the number of cores (default: 1)\n"
+            "  --pipeline-threads <n>      Workers parsing a large session, 0 for the number of cores (default: 1)\n"
+            "  --pipeline-min <n>          Messages of a session to use the workers (default: 20000)\n"
+            "  --download-cache <dir>      Cache of the downloads across the exportings\n"
+            "  --download-cache-size <mb>  Size of the cache (default: 1024)\n"
+            "  --metrics <file>            Write the metrics of the exporting to the file as JSON\n"
+            "  --metrics-interval <ms>     Sampling interval of the metrics (default: 1000)\n"
+            "  --trace <file>              Write the spans of the exporting to the file as Chrome trace JSON\n"
+            "  --memory-limit <mb>         Ceiling of the major buffers, over it tasks are spilled to disk and sessions flushed early\n"
+            "  --list                      List the accounts and sessions of the backup and exit\n"
+            "  --quiet                     No progress on stdout\n"
+            "  --verbose                   Debug logs on stderr\n"
+            "  --batch <file>              JSON of the jobs: {\"jobs\": [{\"backup\", \"output\", \"accounts\", \"sessions\"}]}\n"
+            "  --batch-jobs <n>            Jobs exported at the same time (default: 2)\n"
+            "  --batch-threads <n>         Sessions exported at the same time by all the jobs, 0 for the number of cores (default: 0)\n",
+            name, name);
+}
+
+static bool parseNumber(const char* value, unsigned long long& number)
+{
+    if (NULL == value || *value == '\0')
+    {
+        return false;
+    }
+    char* end = NULL;
+    number = std::strtoull(value, &end, 0);
+    return NULL != end && *end == '\0';
+}
+
+static bool parseCommandLine(int argc, char* argv[], CommandLine& cmdLine)
+{
+    for (int idx = 1; idx < argc; ++idx)
+    {
+        std::string arg = argv[idx];
+        const char* value = (idx + 1 < argc) ? argv[idx + 1] : NULL;
+        unsigned long long number = 0;
+        bool hasValue = true;
+
+        if (arg == "--help" || arg == "-h")
+        {
+            return false;
+        }
+        else if (arg == "--text")
+        {
+            cmdLine.textMode = true;
+            hasValue = false;
+        }
+        else if (arg == "--pdf")
+        {
+            cmdLine.pdfMode = true;
+            hasValue = false;
+        }
+        else if (arg == "--archive")
+        {
+            cmdLine.archiveMode = true;
+            hasValue = false;
+        }
+        else if (arg == "--compress-pages")
+        {
+            cmdLine.compressingPages = true;
+            hasValue = false;
+        }
+        else if (arg == "--desc")
+        {
+            cmdLine.descOrder = true;
+            hasValue = false;
+        }
+        else if (arg == "--incremental")
+        {
+            cmdLine.incremental = true;
+            hasValue = false;
+        }
+        else if (arg == "--list")
+        {
+            cmdLine.listing = true;
+            hasValue = false;
+        }
+        else if (arg == "--quiet")
+        {
+            cmdLine.quiet = true;
+            hasValue = false;
+        }
+        else if (arg == "--verbose")
+        {
+            cmdLine.verbose = true;
+            hasValue = false;
+        }
+        else if (NULL == value)
+        {
+            fprintf(stderr, "Missing value of %s\n", arg.c_str());
+            return false;
+        }
+        else if (arg == "--backup")
+        {
+            cmdLine.backup = value;
+        }
+        else if (arg == "--output")
+        {
+            cmdLine.output = value;
+        }
+        else if (arg == "--res")
+        {
+            cmdLine.workDir = value;
+        }
+        else if (arg == "--lang")
+        {
+            cmdLine.languageCode = value;
+        }
+        else if (arg == "--browser")
+        {
+            cmdLine.browserPath = value;
+        }
+        else if (arg == "--account")
+        {
+            cmdLine.accounts.insert(value);
+        }
+        else if (arg == "--session")
+        {
+            cmdLine.sessions.insert(value);
+        }
+        else if (arg == "--download-cache")
+        {
+            cmdLine.downloadCacheDir = value;
+        }
+        else if (arg == "--metrics")
+        {
+            cmdLine.metricsFile = value;
+        }
+        else if (arg == "--trace")
+        {
+            cmdLine.traceFile = value;
+        }
+        else if (arg == "--batch")
+        {
+            cmdLine.batchFile = value;
+        }
+        else if (arg != "--options" && arg != "--browsers" && arg != "--session-threads" && arg != "--pipeline-threads" && arg != "--pipeline-min" && arg != "--download-cache-size" && arg != "--metrics-interval" && arg != "--memory-limit" && arg != "--batch-jobs" && arg != "--batch-threads")
+        {
+            fprintf(stderr, "Unknown option: %s\n", arg.c_str());
+            return false;
+        }
+        else if (!parseNumber(value, number))
+        {
+            fprintf(stderr, "Invalid value of %s: %s\n", arg.c_str(), value);
+            return false;
+        }
+        else if (arg == "--options")
+        {
+            cmdLine.hasOptions = true;
+            cmdLine.options = static_cast<int>(number);
+        }
+        else if (arg == "--browsers")
+        {
+            cmdLine.numberOfBrowsers = static_cast<unsigned int>(number);
+        }
+        else if (arg == "--session-threads")
+        {
+            cmdLine.sessionThreads = static_cast<unsigned int>(number);
+        }
+        else if (arg == "--pipeline-threads")
+        {
+            cmdLine.pipelineThreads = static_cast<unsigned int>(number);
+        }
+        else if (arg == "--pipeline-min")
+        {
+            cmdLine.pipelineMinMessages = static_cast<unsigned int>(number);
+        }
+        else if (arg == "--download-cache-size")
+        {
+            cmdLine.downloadCacheSize = static_cast<uint64_t>(number) * 1024 * 1024;
+        }
+        else if (arg == "--memory-limit")
+        {
+            cmdLine.memoryLimit = static_cast<uint64_t>(number) * 1024 * 1024;
+        }
+        else if (arg == "--batch-jobs")
+        {
+            cmdLine.batchJobs = static_cast<unsigned int>(number);
+        }
+        else if (arg == "--batch-threads")
+        {
+            cmdLine.batchThreads = static_cast<unsigned int>(number);
+        }
+        else
+        {
+            cmdLine.metricsInterval = static_cast<unsigned int>(number);
+        }
+
+        if (hasValue)
+        {
+            ++idx;
+        }
+    }
+
+    if (!cmdLine.batchFile.empty())
+    {
+        // The outputs of the batch are different directories, the browsers and the metrics are of one exporting
+        if (!cmdLine.backup.empty() || cmdLine.listing || cmdLine.pdfMode || !cmdLine.metricsFile.empty())
+        {
+            fprintf(stderr, "--batch can't be used with --backup, --list, --pdf or --metrics\n");
+            return false;
+        }
+    }
+    else if (cmdLine.backup.empty() || (cmdLine.output.empty() && !cmdLine.listing))
+    {
+        return false;
+    }
+    if (cmdLine.archiveMode && (cmdLine.pdfMode || cmdLine.textMode))
+    {
+        fprintf(stderr, "--archive can't be used with --text or --pdf\n");
+        return false;
+    }
+    if (cmdLine.pdfMode && cmdLine.browserPath.empty())
+    {
+        fprintf(stderr, "--pdf needs --browser\n");
+        return false;
+    }
+    if (!cmdLine.downloadCacheDir.empty() && 0 == cmdLine.downloadCacheSize)
+    {
+        cmdLine.downloadCacheSize = 1024ull * 1024 * 1024;
+    }
+    return true;
+}
+
+static bool matchesName(const std::set<std::string>& names, const Friend& f)
+{
+    return names.find(f.getUsrName()) != names.cend() || names.find(f.getDisplayName()) != names.cend();
+}
+
+// Filter of the accounts and sessions on the command line, in the form of the selection of the GUI
+static void buildFilter(const CommandLine& cmdLine, const std::vector<std::pair<Friend, std::vector<Session>>>& usersAndSessions, std::map<std::string, std::map<std::string, void *>>& filter)
+{
+    for (std::vector<std::pair<Friend, std::vector<Session>>>::const_iterator it = usersAndSessions.cbegin(); it != usersAndSessions.cend(); ++it)
+    {
+        if (!cmdLine.accounts.empty() && !matchesName(cmdLine.accounts, it->first))
+        {
+            continue;
+        }
+        std::map<std::string, void *> sessions;
+        for (std::vector<Session>::const_iterator itSession = it->second.cbegin(); itSession != it->second.cend(); ++itSession)
+        {
+            if (cmdLine.sessions.empty() || matchesName(cmdLine.sessions, *itSession))
+            {
+                sessions[itSession->getUsrName()] = NULL;
+            }
+        }
+        if (!sessions.empty())
+        {
+            filter[it->first.getUsrName()].swap(sessions);
+        }
+    }
+}
+
+static void listUsersAndSessions(const std::vector<std::pair<Friend, std::vector<Session>>>& usersAndSessions)
+{
+    for (std::vector<std::pair<Friend, std::vector<Session>>>::const_iterator it = usersAndSessions.cbegin(); it != usersAndSessions.cend(); ++it)
+    {
+        fprintf(stdout, "%s\t%s\n", it->first.getUsrName().c_str(), it->first.getDisplayName().c_str());
+        for (std::vector<Session>::const_iterator itSession = it->second.cbegin(); itSession != it->second.cend(); ++itSession)
+        {
+            fprintf(stdout, "  %s\t%s\t%d\n", itSession->getUsrName().c_str(), itSession->getDisplayName().c_str(), itSession->getRecordCount());
+        }
+    }
+}
+
+static Json::Value metricsToJson(const ExportMetrics& metrics)
+{
+    Json::Value obj(Json::objectValue);
+    obj["elapsed"] = Json::Value(metrics.elapsedSeconds);
+    obj["messages"] = Json::Value(static_cast<Json::UInt64>(metrics.numberOfMessages));
+    obj["downloadedBytes"] = Json::Value(static_cast<Json::UInt64>(metrics.downloadedBytes));
+    obj["writtenBytes"] = Json::Value(static_cast<Json::UInt64>(metrics.writtenBytes));
+    obj["downloads"] = Json::Value(static_cast<Json::UInt64>(metrics.numberOfDownloads));
+    obj["failedDownloads"] = Json::Value(static_cast<Json::UInt64>(metrics.numberOfFailedDownloads));
+    obj["retries"] = Json::Value(static_cast<Json::UInt64>(metrics.numberOfRetries));
+    obj["queuedDownloads"] = Json::Value(metrics.queuedDownloads);
+    obj["runningDownloads"] = Json::Value(metrics.runningDownloads);
+    obj["queuedCopies"] = Json::Value(metrics.queuedCopies);
+    obj["deferredTasks"] = Json::Value(metrics.deferredTasks);
+    obj["queuedAudio"] = Json::Value(metrics.queuedAudio);
+    obj["queuedWrites"] = Json::Value(metrics.queuedWrites);
+    obj["pendingWriteBytes"] = Json::Value(static_cast<Json::UInt64>(metrics.pendingWriteBytes));
+    obj["accountedBytes"] = Json::Value(static_cast<Json::UInt64>(metrics.accountedBytes));
+    obj["peakAccountedBytes"] = Json::Value(static_cast<Json::UInt64>(metrics.peakAccountedBytes));
+    obj["messagesPerSecond"] = Json::Value(metrics.messagesPerSecond);
+    obj["downloadedBytesPerSecond"] = Json::Value(metrics.downloadedBytesPerSecond);
+    obj["writtenBytesPerSecond"] = Json::Value(metrics.writtenBytesPerSecond);
+    return obj;
+}
+
+// The totals of the last sample (it is forced at the end of the exporting) and all the samples
+static bool writeMetrics(const CommandLine& cmdLine, const ExportNotifierImpl& notifier, int exitCode)
+{
+    std::vector<ExportMetrics> samples = notifier.getSamples();
+
+    Json::Value samplesObj(Json::arrayValue);
+    for (std::vector<ExportMetrics>::const_iterator it = samples.cbegin(); it != samples.cend(); ++it)
+    {
+        samplesObj.append(metricsToJson(*it));
+    }
+
+    Json::Value reportObj(Json::objectValue);
+    reportObj["backup"] = Json::Value(cmdLine.backup);
+    reportObj["output"] = Json::Value(cmdLine.output);
+    reportObj["options"] = Json::Value(cmdLine.options);
+    reportObj["sessionThreads"] = Json::Value(cmdLine.sessionThreads);
+    reportObj["pipelineThreads"] = Json::Value(cmdLine.pipelineThreads);
+    reportObj["exitCode"] = Json::Value(exitCode);
+    reportObj["sessions"] = Json::Value(notifier.getNumberOfSessions());
+    if (!samples.empty())
+    {
+        const ExportMetrics& last = samples.back();
+        Json::Value totalObj = metricsToJson(last);
+        // The rates of a sample are since the previous one
+        if (last.elapsedSeconds > 0)
+        {
+            totalObj["averageMessagesPerSecond"] = Json::Value(last.numberOfMessages / last.elapsedSeconds);
+            totalObj["averageWrittenBytesPerSecond"] = Json::Value(last.writtenBytes / last.elapsedSeconds);
+        }
+        reportObj["total"] = totalObj;
+    }
+    Json::Value sessionMemoryObj(Json::objectValue);
+    std::vector<std::pair<std::string, uint64_t>> sessionMemory = notifier.getSessionMemory();
+    for (std::vector<std::pair<std::string, uint64_t>>::const_iterator it = sessionMemory.cbegin(); it != sessionMemory.cend(); ++it)
+    {
+        sessionMemoryObj[it->first] = Json::Value(static_cast<Json::UInt64>(it->second));
+    }
+    reportObj["memoryLimit"] = Json::Value(static_cast<Json::UInt64>(cmdLine.memoryLimit));
+    reportObj["sessionPeakBytes"] = sessionMemoryObj;
+    reportObj["samples"] = samplesObj;
+
+    Json::StyledWriter writer;
+    return writeFile(cmdLine.metricsFile, writer.write(reportObj));
+}
+
+// Options of the command line other than the backup, the output and the filter
+static void configureExporter(const CommandLine& cmdLine, Exporter& exporter, PdfConverter* pdfConverter)
+{
+    if (!cmdLine.languageCode.empty())
+    {
+        exporter.setLanguageCode(cmdLine.languageCode);
+    }
+    if (cmdLine.hasOptions)
+    {
+        exporter.setOptions(cmdLine.options);
+    }
+    if (cmdLine.descOrder)
+    {
+        exporter.setOrder(false);
+    }
+    if (cmdLine.incremental)
+    {
+        exporter.setIncrementalExporting(true);
+        exporter.setCachingManifest(true);
+    }
+    if (cmdLine.textMode || (exporter.getOptions() & SPO_TEXT_MODE) == SPO_TEXT_MODE)
+    {
+        exporter.setTextMode();
+        exporter.setExtName("txt");
+        exporter.setTemplatesName("templates_txt");
+    }
+    if (cmdLine.archiveMode)
+    {
+        exporter.setArchiveMode();
+    }
+    if (cmdLine.compressingPages)
+    {
+        exporter.setCompressingPages();
+    }
+    if (NULL != pdfConverter)
+    {
+        exporter.setPdfMode();
+        exporter.setSyncLoading(true);
+        exporter.setLoadingDataOnScroll(false);
+        exporter.supportsFilter(false);
+    }
+    exporter.setParallelSessions(cmdLine.sessionThreads);
+    exporter.setSessionPipeline(cmdLine.pipelineThreads, cmdLine.pipelineMinMessages);
+    if (!cmdLine.downloadCacheDir.empty())
+    {
+        exporter.setDownloadCache(cmdLine.downloadCacheDir, cmdLine.downloadCacheSize);
+    }
+    if (!cmdLine.metricsFile.empty())
+    {
+        exporter.setMetricsInterval(cmdLine.metricsInterval);
+    }
+    exporter.setMemoryCeiling(cmdLine.memoryLimit);
+}
+
+// The accounts and sessions of the backup are loaded only if there is a filter or they are to be listed
+static int loadFilter(const CommandLine& cmdLine, Logger* logger, std::map<std::string, std::map<std::string, void *>>& filter)
+{
+    if (!cmdLine.listing && cmdLine.accounts.empty() && cmdLine.sessions.empty())
+    {
+        return EXIT_CODE_SUCCEEDED;
+    }
+    std::vector<std::pair<Friend, std::vector<Session>>> usersAndSessions;
+    Exporter loader(cmdLine.workDir, cmdLine.backup, cmdLine.output, logger, NULL);
+    if (!cmdLine.languageCode.empty())
+    {
+        loader.setLanguageCode(cmdLine.languageCode);
+    }
+    if (!loader.loadUsersAndSessions())
+    {
+        return EXIT_CODE_FAILED;
+    }
+    loader.swapUsersAndSessions(usersAndSessions);
+    if (cmdLine.listing)
+    {
+        listUsersAndSessions(usersAndSessions);
+        return EXIT_CODE_SUCCEEDED;
+    }
+    buildFilter(cmdLine, usersAndSessions, filter);
+    if (filter.empty())
+    {
+        fprintf(stderr, "No account or session matches the filter of %s\n", cmdLine.backup.c_str());
+        return EXIT_CODE_WRONG_ARGS;
+    }
+    return EXIT_CODE_SUCCEEDED;
+}
+
+static void readNames(const Json::Value& value, std::set<std::string>& names)
+{
+    if (value.isArray())
+    {
+        for (Json::ArrayIndex idx = 0; idx < value.size(); ++idx)
+        {
+            names.insert(value[idx].asString());
+        }
+    }
+}
+
+// Each job is the command line with its own backup, output, accounts and sessions
+static bool loadBatch(const CommandLine& cmdLine, std::vector<CommandLine>& jobs)
+{
+    Json::Reader reader;
+    Json::Value rootValue;
+    if (!reader.parse(readFile(cmdLine.batchFile), rootValue) || !rootValue.isObject() || !rootValue["jobs"].isArray())
+    {
+        fprintf(stderr, "Invalid batch file: %s\n", cmdLine.batchFile.c_str());
+        return false;
+    }
+    const Json::Value& jobsValue = rootValue["jobs"];
+    for (Json::ArrayIndex idx = 0; idx < jobsValue.size(); ++idx)
+    {
+        const Json::Value& jobValue = jobsValue[idx];
+        CommandLine job = cmdLine;
+        job.backup = jobValue["backup"].asString();
+        job.output = jobValue["output"].asString();
+        readNames(jobValue["accounts"], job.accounts);
+        readNames(jobValue["sessions"], job.sessions);
+        if (job.backup.empty() || job.output.empty())
+        {
+            fprintf(stderr, "Job %u of the batch needs backup and output\n", static_cast<unsigned int>(idx + 1));
+            return false;
+        }
+        jobs.push_back(job);
+    }
+    return !jobs.empty();
+}
+
+static int runBatch(const CommandLine& cmdLine, Logger* logger)
+{
+    std::vector<CommandLine> jobs;
+    if (!loadBatch(cmdLine, jobs))
+    {
+        return EXIT_CODE_WRONG_ARGS;
+    }
+    
+    BatchNotifierImpl batchNotifier(cmdLine.quiet);
+    ExportBatch batch(cmdLine.workDir, logger);
+    ExportBatch::Budget budget;
+    budget.numberOfJobs = cmdLine.batchJobs;
+    budget.numberOfThreads = cmdLine.batchThreads;
+    batch.setBudget(budget);
+    batch.setNotifier(&batchNotifier);
+    
+    std::vector<ExportNotifierImpl *> notifiers;
+    for (std::vector<CommandLine>::const_iterator it = jobs.cbegin(); it != jobs.cend(); ++it)
+    {
+        ExportBatch::Job job;
+        job.backup = it->backup;
+        job.output = it->output;
+        int exitCode = loadFilter(*it, logger, job.filter);
+        if (exitCode != EXIT_CODE_SUCCEEDED)
+        {
+            for (std::vector<ExportNotifierImpl *>::iterator itNotifier = notifiers.begin(); itNotifier != notifiers.end(); ++itNotifier)
+            {
+                delete *itNotifier;
+            }
+            return exitCode;
+        }
+        notifiers.push_back(new ExportNotifierImpl(cmdLine.quiet));
+        job.notifier = notifiers.back();
+        const CommandLine& jobCmdLine = *it;
+        job.configure = [&jobCmdLine](Exporter& exporter) {
+            configureExporter(jobCmdLine, exporter, NULL);
+        };
+        size_t jobIndex = batch.addJob(job);
+        batchNotifier.addJob(jobIndex, it->backup, it->output);
+    }
+    
+    // The batch takes a lock to cancel the exportings, the signal only tells this thread
+    g_cancelling = false;
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+    
+    std::atomic<bool> running(true);
+    bool succeeded = false;
+    std::thread thread([&batch, &running, &succeeded]() {
+        succeeded = batch.run();
+        running = false;
+    });
+    bool cancelled = false;
+    while (running)
+    {
+        if (g_cancelling && !cancelled)
+        {
+            batch.cancel();
+            cancelled = true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }
+    thread.join();
+    
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    for (std::vector<ExportNotifierImpl *>::iterator it = notifiers.begin(); it != notifiers.end(); ++it)
+    {
+        delete *it;
+    }
+    
+    if (cancelled)
+    {
+        return EXIT_CODE_CANCELLED;
+    }
+    return succeeded ? EXIT_CODE_SUCCEEDED : EXIT_CODE_FAILED;
+}
+
+static void finishTracing(const CommandLine& cmdLine)
+{
+    if (cmdLine.traceFile.empty())
+    {
+        return;
+    }
+    stopTracing();
+    if (!writeTrace(cmdLine.traceFile))
+    {
+        fprintf(stderr, "Failed to write the trace: %s\n", cmdLine.traceFile.c_str());
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    CommandLine cmdLine;
+    if (!parseCommandLine(argc, argv, cmdLine))
+    {
+        printUsage(argv[0]);
+        return EXIT_CODE_WRONG_ARGS;
+    }
+
+    Exporter::initializeExporter();
+    if (!cmdLine.traceFile.empty())
+    {
+        startTracing();
+    }
+
+    LoggerImpl logger(cmdLine.verbose);
+    if (!cmdLine.batchFile.empty())
+    {
+        int exitCode = runBatch(cmdLine, &logger);
+        finishTracing(cmdLine);
+        Exporter::uninitializeExporter();
+        return exitCode;
+    }
+    
+    ExportNotifierImpl notifier(cmdLine.quiet);
+
+    std::map<std::string, std::map<std::string, void *>> filter;
+    int exitCode = loadFilter(cmdLine, &logger, filter);
+    if (exitCode != EXIT_CODE_SUCCEEDED || cmdLine.listing)
+    {
+        Exporter::uninitializeExporter();
+        return exitCode;
+    }
+
+    ChromePdfConverter* pdfConverter = NULL;
+    if (cmdLine.pdfMode)
+    {
+        pdfConverter = new ChromePdfConverter(cmdLine.browserPath, cmdLine.output, cmdLine.numberOfBrowsers);
+        if (!pdfConverter->isSupported())
+        {
+            fprintf(stderr, "Printing to pdf is not supported on this system\n");
+            delete pdfConverter;
+            Exporter::uninitializeExporter();
+            return EXIT_CODE_WRONG_ARGS;
+        }
+    }
+
+    Exporter* exporter = new Exporter(cmdLine.workDir, cmdLine.backup, cmdLine.output, &logger, pdfConverter);
+    configureExporter(cmdLine, *exporter, pdfConverter);
+    cmdLine.options = exporter->getOptions();
+    exporter->setNotifier(&notifier);
+    exporter->filterUsersAndSessions(filter);
+
+    g_exporter = exporter;
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    if (exporter->run())
+    {
+        exporter->waitForComplition();
+        if (notifier.isCancelled())
+        {
+            exitCode = EXIT_CODE_CANCELLED;
+        }
+    }
+    else
+    {
+        exitCode = EXIT_CODE_FAILED;
+    }
+
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    g_exporter = NULL;
+    delete exporter;
+    if (NULL != pdfConverter)
+    {
+        delete pdfConverter;
+    }
+
+    if (!cmdLine.metricsFile.empty() && !writeMetrics(cmdLine, notifier, exitCode))
+    {
+        fprintf(stderr, "Failed to write the metrics: %s\n", cmdLine.metricsFile.c_str());
+    }
+    finishTracing(cmdLine);
+
+    Exporter::uninitializeExporter();
+    return exitCode;
+}
@@ -0,0 +1,162 @@
+//
+//  main.cpp
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/16.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+//  The failures of a host must not pile up their back-offs: the retries of a refused connection
+//  are made right away, and the tasks waiting for a retry don't keep the slots of their host,
+//  so a host answering 503 costs about the back-offs of one task instead of those of every task.
+//  Exits with 0 if all the downloads complete in time.
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "../../WechatExporter/core/DownloadEngine.h"
+#include "../../WechatExporter/core/FileSystem.h"
+
+#define NUMBER_OF_TASKS         32
+// Refused connections aren't retried after back-offs, whose sum is more than this for one task
+#define MAX_ELAPSED_REFUSED     3000
+// The back-offs of one task add up to 3.5 seconds, the tasks holding the slots of the host would take ten times of it
+#define MAX_ELAPSED_UNAVAILABLE 10000
+
+class Counter : public DownloadEngine::Callback
+{
+public:
+    Counter() : m_completed(0), m_succeeded(0)
+    {
+    }
+
+    void onDownloadComplete(const DownloadTask * /*task*/, bool succeeded)
+    {
+        ++m_completed;
+        if (succeeded)
+        {
+            ++m_succeeded;
+        }
+    }
+
+    std::atomic<int> m_completed;
+    std::atomic<int> m_succeeded;
+};
+
+// Socket bound to a free port of the loopback, -1 if it fails
+static int bindLoopback(int& port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(addr);
+    if (bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0 || getsockname(fd, reinterpret_cast<struct sockaddr *>(&addr), &length) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    port = ntohs(addr.sin_port);
+    return fd;
+}
+
+// Answers 503 to every request until the socket is shut down
+static void serveUnavailable(int fd)
+{
+    static const char response[] = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    for (;;)
+    {
+        int client = accept(fd, NULL, NULL);
+        if (client < 0)
+        {
+            break;
+        }
+        char buffer[4096];
+        recv(client, buffer, sizeof(buffer), 0);
+        send(client, response, sizeof(response) - 1, 0);
+        close(client);
+    }
+}
+
+// Milliseconds for the downloads of all the tasks from the port, which all fail
+static long long download(int port, const std::string& outputDir, Counter& counter)
+{
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+    {
+        DownloadEngine engine(2, 16, &counter);
+        engine.setTag("dl");
+        for (int idx = 0; idx < NUMBER_OF_TASKS; ++idx)
+        {
+            std::string url = "http://127.0.0.1:" + std::to_string(port) + "/" + std::to_string(idx) + ".jpg";
+            engine.addTask(new DownloadTask(url, combinePath(outputDir, std::to_string(idx) + ".jpg"), "", 0, std::to_string(idx)));
+        }
+        // The destructor waits for the queued downloads
+        engine.shutdown();
+    }
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+static bool check(const char* name, const Counter& counter, long long elapsed, long long maxElapsed)
+{
+    printf("%s: %d/%d downloads completed in %lld ms\n", name, counter.m_completed.load(), NUMBER_OF_TASKS, elapsed);
+    if (counter.m_completed != NUMBER_OF_TASKS || counter.m_succeeded != 0)
+    {
+        fprintf(stderr, "%s: unexpected completions: %d, succeeded: %d\n", name, counter.m_completed.load(), counter.m_succeeded.load());
+        return false;
+    }
+    if (elapsed > maxElapsed)
+    {
+        fprintf(stderr, "%s: the downloads took %lld ms, more than %lld ms\n", name, elapsed, maxElapsed);
+        return false;
+    }
+    return true;
+}
+
+int main()
+{
+    int refusedPort = 0;
+    int refusedFd = bindLoopback(refusedPort);
+    int unavailablePort = 0;
+    int unavailableFd = bindLoopback(unavailablePort);
+    if (refusedFd < 0 || unavailableFd < 0 || listen(unavailableFd, 64) != 0)
+    {
+        fprintf(stderr, "No free port of the loopback\n");
+        return 1;
+    }
+    // Nothing listens on the port any more, the connections to it are refused
+    close(refusedFd);
+    std::thread server(serveUnavailable, unavailableFd);
+
+    const char* tmp = getenv("TMPDIR");
+    std::string outputDir = combinePath((NULL == tmp || *tmp == 0) ? "/tmp" : tmp, "wxexp_downloadengine_" + std::to_string(unavailablePort));
+    makeDirectory(outputDir);
+
+    DownloadTask::initialize();
+    Counter refused;
+    long long elapsedRefused = download(refusedPort, outputDir, refused);
+    Counter unavailable;
+    long long elapsedUnavailable = download(unavailablePort, outputDir, unavailable);
+    DownloadTask::uninitialize();
+
+    shutdown(unavailableFd, SHUT_RDWR);
+    close(unavailableFd);
+    server.join();
+    deleteDirectory(outputDir);
+
+    bool succeeded = check("refused", refused, elapsedRefused, MAX_ELAPSED_REFUSED);
+    succeeded = check("unavailable", unavailable, elapsedUnavailable, MAX_ELAPSED_UNAVAILABLE) && succeeded;
+    return succeeded ? 0 : 1;
+}
@@ -0,0 +1,110 @@
+//
+//  main.cpp
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/16.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+//  The checkpoints of a big session must not grow the raw messages file by a segment each for ever:
+//  once it has too many segments, it is compacted into one segment, with the saved messages kept in order.
+//  Exits with 0 if the file is compacted and has all the messages.
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <algorithm>
+#include "../../WechatExporter/core/SessionWriter.h"
+#include "../../WechatExporter/core/MessageStore.h"
+#include "../../WechatExporter/core/FileSystem.h"
+
+#define NUMBER_OF_CHECKPOINTS       40
+#define MESSAGES_PER_CHECKPOINT     25
+// MESSAGE_STORE_MAX_SEGMENTS of MessageStore.cpp
+#define MAX_SEGMENTS                16
+
+static std::string getMessage(size_t index)
+{
+    return "<div class=\"msg\" msgtime=\"" + std::to_string(1600000000 + index) + "\">" + std::to_string(index) + "</div>";
+}
+
+// Messages of the file are the ones added in their order, numberOfSegments is 0 if the file can't be read
+static bool verify(const std::string& fileName, size_t numberOfMessages, size_t& numberOfSegments)
+{
+    MessageStoreReader reader;
+    numberOfSegments = 0;
+    if (!reader.open(fileName))
+    {
+        return false;
+    }
+    numberOfSegments = reader.getNumberOfSegments();
+    size_t index = 0;
+    const char* message = NULL;
+    size_t length = 0;
+    for (size_t segment = 0; segment < numberOfSegments; ++segment)
+    {
+        for (size_t msgIdx = 0; msgIdx < reader.getNumberOfMessages(segment); ++msgIdx, ++index)
+        {
+            if (!reader.getMessage(segment, msgIdx, message, length) || std::string(message, length) != getMessage(index))
+            {
+                fprintf(stderr, "Message %u is not the one added\n", static_cast<unsigned int>(index));
+                return false;
+            }
+        }
+    }
+    if (index != numberOfMessages)
+    {
+        fprintf(stderr, "%u messages in the file, %u added\n", static_cast<unsigned int>(index), static_cast<unsigned int>(numberOfMessages));
+        return false;
+    }
+    return true;
+}
+
+int main()
+{
+    const char* tmp = getenv("TMPDIR");
+    std::string outputDir = combinePath((NULL == tmp || *tmp == 0) ? "/tmp" : tmp, "wxexp_sessionwriter_" + std::to_string(rand()));
+    makeDirectory(outputDir);
+    std::string fileName = combinePath(outputDir, "session.dat");
+
+    bool succeeded = true;
+    size_t maxSegments = 0;
+    size_t numberOfCompactions = 0;
+    size_t numberOfMessages = 0;
+    {
+        SessionWriter writer("%%JSON_DATA%%", 100, false, false);
+        succeeded = writer.openRawMessages(fileName, false);
+        size_t lastSegments = 0;
+        for (size_t cp = 0; succeeded && cp < NUMBER_OF_CHECKPOINTS; ++cp)
+        {
+            for (size_t idx = 0; idx < MESSAGES_PER_CHECKPOINT; ++idx, ++numberOfMessages)
+            {
+                writer.addMessage(getMessage(numberOfMessages));
+            }
+            size_t numberOfSegments = 0;
+            if (!writer.checkpoint() || !verify(fileName, numberOfMessages, numberOfSegments))
+            {
+                fprintf(stderr, "Checkpoint %u failed\n", static_cast<unsigned int>(cp));
+                succeeded = false;
+                break;
+            }
+            if (numberOfSegments < lastSegments)
+            {
+                ++numberOfCompactions;
+            }
+            lastSegments = numberOfSegments;
+            maxSegments = std::max(maxSegments, numberOfSegments);
+        }
+        size_t numberOfSegments = 0;
+        succeeded = succeeded && writer.closeRawMessages() && verify(fileName, numberOfMessages, numberOfSegments);
+    }
+    deleteDirectory(outputDir);
+
+    printf("%u messages, %u compactions, up to %u segments\n", static_cast<unsigned int>(numberOfMessages), static_cast<unsigned int>(numberOfCompactions), static_cast<unsigned int>(maxSegments));
+    if (succeeded && (numberOfCompactions == 0 || maxSegments > MAX_SEGMENTS))
+    {
+        fprintf(stderr, "The raw messages file wasn't compacted\n");
+        succeeded = false;
+    }
+    return succeeded ? 0 : 1;
+}
@@ -0,0 +1,901 @@
+//
+//  main.cpp
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+//  Writes a fake iTunes backup of WeChat for the performance work, the same shape as a real one so that
+//  ITunesDb, SessionsParser and MessageParser load it as they are. The contents come from a seeded random
+//  generator, the same arguments give the same backup:
+//  backupgen --output <dir> [options]
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <chrono>
+#include <sqlite3.h>
+#include <plist/plist.h>
+#include "../../WechatExporter/core/Utils.h"
+#include "../../WechatExporter/core/FileSystem.h"
+
+#define WECHAT_DOMAIN           "AppDomain-com.tencent.xin"
+#define WECHAT_SHARE_DOMAIN     "AppDomainGroup-group.com.tencent.xin"
+
+#define MANIFEST_FLAG_FILE      1
+#define MANIFEST_FLAG_DIRECTORY 2
+
+// Kinds of the generated messages, the weights of the mix are in this order
+#define MSG_KIND_TEXT           0
+#define MSG_KIND_IMAGE          1
+#define MSG_KIND_VOICE          2
+#define MSG_KIND_EMOJI          3
+#define MSG_KIND_APP            4
+#define NUMBER_OF_MSG_KINDS     5
+
+struct GeneratorOptions
+{
+    std::string output;
+    unsigned int numberOfAccounts;
+    unsigned int numberOfChats;         // Of each account
+    unsigned int numberOfMessages;      // Of each chat
+    unsigned int numberOfFriends;       // Of each account, 0 for twice the chats
+    unsigned int chatroomPercent;       // Chats which are chatrooms
+    unsigned int numberOfMembers;       // Of each chatroom
+    unsigned int numberOfDbs;           // MM.sqlite and message_N.sqlite of each account
+    unsigned int mix[NUMBER_OF_MSG_KINDS];
+    unsigned int textLength;            // Average characters of a text message
+    unsigned int imageSize;             // Bytes of an image, the thumbnail is an eighth of it
+    unsigned int voiceSize;
+    std::string mediaHost;              // Of the urls of the avatars, emojis and links
+    unsigned int seed;
+    std::string iOSVersion;
+    std::string wechatVersion;
+    unsigned int startTime;             // Of the first messages
+    bool quiet;
+
+    GeneratorOptions() : numberOfAccounts(1), numberOfChats(20), numberOfMessages(1000), numberOfFriends(0), chatroomPercent(30), numberOfMembers(20), numberOfDbs(1), textLength(40), imageSize(32 * 1024), voiceSize(8 * 1024), mediaHost("http://127.0.0.1:9"), seed(1), iOSVersion("14.4"), wechatVersion("8.0.2"), startTime(1577836800), quiet(false)
+    {
+        // text, image, voice, emoji, app
+        mix[MSG_KIND_TEXT] = 70;
+        mix[MSG_KIND_IMAGE] = 10;
+        mix[MSG_KIND_VOICE] = 5;
+        mix[MSG_KIND_EMOJI] = 10;
+        mix[MSG_KIND_APP] = 5;
+    }
+};
+
+struct GeneratorStats
+{
+    uint64_t numberOfMessages;
+    uint64_t numberOfFiles;
+    uint64_t numberOfBytes;
+
+    GeneratorStats() : numberOfMessages(0), numberOfFiles(0), numberOfBytes(0)
+    {
+    }
+};
+
+// Manifest.db of the backup and the files under <fileId[0..2]>/<fileId>, the fileIds are sha1 of domain-relativePath as iTunes does
+class BackupWriter
+{
+public:
+    BackupWriter(const std::string& rootPath, unsigned int modifiedTime, GeneratorStats& stats) : m_rootPath(rootPath), m_modifiedTime(modifiedTime), m_stats(stats), m_db(NULL), m_stmt(NULL)
+    {
+    }
+
+    ~BackupWriter()
+    {
+        close();
+    }
+
+    bool open()
+    {
+        std::string dbPath = combinePath(m_rootPath, "Manifest.db");
+        deleteFile(dbPath);
+        if (sqlite3_open(dbPath.c_str(), &m_db) != SQLITE_OK)
+        {
+            return false;
+        }
+        const char* sql = "CREATE TABLE Files (fileID TEXT PRIMARY KEY, domain TEXT, relativePath TEXT, flags INTEGER, file BLOB);"
+            "CREATE INDEX FilesDomainIdx ON Files(domain);"
+            "CREATE INDEX FilesRelativePathIdx ON Files(relativePath);"
+            "CREATE INDEX FilesFlagsIdx ON Files(flags);"
+            "CREATE TABLE Properties (key TEXT PRIMARY KEY, value BLOB);"
+            "BEGIN TRANSACTION;";
+        if (sqlite3_exec(m_db, sql, NULL, NULL, NULL) != SQLITE_OK)
+        {
+            return false;
+        }
+        std::string insertSql = "INSERT OR REPLACE INTO Files(fileID,domain,relativePath,flags,file) VALUES(?,?,?,?,?)";
+        return sqlite3_prepare_v2(m_db, insertSql.c_str(), (int)(insertSql.size()), &m_stmt, NULL) == SQLITE_OK;
+    }
+
+    bool close()
+    {
+        bool succeeded = true;
+        if (NULL != m_stmt)
+        {
+            sqlite3_finalize(m_stmt);
+            m_stmt = NULL;
+        }
+        if (NULL != m_db)
+        {
+            succeeded = sqlite3_exec(m_db, "COMMIT;", NULL, NULL, NULL) == SQLITE_OK;
+            sqlite3_close(m_db);
+            m_db = NULL;
+        }
+        return succeeded;
+    }
+
+    // Where the file of relativePath goes, it is added to the manifest with addFile once it's written
+    std::string getRealPath(const std::string& domain, const std::string& relativePath) const
+    {
+        std::string fileId = sha1(domain + "-" + relativePath);
+        return combinePath(m_rootPath, fileId.substr(0, 2), fileId);
+    }
+
+    bool addFile(const std::string& domain, const std::string& relativePath)
+    {
+        std::string realPath = getRealPath(domain, relativePath);
+        uint64_t size = 0;
+        std::time_t modifiedTime = 0;
+        if (!getFileInfo(realPath, size, modifiedTime))
+        {
+            return false;
+        }
+        ++m_stats.numberOfFiles;
+        m_stats.numberOfBytes += size;
+        return addEntry(domain, relativePath, MANIFEST_FLAG_FILE, size);
+    }
+
+    bool writeFile(const std::string& domain, const std::string& relativePath, const std::string& data)
+    {
+        std::string realPath = getRealPath(domain, relativePath);
+        if (!makeParentDirectory(realPath) || !::writeFile(realPath, data))
+        {
+            return false;
+        }
+        return addFile(domain, relativePath);
+    }
+
+    bool addDirectory(const std::string& domain, const std::string& relativePath)
+    {
+        return addEntry(domain, relativePath, MANIFEST_FLAG_DIRECTORY, 0);
+    }
+
+    bool makeParentDirectory(const std::string& realPath) const
+    {
+        std::string::size_type pos = realPath.find_last_of('/');
+        std::string dir = (pos == std::string::npos) ? m_rootPath : realPath.substr(0, pos);
+        return existsDirectory(dir) || makeDirectory(dir);
+    }
+
+private:
+    // MBFile archived by NSKeyedArchiver, ITunesDb reads LastModified and Size of it
+    std::string buildFileBlob(int flags, uint64_t size) const
+    {
+        plist_t fileNode = plist_new_dict();
+        plist_dict_set_item(fileNode, "LastModified", plist_new_uint(m_modifiedTime));
+        plist_dict_set_item(fileNode, "LastStatusChange", plist_new_uint(m_modifiedTime));
+        plist_dict_set_item(fileNode, "Birth", plist_new_uint(m_modifiedTime));
+        plist_dict_set_item(fileNode, "Size", plist_new_uint(size));
+        plist_dict_set_item(fileNode, "Mode", plist_new_uint(flags == MANIFEST_FLAG_DIRECTORY ? 040755 : 0100644));
+        plist_dict_set_item(fileNode, "UserID", plist_new_uint(501));
+        plist_dict_set_item(fileNode, "GroupID", plist_new_uint(501));
+        plist_dict_set_item(fileNode, "ProtectionClass", plist_new_uint(3));
+        plist_dict_set_item(fileNode, "$class", plist_new_uid(2));
+
+        plist_t classNode = plist_new_dict();
+        plist_t classesNode = plist_new_array();
+        plist_array_append_item(classesNode, plist_new_string("MBFile"));
+        plist_array_append_item(classesNode, plist_new_string("NSObject"));
+        plist_dict_set_item(classNode, "$classes", classesNode);
+        plist_dict_set_item(classNode, "$classname", plist_new_string("MBFile"));
+
+        plist_t objectsNode = plist_new_array();
+        plist_array_append_item(objectsNode, plist_new_string("$null"));
+        plist_array_append_item(objectsNode, fileNode);
+        plist_array_append_item(objectsNode, classNode);
+
+        plist_t topNode = plist_new_dict();
+        plist_dict_set_item(topNode, "root", plist_new_uid(1));
+
+        plist_t rootNode = plist_new_dict();
+        plist_dict_set_item(rootNode, "$version", plist_new_uint(100000));
+        plist_dict_set_item(rootNode, "$archiver", plist_new_string("NSKeyedArchiver"));
+        plist_dict_set_item(rootNode, "$top", topNode);
+        plist_dict_set_item(rootNode, "$objects", objectsNode);
+
+        char* data = NULL;
+        uint32_t length = 0;
+        plist_to_bin(rootNode, &data, &length);
+        std::string blob;
+        if (NULL != data)
+        {
+            blob.assign(data, length);
+            plist_mem_free(data);
+        }
+        plist_free(rootNode);
+        return blob;
+    }
+
+    bool addEntry(const std::string& domain, const std::string& relativePath, int flags, uint64_t size)
+    {
+        std::string fileId = sha1(domain + "-" + relativePath);
+        std::string blob = buildFileBlob(flags, size);
+        sqlite3_bind_text(m_stmt, 1, fileId.c_str(), (int)(fileId.size()), SQLITE_TRANSIENT);
+        sqlite3_bind_text(m_stmt, 2, domain.c_str(), (int)(domain.size()), SQLITE_TRANSIENT);
+        sqlite3_bind_text(m_stmt, 3, relativePath.c_str(), (int)(relativePath.size()), SQLITE_TRANSIENT);
+        sqlite3_bind_int(m_stmt, 4, flags);
+        sqlite3_bind_blob(m_stmt, 5, blob.c_str(), (int)(blob.size()), SQLITE_TRANSIENT);
+        bool succeeded = sqlite3_step(m_stmt) == SQLITE_DONE;
+        sqlite3_reset(m_stmt);
+        return succeeded;
+    }
+
+    BackupWriter(const BackupWriter&);
+    BackupWriter& operator=(const BackupWriter&);
+
+    std::string m_rootPath;
+    unsigned int m_modifiedTime;
+    GeneratorStats& m_stats;
+    sqlite3* m_db;
+    sqlite3_stmt* m_stmt;
+};
+
+// Wire format of protobuf, only the fields the parsers read
+static void appendVarint(std::string& output, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        output.push_back(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    output.push_back(static_cast<char>(value));
+}
+
+static void appendField(std::string& output, uint32_t fieldNumber, const std::string& value)
+{
+    appendVarint(output, (static_cast<uint64_t>(fieldNumber) << 3) | 2);
+    appendVarint(output, value.size());
+    output += value;
+}
+
+static std::string escapeXml(const std::string& value)
+{
+    std::string output;
+    output.reserve(value.size());
+    for (std::string::const_iterator it = value.cbegin(); it != value.cend(); ++it)
+    {
+        switch (*it)
+        {
+            case '<': output += "&lt;"; break;
+            case '>': output += "&gt;"; break;
+            case '&': output += "&amp;"; break;
+            case '"': output += "&quot;"; break;
+            default: output.push_back(*it); break;
+        }
+    }
+    return output;
+}
+
+struct Contact
+{
+    std::string usrName;
+    std::string displayName;
+};
+
+struct Chat
+{
+    Contact contact;
+    std::vector<size_t> members;    // Indexes of the friends in a chatroom
+};
+
+class Generator
+{
+public:
+    Generator(const GeneratorOptions& options) : m_options(options), m_random(options.seed), m_writer(options.output, options.startTime, m_stats)
+    {
+        unsigned int total = 0;
+        for (int idx = 0; idx < NUMBER_OF_MSG_KINDS; ++idx)
+        {
+            total += m_options.mix[idx];
+        }
+        if (0 == total)
+        {
+            m_options.mix[MSG_KIND_TEXT] = 1;
+        }
+        m_kinds = std::discrete_distribution<int>(m_options.mix, m_options.mix + NUMBER_OF_MSG_KINDS);
+    }
+
+    bool run()
+    {
+        if (!makeDirectory(m_options.output) || !m_writer.open())
+        {
+            fprintf(stderr, "Failed to create Manifest.db in %s\n", m_options.output.c_str());
+            return false;
+        }
+
+        std::vector<Contact> accounts;
+        for (unsigned int idx = 0; idx < m_options.numberOfAccounts; ++idx)
+        {
+            Contact account = { "wxid_gen" + std::to_string(idx + 1), "Account " + std::to_string(idx + 1) };
+            accounts.push_back(account);
+        }
+
+        bool succeeded = writeBackupPlists() && writePreferences() && writeLoginInfo(accounts);
+        for (std::vector<Contact>::const_iterator it = accounts.cbegin(); succeeded && it != accounts.cend(); ++it)
+        {
+            succeeded = writeAccount(*it, static_cast<unsigned int>(std::distance(accounts.cbegin(), it)));
+        }
+        return m_writer.close() && succeeded;
+    }
+
+    const GeneratorStats& getStats() const
+    {
+        return m_stats;
+    }
+
+private:
+    Generator(const Generator&);
+    Generator& operator=(const Generator&);
+
+    unsigned int nextInt(unsigned int minValue, unsigned int maxValue)
+    {
+        return std::uniform_int_distribution<unsigned int>(minValue, maxValue)(m_random);
+    }
+
+    std::string buildPlist(plist_t node, bool xml) const
+    {
+        char* data = NULL;
+        uint32_t length = 0;
+        if (xml)
+        {
+            plist_to_xml(node, &data, &length);
+        }
+        else
+        {
+            plist_to_bin(node, &data, &length);
+        }
+        std::string output;
+        if (NULL != data)
+        {
+            output.assign(data, length);
+            plist_mem_free(data);
+        }
+        plist_free(node);
+        return output;
+    }
+
+    // Info.plist and Manifest.plist are in the root of the backup, not in the manifest
+    bool writeBackupPlists()
+    {
+        std::string backupTime = "2021-08-15T00:00:00Z";
+        plist_t infoNode = plist_new_dict();
+        plist_dict_set_item(infoNode, "Device Name", plist_new_string("Generated"));
+        plist_dict_set_item(infoNode, "Display Name", plist_new_string("Generated"));
+        plist_dict_set_item(infoNode, "Product Type", plist_new_string("iPhone12,1"));
+        plist_dict_set_item(infoNode, "Product Version", plist_new_string(m_options.iOSVersion.c_str()));
+        plist_dict_set_item(infoNode, "iTunes Version", plist_new_string("12.11.3"));
+        plist_dict_set_item(infoNode, "Last Backup Date", plist_new_string(backupTime.c_str()));
+        plist_dict_set_item(infoNode, "Unique Identifier", plist_new_string(sha1(std::to_string(m_options.seed)).c_str()));
+
+        plist_t lockdownNode = plist_new_dict();
+        plist_dict_set_item(lockdownNode, "ProductVersion", plist_new_string(m_options.iOSVersion.c_str()));
+        plist_dict_set_item(lockdownNode, "DeviceName", plist_new_string("Generated"));
+        plist_t manifestNode = plist_new_dict();
+        plist_dict_set_item(manifestNode, "IsEncrypted", plist_new_bool(0));
+        plist_dict_set_item(manifestNode, "Version", plist_new_string("10.0"));
+        plist_dict_set_item(manifestNode, "Lockdown", lockdownNode);
+
+        return writeFile(combinePath(m_options.output, "Info.plist"), buildPlist(infoNode, true)) && writeFile(combinePath(m_options.output, "Manifest.plist"), buildPlist(manifestNode, false));
+    }
+
+    bool writePreferences()
+    {
+        plist_t versionsNode = plist_new_array();
+        plist_array_append_item(versionsNode, plist_new_string(m_options.wechatVersion.c_str()));
+        plist_t node = plist_new_dict();
+        plist_dict_set_item(node, "prevStartupVersions", versionsNode);
+        return m_writer.writeFile(WECHAT_DOMAIN, "Library/Preferences/com.tencent.xin.plist", buildPlist(node, false));
+    }
+
+    // Field 1 is the list of the accounts logged in, each one is a length-delimited message of usrName (1) and name (3)
+    bool writeLoginInfo(const std::vector<Contact>& accounts)
+    {
+        std::string users;
+        for (std::vector<Contact>::const_iterator it = accounts.cbegin(); it != accounts.cend(); ++it)
+        {
+            std::string user;
+            appendField(user, 1, it->usrName);
+            appendField(user, 3, it->displayName);
+            appendVarint(users, user.size());
+            users += user;
+        }
+        std::string loginInfo;
+        appendField(loginInfo, 1, users);
+        return m_writer.writeFile(WECHAT_DOMAIN, "Documents/LoginInfo2.dat", loginInfo);
+    }
+
+    bool writeAccount(const Contact& account, unsigned int accountIndex)
+    {
+        std::string userRoot = "Documents/" + md5(account.usrName);
+        m_writer.addDirectory(WECHAT_DOMAIN, userRoot);
+
+        unsigned int numberOfFriends = m_options.numberOfFriends > 0 ? m_options.numberOfFriends : m_options.numberOfChats * 2;
+        std::vector<Contact> friends;
+        for (unsigned int idx = 0; idx < numberOfFriends; ++idx)
+        {
+            Contact f = { "wxid_gen" + std::to_string(accountIndex + 1) + "_" + std::to_string(idx + 1), "Friend " + std::to_string(idx + 1) };
+            friends.push_back(f);
+        }
+
+        unsigned int numberOfChatrooms = m_options.numberOfChats * m_options.chatroomPercent / 100;
+        std::vector<Chat> chats;
+        for (unsigned int idx = 0; idx < m_options.numberOfChats; ++idx)
+        {
+            Chat chat;
+            if (idx < numberOfChatrooms || friends.empty())
+            {
+                chat.contact.usrName = std::to_string(20000000000ull + accountIndex * 100000ull + idx) + "@chatroom";
+                chat.contact.displayName = "Chatroom " + std::to_string(idx + 1);
+                for (unsigned int member = 0; member < m_options.numberOfMembers && !friends.empty(); ++member)
+                {
+                    chat.members.push_back(nextInt(0, static_cast<unsigned int>(friends.size() - 1)));
+                }
+            }
+            else
+            {
+                chat.contact = friends[(idx - numberOfChatrooms) % friends.size()];
+            }
+            chats.push_back(chat);
+        }
+
+        if (!writeContacts(userRoot, account, friends, chats) || !writeSessions(userRoot, chats) || !writeMessages(userRoot, account, friends, chats))
+        {
+            fprintf(stderr, "Failed to write the databases of %s\n", account.usrName.c_str());
+            return false;
+        }
+        if (!m_options.quiet)
+        {
+            fprintf(stdout, "%s: %u friends, %u chats\n", account.usrName.c_str(), static_cast<unsigned int>(friends.size()), static_cast<unsigned int>(chats.size()));
+            fflush(stdout);
+        }
+        return true;
+    }
+
+    bool openDb(const std::string& path, sqlite3 **ppDb, const char* schema) const
+    {
+        deleteFile(path);
+        if (!m_writer.makeParentDirectory(path) || sqlite3_open(path.c_str(), ppDb) != SQLITE_OK)
+        {
+            sqlite3_close(*ppDb);
+            *ppDb = NULL;
+            return false;
+        }
+        if (sqlite3_exec(*ppDb, schema, NULL, NULL, NULL) != SQLITE_OK || sqlite3_exec(*ppDb, "BEGIN TRANSACTION;", NULL, NULL, NULL) != SQLITE_OK)
+        {
+            sqlite3_close(*ppDb);
+            *ppDb = NULL;
+            return false;
+        }
+        return true;
+    }
+
+    bool closeDb(sqlite3* db, const std::string& relativePath)
+    {
+        bool succeeded = sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) == SQLITE_OK;
+        sqlite3_close(db);
+        return succeeded && m_writer.addFile(WECHAT_DOMAIN, relativePath);
+    }
+
+    // Friend of WCDB_Contact.sqlite: the name (1) of dbContactRemark, the avatars (2, 3) of dbContactHeadImage
+    // and the members xml (6) of dbContactChatRoom are protobuf
+    bool writeContacts(const std::string& userRoot, const Contact& account, const std::vector<Contact>& friends, const std::vector<Chat>& chats)
+    {
+        std::string relativePath = userRoot + "/DB/WCDB_Contact.sqlite";
+        sqlite3* db = NULL;
+        if (!openDb(m_writer.getRealPath(WECHAT_DOMAIN, relativePath), &db, "CREATE TABLE Friend (userName TEXT PRIMARY KEY, type INTEGER DEFAULT 0, certificationFlag INTEGER DEFAULT 0, imgStatus INTEGER DEFAULT 0, encodeUserName TEXT, dbContactLocal BLOB, dbContactOther BLOB, dbContactRemark BLOB, dbContactHeadImage BLOB, dbContactProfile BLOB, dbContactSocial BLOB, dbContactChatRoom BLOB, dbContactBrand BLOB);"))
+        {
+            return false;
+        }
+        std::string sql = "INSERT OR REPLACE INTO Friend(userName,type,dbContactRemark,dbContactHeadImage,dbContactChatRoom) VALUES(?,?,?,?,?)";
+        sqlite3_stmt* stmt = NULL;
+        if (sqlite3_prepare_v2(db, sql.c_str(), (int)(sql.size()), &stmt, NULL) != SQLITE_OK)
+        {
+            sqlite3_close(db);
+            return false;
+        }
+
+        std::vector<std::pair<const Contact *, const Chat *>> contacts;
+        contacts.push_back(std::make_pair(&account, static_cast<const Chat *>(NULL)));
+        for (std::vector<Contact>::const_iterator it = friends.cbegin(); it != friends.cend(); ++it)
+        {
+            contacts.push_back(std::make_pair(&(*it), static_cast<const Chat *>(NULL)));
+        }
+        for (std::vector<Chat>::const_iterator it = chats.cbegin(); it != chats.cend(); ++it)
+        {
+            if (!it->members.empty())
+            {
+                contacts.push_back(std::make_pair(&it->contact, &(*it)));
+            }
+        }
+
+        bool succeeded = true;
+        for (std::vector<std::pair<const Contact *, const Chat *>>::const_iterator it = contacts.cbegin(); succeeded && it != contacts.cend(); ++it)
+        {
+            const Contact& contact = *(it->first);
+            std::string remark;
+            appendField(remark, 1, contact.displayName);
+            std::string headImage;
+            std::string hash = md5(contact.usrName);
+            appendField(headImage, 2, m_options.mediaHost + "/head/" + hash + "/132");
+            appendField(headImage, 3, m_options.mediaHost + "/head/" + hash + "/0");
+            std::string chatroom;
+            if (NULL != it->second)
+            {
+                std::string members = "<RoomData>";
+                for (std::vector<size_t>::const_iterator itMember = it->second->members.cbegin(); itMember != it->second->members.cend(); ++itMember)
+                {
+                    const Contact& member = friends[*itMember];
+                    members += "<Member UserName=\"" + escapeXml(member.usrName) + "\"><DisplayName>" + escapeXml(member.displayName) + "</DisplayName></Member>";
+                }
+                members += "</RoomData>";
+                appendField(chatroom, 6, members);
+            }
+
+            sqlite3_bind_text(stmt, 1, contact.usrName.c_str(), (int)(contact.usrName.size()), SQLITE_TRANSIENT);
+            sqlite3_bind_int(stmt, 2, 3);
+            sqlite3_bind_blob(stmt, 3, remark.c_str(), (int)(remark.size()), SQLITE_TRANSIENT);
+            sqlite3_bind_blob(stmt, 4, headImage.c_str(), (int)(headImage.size()), SQLITE_TRANSIENT);
+            if (chatroom.empty())
+            {
+                sqlite3_bind_null(stmt, 5);
+            }
+            else
+            {
+                sqlite3_bind_blob(stmt, 5, chatroom.c_str(), (int)(chatroom.size()), SQLITE_TRANSIENT);
+            }
+            succeeded = sqlite3_step(stmt) == SQLITE_DONE;
+            sqlite3_reset(stmt);
+        }
+        sqlite3_finalize(stmt);
+        return closeDb(db, relativePath) && succeeded;
+    }
+
+    // SessionAbstract of session.db, without the cell data files (ConStrRes1)
+    bool writeSessions(const std::string& userRoot, const std::vector<Chat>& chats)
+    {
+        std::string relativePath = userRoot + "/session/session.db";
+        sqlite3* db = NULL;
+        if (!openDb(m_writer.getRealPath(WECHAT_DOMAIN, relativePath), &db, "CREATE TABLE SessionAbstract (UsrName TEXT PRIMARY KEY, Status INTEGER DEFAULT 0, CreateTime INTEGER DEFAULT 0, unreadcount INTEGER DEFAULT 0, ConIntRes1 INTEGER DEFAULT 0, ConIntRes2 INTEGER DEFAULT 0, ConIntRes3 INTEGER DEFAULT 0, ConStrRes1 TEXT, ConStrRes2 TEXT, ConStrRes3 TEXT);"))
+        {
+            return false;
+        }
+        std::string sql = "INSERT OR REPLACE INTO SessionAbstract(UsrName,CreateTime,unreadcount) VALUES(?,?,?)";
+        sqlite3_stmt* stmt = NULL;
+        if (sqlite3_prepare_v2(db, sql.c_str(), (int)(sql.size()), &stmt, NULL) != SQLITE_OK)
+        {
+            sqlite3_close(db);
+            return false;
+        }
+        bool succeeded = true;
+        for (std::vector<Chat>::const_iterator it = chats.cbegin(); succeeded && it != chats.cend(); ++it)
+        {
+            sqlite3_bind_text(stmt, 1, it->contact.usrName.c_str(), (int)(it->contact.usrName.size()), SQLITE_TRANSIENT);
+            sqlite3_bind_int64(stmt, 2, m_options.startTime + static_cast<int64_t>(m_options.numberOfMessages) * 60);
+            sqlite3_bind_int(stmt, 3, static_cast<int>(nextInt(0, 5)));
+            succeeded = sqlite3_step(stmt) == SQLITE_DONE;
+            sqlite3_reset(stmt);
+        }
+        sqlite3_finalize(stmt);
+        return closeDb(db, relativePath) && succeeded;
+    }
+
+    // The chats are spread over MM.sqlite and message_N.sqlite, a table of Chat_<md5 of usrName> each
+    bool writeMessages(const std::string& userRoot, const Contact& account, const std::vector<Contact>& friends, const std::vector<Chat>& chats)
+    {
+        unsigned int numberOfDbs = std::max(m_options.numberOfDbs, 1u);
+        bool succeeded = true;
+        for (unsigned int dbIndex = 0; succeeded && dbIndex < numberOfDbs; ++dbIndex)
+        {
+            std::string relativePath = userRoot + "/DB/" + (dbIndex == 0 ? std::string("MM.sqlite") : ("message_" + std::to_string(dbIndex) + ".sqlite"));
+            sqlite3* db = NULL;
+            if (!openDb(m_writer.getRealPath(WECHAT_DOMAIN, relativePath), &db, "CREATE TABLE Friend_Ext (UsrName TEXT PRIMARY KEY);"))
+            {
+                return false;
+            }
+            for (size_t chatIndex = dbIndex; succeeded && chatIndex < chats.size(); chatIndex += numberOfDbs)
+            {
+                succeeded = writeChat(db, userRoot, account, friends, chats[chatIndex]);
+            }
+            succeeded = closeDb(db, relativePath) && succeeded;
+        }
+        return succeeded;
+    }
+
+    bool writeChat(sqlite3* db, const std::string& userRoot, const Contact& account, const std::vector<Contact>& friends, const Chat& chat)
+    {
+        std::string chatHash = md5(chat.contact.usrName);
+        std::string tableName = "Chat_" + chatHash;
+        std::string schema = "CREATE TABLE " + tableName + " (TableVer INTEGER DEFAULT 1, MesLocalID INTEGER PRIMARY KEY AUTOINCREMENT, MesSvrID INTEGER DEFAULT 0, CreateTime INTEGER DEFAULT 0, Message TEXT, Status INTEGER DEFAULT 0, ImgStatus INTEGER DEFAULT 0, Type INTEGER, Des INTEGER);"
+            "CREATE INDEX " + tableName + "_Index ON " + tableName + "(CreateTime);";
+        if (sqlite3_exec(db, schema.c_str(), NULL, NULL, NULL) != SQLITE_OK)
+        {
+            return false;
+        }
+        std::string sql = "INSERT INTO " + tableName + "(MesSvrID,CreateTime,Message,Status,Type,Des) VALUES(?,?,?,?,?,?)";
+        sqlite3_stmt* stmt = NULL;
+        if (sqlite3_prepare_v2(db, sql.c_str(), (int)(sql.size()), &stmt, NULL) != SQLITE_OK)
+        {
+            return false;
+        }
+
+        bool isChatroom = !chat.members.empty();
+        unsigned int createTime = m_options.startTime;
+        bool succeeded = true;
+        for (unsigned int idx = 0; succeeded && idx < m_options.numberOfMessages; ++idx)
+        {
+            // MesLocalID is the rowid, the files of the messages are named after it
+            int64_t msgId = static_cast<int64_t>(idx) + 1;
+            std::string msgIdStr = std::to_string(msgId);
+            int des = static_cast<int>(nextInt(0, 1));
+            const Contact& sender = (des == 0) ? account : (isChatroom ? friends[chat.members[nextInt(0, static_cast<unsigned int>(chat.members.size() - 1))]] : chat.contact);
+            createTime += nextInt(1, 600);
+
+            int type = 1;
+            std::string content;
+            switch (m_kinds(m_random))
+            {
+                case MSG_KIND_IMAGE:
+                    type = 3;
+                    content = "<msg><img length=\"" + std::to_string(m_options.imageSize) + "\" hdlength=\"0\" /></msg>";
+                    succeeded = writeMedia(userRoot + "/Img/" + chatHash + "/" + msgIdStr + ".pic", m_options.imageSize, "\xFF\xD8\xFF\xE0", "\xFF\xD9") &&
+                        writeMedia(userRoot + "/Img/" + chatHash + "/" + msgIdStr + ".pic_thum", std::max(m_options.imageSize / 8, 64u), "\xFF\xD8\xFF\xE0", "\xFF\xD9");
+                    break;
+                case MSG_KIND_VOICE:
+                {
+                    type = 34;
+                    unsigned int voiceLength = nextInt(1000, 60000);
+                    content = "<msg><voicemsg endflag=\"1\" length=\"" + std::to_string(m_options.voiceSize) + "\" voicelength=\"" + std::to_string(voiceLength) + "\" /></msg>";
+                    succeeded = writeVoice(userRoot + "/Audio/" + chatHash + "/" + msgIdStr + ".aud", m_options.voiceSize);
+                    break;
+                }
+                case MSG_KIND_EMOJI:
+                {
+                    type = 47;
+                    std::string emojiMd5 = md5(chatHash + msgIdStr);
+                    content = "<msg><emoji fromusername=\"" + escapeXml(sender.usrName) + "\" tousername=\"" + escapeXml(des == 0 ? chat.contact.usrName : account.usrName) + "\" type=\"2\" md5=\"" + emojiMd5 + "\" len=\"4096\" cdnurl=\"" + escapeXml(m_options.mediaHost + "/emoji/" + emojiMd5 + "/0") + "\" thumburl=\"\" width=\"240\" height=\"240\"></emoji></msg>";
+                    break;
+                }
+                case MSG_KIND_APP:
+                    type = 49;
+                    content = "<msg><appmsg appid=\"\" sdkver=\"0\"><title>" + escapeXml(buildText(24)) + "</title><des>" + escapeXml(buildText(48)) + "</des><type>5</type><url>" + escapeXml(m_options.mediaHost + "/article/" + chatHash + "/" + msgIdStr) + "</url><thumburl></thumburl></appmsg><fromusername>" + escapeXml(sender.usrName) + "</fromusername></msg>";
+                    break;
+                default:
+                    content = buildText(m_options.textLength);
+                    break;
+            }
+            if (isChatroom && des != 0)
+            {
+                content = sender.usrName + ":\n" + content;
+            }
+
+            sqlite3_bind_int64(stmt, 1, static_cast<int64_t>(m_random()));
+            sqlite3_bind_int64(stmt, 2, createTime);
+            sqlite3_bind_text(stmt, 3, content.c_str(), (int)(content.size()), SQLITE_TRANSIENT);
+            sqlite3_bind_int(stmt, 4, des == 0 ? 2 : 4);
+            sqlite3_bind_int(stmt, 5, type);
+            sqlite3_bind_int(stmt, 6, des);
+            succeeded = succeeded && sqlite3_step(stmt) == SQLITE_DONE;
+            sqlite3_reset(stmt);
+            ++m_stats.numberOfMessages;
+        }
+        sqlite3_finalize(stmt);
+        return succeeded;
+    }
+
+    bool writeMedia(const std::string& relativePath, unsigned int size, const std::string& header, const std::string& trailer)
+    {
+        std::string data = header;
+        data.reserve(std::max(static_cast<size_t>(size), header.size() + trailer.size()));
+        while (data.size() + trailer.size() < size)
+        {
+            data.push_back(static_cast<char>(m_random() & 0xFF));
+        }
+        data += trailer;
+        return m_writer.writeFile(WECHAT_DOMAIN, relativePath, data);
+    }
+
+    // The SILK header of WeChat and packets of a 16-bit length each, the payloads of the packets are filler
+    bool writeVoice(const std::string& relativePath, unsigned int size)
+    {
+        std::string data("\x02#!SILK_V3", 10);
+        data.reserve(std::max(static_cast<size_t>(size), data.size()));
+        while (data.size() + 2 < size)
+        {
+            size_t length = std::min(static_cast<size_t>(nextInt(20, 80)), size - data.size() - 2);
+            data.push_back(static_cast<char>(length & 0xFF));
+            data.push_back(static_cast<char>((length >> 8) & 0xFF));
+            for (size_t idx = 0; idx < length; ++idx)
+            {
+                data.push_back(static_cast<char>(m_random() & 0xFF));
+            }
+        }
+        return m_writer.writeFile(WECHAT_DOMAIN, relativePath, data);
+    }
+
+    // Latin words mixed with CJK characters and the emoticon codes of WeChat, about length characters
+    std::string buildText(unsigned int length)
+    {
+        static const char* words[] = { "hello", "ok", "thanks", "tomorrow", "meeting", "lunch", "photo", "http://example.com/a?b=1", "[Smile]", "[微笑]", "哈哈", "好的", "明天见", "收到" };
+        unsigned int target = std::max(nextInt(length / 2, length + length / 2), 1u);
+        std::string text;
+        unsigned int characters = 0;
+        while (characters < target)
+        {
+            if (!text.empty())
+            {
+                text.push_back(' ');
+            }
+            if (nextInt(0, 3) == 0)
+            {
+                // U+4E00..U+4FFF, three bytes of UTF-8 each
+                unsigned int codePoint = 0x4E00 + nextInt(0, 0x1FF);
+                text.push_back(static_cast<char>(0xE0 | (codePoint >> 12)));
+                text.push_back(static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F)));
+                text.push_back(static_cast<char>(0x80 | (codePoint & 0x3F)));
+                characters += 1;
+            }
+            else
+            {
+                const char* word = words[nextInt(0, sizeof(words) / sizeof(words[0]) - 1)];
+                text += word;
+                characters += static_cast<unsigned int>(std::strlen(word));
+            }
+        }
+        return text;
+    }
+
+    GeneratorOptions m_options;
+    std::mt19937 m_random;
+    std::discrete_distribution<int> m_kinds;
+    GeneratorStats m_stats;
+    BackupWriter m_writer;
+};
+
+static void printUsage(const char* name)
+{
+    fprintf(stderr,
+            "Usage: %s --output <dir> [options]\n"
+            "  --output <dir>          Directory of the backup, created if it doesn't exist\n"
+            "  --accounts <n>          Accounts logged in (default: 1)\n"
+            "  --chats <n>             Chats of each account (default: 20)\n"
+            "  --messages <n>          Messages of each chat (default: 1000)\n"
+            "  --friends <n>           Friends of each account, 0 for twice the chats (default: 0)\n"
+            "  --chatrooms <percent>   Chats which are chatrooms (default: 30)\n"
+            "  --members <n>           Members of each chatroom (default: 20)\n"
+            "  --dbs <n>               Message databases of each account, MM.sqlite and message_N.sqlite (default: 1)\n"
+            "  --mix <t,i,v,e,a>       Weights of text, image, voice, emoji and app messages (default: 70,10,5,10,5)\n"
+            "  --text-length <n>       Average characters of a text message (default: 40)\n"
+            "  --image-size <bytes>    Size of an image, its thumbnail is an eighth of it (default: 32768)\n"
+            "  --voice-size <bytes>    Size of a voice (default: 8192)\n"
+            "  --media-host <url>      Host of the avatars, emojis and links (default: http://127.0.0.1:9, nothing listens)\n"
+            "  --seed <n>              Seed of the contents, the same seed gives the same backup (default: 1)\n"
+            "  --ios <version>         iOS version of the backup (default: 14.4)\n"
+            "  --wechat <version>      WeChat version (default: 8.0.2)\n"
+            "  --quiet                 No summary on stdout\n",
+            name);
+}
+
+static bool parseNumber(const char* value, unsigned int& number)
+{
+    if (NULL == value || *value == '\0')
+    {
+        return false;
+    }
+    char* end = NULL;
+    unsigned long long result = std::strtoull(value, &end, 0);
+    if (NULL == end || *end != '\0' || result > 0xFFFFFFFFull)
+    {
+        return false;
+    }
+    number = static_cast<unsigned int>(result);
+    return true;
+}
+
+static bool parseMix(const std::string& value, unsigned int* mix)
+{
+    std::vector<std::string> weights = split(value, ",");
+    if (weights.size() != NUMBER_OF_MSG_KINDS)
+    {
+        return false;
+    }
+    for (size_t idx = 0; idx < weights.size(); ++idx)
+    {
+        if (!parseNumber(weights[idx].c_str(), mix[idx]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool parseCommandLine(int argc, char* argv[], GeneratorOptions& options)
+{
+    for (int idx = 1; idx < argc; ++idx)
+    {
+        std::string arg = argv[idx];
+        const char* value = (idx + 1 < argc) ? argv[idx + 1] : NULL;
+        if (arg == "--quiet")
+        {
+            options.quiet = true;
+            continue;
+        }
+        if (arg == "--help" || arg == "-h" || NULL == value)
+        {
+            return false;
+        }
+        ++idx;
+
+        bool succeeded = true;
+        if (arg == "--output") options.output = value;
+        else if (arg == "--media-host") options.mediaHost = value;
+        else if (arg == "--ios") options.iOSVersion = value;
+        else if (arg == "--wechat") options.wechatVersion = value;
+        else if (arg == "--mix") succeeded = parseMix(value, options.mix);
+        else if (arg == "--accounts") succeeded = parseNumber(value, options.numberOfAccounts);
+        else if (arg == "--chats") succeeded = parseNumber(value, options.numberOfChats);
+        else if (arg == "--messages") succeeded = parseNumber(value, options.numberOfMessages);
+        else if (arg == "--friends") succeeded = parseNumber(value, options.numberOfFriends);
+        else if (arg == "--chatrooms") succeeded = parseNumber(value, options.chatroomPercent) && options.chatroomPercent <= 100;
+        else if (arg == "--members") succeeded = parseNumber(value, options.numberOfMembers);
+        else if (arg == "--dbs") succeeded = parseNumber(value, options.numberOfDbs);
+        else if (arg == "--text-length") succeeded = parseNumber(value, options.textLength);
+        else if (arg == "--image-size") succeeded = parseNumber(value, options.imageSize);
+        else if (arg == "--voice-size") succeeded = parseNumber(value, options.voiceSize);
+        else if (arg == "--seed") succeeded = parseNumber(value, options.seed);
+        else
+        {
+            fprintf(stderr, "Unknown option: %s\n", arg.c_str());
+            return false;
+        }
+        if (!succeeded)
+        {
+            fprintf(stderr, "Invalid value of %s: %s\n", arg.c_str(), value);
+            return false;
+        }
+    }
+    return !options.output.empty() && options.numberOfAccounts > 0;
+}
+
+int main(int argc, char* argv[])
+{
+    GeneratorOptions options;
+    if (!parseCommandLine(argc, argv, options))
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+    Generator generator(options);
+    if (!generator.run())
+    {
+        return 2;
+    }
+
+    if (!options.quiet)
+    {
+        const GeneratorStats& stats = generator.getStats();
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+        fprintf(stdout, "%llu messages, %llu files, %llu bytes in %.2f s\n", static_cast<unsigned long long>(stats.numberOfMessages), static_cast<unsigned long long>(stats.numberOfFiles), static_cast<unsigned long long>(stats.numberOfBytes), elapsed);
+    }
+    return 0;
+}
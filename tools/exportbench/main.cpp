@@ -0,0 +1,637 @@
+//
+//  main.cpp
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+//  End-to-end benchmark of the exporting: Exporter::run over the backups of tools/backupgen at a few scales,
+//  with the main options turned on one at a time. The downloads go to an HTTP server of its own on the loopback,
+//  the results are written as JSON and compared with a baseline of a previous run:
+//  exportbench --res <dir> --generator <backupgen> --data <dir> --work <dir> [options]
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <json/json.h>
+#include "../../WechatExporter/core/Exporter.h"
+#include "../../WechatExporter/core/MessageParser.h"
+#include "../../WechatExporter/core/ExportMetrics.h"
+#include "../../WechatExporter/core/FileSystem.h"
+#include "../../cli/LoggerImpl.h"
+#include "../../cli/ExportNotifierImpl.h"
+
+#define EXIT_CODE_SUCCEEDED     0
+#define EXIT_CODE_WRONG_ARGS    1
+#define EXIT_CODE_FAILED        2
+#define EXIT_CODE_REGRESSED     4
+
+#define FIXTURE_BODY_SIZE       2048
+
+struct BenchOptions
+{
+    std::string workDir;        // Where the res directory is
+    std::string generator;      // Path of backupgen
+    std::string dataDir;        // Generated backups, kept across the runs
+    std::string outputDir;      // Outputs of the cases, deleted before each case
+    std::vector<std::string> scales;
+    std::vector<std::string> variants;
+    unsigned int repeat;
+    unsigned int port;          // Of the HTTP fixture, it is in the urls of the generated backups
+    std::string resultsFile;
+    std::string baselineFile;
+    unsigned int tolerance;     // Percent
+    bool verbose;
+
+    BenchOptions() : workDir("."), generator("backupgen"), repeat(1), port(18080), tolerance(10), verbose(false)
+    {
+    }
+};
+
+// Answers any GET with the same small body, so that the downloads are real transfers which never depend on the network
+class HttpFixture
+{
+public:
+    HttpFixture() : m_socket(-1), m_stopping(false), m_numberOfRequests(0)
+    {
+    }
+
+    ~HttpFixture()
+    {
+        stop();
+    }
+
+    bool start(unsigned int port)
+    {
+        m_socket = socket(AF_INET, SOCK_STREAM, 0);
+        if (m_socket < 0)
+        {
+            return false;
+        }
+        int reuse = 1;
+        setsockopt(m_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(static_cast<uint16_t>(port));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(m_socket, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0 || listen(m_socket, 128) != 0)
+        {
+            close(m_socket);
+            m_socket = -1;
+            return false;
+        }
+        std::string body(FIXTURE_BODY_SIZE, '\0');
+        for (size_t idx = 0; idx < body.size(); ++idx)
+        {
+            body[idx] = static_cast<char>(idx * 31 + 7);
+        }
+        m_response = "HTTP/1.1 200 OK\r\nContent-Type: image/jpeg\r\nContent-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        m_thread = std::thread(&HttpFixture::serve, this);
+        return true;
+    }
+
+    void stop()
+    {
+        if (m_socket < 0)
+        {
+            return;
+        }
+        m_stopping = true;
+        shutdown(m_socket, SHUT_RDWR);
+        close(m_socket);
+        if (m_thread.joinable())
+        {
+            m_thread.join();
+        }
+        m_socket = -1;
+    }
+
+    uint64_t getNumberOfRequests() const
+    {
+        return m_numberOfRequests.load();
+    }
+
+private:
+    HttpFixture(const HttpFixture&);
+    HttpFixture& operator=(const HttpFixture&);
+
+    void serve()
+    {
+        while (!m_stopping)
+        {
+            int client = accept(m_socket, NULL, NULL);
+            if (client < 0)
+            {
+                continue;
+            }
+            // The request is read up to its headers, there is no body in a GET
+            std::string request;
+            char buffer[4096];
+            while (request.find("\r\n\r\n") == std::string::npos)
+            {
+                ssize_t length = recv(client, buffer, sizeof(buffer), 0);
+                if (length <= 0)
+                {
+                    break;
+                }
+                request.append(buffer, static_cast<size_t>(length));
+            }
+            if (request.find("\r\n\r\n") != std::string::npos)
+            {
+                ++m_numberOfRequests;
+                const char* p = m_response.c_str();
+                size_t remaining = m_response.size();
+                while (remaining > 0)
+                {
+                    ssize_t length = send(client, p, remaining, MSG_NOSIGNAL);
+                    if (length <= 0)
+                    {
+                        break;
+                    }
+                    p += length;
+                    remaining -= static_cast<size_t>(length);
+                }
+            }
+            close(client);
+        }
+    }
+
+    int m_socket;
+    std::atomic<bool> m_stopping;
+    std::atomic<uint64_t> m_numberOfRequests;
+    std::string m_response;
+    std::thread m_thread;
+};
+
+// What the process did during a case. The syscalls are the read and write ones that Linux counts in /proc/self/io,
+// -1 where the system doesn't tell
+struct ProcessStats
+{
+    int64_t peakRss;
+    int64_t readSyscalls;
+    int64_t writeSyscalls;
+    int64_t writtenBytes;
+
+    ProcessStats() : peakRss(-1), readSyscalls(-1), writeSyscalls(-1), writtenBytes(-1)
+    {
+    }
+};
+
+#ifdef __linux__
+// The files of /proc have no size, readFile of FileSystem sees them empty
+static std::string readProcFile(const char* path)
+{
+    std::string contents;
+    FILE* fp = fopen(path, "r");
+    if (NULL != fp)
+    {
+        char buffer[4096];
+        size_t length = 0;
+        while ((length = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+        {
+            contents.append(buffer, length);
+        }
+        fclose(fp);
+    }
+    return contents;
+}
+#endif
+
+static void readProcessStats(ProcessStats& stats)
+{
+#ifdef __linux__
+    std::string io = readProcFile("/proc/self/io");
+    std::vector<std::string> lines = split(io, "\n");
+    for (std::vector<std::string>::const_iterator it = lines.cbegin(); it != lines.cend(); ++it)
+    {
+        if (startsWith(*it, "syscr:"))
+        {
+            stats.readSyscalls = std::strtoll(it->c_str() + 6, NULL, 10);
+        }
+        else if (startsWith(*it, "syscw:"))
+        {
+            stats.writeSyscalls = std::strtoll(it->c_str() + 6, NULL, 10);
+        }
+        else if (startsWith(*it, "wchar:"))
+        {
+            stats.writtenBytes = std::strtoll(it->c_str() + 6, NULL, 10);
+        }
+    }
+    std::string status = readProcFile("/proc/self/status");
+    std::string::size_type pos = status.find("VmHWM:");
+    if (pos != std::string::npos)
+    {
+        stats.peakRss = std::strtoll(status.c_str() + pos + 6, NULL, 10) * 1024;
+    }
+#else
+    // The peak of the whole process, the cases after a larger one report its peak
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+        stats.peakRss = static_cast<int64_t>(usage.ru_maxrss);
+    }
+#endif
+}
+
+// The peak RSS of the next case starts from the current RSS
+static void resetPeakRss()
+{
+#ifdef __linux__
+    FILE* fp = fopen("/proc/self/clear_refs", "w");
+    if (NULL != fp)
+    {
+        fputs("5", fp);
+        fclose(fp);
+    }
+#endif
+}
+
+struct Scale
+{
+    std::string name;
+    unsigned int numberOfChats;
+    unsigned int numberOfMessages;  // Of each chat
+};
+
+// 10k, 1m, 10m or a plain number of messages, spread over more chats as it grows
+static bool parseScale(const std::string& name, Scale& scale)
+{
+    char* end = NULL;
+    unsigned long long total = std::strtoull(name.c_str(), &end, 10);
+    if (NULL == end || end == name.c_str())
+    {
+        return false;
+    }
+    std::string suffix = end;
+    if (suffix == "k" || suffix == "K")
+    {
+        total *= 1000;
+    }
+    else if (suffix == "m" || suffix == "M")
+    {
+        total *= 1000000;
+    }
+    else if (!suffix.empty())
+    {
+        return false;
+    }
+    if (total == 0 || total > 0xFFFFFFFFull)
+    {
+        return false;
+    }
+    scale.name = name;
+    scale.numberOfChats = static_cast<unsigned int>(std::min(std::max(total / 5000, 10ull), 500ull));
+    scale.numberOfMessages = static_cast<unsigned int>(std::max(total / scale.numberOfChats, 1ull));
+    return true;
+}
+
+// The backup of a scale is generated once, again only if the arguments of backupgen changed
+static bool prepareBackup(const BenchOptions& options, const Scale& scale, std::string& backup)
+{
+    backup = combinePath(options.dataDir, scale.name);
+    std::string args = "--output \"" + backup + "\" --chats " + std::to_string(scale.numberOfChats) + " --messages " + std::to_string(scale.numberOfMessages) + " --dbs 2 --media-host http://127.0.0.1:" + std::to_string(options.port) + " --quiet";
+    std::string argsPath = combinePath(options.dataDir, scale.name + ".args");
+    if (existsFile(combinePath(backup, "Manifest.db")) && readFile(argsPath) == args)
+    {
+        return true;
+    }
+
+    fprintf(stdout, "Generating %s: %u chats of %u messages\n", scale.name.c_str(), scale.numberOfChats, scale.numberOfMessages);
+    fflush(stdout);
+    deleteFile(argsPath);
+    deleteDirectory(backup);
+    std::string command = "\"" + options.generator + "\" " + args;
+    if (!makeDirectory(options.dataDir) || std::system(command.c_str()) != 0)
+    {
+        fprintf(stderr, "Failed to generate the backup: %s\n", command.c_str());
+        return false;
+    }
+    return writeFile(argsPath, args);
+}
+
+// default, incremental (a second exporting over the first one, nothing new), text or sync
+static bool isValidVariant(const std::string& variant)
+{
+    return variant == "default" || variant == "incremental" || variant == "text" || variant == "sync";
+}
+
+static bool exportOnce(const BenchOptions& options, const std::string& backup, const std::string& output, const std::string& variant, Logger* logger)
+{
+    ExportNotifierImpl notifier(true);
+    Exporter exporter(options.workDir, backup, output, logger, NULL);
+    if (variant == "incremental")
+    {
+        exporter.setIncrementalExporting(true);
+        exporter.setCachingManifest(true);
+    }
+    else if (variant == "text")
+    {
+        exporter.setTextMode();
+        exporter.setExtName("txt");
+        exporter.setTemplatesName("templates_txt");
+    }
+    else if (variant == "sync")
+    {
+        exporter.setSyncLoading(true);
+    }
+    exporter.setNotifier(&notifier);
+    if (!exporter.run())
+    {
+        return false;
+    }
+    exporter.waitForComplition();
+    return !notifier.isCancelled();
+}
+
+static bool runCase(const BenchOptions& options, const Scale& scale, const std::string& backup, const std::string& variant, Logger* logger, HttpFixture& fixture, Json::Value& result)
+{
+    std::string output = combinePath(options.outputDir, scale.name + "-" + variant);
+    std::vector<Json::Value> runs;
+    for (unsigned int idx = 0; idx < options.repeat; ++idx)
+    {
+        deleteDirectory(output);
+        if (!makeDirectory(output))
+        {
+            return false;
+        }
+        if (variant == "incremental" && !exportOnce(options, backup, output, variant, logger))
+        {
+            return false;
+        }
+
+        resetExportMetrics();
+        resetPeakRss();
+        ProcessStats startStats;
+        readProcessStats(startStats);
+        uint64_t startRequests = fixture.getNumberOfRequests();
+        std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+        bool succeeded = exportOnce(options, backup, output, variant, logger);
+
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+        ProcessStats endStats;
+        readProcessStats(endStats);
+        int64_t numberOfMessages = g_exportMetrics[EXPORT_METRIC_MESSAGES].load();
+
+        Json::Value run(Json::objectValue);
+        run["succeeded"] = Json::Value(succeeded);
+        run["wallSeconds"] = Json::Value(elapsed);
+        run["messages"] = Json::Value(static_cast<Json::Int64>(numberOfMessages));
+        run["messagesPerSecond"] = Json::Value(elapsed > 0 ? numberOfMessages / elapsed : 0.0);
+        run["peakRssBytes"] = Json::Value(static_cast<Json::Int64>(endStats.peakRss));
+        run["readSyscalls"] = Json::Value(static_cast<Json::Int64>(endStats.readSyscalls < 0 ? -1 : endStats.readSyscalls - startStats.readSyscalls));
+        run["writeSyscalls"] = Json::Value(static_cast<Json::Int64>(endStats.writeSyscalls < 0 ? -1 : endStats.writeSyscalls - startStats.writeSyscalls));
+        run["processWrittenBytes"] = Json::Value(static_cast<Json::Int64>(endStats.writtenBytes < 0 ? -1 : endStats.writtenBytes - startStats.writtenBytes));
+        run["writtenBytes"] = Json::Value(static_cast<Json::Int64>(g_exportMetrics[EXPORT_METRIC_WRITTEN_BYTES].load()));
+        run["downloads"] = Json::Value(static_cast<Json::Int64>(g_exportMetrics[EXPORT_METRIC_DOWNLOADS].load()));
+        run["failedDownloads"] = Json::Value(static_cast<Json::Int64>(g_exportMetrics[EXPORT_METRIC_FAILED_DOWNLOADS].load()));
+        run["httpRequests"] = Json::Value(static_cast<Json::UInt64>(fixture.getNumberOfRequests() - startRequests));
+        runs.push_back(run);
+        if (!succeeded)
+        {
+            break;
+        }
+    }
+
+    // The run of the median wall time stands for the case
+    std::sort(runs.begin(), runs.end(), [](const Json::Value& a, const Json::Value& b) { return a["wallSeconds"].asDouble() < b["wallSeconds"].asDouble(); });
+    result = runs[runs.size() / 2];
+    result["scale"] = Json::Value(scale.name);
+    result["variant"] = Json::Value(variant);
+    result["runs"] = Json::Value(static_cast<Json::UInt>(runs.size()));
+    result["succeeded"] = Json::Value(runs.back()["succeeded"].asBool() && runs.front()["succeeded"].asBool());
+    return result["succeeded"].asBool();
+}
+
+// A case regresses if it is slower or grows its peak RSS by more than the tolerance, the cases missing from the baseline are skipped
+static unsigned int compareWithBaseline(const Json::Value& results, const Json::Value& baseline, unsigned int tolerance)
+{
+    std::map<std::string, Json::Value> baselineCases;
+    const Json::Value& cases = baseline["cases"];
+    for (Json::ArrayIndex idx = 0; cases.isArray() && idx < cases.size(); ++idx)
+    {
+        baselineCases[cases[idx]["scale"].asString() + "/" + cases[idx]["variant"].asString()] = cases[idx];
+    }
+
+    unsigned int numberOfRegressions = 0;
+    double limit = 1.0 + tolerance / 100.0;
+    fprintf(stdout, "%-24s %12s %12s %8s %12s %12s %8s\n", "case", "wall(s)", "baseline", "ratio", "rss(MB)", "baseline", "ratio");
+    const Json::Value& currentCases = results["cases"];
+    for (Json::ArrayIndex idx = 0; idx < currentCases.size(); ++idx)
+    {
+        const Json::Value& current = currentCases[idx];
+        std::string key = current["scale"].asString() + "/" + current["variant"].asString();
+        std::map<std::string, Json::Value>::const_iterator it = baselineCases.find(key);
+        if (it == baselineCases.cend())
+        {
+            fprintf(stdout, "%-24s %12.3f %12s\n", key.c_str(), current["wallSeconds"].asDouble(), "-");
+            continue;
+        }
+        double wall = current["wallSeconds"].asDouble();
+        double baselineWall = it->second["wallSeconds"].asDouble();
+        double rss = current["peakRssBytes"].asDouble();
+        double baselineRss = it->second["peakRssBytes"].asDouble();
+        double wallRatio = baselineWall > 0 ? wall / baselineWall : 0;
+        double rssRatio = baselineRss > 0 && rss > 0 ? rss / baselineRss : 0;
+        bool regressed = wallRatio > limit || rssRatio > limit || !current["succeeded"].asBool();
+        if (regressed)
+        {
+            ++numberOfRegressions;
+        }
+        fprintf(stdout, "%-24s %12.3f %12.3f %8.2f %12.1f %12.1f %8.2f%s\n", key.c_str(), wall, baselineWall, wallRatio, rss / 1048576.0, baselineRss / 1048576.0, rssRatio, regressed ? "  REGRESSED" : "");
+    }
+    return numberOfRegressions;
+}
+
+static void printUsage(const char* name)
+{
+    fprintf(stderr,
+            "Usage: %s --data <dir> --work <dir> [options]\n"
+            "  --res <dir>             Directory containing res/ with the templates (default: .)\n"
+            "  --generator <path>      backupgen of tools/backupgen (default: backupgen)\n"
+            "  --data <dir>            Generated backups, they are kept for the next runs\n"
+            "  --work <dir>            Outputs of the exportings, deleted before each case\n"
+            "  --scales <list>         Messages of the backups, comma separated (default: 10k,1m,10m)\n"
+            "  --variants <list>       default, incremental, text and sync, comma separated (default: all)\n"
+            "  --repeat <n>            Runs of each case, the median is kept (default: 1)\n"
+            "  --port <n>              Port of the local HTTP server of the downloads (default: 18080)\n"
+            "  --results <file>        Writes the results as JSON\n"
+            "  --baseline <file>       Results of a previous run, exits with %d if a case regressed\n"
+            "  --tolerance <percent>   Slowdown or growth of the peak RSS allowed by the baseline (default: 10)\n"
+            "  --verbose               Logs of the exporter\n",
+            name, EXIT_CODE_REGRESSED);
+}
+
+static bool parseNumber(const char* value, unsigned int& number)
+{
+    if (NULL == value || *value == '\0')
+    {
+        return false;
+    }
+    char* end = NULL;
+    unsigned long long result = std::strtoull(value, &end, 10);
+    if (NULL == end || *end != '\0' || result > 0xFFFFFFFFull)
+    {
+        return false;
+    }
+    number = static_cast<unsigned int>(result);
+    return true;
+}
+
+static bool parseCommandLine(int argc, char* argv[], BenchOptions& options)
+{
+    options.scales = split("10k,1m,10m", ",");
+    options.variants = split("default,incremental,text,sync", ",");
+    for (int idx = 1; idx < argc; ++idx)
+    {
+        std::string arg = argv[idx];
+        const char* value = (idx + 1 < argc) ? argv[idx + 1] : NULL;
+        if (arg == "--verbose")
+        {
+            options.verbose = true;
+            continue;
+        }
+        if (arg == "--help" || arg == "-h" || NULL == value)
+        {
+            return false;
+        }
+        ++idx;
+
+        bool succeeded = true;
+        if (arg == "--res") options.workDir = value;
+        else if (arg == "--generator") options.generator = value;
+        else if (arg == "--data") options.dataDir = value;
+        else if (arg == "--work") options.outputDir = value;
+        else if (arg == "--scales") options.scales = split(value, ",");
+        else if (arg == "--variants") options.variants = split(value, ",");
+        else if (arg == "--results") options.resultsFile = value;
+        else if (arg == "--baseline") options.baselineFile = value;
+        else if (arg == "--repeat") succeeded = parseNumber(value, options.repeat) && options.repeat > 0;
+        else if (arg == "--port") succeeded = parseNumber(value, options.port) && options.port > 0 && options.port < 65536;
+        else if (arg == "--tolerance") succeeded = parseNumber(value, options.tolerance);
+        else
+        {
+            fprintf(stderr, "Unknown option: %s\n", arg.c_str());
+            return false;
+        }
+        if (!succeeded)
+        {
+            fprintf(stderr, "Invalid value of %s: %s\n", arg.c_str(), value);
+            return false;
+        }
+    }
+    for (std::vector<std::string>::const_iterator it = options.variants.cbegin(); it != options.variants.cend(); ++it)
+    {
+        if (!isValidVariant(*it))
+        {
+            fprintf(stderr, "Unknown variant: %s\n", it->c_str());
+            return false;
+        }
+    }
+    return !options.dataDir.empty() && !options.outputDir.empty() && !options.scales.empty() && !options.variants.empty();
+}
+
+int main(int argc, char* argv[])
+{
+    BenchOptions options;
+    if (!parseCommandLine(argc, argv, options))
+    {
+        printUsage(argv[0]);
+        return EXIT_CODE_WRONG_ARGS;
+    }
+    std::vector<Scale> scales;
+    for (std::vector<std::string>::const_iterator it = options.scales.cbegin(); it != options.scales.cend(); ++it)
+    {
+        Scale scale;
+        if (!parseScale(*it, scale))
+        {
+            fprintf(stderr, "Invalid scale: %s\n", it->c_str());
+            return EXIT_CODE_WRONG_ARGS;
+        }
+        scales.push_back(scale);
+    }
+
+    Json::Value baseline;
+    if (!options.baselineFile.empty())
+    {
+        Json::Reader reader;
+        if (!reader.parse(readFile(options.baselineFile), baseline, false))
+        {
+            fprintf(stderr, "Failed to read the baseline: %s\n", options.baselineFile.c_str());
+            return EXIT_CODE_WRONG_ARGS;
+        }
+    }
+
+    HttpFixture fixture;
+    if (!fixture.start(options.port))
+    {
+        fprintf(stderr, "Failed to listen on 127.0.0.1:%u\n", options.port);
+        return EXIT_CODE_FAILED;
+    }
+
+    Exporter::initializeExporter();
+    LoggerImpl logger(options.verbose);
+
+    Json::Value results(Json::objectValue);
+    results["cores"] = Json::Value(std::max(std::thread::hardware_concurrency(), 1u));
+    results["repeat"] = Json::Value(options.repeat);
+    results["cases"] = Json::Value(Json::arrayValue);
+    int exitCode = EXIT_CODE_SUCCEEDED;
+    for (std::vector<Scale>::const_iterator itScale = scales.cbegin(); itScale != scales.cend(); ++itScale)
+    {
+        std::string backup;
+        if (!prepareBackup(options, *itScale, backup))
+        {
+            exitCode = EXIT_CODE_FAILED;
+            break;
+        }
+        for (std::vector<std::string>::const_iterator itVariant = options.variants.cbegin(); itVariant != options.variants.cend(); ++itVariant)
+        {
+            Json::Value result;
+            if (!runCase(options, *itScale, backup, *itVariant, &logger, fixture, result))
+            {
+                fprintf(stderr, "Failed to export %s with %s\n", itScale->name.c_str(), itVariant->c_str());
+                exitCode = EXIT_CODE_FAILED;
+            }
+            if (!result.isNull())
+            {
+                fprintf(stdout, "%s/%s: %.3f s, %.0f messages/s, peak RSS %.1f MB\n", itScale->name.c_str(), itVariant->c_str(), result["wallSeconds"].asDouble(), result["messagesPerSecond"].asDouble(), result["peakRssBytes"].asDouble() / 1048576.0);
+                fflush(stdout);
+                results["cases"].append(result);
+            }
+        }
+        deleteDirectory(options.outputDir);
+    }
+
+    Exporter::uninitializeExporter();
+    fixture.stop();
+
+    if (!options.resultsFile.empty())
+    {
+        Json::StyledWriter writer;
+        if (!writeFile(options.resultsFile, writer.write(results)))
+        {
+            fprintf(stderr, "Failed to write the results: %s\n", options.resultsFile.c_str());
+        }
+    }
+    if (!baseline.isNull() && compareWithBaseline(results, baseline, options.tolerance) > 0 && exitCode == EXIT_CODE_SUCCEEDED)
+    {
+        exitCode = EXIT_CODE_REGRESSED;
+    }
+    return exitCode;
+}
@@ -0,0 +1,197 @@
+//
+//  Benchmark.cpp
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#include "Benchmark.h"
+#include <cstdio>
+#include <ctime>
+#include <vector>
+#include <regex>
+#include <thread>
+#include <algorithm>
+#include <json/json.h>
+#include "../../WechatExporter/core/Utils.h"
+#include "../../WechatExporter/core/FileSystem.h"
+
+#define BENCH_MAX_ITERATIONS    static_cast<uint64_t>(1000000000)
+
+BenchState::BenchState(uint64_t maxIterations) : m_maxIterations(maxIterations), m_iterations(0), m_elapsed(std::chrono::steady_clock::duration::zero()), m_items(0), m_bytes(0)
+{
+}
+
+void BenchState::pauseTiming()
+{
+    m_elapsed += std::chrono::steady_clock::now() - m_startTime;
+}
+
+void BenchState::resumeTiming()
+{
+    m_startTime = std::chrono::steady_clock::now();
+}
+
+static std::vector<std::pair<std::string, BenchFunction>>& getBenchmarks()
+{
+    static std::vector<std::pair<std::string, BenchFunction>> benchmarks;
+    return benchmarks;
+}
+
+int registerBenchmark(const std::string& name, const BenchFunction& function)
+{
+    std::vector<std::pair<std::string, BenchFunction>>& benchmarks = getBenchmarks();
+    benchmarks.push_back(std::make_pair(name, function));
+    return static_cast<int>(benchmarks.size());
+}
+
+struct BenchResult
+{
+    std::string name;
+    uint64_t iterations;
+    double realTime;        // ns per iteration
+    double cpuTime;
+    double itemsPerSecond;
+    double bytesPerSecond;
+    std::string label;
+};
+
+// The iterations grow until a run lasts minTime, the last run is the result.
+// The cpu time is of the process, other threads of the benchmark count as well
+static bool runBenchmark(const std::string& name, const BenchFunction& function, double minTime, BenchResult& result)
+{
+    uint64_t iterations = 1;
+    while (true)
+    {
+        BenchState state(iterations);
+        std::clock_t startClock = std::clock();
+        function(state);
+        double cpuSeconds = static_cast<double>(std::clock() - startClock) / CLOCKS_PER_SEC;
+        if (!state.getSkipped().empty())
+        {
+            fprintf(stdout, "%-56s skipped: %s\n", name.c_str(), state.getSkipped().c_str());
+            fflush(stdout);
+            return false;
+        }
+
+        double elapsed = state.getElapsedSeconds();
+        if (elapsed >= minTime || iterations >= BENCH_MAX_ITERATIONS || state.getIterations() == 0)
+        {
+            uint64_t numberOfIterations = std::max(state.getIterations(), static_cast<uint64_t>(1));
+            result.name = name;
+            result.iterations = state.getIterations();
+            result.realTime = elapsed * 1e9 / numberOfIterations;
+            result.cpuTime = cpuSeconds * 1e9 / numberOfIterations;
+            result.itemsPerSecond = (elapsed > 0 && state.getItems() > 0) ? state.getItems() / elapsed : 0;
+            result.bytesPerSecond = (elapsed > 0 && state.getBytes() > 0) ? state.getBytes() / elapsed : 0;
+            result.label = state.getLabel();
+            return true;
+        }
+
+        // Far from minTime the time of a run says little, it grows tenfold then
+        double multiplier = (elapsed > minTime / 10) ? (minTime * 1.4 / elapsed) : 10.0;
+        iterations = std::min(static_cast<uint64_t>(iterations * std::max(multiplier, 1.5)) + 1, BENCH_MAX_ITERATIONS);
+    }
+}
+
+static void printResult(const BenchResult& result)
+{
+    std::string rates;
+    if (result.itemsPerSecond > 0)
+    {
+        rates += formatString("  %.3fM items/s", result.itemsPerSecond / 1e6);
+    }
+    if (result.bytesPerSecond > 0)
+    {
+        rates += formatString("  %.1f MB/s", result.bytesPerSecond / 1048576.0);
+    }
+    if (!result.label.empty())
+    {
+        rates += "  " + result.label;
+    }
+    fprintf(stdout, "%-56s %14.1f ns %14.1f ns %12llu%s\n", result.name.c_str(), result.realTime, result.cpuTime, static_cast<unsigned long long>(result.iterations), rates.c_str());
+    fflush(stdout);
+}
+
+static bool writeResults(const std::string& path, const std::vector<BenchResult>& results)
+{
+    Json::Value contextObj(Json::objectValue);
+    contextObj["date"] = Json::Value(getTimestampString(true, false));
+    contextObj["num_cpus"] = Json::Value(std::max(std::thread::hardware_concurrency(), 1u));
+#ifdef NDEBUG
+    contextObj["library_build_type"] = Json::Value("release");
+#else
+    contextObj["library_build_type"] = Json::Value("debug");
+#endif
+
+    Json::Value benchmarksObj(Json::arrayValue);
+    for (std::vector<BenchResult>::const_iterator it = results.cbegin(); it != results.cend(); ++it)
+    {
+        Json::Value obj(Json::objectValue);
+        obj["name"] = Json::Value(it->name);
+        obj["run_name"] = Json::Value(it->name);
+        obj["run_type"] = Json::Value("iteration");
+        obj["iterations"] = Json::Value(static_cast<Json::UInt64>(it->iterations));
+        obj["real_time"] = Json::Value(it->realTime);
+        obj["cpu_time"] = Json::Value(it->cpuTime);
+        obj["time_unit"] = Json::Value("ns");
+        if (it->itemsPerSecond > 0)
+        {
+            obj["items_per_second"] = Json::Value(it->itemsPerSecond);
+        }
+        if (it->bytesPerSecond > 0)
+        {
+            obj["bytes_per_second"] = Json::Value(it->bytesPerSecond);
+        }
+        if (!it->label.empty())
+        {
+            obj["label"] = Json::Value(it->label);
+        }
+        benchmarksObj.append(obj);
+    }
+
+    Json::Value rootObj(Json::objectValue);
+    rootObj["context"] = contextObj;
+    rootObj["benchmarks"] = benchmarksObj;
+    Json::StyledWriter writer;
+    return writeFile(path, writer.write(rootObj));
+}
+
+bool runBenchmarks(const BenchRunOptions& options)
+{
+    std::regex filter;
+    try
+    {
+        filter = std::regex(options.filter.empty() ? std::string(".*") : options.filter);
+    }
+    catch (const std::regex_error&)
+    {
+        fprintf(stderr, "Invalid filter: %s\n", options.filter.c_str());
+        return false;
+    }
+
+    fprintf(stdout, "%-56s %17s %17s %12s\n", "Benchmark", "Time", "CPU", "Iterations");
+    std::vector<BenchResult> results;
+    const std::vector<std::pair<std::string, BenchFunction>>& benchmarks = getBenchmarks();
+    for (std::vector<std::pair<std::string, BenchFunction>>::const_iterator it = benchmarks.cbegin(); it != benchmarks.cend(); ++it)
+    {
+        if (!std::regex_search(it->first, filter))
+        {
+            continue;
+        }
+        BenchResult result;
+        if (runBenchmark(it->first, it->second, options.minTime, result))
+        {
+            printResult(result);
+            results.push_back(result);
+        }
+    }
+
+    if (!options.jsonFile.empty() && !writeResults(options.jsonFile, results))
+    {
+        fprintf(stderr, "Failed to write the results: %s\n", options.jsonFile.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,132 @@
+//
+//  Benchmark.h
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+
+#ifndef Benchmark_h
+#define Benchmark_h
+
+#include <cstdint>
+#include <string>
+#include <functional>
+#include <chrono>
+
+// Micro benchmarks in the way of Google Benchmark, without the dependency: a benchmark loops on keepRunning
+// and the runner picks the number of iterations which fill the minimum time. The JSON written by --json has
+// the fields of the one of Google Benchmark, so its compare.py reads it
+class BenchState
+{
+public:
+    explicit BenchState(uint64_t maxIterations);
+
+    bool keepRunning()
+    {
+        if (m_iterations < m_maxIterations)
+        {
+            if (0 == m_iterations++)
+            {
+                m_startTime = std::chrono::steady_clock::now();
+            }
+            return true;
+        }
+        m_elapsed += std::chrono::steady_clock::now() - m_startTime;
+        return false;
+    }
+
+    uint64_t getIterations() const
+    {
+        return m_iterations;
+    }
+
+    // Setup within the loop is left out of the time between them
+    void pauseTiming();
+    void resumeTiming();
+
+    // Per the whole run, e.g. getIterations() * messages of the corpus
+    void setItemsProcessed(uint64_t items)
+    {
+        m_items = items;
+    }
+    void setBytesProcessed(uint64_t bytes)
+    {
+        m_bytes = bytes;
+    }
+    void setLabel(const std::string& label)
+    {
+        m_label = label;
+    }
+    // The input isn't there, e.g. no backup is given, the benchmark returns without looping
+    void skip(const std::string& reason)
+    {
+        m_skipped = reason;
+    }
+
+    double getElapsedSeconds() const
+    {
+        return std::chrono::duration<double>(m_elapsed).count();
+    }
+    uint64_t getItems() const
+    {
+        return m_items;
+    }
+    uint64_t getBytes() const
+    {
+        return m_bytes;
+    }
+    const std::string& getLabel() const
+    {
+        return m_label;
+    }
+    const std::string& getSkipped() const
+    {
+        return m_skipped;
+    }
+
+private:
+    uint64_t m_maxIterations;
+    uint64_t m_iterations;
+    std::chrono::steady_clock::time_point m_startTime;
+    std::chrono::steady_clock::duration m_elapsed;
+    uint64_t m_items;
+    uint64_t m_bytes;
+    std::string m_label;
+    std::string m_skipped;
+};
+
+typedef std::function<void(BenchState&)> BenchFunction;
+
+// Benchmarks run in the order they are registered
+int registerBenchmark(const std::string& name, const BenchFunction& function);
+
+struct BenchRunOptions
+{
+    std::string filter;         // Regex of the names, all of them if empty
+    double minTime;             // Seconds of each benchmark
+    std::string jsonFile;
+
+    BenchRunOptions() : minTime(0.5)
+    {
+    }
+};
+
+// Prints a line per benchmark, false if the filter isn't a valid regex or the JSON can't be written
+bool runBenchmarks(const BenchRunOptions& options);
+
+// Keeps the compiler from dropping the computation of value
+template<class T>
+inline void doNotOptimize(const T& value)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    asm volatile("" : : "r,m"(value) : "memory");
+#else
+    static volatile const void* sink;
+    sink = &value;
+#endif
+}
+
+#define BENCHMARK(function) static int function##_registered = registerBenchmark(#function, function)
+
+#endif /* Benchmark_h */
@@ -0,0 +1,847 @@
+//
+//  main.cpp
+//  WechatExporter
+//
+//  Created by Matthew on 2021/8/15.
+//  Copyright © 2021 Matthew. All rights reserved.
+//
+//  Micro benchmarks of the pieces of the message path, over the messages of a corpus: a message database
+//  (MM.sqlite or message_N.sqlite) taken from a backup, or built-in samples of each type without one:
+//  microbench [--corpus <db>] [--backup <dir>] [--silk <file>] [--res <dir>] [--filter <regex>] [--json <file>]
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <map>
+#include <random>
+#include <algorithm>
+#include <sqlite3.h>
+#include <json/json.h>
+#include "../../WechatExporter/core/Exporter.h"
+#include "../../WechatExporter/core/ITunesParser.h"
+#include "../../WechatExporter/core/MessageParser.h"
+#include "../../WechatExporter/core/TaskManager.h"
+#include "../../WechatExporter/core/XmlParser.h"
+#include "../../WechatExporter/core/CompiledTemplate.h"
+#include "../../WechatExporter/core/RawMessage.h"
+#include "../../WechatExporter/core/ProtobufFields.h"
+#include "../../WechatExporter/core/MessageStore.h"
+#include "../../WechatExporter/core/ExportContext.h"
+#include "../../WechatExporter/core/Utils.h"
+#include "../../WechatExporter/core/FileSystem.h"
+#include "Benchmark.h"
+
+#define WECHAT_DOMAIN               "AppDomain-com.tencent.xin"
+#define CORPUS_MAX_MESSAGES_PER_TYPE 2000
+
+struct CorpusMessage
+{
+    int type;
+    int des;
+    std::string content;
+};
+
+struct MicrobenchOptions
+{
+    std::string corpus;
+    std::string backup;
+    std::string silkFile;
+    std::string workDir;        // Where the res directory is
+    std::string tempDir;        // Files written by the benchmarks of MessageStore and the audio
+    BenchRunOptions runOptions;
+
+    MicrobenchOptions() : workDir("."), tempDir(".")
+    {
+    }
+};
+
+class NullLogger : public Logger
+{
+public:
+    void write(const std::string& log)
+    {
+    }
+    void debug(const std::string& log)
+    {
+    }
+};
+
+static MicrobenchOptions g_options;
+static std::map<int, std::vector<CorpusMessage>> g_corpus;     // type => messages
+static NullLogger g_logger;
+
+// Rows of all the Chat_ tables, up to maxPerType messages of each type
+static bool loadCorpus(const std::string& path, size_t maxPerType)
+{
+    sqlite3* db = NULL;
+    if (openSqlite3ReadOnly(path, &db) != SQLITE_OK)
+    {
+        sqlite3_close(db);
+        return false;
+    }
+    std::vector<std::string> tables;
+    sqlite3_stmt* stmt = NULL;
+    if (sqlite3_prepare_v2(db, "SELECT name FROM sqlite_master WHERE type='table' AND name LIKE 'Chat\\_%' ESCAPE '\\'", -1, &stmt, NULL) == SQLITE_OK)
+    {
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            tables.push_back(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)));
+        }
+        sqlite3_finalize(stmt);
+    }
+    for (std::vector<std::string>::const_iterator it = tables.cbegin(); it != tables.cend(); ++it)
+    {
+        std::string sql = "SELECT Type,Des,Message FROM " + *it;
+        if (sqlite3_prepare_v2(db, sql.c_str(), (int)(sql.size()), &stmt, NULL) != SQLITE_OK)
+        {
+            continue;
+        }
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            CorpusMessage msg;
+            msg.type = sqlite3_column_int(stmt, 0);
+            msg.des = sqlite3_column_int(stmt, 1);
+            const char* content = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2));
+            std::vector<CorpusMessage>& messages = g_corpus[msg.type];
+            if (NULL == content || messages.size() >= maxPerType)
+            {
+                continue;
+            }
+            msg.content = content;
+            messages.push_back(msg);
+        }
+        sqlite3_finalize(stmt);
+    }
+    sqlite3_close(db);
+    return !g_corpus.empty();
+}
+
+// Shapes of the common types, for the runs without a recorded corpus
+static void loadDefaultCorpus()
+{
+    const CorpusMessage messages[] = {
+        { MessageParser::MSGTYPE_TEXT, 0, "OK, see you tomorrow at 10 [Smile]" },
+        { MessageParser::MSGTYPE_TEXT, 1, "wxid_sender01:\n\xE6\x98\x8E\xE5\xA4\xA9\xE8\xA7\x81 https://example.com/a?b=1&c=<2> [\xE5\xBE\xAE\xE7\xAC\x91]\nsecond line" },
+        { MessageParser::MSGTYPE_IMAGE, 1, "wxid_sender01:\n<?xml version=\"1.0\"?><msg><img aeskey=\"0123456789abcdef\" encryver=\"1\" cdnthumbaeskey=\"0123456789abcdef\" cdnthumburl=\"3057020100044b30490201\" cdnthumblength=\"3401\" cdnthumbheight=\"120\" cdnthumbwidth=\"90\" length=\"58213\" hdlength=\"0\" md5=\"d41d8cd98f00b204e9800998ecf8427e\" /></msg>" },
+        { MessageParser::MSGTYPE_VOICE, 0, "<msg><voicemsg endflag=\"1\" cancelflag=\"0\" forwardflag=\"0\" voiceformat=\"4\" voicelength=\"5320\" length=\"8362\" bufid=\"0\" clientmsgid=\"41\" fromusername=\"wxid_bench\" /></msg>" },
+        { MessageParser::MSGTYPE_EMOTICON, 1, "wxid_sender01:\n<msg><emoji fromusername=\"wxid_sender01\" tousername=\"20000000001@chatroom\" type=\"2\" md5=\"0123456789abcdef0123456789abcdef\" len=\"31744\" productid=\"\" androidmd5=\"0123456789abcdef0123456789abcdef\" cdnurl=\"http://127.0.0.1:9/emoji/0123456789abcdef/0\" thumburl=\"\" width=\"240\" height=\"240\"></emoji></msg>" },
+        { MessageParser::MSGTYPE_APP, 0, "<?xml version=\"1.0\"?><msg><appmsg appid=\"\" sdkver=\"0\"><title>An article &amp; its title</title><des>The description of the article, which is a bit longer than the title</des><type>5</type><url>http://mp.weixin.qq.com/s?__biz=MzA&amp;mid=2650&amp;idx=1&amp;sn=abc#rd</url><thumburl>http://127.0.0.1:9/thumb/1</thumburl><sourcedisplayname>Account</sourcedisplayname></appmsg><fromusername>wxid_bench</fromusername></msg>" },
+        { MessageParser::MSGTYPE_APP, 1, "wxid_sender01:\n<msg><appmsg appid=\"\" sdkver=\"0\"><title>Reply to it</title><type>57</type><refermsg><type>1</type><svrid>123456789</svrid><fromusr>20000000001@chatroom</fromusr><chatusr>wxid_sender02</chatusr><displayname>Friend 2</displayname><content>The quoted text</content></refermsg></appmsg></msg>" },
+        { MessageParser::MSGTYPE_LOCATION, 0, "<msg><location x=\"39.908722\" y=\"116.397499\" scale=\"16\" label=\"Beijing\" poiname=\"Tiananmen\" maptype=\"roadmap\" /></msg>" },
+        { MessageParser::MSGTYPE_SYS, 0, "\"Friend 1\" joined the group chat" },
+    };
+    for (size_t idx = 0; idx < sizeof(messages) / sizeof(messages[0]); ++idx)
+    {
+        g_corpus[messages[idx].type].push_back(messages[idx]);
+    }
+}
+
+static std::string stripSender(const CorpusMessage& msg)
+{
+    std::string::size_type pos = msg.content.find(":\n");
+    if (msg.des != 0 && pos != std::string::npos && msg.content.find('<') > pos)
+    {
+        return msg.content.substr(pos + 2);
+    }
+    return msg.content;
+}
+
+static const std::vector<CorpusMessage>* getMessages(int type)
+{
+    std::map<int, std::vector<CorpusMessage>>::const_iterator it = g_corpus.find(type);
+    return (it == g_corpus.cend() || it->second.empty()) ? NULL : &(it->second);
+}
+
+// Everything MessageParser needs, without a backup the files of the media are not found and nothing is copied
+class ParserContext
+{
+public:
+    ParserContext() : m_iTunesDb(g_options.backup, "Manifest.db"), m_iTunesDbShare(g_options.backup, "Manifest.db"), m_taskManager(&g_logger, 1), m_session(&m_myself), m_chatroom(&m_myself), m_parser(NULL)
+    {
+        if (!g_options.backup.empty())
+        {
+            m_iTunesDb.load(WECHAT_DOMAIN);
+        }
+        // The downloads of emojis and thumbnails are held and dropped at the end
+        m_taskManager.setDeferringMedia(true);
+        m_myself.setUsrName("wxid_bench");
+        m_myself.setDisplayName("Bench");
+        m_session.setUsrName("wxid_sender01");
+        m_session.setDisplayName("Friend 1");
+        m_chatroom.setUsrName("20000000001@chatroom");
+        m_chatroom.setDisplayName("Chatroom 1");
+        m_outputPath = combinePath(g_options.tempDir, "microbench_output");
+        m_parser = new MessageParser(m_iTunesDb, m_iTunesDbShare, m_taskManager, m_friends, m_myself, 0, g_options.workDir, m_outputPath, m_localeStrings);
+    }
+
+    ~ParserContext()
+    {
+        delete m_parser;
+        m_taskManager.cancel();
+        m_taskManager.shutdown();
+        deleteDirectory(m_outputPath);
+    }
+
+    bool parse(const CorpusMessage& corpusMessage, int64_t msgId, TemplateValuesList& tvs) const
+    {
+        WXMSG msg;
+        msg.createTime = 1577836800 + static_cast<int>(msgId);
+        msg.content = corpusMessage.content;
+        msg.des = corpusMessage.des;
+        msg.type = corpusMessage.type;
+        msg.msgIdValue = msgId;
+        msg.msgId = std::to_string(msgId);
+        tvs.clear();
+        // A sender in front of the content is of a chatroom
+        bool inChatroom = corpusMessage.des != 0 && corpusMessage.content.find(":\n") != std::string::npos && stripSender(corpusMessage) != corpusMessage.content;
+        return m_parser->parse(msg, inChatroom ? m_chatroom : m_session, tvs);
+    }
+
+private:
+    ParserContext(const ParserContext&);
+    ParserContext& operator=(const ParserContext&);
+
+    ITunesDb m_iTunesDb;
+    ITunesDb m_iTunesDbShare;
+    TaskManager m_taskManager;
+    Friends m_friends;
+    Friend m_myself;
+    Session m_session;
+    Session m_chatroom;
+    LocaleStrings m_localeStrings;
+    std::string m_outputPath;
+    MessageParser* m_parser;
+};
+
+static void benchFindITunesFile(BenchState& state, bool hit)
+{
+    if (g_options.backup.empty())
+    {
+        state.skip("no --backup");
+        return;
+    }
+    ITunesDb iTunesDb(g_options.backup, "Manifest.db");
+    if (!iTunesDb.load(WECHAT_DOMAIN))
+    {
+        state.skip("failed to load the manifest");
+        return;
+    }
+    std::vector<std::string> paths;
+    iTunesDb.enumFiles([&paths, hit](const ITunesFile* file) {
+        paths.push_back(hit ? std::string(file->relativePath, file->relativePathLength) : (std::string(file->relativePath, file->relativePathLength) + ".none"));
+        return true;
+    });
+    if (paths.empty())
+    {
+        state.skip("no file in the manifest");
+        return;
+    }
+    // Not in the order of the manifest, as the lookups of the messages are
+    std::shuffle(paths.begin(), paths.end(), std::mt19937(1));
+    size_t idx = 0;
+    while (state.keepRunning())
+    {
+        doNotOptimize(iTunesDb.findITunesFile(paths[idx]));
+        if (++idx == paths.size())
+        {
+            idx = 0;
+        }
+    }
+    state.setItemsProcessed(state.getIterations());
+    state.setLabel(std::to_string(paths.size()) + " files");
+}
+
+static void benchParse(BenchState& state, int type)
+{
+    const std::vector<CorpusMessage>* messages = getMessages(type);
+    if (NULL == messages)
+    {
+        state.skip("no message of the type");
+        return;
+    }
+    ParserContext context;
+    TemplateValuesList tvs;
+    size_t idx = 0;
+    uint64_t bytes = 0;
+    int64_t msgId = 1;
+    while (state.keepRunning())
+    {
+        const CorpusMessage& msg = (*messages)[idx];
+        doNotOptimize(context.parse(msg, msgId++, tvs));
+        bytes += msg.content.size();
+        if (++idx == messages->size())
+        {
+            idx = 0;
+        }
+    }
+    state.setItemsProcessed(state.getIterations());
+    state.setBytesProcessed(bytes);
+}
+
+// The xml messages of all the types, without the senders of the chatrooms
+static std::vector<std::string> collectXml()
+{
+    std::vector<std::string> xmls;
+    for (std::map<int, std::vector<CorpusMessage>>::const_iterator it = g_corpus.cbegin(); it != g_corpus.cend(); ++it)
+    {
+        for (std::vector<CorpusMessage>::const_iterator itMsg = it->second.cbegin(); itMsg != it->second.cend(); ++itMsg)
+        {
+            std::string content = stripSender(*itMsg);
+            if (startsWith(content, "<"))
+            {
+                xmls.push_back(content);
+            }
+        }
+    }
+    return xmls;
+}
+
+static void benchXmlParserConstruct(BenchState& state)
+{
+    std::vector<std::string> xmls = collectXml();
+    if (xmls.empty())
+    {
+        state.skip("no xml message");
+        return;
+    }
+    size_t idx = 0;
+    uint64_t bytes = 0;
+    while (state.keepRunning())
+    {
+        XmlParser xmlParser(xmls[idx], true);
+        doNotOptimize(xmlParser);
+        bytes += xmls[idx].size();
+        if (++idx == xmls.size())
+        {
+            idx = 0;
+        }
+    }
+    state.setItemsProcessed(state.getIterations());
+    state.setBytesProcessed(bytes);
+}
+
+// The xpaths of the app messages, on documents parsed ahead
+static void benchXmlParserXPath(BenchState& state)
+{
+    const std::vector<CorpusMessage>* messages = getMessages(MessageParser::MSGTYPE_APP);
+    if (NULL == messages)
+    {
+        state.skip("no app message");
+        return;
+    }
+    std::vector<XmlParser *> parsers;
+    for (std::vector<CorpusMessage>::const_iterator it = messages->cbegin(); it != messages->cend(); ++it)
+    {
+        parsers.push_back(new XmlParser(stripSender(*it), true));
+    }
+    size_t idx = 0;
+    std::string value;
+    while (state.keepRunning())
+    {
+        const XmlParser* xmlParser = parsers[idx];
+        doNotOptimize(xmlParser->parseNodeValue("/msg/appmsg/type", value));
+        doNotOptimize(xmlParser->parseNodeValue("/msg/appmsg/title", value));
+        doNotOptimize(xmlParser->parseNodeValue("/msg/appmsg/url", value));
+        doNotOptimize(xmlParser->parseAttributeValue("/msg/appmsg", "appid", value));
+        if (++idx == parsers.size())
+        {
+            idx = 0;
+        }
+    }
+    state.setItemsProcessed(state.getIterations() * 4);
+    for (std::vector<XmlParser *>::iterator it = parsers.begin(); it != parsers.end(); ++it)
+    {
+        delete *it;
+    }
+}
+
+// What Exporter::buildContentFromTemplateValues does for each message, with the values of the parsed corpus
+static void benchRenderTemplates(BenchState& state)
+{
+    std::map<std::string, CompiledTemplate> templates;
+    const char* names[] = {"msg", "video", "notice", "system", "audio", "image", "card", "emoji", "plainshare", "share", "thumb", "refermsg", "channels"};
+    for (size_t idx = 0; idx < sizeof(names) / sizeof(names[0]); ++idx)
+    {
+        std::string text = readFile(combinePath(g_options.workDir, "res", "templates", std::string(names[idx]) + ".html"));
+        if (!text.empty())
+        {
+            templates[names[idx]].compile(text);
+        }
+    }
+    if (templates.empty())
+    {
+        state.skip("no templates in --res");
+        return;
+    }
+
+    std::vector<TemplateValues> values;
+    {
+        ParserContext context;
+        TemplateValuesList tvs;
+        int64_t msgId = 1;
+        for (std::map<int, std::vector<CorpusMessage>>::const_iterator it = g_corpus.cbegin(); it != g_corpus.cend(); ++it)
+        {
+            for (std::vector<CorpusMessage>::const_iterator itMsg = it->second.cbegin(); itMsg != it->second.cend(); ++itMsg)
+            {
+                context.parse(*itMsg, msgId++, tvs);
+                for (TemplateValuesList::const_iterator itTv = tvs.cbegin(); itTv != tvs.cend(); ++itTv)
+                {
+                    if (templates.find(itTv->getName()) != templates.cend())
+                    {
+                        values.push_back(*itTv);
+                    }
+                }
+            }
+        }
+    }
+    if (values.empty())
+    {
+        state.skip("no template of the messages");
+        return;
+    }
+
+    std::string content;
+    size_t idx = 0;
+    uint64_t bytes = 0;
+    while (state.keepRunning())
+    {
+        content.clear();
+        templates.find(values[idx].getName())->second.render(values[idx], content);
+        bytes += content.size();
+        if (++idx == values.size())
+        {
+            idx = 0;
+        }
+    }
+    state.setItemsProcessed(state.getIterations());
+    state.setBytesProcessed(bytes);
+}
+
+static std::vector<std::string> collectTexts()
+{
+    std::vector<std::string> texts;
+    const std::vector<CorpusMessage>* messages = getMessages(MessageParser::MSGTYPE_TEXT);
+    if (NULL != messages)
+    {
+        for (std::vector<CorpusMessage>::const_iterator it = messages->cbegin(); it != messages->cend(); ++it)
+        {
+            texts.push_back(it->content);
+        }
+    }
+    return texts;
+}
+
+static void benchSafeHTML(BenchState& state)
+{
+    std::vector<std::string> texts = collectTexts();
+    if (texts.empty())
+    {
+        state.skip("no text message");
+        return;
+    }
+    size_t idx = 0;
+    uint64_t bytes = 0;
+    while (state.keepRunning())
+    {
+        doNotOptimize(safeHTML(texts[idx]));
+        bytes += texts[idx].size();
+        if (++idx == texts.size())
+        {
+            idx = 0;
+        }
+    }
+    state.setItemsProcessed(state.getIterations());
+    state.setBytesProcessed(bytes);
+}
+
+static void benchEncodeUrl(BenchState& state)
+{
+    // The urls of the links, emojis and thumbnails of the corpus
+    std::vector<std::string> urls;
+    std::vector<std::string> xmls = collectXml();
+    for (std::vector<std::string>::const_iterator it = xmls.cbegin(); it != xmls.cend(); ++it)
+    {
+        XmlParser xmlParser(*it, true);
+        std::string url;
+        if (xmlParser.parseNodeValue("/msg/appmsg/url", url) && !url.empty())
+        {
+            urls.push_back(url);
+        }
+        if (xmlParser.parseAttributeValue("/msg/emoji", "cdnurl", url) && !url.empty())
+        {
+            urls.push_back(url);
+        }
+    }
+    if (urls.empty())
+    {
+        state.skip("no url in the messages");
+        return;
+    }
+    size_t idx = 0;
+    uint64_t bytes = 0;
+    while (state.keepRunning())
+    {
+        doNotOptimize(encodeUrl(urls[idx]));
+        bytes += urls[idx].size();
+        if (++idx == urls.size())
+        {
+            idx = 0;
+        }
+    }
+    state.setItemsProcessed(state.getIterations());
+    state.setBytesProcessed(bytes);
+}
+
+static void benchReplaceAll(BenchState& state)
+{
+    std::vector<std::string> texts = collectTexts();
+    if (texts.empty())
+    {
+        state.skip("no text message");
+        return;
+    }
+    std::vector<std::pair<std::string, std::string>> pairs;
+    pairs.push_back(std::make_pair("\r\n", "<br />"));
+    pairs.push_back(std::make_pair("\n", "<br />"));
+    pairs.push_back(std::make_pair("\t", "&nbsp;&nbsp;&nbsp;&nbsp;"));
+    size_t idx = 0;
+    uint64_t bytes = 0;
+    while (state.keepRunning())
+    {
+        const std::string& text = texts[idx];
+        doNotOptimize(replaceAll(text, pairs));
+        bytes += texts[idx].size();
+        if (++idx == texts.size())
+        {
+            idx = 0;
+        }
+    }
+    state.setItemsProcessed(state.getIterations());
+    state.setBytesProcessed(bytes);
+}
+
+// Blobs in the shape of dbContactHeadImage and dbContactRemark: a few strings, one of them nested
+static std::vector<std::string> buildProtobufBlobs()
+{
+    std::vector<std::string> blobs;
+    for (int idx = 0; idx < 64; ++idx)
+    {
+        std::string nested;
+        std::string name = "Friend " + std::to_string(idx);
+        nested.push_back(static_cast<char>((1 << 3) | 2));
+        nested.push_back(static_cast<char>(name.size()));
+        nested += name;
+
+        std::string blob;
+        blob.push_back(static_cast<char>((1 << 3) | 0));
+        blob.push_back(static_cast<char>(idx & 0x7F));
+        std::string urls[] = { "http://wx.qlogo.cn/mmhead/ver_1/" + md5(name) + "/132", "http://wx.qlogo.cn/mmhead/ver_1/" + md5(name) + "/0" };
+        for (int field = 0; field < 2; ++field)
+        {
+            blob.push_back(static_cast<char>(((field + 2) << 3) | 2));
+            blob.push_back(static_cast<char>(urls[field].size()));
+            blob += urls[field];
+        }
+        blob.push_back(static_cast<char>((4 << 3) | 2));
+        blob.push_back(static_cast<char>(nested.size()));
+        blob += nested;
+        blobs.push_back(blob);
+    }
+    return blobs;
+}
+
+static void benchRawMessageParse(BenchState& state)
+{
+    std::vector<std::string> blobs = buildProtobufBlobs();
+    size_t idx = 0;
+    std::string value;
+    while (state.keepRunning())
+    {
+        RawMessage msg;
+        msg.merge(blobs[idx].c_str(), static_cast<int>(blobs[idx].size()));
+        doNotOptimize(msg.parse("2", value));
+        doNotOptimize(msg.parse("3", value));
+        doNotOptimize(msg.parse("4.1", value));
+        if (++idx == blobs.size())
+        {
+            idx = 0;
+        }
+    }
+    state.setItemsProcessed(state.getIterations());
+}
+
+static void benchProtobufFieldsRead(BenchState& state)
+{
+    std::vector<std::string> blobs = buildProtobufBlobs();
+    ProtobufFieldPaths paths({"2", "3", "4.1"});
+    size_t idx = 0;
+    std::string value;
+    while (state.keepRunning())
+    {
+        ProtobufFields fields(paths);
+        fields.read(blobs[idx].c_str(), blobs[idx].size());
+        doNotOptimize(fields.parse("2", value));
+        doNotOptimize(fields.parse("3", value));
+        doNotOptimize(fields.parse("4.1", value));
+        if (++idx == blobs.size())
+        {
+            idx = 0;
+        }
+    }
+    state.setItemsProcessed(state.getIterations());
+}
+
+static void benchSilkToPcm(BenchState& state)
+{
+    if (g_options.silkFile.empty())
+    {
+        state.skip("no --silk");
+        return;
+    }
+    std::vector<unsigned char> pcm;
+    uint64_t bytes = 0;
+    while (state.keepRunning())
+    {
+        pcm.clear();
+        if (!silkToPcm(g_options.silkFile, pcm))
+        {
+            state.skip("failed to decode the silk");
+            return;
+        }
+        bytes += pcm.size();
+    }
+    state.setItemsProcessed(state.getIterations());
+    state.setBytesProcessed(bytes);
+}
+
+static void benchPcmToMp3(BenchState& state)
+{
+    std::vector<unsigned char> pcm;
+    if (g_options.silkFile.empty() || !silkToPcm(g_options.silkFile, pcm))
+    {
+        state.skip("no --silk");
+        return;
+    }
+    std::string mp3Path = combinePath(g_options.tempDir, "microbench.mp3");
+    while (state.keepRunning())
+    {
+        pcmToMp3(pcm, mp3Path);
+    }
+    deleteFile(mp3Path);
+    state.setItemsProcessed(state.getIterations());
+    state.setBytesProcessed(state.getIterations() * pcm.size());
+}
+
+// The rendered messages of a session written to and read back from the .dat of the incremental exporting
+static std::vector<std::string> buildRenderedMessages()
+{
+    std::vector<std::string> messages;
+    std::vector<std::string> texts = collectTexts();
+    for (size_t idx = 0; idx < 1000 && !texts.empty(); ++idx)
+    {
+        messages.push_back("<div class=\"msg left\" id=\"msg" + std::to_string(idx) + "\"><div class=\"nickname\">Friend 1</div><div class=\"content\">" + safeHTML(texts[idx % texts.size()]) + "</div></div>");
+    }
+    return messages;
+}
+
+static void benchMessageStoreWrite(BenchState& state)
+{
+    std::vector<std::string> messages = buildRenderedMessages();
+    if (messages.empty())
+    {
+        state.skip("no text message");
+        return;
+    }
+    std::string path = combinePath(g_options.tempDir, "microbench.dat");
+    uint64_t bytes = 0;
+    while (state.keepRunning())
+    {
+        MessageStoreWriter writer;
+        writer.open(path);
+        for (std::vector<std::string>::const_iterator it = messages.cbegin(); it != messages.cend(); ++it)
+        {
+            writer.add(it->c_str(), it->size());
+            bytes += it->size();
+        }
+        writer.close();
+    }
+    deleteFile(path);
+    state.setItemsProcessed(state.getIterations() * messages.size());
+    state.setBytesProcessed(bytes);
+}
+
+static void benchMessageStoreRead(BenchState& state)
+{
+    std::vector<std::string> messages = buildRenderedMessages();
+    std::string path = combinePath(g_options.tempDir, "microbench.dat");
+    MessageStoreWriter writer;
+    if (messages.empty() || !writer.open(path))
+    {
+        state.skip("no text message");
+        return;
+    }
+    for (std::vector<std::string>::const_iterator it = messages.cbegin(); it != messages.cend(); ++it)
+    {
+        writer.add(it->c_str(), it->size());
+    }
+    writer.close();
+
+    uint64_t bytes = 0;
+    while (state.keepRunning())
+    {
+        MessageStoreReader reader;
+        reader.open(path);
+        for (size_t segment = 0; segment < reader.getNumberOfSegments(); ++segment)
+        {
+            for (size_t idx = 0; idx < reader.getNumberOfMessages(segment); ++idx)
+            {
+                const char* message = NULL;
+                size_t length = 0;
+                if (reader.getMessage(segment, idx, message, length))
+                {
+                    doNotOptimize(message);
+                    bytes += length;
+                }
+            }
+        }
+    }
+    deleteFile(path);
+    state.setItemsProcessed(state.getIterations() * messages.size());
+    state.setBytesProcessed(bytes);
+}
+
+// The context of an exporting of 1000 sessions, saved at each checkpoint and read by the next exporting
+static void benchExportContext(BenchState& state)
+{
+    ExportContext context;
+    context.setOptions(SPO_INCREMENTAL_EXP);
+    context.refreshExportTime();
+    for (int idx = 0; idx < 1000; ++idx)
+    {
+        context.setMaxId("wxid_gen1_" + std::to_string(idx), 100000 + idx);
+    }
+    uint64_t bytes = 0;
+    while (state.keepRunning())
+    {
+        std::string data = context.serialize();
+        ExportContext loaded;
+        doNotOptimize(loaded.unserialize(data));
+        bytes += data.size();
+    }
+    state.setItemsProcessed(state.getIterations() * context.getNumberOfSessions());
+    state.setBytesProcessed(bytes);
+}
+
+static void benchFindITunesFileHit(BenchState& state)
+{
+    benchFindITunesFile(state, true);
+}
+
+static void benchFindITunesFileMiss(BenchState& state)
+{
+    benchFindITunesFile(state, false);
+}
+
+BENCHMARK(benchFindITunesFileHit);
+BENCHMARK(benchFindITunesFileMiss);
+BENCHMARK(benchXmlParserConstruct);
+BENCHMARK(benchXmlParserXPath);
+BENCHMARK(benchRenderTemplates);
+BENCHMARK(benchSafeHTML);
+BENCHMARK(benchEncodeUrl);
+BENCHMARK(benchReplaceAll);
+BENCHMARK(benchRawMessageParse);
+BENCHMARK(benchProtobufFieldsRead);
+BENCHMARK(benchSilkToPcm);
+BENCHMARK(benchPcmToMp3);
+BENCHMARK(benchMessageStoreWrite);
+BENCHMARK(benchMessageStoreRead);
+BENCHMARK(benchExportContext);
+
+static void printUsage(const char* name)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --corpus <db>           MM.sqlite or message_N.sqlite of a backup, built-in samples without it\n"
+            "  --backup <dir>          Backup of the benchmarks of ITunesDb (and the media of the parser)\n"
+            "  --silk <file>           Voice of the benchmarks of the audio\n"
+            "  --res <dir>             Directory containing res/ with the templates (default: .)\n"
+            "  --temp <dir>            Files written by the benchmarks (default: .)\n"
+            "  --filter <regex>        Benchmarks of the matching names\n"
+            "  --min-time <seconds>    Time of each benchmark (default: 0.5)\n"
+            "  --json <file>           Writes the results in the JSON of Google Benchmark\n",
+            name);
+}
+
+static bool parseCommandLine(int argc, char* argv[], MicrobenchOptions& options)
+{
+    for (int idx = 1; idx < argc; ++idx)
+    {
+        std::string arg = argv[idx];
+        const char* value = (idx + 1 < argc) ? argv[idx + 1] : NULL;
+        if (arg == "--help" || arg == "-h" || NULL == value)
+        {
+            return false;
+        }
+        ++idx;
+
+        if (arg == "--corpus") options.corpus = value;
+        else if (arg == "--backup") options.backup = value;
+        else if (arg == "--silk") options.silkFile = value;
+        else if (arg == "--res") options.workDir = value;
+        else if (arg == "--temp") options.tempDir = value;
+        else if (arg == "--filter") options.runOptions.filter = value;
+        else if (arg == "--json") options.runOptions.jsonFile = value;
+        else if (arg == "--min-time")
+        {
+            char* end = NULL;
+            options.runOptions.minTime = std::strtod(value, &end);
+            if (NULL == end || *end != '\0' || options.runOptions.minTime <= 0)
+            {
+                fprintf(stderr, "Invalid value of %s: %s\n", arg.c_str(), value);
+                return false;
+            }
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option: %s\n", arg.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    if (!parseCommandLine(argc, argv, g_options))
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+    if (!g_options.corpus.empty())
+    {
+        if (!loadCorpus(g_options.corpus, CORPUS_MAX_MESSAGES_PER_TYPE))
+        {
+            fprintf(stderr, "No message in the corpus: %s\n", g_options.corpus.c_str());
+            return 1;
+        }
+    }
+    else
+    {
+        loadDefaultCorpus();
+    }
+
+    // MessageParser::parse of each type in the corpus
+    for (std::map<int, std::vector<CorpusMessage>>::const_iterator it = g_corpus.cbegin(); it != g_corpus.cend(); ++it)
+    {
+        int type = it->first;
+        registerBenchmark("benchParse/" + std::to_string(type), [type](BenchState& state) { benchParse(state, type); });
+    }
+
+    Exporter::initializeExporter();
+    bool succeeded = runBenchmarks(g_options.runOptions);
+    Exporter::uninitializeExporter();
+    return succeeded ? 0 : 2;
+}
@@ -152,6 +152,24 @@ CString AppConfiguration::GetDefaultBackupDir(BOOL bCheckExistence/* = TRUE*/)
 	return backupDir;
 }
 
+CString AppConfiguration::GetBackupCacheFile()
+{
+	CString cacheFile;
+	TCHAR szPath[MAX_PATH] = { 0 };
+	HRESULT hr = SHGetFolderPath(NULL, CSIDL_LOCAL_APPDATA, NULL, SHGFP_TYPE_CURRENT, szPath);
+	if (SUCCEEDED(hr))
+	{
+		_tcscat(szPath, TEXT("\\WechatExporter"));
+		if (::CreateDirectory(szPath, NULL) || ::GetLastError() == ERROR_ALREADY_EXISTS)
+		{
+			cacheFile = szPath;
+			cacheFile += TEXT("\\backups.dat");
+		}
+	}
+
+	return cacheFile;
+}
+
 DWORD AppConfiguration::GetLastCheckUpdateTime()
 {
 	DWORD dwValue = 0;
@@ -26,6 +26,7 @@ public:
 	static void SetLastBackupDir(LPCTSTR szBackupDir);
 	static CString GetLastBackupDir();
 	static CString GetDefaultBackupDir(BOOL bCheckExistence = TRUE);
+	static CString GetBackupCacheFile();
 
 	static DWORD GetLastCheckUpdateTime();
 	static void SetLastCheckUpdateTime(DWORD lastCheckUpdateTime = 0);
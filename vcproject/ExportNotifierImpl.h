@@ -88,3 +88,42 @@ public:
 	}
 };
 
+// The data of the messages are copies for the view, it deletes them
+class LoadingNotifierImpl : public LoadingNotifier
+{
+protected:
+	HWND m_hWnd;
+
+public:
+	static const UINT WM_USERS_LOADED = ExportNotifierImpl::WM_EN_END + 1;
+	static const UINT WM_SESSIONS_LOADED = ExportNotifierImpl::WM_EN_END + 2;
+	static const UINT WM_LN_END = WM_SESSIONS_LOADED;
+
+public:
+	LoadingNotifierImpl(HWND hWnd) : m_hWnd(hWnd)
+	{
+	}
+
+	~LoadingNotifierImpl()
+	{
+		m_hWnd = NULL;
+	}
+
+	void onUsersLoaded(const std::vector<Friend>& users) const
+	{
+		std::vector<Friend> *data = new std::vector<Friend>(users);
+		if (!::PostMessage(m_hWnd, WM_USERS_LOADED, 0, reinterpret_cast<LPARAM>(data)))
+		{
+			delete data;
+		}
+	}
+
+	void onSessionsLoaded(size_t userIndex, const std::vector<Session>& sessions, int stage) const
+	{
+		std::vector<Session> *data = new std::vector<Session>(sessions);
+		if (!::PostMessage(m_hWnd, WM_SESSIONS_LOADED, (WPARAM)userIndex, reinterpret_cast<LPARAM>(data)))
+		{
+			delete data;
+		}
+	}
+};
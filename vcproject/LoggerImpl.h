@@ -26,26 +26,48 @@ public:
 		::SendMessage(m_hWndLog, LB_SETTOPINDEX, count - 1, 0L);
 	}
 
-	void write(const std::string& log)
+	std::string getTimeString() const
 	{
-		CW2T pszT(CA2W(log.c_str(), CP_UTF8));
-		
 #if !defined(NDEBUG) || defined(DBG_PERF)
-		std::string timeString = getTimestampString(false, true) + ": ";
+		return getTimestampString(false, true) + ": ";
 #else
-		std::string timeString = getTimestampString() + ": ";
+		return getTimestampString() + ": ";
 #endif
+	}
+
+	void formatLog(const std::string& timeString, const std::string& log, std::vector<TCHAR>& szLog)
+	{
+		CW2T pszT(CA2W(log.c_str(), CP_UTF8));
 		CA2T szTime(timeString.c_str());
 
-		std::vector<TCHAR> szLog;
 		szLog.resize(_tcslen(pszT) + _tcslen(szTime) + 1, 0);
 
 		_tcscpy(&szLog[0], (LPCTSTR)szTime);
 		_tcscat(&szLog[0], (LPCTSTR)pszT);
+	}
+
+	void write(const std::string& log)
+	{
+		std::vector<TCHAR> szLog;
+		formatLog(getTimeString(), log, szLog);
 		
 		outputLog(&szLog[0]);
 	}
 
+	// The list box is scrolled once per batch
+	void writeLines(const std::vector<std::string>& logs)
+	{
+		std::string timeString = getTimeString();
+		std::vector<TCHAR> szLog;
+		for (std::vector<std::string>::const_iterator it = logs.cbegin(); it != logs.cend(); ++it)
+		{
+			formatLog(timeString, *it, szLog);
+			::SendMessage(m_hWndLog, LB_ADDSTRING, 0, (LPARAM)&szLog[0]);
+		}
+		LRESULT count = ::SendMessage(m_hWndLog, LB_GETCOUNT, 0, 0L);
+		::SendMessage(m_hWndLog, LB_SETTOPINDEX, count - 1, 0L);
+	}
+
 	void debug(const std::string& log)
 	{
 // #if !defined(NDEBUG) || defined(DBG_PERF)
@@ -58,7 +58,9 @@ private:
 	{
 	protected:
 		HWND m_hWnd;
+		std::string m_backupDir;
 		std::future<bool> m_task;
+		LoadingNotifierImpl m_loadingNotifier;
 		Exporter m_exp;
 		CWaitCursor m_waitCursor;
 
@@ -70,13 +72,18 @@ private:
 			}
 
 			bool ret = m_exp.loadUsersAndSessions();
+			if (ret)
+			{
+				Exporter::prewarmITunes(m_backupDir);
+			}
 			::PostMessage(m_hWnd, WM_LOADDATA, (ret ? 1 : 0), reinterpret_cast<LPARAM>(this));
 			return ret;
 		}
 	public:
 
-		CLoadingHandler(HWND hWnd, const std::string& resDir, const std::string& backupDir, Logger* logger) : m_hWnd(hWnd), m_exp(resDir, backupDir, "", logger, NULL)
+		CLoadingHandler(HWND hWnd, const std::string& resDir, const std::string& backupDir, Logger* logger) : m_hWnd(hWnd), m_backupDir(backupDir), m_loadingNotifier(hWnd), m_exp(resDir, backupDir, "", logger, NULL)
 		{
+			m_exp.setLoadingNotifier(&m_loadingNotifier);
 		}
 
 		~CLoadingHandler()
@@ -178,7 +185,9 @@ public:
 	static const UINT WM_TASKS_START = ExportNotifierImpl::WM_TASKS_START;
 	static const UINT WM_TASKS_COMPLETE = ExportNotifierImpl::WM_TASKS_COMPLETE;
 	static const UINT WM_TASKS_PROGRESS = ExportNotifierImpl::WM_TASKS_PROGRESS;
-	static const UINT WM_MSG_START = ExportNotifierImpl::WM_EN_END;
+	static const UINT WM_USERS_LOADED = LoadingNotifierImpl::WM_USERS_LOADED;
+	static const UINT WM_SESSIONS_LOADED = LoadingNotifierImpl::WM_SESSIONS_LOADED;
+	static const UINT WM_MSG_START = LoadingNotifierImpl::WM_LN_END;
 	static const UINT WM_UPD_VIEWSTATE = WM_MSG_START + 1;
 	static const UINT WM_LOADDATA = WM_MSG_START + 2;
 	static const UINT WM_CHKUPDATE = WM_MSG_START + 3;
@@ -230,6 +239,7 @@ public:
 		{
 			CW2A backupDir(CT2W(backupDir), CP_UTF8);
 			ManifestParser parser((LPCSTR)backupDir);
+			SetCacheFile(parser);
 			parser.parse(manifests);
 		}
 #ifndef NDEBUG
@@ -237,6 +247,7 @@ public:
 		{
 			CW2A backupDir(CT2W(lastBackupDir), CP_UTF8);
 			ManifestParser parser((LPCSTR)backupDir);
+			SetCacheFile(parser);
 			parser.parse(manifests);
 		}
 #endif
@@ -298,6 +309,8 @@ public:
 		MESSAGE_HANDLER(WM_TASKS_COMPLETE, OnTasksComplete)
 		MESSAGE_HANDLER(WM_TASKS_PROGRESS, OnTasksProgress)
 		MESSAGE_HANDLER(WM_UPD_VIEWSTATE, OnUpdateViewState)
+		MESSAGE_HANDLER(WM_USERS_LOADED, OnUsersLoaded)
+		MESSAGE_HANDLER(WM_SESSIONS_LOADED, OnSessionsLoaded)
 		MESSAGE_HANDLER(WM_LOADDATA, OnLoadData)
 		MESSAGE_HANDLER(WM_CHKUPDATE, OnCheckUpdate)
 		NOTIFY_HANDLER(IDC_SESSIONS, LVN_ITEMCHANGED, OnListItemChanged)
@@ -353,12 +366,59 @@ public:
 		return 0;
 	}
 
+	LRESULT OnUsersLoaded(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL& bHandled)
+	{
+		std::vector<Friend> *users = reinterpret_cast<std::vector<Friend> *>(lParam);
+		if (NULL != users)
+		{
+			CComboBox cbmBox = GetDlgItem(IDC_USERS);
+			cbmBox.ResetContent();
+			CListViewCtrl listViewCtrl = GetDlgItem(IDC_SESSIONS);
+			listViewCtrl.DeleteAllItems();
+
+			m_usersAndSessions.clear();
+			m_usersAndSessions.reserve(users->size());
+			for (std::vector<Friend>::const_iterator it = users->cbegin(); it != users->cend(); ++it)
+			{
+				m_usersAndSessions.push_back(std::pair<Friend, std::vector<Session>>(*it, std::vector<Session>()));
+			}
+			LoadUsers(CString());
+			delete users;
+		}
+
+		return 0;
+	}
+
+	LRESULT OnSessionsLoaded(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL& bHandled)
+	{
+		std::vector<Session> *sessions = reinterpret_cast<std::vector<Session> *>(lParam);
+		if (NULL != sessions)
+		{
+			size_t userIndex = static_cast<size_t>(wParam);
+			if (userIndex < m_usersAndSessions.size())
+			{
+				m_usersAndSessions[userIndex].second.swap(*sessions);
+				// Reload the list now, its items point to the sessions replaced
+				BOOL handled = TRUE;
+				OnUserSelChange(CBN_SELCHANGE, IDC_USERS, NULL, handled);
+			}
+			delete sessions;
+		}
+
+		return 0;
+	}
+
 	LRESULT OnLoadData(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL& bHandled)
 	{
 		CLoadingHandler *handler = reinterpret_cast<CLoadingHandler *>(lParam);
 		if (NULL != handler)
 		{
 			handler->waitForCompletion();
+			// The items of the sessions loaded so far point into m_usersAndSessions
+			CComboBox cbmBox = GetDlgItem(IDC_USERS);
+			cbmBox.ResetContent();
+			CListViewCtrl listViewCtrl = GetDlgItem(IDC_SESSIONS);
+			listViewCtrl.DeleteAllItems();
 			handler->getUsersAndSessions(m_usersAndSessions);
 
 			LoadUsers(handler->getVersions());
@@ -433,6 +493,7 @@ public:
 			CW2A backupDir(CT2W(folder.m_szFolderPath), CP_UTF8);
 
 			ManifestParser parser((LPCSTR)backupDir);
+			SetCacheFile(parser);
 			std::vector<BackupManifest> manifests;
 			if (parser.parse(manifests) && !manifests.empty())
 			{
@@ -753,6 +814,7 @@ public:
 		m_exporter->setLoadingDataOnScroll(loadingDataOnScroll);
 		m_exporter->supportsFilter(supportingFilter);
 		m_exporter->setIncrementalExporting(incrementalExp);
+		m_exporter->setCachingManifest(incrementalExp);
 		if (saveFilesInSessionFolder)
 		{
 			m_exporter->saveFilesInSessionFolder();
@@ -986,6 +1048,16 @@ protected:
 		}
 	}
 
+	void SetCacheFile(ManifestParser& parser)
+	{
+		CString cacheFile = AppConfiguration::GetBackupCacheFile();
+		if (!cacheFile.IsEmpty())
+		{
+			CW2A pszCacheFile(CT2W(cacheFile), CP_UTF8);
+			parser.setCacheFile((LPCSTR)pszCacheFile);
+		}
+	}
+
 	void UpdateBackups(const std::vector<BackupManifest>& manifests, BOOL onLaunch = FALSE)
 	{
 		if (manifests.empty())